@@ -9,6 +9,8 @@
 
 #include <aeos/types.h>
 #include <aeos/window.h>
+#include <aeos/arena.h>
+#include <aeos/task.h>
 
 /* File list entry */
 typedef struct {
@@ -21,17 +23,32 @@ typedef struct {
 typedef struct {
     window_t *window;
     char current_path[256];
-    file_entry_t entries[64];
+    arena_t *arena;                 /* Per-refresh memory */
+    file_entry_t *entries;          /* Loaded so far, in the arena */
     uint32_t entry_count;
+    uint32_t entry_capacity;
+    /* The listing is read as rows scroll into view, not all at once */
+    struct vfs_dirent *batch;       /* vfs_getdents() buffer, in the arena */
+    uint64_t dir_offset;            /* Directory offset of the next read */
+    bool dir_done;                  /* Every entry is loaded */
     int32_t selected_index;
     uint32_t scroll_offset;
     uint32_t visible_entries;
     /* File viewer state */
     bool viewing_file;
     char view_filename[64];
-    char view_content[2048];
+    const char *view_data;          /* The mapped file, or view_content */
+    char view_content[2048];        /* Copy of the start of unmappable files */
+    void *view_map;                 /* vfs_mmap() view, NULL if copied */
     uint32_t view_content_len;
     uint32_t view_scroll;
+
+    /* A file being opened for viewing, in a helper (vfs_read blocks) */
+    future_t load;
+    task_t load_task;
+    char load_path[256];
+    bool loading;
+    bool closing;                   /* Closed while loading: freed once it is over */
 } filemanager_t;
 
 /**
@@ -42,6 +59,7 @@ filemanager_t *filemanager_create(void);
 
 /**
  * Destroy file manager
+ * One that is still opening a file is freed once that is over.
  */
 void filemanager_destroy(filemanager_t *fm);
 
@@ -13,6 +13,7 @@
 /* Settings app state */
 typedef struct {
     window_t *window;
+    uint64_t last_refresh;      /* Uptime (ms) the frame stats were last redrawn */
 } settings_t;
 
 /**
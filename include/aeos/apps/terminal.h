@@ -9,6 +9,9 @@
 
 #include <aeos/types.h>
 #include <aeos/window.h>
+#include <aeos/process.h>
+#include <aeos/shell.h>
+#include <aeos/task.h>
 
 /* Terminal dimensions (in characters) */
 #define TERMINAL_COLS   80
@@ -16,6 +19,9 @@
 #define TERMINAL_CHAR_WIDTH  8
 #define TERMINAL_CHAR_HEIGHT 8
 
+/* Lines kept after they scroll off the top (terminal_set_scrollback) */
+#define TERMINAL_SCROLLBACK_LINES   500
+
 /* Terminal colors (ANSI-like) */
 #define TERM_COLOR_BLACK    0
 #define TERM_COLOR_RED      1
@@ -34,10 +40,27 @@ typedef struct {
     uint8_t attr;
 } terminal_cell_t;
 
+/* Scrollback cell: 2 bytes instead of 4 */
+typedef struct {
+    char ch;
+    uint8_t color;              /* fg << 4 | bg */
+} terminal_packed_cell_t;
+
 /* Terminal state */
 typedef struct {
     window_t *window;
+
+    /* Screen rows as a ring: screen row r is cells[(top + r) % TERMINAL_ROWS] */
     terminal_cell_t cells[TERMINAL_ROWS][TERMINAL_COLS];
+    uint32_t top;
+
+    /* Columns [dirty_x0, dirty_x1) of each screen row changed, not yet invalidated */
+    uint8_t dirty_x0[TERMINAL_ROWS];
+    uint8_t dirty_x1[TERMINAL_ROWS];
+    bool dirty_all;
+    uint32_t drawn_cursor_x;    /* Cursor cell as last invalidated */
+    uint32_t drawn_cursor_y;
+
     uint32_t cursor_x;
     uint32_t cursor_y;
     uint8_t current_fg;
@@ -51,8 +74,24 @@ typedef struct {
     uint32_t input_pos;
     bool input_ready;
 
-    /* Scroll buffer */
-    uint32_t scroll_offset;
+    /* Scrollback: a ring of scrollback_limit packed lines */
+    terminal_packed_cell_t *scrollback;
+    uint32_t scrollback_limit;
+    uint32_t scrollback_head;   /* Next line to write */
+    uint32_t scrollback_count;
+    uint32_t scroll_offset;     /* Lines scrolled back, 0 = live view */
+
+    /* Running command: a future runs the line, a task shows its output */
+    future_t cmd;
+    task_t task;
+    char cmd_line[SHELL_MAX_LINE];
+    int out_fd;                 /* Read end of the command's output pipe */
+    bool busy;
+    bool closing;               /* Closed while busy: freed when it is over */
+
+    /* Working directory of its commands */
+    struct vfs_inode *cwd;
+    char cwd_path[PROCESS_PATH_LEN];
 } terminal_t;
 
 /**
@@ -63,6 +102,7 @@ terminal_t *terminal_create(void);
 
 /**
  * Destroy terminal
+ * A terminal running a command is freed once the command is over.
  */
 void terminal_destroy(terminal_t *term);
 
@@ -86,6 +126,12 @@ void terminal_printf(terminal_t *term, const char *fmt, ...);
  */
 void terminal_clear(terminal_t *term);
 
+/**
+ * Set the scrollback line limit (0 disables it); clears the history
+ * @return 0 on success, -1 if out of memory (scrollback is disabled)
+ */
+int terminal_set_scrollback(terminal_t *term, uint32_t lines);
+
 /**
  * Set terminal colors
  */
@@ -98,6 +144,8 @@ void terminal_handle_key(terminal_t *term, key_event_t *key);
 
 /**
  * Execute shell command in terminal
+ * The command runs in a helper process; its output is shown as it comes,
+ * and the prompt returns when it is over (terminal_t.busy until then).
  */
 void terminal_execute_command(terminal_t *term, const char *cmd);
 
@@ -0,0 +1,88 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/arena.h
+ * Description: Arena allocator - bump allocation, freed all at once
+ * ============================================================================ */
+
+#ifndef AEOS_ARENA_H
+#define AEOS_ARENA_H
+
+#include <aeos/types.h>
+
+/*
+ * An arena hands out memory by bumping a pointer through blocks of pages
+ * from the PMM and frees it all in one go, for work that makes many
+ * short-lived allocations: one shell command, one file manager refresh.
+ * There is no per-allocation free and no header per allocation. An arena
+ * is not locked; each belongs to one process or one window.
+ */
+
+/* Alignment of every arena allocation */
+#define ARENA_ALIGN         16
+
+/* Opaque arena (lives at the start of its first block) */
+typedef struct arena arena_t;
+
+/* A position in an arena, for arena_release() */
+typedef struct {
+    void *chunk;                        /* Newest block at the time */
+    uint8_t *ptr;
+    size_t used;
+} arena_mark_t;
+
+/**
+ * Create an arena
+ *
+ * @param order Size of its blocks, 2^order pages (larger requests get a
+ *              block of their own)
+ * @return Arena, or NULL if out of memory
+ */
+arena_t *arena_create(uint32_t order);
+
+/**
+ * Destroy an arena, returning all its pages to the PMM
+ */
+void arena_destroy(arena_t *arena);
+
+/**
+ * Allocate from an arena - a pointer bump unless a new block is needed
+ *
+ * @param arena Arena (NULL fails)
+ * @param size Bytes wanted, rounded up to ARENA_ALIGN
+ * @return Pointer to uninitialized memory, or NULL if out of memory
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Allocate zeroed memory from an arena
+ */
+void *arena_calloc(arena_t *arena, size_t size);
+
+/**
+ * Free everything allocated from an arena
+ * Keeps its first block, so the next use doesn't go back to the PMM.
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * Current position of an arena
+ * A NULL arena gives a mark arena_release() ignores.
+ */
+arena_mark_t arena_mark(arena_t *arena);
+
+/**
+ * Free everything allocated from an arena since a mark
+ * Marks taken later than this one become invalid.
+ */
+void arena_release(arena_t *arena, arena_mark_t mark);
+
+/**
+ * Bytes allocated from an arena since it was created or last reset
+ */
+size_t arena_used(const arena_t *arena);
+
+#endif /* AEOS_ARENA_H */
+
+/* ============================================================================
+ * End of arena.h
+ * ============================================================================ */
@@ -0,0 +1,54 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/bench.h
+ * Description: Kernel microbenchmark suite
+ * ============================================================================ */
+
+#ifndef AEOS_BENCH_H
+#define AEOS_BENCH_H
+
+#include <aeos/types.h>
+
+/* Host file 'make bench' collects the results in */
+#define BENCH_RESULTS_FILE  "bench.txt"
+
+/**
+ * Called with each line of output (no trailing newline)
+ */
+typedef void (*bench_print_fn)(const char *line, void *ctx);
+
+/**
+ * Run benchmarks and report min/median/p99 time per operation
+ * Each benchmark times batches of operations with the generic timer; a
+ * benchmark whose subsystem is missing (no framebuffer, no desktop) is
+ * reported as skipped.
+ *
+ * @param name Benchmark to run, or NULL for all of them
+ * @param out Called once per output line
+ * @param ctx Passed to out
+ * @return Benchmarks that failed to run, or -1 if none is called name
+ */
+int bench_run(const char *name, bench_print_fn out, void *ctx);
+
+/**
+ * List the benchmarks and what each measures
+ *
+ * @param out Called once per output line
+ * @param ctx Passed to out
+ */
+void bench_list(bench_print_fn out, void *ctx);
+
+/**
+ * Run every benchmark, copying the report to a host file (semihosting)
+ * Used by the 'bench' boot option.
+ *
+ * @param path Host file name
+ * @return Benchmarks that failed to run, or -1 if the file can't be written
+ */
+int bench_run_to_host(const char *path);
+
+#endif /* AEOS_BENCH_H */
+
+/* ============================================================================
+ * End of bench.h
+ * ============================================================================ */
@@ -0,0 +1,158 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/blkdev.h
+ * Description: Block devices and the write-back block cache
+ * ============================================================================ */
+
+#ifndef AEOS_BLKDEV_H
+#define AEOS_BLKDEV_H
+
+#include <aeos/types.h>
+
+/* Block size: one page, the unit of caching and of device I/O */
+#define BLK_SHIFT       12
+#define BLK_SIZE        (1U << BLK_SHIFT)
+
+/* Registered devices */
+#define BLKDEV_MAX      8
+
+/* Cache size in blocks (one PMM page each, allocated on first use) */
+#define BCACHE_BLOCKS   512
+
+/* The flusher writes dirty blocks back this often */
+#define BCACHE_FLUSH_MS 1000
+
+/* Most adjacent dirty blocks written back in one device request */
+#define BCACHE_RUN_MAX  64
+
+struct blkdev;
+struct bio;
+
+/*
+ * Device operations: whole blocks, 0 on success or -1. read and write are
+ * synchronous. A device that can keep requests in flight also provides
+ * submit, which starts a bio and returns; the driver calls bio_complete()
+ * when it finishes. poll reaps finished requests without waiting for an
+ * interrupt, so callers can wait before interrupts are enabled.
+ */
+typedef struct blkdev_ops {
+    int (*read)(struct blkdev *dev, uint64_t block, uint32_t count, void *buf);
+    int (*write)(struct blkdev *dev, uint64_t block, uint32_t count, const void *buf);
+    int (*submit)(struct blkdev *dev, struct bio *bio);     /* Optional */
+    void (*poll)(struct blkdev *dev);                       /* Optional */
+} blkdev_ops_t;
+
+/* A block device */
+typedef struct blkdev {
+    char name[16];
+    uint64_t num_blocks;
+    const blkdev_ops_t *ops;
+    void *priv;             /* Driver state */
+    uint32_t index;         /* Set by blkdev_register */
+} blkdev_t;
+
+/* Called when a bio finishes; may run in interrupt context */
+typedef void (*bio_end_t)(struct bio *bio);
+
+/* An asynchronous block request */
+typedef struct bio {
+    blkdev_t *dev;
+    uint64_t block;         /* First block */
+    uint32_t count;         /* Blocks */
+    void *buf;              /* count * BLK_SIZE bytes, stays valid until done */
+    bool write;
+    bio_end_t end_io;       /* Optional; then it owns the bio, not blk_wait */
+    void *private;          /* For end_io */
+    int status;             /* 0 or -1, valid once done */
+    volatile bool done;
+    struct bio *next;       /* Driver use while in flight */
+} bio_t;
+
+/* Block cache statistics */
+typedef struct bcache_stats {
+    uint32_t cached;        /* Blocks holding data */
+    uint32_t dirty;         /* Blocks waiting for writeback */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t runs;          /* Writeback requests issued */
+    uint64_t written;       /* Blocks written back */
+    uint64_t errors;        /* Failed device requests */
+    uint64_t reclaimed;     /* Pages given back under memory pressure */
+} bcache_stats_t;
+
+/**
+ * Register a block device
+ * @return 0 on success, -1 if the table is full
+ */
+int blkdev_register(blkdev_t *dev);
+
+/**
+ * Find a registered block device by name
+ * @return Device, NULL if there is none
+ */
+blkdev_t *blkdev_find(const char *name);
+
+/**
+ * Get a registered block device by index
+ * @return Device, NULL past the last one
+ */
+blkdev_t *blkdev_get(uint32_t index);
+
+/**
+ * Start a block request
+ * On devices without a submit operation the request runs synchronously and
+ * has completed when this returns. The bio must not be touched until it is
+ * done.
+ * @return 0 if the request was started, -1 if it was rejected
+ */
+int blk_submit(bio_t *bio);
+
+/**
+ * Wait for a submitted bio without end_io to finish
+ * @return The bio's status
+ */
+int blk_wait(bio_t *bio);
+
+/**
+ * Finish a bio: for drivers
+ * Sets status and done, then runs end_io, which may free or reuse the bio.
+ */
+void bio_complete(bio_t *bio, int status);
+
+/**
+ * Start the background flusher
+ * Before this, dirty blocks only go out on bcache_sync() or when the
+ * cache needs room.
+ */
+void bcache_init(void);
+
+/**
+ * Read bytes from a device through the cache
+ * @return 0 on success, -1 on error
+ */
+int bcache_read(blkdev_t *dev, uint64_t offset, void *buf, size_t len);
+
+/**
+ * Write bytes to a device through the cache
+ * The data reaches the device later; see bcache_sync().
+ * @return 0 on success, -1 on error
+ */
+int bcache_write(blkdev_t *dev, uint64_t offset, const void *buf, size_t len);
+
+/**
+ * Write back every dirty block of a device (NULL for all devices)
+ * Returns once they are on the device.
+ * @return Blocks written, -1 if a device request failed
+ */
+int bcache_sync(blkdev_t *dev);
+
+/**
+ * Get block cache statistics
+ */
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif /* AEOS_BLKDEV_H */
+
+/* ============================================================================
+ * End of blkdev.h
+ * ============================================================================ */
@@ -0,0 +1,68 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/boottime.h
+ * Description: Boot timeline and deferred boot work
+ * ============================================================================ */
+
+#ifndef AEOS_BOOTTIME_H
+#define AEOS_BOOTTIME_H
+
+#include <aeos/types.h>
+
+/*
+ * Each init stage records the virtual counter (CNTVCT) as it finishes, so
+ * the 'boottime' shell command can show where time-to-shell goes. The
+ * counter runs from the moment QEMU starts the CPU, so the first mark also
+ * shows how long firmware and the boot code took.
+ *
+ * A fast boot (boot option 'fastboot') hands the init the shell prompt does
+ * not need to a background process. Commands wait for it to finish first.
+ */
+
+/* Stages the timeline holds; later marks are dropped */
+#define BOOTTIME_MAX_STAGES 32
+
+/**
+ * Record the end of an init stage
+ * Safe from any CPU once the MMU is on (it takes a spinlock), before the
+ * timer is initialized too.
+ *
+ * @param stage Stage name (not copied, must be static)
+ */
+void boottime_mark(const char *stage);
+
+/**
+ * Record a stage that ended earlier, at a counter value read then
+ * For stages before the MMU is on, where boottime_mark() can't run.
+ *
+ * @param stage Stage name (not copied, must be static)
+ * @param counter timer_get_counter() at the end of the stage
+ */
+void boottime_mark_at(const char *stage, uint64_t counter);
+
+/**
+ * Print the boot timeline (boottime shell command)
+ */
+void boottime_print(void);
+
+/**
+ * Note that boot work has been handed to a background process
+ */
+void boottime_defer_begin(void);
+
+/**
+ * Note that the background boot work has finished
+ */
+void boottime_defer_end(void);
+
+/**
+ * Wait until the background boot work has finished
+ * Returns at once unless boottime_defer_begin() was called.
+ */
+void boottime_wait(void);
+
+#endif /* AEOS_BOOTTIME_H */
+
+/* ============================================================================
+ * End of boottime.h
+ * ============================================================================ */
@@ -22,6 +22,17 @@
 #define TASKBAR_BUTTON_WIDTH 120
 #define START_BUTTON_WIDTH 60
 
+/*
+ * Changing parts of the taskbar, each damaged on its own: the window
+ * buttons (the strip right of the start button), the clock and the HUD
+ */
+#define TASKBAR_BUTTONS_X   (START_BUTTON_WIDTH + 12)
+#define TASKBAR_CLOCK_X     (fb_width() - 50)
+#define TASKBAR_CLOCK_WIDTH 40
+#define TASKBAR_HUD_CHARS   28
+#define TASKBAR_HUD_X       (fb_width() - 58 - TASKBAR_HUD_CHARS * 8)
+#define TASKBAR_HUD_WIDTH   (TASKBAR_HUD_CHARS * 8)
+
 /* Maximum desktop icons */
 #define MAX_DESKTOP_ICONS 16
 
@@ -57,10 +68,19 @@ void desktop_draw_taskbar(void);
 
 /**
  * Full desktop paint (background + icons + taskbar)
- * This is the callback for window manager
+ * This is the callback for window manager. The unchanging parts are
+ * blitted from a cached layer; only the taskbar's buttons, clock and HUD
+ * and the start menu are drawn each time.
  */
 void desktop_paint(void);
 
+/**
+ * Throw away the cached desktop layer
+ * Call when anything it holds changes: icons, colors or the resolution.
+ * It is rendered again on the next paint.
+ */
+void desktop_invalidate(void);
+
 /**
  * Handle desktop click (for icons)
  * @param x Screen X coordinate
@@ -108,4 +128,14 @@ void desktop_toggle_start_menu(void);
  */
 bool desktop_start_menu_visible(void);
 
+/**
+ * Show/hide the performance HUD in the taskbar (F12)
+ */
+void desktop_toggle_hud(void);
+
+/**
+ * Is the performance HUD visible?
+ */
+bool desktop_hud_visible(void);
+
 #endif /* AEOS_DESKTOP_H */
@@ -0,0 +1,112 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/dma.h
+ * Description: Memory shared with DMA devices
+ * ============================================================================ */
+
+#ifndef AEOS_DMA_H
+#define AEOS_DMA_H
+
+#include <aeos/types.h>
+#include <aeos/mm.h>
+
+/*
+ * Devices either snoop the CPU caches or read and write RAM behind them.
+ * dma_init() finds out which from the device tree: QEMU marks its
+ * virtio-mmio transports "dma-coherent". There are two kinds of memory:
+ *
+ * - Coherent memory from dma_alloc_coherent(), for rings and small
+ *   structures both sides poll. With coherent devices it is plain cached
+ *   RAM. Otherwise its pages are mapped again, Normal non-cacheable, in
+ *   the MMU's mapping window, so no access to it ever needs maintenance.
+ *   The CPU uses the returned pointer, devices the physical address.
+ *
+ * - Any other buffer, in cached RAM at its identity address. Clean it to
+ *   RAM with dma_sync_for_device() before a device reads or writes it,
+ *   and drop stale lines with dma_sync_for_cpu() once a device has
+ *   written it. Both return at once when devices are coherent. Bulk
+ *   buffers like the framebuffer stay cached and only sync the rows a
+ *   transfer covers (dma_sync_2d_for_device()).
+ *
+ * Virtqueues sync the buffers of every chain themselves. Memory a device
+ * reaches outside a virtqueue, such as a GPU resource's backing store, is
+ * its driver's to sync.
+ */
+
+/* Largest coherent allocation when it must be remapped: 2^order pages */
+#define DMA_COHERENT_MAX_ORDER  4
+
+/* DMA statistics */
+typedef struct {
+    bool coherent;              /* Devices snoop the caches */
+    uint32_t line_size;         /* Smallest D-cache line (CTR_EL0) */
+    size_t coherent_allocs;     /* Live dma_alloc_coherent() buffers */
+    size_t coherent_bytes;
+    uint64_t syncs;             /* Sync calls that did maintenance */
+    uint64_t lines;             /* Cache lines cleaned or invalidated */
+} dma_stats_t;
+
+/**
+ * Decide how DMA memory is handled
+ * Call after the MMU is on and the device tree is parsed, before any
+ * driver allocates DMA memory.
+ *
+ * @param noncoherent Do cache maintenance even if the device tree says
+ *                    devices are coherent (the "dma-noncoherent" option)
+ */
+void dma_init(bool noncoherent);
+
+/**
+ * Check whether devices snoop the CPU caches
+ */
+bool dma_coherent(void);
+
+/**
+ * Allocate zeroed memory that needs no cache maintenance
+ * @param size Bytes, rounded up to whole pages
+ * @param dma_addr Receives the address for the device
+ * @return CPU address, or NULL on failure
+ */
+void *dma_alloc_coherent(size_t size, uint64_t *dma_addr);
+
+/**
+ * Free memory from dma_alloc_coherent()
+ * @param cpu_addr Address it returned
+ * @param dma_addr Device address it gave
+ * @param size Size passed to it
+ */
+void dma_free_coherent(void *cpu_addr, uint64_t dma_addr, size_t size);
+
+/**
+ * Make a cached buffer's contents visible to devices (clean to RAM)
+ * Also needed before a device writes it, so no dirty line is written
+ * back over what the device wrote.
+ */
+void dma_sync_for_device(const void *addr, size_t size);
+
+/**
+ * Make what a device wrote to a cached buffer visible to the CPU
+ */
+void dma_sync_for_cpu(const void *addr, size_t size);
+
+/**
+ * Clean a rectangle of a cached 2D buffer for a device
+ * @param base First byte of the rectangle
+ * @param pitch Bytes from one row to the next
+ * @param width Bytes per row of the rectangle
+ * @param rows Number of rows
+ */
+void dma_sync_2d_for_device(const void *base, size_t pitch, size_t width,
+                            uint32_t rows);
+
+/**
+ * Get DMA statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void dma_get_stats(dma_stats_t *stats);
+
+#endif /* AEOS_DMA_H */
+
+/* ============================================================================
+ * End of dma.h
+ * ============================================================================ */
@@ -33,6 +33,12 @@ typedef struct {
     uint32_t size_dt_struct;     /* Size of structure block */
 } __attribute__((packed)) dtb_header_t;
 
+/* A physical address range */
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} dtb_region_t;
+
 /**
  * Initialize DTB parser
  * @param dtb_addr Address of device tree blob
@@ -40,6 +46,29 @@ typedef struct {
  */
 int dtb_init(void *dtb_addr);
 
+/**
+ * Find the RAM in device tree
+ * Reads the reg ranges of the top-level memory nodes (device_type
+ * "memory"), decoded with the root's #address-cells and #size-cells.
+ *
+ * @param regions Output array
+ * @param max Capacity of regions
+ * @return Number of ranges written, 0 if there is no DTB or no memory node
+ */
+uint32_t dtb_get_memory(dtb_region_t *regions, uint32_t max);
+
+/**
+ * Find the memory the device tree keeps from the OS
+ * The blob itself, the /memreserve/ entries of its header, and the reg
+ * ranges of the /reserved-memory children. Children with only a size
+ * (for the OS to place itself) need nothing here and are skipped.
+ *
+ * @param regions Output array
+ * @param max Capacity of regions
+ * @return Number of ranges written
+ */
+uint32_t dtb_get_reserved(dtb_region_t *regions, uint32_t max);
+
 /**
  * Find framebuffer address in device tree
  * @param fb_addr Output: framebuffer base address
@@ -48,6 +77,39 @@ int dtb_init(void *dtb_addr);
  */
 int dtb_find_framebuffer(uint64_t *fb_addr, uint64_t *fb_size);
 
+/* PSCI conduits */
+#define DTB_PSCI_HVC    0
+#define DTB_PSCI_SMC    1
+
+/**
+ * Find the PSCI calling convention in device tree
+ * @return DTB_PSCI_HVC or DTB_PSCI_SMC, -1 if no psci node was found
+ */
+int dtb_get_psci_method(void);
+
+/**
+ * Find the kernel command line in device tree
+ * QEMU's -append sets it.
+ * @return The /chosen/bootargs string (inside the blob), NULL if absent
+ */
+const char *dtb_get_bootargs(void);
+
+/**
+ * Find the initrd in device tree
+ * Reads /chosen linux,initrd-start and linux,initrd-end.
+ * @param start Output: physical address of the first byte
+ * @param end Output: physical address past the last byte
+ * @return 0 on success, -1 if no initrd was passed
+ */
+int dtb_get_initrd(uint64_t *start, uint64_t *end);
+
+/**
+ * Check whether the virtio-mmio transports snoop the CPU caches
+ * Looks for "dma-coherent" in the virtio_mmio nodes.
+ * @return 1 if they are coherent, 0 if not, -1 if there are no such nodes
+ */
+int dtb_virtio_dma_coherent(void);
+
 #endif /* AEOS_DTB_H */
 
 /* ============================================================================
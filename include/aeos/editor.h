@@ -8,6 +8,7 @@
 #define AEOS_EDITOR_H
 
 #include <aeos/types.h>
+#include <aeos/piece_table.h>
 
 /* Terminal dimensions */
 #define EDITOR_TERM_ROWS    24
@@ -17,9 +18,9 @@
 #define EDITOR_MAX_FILENAME 256
 #define EDITOR_MAX_LINES    1024
 #define EDITOR_MAX_LINE_LEN 256
-#define EDITOR_MAX_YANK     4096
 #define EDITOR_MAX_SEARCH   64
 #define EDITOR_MAX_EX_CMD   64
+#define EDITOR_MAX_UNDO     1024        /* Journal entries kept */
 
 /* Special key codes (returned by editor_read_key) */
 #define KEY_ESCAPE      27
@@ -47,7 +48,7 @@ typedef enum {
     MODE_EX             /* Ex mode - command line (:w, :q, etc.) */
 } editor_mode_t;
 
-/* Line structure - each line is a dynamically allocated string */
+/* Line view - one line copied out of the text */
 typedef struct {
     char *chars;        /* Line content */
     size_t len;         /* Current length (excluding null terminator) */
@@ -62,6 +63,17 @@ typedef struct {
     int end_col;        /* Ending column */
 } editor_selection_t;
 
+/* Undo journal entry: one insert or delete of a range */
+typedef struct editor_undo {
+    struct editor_undo *prev;
+    struct editor_undo *next;
+    pt_node_t *pieces;  /* Text while out of the document, else NULL */
+    uint32_t pos;       /* Offset of the range */
+    uint32_t len;
+    uint32_t group;     /* Entries of one command share a group */
+    bool insert;        /* Made by an insert (can grow while typing) */
+} editor_undo_t;
+
 /* Editor state */
 typedef struct {
     /* File info */
@@ -69,10 +81,13 @@ typedef struct {
     bool modified;
     bool new_file;
 
-    /* Buffer - array of lines */
-    editor_line_t *lines;
+    /* Buffer - piece table, lines are the runs between newlines */
+    piece_table_t text;
     int num_lines;
-    int lines_capacity;
+
+    /* Line being displayed or searched */
+    editor_line_t line;
+    int line_row;       /* Row held in line, -1 if none */
 
     /* Cursor position */
     int cursor_row;     /* 0-based row in file */
@@ -88,9 +103,8 @@ typedef struct {
     /* Visual mode selection */
     editor_selection_t selection;
 
-    /* Yank buffer (clipboard) */
-    char yank_buffer[EDITOR_MAX_YANK];
-    size_t yank_len;
+    /* Yank register - runs of the text, shared with the document */
+    pt_span_list_t yank;
     bool yank_is_line;  /* True if yanked whole lines */
 
     /* Search */
@@ -99,6 +113,16 @@ typedef struct {
     int search_col;     /* Last search match col */
     bool search_active;
 
+    /* Undo journal - oldest first, undo_top is the last applied entry */
+    editor_undo_t *undo_head;
+    editor_undo_t *undo_top;
+    editor_undo_t *undo_spare;      /* Reserved for the next change */
+    editor_undo_t *undo_saved;      /* undo_top when last saved */
+    bool undo_saved_valid;          /* False once that state is gone */
+    uint32_t undo_group;
+    bool undo_group_open;
+    int undo_count;
+
     /* Ex command line */
     char ex_command[EDITOR_MAX_EX_CMD];
     int ex_len;
@@ -0,0 +1,83 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/elf.h
+ * Description: ELF64 executable loader interface
+ * ============================================================================ */
+
+#ifndef AEOS_ELF_H
+#define AEOS_ELF_H
+
+#include <aeos/types.h>
+#include <aeos/mmu.h>
+
+/* e_ident */
+#define ELF_MAGIC           0x464C457FU     /* "\x7FELF", little-endian */
+#define ELF_CLASS_64        2
+#define ELF_DATA_LSB        1
+
+/* e_type and e_machine */
+#define ELF_TYPE_EXEC       2
+#define ELF_MACHINE_AARCH64 183
+
+/* Program header types and flags */
+#define ELF_PT_LOAD         1
+#define ELF_PF_X            (1U << 0)
+#define ELF_PF_W            (1U << 1)
+#define ELF_PF_R            (1U << 2)
+
+/* Most program headers accepted */
+#define ELF_MAX_PHDRS       16
+
+/* File header */
+typedef struct {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t osabi;
+    uint8_t pad[8];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t elf_version;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf64_ehdr_t;
+
+/* Program header */
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+} elf64_phdr_t;
+
+/**
+ * Load a static AArch64 executable into a user address space
+ * Each PT_LOAD segment gets fresh pages with the segment's permissions;
+ * bytes past the file contents are zero. Segments may not share pages.
+ *
+ * @param space Address space to map into
+ * @param path Path of the executable
+ * @param limit Segments must lie below this address
+ * @param entry Receives the entry point
+ * @return 0 on success, -1 on error (pages already mapped stay in space)
+ */
+int elf_load(mmu_space_t *space, const char *path, uint64_t limit, uint64_t *entry);
+
+#endif /* AEOS_ELF_H */
+
+/* ============================================================================
+ * End of elf.h
+ * ============================================================================ */
@@ -9,8 +9,7 @@
 
 #include <aeos/types.h>
 
-/* Event queue size (must be large enough to avoid dropping button events
-   during rapid mouse movement — each mouse move generates 1-2 events) */
+/* Event queue size, a power of two (consecutive mouse moves share a slot) */
 #define EVENT_QUEUE_SIZE 256
 
 /* Event types */
@@ -157,6 +156,7 @@ void event_init(void);
 
 /**
  * Push an event to the queue
+ * Safe from interrupt handlers and any CPU.
  * @param event Event to push
  * @return true if successful, false if queue full
  */
@@ -164,11 +164,29 @@ bool event_push(const event_t *event);
 
 /**
  * Pop an event from the queue
+ * The queue has a single consumer, the window manager; the pop, peek,
+ * empty and clear calls are for it alone.
  * @param event Pointer to store event
  * @return true if event available, false if queue empty
  */
 bool event_pop(event_t *event);
 
+/**
+ * Pop up to n events from the queue
+ * @param out Array for the events
+ * @param n Its size
+ * @return Number of events popped
+ */
+uint32_t event_pop_many(event_t *out, uint32_t n);
+
+/**
+ * Set the function called after each event is queued
+ * It runs in the producer's context, often an input interrupt, and is how
+ * the consumer learns there is work without polling.
+ */
+typedef void (*event_notify_fn)(void);
+void event_set_notify(event_notify_fn fn);
+
 /**
  * Peek at the next event without removing it
  * @param event Pointer to store event
@@ -0,0 +1,54 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/format.h
+ * Description: printf-style formatting engine
+ * ============================================================================ */
+
+#ifndef AEOS_FORMAT_H
+#define AEOS_FORMAT_H
+
+#include <aeos/types.h>
+#include <aeos/stdarg.h>
+
+/*
+ * kprintf(), klog() and snprintf() all format through fmt_vformat(). It
+ * writes into a caller's buffer, so text goes out in chunks rather than
+ * one call per character: kprintf hands each full buffer (usually once
+ * per call) to the log ring and the console, snprintf just stops storing.
+ *
+ * Conversions: %d %i %u %x %X %p %s %c %%
+ * Flags: '-' (left align), '0' (zero pad numbers)
+ * Width: digits or '*'; precision ('.' digits or '.*') limits %s
+ * Length: l, ll, z, j, t (64-bit); h (short), hh (char) truncate
+ * %p is "0x" and 16 hex digits. Decimal conversion makes two digits per
+ * division from a table.
+ */
+
+/* Output buffer of one formatting call */
+typedef struct fmt_out {
+    char *buf;
+    size_t size;                        /* Bytes buf holds */
+    size_t len;                         /* Bytes in buf */
+    size_t total;                       /* Bytes produced, flushed or dropped ones too */
+
+    /* Called when buf is full: empties it (and may move buf). NULL drops
+     * whatever does not fit. */
+    void (*flush)(struct fmt_out *out);
+} fmt_out_t;
+
+/**
+ * Format into an output buffer
+ * @return Characters this call produced
+ */
+int fmt_vformat(fmt_out_t *out, const char *fmt, va_list args);
+
+/**
+ * Append bytes to an output buffer unformatted
+ */
+void fmt_write(fmt_out_t *out, const char *s, size_t len);
+
+#endif /* AEOS_FORMAT_H */
+
+/* ============================================================================
+ * End of format.h
+ * ============================================================================ */
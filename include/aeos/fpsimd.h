@@ -0,0 +1,83 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/fpsimd.h
+ * Description: FP/SIMD register state of user processes
+ * ============================================================================ */
+
+#ifndef AEOS_FPSIMD_H
+#define AEOS_FPSIMD_H
+
+#include <aeos/types.h>
+
+struct process;
+
+/* fpsimd_cpu of a process whose state was never loaded */
+#define FPSIMD_NO_CPU   0xFFFFFFFFU
+
+/**
+ * Saved FP/SIMD registers
+ * Kernel C never uses them (-mgeneral-regs-only), so only EL0 has any.
+ */
+typedef struct {
+    uint64_t vregs[64];         /* q0-q31, low doubleword first */
+    uint32_t fpsr;
+    uint32_t fpcr;
+} fpsimd_state_t;
+
+/**
+ * Save the FP/SIMD registers (context.asm)
+ */
+void fpsimd_save_regs(fpsimd_state_t *state);
+
+/**
+ * Load the FP/SIMD registers (context.asm)
+ */
+void fpsimd_load_regs(const fpsimd_state_t *state);
+
+/**
+ * Save a process's registers as it is switched out (IRQs masked)
+ * Only if they are live on this CPU; nothing for kernel processes.
+ *
+ * @param from Process being switched out
+ */
+void fpsimd_switch(struct process *from);
+
+/**
+ * Bring the current process's registers back before it returns to EL0
+ * Called on every EL0 return with IRQs masked (vectors.asm). The load is
+ * skipped when this CPU's registers still hold the process's state.
+ */
+void fpsimd_user_return(void);
+
+/**
+ * Write the current process's live registers back to its PCB
+ * For process_clone(), which copies them to the child.
+ */
+void fpsimd_flush_current(void);
+
+/**
+ * Check whether kernel code may use NEON here
+ * Not in interrupt handlers or tasklets (IRQs masked or in_softirq()),
+ * which may have interrupted a NEON section, and not while preemption
+ * is already disabled.
+ */
+bool kernel_neon_usable(void);
+
+/**
+ * Take the FP/SIMD registers for kernel NEON code
+ * Saves the current process's live state and disables preemption until
+ * kernel_neon_end(). The caller checks kernel_neon_usable() first.
+ */
+void kernel_neon_begin(void);
+
+/**
+ * Give the FP/SIMD registers back
+ * The user state is loaded again on the way back to EL0.
+ */
+void kernel_neon_end(void);
+
+#endif /* AEOS_FPSIMD_H */
+
+/* ============================================================================
+ * End of fpsimd.h
+ * ============================================================================ */
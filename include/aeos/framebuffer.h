@@ -9,10 +9,17 @@
 
 #include <aeos/types.h>
 
-/* Framebuffer configuration */
-#define FB_WIDTH        640
-#define FB_HEIGHT       480
-#define FB_BPP          32  /* Bits per pixel (RGBA8888) */
+/*
+ * Framebuffer configuration
+ * The resolution is a runtime property: the display driver reports the
+ * display's mode and sets it with fb_set_mode(), which can also resize a
+ * running framebuffer. Until then the default mode is used.
+ */
+#define FB_DEFAULT_WIDTH    640
+#define FB_DEFAULT_HEIGHT   480
+#define FB_MIN_WIDTH        640     /* Smallest mode the desktop is laid out for */
+#define FB_MIN_HEIGHT       480
+#define FB_BPP              32      /* Bits per pixel (RGBA8888) */
 
 /* Color definitions (RGBA8888 format) */
 #define COLOR_BLACK     0xFF000000
@@ -26,9 +33,19 @@
 #define COLOR_GRAY      0xFF808080
 #define COLOR_DARK_GRAY 0xFF404040
 
+/* Rectangle in screen coordinates */
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+} rect_t;
+
 /* Framebuffer info structure */
 typedef struct {
-    uint32_t *base;         /* Base address of framebuffer */
+    uint32_t *base;         /* Base address of framebuffer (the back buffer) */
+    uint32_t *buffers[2];   /* Both buffers (buffers[1] NULL if single-buffered) */
+    uint32_t back;          /* Index of the buffer base points to */
     uint32_t width;         /* Width in pixels */
     uint32_t height;        /* Height in pixels */
     uint32_t pitch;         /* Bytes per scanline */
@@ -48,10 +65,218 @@ int fb_init(void);
 fb_info_t *fb_get_info(void);
 
 /**
- * Clear screen to color
+ * Screen size in pixels (signed, like screen coordinates)
+ */
+int32_t fb_width(void);
+int32_t fb_height(void);
+
+/**
+ * Fit a display's mode to what the framebuffer can hold
+ * A buffer must fit one huge buffer, so a mode too large for that becomes
+ * the largest common mode that fits the display; one smaller than
+ * FB_MIN_WIDTH x FB_MIN_HEIGHT becomes the minimum.
+ *
+ * @param width In: the display's width; out: the mode to use
+ * @param height In: the display's height; out: the mode to use
+ */
+void fb_fit_mode(uint32_t *width, uint32_t *height);
+
+/**
+ * Set the resolution
+ * Before fb_init() this only records the mode. Afterwards the buffers are
+ * reallocated (as many as there were) and cleared; the display driver must
+ * have stopped reading the old ones. On failure the old mode stays.
+ *
+ * @return 0 on success, -1 if the mode is too large or memory ran out
+ */
+int fb_set_mode(uint32_t width, uint32_t height);
+
+/**
+ * Present handler: put a buffer on screen
+ * @param buffer Index into fb_info_t.buffers
+ * @param rects Areas changed since the last present
+ * @param n Number of rects
+ * @return 0 on success, -1 on error
+ */
+typedef int (*fb_present_fn)(uint32_t buffer, const rect_t *rects, uint32_t n);
+
+/**
+ * Allocate a second buffer so drawing never touches the buffer on screen
+ * The current contents are copied into it.
+ * @return 0 on success, -1 on error (stays single-buffered)
+ */
+int fb_enable_double_buffer(void);
+
+/**
+ * Set the display driver's present handler (NULL to remove)
+ */
+void fb_set_present_handler(fb_present_fn fn);
+
+/**
+ * Cursor handlers: a display driver's hardware cursor plane
+ * The define handler uploads an ARGB8888 image (alpha 0 transparent) with
+ * its hotspot; the move handler positions or hides it.
+ */
+typedef int (*fb_cursor_define_fn)(const uint32_t *image, uint32_t width, uint32_t height,
+                                   uint32_t hot_x, uint32_t hot_y);
+typedef int (*fb_cursor_move_fn)(int32_t x, int32_t y, bool visible);
+
+/**
+ * Set the display driver's cursor handlers (NULL to remove)
+ */
+void fb_set_cursor_handlers(fb_cursor_define_fn define, fb_cursor_move_fn move);
+
+/**
+ * Put an image on the hardware cursor plane
+ * @return 0 on success, -1 if there is no hardware cursor
+ */
+int fb_cursor_define(const uint32_t *image, uint32_t width, uint32_t height,
+                     uint32_t hot_x, uint32_t hot_y);
+
+/**
+ * Move (or hide) the hardware cursor; touches no framebuffer pixels
+ * @return 0 on success, -1 if there is no hardware cursor
+ */
+int fb_cursor_move(int32_t x, int32_t y, bool visible);
+
+/**
+ * Show the back buffer and start drawing into the other one
+ * The present handler shows the back buffer. The buffers then trade places
+ * and the changed rects are copied across, so the new back buffer starts out
+ * identical to the screen. Single-buffered, only the present is done.
+ *
+ * @param rects Areas drawn since the last swap
+ * @param n Number of rects
+ * @return 0 on success, -1 on error (buffers not swapped)
+ */
+int fb_swap_buffers(const rect_t *rects, uint32_t n);
+
+/**
+ * Clear screen to color (only the clip rectangle while one is set)
  */
 void fb_clear(uint32_t color);
 
+/**
+ * Restrict all drawing functions to a rectangle
+ * Used by the compositor to repaint only damaged areas.
+ *
+ * @param clip Rectangle to draw into, or NULL for the whole screen
+ */
+void fb_set_clip(const rect_t *clip);
+
+/**
+ * Get the current clip rectangle (to restore it after drawing elsewhere)
+ */
+void fb_get_clip(rect_t *clip);
+
+/**
+ * Redirect all drawing functions into an off-screen buffer
+ * Drawing keeps using screen coordinates: (x, y) is where the buffer's first
+ * pixel sits on screen, and pixels outside the buffer are clipped. Used to
+ * render windows into their backbuffers. The clip is reset to the buffer.
+ *
+ * @param pixels width x height buffer, or NULL to draw to the screen again
+ */
+void fb_set_target(uint32_t *pixels, int32_t x, int32_t y,
+                   uint32_t width, uint32_t height);
+
+/**
+ * Copy a width x height block of pixels to (x, y), one memcpy per row
+ * Honours the clip rectangle.
+ *
+ * @param pitch Source pixels per row (>= width)
+ */
+void fb_blit(int32_t x, int32_t y, const uint32_t *src,
+             uint32_t width, uint32_t height, uint32_t pitch);
+
+/**
+ * Like fb_blit(), but source pixels with zero alpha are left out
+ * Used for sprites such as the mouse cursor.
+ */
+void fb_blit_masked(int32_t x, int32_t y, const uint32_t *src,
+                    uint32_t width, uint32_t height, uint32_t pitch);
+
+/**
+ * Premultiply a straight-alpha ARGB colour (for fb_blit_alpha() images)
+ */
+uint32_t fb_premultiply(uint32_t argb);
+
+/**
+ * Blend a translucent colour over a rectangle (source over)
+ * Honours the clip rectangle. Blending reads the target, so it costs only
+ * what the compositor repaints when drawn inside a damage rect.
+ *
+ * @param color Straight-alpha ARGB; alpha 0xFF is a plain fill
+ */
+void fb_blend_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color);
+
+/**
+ * Like fb_blit(), but blends premultiplied-alpha source pixels over the target
+ * Used for the cursor sprite and other images with soft edges.
+ */
+void fb_blit_alpha(int32_t x, int32_t y, const uint32_t *src,
+                   uint32_t width, uint32_t height, uint32_t pitch);
+
+/**
+ * Get alpha blending statistics: pixels blended and spans since boot
+ */
+void fb_get_blend_stats(uint64_t *pixels, uint64_t *spans);
+
+/**
+ * Intersect two rectangles
+ *
+ * @param out Intersection (may alias a or b)
+ * @return true if the intersection is non-empty
+ */
+bool rect_intersect(const rect_t *a, const rect_t *b, rect_t *out);
+
+/**
+ * Smallest rectangle containing both a and b
+ *
+ * @param out Bounding box (may alias a or b)
+ */
+void rect_union(const rect_t *a, const rect_t *b, rect_t *out);
+
+/**
+ * Check whether rectangle a fully contains b
+ */
+bool rect_contains(const rect_t *a, const rect_t *b);
+
+/**
+ * Subtract b from a
+ * The parts of a outside b are returned as up to four disjoint rectangles:
+ * full-width bands above and below b, then the pieces left and right of it.
+ *
+ * @param out Receives the pieces (must not alias a or b)
+ * @return Number of pieces (0 if b covers a)
+ */
+uint32_t rect_subtract(const rect_t *a, const rect_t *b, rect_t out[4]);
+
+/**
+ * Area of a rectangle in pixels
+ */
+static inline uint64_t rect_area(const rect_t *r)
+{
+    return (uint64_t)r->width * (uint64_t)r->height;
+}
+
+/**
+ * Add a rectangle to a short list of rectangles, merging where it pays off
+ *
+ * The new rectangle is merged with an entry when their bounding box covers
+ * at most slack pixels more than the two do together; merges repeat until
+ * nothing more combines. When the list is full the rectangle is folded into
+ * the entry whose bounding box grows the least, so the list never overflows.
+ *
+ * @param list Rectangle list
+ * @param count Entries in use (updated)
+ * @param max Capacity of list (at least 1)
+ * @param r Rectangle to add (already clipped by the caller)
+ * @param slack Wasted pixels a merge may add
+ */
+void rect_list_add(rect_t *list, uint32_t *count, uint32_t max,
+                   const rect_t *r, uint64_t slack);
+
 /**
  * Draw a pixel at (x, y)
  */
@@ -67,6 +292,11 @@ uint32_t fb_getpixel(uint32_t x, uint32_t y);
  */
 void fb_fill_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color);
 
+/**
+ * Draw a horizontal span of width pixels starting at (x, y)
+ */
+void fb_fill_span(int32_t x, int32_t y, int32_t width, uint32_t color);
+
 /**
  * Draw a rectangle outline (accepts signed coordinates, clips internally)
  */
@@ -79,14 +309,38 @@ void fb_draw_line(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t c
 
 /**
  * Draw a character using 8x8 font (accepts signed coordinates)
+ * Copies a pre-expanded tile from the glyph cache.
  */
 void fb_putchar(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg);
 
+/**
+ * Draw len characters of str side by side in one colour pair
+ * Unclipped stretches are written one screen row at a time, each glyph row
+ * a single 32-byte copy.
+ */
+void fb_puts_run(int32_t x, int32_t y, const char *str, uint32_t len,
+                 uint32_t fg, uint32_t bg);
+
 /**
  * Draw a string using 8x8 font (accepts signed coordinates)
  */
 void fb_puts(int32_t x, int32_t y, const char *str, uint32_t fg, uint32_t bg);
 
+/**
+ * Draw a string's foreground pixels only, e.g. on a translucent panel
+ */
+void fb_puts_over(int32_t x, int32_t y, const char *str, uint32_t fg);
+
+/**
+ * Per-pixel reference version of fb_putchar() (textbench baseline)
+ */
+void fb_putchar_uncached(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg);
+
+/**
+ * Get glyph cache hit/miss counts since boot
+ */
+void fb_get_glyph_stats(uint64_t *hits, uint64_t *misses);
+
 /**
  * Scroll screen up by one line (for console mode)
  */
@@ -98,10 +352,17 @@ void fb_scroll(void);
 void fb_console_print(const char *str, uint32_t color);
 
 /**
- * Save framebuffer as PPM image (dumps to serial in PPM format)
- * Can be redirected to a file and viewed with any image viewer
+ * Buffer on the display
+ * The back buffer while single-buffered, otherwise the other one.
+ */
+const uint32_t *fb_front_buffer(void);
+
+/**
+ * Save the screen as a binary (P6) PPM image on the host (semihosting)
+ * @param path Host file, created or truncated
+ * @return 0 on success, -1 on error
  */
-void fb_screenshot_ppm(void);
+int fb_screenshot(const char *path);
 
 /**
  * Display ASCII art preview of framebuffer (for text mode)
@@ -13,22 +13,140 @@
 /* Filesystem image magic number */
 #define FS_MAGIC 0x41454F53 /* "AEOS" in hex (A=0x41, E=0x45, O=0x4F, S=0x53) */
 
-/* Filesystem image version */
-#define FS_VERSION 1
+/* Filesystem image version: v2 is a log of segments, v1 one flat tree */
+#define FS_VERSION    2
+#define FS_VERSION_V1 1
 
-/* Maximum filesystem image size (2MB) */
+/* Size of the in-memory storage buffer (fs_get_storage_buffer) */
 #define FS_IMAGE_MAX_SIZE (2 * 1024 * 1024)
 
-/* Filesystem image header */
+/* Device reads go through one buffer of this size */
+#define FS_CHUNK_SIZE 4096
+
+/* Devices tried at boot, in order; saves go where the image was found */
+#define FS_DEVICE_DISK    "vda"
+#define FS_DEVICE_DEFAULT "host"
+#define FS_DEVICE_ALT     "pflash"
+
+/* Largest data payload in one record */
+#define FS_EXTENT_MAX (64 * 1024)
+
+/* A save rewrites the whole log once it outgrows the live data this much */
+#define FS_LOG_SLACK  (256 * 1024)
+
+/* Image flags (v2 header) */
+#define FS_IMAGE_LZ4  0x1   /* Everything after the header is in fs_block_t frames */
+
+/* Raw bytes per compressed block */
+#define FS_BLOCK_SIZE (64 * 1024)
+
+/* Save flags */
+#define FS_SAVE_COMPRESS 0x1   /* Write an LZ4-compressed image */
+
+/* Segment magic ("SEGS") */
+#define FS_SEGMENT_MAGIC 0x53474553
+
+/* Record types (v2) */
+#define FS_REC_FILE    1    /* fs_file_record_t */
+#define FS_REC_DIR     2    /* fs_dir_record_t, then the children */
+#define FS_REC_DATA    3    /* fs_data_record_t, then the bytes */
+#define FS_REC_COMMIT  4    /* fs_commit_t, ends a segment */
+
+/* Filesystem image header (both versions) */
 typedef struct fs_image_header {
     uint32_t magic;         /* Magic number (FS_MAGIC) */
     uint32_t version;       /* Format version */
     uint64_t timestamp;     /* Save timestamp */
-    uint32_t num_inodes;    /* Number of inodes */
-    uint32_t data_size;     /* Total data size */
+    union {
+        uint32_t num_inodes;    /* Number of inodes (v1) */
+        uint32_t epoch;         /* Full saves so far (v2) */
+    };
+    union {
+        uint32_t data_size; /* Total data size (v1) */
+        uint32_t flags;     /* FS_IMAGE_* (v2) */
+    };
 } fs_image_header_t;
 
-/* Serialized inode entry */
+/*
+ * A v2 image is the header followed by segments, one per save. A full save
+ * writes a new image with every inode; an incremental save appends a segment
+ * with only the inodes and byte ranges changed since the last one. Loading
+ * replays the segments in order and stops at the first one whose commit
+ * record is missing or does not match. A block device is never truncated,
+ * so a full save also bumps the epoch: segments left past the end of a
+ * shorter new image carry an older one and are ignored.
+ */
+
+/* Segment header */
+typedef struct fs_segment {
+    uint32_t magic;         /* FS_SEGMENT_MAGIC */
+    uint32_t epoch;         /* Header epoch when written */
+    uint64_t generation;    /* ramfs generation the segment was saved at */
+    uint64_t root_ino;      /* Root directory */
+} fs_segment_t;
+
+/* Record header, followed by length bytes of payload */
+typedef struct fs_record {
+    uint32_t type;          /* FS_REC_* */
+    uint32_t length;        /* Payload bytes */
+    uint64_t ino;           /* Inode the record is about */
+} fs_record_t;
+
+/* File attributes; the file is cut to trunc, then sized to size */
+typedef struct fs_file_record {
+    uint32_t mode;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t trunc;
+} fs_file_record_t;
+
+/* Directory attributes; num_children fs_dir_child_t + name follow */
+typedef struct fs_dir_record {
+    uint32_t mode;
+    uint32_t num_children;
+} fs_dir_record_t;
+
+/* Directory entry, followed by name_len bytes of name (no NUL) */
+typedef struct fs_dir_child {
+    uint64_t ino;
+    uint32_t name_len;
+    uint32_t reserved;
+} fs_dir_child_t;
+
+/* File bytes at an offset; the rest of the payload is the data */
+typedef struct fs_data_record {
+    uint64_t offset;
+} fs_data_record_t;
+
+/* Segment trailer */
+typedef struct fs_commit {
+    uint32_t checksum;      /* FNV-1a of the segment up to this record */
+    uint32_t records;       /* Records before this one */
+} fs_commit_t;
+
+/*
+ * In a compressed image the segments are cut into blocks of up to
+ * FS_BLOCK_SIZE bytes, each compressed on its own, so a load needs one
+ * block in memory at a time. Every segment ends a block, which lets a
+ * later save append.
+ */
+typedef struct fs_block {
+    uint32_t raw_len;       /* Bytes once decompressed */
+    uint32_t packed_len;    /* LZ4 bytes that follow, 0 if stored raw */
+} fs_block_t;
+
+/* Result of the last save */
+typedef struct fs_persist_stats {
+    bool full;              /* Whole image rewritten, not appended */
+    bool compressed;
+    uint32_t inodes;        /* Inodes written */
+    uint64_t raw_bytes;     /* Bytes before compression */
+    uint64_t written;       /* Bytes written to the image */
+    uint64_t image_size;    /* Image size afterwards */
+    const char *device;     /* Block device holding the image */
+} fs_persist_stats_t;
+
+/* v1 serialized inode entry */
 typedef struct fs_inode_entry {
     uint64_t ino;           /* Inode number */
     uint32_t type;          /* File type */
@@ -41,16 +159,17 @@ typedef struct fs_inode_entry {
 } fs_inode_entry_t;
 
 /**
- * Save filesystem to memory buffer
+ * Save filesystem to memory buffer as a full v2 image
  * @param fs Filesystem to save
  * @param buffer Buffer to write to
  * @param buffer_size Size of buffer
+ * @param flags FS_SAVE_* flags
  * @return Number of bytes written, or negative on error
  */
-ssize_t fs_save(vfs_filesystem_t *fs, void *buffer, size_t buffer_size);
+ssize_t fs_save(vfs_filesystem_t *fs, void *buffer, size_t buffer_size, uint32_t flags);
 
 /**
- * Load filesystem from memory buffer
+ * Load filesystem from memory buffer (v1 or v2 image)
  * @param fs Filesystem to load into
  * @param buffer Buffer to read from
  * @param buffer_size Size of buffer
@@ -60,7 +179,8 @@ int fs_load(vfs_filesystem_t *fs, const void *buffer, size_t buffer_size);
 
 /**
  * Get persistent storage buffer
- * @return Pointer to storage buffer
+ * Allocated (zeroed, FS_IMAGE_MAX_SIZE bytes) the first time it is asked for.
+ * @return Pointer to storage buffer, or NULL if out of memory
  */
 void *fs_get_storage_buffer(void);
 
@@ -72,18 +192,39 @@ size_t fs_get_storage_size(void);
 
 /**
  * Save filesystem to disk
+ * Appends the changes since the last save, or rewrites the image when the
+ * stored copy is not known to match or the log has grown too long.
+ * FS_SAVE_COMPRESS rewrites an uncompressed image compressed; a
+ * compressed image stays compressed. The image goes into the block cache
+ * and reaches the device in the background; bcache_sync() waits for it.
  * @param fs Filesystem to save
+ * @param flags FS_SAVE_* flags
  * @return 0 on success, negative on error
  */
-int fs_save_to_disk(vfs_filesystem_t *fs);
+int fs_save_to_disk(vfs_filesystem_t *fs, uint32_t flags);
 
 /**
  * Load filesystem from disk
+ * Tries FS_DEVICE_DISK, FS_DEVICE_DEFAULT, then FS_DEVICE_ALT.
  * @param fs Filesystem to load into
  * @return 0 on success, negative on error
  */
 int fs_load_from_disk(vfs_filesystem_t *fs);
 
+/**
+ * Choose the block device later saves go to
+ * The next save rewrites the whole image there.
+ * @param name Registered block device
+ * @return 0 on success, -1 if there is no such device
+ */
+int fs_set_persist_device(const char *name);
+
+/**
+ * Get what the last save wrote
+ * @param stats Filled in (zeroed before the first save)
+ */
+void fs_get_persist_stats(fs_persist_stats_t *stats);
+
 #endif /* AEOS_FS_PERSIST_H */
 
 /* ============================================================================
@@ -36,6 +36,12 @@
  */
 void gic_init(void);
 
+/**
+ * Initialize the calling CPU's banked SGI/PPI state and CPU interface
+ * Called by gic_init() on the boot CPU and by each secondary core.
+ */
+void gic_init_cpu(void);
+
 /**
  * Enable a specific IRQ
  *
@@ -58,11 +64,18 @@ void gic_disable_irq(uint32_t irq);
  */
 void gic_set_priority(uint32_t irq, uint8_t priority);
 
+/* GICC_IAR fields: interrupt ID, and the requesting CPU for SGIs */
+#define GIC_IAR_IRQ(iar)    ((iar) & 0x3FF)
+#define GIC_IAR_CPU(iar)    (((iar) >> 10) & 0x7)
+
+/* Software-generated interrupts used by the kernel */
+#define SGI_RESCHEDULE      0       /* Work was queued: leave wfi and reschedule */
+
 /**
  * Acknowledge an interrupt
  * Must be called at start of IRQ handler
  *
- * @return IRQ number that fired
+ * @return Raw GICC_IAR value (use GIC_IAR_IRQ() for the IRQ number)
  */
 uint32_t gic_acknowledge_irq(void);
 
@@ -70,9 +83,9 @@ uint32_t gic_acknowledge_irq(void);
  * Signal end of interrupt
  * Must be called at end of IRQ handler
  *
- * @param irq IRQ number to acknowledge
+ * @param iar Value returned by gic_acknowledge_irq() (SGIs need the CPU ID)
  */
-void gic_end_of_irq(uint32_t irq);
+void gic_end_of_irq(uint32_t iar);
 
 /**
  * Send a software-generated interrupt (SGI)
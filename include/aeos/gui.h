@@ -16,6 +16,12 @@
  */
 int gui_init(void);
 
+/**
+ * Set up the event queue and input devices, once
+ * gui_init() calls it; a fast boot calls it early, in the background.
+ */
+void gui_init_input(void);
+
 /**
  * Run the GUI
  * This function does not return until GUI exits
@@ -52,4 +58,9 @@ void gui_launch_settings(void);
  */
 void gui_launch_about(void);
 
+/**
+ * Print compositor and display statistics (gfxinfo shell command)
+ */
+void gui_print_stats(void);
+
 #endif /* AEOS_GUI_H */
@@ -8,6 +8,8 @@
 #define AEOS_HEAP_H
 
 #include <aeos/types.h>
+#include <aeos/slab.h>
+#include <aeos/memprof.h>
 
 /**
  * Initialize the kernel heap
@@ -19,20 +21,29 @@ void heap_init(void *heap_start, size_t heap_size);
 
 /**
  * Allocate memory from kernel heap
+ * Requests up to SLAB_MAX_SIZE bytes come from the slab size classes,
+ * larger ones from the first-fit block list.
+ *
+ * kmalloc, kcalloc and krealloc are macros passing their call site to the
+ * allocation profiler (see memprof.h).
  *
  * @param size Number of bytes to allocate
+ * @param site Call site, "file:line"
  * @return Pointer to allocated memory, or NULL on failure
  */
-void *kmalloc(size_t size);
+void *kmalloc_at(size_t size, const char *site);
+#define kmalloc(size)               kmalloc_at((size), MEMPROF_SITE)
 
 /**
  * Allocate and zero-initialize memory from kernel heap
  *
  * @param nmemb Number of elements
  * @param size Size of each element
+ * @param site Call site, "file:line"
  * @return Pointer to allocated memory, or NULL on failure
  */
-void *kcalloc(size_t nmemb, size_t size);
+void *kcalloc_at(size_t nmemb, size_t size, const char *site);
+#define kcalloc(nmemb, size)        kcalloc_at((nmemb), (size), MEMPROF_SITE)
 
 /**
  * Free memory allocated by kmalloc/kcalloc
@@ -46,9 +57,11 @@ void kfree(void *ptr);
  *
  * @param ptr Pointer to existing allocation (or NULL)
  * @param new_size New size in bytes
+ * @param site Call site, "file:line" (a block that grows moves to it)
  * @return Pointer to resized memory, or NULL on failure
  */
-void *krealloc(void *ptr, size_t new_size);
+void *krealloc_at(void *ptr, size_t new_size, const char *site);
+#define krealloc(ptr, new_size)     krealloc_at((ptr), (new_size), MEMPROF_SITE)
 
 /**
  * Get heap statistics
@@ -57,9 +70,13 @@ typedef struct {
     size_t total_size;      /* Total heap size */
     size_t used_size;       /* Currently allocated */
     size_t free_size;       /* Currently free */
+    size_t largest_free;    /* Largest free block */
     size_t num_blocks;      /* Number of blocks */
     size_t num_allocs;      /* Total allocations */
     size_t num_frees;       /* Total frees */
+    size_t slab_size;       /* Bytes of PMM pages backing the size classes */
+    size_t slab_used;       /* Bytes of size-class objects allocated */
+    kmem_cache_stats_t classes[SLAB_NUM_CLASSES];  /* Per size class */
 } heap_stats_t;
 
 /**
@@ -0,0 +1,98 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/initrd.h
+ * Description: Read-only initrd image, layered under ramfs
+ * ============================================================================ */
+
+#ifndef AEOS_INITRD_H
+#define AEOS_INITRD_H
+
+#include <aeos/types.h>
+#include <aeos/vfs.h>
+
+/*
+ * An initrd is a packed directory tree the loader leaves in RAM. It is
+ * mounted where it lies: ramfs links a directory's entries in the first
+ * time the directory is used, and reads, mmap() and saves take file data
+ * straight from the image. The first change to a file copies it into
+ * ramfs pages, so the image itself is never written. Mounting costs the
+ * same whatever the size of the tree.
+ *
+ * Layout: header, inode table (inode 0 is the root), entry table with each
+ * directory's entries contiguous, name table, then file data with every
+ * file starting on a page and zero-padded to the next.
+ */
+
+#define INITRD_MAGIC        0x44524941  /* "AIRD" */
+#define INITRD_VERSION      1
+
+/* Where 'make run-initrd' has QEMU's loader put the image, for boots with
+ * no device tree to say where it is */
+#define INITRD_LOAD_ADDR    0x48000000
+
+/* Host file 'mkinitrd' writes when not given one */
+#define INITRD_FILE         "initrd.img"
+
+/* Image header */
+typedef struct {
+    uint32_t magic;                     /* INITRD_MAGIC */
+    uint32_t version;                   /* INITRD_VERSION */
+    uint64_t size;                      /* Image bytes */
+    uint32_t num_inodes;
+    uint32_t num_entries;
+    uint64_t inodes_off;                /* initrd_inode_t[num_inodes] */
+    uint64_t entries_off;               /* initrd_entry_t[num_entries] */
+    uint64_t names_off;                 /* NUL-terminated names */
+    uint64_t names_size;
+} initrd_header_t;
+
+/* Inode */
+typedef struct {
+    uint32_t type;                      /* VFS_FILE_REGULAR or VFS_FILE_DIRECTORY */
+    uint32_t mode;
+    uint64_t size;                      /* File: bytes; directory: entries */
+    uint64_t offset;                    /* File: data offset; directory: first entry */
+} initrd_inode_t;
+
+/* Directory entry */
+typedef struct {
+    uint32_t ino;                       /* Index in the inode table */
+    uint32_t name_off;                  /* Offset in the name table */
+} initrd_entry_t;
+
+/**
+ * Find the initrd and reserve it in memblock
+ * Must run after memblock_init() and before mm_init(). The device tree's /chosen linux,initrd-start
+ * gives the image; without one, INITRD_LOAD_ADDR is checked for it.
+ *
+ * @return 0 if an image was found, -1 if not
+ */
+int initrd_probe(void);
+
+/**
+ * Check whether initrd_probe() found an image
+ */
+bool initrd_present(void);
+
+/**
+ * Layer the initrd under a ramfs, whose root must still be empty
+ *
+ * @param fs ramfs filesystem
+ * @return 0 on success, -1 if there is no initrd
+ */
+int initrd_attach(vfs_filesystem_t *fs);
+
+/**
+ * Pack a ramfs directory tree into an initrd image on the host
+ *
+ * @param dir Directory to pack (it becomes the image's root)
+ * @param host_path File written through semihosting
+ * @return Image size in bytes, -1 on error
+ */
+ssize_t initrd_pack(const char *dir, const char *host_path);
+
+#endif /* AEOS_INITRD_H */
+
+/* ============================================================================
+ * End of initrd.h
+ * ============================================================================ */
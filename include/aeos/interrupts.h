@@ -41,6 +41,27 @@ typedef struct {
  */
 typedef void (*irq_handler_t)(void);
 
+/* IRQ numbers with statistics of their own; higher ones share the last */
+#define IRQ_STATS_NR        128
+
+/* Latency histogram: bucket b counts IRQs of [2^b, 2^(b+1)) counter ticks
+ * from acknowledge to EOI (the last bucket is open-ended) */
+#define IRQ_LAT_BUCKETS     16
+
+/* One IRQ number's count and handling latency */
+typedef struct {
+    uint64_t count;
+    uint64_t ticks;                     /* Counter ticks spent in total */
+    uint64_t hist[IRQ_LAT_BUCKETS];
+} irq_stat_t;
+
+/* Exception statistics, summed over CPUs */
+typedef struct {
+    uint64_t vectors[4][4];             /* Vector entries by source and type */
+    uint64_t types[4];                  /* Handled, by exception_type_t */
+    uint64_t spurious;                  /* Acknowledges with no IRQ pending */
+} exception_stats_t;
+
 /**
  * Initialize interrupt subsystem
  * - Installs exception vector table
@@ -74,6 +95,45 @@ void irq_register_handler(uint32_t irq, irq_handler_t handler);
  */
 void irq_unregister_handler(uint32_t irq);
 
+/**
+ * Get the handler registered for an IRQ
+ *
+ * @return Handler, or NULL if there is none
+ */
+irq_handler_t irq_get_handler(uint32_t irq);
+
+/**
+ * Get exception and vector counts
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void exception_get_stats(exception_stats_t *stats);
+
+/**
+ * Get one IRQ number's count and latency histogram
+ *
+ * @param irq IRQ number (below IRQ_STATS_NR)
+ * @param stat Filled with the sum over CPUs
+ * @return 0 on success, -1 if irq is out of range
+ */
+int irq_get_stat(uint32_t irq, irq_stat_t *stat);
+
+/**
+ * Count one sample in a latency statistic
+ * For statistics shaped like irq_stat_t elsewhere (deferred work).
+ *
+ * @param st Statistic
+ * @param ticks Latency in counter ticks
+ */
+void irq_stat_add(irq_stat_t *st, uint64_t ticks);
+
+/**
+ * Latency at a percentile, from the histogram
+ *
+ * @return Upper bound in counter ticks, ~0 if in the open-ended bucket
+ */
+uint64_t irq_stat_percentile(const irq_stat_t *stat, uint32_t pct);
+
 /**
  * Get exception syndrome information
  */
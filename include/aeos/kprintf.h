@@ -20,7 +20,10 @@ typedef enum {
 
 /**
  * Kernel printf - formatted output to console
- * Supports: %d, %u, %x, %X, %p, %s, %c, %%
+ * Conversions, widths and 64-bit lengths as in format.h
+ * The text is also kept in the log ring (see logbuf.h, dmesg). In a
+ * process with a stdout_fd it is written there instead, and the call may
+ * block on a full pipe.
  *
  * @param fmt Format string
  * @param ... Variable arguments
@@ -53,12 +56,30 @@ void klog(log_level_t level, const char *fmt, ...);
 #define klog_error(fmt, ...) klog(LOG_ERROR, fmt, ##__VA_ARGS__)
 #define klog_fatal(fmt, ...) klog(LOG_FATAL, fmt, ##__VA_ARGS__)
 
+/**
+ * Write to the console without adding to the log ring
+ * Goes to the output hook when one is set, or to the process's stdout_fd
+ * like kprintf(). dmesg replays through this.
+ *
+ * @param buf Text to write
+ * @param len Its length
+ */
+void console_write(const char *buf, size_t len);
+
+/**
+ * Make console output synchronous for a crash report
+ * kprintf normally only queues text for the UART's TX interrupt, which a
+ * dying system may never take. klog_fatal switches on its own.
+ */
+void kprintf_panic_mode(void);
+
 /**
  * Output hook for redirecting kprintf output (e.g., to GUI terminal)
- * When set, each character goes to the hook instead of UART.
+ * When set, text goes to the hook instead of UART, once per kprintf or
+ * klog call (or per full line buffer), with IRQs masked.
  * Set to NULL to restore normal UART output.
  */
-typedef void (*kprintf_hook_fn)(char c);
+typedef void (*kprintf_hook_fn)(const char *buf, size_t len);
 extern kprintf_hook_fn kprintf_output_hook;
 
 #endif /* AEOS_KPRINTF_H */
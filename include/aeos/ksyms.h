@@ -0,0 +1,55 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/ksyms.h
+ * Description: Kernel symbol table interface
+ * ============================================================================ */
+
+#ifndef AEOS_KSYMS_H
+#define AEOS_KSYMS_H
+
+#include <aeos/types.h>
+
+/* No symbol covers the address */
+#define KSYM_NONE       0xFFFFFFFFU
+
+/**
+ * Find the text symbol an address falls in
+ * The table is generated from the kernel's own link (scripts/ksyms.awk).
+ *
+ * @param addr Code address
+ * @return Symbol index, or KSYM_NONE outside the kernel's text
+ */
+uint32_t ksym_index(uint64_t addr);
+
+/**
+ * Name of a symbol
+ *
+ * @param index Index from ksym_index()
+ * @return Its name, or "?" for KSYM_NONE
+ */
+const char *ksym_name(uint32_t index);
+
+/**
+ * Start address of a symbol
+ */
+uint64_t ksym_addr(uint32_t index);
+
+/**
+ * Number of symbols in the table
+ */
+uint32_t ksym_count(void);
+
+/**
+ * Symbolize an address
+ *
+ * @param addr Code address
+ * @param offset If not NULL, receives addr minus the symbol's start
+ * @return Symbol name, or NULL outside the kernel's text
+ */
+const char *ksym_lookup(uint64_t addr, uint64_t *offset);
+
+#endif /* AEOS_KSYMS_H */
+
+/* ============================================================================
+ * End of ksyms.h
+ * ============================================================================ */
@@ -0,0 +1,59 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/logbuf.h
+ * Description: Kernel log ring buffer interface
+ * ============================================================================ */
+
+#ifndef AEOS_LOGBUF_H
+#define AEOS_LOGBUF_H
+
+#include <aeos/types.h>
+
+/* Ring size per CPU (power of two) */
+#define LOGBUF_CPU_SIZE     (16 * 1024)
+
+/* Longest record; longer output is split over several */
+#define LOGBUF_RECORD_MAX   256
+
+/* Record level for plain kprintf output (klog uses log_level_t) */
+#define LOGBUF_LEVEL_NONE   0xFF
+
+/* Log ring statistics */
+typedef struct {
+    uint64_t records;               /* Records appended since boot */
+    uint64_t bytes;                 /* Text bytes appended since boot */
+    uint64_t overwritten;           /* Oldest records dropped for space */
+    uint32_t held;                  /* Records currently held, all CPUs */
+} logbuf_stats_t;
+
+/**
+ * Append a record to the calling CPU's ring
+ * Safe from any context; never blocks. Text longer than LOGBUF_RECORD_MAX
+ * is cut short.
+ *
+ * @param level log_level_t value or LOGBUF_LEVEL_NONE
+ * @param text Record text (not NUL-terminated)
+ * @param len Its length
+ */
+void logbuf_append(uint8_t level, const char *text, uint32_t len);
+
+/**
+ * Replay every held record, oldest first across all CPUs
+ * Records overwritten while the replay runs are skipped.
+ *
+ * @param out Called once per record with its text
+ */
+typedef void (*logbuf_out_fn)(const char *text, size_t len);
+void logbuf_replay(logbuf_out_fn out);
+
+/**
+ * Get log ring statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void logbuf_get_stats(logbuf_stats_t *stats);
+
+#endif /* AEOS_LOGBUF_H */
+
+/* ============================================================================
+ * End of logbuf.h
+ * ============================================================================ */
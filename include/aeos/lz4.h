@@ -0,0 +1,48 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/lz4.h
+ * Description: LZ4 block compression
+ * ============================================================================ */
+
+#ifndef AEOS_LZ4_H
+#define AEOS_LZ4_H
+
+#include <aeos/types.h>
+
+/* Largest block: offsets are 16 bits, so a match never reaches past it */
+#define LZ4_BLOCK_MAX   65536
+
+/* Compressor hash table: entries of uint16_t */
+#define LZ4_HASH_LOG    12
+#define LZ4_HASH_SIZE   (1 << LZ4_HASH_LOG)
+
+/* Worst-case compressed size of n bytes */
+#define LZ4_BOUND(n)    ((n) + (n) / 255 + 16)
+
+/**
+ * Compress a block into the LZ4 block format
+ * @param src Input, at most LZ4_BLOCK_MAX bytes
+ * @param len Input length
+ * @param dst Output buffer
+ * @param cap Output capacity; LZ4_BOUND(len) always suffices
+ * @param table Scratch hash table of LZ4_HASH_SIZE entries
+ * @return Compressed length, 0 if it did not fit in cap
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap, uint16_t *table);
+
+/**
+ * Decompress an LZ4 block
+ * Malformed input is rejected; nothing is written past cap.
+ * @param src Compressed block
+ * @param len Compressed length
+ * @param dst Output buffer
+ * @param cap Output capacity
+ * @return Decompressed length, -1 if the block is malformed or too large
+ */
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* AEOS_LZ4_H */
+
+/* ============================================================================
+ * End of lz4.h
+ * ============================================================================ */
@@ -0,0 +1,110 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/memblock.h
+ * Description: Early physical memory map and boot-time allocator
+ * ============================================================================ */
+
+#ifndef AEOS_MEMBLOCK_H
+#define AEOS_MEMBLOCK_H
+
+#include <aeos/types.h>
+
+/*
+ * Before the PMM exists, physical memory is two lists of page-aligned
+ * ranges, each kept sorted and merged: the RAM the device tree reports,
+ * and what is reserved within it (the kernel image, the blob, the DTB's
+ * reserved ranges, the initrd, and early allocations). memblock_alloc()
+ * carves boot-time structures, such as the PMM's page map and the heap,
+ * out of the lowest free range that fits, so they scale with RAM instead
+ * of being sized by the linker script.
+ *
+ * pmm_init() then hands every free range to the buddy allocator and
+ * retires memblock: later reservations go through pmm_reserve_region().
+ * The RAM list stays for mmu_init() and for range checks.
+ */
+
+/* Ranges each list can hold */
+#define MEMBLOCK_MAX_REGIONS    32
+
+/* A physical range */
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} memblock_region_t;
+
+/**
+ * Build the memory map from the device tree
+ * Falls back to PHYS_RAM_DEFAULT_SIZE at PHYS_RAM_START without /memory
+ * nodes, ignores RAM from PHYS_RAM_LIMIT up, and reserves the kernel
+ * image and everything the device tree reserves. Call after dtb_init().
+ */
+void memblock_init(void);
+
+/**
+ * Add a range of RAM (rounded inward to pages)
+ * @return 0 on success, -1 if the list is full or memblock is retired
+ */
+int memblock_add(uint64_t base, uint64_t size);
+
+/**
+ * Reserve a range (rounded outward to pages)
+ * @return 0 on success, -1 if the list is full or memblock is retired
+ */
+int memblock_reserve(uint64_t base, uint64_t size);
+
+/**
+ * Allocate from the lowest free range that fits (not zeroed)
+ * @param size Bytes (rounded up to pages)
+ * @param align Alignment, a power of two of at least PAGE_SIZE
+ * @return Physical address, or 0 if nothing fits or memblock is retired
+ */
+uint64_t memblock_alloc(uint64_t size, uint64_t align);
+
+/**
+ * Find the next free range at or above a position
+ * @param pos In: where to look from; out: the end of the range found
+ * @param start Receives the start of the range
+ * @param end Receives the end of the range
+ * @return false when there are no more
+ */
+bool memblock_next_free(uint64_t *pos, uint64_t *start, uint64_t *end);
+
+/**
+ * Stop handing out memory: the PMM owns it from now on
+ */
+void memblock_retire(void);
+
+/**
+ * Lowest RAM address
+ */
+uint64_t memblock_start(void);
+
+/**
+ * End of the highest RAM range
+ */
+uint64_t memblock_end(void);
+
+/**
+ * Total bytes of RAM in all ranges
+ */
+uint64_t memblock_memory_size(void);
+
+/**
+ * Get a RAM range
+ * @param index 0 up
+ * @return false past the last range
+ */
+bool memblock_get_memory(uint32_t index, memblock_region_t *region);
+
+/**
+ * Get a reserved range
+ * @param index 0 up
+ * @return false past the last range
+ */
+bool memblock_get_reserved(uint32_t index, memblock_region_t *region);
+
+#endif /* AEOS_MEMBLOCK_H */
+
+/* ============================================================================
+ * End of memblock.h
+ * ============================================================================ */
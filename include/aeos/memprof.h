@@ -0,0 +1,121 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/memprof.h
+ * Description: Allocation profiler - live bytes per allocation site
+ * ============================================================================ */
+
+#ifndef AEOS_MEMPROF_H
+#define AEOS_MEMPROF_H
+
+#include <aeos/types.h>
+
+/* Distinct allocation sites tracked (power of two) */
+#define MEMPROF_MAX_SITES   512
+
+/* Live allocations tracked (power of two); the table is kept 3/4 full at most */
+#define MEMPROF_MAX_LIVE    16384
+
+/* Sites in a report by default */
+#define MEMPROF_REPORT_TOP  16
+
+/* What an allocation came from */
+#define MEMPROF_HEAP        0           /* kmalloc/kcalloc/krealloc */
+#define MEMPROF_PAGES       1           /* pmm_alloc_pages */
+
+/*
+ * Call site of an allocation, "src/file.c:123"
+ * The allocator macros in heap.h and pmm.h pass it; being a string literal
+ * it also identifies the site by address.
+ */
+#define MEMPROF_STR2(x)     #x
+#define MEMPROF_STR(x)      MEMPROF_STR2(x)
+#define MEMPROF_SITE        __FILE__ ":" MEMPROF_STR(__LINE__)
+
+/* One allocation site */
+typedef struct {
+    const char *site;                   /* "file:line" */
+    uint32_t kind;                      /* MEMPROF_HEAP or MEMPROF_PAGES */
+    uint32_t live_count;                /* Allocations not yet freed */
+    uint64_t live_bytes;                /* Bytes they hold */
+    uint64_t allocs;                    /* Allocations since tracking began */
+    uint64_t bytes;                     /* Bytes allocated since then */
+} memprof_site_t;
+
+/* Profiler statistics */
+typedef struct {
+    bool enabled;
+    uint32_t sites;                     /* Sites seen */
+    uint64_t live;                      /* Allocations being tracked */
+    uint64_t untracked;                 /* Missed: site or live table full */
+} memprof_stats_t;
+
+/* Nonzero while allocations are being recorded; read by every allocation */
+extern volatile uint32_t memprof_enabled;
+
+/**
+ * Record an allocation
+ * Use MEMPROF_ALLOC(), which skips the call while the profiler is off.
+ */
+void memprof_alloc(const void *ptr, size_t size, const char *site, uint32_t kind);
+
+/**
+ * Record a free (allocations made while the profiler was off are ignored)
+ * Use MEMPROF_FREE().
+ */
+void memprof_free(const void *ptr, uint32_t kind);
+
+/*
+ * With the profiler off an allocation or free costs one load and one
+ * not-taken branch.
+ */
+#define MEMPROF_ALLOC(ptr, size, site, kind) \
+    do { \
+        if (__builtin_expect(memprof_enabled, 0)) { \
+            memprof_alloc((ptr), (size), (site), (kind)); \
+        } \
+    } while (0)
+
+#define MEMPROF_FREE(ptr, kind) \
+    do { \
+        if (__builtin_expect(memprof_enabled, 0)) { \
+            memprof_free((ptr), (kind)); \
+        } \
+    } while (0)
+
+/**
+ * Start or stop recording
+ * Only allocations made while recording are attributed. Starting discards
+ * what an earlier run recorded; stopping keeps it for a report. The live
+ * table is allocated from the PMM the first time recording starts.
+ *
+ * @param on True to start, false to stop
+ * @return 0 on success, -1 if the live table could not be allocated
+ */
+int memprof_enable(bool on);
+
+/**
+ * Forget every site and live allocation
+ */
+void memprof_reset(void);
+
+/**
+ * Copy out the sites holding the most live bytes, largest first
+ *
+ * @param out Array of max entries
+ * @param max Entries wanted
+ * @return Entries filled in
+ */
+uint32_t memprof_top(memprof_site_t *out, uint32_t max);
+
+/**
+ * Get profiler statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void memprof_get_stats(memprof_stats_t *stats);
+
+#endif /* AEOS_MEMPROF_H */
+
+/* ============================================================================
+ * End of memprof.h
+ * ============================================================================ */
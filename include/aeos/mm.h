@@ -8,6 +8,7 @@
 #define AEOS_MM_H
 
 #include <aeos/types.h>
+#include <aeos/memprof.h>
 
 /* Page size and related constants */
 #define PAGE_SIZE       4096        /* 4KB pages */
@@ -16,8 +17,8 @@
 
 /* Memory regions for QEMU virt board */
 #define PHYS_RAM_START  0x40000000  /* Physical RAM starts at 1GB */
-#define PHYS_RAM_SIZE   0x10000000  /* 256MB default */
-#define PHYS_RAM_END    (PHYS_RAM_START + PHYS_RAM_SIZE)
+#define PHYS_RAM_DEFAULT_SIZE 0x10000000  /* 256MB if the DTB names no memory */
+#define PHYS_RAM_LIMIT  0x1000000000ULL  /* RAM from 64GB up is ignored (MMU_USER_BASE) */
 
 /* Kernel virtual memory layout */
 #define KERNEL_VIRT_BASE    0xFFFF000000000000ULL  /* Kernel high half */
@@ -43,12 +44,13 @@
 /* Number of pages in a memory region */
 #define BYTES_TO_PAGES(bytes)   (((bytes) + PAGE_SIZE - 1) >> PAGE_SHIFT)
 
-/* Memory protection flags (for future VMM use) */
+/* Memory protection flags (used by the MMU page-table builder) */
 #define MEM_READ    (1 << 0)
 #define MEM_WRITE   (1 << 1)
 #define MEM_EXEC    (1 << 2)
 #define MEM_USER    (1 << 3)
 #define MEM_NOCACHE (1 << 4)
+#define MEM_DEVICE  (1 << 5)  /* Device-nGnRE (MMIO) */
 
 /* Common memory protection combinations */
 #define MEM_KERNEL_RO   (MEM_READ)
@@ -79,4 +81,47 @@ size_t mm_get_free_memory(void);
  */
 size_t mm_get_used_memory(void);
 
+/*
+ * Huge buffers
+ *
+ * Large buffers (framebuffers, window backbuffers, the filesystem image)
+ * come straight from the PMM as one naturally aligned block rather than
+ * from the heap. The linear map covers RAM with 2MB blocks, so a buffer of
+ * up to 2MB (order MM_HUGE_ORDER) sits under a single TLB entry and a
+ * larger one under the fewest possible.
+ */
+#define MM_HUGE_ORDER       9
+#define MM_HUGE_SIZE        (PAGE_SIZE << MM_HUGE_ORDER)    /* 2MB */
+
+/* Huge buffer statistics */
+typedef struct {
+    size_t buffers;             /* Buffers allocated */
+    size_t bytes;               /* Bytes of PMM blocks they hold */
+} mm_huge_stats_t;
+
+/**
+ * Allocate a huge buffer (not zeroed)
+ * mm_alloc_huge is a macro passing its call site to the allocation
+ * profiler.
+ *
+ * @param size Bytes wanted, up to 2^PMM_MAX_ORDER pages
+ * @param site Call site, "file:line"
+ * @return Buffer aligned to its block size, or NULL if out of memory
+ */
+void *mm_alloc_huge_at(size_t size, const char *site);
+#define mm_alloc_huge(size)     mm_alloc_huge_at((size), MEMPROF_SITE)
+
+/**
+ * Free a huge buffer
+ *
+ * @param ptr Buffer from mm_alloc_huge (NULL is ignored)
+ * @param size Size it was allocated with
+ */
+void mm_free_huge(void *ptr, size_t size);
+
+/**
+ * Get huge buffer statistics
+ */
+void mm_get_huge_stats(mm_huge_stats_t *stats);
+
 #endif /* AEOS_MM_H */
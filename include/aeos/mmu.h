@@ -0,0 +1,325 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/mmu.h
+ * Description: MMU and page table management interface
+ * ============================================================================ */
+
+#ifndef AEOS_MMU_H
+#define AEOS_MMU_H
+
+#include <aeos/types.h>
+#include <aeos/mm.h>
+
+/*
+ * Translation regime
+ *
+ * 4KB granule, 39-bit virtual address space (T0SZ = 25) so the walk starts
+ * at level 1. Each level-1 entry covers 1GB, each level-2 entry 2MB and each
+ * level-3 entry a single 4KB page. Level-1 and level-2 entries either point
+ * to the next table or are block descriptors mapping all of their range,
+ * which the kernel's identity map uses wherever alignment allows.
+ */
+#define MMU_VA_BITS         39
+#define MMU_ENTRIES         512         /* Descriptors per table */
+
+#define MMU_L1_SHIFT        30
+#define MMU_L2_SHIFT        21
+#define MMU_L3_SHIFT        12
+
+#define MMU_L1_BLOCK_SIZE   (1ULL << MMU_L1_SHIFT)     /* 1GB */
+#define MMU_L2_BLOCK_SIZE   (1ULL << MMU_L2_SHIFT)     /* 2MB */
+
+#define MMU_L1_INDEX(va)    (((va) >> MMU_L1_SHIFT) & (MMU_ENTRIES - 1))
+#define MMU_L2_INDEX(va)    (((va) >> MMU_L2_SHIFT) & (MMU_ENTRIES - 1))
+#define MMU_L3_INDEX(va)    (((va) >> MMU_L3_SHIFT) & (MMU_ENTRIES - 1))
+
+/* MAIR_EL1 attribute indices */
+#define MT_DEVICE_nGnRnE    0
+#define MT_DEVICE_nGnRE     1
+#define MT_NORMAL_NC        2
+#define MT_NORMAL           3
+
+/* MAIR_EL1 attribute encodings */
+#define MAIR_DEVICE_nGnRnE  0x00ULL
+#define MAIR_DEVICE_nGnRE   0x04ULL
+#define MAIR_NORMAL_NC      0x44ULL     /* Inner/outer non-cacheable */
+#define MAIR_NORMAL_WB      0xFFULL     /* Inner/outer write-back, RW-allocate */
+
+#define MAIR_VALUE          ((MAIR_DEVICE_nGnRnE << (8 * MT_DEVICE_nGnRnE)) | \
+                             (MAIR_DEVICE_nGnRE  << (8 * MT_DEVICE_nGnRE))  | \
+                             (MAIR_NORMAL_NC     << (8 * MT_NORMAL_NC))     | \
+                             (MAIR_NORMAL_WB     << (8 * MT_NORMAL)))
+
+/* TCR_EL1 fields */
+#define TCR_T0SZ            (64 - MMU_VA_BITS)
+#define TCR_IRGN0_WBWA      (1ULL << 8)
+#define TCR_ORGN0_WBWA      (1ULL << 10)
+#define TCR_SH0_INNER       (3ULL << 12)
+#define TCR_TG0_4K          (0ULL << 14)
+#define TCR_EPD1            (1ULL << 23)    /* No TTBR1 walks (no high half yet) */
+#define TCR_IPS_SHIFT       32
+
+/* TTBR0_EL1 ASID field (TCR_EL1.A1 = 0, so TTBR0 holds the ASID) */
+#define TTBR_ASID_SHIFT     48
+
+/* Page table descriptor bits */
+#define PTE_VALID           (1ULL << 0)
+#define PTE_TABLE           (1ULL << 1)     /* Level 1/2: next-level table (clear: block) */
+#define PTE_PAGE            (1ULL << 1)     /* Level 3: page descriptor */
+#define PTE_ATTRINDX(idx)   ((uint64_t)(idx) << 2)
+#define PTE_AP_USER         (1ULL << 6)     /* AP[1]: EL0 accessible */
+#define PTE_AP_RO           (1ULL << 7)     /* AP[2]: read-only */
+#define PTE_SH_INNER        (3ULL << 8)
+#define PTE_AF              (1ULL << 10)    /* Access flag */
+#define PTE_NG              (1ULL << 11)    /* Not global */
+#define PTE_PXN             (1ULL << 53)    /* Privileged execute-never */
+#define PTE_UXN             (1ULL << 54)    /* Unprivileged execute-never */
+#define PTE_COW             (1ULL << 55)    /* Software: writable, copy on write */
+
+#define PTE_ADDR_MASK       0x0000FFFFFFFFF000ULL
+
+/*
+ * Kernel mapping window
+ *
+ * Mappings that are not part of the identity map, such as vfs_mmap() file
+ * views, get virtual addresses from a window that lies above RAM and MMIO.
+ * Each mapping is followed by an unmapped guard page.
+ */
+#define MMU_VMAP_BASE       0x4000000000ULL     /* 256GB */
+#define MMU_VMAP_SIZE       0x10000000ULL       /* 256MB */
+#define MMU_VMAP_PAGES      (MMU_VMAP_SIZE >> PAGE_SHIFT)
+
+/*
+ * User address spaces
+ *
+ * Each user process gets its own level-1 table. The kernel's level-1
+ * entries (MMIO, RAM and the mapping window) are copied into it, so the
+ * kernel half is shared and never changes; the slots covering the user
+ * range below are private. User pages are non-global and tagged with the
+ * space's ASID, so switching TTBR0 needs no TLB flush.
+ */
+#define MMU_USER_BASE       0x1000000000ULL     /* 64GB: programs link here */
+#define MMU_USER_TOP        MMU_VMAP_BASE       /* Stacks grow down from here */
+
+/* ASIDs: 8 bits, 0 is the kernel's; a new generation starts when they run out */
+#define MMU_ASID_BITS       8
+#define MMU_NUM_ASIDS       (1U << MMU_ASID_BITS)
+
+/* ESR_EL1 fields of a data abort */
+#define ESR_EC_IABT_LOW     0x20                /* Instruction abort, from EL0 */
+#define ESR_EC_DABT_LOW     0x24                /* Data abort, from EL0 */
+#define ESR_EC_DABT_CUR     0x25                /* Data abort, same EL */
+#define ESR_DABT_WNR        (1ULL << 6)         /* Write, not read */
+#define ESR_DABT_DFSC(esr)  ((esr) & 0x3F)
+#define DFSC_PERM_FAULT(fsc) (((fsc) & 0x3C) == 0x0C)
+#define DFSC_XLAT_FAULT(fsc) (((fsc) & 0x3C) == 0x04)
+
+/**
+ * Fault handler for the mapping window
+ * @param va Faulting address (inside the window)
+ * @param write True for a write to a read-only page
+ * @return 0 if resolved (the access is retried), -1 otherwise
+ */
+typedef int (*mmu_fault_fn)(uint64_t va, bool write);
+
+/* A user address space (opaque) */
+typedef struct mmu_space mmu_space_t;
+
+/* Maximum number of named regions tracked for reporting */
+#define MMU_MAX_REGIONS     16
+
+/* A named mapping, recorded for meminfo */
+typedef struct {
+    const char *name;
+    uint64_t va;
+    uint64_t pa;
+    size_t size;
+    uint32_t flags;             /* MEM_* protection flags */
+} mmu_region_t;
+
+/* MMU statistics */
+typedef struct {
+    bool enabled;               /* MMU and caches on */
+    uint64_t ttbr0;             /* Root table physical address */
+    size_t table_pages;         /* Pages used for translation tables */
+    size_t mapped_pages;        /* Total 4KB pages mapped, blocks included */
+    size_t blocks_1g;           /* Kernel 1GB block descriptors */
+    size_t blocks_2m;           /* Kernel 2MB block descriptors */
+    uint32_t num_regions;       /* Named regions */
+    size_t vmap_pages;          /* Mapping window pages in use */
+    uint32_t spaces;            /* User address spaces alive */
+    size_t user_pages;          /* Pages mapped into them */
+    uint64_t asid_generation;   /* ASID rollovers since boot */
+    uint64_t cow_faults;        /* Writes to copy-on-write pages */
+    uint64_t cow_copies;        /* Of those, pages that had to be copied */
+} mmu_stats_t;
+
+/**
+ * Build the kernel identity map and enable the MMU, D-cache and I-cache
+ * RAM is mapped Normal write-back, MMIO ranges as Device-nGnRE.
+ * Must run after pmm_init() since translation tables come from the PMM.
+ * @return 0 on success, -1 on error
+ */
+int mmu_init(void);
+
+/**
+ * Map a virtual address range to a physical range
+ * Uses 1GB and 2MB block descriptors wherever va and pa are aligned for
+ * them and the range covers the whole block, 4KB pages elsewhere. Before
+ * the MMU is on, a range may overlap an earlier block mapping, which is
+ * split into the next level's entries; afterwards that is refused.
+ * @param va Virtual start address (page-aligned)
+ * @param pa Physical start address (page-aligned)
+ * @param size Size in bytes (rounded up to pages)
+ * @param flags MEM_* protection flags (MEM_DEVICE / MEM_NOCACHE select attributes)
+ * @return 0 on success, -1 on error
+ */
+int mmu_map_range(uint64_t va, uint64_t pa, size_t size, uint32_t flags);
+
+/**
+ * Map and record a named region (shown by meminfo)
+ * @return 0 on success, -1 on error
+ */
+int mmu_map_region(const char *name, uint64_t pa, size_t size, uint32_t flags);
+
+/**
+ * Map a list of physical pages contiguously in the mapping window
+ * @param pages Physical page addresses
+ * @param count Number of pages
+ * @param flags MEM_* protection flags
+ * @return Virtual address of the first page, or 0 on error
+ */
+uint64_t mmu_vmap(const uint64_t *pages, size_t count, uint32_t flags);
+
+/**
+ * Unmap a window mapping and release its addresses
+ * @param va Address returned by mmu_vmap()
+ * @param count Number of pages passed to mmu_vmap()
+ */
+void mmu_vunmap(uint64_t va, size_t count);
+
+/**
+ * Point one mapped window page at a different physical page
+ * Uses break-before-make, so other CPUs never see both translations.
+ * @return 0 on success, -1 on error
+ */
+int mmu_vmap_replace(uint64_t va, uint64_t pa, uint32_t flags);
+
+/**
+ * Install the handler for faults inside the mapping window
+ */
+void mmu_set_vmap_fault_handler(mmu_fault_fn fn);
+
+/**
+ * Install the handler for translation faults inside the user range
+ * Called with the faulting process's space in TTBR0, e.g. to fill in
+ * demand-zero stack pages.
+ */
+void mmu_set_user_fault_handler(mmu_fault_fn fn);
+
+/**
+ * Create an empty user address space
+ * @return New space, or NULL on allocation failure
+ */
+mmu_space_t *mmu_space_create(void);
+
+/**
+ * Copy a user address space, sharing its pages copy-on-write
+ * Only the tables are copied. Writable pages become read-only in both
+ * spaces and are marked PTE_COW; the first write to one in either space
+ * faults, and mmu_handle_fault() gives the writer a private copy (or just
+ * makes it writable again once no other space shares the page).
+ * Read-only pages are shared as they are.
+ *
+ * @param src Space to copy, normally the caller's (live in TTBR0)
+ * @return New space, or NULL on allocation failure
+ */
+mmu_space_t *mmu_space_clone(mmu_space_t *src);
+
+/**
+ * Free a user address space, its tables and every page mapped into it
+ * Pages still shared with another space are only released by this one.
+ * Must not be live in TTBR0 on any CPU.
+ */
+void mmu_space_destroy(mmu_space_t *space);
+
+/**
+ * Map physical pages into a user address space
+ * The space takes ownership of the pages: mmu_space_destroy() frees them.
+ * Only unmapped addresses may be mapped, so no TLB maintenance is needed.
+ *
+ * @param va User virtual address (page-aligned, inside the user range)
+ * @param pa Physical address (page-aligned)
+ * @param size Size in bytes (rounded up to pages)
+ * @param flags MEM_USER_* protection flags
+ * @return 0 on success, -1 on error
+ */
+int mmu_space_map(mmu_space_t *space, uint64_t va, uint64_t pa, size_t size,
+                  uint32_t flags);
+
+/**
+ * Translate a user virtual address in a space
+ * @return Physical address, or 0 if not mapped
+ */
+uint64_t mmu_space_translate(mmu_space_t *space, uint64_t va);
+
+/**
+ * Load a space into TTBR0 on the calling CPU (IRQs must be masked)
+ * @param space Space to switch to, or NULL for the kernel tables
+ */
+void mmu_switch_space(mmu_space_t *space);
+
+/**
+ * Make instructions written through the kernel map visible to execution
+ * @param pa Physical (identity-mapped) start of the written range
+ * @param size Its size in bytes
+ */
+void mmu_sync_icache(uint64_t pa, size_t size);
+
+/**
+ * Check whether a range lies entirely inside the user address range
+ */
+static inline bool mmu_user_range_ok(uint64_t va, size_t size)
+{
+    return va >= MMU_USER_BASE && va < MMU_USER_TOP &&
+           size <= MMU_USER_TOP - va;
+}
+
+/**
+ * Try to resolve a synchronous exception as a mapping window or user fault
+ * In the user range, translation faults go to the user fault handler and
+ * writes to copy-on-write pages are resolved here.
+ * @param esr ESR_EL1 value
+ * @param far FAR_EL1 value
+ * @return 0 if handled and the access can be retried, -1 otherwise
+ */
+int mmu_handle_fault(uint64_t esr, uint64_t far);
+
+/**
+ * Translate a virtual address by walking the kernel tables
+ * @param va Virtual address
+ * @return Physical address, or 0 if not mapped
+ */
+uint64_t mmu_translate(uint64_t va);
+
+/**
+ * Check if the MMU has been enabled
+ */
+bool mmu_enabled(void);
+
+/**
+ * Get MMU statistics
+ */
+void mmu_get_stats(mmu_stats_t *stats);
+
+/**
+ * Get a recorded region by index
+ * @return Region pointer or NULL if index is out of range
+ */
+const mmu_region_t *mmu_get_region(uint32_t index);
+
+#endif /* AEOS_MMU_H */
+
+/* ============================================================================
+ * End of mmu.h
+ * ============================================================================ */
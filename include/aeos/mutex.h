@@ -0,0 +1,63 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/mutex.h
+ * Description: Sleeping mutexes
+ * ============================================================================ */
+
+#ifndef AEOS_MUTEX_H
+#define AEOS_MUTEX_H
+
+#include <aeos/types.h>
+#include <aeos/spinlock.h>
+#include <aeos/wait.h>
+
+struct process;
+
+/*
+ * A mutex may be held across work that blocks (device I/O, sleeps).
+ * Contended lockers block in FIFO order, and unlock hands the mutex to
+ * the first of them directly, so a newcomer cannot overtake a waiter.
+ * Process context only: IRQ handlers and tasklets use spinlocks.
+ */
+typedef struct {
+    spinlock_t lock;                    /* Protects the fields below */
+    bool locked;
+    struct process *owner;              /* NULL before the scheduler runs */
+    waiter_t *head;                     /* Blocked lockers, oldest first */
+    waiter_t *tail;
+    uint64_t contended;                 /* Locks that had to wait */
+} mutex_t;
+
+#define MUTEX_INIT          { SPINLOCK_INIT, false, NULL, NULL, NULL, 0 }
+
+/**
+ * Initialize a mutex (unlocked)
+ */
+void mutex_init(mutex_t *m);
+
+/**
+ * Acquire a mutex, blocking while another process holds it
+ */
+void mutex_lock(mutex_t *m);
+
+/**
+ * Acquire a mutex only if it is free
+ * @return true if it was taken
+ */
+bool mutex_trylock(mutex_t *m);
+
+/**
+ * Release a mutex, handing it to the oldest waiter
+ */
+void mutex_unlock(mutex_t *m);
+
+/**
+ * Check whether a mutex is held (by anyone)
+ */
+bool mutex_is_locked(const mutex_t *m);
+
+#endif /* AEOS_MUTEX_H */
+
+/* ============================================================================
+ * End of mutex.h
+ * ============================================================================ */
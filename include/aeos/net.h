@@ -0,0 +1,179 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/net.h
+ * Description: Minimal IPv4 networking: ARP and sending UDP
+ * ============================================================================ */
+
+#ifndef AEOS_NET_H
+#define AEOS_NET_H
+
+#include <aeos/types.h>
+#include <aeos/virtq.h>
+#include <aeos/virtio_net.h>
+
+/*
+ * Enough of IPv4 to get datagrams off the machine: a static address, ARP
+ * to find the next hop, and UDP sends whose payload goes to the device
+ * from the caller's buffers. Nothing is received beyond ARP. Addresses and
+ * ports are in host byte order throughout the API.
+ *
+ * The defaults are those of QEMU's user networking, where 10.0.2.2 is the
+ * host: 'make run-net' forwards nothing, but datagrams sent there arrive
+ * on the host's loopback interface.
+ */
+
+/* Build an address from its dotted-quad parts */
+#define NET_IP(a, b, c, d)  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | \
+                             ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+#define NET_DEFAULT_ADDR    NET_IP(10, 0, 2, 15)
+#define NET_DEFAULT_GATEWAY NET_IP(10, 0, 2, 2)
+#define NET_DEFAULT_NETMASK NET_IP(255, 255, 255, 0)
+
+/* Ethernet */
+#define ETH_TYPE_IPV4       0x0800
+#define ETH_TYPE_ARP        0x0806
+#define ETH_FRAME_MIN       60          /* Without the FCS */
+
+/* IPv4 */
+#define IP_PROTO_UDP        17
+#define IP_TTL_DEFAULT      64
+
+/* Largest UDP payload that fits the MTU unfragmented */
+#define UDP_PAYLOAD_MAX     (VIRTIO_NET_MTU - sizeof(ipv4_hdr_t) - sizeof(udp_hdr_t))
+
+/* Payload buffers per datagram */
+#define UDP_SEND_BUFS       VIRTIO_NET_TX_BUFS
+
+/* ARP cache entries */
+#define NET_ARP_ENTRIES     8
+
+typedef struct {
+    uint8_t dst[VIRTIO_NET_ALEN];
+    uint8_t src[VIRTIO_NET_ALEN];
+    uint16_t type;
+} __attribute__((packed)) eth_hdr_t;
+
+typedef struct {
+    uint16_t htype;
+    uint16_t ptype;
+    uint8_t hlen;
+    uint8_t plen;
+    uint16_t oper;
+    uint8_t sha[VIRTIO_NET_ALEN];
+    uint32_t spa;
+    uint8_t tha[VIRTIO_NET_ALEN];
+    uint32_t tpa;
+} __attribute__((packed)) arp_pkt_t;
+
+typedef struct {
+    uint8_t ver_ihl;
+    uint8_t tos;
+    uint16_t total_len;
+    uint16_t id;
+    uint16_t frag;
+    uint8_t ttl;
+    uint8_t proto;
+    uint16_t csum;
+    uint32_t src;
+    uint32_t dst;
+} __attribute__((packed)) ipv4_hdr_t;
+
+typedef struct {
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t len;
+    uint16_t csum;
+} __attribute__((packed)) udp_hdr_t;
+
+/* Network statistics */
+typedef struct {
+    uint64_t rx_frames;             /* Frames handed up by the driver */
+    uint64_t rx_arp;
+    uint64_t rx_ignored;            /* Not ARP, or not for us */
+    uint64_t tx_arp;
+    uint64_t udp_sent;
+    uint64_t udp_bytes;             /* Payload bytes */
+    uint64_t arp_misses;            /* Sends that had to resolve first */
+    uint64_t arp_failures;          /* Next hops that never answered */
+} net_stats_t;
+
+static inline uint16_t net_htons(uint16_t v) { return __builtin_bswap16(v); }
+static inline uint16_t net_ntohs(uint16_t v) { return __builtin_bswap16(v); }
+static inline uint32_t net_htonl(uint32_t v) { return __builtin_bswap32(v); }
+static inline uint32_t net_ntohl(uint32_t v) { return __builtin_bswap32(v); }
+
+/**
+ * Bring networking up on the VirtIO network device
+ * Call after virtio_net_init().
+ *
+ * @return 0 on success, -1 if there is no network device
+ */
+int net_init(void);
+
+/**
+ * Check whether networking is up
+ */
+bool net_up(void);
+
+/**
+ * Get the interface address, netmask and gateway (any may be NULL)
+ */
+void net_get_config(uint32_t *addr, uint32_t *netmask, uint32_t *gateway);
+
+/**
+ * Send a UDP datagram from several buffers
+ * The buffers are not copied: leave them untouched until net_wait() on
+ * the returned fence. Resolving the next hop may wait for an ARP reply.
+ *
+ * @param dst Destination address
+ * @param dst_port Destination port
+ * @param src_port Source port
+ * @param bufs Payload buffers (device-readable)
+ * @param count Number of buffers, at most UDP_SEND_BUFS
+ * @return Fence of the send, 0 on error
+ */
+uint64_t udp_sendv(uint32_t dst, uint16_t dst_port, uint16_t src_port,
+                   const virtq_buf_t *bufs, uint16_t count);
+
+/**
+ * Send a UDP datagram from one buffer (see udp_sendv())
+ */
+uint64_t udp_send(uint32_t dst, uint16_t dst_port, uint16_t src_port,
+                  const void *data, size_t len);
+
+/**
+ * Wait until every send up to a fence is done with its buffers
+ *
+ * @return 0 on success, -1 on timeout
+ */
+int net_wait(uint64_t fence);
+
+/**
+ * Parse a dotted-quad address
+ *
+ * @return 0 on success, -1 if str is not one
+ */
+int net_parse_addr(const char *str, uint32_t *addr);
+
+/**
+ * Format an address as a dotted quad (buf needs 16 bytes)
+ */
+void net_format_addr(uint32_t addr, char *buf, size_t size);
+
+/**
+ * Format a MAC address (buf needs 18 bytes)
+ */
+void net_format_mac(const uint8_t mac[VIRTIO_NET_ALEN], char *buf, size_t size);
+
+/**
+ * Get network statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void net_get_stats(net_stats_t *stats);
+
+#endif /* AEOS_NET_H */
+
+/* ============================================================================
+ * End of net.h
+ * ============================================================================ */
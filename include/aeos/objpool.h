@@ -0,0 +1,126 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/objpool.h
+ * Description: Typed object pools for hot kernel objects
+ * ============================================================================ */
+
+#ifndef AEOS_OBJPOOL_H
+#define AEOS_OBJPOOL_H
+
+#include <aeos/types.h>
+#include <aeos/mm.h>
+#include <aeos/slab.h>
+#include <aeos/spinlock.h>
+
+/*
+ * A pool keeps a stack of ready objects in front of a slab cache (or, for
+ * page pools, the PMM), so an allocation or free that hits the stack costs
+ * one pointer pop or push under the pool's lock. The backing cache is
+ * created on first use, so pools are defined statically and need no init.
+ *
+ * An optional constructor runs once, when an object is first taken from
+ * backing memory; callers return objects to the pool in their constructed
+ * state. Page pools zero their blocks as they enter the pool, so a page
+ * pool allocation is always pre-zeroed.
+ */
+
+/* Ready objects a pool holds; frees beyond this go back to backing memory */
+#define OBJPOOL_MAX_FREE    32
+
+/* Maximum number of pools in a report */
+#define OBJPOOL_MAX_POOLS   16
+
+/* Pool flags */
+#define OBJPOOL_PAGES       (1U << 0)   /* Objects are page blocks from the PMM */
+#define OBJPOOL_ZERO        (1U << 1)   /* Objects are zeroed as they enter the pool */
+
+/* Puts a new object in its constructed state */
+typedef void (*objpool_ctor_t)(void *obj);
+
+/* Object pool (define with OBJPOOL_INIT or OBJPOOL_PAGES_INIT) */
+typedef struct objpool {
+    const char *name;                   /* Pool name (not copied) */
+    size_t size;                        /* Object size in bytes */
+    uint32_t order;                     /* Page pools: block order */
+    uint32_t flags;
+    objpool_ctor_t ctor;                /* Optional constructor */
+    kmem_cache_t *cache;                /* Backing cache, created on first use */
+    void *free[OBJPOOL_MAX_FREE];       /* Ready objects, a stack */
+    uint32_t nr_free;
+    uint32_t objects;                   /* Taken from backing memory, not returned */
+    uint64_t allocs;
+    uint64_t hits;                      /* Allocations popped off the stack */
+    uint64_t frees;
+    struct objpool *next;               /* Registered pools, for reporting */
+    bool registered;
+    spinlock_t lock;                    /* Protects the stack and counters */
+} objpool_t;
+
+/* Pool of objects of a type, from a slab cache */
+#define OBJPOOL_INIT(pool_name, type, ctor_fn) { \
+    .name = (pool_name), \
+    .size = sizeof(type), \
+    .ctor = (ctor_fn), \
+    .lock = SPINLOCK_INIT, \
+}
+
+/* Pool of pre-zeroed 2^order page blocks, from the PMM */
+#define OBJPOOL_PAGES_INIT(pool_name, block_order) { \
+    .name = (pool_name), \
+    .size = (size_t)PAGE_SIZE << (block_order), \
+    .order = (block_order), \
+    .flags = OBJPOOL_PAGES | OBJPOOL_ZERO, \
+    .lock = SPINLOCK_INIT, \
+}
+
+/* Per-pool statistics */
+typedef struct {
+    const char *name;
+    size_t obj_size;
+    uint32_t objects;                   /* In use plus ready */
+    uint32_t ready;                     /* On the stack */
+    uint64_t allocs;
+    uint64_t hits;                      /* Allocations served by a pop */
+    uint64_t frees;
+} objpool_stats_t;
+
+/**
+ * Allocate an object - a pointer pop when the pool has one ready
+ * Otherwise the object comes from backing memory and is constructed.
+ *
+ * @param pool Pool to allocate from
+ * @return Pointer to object, or NULL if out of memory
+ */
+void *objpool_alloc(objpool_t *pool);
+
+/**
+ * Return an object to its pool, in its constructed state
+ *
+ * @param pool Pool the object came from
+ * @param obj Object (NULL is ignored)
+ */
+void objpool_free(objpool_t *pool, void *obj);
+
+/**
+ * Fill a pool's stack with ready objects ahead of demand
+ *
+ * @param pool Pool to fill
+ * @param count Ready objects wanted (at most OBJPOOL_MAX_FREE)
+ * @return 0 on success, -1 if backing memory ran out
+ */
+int objpool_reserve(objpool_t *pool, uint32_t count);
+
+/**
+ * Copy out statistics for every pool that has been used
+ *
+ * @param out Array of max entries
+ * @param max Entries wanted
+ * @return Entries filled in
+ */
+uint32_t objpool_get_stats(objpool_stats_t *out, uint32_t max);
+
+#endif /* AEOS_OBJPOOL_H */
+
+/* ============================================================================
+ * End of objpool.h
+ * ============================================================================ */
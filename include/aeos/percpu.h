@@ -0,0 +1,98 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/percpu.h
+ * Description: Per-CPU statistics counters
+ * ============================================================================ */
+
+#ifndef AEOS_PERCPU_H
+#define AEOS_PERCPU_H
+
+#include <aeos/types.h>
+#include <aeos/smp.h>
+
+/*
+ * A hot counter shared by every CPU moves its cache line to whichever core
+ * bumped it last. Per-CPU counters give each CPU its own copy, on lines no
+ * other CPU writes, and a read sums the copies. Sums are not a snapshot:
+ * adds racing a read may show in some copies and not others.
+ *
+ * percpu_counter_t holds a single counter. A subsystem with many counters
+ * keeps a PERCPU_ALIGNED struct of them per CPU instead, adds with
+ * percpu_add() on the calling CPU's copy and reads with percpu_sum().
+ */
+
+/* Keeps each CPU's copy on cache lines of its own */
+#define PERCPU_ALIGNED      __attribute__((aligned(CACHE_LINE_SIZE)))
+
+/* One counter, a copy per CPU */
+typedef struct {
+    struct {
+        uint64_t val;
+    } PERCPU_ALIGNED cpu[MAX_CPUS];
+} percpu_counter_t;
+
+/**
+ * Add to a counter in the calling CPU's copy
+ * The exclusive pair makes the add safe against an interrupt on this CPU,
+ * and against the caller moving to another CPU after picking the copy
+ * (the add then lands in the old CPU's copy, which a sum does not mind).
+ *
+ * @param p Counter in the calling CPU's copy
+ * @param val Amount to add
+ */
+static inline void percpu_add(uint64_t *p, uint64_t val)
+{
+    __atomic_add_fetch(p, val, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum a counter over every CPU's copy
+ *
+ * @param first The counter in CPU 0's copy
+ * @param stride Bytes from one CPU's copy to the next
+ * @return Sum of the copies
+ */
+static inline uint64_t percpu_sum(const uint64_t *first, size_t stride)
+{
+    const uint8_t *p = (const uint8_t *)first;
+    uint64_t sum = 0;
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        sum += *(const volatile uint64_t *)(p + cpu * stride);
+    }
+    return sum;
+}
+
+static inline void percpu_counter_add(percpu_counter_t *c, uint64_t val)
+{
+    percpu_add(&c->cpu[smp_processor_id()].val, val);
+}
+
+static inline void percpu_counter_inc(percpu_counter_t *c)
+{
+    percpu_add(&c->cpu[smp_processor_id()].val, 1);
+}
+
+/**
+ * Sum of a counter over all CPUs
+ */
+static inline uint64_t percpu_counter_read(const percpu_counter_t *c)
+{
+    return percpu_sum(&c->cpu[0].val, sizeof(c->cpu[0]));
+}
+
+/**
+ * One CPU's copy of a counter
+ */
+static inline uint64_t percpu_counter_read_cpu(const percpu_counter_t *c,
+                                               uint32_t cpu)
+{
+    return *(const volatile uint64_t *)&c->cpu[cpu].val;
+}
+
+#endif /* AEOS_PERCPU_H */
+
+/* ============================================================================
+ * End of percpu.h
+ * ============================================================================ */
@@ -13,18 +13,25 @@
 #define PFLASH_BASE 0x04000000
 #define PFLASH_SIZE (64 * 1024 * 1024)  /* 64MB */
 
+/* Erase unit (QEMU virt: 256 sectors per bank) */
+#define PFLASH_SECTOR_SIZE (256 * 1024)
+
 /**
  * Initialize pflash persistence
+ * Registers the "pflash" block device
  */
 void pflash_init(void);
 
 /**
  * Write data to pflash
+ * Erases and reprograms the sectors it touches as needed.
+ * @return 0 on success, -1 on error
  */
 int pflash_write(uint32_t offset, const void *data, size_t size);
 
 /**
  * Read data from pflash
+ * @return 0 on success, -1 on error
  */
 int pflash_read(uint32_t offset, void *data, size_t size);
 
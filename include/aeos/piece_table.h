@@ -0,0 +1,185 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/piece_table.h
+ * Description: Piece table text storage interface
+ * ============================================================================ */
+
+#ifndef AEOS_PIECE_TABLE_H
+#define AEOS_PIECE_TABLE_H
+
+#include <aeos/types.h>
+
+/* Buffers the pieces refer to */
+#define PT_BUF_ORIG     0               /* File contents as loaded */
+#define PT_BUF_ADD      1               /* Everything inserted since */
+#define PT_NUM_BUFS     2
+
+/* Append-only text buffer with an index of its newlines */
+typedef struct {
+    char *data;
+    uint32_t len;
+    uint32_t capacity;
+    uint32_t *newlines;                 /* Offsets of '\n' in data, ascending */
+    uint32_t num_newlines;
+    uint32_t newlines_capacity;
+} pt_buffer_t;
+
+/* A run of text in one buffer */
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    uint8_t buf;                        /* PT_BUF_ORIG or PT_BUF_ADD */
+} pt_span_t;
+
+/* Ordered list of runs, e.g. a yank register */
+typedef struct {
+    pt_span_t *spans;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t len;                       /* Total bytes over all spans */
+} pt_span_list_t;
+
+typedef struct pt_node pt_node_t;
+
+/*
+ * The document is the in-order sequence of pieces held in a balanced tree.
+ * Each node caches the bytes and newlines below it, so offsets and line
+ * starts are found in O(log n). Buffer text never moves or changes once
+ * written, so spans stay valid for the life of the table.
+ */
+typedef struct {
+    pt_buffer_t bufs[PT_NUM_BUFS];
+    pt_node_t *root;
+    pt_node_t *spare[2];                /* Preallocated for piece splits */
+} piece_table_t;
+
+/* Called for each run of text in document order */
+typedef int (*pt_text_fn)(void *ctx, const char *text, uint32_t len);
+
+/**
+ * Initialize an empty piece table
+ * @return 0 on success, -1 on allocation failure
+ */
+int pt_init(piece_table_t *pt);
+
+/**
+ * Replace the document with a loaded file
+ * The table takes ownership of data, which must come from kmalloc.
+ *
+ * @return 0 on success, -1 on failure (data is freed either way)
+ */
+int pt_load(piece_table_t *pt, char *data, uint32_t len);
+
+/**
+ * Free all pieces and buffers
+ */
+void pt_destroy(piece_table_t *pt);
+
+/**
+ * Document length in bytes
+ */
+uint32_t pt_length(const piece_table_t *pt);
+
+/**
+ * Number of lines (newlines + 1)
+ */
+uint32_t pt_line_count(const piece_table_t *pt);
+
+/**
+ * Number of pieces the document is made of
+ */
+uint32_t pt_piece_count(const piece_table_t *pt);
+
+/**
+ * Line holding an offset
+ */
+uint32_t pt_line_of(const piece_table_t *pt, uint32_t pos);
+
+/**
+ * Offset of the first byte of a line
+ * Lines past the end give the document length.
+ */
+uint32_t pt_line_start(const piece_table_t *pt, uint32_t line);
+
+/**
+ * Length of a line, not counting its newline
+ */
+uint32_t pt_line_length(const piece_table_t *pt, uint32_t line);
+
+/**
+ * Insert text at an offset
+ * @return 0 on success, -1 on failure (document unchanged)
+ */
+int pt_insert(piece_table_t *pt, uint32_t pos, const char *text, uint32_t len);
+
+/**
+ * Insert previously copied runs at an offset
+ * No text is copied; the new pieces refer to the same buffer runs.
+ *
+ * @return 0 on success, -1 on failure (document unchanged)
+ */
+int pt_insert_spans(piece_table_t *pt, uint32_t pos, const pt_span_list_t *list);
+
+/**
+ * Delete a range
+ *
+ * @param removed If not NULL, receives the deleted runs
+ * @return 0 on success, -1 on failure (document unchanged)
+ */
+int pt_delete(piece_table_t *pt, uint32_t pos, uint32_t len, pt_span_list_t *removed);
+
+/**
+ * Detach a range, keeping its pieces as a tree of their own
+ * The detached pieces can later be reattached with pt_paste, anywhere and
+ * at O(log n) cost whatever their size, or freed with pt_free_pieces.
+ *
+ * @param out Receives the detached pieces (NULL for an empty range)
+ * @return 0 on success, -1 on failure (document unchanged)
+ */
+int pt_cut(piece_table_t *pt, uint32_t pos, uint32_t len, pt_node_t **out);
+
+/**
+ * Reattach pieces detached by pt_cut at an offset
+ * @return 0 on success, -1 on failure (document and pieces unchanged)
+ */
+int pt_paste(piece_table_t *pt, uint32_t pos, pt_node_t *pieces);
+
+/**
+ * Free pieces detached by pt_cut
+ */
+void pt_free_pieces(pt_node_t *pieces);
+
+/**
+ * Append the runs covering a range to a span list
+ * @return 0 on success, -1 on allocation failure
+ */
+int pt_copy_spans(const piece_table_t *pt, uint32_t pos, uint32_t len,
+                  pt_span_list_t *out);
+
+/**
+ * Copy a range out as text
+ * @return Bytes copied
+ */
+uint32_t pt_read(const piece_table_t *pt, uint32_t pos, char *dst, uint32_t len);
+
+/**
+ * Call fn for each run of the document in order
+ * Stops at the first non-zero return and passes it back.
+ */
+int pt_for_each(const piece_table_t *pt, pt_text_fn fn, void *ctx);
+
+/**
+ * Empty a span list, keeping its storage
+ */
+void pt_spans_clear(pt_span_list_t *list);
+
+/**
+ * Free a span list's storage
+ */
+void pt_spans_free(pt_span_list_t *list);
+
+#endif /* AEOS_PIECE_TABLE_H */
+
+/* ============================================================================
+ * End of piece_table.h
+ * ============================================================================ */
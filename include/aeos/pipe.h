@@ -0,0 +1,42 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/pipe.h
+ * Description: Kernel pipes between processes
+ * ============================================================================ */
+
+#ifndef AEOS_PIPE_H
+#define AEOS_PIPE_H
+
+#include <aeos/types.h>
+#include <aeos/mm.h>
+
+/*
+ * A pipe is a ring buffer of PMM pages with a read end and a write end,
+ * each an ordinary file descriptor (vfs_read/vfs_write/vfs_close). A
+ * reader blocks while the pipe is empty and sees end of file (0) once
+ * every write end is closed; a writer blocks while it is full and gets
+ * -1 once every read end is closed. Ends can be shared with other
+ * processes through vfs_fd_install(); the pipe is freed when both of its
+ * ends are closed everywhere. Pipe ends cannot be seeked or mapped.
+ *
+ * A read end opened with O_NONBLOCK never waits: an empty pipe with a
+ * writer left returns VFS_WOULD_BLOCK, so a GUI task can poll it.
+ */
+
+/* Buffer, 2^order pages */
+#define PIPE_ORDER      2
+#define PIPE_SIZE       (PAGE_SIZE << PIPE_ORDER)
+
+/**
+ * Create a pipe in the current process
+ * @param fds Receives the read end in fds[0] and the write end in fds[1]
+ * @param flags O_NONBLOCK for a read end that never waits, or 0
+ * @return 0 on success, -1 on error
+ */
+int pipe_open(int fds[2], uint32_t flags);
+
+#endif /* AEOS_PIPE_H */
+
+/* ============================================================================
+ * End of pipe.h
+ * ============================================================================ */
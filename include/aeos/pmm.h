@@ -9,6 +9,7 @@
 
 #include <aeos/types.h>
 #include <aeos/mm.h>
+#include <aeos/memprof.h>
 
 /* Maximum buddy order (2^MAX_ORDER pages) */
 #define PMM_MAX_ORDER   10          /* Up to 2^10 = 1024 pages = 4MB */
@@ -24,21 +25,32 @@ typedef struct {
     size_t free_pages;          /* Currently free pages */
     size_t used_pages;          /* Currently used pages */
     size_t reserved_pages;      /* Reserved pages (kernel, etc.) */
+    size_t largest_free_pages;  /* Largest free contiguous block */
+    size_t pcp_pages;           /* Free pages held on per-CPU lists */
+    size_t pcp_hits;            /* Order-0 allocations served per-CPU */
+    size_t pcp_misses;          /* Order-0 allocations that refilled */
+    size_t wmark_min;           /* Below: allocations reclaim first */
+    size_t wmark_low;           /* Below: kreclaimd is woken */
+    size_t wmark_high;          /* kreclaimd stops here */
 } pmm_stats_t;
 
+/* Watermarks: min is 1/PMM_WMARK_DIV of RAM, low and high 2x and 3x that */
+#define PMM_WMARK_DIV       256
+#define PMM_WMARK_MIN_PAGES 32
+
 /**
  * Initialize the Physical Memory Manager
  *
- * @param mem_start Start of usable physical memory
- * @param mem_end End of usable physical memory
- * @param kernel_end End of kernel in physical memory
- *
  * This function:
- * - Sets up the buddy allocator data structures
- * - Marks kernel memory as reserved
- * - Makes remaining memory available for allocation
+ * - Sizes the page map for the span memblock reports and allocates it
+ *   from memblock
+ * - Puts every range memblock left free on the buddy lists; what it
+ *   reserved (kernel, heap, device tree, initrd) is never allocated
+ * - Retires memblock
+ *
+ * Run after memblock_init() and the early memblock allocations.
  */
-void pmm_init(uint64_t mem_start, uint64_t mem_end, uint64_t kernel_end);
+void pmm_init(void);
 
 /**
  * Allocate 2^order contiguous physical pages
@@ -50,17 +62,23 @@ void pmm_init(uint64_t mem_start, uint64_t mem_end, uint64_t kernel_end);
  * - If block of requested size is available, return it
  * - Otherwise, split larger block recursively
  * - O(log n) time complexity
+ * Single pages come from a per-CPU hot list and only touch the shared
+ * buddy lists (under a spinlock) once per batch. Safe to call from IRQs.
+ * Only those slow paths compare free memory with the watermarks. When
+ * nothing fits, registered shrinkers are run with rising pressure and
+ * the allocation retried after each pass (see shrinker.h).
+ * pmm_alloc_pages and pmm_alloc_page are macros passing their call site to
+ * the allocation profiler (see memprof.h).
  */
-uint64_t pmm_alloc_pages(uint32_t order);
+uint64_t pmm_alloc_pages_at(uint32_t order, const char *site);
+#define pmm_alloc_pages(order)      pmm_alloc_pages_at((order), MEMPROF_SITE)
 
 /**
  * Allocate a single physical page
  *
  * @return Physical address of allocated page, or 0 on failure
  */
-static inline uint64_t pmm_alloc_page(void) {
-    return pmm_alloc_pages(0);
-}
+#define pmm_alloc_page()            pmm_alloc_pages_at(0, MEMPROF_SITE)
 
 /**
  * Free 2^order contiguous physical pages
@@ -85,6 +103,34 @@ static inline void pmm_free_page(uint64_t addr) {
     pmm_free_pages(addr, 0);
 }
 
+/*
+ * Shared pages
+ *
+ * A page may have several owners, such as the address spaces sharing it
+ * copy-on-write. Each page has a count of owners beyond the first, so an
+ * allocated page starts with one owner, and pmm_page_put() frees it when
+ * the last one lets go. Counts saturate at PMM_PAGE_MAX_SHARE extra owners.
+ */
+#define PMM_PAGE_MAX_SHARE  255
+
+/**
+ * Add an owner to an allocated single page
+ * @param addr Physical address of the page
+ * @return 0 on success, -1 if the count is saturated (copy the page instead)
+ */
+int pmm_page_share(uint64_t addr);
+
+/**
+ * Drop an owner of a single page, freeing it with the last one
+ * @param addr Physical address of the page
+ */
+void pmm_page_put(uint64_t addr);
+
+/**
+ * Check whether a single page has more than one owner
+ */
+bool pmm_page_shared(uint64_t addr);
+
 /**
  * Reserve a range of physical memory (mark as unavailable)
  *
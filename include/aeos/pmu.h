@@ -0,0 +1,102 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/pmu.h
+ * Description: ARMv8 Performance Monitors Unit (PMU) interface
+ * ============================================================================ */
+
+#ifndef AEOS_PMU_H
+#define AEOS_PMU_H
+
+#include <aeos/types.h>
+
+/* PMU overflow PPI on QEMU virt */
+#define PMU_PPI                 23
+
+/* Common architectural events (PMEVTYPER.evtCount) */
+#define PMU_EV_L1D_CACHE_REFILL 0x03
+#define PMU_EV_INST_RETIRED     0x08
+#define PMU_EV_BR_MIS_PRED      0x10
+#define PMU_EV_CPU_CYCLES       0x11
+
+/* Counted values; events the CPU doesn't implement are left out of valid */
+#define PMU_CYCLES              0
+#define PMU_INSTRUCTIONS        1
+#define PMU_CACHE_MISSES        2
+#define PMU_BRANCH_MISSES       3
+#define PMU_NUM_COUNTS          4
+
+/**
+ * Counts accumulated by one process (or a sample of them)
+ * Counts include EL0 and EL1 time spent on the process's behalf.
+ */
+typedef struct {
+    uint64_t count[PMU_NUM_COUNTS];
+} pmu_counts_t;
+
+/**
+ * PMU statistics
+ */
+typedef struct {
+    bool available;             /* PMUv3 present and set up */
+    uint32_t num_counters;      /* Event counters the CPU implements */
+    uint32_t valid;             /* Bit per PMU_* count being counted */
+    uint64_t overflows;         /* Event counter wraps folded in */
+} pmu_stats_t;
+
+/**
+ * Initialize the PMU on the boot CPU
+ * Checks for PMUv3, picks the events the CPU supports and starts counting.
+ */
+void pmu_init(void);
+
+/**
+ * Start counting on the calling secondary CPU
+ * Must be called after pmu_init() has run on the boot CPU
+ */
+void pmu_init_cpu(void);
+
+/**
+ * Check whether PMU counts are available
+ */
+bool pmu_available(void);
+
+/**
+ * Bitmask of the PMU_* counts that are being counted
+ */
+uint32_t pmu_valid_counts(void);
+
+/**
+ * Read the calling CPU's cycle counter (PMCCNTR_EL0)
+ *
+ * @return CPU cycles since the PMU was started, 0 without a PMU
+ */
+uint64_t pmu_cycles(void);
+
+/**
+ * Charge this CPU's counts since the last switch to the outgoing process
+ * Called by the scheduler with IRQs masked.
+ *
+ * @param acc Outgoing process's counts (NULL: just restart the interval)
+ */
+void pmu_switch(pmu_counts_t *acc);
+
+/**
+ * Read the current process's counts so far
+ * Safe against preemption and against migration between CPUs.
+ *
+ * @param out Receives the counts
+ */
+void pmu_read_self(pmu_counts_t *out);
+
+/**
+ * Get PMU statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void pmu_get_stats(pmu_stats_t *stats);
+
+#endif /* AEOS_PMU_H */
+
+/* ============================================================================
+ * End of pmu.h
+ * ============================================================================ */
@@ -8,13 +8,34 @@
 #define AEOS_PROCESS_H
 
 #include <aeos/types.h>
+#include <aeos/pmu.h>
+#include <aeos/fpsimd.h>
 
-/* Forward declaration for VFS file descriptor table */
+/* Forward declarations for VFS file descriptor table, inodes and address spaces */
 struct vfs_fd_table;
+struct vfs_inode;
+struct mmu_space;
+struct arena;
+
+/* Working directory path length (MAX_PATH_LEN) */
+#define PROCESS_PATH_LEN    256
 
 /* Process stack size (4KB per process) */
 #define PROCESS_STACK_SIZE  4096
 
+/* Largest kernel stack process_alloc_stack() hands out, 2^order pages */
+#define PROCESS_STACK_MAX_ORDER 3
+
+/* Scratch arena blocks, 2^order pages */
+#define PROCESS_SCRATCH_ORDER   2
+
+/* User stack: reserved below the top of the user range, pages filled in on
+ * first touch, with an unmapped guard page below the reservation */
+#define PROCESS_USER_STACK_SIZE (1024 * 1024)
+
+/* Name kept for user processes (their path's last component) */
+#define PROCESS_NAME_LEN    32
+
 /**
  * Process states
  */
@@ -45,14 +66,36 @@ typedef struct process {
     /* Memory management */
     void *stack_base;               /* Base of stack allocation */
     size_t stack_size;              /* Stack size (bytes) */
+    struct arena *scratch;          /* Scratch arena, created on first use */
 
     /* File system */
     struct vfs_fd_table *fd_table;  /* File descriptor table */
+    struct vfs_inode *cwd;          /* Working directory (NULL: root) */
+    char cwd_path[PROCESS_PATH_LEN]; /* Its absolute path */
+    int stdin_fd;                   /* Standard input, -1: the console */
+    int stdout_fd;                  /* Where kprintf() goes, -1: the console */
 
     /* Scheduling */
     struct process *next;           /* Next process in scheduler queue */
     uint64_t time_slice;            /* Time quantum (for preemptive scheduling) */
     uint64_t total_time;            /* Total CPU time used */
+    uint32_t cpu;                   /* CPU whose ready queue owns this process */
+    volatile bool on_cpu;           /* Registers live on a CPU: not stealable */
+    int32_t nice;                   /* -20 (favoured) to 19, inherited */
+    uint32_t prio;                  /* Run queue level, 0 highest (scheduler) */
+    bool boosted;                   /* Woken from a block, quantum not used up */
+    pmu_counts_t pmu;               /* PMU counts charged at context switch */
+    struct process *all_next;       /* On the list of live processes */
+
+    /* User mode (mm is NULL for kernel threads) */
+    struct mmu_space *mm;           /* Address space loaded into TTBR0 */
+    uint64_t user_entry;            /* EL0 entry point */
+    uint64_t user_stack_top;        /* Initial SP_EL0 */
+    uint64_t user_stack_limit;      /* Lowest address the stack may grow to */
+    char user_name[PROCESS_NAME_LEN];
+    uint32_t preempt_count;         /* preempt_disable() depth */
+    uint32_t fpsimd_cpu;            /* CPU it last loaded fpsimd on */
+    fpsimd_state_t fpsimd;          /* FP/SIMD registers while not live */
 
 } process_t;
 
@@ -70,12 +113,101 @@ typedef void (*process_entry_t)(void);
  */
 process_t *process_create(process_entry_t entry_point, const char *name);
 
+/**
+ * Allocate a process without adding it to the scheduler
+ * Used for per-CPU idle processes, which never sit on a ready queue.
+ *
+ * @param entry_point Function to execute
+ * @param name Process name (for debugging)
+ * @return Pointer to new PCB, or NULL on failure
+ */
+process_t *process_alloc(process_entry_t entry_point, const char *name);
+
+/**
+ * Allocate a process with a larger kernel stack
+ * For processes that run shell commands, whose frames outgrow a page.
+ * Not added to the scheduler, like process_alloc().
+ *
+ * @param entry_point Function to execute
+ * @param name Process name (for debugging)
+ * @param order Stack of 2^order pages, at most PROCESS_STACK_MAX_ORDER
+ * @return Pointer to new PCB, or NULL on failure
+ */
+process_t *process_alloc_stack(process_entry_t entry_point, const char *name,
+                               uint32_t order);
+
+/**
+ * Create a user process from an ELF executable
+ * The program gets its own address space and runs at EL0; its stack
+ * grows on demand up to PROCESS_USER_STACK_SIZE.
+ *
+ * @param path Path of the executable
+ * @return Pointer to new PCB, or NULL on failure
+ */
+process_t *process_create_user(const char *path);
+
+/**
+ * Scratch arena of the current process
+ * For short-lived kernel work; the caller frees what it allocated with
+ * arena_release() or arena_reset(). Destroyed when the process exits.
+ *
+ * @return Arena, or NULL with no current process or no memory
+ */
+struct arena *process_scratch(void);
+
+/**
+ * Return a process's kernel stack to the stack pool
+ * Used for the boot context, which keeps running on the boot stack.
+ *
+ * @param proc Process whose stack to release
+ */
+void process_release_stack(process_t *proc);
+
+/**
+ * Clone the current user process
+ * Must be called from a system call of the process. The child gets a
+ * copy-on-write clone of its address space (see mmu_space_clone()) and
+ * shares its fd table, so opens and closes in either show in both. It
+ * starts by returning to EL0 from the same system call, with 0 in x0.
+ * Kernel threads have no address space and cannot be cloned.
+ *
+ * @return The child, already runnable, or NULL on failure
+ */
+process_t *process_clone(void);
+
+/**
+ * Resolve a translation fault in the current process's user range
+ * Installed as the MMU's user fault handler: fills in stack pages.
+ *
+ * @return 0 if a page was mapped (retry the access), -1 otherwise
+ */
+int process_user_fault(uint64_t va, bool write);
+
 /**
  * Exit current process
  * Marks process as ZOMBIE and yields to scheduler
  */
 void process_exit(void) __attribute__((noreturn));
 
+/**
+ * Free a process from process_alloc() that was never made runnable
+ * Closes the files in its table.
+ *
+ * @param proc Process to free
+ */
+void process_discard(process_t *proc);
+
+/**
+ * Free an exited process's PCB and kernel stack
+ * For a creator that waited for its child to exit and holds the only
+ * pointer left to it. Fails while the process is still live, or still
+ * on its CPU on its way out.
+ *
+ * @param proc Zombie process
+ * @return 0 if freed, -1 if it cannot be freed yet
+ */
+int process_reap(process_t *proc);
+
 /**
  * Get current running process
  *
@@ -91,6 +223,27 @@ process_t *process_current(void);
  */
 process_t *process_get_by_pid(uint64_t pid);
 
+/* A live process, as listed by process_list() */
+typedef struct {
+    uint64_t pid;
+    const char *name;
+    process_state_t state;
+    uint32_t cpu;
+    int32_t nice;
+    uint32_t prio;
+    bool boosted;
+    uint64_t total_time;            /* Timer ticks it has run for */
+} process_info_t;
+
+/**
+ * List the live processes, oldest first
+ *
+ * @param info Array to fill
+ * @param max Its length
+ * @return Number of live processes (can be more than max)
+ */
+uint32_t process_list(process_info_t *info, uint32_t max);
+
 /**
  * Initialize process subsystem
  * Creates the kernel idle process
@@ -0,0 +1,94 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/profile.h
+ * Description: Sampling profiler interface
+ * ============================================================================ */
+
+#ifndef AEOS_PROFILE_H
+#define AEOS_PROFILE_H
+
+#include <aeos/types.h>
+#include <aeos/interrupts.h>
+
+/* Samples held per CPU; later samples are dropped until the next start */
+#define PROF_MAX_SAMPLES    2048
+
+/* Frames kept per sample, interrupted PC first */
+#define PROF_MAX_DEPTH      8
+
+/* One timer-tick sample */
+typedef struct {
+    uint64_t pc[PROF_MAX_DEPTH];
+    uint8_t depth;
+    uint8_t user;                       /* Interrupted EL0 (pc[0] only) */
+    uint16_t reserved[3];
+} prof_sample_t;
+
+/* Profiler statistics */
+typedef struct {
+    bool running;
+    uint64_t samples;                   /* Held, all CPUs */
+    uint64_t user;                      /* Of those, taken in EL0 */
+    uint64_t dropped;                   /* Buffers were full */
+    uint64_t elapsed_ns;                /* Since start (to stop if stopped) */
+} prof_stats_t;
+
+/**
+ * Called for each function and its sample count, hottest first
+ */
+typedef void (*prof_report_fn)(const char *name, uint64_t samples, void *ctx);
+
+/**
+ * Record the interrupted context (timer interrupt only)
+ * Does nothing unless the profiler is running.
+ *
+ * @param context Saved registers of the interrupted code
+ * @param user True if the interrupt came from EL0
+ */
+void profile_sample(const cpu_context_t *context, bool user);
+
+/**
+ * Discard earlier samples and start sampling on all CPUs
+ * @return 0 on success, -1 if the buffers could not be allocated
+ */
+int profile_start(void);
+
+/**
+ * Stop sampling (samples are kept for the report)
+ */
+void profile_stop(void);
+
+/**
+ * Report the functions with the most samples
+ * Samples taken in EL0 are reported as "[user]", addresses outside the
+ * kernel's symbol table as "[unknown]".
+ *
+ * @param top Most functions to report
+ * @param fn Called once per function
+ * @param ctx Passed to fn
+ * @return Number reported, or -1 on allocation failure
+ */
+int profile_report(uint32_t top, prof_report_fn fn, void *ctx);
+
+/**
+ * Write the samples as folded stacks to a host file (semihosting)
+ * One "outer;...;inner 1" line per sample, the input format of
+ * flamegraph.pl.
+ *
+ * @param path Host file name
+ * @return Samples written, or -1 on error
+ */
+int profile_dump_folded(const char *path);
+
+/**
+ * Get profiler statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void profile_get_stats(prof_stats_t *stats);
+
+#endif /* AEOS_PROFILE_H */
+
+/* ============================================================================
+ * End of profile.h
+ * ============================================================================ */
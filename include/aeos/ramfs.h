@@ -10,27 +10,68 @@
 #include <aeos/vfs.h>
 #include <aeos/types.h>
 
-/* Maximum file size in ramfs (256 KB) */
-#define RAMFS_MAX_FILE_SIZE  (256 * 1024)
+/* Maximum file size in ramfs (1 GB: a two-level page tree) */
+#define RAMFS_MAX_FILE_SIZE  (1ULL << 30)
 
-/* Maximum files per directory */
-#define RAMFS_MAX_FILES      64
+/* File page tree: each node is one page of pointers */
+#define RAMFS_RADIX_SHIFT    9
+#define RAMFS_RADIX_SLOTS    (1 << RAMFS_RADIX_SHIFT)
+
+/* Smallest directory hash index (slots, power of two) */
+#define RAMFS_INDEX_MIN      16
 
 /* RAM filesystem directory entry (internal) */
 typedef struct ramfs_dirent {
     char name[64];              /* Entry name */
+    uint32_t hash;              /* Hash of name, checked before strcmp */
     struct vfs_inode *inode;    /* Pointer to child inode */
-    struct ramfs_dirent *next;  /* Next entry */
+    struct ramfs_dirent *next;  /* Next entry (insertion order) */
+    struct ramfs_dirent *prev;  /* Previous entry */
 } ramfs_dirent_t;
 
 /* RAM filesystem inode data */
 typedef struct ramfs_inode {
-    char *data;                 /* File data buffer */
-    size_t data_size;           /* Allocated data size */
-    ramfs_dirent_t *entries;    /* Directory entries (if directory) */
+    /* File data: radix tree of PMM pages, height 0 is a single page.
+     * Missing pages are holes and read as zeroes. */
+    void *pages;
+    uint32_t pages_height;
+    uint32_t map_count;         /* Live vfs_mmap() views; pages must stay put */
+    bool unlinked;              /* Removed while mapped, freed on last unmap */
+
+    /* Changes since the last save, for incremental persistence */
+    uint64_t dirty_gen;         /* Generation of the last change (0 = never) */
+    uint64_t dirty_start;       /* Byte range written, empty when start >= end */
+    uint64_t dirty_end;
+    uint64_t trunc_size;        /* Smallest size the file had */
+
+    ramfs_dirent_t *entries;    /* Directory entries, oldest first (if directory) */
+    ramfs_dirent_t *last;       /* Newest entry */
     size_t num_entries;         /* Number of entries */
+
+    /* Open-addressing hash index of the entries (NULL while empty) */
+    ramfs_dirent_t **index;
+    size_t index_size;          /* Slots, a power of two */
+    size_t index_deleted;       /* Slots left by removed entries */
+
+    /* Where the last readdir stopped, so a listing is not quadratic */
+    ramfs_dirent_t *readdir_entry;
+    size_t readdir_pos;
+
+    /* Read-only lower layer (an initrd): a file is read from it in place
+     * until its first change copies it up into pages; a directory's lower
+     * entries are linked in the first time the directory is used */
+    const uint8_t *lower;       /* File data in the image, NULL once copied up */
+    const void *lower_dir;      /* For the populate callback, NULL once done */
 } ramfs_inode_t;
 
+/**
+ * Links the entries of a lower directory in with ramfs_add_lower()
+ * @param dir ramfs directory (its lower_dir already cleared)
+ * @param lower_dir What ramfs_set_lower_dir() or ramfs_add_lower() was given
+ * @return 0 on success, -1 on error
+ */
+typedef int (*ramfs_populate_fn)(vfs_inode_t *dir, const void *lower_dir);
+
 /**
  * Initialize ramfs filesystem
  * @return Pointer to ramfs filesystem structure
@@ -42,6 +83,120 @@ vfs_filesystem_t *ramfs_create(void);
  */
 void ramfs_destroy(vfs_filesystem_t *fs);
 
+/**
+ * Add an existing inode to a ramfs directory
+ * Used when loading a saved filesystem; entries keep the order they are added in.
+ * @param dir Directory inode
+ * @param name Entry name (fewer than 64 characters)
+ * @param inode Child inode
+ * @return 0 on success, -1 on error (name taken or too long, out of memory)
+ */
+int ramfs_dir_link(vfs_inode_t *dir, const char *name, vfs_inode_t *inode);
+
+/**
+ * Size a directory's index for count more entries
+ * A loader that knows how many entries it will link calls this first, so
+ * the index is built once instead of regrown as they arrive.
+ * @return 0 on success, -1 if not a directory or out of memory
+ */
+int ramfs_dir_reserve(vfs_inode_t *dir, size_t count);
+
+/**
+ * Create a detached inode with a given number
+ * Used when loading a saved filesystem; link it with ramfs_dir_link().
+ * @param fs ramfs filesystem
+ * @param ino Inode number
+ * @param type VFS_FILE_REGULAR or VFS_FILE_DIRECTORY
+ * @param mode Permissions
+ * @return New inode, NULL if out of memory
+ */
+vfs_inode_t *ramfs_alloc_inode(vfs_filesystem_t *fs, uint64_t ino,
+                               vfs_file_type_t type, uint32_t mode);
+
+/**
+ * Free an inode that is in no directory, with its pages and entries
+ * Directory entries are dropped, not the inodes they point to.
+ * @param inode ramfs inode
+ */
+void ramfs_free_inode(vfs_inode_t *inode);
+
+/**
+ * Get the current change generation
+ * Every change to an inode's data, size or entries stamps it with a new
+ * generation; a save records the generation it reached.
+ * @return Generation of the most recent change
+ */
+uint64_t ramfs_get_generation(void);
+
+/**
+ * Forget an inode's dirty byte range once it has been saved
+ * @param inode ramfs inode
+ */
+void ramfs_mark_clean(vfs_inode_t *inode);
+
+/**
+ * Get the page holding a file offset, for zero-copy readers
+ * @param inode ramfs file
+ * @param offset Byte offset in the file
+ * @param len Receives the bytes from offset to the end of the page or file
+ * @return Pointer to the byte at offset, NULL for a hole (len zero bytes)
+ *         or at end of file (len 0)
+ */
+const void *ramfs_file_page(vfs_inode_t *inode, uint64_t offset, size_t *len);
+
+/**
+ * Read file data at an offset (holes read as zeroes)
+ * @return Bytes read, 0 at end of file, -1 on error
+ */
+ssize_t ramfs_read_data(vfs_inode_t *inode, uint64_t offset, void *buf, size_t count);
+
+/**
+ * Write file data at an offset, adding pages as needed
+ * Writing past the end leaves a hole that costs no memory.
+ * @return Bytes written, -1 on error
+ */
+ssize_t ramfs_write_data(vfs_inode_t *inode, uint64_t offset, const void *buf, size_t count);
+
+/**
+ * Cut a file down to a size, freeing the pages past it
+ * @return 0 on success, -1 on error
+ */
+int ramfs_truncate(vfs_inode_t *inode, uint64_t size);
+
+/**
+ * Set the callback that populates lower directories
+ */
+void ramfs_set_populate(ramfs_populate_fn fn);
+
+/**
+ * Layer a lower directory under an empty ramfs directory
+ * @param dir ramfs directory (the root, for a whole image)
+ * @param lower_dir Passed to the populate callback on first use
+ */
+void ramfs_set_lower_dir(vfs_inode_t *dir, const void *lower_dir);
+
+/**
+ * Add an entry backed by the lower layer to a directory
+ * @param dir ramfs directory being populated
+ * @param name Entry name (fewer than 64 characters)
+ * @param type VFS_FILE_REGULAR or VFS_FILE_DIRECTORY
+ * @param mode Permissions
+ * @param size File size (0 for a directory)
+ * @param lower File: its data, size bytes that stay in place and unchanged;
+ *              directory: passed to the populate callback on first use
+ * @return New inode, NULL on error
+ */
+vfs_inode_t *ramfs_add_lower(vfs_inode_t *dir, const char *name, vfs_file_type_t type,
+                             uint32_t mode, uint64_t size, const void *lower);
+
+/**
+ * Link a directory's lower entries in, if not done yet
+ * Every ramfs directory operation does this first; walkers that read
+ * ramfs_inode_t entries directly must too.
+ * @return 0 on success, -1 if populating failed
+ */
+int ramfs_dir_populate(vfs_inode_t *dir);
+
 #endif /* AEOS_RAMFS_H */
 
 /* ============================================================================
@@ -8,15 +8,38 @@
 #define AEOS_SCHEDULER_H
 
 #include <aeos/process.h>
+#include <aeos/smp.h>
+
+/*
+ * Ready processes wait on one of SCHED_PRIO_LEVELS FIFOs, 0 first. A
+ * process's nice value sets its level (five nice values a level) and its
+ * quantum (SCHED_SLICE_MIN..MAX ticks in scheduler.c, 10 at nice 0). A
+ * process woken from a block runs SCHED_WAKE_BOOST levels up until it
+ * next uses up a whole quantum, so one that mostly waits for input gets
+ * in ahead of CPU-bound work at the same nice value.
+ */
+#define SCHED_PRIO_LEVELS   8
+#define SCHED_NICE_MIN      (-20)
+#define SCHED_NICE_MAX      19
+#define SCHED_WAKE_BOOST    2
 
 /**
  * Initialize the scheduler
- * Sets up the idle process and ready queue
+ * Sets up the per-CPU ready queues and the boot CPU's idle process, and
+ * turns the running boot context into the "kernel" process on CPU 0
  */
 void scheduler_init(void);
 
 /**
- * Add a process to the scheduler's ready queue
+ * Bring the calling secondary CPU's ready queue online
+ * Creates its idle process; call scheduler_start() afterwards
+ *
+ * @param cpu Logical CPU index
+ */
+void scheduler_init_cpu(uint32_t cpu);
+
+/**
+ * Add a process to the ready queue of the least loaded CPU
  *
  * @param proc Process to add
  */
@@ -30,8 +53,24 @@ void scheduler_add_process(process_t *proc);
 void scheduler_remove_process(process_t *proc);
 
 /**
- * Select the next process to run
- * Uses round-robin algorithm
+ * Change a process's nice value
+ * A queued process moves to its new level at once.
+ *
+ * @param proc Process (not an idle process)
+ * @param nice SCHED_NICE_MIN to SCHED_NICE_MAX
+ * @return 0 on success, -1 if out of range
+ */
+int scheduler_set_nice(process_t *proc, int32_t nice);
+
+/**
+ * Time quantum of a nice value
+ * @return Timer ticks
+ */
+uint32_t scheduler_quantum(int32_t nice);
+
+/**
+ * Select the next process to run on the calling CPU
+ * The head of the best non-empty level
  *
  * @return Next process to execute
  */
@@ -44,16 +83,72 @@ process_t *schedule(void);
  */
 void yield(void);
 
+/**
+ * Block the current process until scheduler_wake()
+ * Callers usually mask IRQs first so the wakeup they arranged cannot run
+ * before the process has actually blocked.
+ */
+void scheduler_block(void);
+
+/**
+ * Block the current process unless a wakeup condition is already set
+ * The flag is read under the run queue lock that scheduler_wake() takes,
+ * so a waker that sets it and then calls scheduler_wake() is never lost,
+ * even from another CPU.
+ *
+ * @param cond Flag the waker sets first (NULL blocks unconditionally)
+ */
+void scheduler_block_unless(const volatile bool *cond);
+
+/**
+ * Make a blocked process runnable again
+ * Safe from interrupt context and from any CPU. A wakeup that arrives
+ * before the target has switched away cancels its block.
+ *
+ * @param proc Process to wake
+ */
+void scheduler_wake(process_t *proc);
+
+/**
+ * Finish a context switch on the new process's stack
+ * Marks the previous process as off the CPU so other CPUs may steal it
+ * (internal - called by yield() and process_trampoline)
+ *
+ * @param prev Process switched away from, or NULL
+ */
+void scheduler_finish_switch(process_t *prev);
+
 /**
  * Timer tick handler for preemptive scheduling
  * Called from timer IRQ handler to decrement time slices
- * and trigger context switches when a process exhausts its quantum
+ * and request a context switch when a process exhausts its quantum
  */
 void scheduler_tick(void);
 
 /**
- * Start the scheduler
- * Begins executing the first process in the ready queue
+ * Perform a requested preemption on IRQ/FIQ exit
+ * Called from vectors.asm after the handler has sent the GIC EOI, with
+ * the interrupted context saved on the current process's stack
+ */
+void scheduler_irq_exit(void);
+
+/**
+ * Keep the current process on this CPU until preempt_enable()
+ * Interrupts still run, but their exit does not switch. Nests; the
+ * process must not block or yield meanwhile.
+ */
+void preempt_disable(void);
+
+/**
+ * Undo preempt_disable(), switching now if a reschedule was put off
+ * The put-off switch waits for the next IRQ exit while IRQs are masked.
+ */
+void preempt_enable(void);
+
+/**
+ * Start the scheduler on the calling CPU
+ * Begins executing the first process in this CPU's ready queue, or its
+ * idle process if the queue is empty
  * This function does not return
  */
 void scheduler_start(void) __attribute__((noreturn));
@@ -65,6 +160,18 @@ typedef struct {
     uint64_t total_processes;       /* Total processes created */
     uint64_t running_processes;     /* Currently active processes */
     uint64_t context_switches;      /* Total context switches */
+    uint64_t steals;                /* Successful work steals */
+    uint64_t stolen;                /* Processes migrated by steals */
+    uint32_t online_cpus;           /* CPUs with a run queue */
+    struct {
+        bool online;
+        uint32_t nr_running;        /* Processes owned by this CPU */
+        uint64_t context_switches;
+        uint64_t steals;            /* Steals performed by this CPU */
+        uint64_t stolen;            /* Processes it took */
+        uint64_t ipis;              /* Reschedule IPIs received */
+        uint64_t preemptions;       /* Switches made on IRQ exit */
+    } cpus[MAX_CPUS];
 } scheduler_stats_t;
 
 void scheduler_get_stats(scheduler_stats_t *stats);
@@ -0,0 +1,99 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/screenrec.h
+ * Description: Screen recording to a host file
+ * ============================================================================ */
+
+#ifndef AEOS_SCREENREC_H
+#define AEOS_SCREENREC_H
+
+#include <aeos/types.h>
+#include <aeos/framebuffer.h>
+
+/*
+ * While recording, wm_present() hands every frame's damage rects to
+ * screenrec_frame(), which encodes them against the previous recorded
+ * frame into a ring buffer. A workqueue item writes the ring out to the
+ * host file, so the compositor never waits for semihosting. A frame that
+ * does not fit in the ring is dropped, and its rects go out with the next
+ * one that does.
+ *
+ * Stream format (little-endian):
+ *
+ *   header  "AEOSREC1", u32 width, u32 height
+ *   frame   u64 ns since the start, u32 rect count, u32 bytes of rects
+ *   rect    u16 x, y, width, height, then ops covering it row by row
+ *
+ * Each op is one byte, 2 bits of kind and 6 of count - 1 (n = 1..64).
+ * Ops never cross the end of a row:
+ *
+ *   00  skip n pixels (unchanged since the last frame)
+ *   01  repeat the next RGB triplet n times
+ *   10  n literal RGB triplets follow
+ *   11  skip n * 64 pixels
+ *
+ * The first frame is the whole screen against a black one.
+ */
+
+#define SCREENREC_MAGIC     "AEOSREC1"
+
+/* Op kinds (top two bits) */
+#define SCREENREC_SKIP      0x00
+#define SCREENREC_REPEAT    0x40
+#define SCREENREC_LITERAL   0x80
+#define SCREENREC_SKIP64    0xC0
+#define SCREENREC_OP_MAX    64          /* Pixels (or 64-pixel blocks) per op */
+
+/* Recording statistics */
+typedef struct {
+    bool active;
+    bool failed;                        /* A host write failed */
+    uint32_t ring_size;                 /* Bytes */
+    uint64_t frames;                    /* Recorded */
+    uint64_t dropped;                   /* No room in the ring */
+    uint64_t pixels;                    /* In recorded rects */
+    uint64_t bytes;                     /* Encoded, header included */
+    uint64_t written;                   /* Sent to the host */
+    uint64_t encode_ns;                 /* Spent in screenrec_frame() */
+    uint64_t max_encode_ns;
+} screenrec_stats_t;
+
+/**
+ * Start recording the screen to a host file (semihosting)
+ * @param path Host file, created or truncated
+ * @return 0 on success, -1 on error or if already recording
+ */
+int screenrec_start(const char *path);
+
+/**
+ * Stop recording: write out what is buffered and close the file
+ * @return 0 on success, -1 if not recording or a write failed
+ */
+int screenrec_stop(void);
+
+/**
+ * Check whether a recording is running
+ */
+bool screenrec_active(void);
+
+/**
+ * Record a presented frame
+ * Called by wm_present() after the swap. Never blocks: a frame is skipped
+ * while recording is being started or stopped.
+ *
+ * @param rects Damage rects of the frame
+ * @param n Number of rects
+ */
+void screenrec_frame(const rect_t *rects, uint32_t n);
+
+/**
+ * Get recording statistics (of the running or the last recording)
+ * @param stats Pointer to stats structure to fill
+ */
+void screenrec_get_stats(screenrec_stats_t *stats);
+
+#endif /* AEOS_SCREENREC_H */
+
+/* ============================================================================
+ * End of screenrec.h
+ * ============================================================================ */
@@ -32,6 +32,9 @@
 #define SEMI_SYS_HEAPINFO    0x16    /* Get heap info */
 #define SEMI_SYS_EXIT        0x18    /* Exit program */
 
+/* SYS_EXIT reason for a normal exit with a status */
+#define ADP_STOPPED_APPLICATION_EXIT 0x20026
+
 /* File open modes (semihosting uses these values, not POSIX) */
 #define SEMIHOST_OPEN_R     0   /* Read only */
 #define SEMIHOST_OPEN_RB    1   /* Read only binary */
@@ -46,9 +49,13 @@
 #define SEMIHOST_OPEN_AP    10  /* Read/append */
 #define SEMIHOST_OPEN_APB   11  /* Read/append binary */
 
+/* Host file behind the "host" block device; it grows as blocks are written */
+#define SEMIHOST_BLK_FILE    "aeos_fs.img"
+#define SEMIHOST_BLK_BLOCKS  (1ULL << 18)    /* 1 GB of block addresses */
+
 /**
  * Initialize semihosting
- * Tests if semihosting is available
+ * Tests if semihosting is available, then registers the "host" block device
  *
  * @return 0 on success, -1 if semihosting not available
  */
@@ -123,4 +130,23 @@ ssize_t semihost_flen(int fd);
  */
 int semihost_remove(const char *path);
 
+/**
+ * Get the program's command line
+ * QEMU passes the -semihosting-config arg= values, or the kernel file
+ * name followed by -append's text.
+ *
+ * @param buf Buffer for the NUL-terminated line
+ * @param len Size of buf
+ * @return 0 on success, -1 on error
+ */
+int semihost_get_cmdline(char *buf, size_t len);
+
+/**
+ * Stop the emulator with an exit status
+ * Does not return; without semihosting the CPU just idles.
+ *
+ * @param code Exit status for the host
+ */
+void semihost_exit(int code) __attribute__((noreturn));
+
 #endif /* AEOS_SEMIHOSTING_H */
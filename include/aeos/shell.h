@@ -15,6 +15,12 @@
 /* Maximum number of arguments */
 #define SHELL_MAX_ARGS 16
 
+/* Commands in one pipeline (a | b | c) */
+#define SHELL_MAX_STAGES 4
+
+/* Pipelines and background jobs running at once */
+#define SHELL_MAX_JOBS 8
+
 /**
  * Initialize shell subsystem
  */
@@ -51,6 +57,16 @@ int shell_parse(char *line, int *argc, char **argv);
  */
 int shell_execute(int argc, char **argv);
 
+/**
+ * Execute a command line
+ * A single command runs in the calling process, as shell_execute() does.
+ * A pipeline (cmd | cmd) runs each command as its own process, joined by
+ * pipes; a trailing '&' leaves it running in the background as a job.
+ * @param line Command line, modified while it is split
+ * @return Exit status of the (last) command, 0 for a background job
+ */
+int shell_execute_line(char *line);
+
 #endif /* AEOS_SHELL_H */
 
 /* ============================================================================
@@ -0,0 +1,121 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/shrinker.h
+ * Description: Cache shrinkers and memory reclaim
+ * ============================================================================ */
+
+#ifndef AEOS_SHRINKER_H
+#define AEOS_SHRINKER_H
+
+#include <aeos/types.h>
+
+/*
+ * A cache that holds memory it could give back registers a shrinker.
+ * count() says how many objects it could free right now, and scan(nr)
+ * frees up to nr of them, least valuable first. Reclaim asks each
+ * shrinker for count >> priority objects (at least one), starting at
+ * SHRINK_PRIORITY_MAX and escalating to 0, where everything goes.
+ *
+ * The PMM watches its free pages against three watermarks (pmm_stats_t):
+ *
+ *   below low   the reclaim process (kreclaimd) is woken, and shrinks
+ *               caches until the high watermark is met again
+ *   below min   an allocation first runs one reclaim pass itself
+ *   exhausted   the allocation escalates through every priority and
+ *               retries after each, and fails only after priority 0
+ *
+ * Both callbacks may run wherever an allocation failed: in an interrupt,
+ * with IRQs masked, with any lock the allocating code holds. They must
+ * not sleep or allocate, and must only try their locks (spin_trylock)
+ * and report nothing to free if they cannot get them.
+ */
+
+/* Lightest pressure: each shrinker is asked for 1/2^N of its objects */
+#define SHRINK_PRIORITY_MAX     3
+
+/* kreclaimd waits this long after a pass that freed nothing */
+#define RECLAIM_BACKOFF_MS      100
+
+/* A registered cache */
+typedef struct shrinker {
+    const char *name;
+    size_t (*count)(void);              /* Objects it could free now */
+    size_t (*scan)(size_t nr);          /* Free up to nr, return the number freed */
+    uint64_t freed;                     /* Objects freed by reclaim */
+    struct shrinker *next;
+} shrinker_t;
+
+/* One shrinker, as shrinker_list() reports it */
+typedef struct {
+    const char *name;
+    size_t count;                       /* Objects it could free now */
+    uint64_t freed;
+} shrinker_info_t;
+
+/* Reclaim statistics */
+typedef struct {
+    uint32_t shrinkers;                 /* Registered */
+    uint64_t direct;                    /* Passes run by allocating code */
+    uint64_t background;                /* Passes run by kreclaimd */
+    uint64_t wakeups;                   /* Times kreclaimd was woken */
+    uint64_t freed;                     /* Objects freed, all shrinkers */
+    uint64_t pages;                     /* PMM pages the passes gave back */
+    uint64_t failures;                  /* Allocations that failed even so */
+} reclaim_stats_t;
+
+/**
+ * Register a shrinker
+ * @param s Shrinker with name, count and scan set (not copied)
+ */
+void shrinker_register(shrinker_t *s);
+
+/**
+ * Unregister a shrinker
+ * Waits for a reclaim pass in progress on another CPU to finish with it.
+ */
+void shrinker_unregister(shrinker_t *s);
+
+/**
+ * Run one reclaim pass over every shrinker
+ * Returns 0 at once if another pass is running, on this CPU or another.
+ *
+ * @param priority 0 (free everything) to SHRINK_PRIORITY_MAX
+ * @param direct Run by allocating code rather than kreclaimd (statistics)
+ * @return Objects freed
+ */
+size_t shrink_caches(uint32_t priority, bool direct);
+
+/**
+ * Start the reclaim process
+ * Before it runs, only direct reclaim happens.
+ */
+void reclaim_init(void);
+
+/**
+ * Wake the reclaim process (called by the PMM below the low watermark)
+ * Safe from any context: the wakeup itself is deferred to a tasklet.
+ */
+void reclaim_wake(void);
+
+/**
+ * Count an allocation that failed after reclaim
+ */
+void reclaim_note_failure(void);
+
+/**
+ * List the registered shrinkers
+ * @return Number written to info
+ */
+uint32_t shrinker_list(shrinker_info_t *info, uint32_t max);
+
+/**
+ * Get reclaim statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void reclaim_get_stats(reclaim_stats_t *stats);
+
+#endif /* AEOS_SHRINKER_H */
+
+/* ============================================================================
+ * End of shrinker.h
+ * ============================================================================ */
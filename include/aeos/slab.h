@@ -0,0 +1,128 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/slab.h
+ * Description: Slab allocator interface - fixed-size object caches
+ * ============================================================================ */
+
+#ifndef AEOS_SLAB_H
+#define AEOS_SLAB_H
+
+#include <aeos/types.h>
+#include <aeos/mm.h>
+
+/*
+ * Every slab is a naturally aligned block of 2^SLAB_ORDER pages taken from
+ * the PMM, with its header at the start. Because buddy blocks are aligned to
+ * their size, the owning slab of any object is found by masking its address.
+ * Each cache keeps one empty slab to save PMM round trips; under memory
+ * pressure the "slab" shrinker gives those back.
+ */
+#define SLAB_ORDER          2
+#define SLAB_SIZE           (PAGE_SIZE << SLAB_ORDER)   /* 16KB */
+
+/* kmalloc size classes: powers of two from 16 bytes to 2KB */
+#define SLAB_MIN_SHIFT      4
+#define SLAB_MAX_SHIFT      11
+#define SLAB_MIN_SIZE       (1UL << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE       (1UL << SLAB_MAX_SHIFT)
+#define SLAB_NUM_CLASSES    (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+/* Largest object a cache can hold (at least four objects per slab) */
+#define SLAB_MAX_OBJ_SIZE   (SLAB_SIZE / 4)
+
+/* Maximum number of caches (size classes included) */
+#define KMEM_MAX_CACHES     32
+
+/* Opaque object cache */
+typedef struct kmem_cache kmem_cache_t;
+
+/* Per-cache statistics */
+typedef struct {
+    const char *name;           /* Cache name */
+    size_t obj_size;            /* Object size in bytes */
+    size_t objs_per_slab;       /* Objects per slab */
+    size_t num_slabs;           /* Slabs currently held */
+    size_t active_objs;         /* Objects currently allocated */
+    size_t total_objs;          /* Object capacity of all slabs */
+    size_t num_allocs;          /* Total allocations */
+    size_t num_frees;           /* Total frees */
+} kmem_cache_stats_t;
+
+/**
+ * Initialize the slab allocator and the kmalloc size classes
+ * Must be called after pmm_init()
+ */
+void slab_init(void);
+
+/**
+ * Create a cache of fixed-size objects
+ *
+ * @param name Cache name (not copied, must stay valid)
+ * @param size Object size in bytes (at most SLAB_MAX_OBJ_SIZE)
+ * @param align Object alignment (0 for the default of 8 bytes)
+ * @return Cache handle, or NULL on failure
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align);
+
+/**
+ * Destroy a cache and return its slabs to the PMM
+ * Fails if any objects are still allocated.
+ *
+ * @return 0 on success, -1 on error
+ */
+int kmem_cache_destroy(kmem_cache_t *cache);
+
+/**
+ * Allocate one object from a cache - O(1)
+ *
+ * @return Pointer to object, or NULL if out of memory
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/**
+ * Return an object to its cache - O(1)
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+ * Get statistics for a cache
+ */
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats);
+
+/**
+ * Allocate from the smallest kmalloc size class that fits
+ *
+ * @param size Requested size (at most SLAB_MAX_SIZE)
+ * @return Pointer to object, or NULL on failure
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * Free an object allocated from any cache
+ */
+void slab_free(void *ptr);
+
+/**
+ * Check whether a pointer belongs to a slab
+ */
+bool slab_owns(const void *ptr);
+
+/**
+ * Get the object size of a slab-allocated pointer
+ *
+ * @return Object size, or 0 if ptr is not a slab object
+ */
+size_t slab_obj_size(const void *ptr);
+
+/**
+ * Get statistics for a kmalloc size class
+ *
+ * @param index Class index (0 = 16 bytes ... SLAB_NUM_CLASSES-1 = 2KB)
+ */
+void slab_get_class_stats(uint32_t index, kmem_cache_stats_t *stats);
+
+#endif /* AEOS_SLAB_H */
+
+/* ============================================================================
+ * End of slab.h
+ * ============================================================================ */
@@ -0,0 +1,87 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/smp.h
+ * Description: Multi-core definitions
+ * ============================================================================ */
+
+#ifndef AEOS_SMP_H
+#define AEOS_SMP_H
+
+#include <aeos/types.h>
+
+/* Maximum number of CPUs supported (QEMU virt -smp up to 4) */
+#define MAX_CPUS        4
+
+/* Cache line size used to keep per-CPU data apart */
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Get the index of the calling CPU (MPIDR_EL1 Aff0)
+ */
+static inline uint32_t smp_processor_id(void)
+{
+    uint64_t mpidr;
+
+    __asm__ volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return (uint32_t)(mpidr & 0xFF) & (MAX_CPUS - 1);
+}
+
+/* Per-CPU boot stack for secondary cores */
+#define SMP_STACK_ORDER 2
+#define SMP_STACK_SIZE  (4096UL << SMP_STACK_ORDER)    /* 16KB */
+
+/* PSCI 0.2 function IDs (SMC64/HVC64 calling convention) */
+#define PSCI_0_2_FN_PSCI_VERSION    0x84000000
+#define PSCI_0_2_FN64_CPU_ON        0xC4000003
+
+/* PSCI return codes */
+#define PSCI_RET_SUCCESS            0
+#define PSCI_RET_NOT_SUPPORTED      (-1)
+#define PSCI_RET_INVALID_PARAMS     (-2)
+#define PSCI_RET_DENIED             (-3)
+#define PSCI_RET_ALREADY_ON         (-4)
+
+/*
+ * Boot record handed to a secondary core through the CPU_ON context ID.
+ * The core reads it with its MMU off, so field offsets are shared with
+ * secondary_entry in boot.asm and it is cleaned to memory before CPU_ON.
+ */
+typedef struct {
+    uint64_t stack_top;         /* 0x00: initial SP_EL1 */
+    uint64_t mair;              /* 0x08: boot CPU MAIR_EL1 */
+    uint64_t tcr;               /* 0x10: boot CPU TCR_EL1 */
+    uint64_t ttbr0;             /* 0x18: boot CPU TTBR0_EL1 */
+    uint64_t sctlr;             /* 0x20: boot CPU SCTLR_EL1 */
+    uint64_t cpu;               /* 0x28: logical CPU index */
+} __attribute__((aligned(CACHE_LINE_SIZE))) smp_boot_record_t;
+
+/**
+ * Start the secondary cores with PSCI CPU_ON
+ * Must be called on the boot CPU after the scheduler is initialized.
+ *
+ * @return Number of CPUs online (including the boot CPU)
+ */
+uint32_t smp_init(void);
+
+/**
+ * Get the number of CPUs online
+ */
+uint32_t smp_num_online(void);
+
+/**
+ * Check whether a CPU has come online
+ */
+bool smp_cpu_online(uint32_t cpu);
+
+/**
+ * C entry point of a secondary core (called from boot.asm)
+ *
+ * @param cpu Logical CPU index
+ */
+void secondary_main(uint64_t cpu) __attribute__((noreturn));
+
+#endif /* AEOS_SMP_H */
+
+/* ============================================================================
+ * End of smp.h
+ * ============================================================================ */
@@ -0,0 +1,98 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/softirq.h
+ * Description: Bottom halves (tasklets) run on IRQ exit
+ * ============================================================================ */
+
+#ifndef AEOS_SOFTIRQ_H
+#define AEOS_SOFTIRQ_H
+
+#include <aeos/types.h>
+#include <aeos/smp.h>
+#include <aeos/interrupts.h>
+
+/*
+ * An IRQ handler (the top half) should only quiet its device and note
+ * what happened; the rest goes into a tasklet. tasklet_schedule() queues
+ * it on the calling CPU, and the tasklets queued there run once the
+ * handler has sent the EOI, with IRQs unmasked again, before the CPU
+ * leaves the interrupt. Another interrupt may arrive in a tasklet, but
+ * its own exit does not run tasklets or switch processes: the outer
+ * exit carries on with both.
+ *
+ * A tasklet never runs on two CPUs at once: one scheduled while it runs
+ * runs again after it, on the CPU that was running it. Tasklets cannot
+ * sleep or yield; work that may block goes on the workqueue (workqueue.h).
+ */
+
+/* Passes over the queue per IRQ exit; what is still queued afterwards
+ * waits for the next exit or for the CPU to idle */
+#define SOFTIRQ_MAX_PASSES  4
+
+typedef void (*tasklet_fn_t)(void *arg);
+
+/* A bottom half */
+typedef struct tasklet {
+    tasklet_fn_t func;
+    void *arg;
+    struct tasklet *next;               /* On a CPU's queue */
+    uint64_t queued_at;                 /* Counter value when scheduled */
+    bool queued;
+    bool running;
+    bool again;                         /* Scheduled while running */
+} tasklet_t;
+
+#define TASKLET_INIT(fn, a) { .func = (fn), .arg = (a) }
+
+/* Bottom half statistics, summed over CPUs */
+typedef struct {
+    irq_stat_t wait;                    /* Scheduled to started */
+    irq_stat_t run;                     /* Running time */
+    uint64_t passes;                    /* Queue passes on IRQ exit */
+    uint64_t left_over;                 /* Exits that hit SOFTIRQ_MAX_PASSES */
+    uint32_t pending[MAX_CPUS];         /* Queued now, by CPU */
+} softirq_stats_t;
+
+/**
+ * Prepare a tasklet
+ */
+void tasklet_init(tasklet_t *t, tasklet_fn_t func, void *arg);
+
+/**
+ * Queue a tasklet on the calling CPU
+ * Meant for IRQ handlers. From process context it runs at the CPU's next
+ * IRQ exit, or when the CPU goes idle.
+ *
+ * @return false if it was already queued
+ */
+bool tasklet_schedule(tasklet_t *t);
+
+/**
+ * Run the calling CPU's queued tasklets
+ * Called with IRQs masked on IRQ exit and by the idle loop; unmasks them
+ * around each tasklet. Does nothing in a nested interrupt.
+ */
+void softirq_run(void);
+
+/**
+ * Check whether the calling CPU has tasklets queued
+ */
+bool softirq_pending(void);
+
+/**
+ * Check whether the calling CPU is running a tasklet
+ * Interrupts taken meanwhile must not switch processes.
+ */
+bool in_softirq(void);
+
+/**
+ * Get bottom half statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void softirq_get_stats(softirq_stats_t *stats);
+
+#endif /* AEOS_SOFTIRQ_H */
+
+/* ============================================================================
+ * End of softirq.h
+ * ============================================================================ */
@@ -0,0 +1,150 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/spinlock.h
+ * Description: Ticket spinlocks and local IRQ save/restore
+ * ============================================================================ */
+
+#ifndef AEOS_SPINLOCK_H
+#define AEOS_SPINLOCK_H
+
+#include <aeos/types.h>
+
+/*
+ * Ticket spinlock
+ *
+ * The low halfword is the ticket being served, the high halfword the next
+ * ticket to hand out. Lockers take a ticket with an exclusive add and wait
+ * in WFE until it is served; unlock is a release store to the owner field,
+ * which clears the waiters' exclusive monitors and wakes them. FIFO order
+ * keeps the lock fair under contention.
+ *
+ * The lock is open-coded rather than built on __atomic_* so the wait can
+ * sit in WFE on the exclusive monitor instead of polling.
+ */
+typedef struct {
+    volatile uint16_t owner;    /* Ticket currently holding the lock */
+    volatile uint16_t next;     /* Next ticket to hand out */
+} spinlock_t;
+
+#define SPINLOCK_INIT   { 0, 0 }
+
+/**
+ * Initialize a spinlock (unlocked)
+ */
+static inline void spin_lock_init(spinlock_t *lock)
+{
+    lock->owner = 0;
+    lock->next = 0;
+}
+
+/**
+ * Acquire a spinlock (busy-waits in WFE)
+ */
+static inline void spin_lock(spinlock_t *lock)
+{
+    uint32_t val, tmp, fail;
+
+    __asm__ volatile(
+        "   prfm pstl1strm, %3\n"
+        "1: ldaxr %w0, %3\n"
+        "   add %w1, %w0, #0x10000\n"
+        "   stxr %w2, %w1, %3\n"
+        "   cbnz %w2, 1b\n"
+        /* Our ticket (high half) already being served? */
+        "   eor %w1, %w0, %w0, ror #16\n"
+        "   cbz %w1, 3f\n"
+        "   sevl\n"
+        "2: wfe\n"
+        "   ldaxrh %w2, %4\n"
+        "   eor %w1, %w2, %w0, lsr #16\n"
+        "   cbnz %w1, 2b\n"
+        "3:\n"
+        : "=&r"(val), "=&r"(tmp), "=&r"(fail), "+Q"(*(uint32_t *)lock)
+        : "Q"(lock->owner)
+        : "memory");
+}
+
+/**
+ * Try to acquire a spinlock without waiting
+ * @return true if the lock was taken
+ */
+static inline bool spin_trylock(spinlock_t *lock)
+{
+    uint32_t val, busy;
+
+    __asm__ volatile(
+        "1: ldaxr %w0, %2\n"
+        "   eor %w1, %w0, %w0, ror #16\n"
+        "   cbnz %w1, 2f\n"
+        "   add %w0, %w0, #0x10000\n"
+        "   stxr %w1, %w0, %2\n"
+        "   cbnz %w1, 1b\n"
+        "2:\n"
+        : "=&r"(val), "=&r"(busy), "+Q"(*(uint32_t *)lock)
+        :
+        : "memory");
+
+    return busy == 0;
+}
+
+/**
+ * Release a spinlock
+ */
+static inline void spin_unlock(spinlock_t *lock)
+{
+    uint16_t owner = lock->owner + 1;
+
+    __asm__ volatile("stlrh %w1, %0"
+                     : "=Q"(lock->owner)
+                     : "r"(owner)
+                     : "memory");
+}
+
+/**
+ * Mask IRQs on this CPU
+ * @return Previous DAIF value for irq_restore()
+ */
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+
+    __asm__ volatile("mrs %0, daif\n"
+                     "msr daifset, #2"
+                     : "=r"(flags) :: "memory");
+    return flags;
+}
+
+/**
+ * Restore the IRQ mask saved by irq_save()
+ */
+static inline void irq_restore(uint64_t flags)
+{
+    __asm__ volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+/**
+ * Mask local IRQs and acquire a spinlock
+ * @return Saved DAIF value for spin_unlock_irqrestore()
+ */
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint64_t flags = irq_save();
+
+    spin_lock(lock);
+    return flags;
+}
+
+/**
+ * Release a spinlock and restore the saved IRQ mask
+ */
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif /* AEOS_SPINLOCK_H */
+
+/* ============================================================================
+ * End of spinlock.h
+ * ============================================================================ */
@@ -0,0 +1,20 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/stdarg.h
+ * Description: Variable argument lists (compiler builtins)
+ * ============================================================================ */
+
+#ifndef AEOS_STDARG_H
+#define AEOS_STDARG_H
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type)   __builtin_va_arg(ap, type)
+#define va_copy(dst, src)  __builtin_va_copy(dst, src)
+#define va_end(ap)         __builtin_va_end(ap)
+
+#endif /* AEOS_STDARG_H */
+
+/* ============================================================================
+ * End of stdarg.h
+ * ============================================================================ */
@@ -8,6 +8,7 @@
 #define AEOS_STRING_H
 
 #include <aeos/types.h>
+#include <aeos/stdarg.h>
 
 /**
  * Get length of string
@@ -86,10 +87,45 @@ int memcmp(const void *s1, const void *s2, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
 
 /**
- * Formatted output to buffer (simplified printf)
- * Supports: %s, %d, %u, %x
+ * Find the first occurrence of byte c in the first n bytes of s
+ * @return Pointer to the byte, or NULL if not found
+ */
+void *memchr(const void *s, int c, size_t n);
+
+/**
+ * Fill memory with a 32-bit value (e.g. a row of pixels)
+ *
+ * @param dest 4-byte aligned destination
+ * @param count Number of 32-bit values to store
+ */
+void *memset32(void *dest, uint32_t value, size_t count);
+
+/**
+ * Byte-at-a-time reference versions of the mem* routines
+ * Used for tiny sizes and early boot, and as the membench baseline
+ */
+void *memcpy_generic(void *dest, const void *src, size_t n);
+void *memset_generic(void *dest, int c, size_t n);
+int memcmp_generic(const void *s1, const void *s2, size_t n);
+void *memmove_generic(void *dest, const void *src, size_t n);
+
+/**
+ * Byte-loop reference versions of the scanning str* routines
+ * Used when NEON is not available, and as the bench baseline
+ */
+size_t strlen_generic(const char *str);
+int strcmp_generic(const char *s1, const char *s2);
+char *strchr_generic(const char *str, int c);
+char *strstr_generic(const char *haystack, const char *needle);
+
+/**
+ * Formatted output to buffer (format.c; conversions as in format.h)
+ * Unlike C's, returns the characters stored, not the length the whole
+ * text would have had, so pos += snprintf(buf + pos, size - pos, ...)
+ * can't run past the buffer. The text is always terminated.
  */
 int snprintf(char *buf, size_t size, const char *fmt, ...);
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args);
 
 #endif /* AEOS_STRING_H */
 
@@ -16,7 +16,7 @@
 #define SYS_GETPID     3   /* Get process ID */
 #define SYS_YIELD      4   /* Yield CPU to next process */
 #define SYS_SLEEP      5   /* Sleep for N milliseconds (future) */
-#define SYS_FORK       6   /* Fork process (future) */
+#define SYS_FORK       6   /* Clone a user process, copy-on-write */
 #define SYS_EXEC       7   /* Execute program (future) */
 #define SYS_WAIT       8   /* Wait for child process (future) */
 #define SYS_OPEN       9   /* Open file (future) */
@@ -29,6 +29,38 @@
 #define STDOUT_FILENO  1
 #define STDERR_FILENO  2
 
+/* Latency histogram: bucket b counts calls of [2^b, 2^(b+1)) counter ticks */
+#define SYSCALL_LAT_BUCKETS     32
+
+/* Trace records kept per CPU (power of two) */
+#define SYSCALL_TRACE_RECORDS   256
+
+/* Per-syscall statistics */
+typedef struct {
+    uint64_t calls;
+    uint64_t ticks;                         /* Counter ticks spent in total */
+    uint64_t hist[SYSCALL_LAT_BUCKETS];
+} syscall_stat_t;
+
+/* Dispatcher statistics */
+typedef struct {
+    uint64_t total;                         /* Calls dispatched */
+    uint64_t invalid;                       /* Bad or unimplemented numbers */
+    uint64_t traced;                        /* Trace records written */
+    bool tracing;
+} syscall_stats_t;
+
+/* Trace record, written when a call returns (exit: when it is made) */
+typedef struct {
+    uint64_t start;                         /* Counter value at entry */
+    uint64_t arg0;
+    uint64_t ret;
+    uint32_t ticks;                         /* Counter ticks in the call */
+    uint16_t pid;
+    uint8_t num;
+    uint8_t cpu;
+} syscall_trace_rec_t;
+
 /*
  * System call handler (called from assembly)
  * Arguments are passed in x0-x5, syscall number in x8
@@ -43,6 +75,49 @@ uint64_t syscall_handler(uint64_t syscall_num,
  */
 void syscall_init(void);
 
+/**
+ * Name of a system call
+ * @return Its name, or NULL if the number is not implemented
+ */
+const char *syscall_name(uint32_t num);
+
+/**
+ * Get dispatcher statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void syscall_get_stats(syscall_stats_t *stats);
+
+/**
+ * Get one system call's count and latency histogram
+ * @return 0 on success, -1 for a bad number
+ */
+int syscall_get_stat(uint32_t num, syscall_stat_t *stat);
+
+/**
+ * Latency at a percentile, from the histogram
+ * @param pct Percentile (1-100)
+ * @return Upper bound of the bucket holding it, in counter ticks
+ */
+uint64_t syscall_stat_percentile(const syscall_stat_t *stat, uint32_t pct);
+
+/**
+ * Turn syscall tracing on or off
+ * While on, every call appends a record to the calling CPU's trace ring.
+ */
+void syscall_trace_set(bool on);
+
+/**
+ * Forget the records traced so far
+ */
+void syscall_trace_clear(void);
+
+/**
+ * Replay held trace records, oldest first across all CPUs
+ * Records overwritten while the replay runs are skipped.
+ */
+typedef void (*syscall_trace_fn)(const syscall_trace_rec_t *rec);
+void syscall_trace_replay(syscall_trace_fn fn);
+
 /*
  * Individual syscall implementations (kernel-side)
  */
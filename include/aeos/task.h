@@ -0,0 +1,186 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/task.h
+ * Description: Cooperative tasks and futures for the GUI
+ * ============================================================================ */
+
+#ifndef AEOS_TASK_H
+#define AEOS_TASK_H
+
+#include <aeos/types.h>
+#include <aeos/timer.h>
+
+struct process;
+
+/*
+ * Window callbacks run inside wm_run(), so anything slow they do holds
+ * up every frame. A task splits such work into steps: its step function
+ * is called again and again from the main loop until it reports that it
+ * is finished, and wm_run() stops calling steps once TASK_BUDGET_NS have
+ * gone by in a pass, presents a frame and comes back. Tasks have no stack
+ * of their own; state that must survive a step lives in the structure
+ * the task belongs to, and TASK_BEGIN()/TASK_YIELD()/TASK_END() let a step
+ * function carry on where it left off (locals do not survive a yield).
+ * A step must not free its own task; on_finish may, once it is off the list.
+ *
+ * Work that blocks (VFS, block or semihosting I/O, a shell command) goes
+ * into a future instead: future_start() runs its function in a helper
+ * process, and the task waits with TASK_AWAIT() while the loop goes on.
+ * The helper's kprintf() output can be sent to one of the caller's
+ * descriptors, such as a pipe the task drains.
+ *
+ * Tasks are run, spawned and awaited from the main loop's process only.
+ *
+ *     static task_status_t load_step(task_t *t)
+ *     {
+ *         viewer_t *v = t->arg;
+ *         TASK_BEGIN(t);
+ *         future_start(&v->io, load_file, v);
+ *         TASK_AWAIT(t, &v->io);
+ *         show(v, v->io.result);
+ *         TASK_END(t);
+ *     }
+ */
+
+/* Step time per pass of the main loop before it presents a frame */
+#define TASK_BUDGET_NS      (4 * 1000000ULL)
+
+/* Helper process stacks, 2^order pages: futures run shell commands */
+#define TASK_FUTURE_STACK_ORDER 2
+
+/* task_run(): no step is due until a future completes */
+#define TASK_NO_DEADLINE    ((uint64_t)-1)
+
+/* What a step function returns */
+typedef enum {
+    TASK_RUN_AGAIN = 0,                 /* Call again on the next pass */
+    TASK_BLOCKED,                       /* Waiting on t->wait or until t->wake_ns */
+    TASK_FINISHED                       /* Done: taken off the task list */
+} task_status_t;
+
+struct task;
+typedef task_status_t (*task_step_fn)(struct task *t);
+typedef int64_t (*future_fn_t)(void *arg);
+
+/* Blocking work run in a helper process */
+typedef struct future {
+    future_fn_t func;
+    void *arg;
+    int out_fd;                         /* Caller's fd the helper prints to, -1: console */
+    int64_t result;                     /* What func returned */
+    struct process *proc;               /* Helper, until reaped */
+    struct future *next;                /* On the list of running futures */
+    volatile bool done;                 /* func has returned */
+    bool running;                       /* Started and not yet reaped */
+} future_t;
+
+/* A cooperative task */
+typedef struct task {
+    task_step_fn step;
+    void *arg;
+    uint32_t state;                     /* Resume point (TASK_BEGIN) */
+    future_t *wait;                     /* Blocked until this one completes */
+    uint64_t wake_ns;                   /* Blocked until timer_get_ns() reaches this */
+    void (*on_finish)(struct task *t);  /* Called once off the list; may free it */
+    struct task *next;                  /* On the task list */
+    bool queued;
+    uint64_t steps;                     /* Steps run */
+} task_t;
+
+/* Resumable step functions (a switch on the resume point) */
+#define TASK_BEGIN(t)       switch ((t)->state) { case 0:
+#define TASK_YIELD(t)                                                       \
+    do {                                                                    \
+        (t)->state = __LINE__;                                              \
+        return TASK_RUN_AGAIN;                                              \
+        case __LINE__:;                                                     \
+    } while (0)
+#define TASK_AWAIT(t, f)                                                    \
+    do {                                                                    \
+        (t)->state = __LINE__;                                              \
+        (t)->wait = (f);                                                    \
+        return TASK_BLOCKED;                                                \
+        case __LINE__:;                                                     \
+    } while (0)
+#define TASK_SLEEP_MS(t, ms)                                                \
+    do {                                                                    \
+        (t)->state = __LINE__;                                              \
+        (t)->wake_ns = timer_get_ns() + (uint64_t)(ms) * 1000000ULL;        \
+        return TASK_BLOCKED;                                                \
+        case __LINE__:;                                                     \
+    } while (0)
+#define TASK_END(t)         } (t)->state = 0; return TASK_FINISHED
+
+/* Task runtime statistics */
+typedef struct {
+    uint32_t tasks;                     /* On the task list */
+    uint32_t futures;                   /* Helpers not reaped yet */
+    uint64_t steps;                     /* Steps run since boot */
+    uint64_t passes;                    /* task_run() calls that ran a step */
+    uint64_t over_budget;               /* Passes cut short by the budget */
+    uint64_t max_step_ns;               /* Longest single step */
+} task_stats_t;
+
+/**
+ * Prepare a task
+ */
+void task_init(task_t *t, task_step_fn step, void *arg);
+
+/**
+ * Put a task on the list; its first step runs on the next pass
+ * @return false if it is already on it
+ */
+bool task_spawn(task_t *t);
+
+/**
+ * Check whether a task is still on the list
+ */
+bool task_active(const task_t *t);
+
+/**
+ * Run due steps until the budget is used up or nothing is due
+ * Called by wm_run() once per loop; reaps the helpers of finished futures.
+ *
+ * @param budget_ns Time to spend
+ * @return timer_get_ns() value by which the next step is due (now if
+ *         steps are left over), or TASK_NO_DEADLINE
+ */
+uint64_t task_run(uint64_t budget_ns);
+
+/**
+ * Set the function called when a future completes
+ * wm_run() installs wm_wake(), so a completion ends its sleep.
+ */
+void task_set_notify(void (*notify)(void));
+
+/**
+ * Prepare a future
+ */
+void future_init(future_t *f);
+
+/**
+ * Run func(arg) in a helper process
+ * The helper starts in the caller's working directory. A future can be
+ * started again once it is done and future_ready() has said so.
+ *
+ * @return 0 on success, -1 if no helper could be started
+ */
+int future_start(future_t *f, future_fn_t func, void *arg);
+
+/**
+ * Check whether a future has completed and its helper is gone
+ * f->result is valid once this returns true.
+ */
+bool future_ready(future_t *f);
+
+/**
+ * Get task runtime statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void task_get_stats(task_stats_t *stats);
+
+#endif /* AEOS_TASK_H */
+
+/* ============================================================================
+ * End of task.h
+ * ============================================================================ */
@@ -8,10 +8,46 @@
 #define AEOS_TIMER_H
 
 #include <aeos/types.h>
+#include <aeos/smp.h>
+
+/* Virtual timer PPI on QEMU virt platform */
+#define TIMER_VIRT_PPI  27
 
 /* Timer tick frequency (Hz) */
 #define TIMER_FREQ_HZ   100     /* 100 ticks per second = 10ms per tick */
 
+/* Maximum pending one-shot events per CPU */
+#define TIMER_MAX_EVENTS    64
+
+/**
+ * Timer event callback
+ * Runs in interrupt context on the CPU the event was queued on.
+ */
+typedef void (*timer_callback_t)(void *arg);
+
+/**
+ * One-shot timer event
+ * Owned by the caller (often on its stack); the timer only links it.
+ */
+typedef struct timer_event {
+    uint64_t deadline;          /* Counter value (CNTVCT) to fire at */
+    timer_callback_t callback;
+    void *arg;
+    int32_t index;              /* Heap slot, -1 while not queued */
+    uint32_t cpu;               /* CPU whose queue holds it */
+} timer_event_t;
+
+/**
+ * Timer statistics
+ */
+typedef struct {
+    struct {
+        uint32_t pending;           /* Events queued */
+        uint64_t events_fired;      /* Events run */
+        uint64_t idle_entries;      /* Times the tick was stopped for idle */
+    } cpus[MAX_CPUS];
+} timer_stats_t;
+
 /**
  * Initialize the system timer
  * - Configures ARM Generic Timer
@@ -26,6 +62,12 @@ void timer_init(void);
  */
 void timer_start(void);
 
+/**
+ * Arm and start the calling secondary CPU's timer
+ * Must be called after timer_init() has run on the boot CPU
+ */
+void timer_init_cpu(void);
+
 /**
  * Get current system tick count
  *
@@ -47,14 +89,95 @@ uint64_t timer_get_uptime_ms(void);
  */
 uint64_t timer_get_uptime_sec(void);
 
+/**
+ * Get monotonic time in nanoseconds
+ * Resolution is one counter tick (16 ns at QEMU's 62.5 MHz).
+ *
+ * @return Nanoseconds of counter time
+ */
+uint64_t timer_get_ns(void);
+
 /**
  * Delay for specified number of milliseconds
- * Uses busy-wait loop (blocking)
+ * Uses busy-wait loop (blocking); use timer_sleep_ms() from processes
  *
  * @param ms Milliseconds to delay
  */
 void timer_delay_ms(uint32_t ms);
 
+/**
+ * Block the current process until a deadline
+ * Other processes run meanwhile; falls back to spinning when there is no
+ * process to block or the CPU's event queue is full.
+ *
+ * @param ns Absolute deadline in timer_get_ns() time
+ */
+void timer_sleep_until(uint64_t ns);
+
+/**
+ * Block until a deadline or until woken with a condition set
+ * The waker sets *cond and then calls scheduler_wake() on the sleeper; a
+ * wakeup that comes before the sleeper has blocked still ends the wait.
+ * The caller clears *cond.
+ *
+ * @param ns Absolute deadline in timer_get_ns() time
+ * @param cond Wakeup flag (NULL: deadline only)
+ */
+void timer_wait_until(uint64_t ns, const volatile bool *cond);
+
+/**
+ * Block the current process for a number of milliseconds
+ *
+ * @param ms Milliseconds to sleep
+ */
+void timer_sleep_ms(uint32_t ms);
+
+/**
+ * Prepare a one-shot event
+ *
+ * @param ev Event to initialize
+ * @param callback Function to call when it fires
+ * @param arg Argument passed to callback
+ */
+void timer_event_init(timer_event_t *ev, timer_callback_t callback, void *arg);
+
+/**
+ * Queue an event on the calling CPU's timer
+ *
+ * @param ev Initialized event, not already queued
+ * @param deadline_ns Absolute deadline in timer_get_ns() time
+ * @return 0 on success, -1 on error (queue full or event in use)
+ */
+int timer_event_add(timer_event_t *ev, uint64_t deadline_ns);
+
+/**
+ * Remove a queued event before it fires
+ * Waits for its callback if that is running on another CPU.
+ *
+ * @param ev Event to cancel
+ * @return true if it was still queued
+ */
+bool timer_event_cancel(timer_event_t *ev);
+
+/**
+ * Stop the periodic tick on this CPU (tickless idle)
+ * The timer is programmed for the next event only. Call with IRQs masked.
+ */
+void timer_idle_enter(void);
+
+/**
+ * Restart the periodic tick on this CPU after idling
+ * Call with IRQs masked.
+ */
+void timer_idle_exit(void);
+
+/**
+ * Get timer event statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void timer_get_stats(timer_stats_t *stats);
+
 /**
  * Get timer frequency in Hz
  *
@@ -62,6 +185,14 @@ void timer_delay_ms(uint32_t ms);
  */
 uint32_t timer_get_frequency(void);
 
+/**
+ * Read the raw virtual counter (CNTVCT_EL0)
+ * Runs at timer_get_frequency() Hz, for fine-grained measurements
+ *
+ * @return Current counter value
+ */
+uint64_t timer_get_counter(void);
+
 /**
  * Handle timer interrupt from FIQ
  * Called directly from FIQ handler when timer interrupt is pending
@@ -0,0 +1,133 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/trace.h
+ * Description: Static tracepoints and the binary trace ring
+ * ============================================================================ */
+
+#ifndef AEOS_TRACE_H
+#define AEOS_TRACE_H
+
+#include <aeos/types.h>
+
+/* Records per CPU ring (power of two); the oldest are overwritten */
+#define TRACE_RING_RECORDS  4096
+
+/*
+ * Every trace event: X(id, name, phase, what a0 and a1 hold)
+ * The phase is the Chrome trace one: B/E open and close a span on the
+ * CPU, b/e an async span matched by (a0, a1), i an instant.
+ */
+#define TRACE_EVENTS(X) \
+    X(SCHED_SWITCH,     "sched_switch",     'i')    /* prev pid, next pid */ \
+    X(IRQ_ENTRY,        "irq_entry",        'B')    /* irq */ \
+    X(IRQ_EXIT,         "irq_exit",         'E')    /* irq */ \
+    X(SOFTIRQ_ENTRY,    "softirq_entry",    'B')    /* tasklet function */ \
+    X(SOFTIRQ_EXIT,     "softirq_exit",     'E')    /* tasklet function */ \
+    X(WORK_START,       "work_start",       'b')    /* work item, function */ \
+    X(WORK_DONE,        "work_done",        'e')    /* work item, function */ \
+    X(SYSCALL_ENTRY,    "syscall_entry",    'B')    /* number, arg0 */ \
+    X(SYSCALL_EXIT,     "syscall_exit",     'E')    /* number, return value */ \
+    X(KMALLOC,          "kmalloc",          'i')    /* pointer, size */ \
+    X(KFREE,            "kfree",            'i')    /* pointer */ \
+    X(VIRTIO_SUBMIT,    "virtio_submit",    'b')    /* device ID, descriptor */ \
+    X(VIRTIO_COMPLETE,  "virtio_complete",  'e')    /* device ID, descriptor */ \
+    X(WM_FRAME_BEGIN,   "wm_frame_begin",   'B') \
+    X(WM_FRAME_END,     "wm_frame_end",     'E')    /* damage rects, pixels */
+
+#define TRACE_EVENT_ENUM(id, name, phase) TRACE_##id,
+typedef enum {
+    TRACE_EVENTS(TRACE_EVENT_ENUM)
+    TRACE_NUM_EVENTS
+} trace_event_t;
+#undef TRACE_EVENT_ENUM
+
+_Static_assert(TRACE_NUM_EVENTS <= 32, "trace_mask has a bit per event");
+
+/* All events */
+#define TRACE_ALL           ((uint32_t)((1ULL << TRACE_NUM_EVENTS) - 1))
+
+/* One trace record (32 bytes) */
+typedef struct {
+    uint64_t ts;                        /* Counter ticks (CNTVCT) */
+    uint64_t a0;
+    uint64_t a1;
+    uint32_t pid;                       /* Current process, 0 before any */
+    uint16_t event;
+    uint8_t cpu;
+    uint8_t reserved;
+} trace_rec_t;
+
+/* Trace statistics */
+typedef struct {
+    uint32_t mask;                      /* Enabled events */
+    uint64_t written;                   /* Records written since boot */
+    uint64_t held;                      /* Records a dump would write */
+} trace_stats_t;
+
+/* Bit per enabled event; read by every tracepoint */
+extern volatile uint32_t trace_mask;
+
+/**
+ * Write a record into the calling CPU's ring
+ * Use TRACEPOINT(), which skips the call while the event is disabled.
+ */
+void trace_emit(uint32_t event, uint64_t a0, uint64_t a1);
+
+/*
+ * A disabled tracepoint costs one load and one not-taken branch.
+ */
+#define TRACEPOINT(id, a0, a1) \
+    do { \
+        if (__builtin_expect(trace_mask & (1U << TRACE_##id), 0)) { \
+            trace_emit(TRACE_##id, (uint64_t)(a0), (uint64_t)(a1)); \
+        } \
+    } while (0)
+
+/**
+ * Enable a set of events (others are disabled)
+ * The rings are allocated the first time any event is enabled.
+ *
+ * @param mask Bit per trace_event_t (0 disables tracing)
+ * @return 0 on success, -1 if the rings could not be allocated
+ */
+int trace_set_mask(uint32_t mask);
+
+/**
+ * Forget the records held so far
+ */
+void trace_clear(void);
+
+/**
+ * Look up an event by name
+ *
+ * @return Event ID, or -1 if there is none by that name
+ */
+int trace_event_by_name(const char *name);
+
+/**
+ * Name of an event
+ */
+const char *trace_event_name(uint32_t event);
+
+/**
+ * Write the held records to a host file (semihosting)
+ * The file is text, one record per line, with a header naming each event
+ * and its phase. scripts/trace2json.awk converts it to Chrome trace JSON.
+ *
+ * @param path Host file name
+ * @return Records written, or -1 on error
+ */
+int trace_dump(const char *path);
+
+/**
+ * Get trace statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ */
+void trace_get_stats(trace_stats_t *stats);
+
+#endif /* AEOS_TRACE_H */
+
+/* ============================================================================
+ * End of trace.h
+ * ============================================================================ */
@@ -12,6 +12,9 @@
 /* PL011 UART base address on QEMU virt board */
 #define UART0_BASE 0x09000000
 
+/* Its interrupt (SPI 1) */
+#define UART0_IRQ  33
+
 /* UART register offsets */
 #define UART_DR     0x00  /* Data Register */
 #define UART_RSR    0x04  /* Receive Status Register */
@@ -34,6 +37,15 @@
 #define UART_FR_RXFE (1 << 4)  /* Receive FIFO empty */
 #define UART_FR_BUSY (1 << 3)  /* UART busy */
 
+/* Interrupt bits (UART_IMSC, UART_RIS, UART_MIS, UART_ICR) */
+#define UART_INT_RX  (1 << 4)  /* Receive */
+#define UART_INT_TX  (1 << 5)  /* Transmit */
+#define UART_INT_RT  (1 << 6)  /* Receive timeout */
+
+/* FIFO levels that raise the interrupts (UART_IFLS) */
+#define UART_IFLS_TX_HALF  (2 << 0)  /* TX FIFO drained to 1/2 */
+#define UART_IFLS_RX_HALF  (2 << 3)  /* RX FIFO filled to 1/2 */
+
 /* UART Line Control Register (UART_LCRH) bits */
 #define UART_LCRH_FEN  (1 << 4)  /* Enable FIFOs */
 #define UART_LCRH_WLEN_8BIT (3 << 5)  /* 8 bits */
@@ -43,14 +55,55 @@
 #define UART_CR_TXE    (1 << 8)  /* Transmit enable */
 #define UART_CR_RXE    (1 << 9)  /* Receive enable */
 
+/* UART statistics */
+typedef struct {
+    uint64_t interrupts;
+    uint64_t writes;                /* uart_write calls */
+    uint64_t tx_bytes;              /* Bytes handed to the FIFO */
+    uint64_t rx_bytes;              /* Bytes taken from the FIFO */
+    uint64_t rx_dropped;            /* Lost to a full RX ring */
+    uint64_t rx_waits;              /* Times a reader slept */
+    uint32_t tx_queued;             /* Waiting in the TX ring */
+    uint32_t rx_queued;             /* Waiting in the RX ring */
+} uart_stats_t;
+
 /**
  * Initialize the UART hardware
  * Sets up baud rate, data format, and enables transmit/receive
  */
 void uart_init(void);
 
+/**
+ * Switch to interrupt-driven transmit and receive
+ * Until this is called (with the GIC up), output is written synchronously
+ * and input is read straight from the FIFO.
+ */
+void uart_enable_irq(void);
+
+/**
+ * Check whether input is delivered by interrupt
+ */
+bool uart_rx_irq_enabled(void);
+
+/**
+ * Set the function called from the RX interrupt when input arrives
+ * It runs in interrupt context.
+ */
+typedef void (*uart_rx_notify_fn)(void);
+void uart_set_rx_notify(uart_rx_notify_fn fn);
+
+/**
+ * Stop buffering: flush what is queued and write synchronously from now on
+ * For crash reports, where the interrupt may never come. Doesn't take the
+ * TX lock, which the crashing CPU may hold.
+ */
+void uart_panic_mode(void);
+
 /**
  * Send a single character to the UART
+ * Queued for the TX interrupt; waits only while the TX buffer is full.
+ * A newline is sent as CR LF.
+ *
  * @param c Character to send
  */
 void uart_putc(char c);
@@ -63,10 +116,20 @@ void uart_puts(const char *s);
 
 /**
  * Receive a single character from the UART (blocking)
+ * The caller sleeps until the RX interrupt delivers a byte.
  * @return Character received
  */
 char uart_getc(void);
 
+/**
+ * Receive a single character, giving up after a timeout
+ * For telling a lone ESC from the start of an escape sequence.
+ *
+ * @param ms Milliseconds to wait
+ * @return Character received, or -1 on timeout
+ */
+int uart_getc_timeout(uint32_t ms);
+
 /**
  * Check if data is available to read from the UART (non-blocking)
  * @return true if data is available, false otherwise
@@ -75,6 +138,8 @@ bool uart_data_available(void);
 
 /**
  * Write a buffer of data to the UART
+ * Queued as one unit, so output from other CPUs doesn't interleave with it.
+ *
  * @param buf Buffer containing data to write
  * @param len Number of bytes to write
  * @return Number of bytes written
@@ -83,10 +148,18 @@ size_t uart_write(const char *buf, size_t len);
 
 /**
  * Read data from the UART into a buffer
+ * Waits for the first byte, then takes what is already buffered.
+ *
  * @param buf Buffer to store received data
  * @param len Maximum number of bytes to read
  * @return Number of bytes read
  */
 size_t uart_read(char *buf, size_t len);
 
+/**
+ * Get UART statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void uart_get_stats(uart_stats_t *stats);
+
 #endif /* AEOS_UART_H */
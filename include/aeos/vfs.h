@@ -8,6 +8,7 @@
 #define AEOS_VFS_H
 
 #include <aeos/types.h>
+#include <aeos/spinlock.h>
 
 /* Maximum number of open files per process */
 #define MAX_OPEN_FILES     16
@@ -23,7 +24,8 @@ typedef enum {
     VFS_FILE_REGULAR = 0,   /* Regular file */
     VFS_FILE_DIRECTORY,     /* Directory */
     VFS_FILE_DEVICE,        /* Device file */
-    VFS_FILE_SYMLINK        /* Symbolic link */
+    VFS_FILE_SYMLINK,       /* Symbolic link */
+    VFS_FILE_PIPE           /* Pipe end (pipe.h), not in any directory */
 } vfs_file_type_t;
 
 /* File access modes (for open) */
@@ -34,6 +36,23 @@ typedef enum {
 #define O_TRUNC     0x0200  /* Truncate to zero length */
 #define O_APPEND    0x0400  /* Append mode */
 #define O_EXCL      0x0800  /* Exclusive create (fail if exists) */
+#define O_NONBLOCK  0x1000  /* Reads return VFS_WOULD_BLOCK instead of waiting (pipes) */
+
+/* vfs_mmap() flags */
+#define VFS_MAP_READ    0x0001  /* Read-only view of the file */
+#define VFS_MAP_COW     0x0002  /* Writable; pages are copied on first write, the file never changes */
+
+/* Bounce buffer size for vfs_copy_file_range() across filesystems */
+#define VFS_COPY_CHUNK     (64 * 1024)
+
+/* vfs_rename(): the paths need a copy, not a rename */
+#define VFS_RENAME_XDEV    (-2)
+
+/* vfs_read() on an O_NONBLOCK file: nothing to read yet */
+#define VFS_WOULD_BLOCK    (-3)
+
+/* Maximum live vfs_mmap() mappings */
+#define VFS_MAX_MAPPINGS   32
 
 /* Seek whence values */
 #define SEEK_SET    0       /* Seek from beginning */
@@ -55,6 +74,7 @@ typedef struct vfs_inode {
     uint32_t nlinks;            /* Number of hard links */
     void *fs_data;              /* Filesystem-specific data */
     struct vfs_filesystem *fs;  /* Filesystem this inode belongs to */
+    struct vfs_inode *parent;   /* Containing directory (directories; NULL at the root) */
 } vfs_inode_t;
 
 /* Directory entry */
@@ -77,14 +97,28 @@ typedef struct vfs_fs_ops {
     int (*inode_mkdir)(vfs_inode_t *parent, const char *name, uint32_t mode, vfs_inode_t **result);
     int (*inode_unlink)(vfs_inode_t *parent, const char *name);
     int (*inode_rmdir)(vfs_inode_t *parent, const char *name);
+    int (*inode_rename)(vfs_inode_t *old_dir, const char *old_name,
+                        vfs_inode_t *new_dir, const char *new_name);   /* Optional */
 
     /* File operations */
     ssize_t (*file_read)(struct vfs_file *file, void *buf, size_t count);
     ssize_t (*file_write)(struct vfs_file *file, const void *buf, size_t count);
     int (*file_close)(struct vfs_file *file);
 
+    /* Copy between two files of this filesystem at their offsets (optional) */
+    ssize_t (*file_copy_range)(struct vfs_file *src, struct vfs_file *dst, size_t count);
+
+    /* Mapping operations (optional): file_mmap fills in the physical page
+     * behind each page of the range and keeps those pages in place until
+     * the matching file_munmap, even if the file is unlinked meanwhile. */
+    int (*file_mmap)(struct vfs_file *file, uint64_t offset, size_t pages, uint64_t *phys);
+    void (*file_munmap)(vfs_inode_t *inode, uint64_t offset, size_t pages);
+
     /* Directory operations */
     int (*dir_readdir)(struct vfs_file *file, vfs_dirent_t **dirent);
+    /* Fill up to count entries from the file offset on, advancing it
+     * (optional; dir_readdir is called once per entry without it) */
+    ssize_t (*dir_getdents)(struct vfs_file *file, vfs_dirent_t *buf, size_t count);
 } vfs_fs_ops_t;
 
 /* Filesystem type registration */
@@ -111,10 +145,12 @@ typedef struct vfs_fd {
     uint32_t flags;             /* File descriptor flags */
 } vfs_fd_t;
 
-/* File descriptor table - per process */
+/* File descriptor table - per process, or shared by cloned processes */
 typedef struct vfs_fd_table {
     vfs_fd_t fds[MAX_OPEN_FILES];
     uint32_t next_fd;           /* Next available fd */
+    uint32_t refcount;          /* Processes using the table */
+    spinlock_t lock;            /* Guards fds, which sharers change at once */
 } vfs_fd_table_t;
 
 /* Mount point */
@@ -159,6 +195,12 @@ int vfs_unmount(const char *path);
  */
 int vfs_open(const char *path, uint32_t flags, uint32_t mode);
 
+/**
+ * Open an inode that has no path (a pipe end)
+ * @return File descriptor on success, negative on error
+ */
+int vfs_open_inode(vfs_inode_t *inode, uint32_t flags);
+
 /**
  * Close a file descriptor
  */
@@ -179,6 +221,37 @@ ssize_t vfs_write(int fd, const void *buf, size_t count);
  */
 int64_t vfs_seek(int fd, int64_t offset, int whence);
 
+/**
+ * Copy data from one file to another at both files' current offsets
+ * Filesystems can copy page to page; otherwise the data goes through a
+ * VFS_COPY_CHUNK bounce buffer. Both offsets advance by the bytes copied.
+ * @param len Maximum bytes to copy
+ * @return Bytes copied (0 at end of the source), -1 on error
+ */
+ssize_t vfs_copy_file_range(int src_fd, int dst_fd, size_t len);
+
+/**
+ * Map part of a file into kernel memory without copying it
+ * The view shares the file's pages: a read-only mapping sees later writes
+ * to the file, a VFS_MAP_COW mapping keeps its own copy of any page it writes.
+ * The mapping stays valid after the fd is closed.
+ * @param fd File descriptor (opened for reading)
+ * @param offset Start offset (page-aligned)
+ * @param len Bytes to map (within the file)
+ * @param flags VFS_MAP_READ or VFS_MAP_COW
+ * @return Address of the data at offset, or NULL if the range or the
+ *         filesystem cannot be mapped (use vfs_read instead)
+ */
+void *vfs_mmap(int fd, uint64_t offset, size_t len, uint32_t flags);
+
+/**
+ * Remove a mapping made by vfs_mmap
+ * @param addr Address returned by vfs_mmap
+ * @param len Length passed to vfs_mmap
+ * @return 0 on success, -1 if addr is not a mapping
+ */
+int vfs_munmap(void *addr, size_t len);
+
 /* ============================================================================
  * Directory Operations
  * ============================================================================ */
@@ -188,6 +261,17 @@ int64_t vfs_seek(int fd, int64_t offset, int whence);
  */
 int vfs_readdir(int fd, vfs_dirent_t *dirent);
 
+/**
+ * Read many directory entries in one call
+ * Carries on where the last call stopped, in time proportional to the
+ * entries returned; vfs_seek() to 0 starts the listing again.
+ * @param fd Open directory
+ * @param buf Receives the entries
+ * @param count Entries buf holds
+ * @return Entries read, 0 at the end of the directory, -1 on error
+ */
+ssize_t vfs_getdents(int fd, vfs_dirent_t *buf, size_t count);
+
 /* ============================================================================
  * File Descriptor Table Operations
  * ============================================================================ */
@@ -198,7 +282,15 @@ int vfs_readdir(int fd, vfs_dirent_t *dirent);
 vfs_fd_table_t *vfs_fd_table_create(void);
 
 /**
- * Destroy a file descriptor table
+ * Take another reference to a file descriptor table
+ * The processes holding it then see each other's opens and closes.
+ * @return The table
+ */
+vfs_fd_table_t *vfs_fd_table_get(vfs_fd_table_t *table);
+
+/**
+ * Drop a reference to a file descriptor table
+ * The last reference closes the table's files and frees it.
  */
 void vfs_fd_table_destroy(vfs_fd_table_t *table);
 
@@ -207,6 +299,15 @@ void vfs_fd_table_destroy(vfs_fd_table_t *table);
  */
 int vfs_fd_alloc(vfs_file_t *file, uint32_t flags);
 
+/**
+ * Share one of the current process's open files with another table
+ * Both descriptors then refer to the same file and offset; it is closed
+ * once every table has closed it (e.g. to hand a pipe end to a child).
+ *
+ * @return File descriptor in table, negative on error
+ */
+int vfs_fd_install(vfs_fd_table_t *table, int fd);
+
 /**
  * Get file from file descriptor
  */
@@ -221,11 +322,41 @@ void vfs_fd_free(int fd);
  * Path Resolution
  * ============================================================================ */
 
+/* Dentry cache statistics */
+typedef struct {
+    uint64_t hits;              /* Names resolved from the cache */
+    uint64_t negative_hits;     /* Names the cache knew to be absent */
+    uint64_t misses;            /* Lookups passed to the filesystem */
+} vfs_dcache_stats_t;
+
 /**
  * Resolve a path to an inode
+ * Absolute paths start at the root, relative ones at the process's working
+ * directory. Lookups go through the dentry cache and allocate nothing.
  */
 int vfs_path_lookup(const char *path, vfs_inode_t **result);
 
+/**
+ * Change the current process's working directory
+ * @return 0 on success, -1 if path is not a directory
+ */
+int vfs_chdir(const char *path);
+
+/**
+ * Get the current process's working directory (absolute, normalised)
+ */
+const char *vfs_getcwd(void);
+
+/**
+ * Empty the dentry cache (the root filesystem was replaced)
+ */
+void vfs_dcache_flush(void);
+
+/**
+ * Get dentry cache statistics
+ */
+void vfs_get_dcache_stats(vfs_dcache_stats_t *stats);
+
 /**
  * Create a new file at path
  */
@@ -246,6 +377,15 @@ int vfs_unlink(const char *path);
  */
 int vfs_rmdir(const char *path);
 
+/**
+ * Rename or move a file or directory within one filesystem
+ * Only the directory entry moves, so the cost does not depend on file
+ * size. An existing file at new_path is replaced.
+ * @return 0 on success, VFS_RENAME_XDEV if the filesystem cannot do it
+ *         (different filesystems: copy and unlink instead), -1 on error
+ */
+int vfs_rename(const char *old_path, const char *new_path);
+
 /**
  * Get the root filesystem
  */
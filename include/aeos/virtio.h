@@ -37,6 +37,10 @@
 #define VIRTIO_MMIO_QUEUE_USED_HIGH 0x0a4  /* Queue used high 32 bits */
 #define VIRTIO_MMIO_CONFIG_GENERATION 0x0fc /* Configuration generation */
 
+/* Interrupt status bits */
+#define VIRTIO_MMIO_INT_VRING       (1U << 0)   /* A used ring was updated */
+#define VIRTIO_MMIO_INT_CONFIG      (1U << 1)   /* Device configuration changed */
+
 /* VirtIO device IDs */
 #define VIRTIO_ID_NETWORK   1
 #define VIRTIO_ID_BLOCK     2
@@ -53,6 +57,9 @@
 #define VIRTIO_STATUS_FAILED        128
 
 /* VirtIO feature bits */
+#define VIRTIO_F_ANY_LAYOUT         (1U << 27)  /* Legacy: headers may share a descriptor */
+#define VIRTIO_RING_F_INDIRECT_DESC (1U << 28)  /* Descriptor tables in memory */
+#define VIRTIO_RING_F_EVENT_IDX     (1U << 29)  /* used_event / avail_event */
 #define VIRTIO_F_VERSION_1  (1ULL << 32)
 
 /* Virtqueue descriptor flags */
@@ -60,6 +67,10 @@
 #define VIRTQ_DESC_F_WRITE      2  /* Buffer is write-only */
 #define VIRTQ_DESC_F_INDIRECT   4  /* Buffer contains list of descriptors */
 
+/* Ring flags */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1  /* Driver is draining; no need to interrupt */
+#define VIRTQ_USED_F_NO_NOTIFY  1  /* Device is polling; no need to notify */
+
 /* Virtqueue descriptor */
 typedef struct {
     uint64_t addr;      /* Physical address */
@@ -88,12 +99,21 @@ typedef struct {
     virtq_used_elem_t ring[];
 } __attribute__((packed)) virtq_used_t;
 
+/**
+ * With VIRTIO_RING_F_EVENT_IDX: does moving an index from old to new pass
+ * the event index the other side asked to hear about?
+ */
+static inline bool virtq_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
 /* VirtIO device structure */
 typedef struct {
     volatile uint32_t *mmio_base;  /* MMIO register base */
     uint32_t device_id;            /* Device type */
     uint32_t vendor_id;            /* Vendor ID */
-    uint64_t features;             /* Supported features */
+    uint64_t features;             /* Negotiated features */
     bool initialized;              /* Initialization status */
 } virtio_device_t;
 
@@ -105,6 +125,22 @@ typedef struct {
  */
 int virtio_init_device(volatile void *base, virtio_device_t *dev);
 
+/**
+ * Reset a device and agree on features
+ * Accepts the ones in want the device offers (plus VERSION_1 on modern
+ * devices) and records them in dev->features. Set the queues up next,
+ * then call virtio_driver_ok().
+ * @param dev Device from virtio_init_device()
+ * @param want Feature bits 0-31 the driver uses
+ * @return 0 on success, -1 if the device refused them
+ */
+int virtio_negotiate(virtio_device_t *dev, uint32_t want);
+
+/**
+ * Tell a device the driver is ready (DRIVER_OK)
+ */
+void virtio_driver_ok(virtio_device_t *dev);
+
 /**
  * Write to VirtIO MMIO register
  */
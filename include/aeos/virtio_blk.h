@@ -0,0 +1,72 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/virtio_blk.h
+ * Description: VirtIO block device driver interface
+ * ============================================================================ */
+
+#ifndef AEOS_VIRTIO_BLK_H
+#define AEOS_VIRTIO_BLK_H
+
+#include <aeos/types.h>
+#include <aeos/virtio_gpu.h>  /* For common VirtIO definitions */
+
+/* Feature bits */
+#define VIRTIO_BLK_F_RO             (1U << 5)   /* Device is read-only */
+
+/* Device configuration (MMIO offset 0x100) */
+#define VIRTIO_BLK_CFG_CAPACITY     0x100       /* 64-bit, in sectors */
+
+/* Request types */
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+
+/* Request status, written by the device */
+#define VIRTIO_BLK_S_OK             0
+#define VIRTIO_BLK_S_IOERR          1
+#define VIRTIO_BLK_S_UNSUPP         2
+
+/* Addressing is always in 512-byte sectors */
+#define VIRTIO_BLK_SECTOR_SHIFT     9
+
+/* Requests in flight at once */
+#define VIRTIO_BLK_MAX_REQUESTS     64
+
+/* The synchronous path splits transfers into requests of this many blocks */
+#define VIRTIO_BLK_SPLIT_BLOCKS     16
+
+/* Request header (device-readable) */
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_req_hdr_t;
+
+/* VirtIO block statistics */
+typedef struct {
+    uint64_t requests;              /* Requests submitted */
+    uint64_t blocks;                /* Blocks transferred */
+    uint64_t notifies;              /* Queue notifications */
+    uint64_t interrupts;            /* Completion interrupts */
+    uint64_t errors;                /* Requests the device failed */
+    uint32_t in_flight;
+    uint32_t max_in_flight;         /* Most requests outstanding at once */
+    bool indirect;                  /* One ring slot per request */
+} virtio_blk_stats_t;
+
+/**
+ * Initialize the VirtIO block device and register it as "vda"
+ * @return 0 on success, -1 if there is no device
+ */
+int virtio_blk_init(void);
+
+/**
+ * Get virtio-blk statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void virtio_blk_get_stats(virtio_blk_stats_t *stats);
+
+#endif /* AEOS_VIRTIO_BLK_H */
+
+/* ============================================================================
+ * End of virtio_blk.h
+ * ============================================================================ */
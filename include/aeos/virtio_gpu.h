@@ -9,11 +9,13 @@
 
 #include <aeos/types.h>
 #include <aeos/virtio.h>
+#include <aeos/framebuffer.h>
 
 /* VirtIO MMIO device region (QEMU virt board) */
 #define VIRTIO_MMIO_BASE    0x0a000000  /* Base address for MMIO devices */
 #define VIRTIO_MMIO_SIZE    0x200       /* Size of each device slot */
 #define VIRTIO_MMIO_COUNT   32          /* Maximum number of devices */
+#define VIRTIO_MMIO_IRQ_BASE 48         /* Slot n raises SPI 16 + n (INTID 48 + n) */
 
 /* VirtIO GPU feature bits */
 #define VIRTIO_GPU_F_VIRGL          0
@@ -32,6 +34,40 @@
 #define VIRTIO_GPU_CMD_GET_CAPSET               0x0109
 #define VIRTIO_GPU_CMD_GET_EDID                 0x010a
 
+/* VirtIO GPU cursor commands (cursor queue) */
+#define VIRTIO_GPU_CMD_UPDATE_CURSOR            0x0300
+#define VIRTIO_GPU_CMD_MOVE_CURSOR              0x0301
+
+/* VirtIO GPU responses (0x11xx success, 0x12xx error) */
+#define VIRTIO_GPU_RESP_OK_NODATA               0x1100
+#define VIRTIO_GPU_RESP_OK_DISPLAY_INFO         0x1101
+#define VIRTIO_GPU_RESP_OK_EDID                 0x1104
+#define VIRTIO_GPU_RESP_ERR_UNSPEC              0x1200
+
+/* Device configuration (MMIO offset 0x100) */
+#define VIRTIO_GPU_CFG_EVENTS_READ  0x100
+#define VIRTIO_GPU_CFG_EVENTS_CLEAR 0x104
+#define VIRTIO_GPU_EVENT_DISPLAY    (1U << 0)   /* Display modes changed */
+
+#define VIRTIO_GPU_MAX_SCANOUTS     16
+#define VIRTIO_GPU_EDID_SIZE        1024
+
+/* Control header flags */
+#define VIRTIO_GPU_FLAG_FENCE   (1 << 0)    /* Response echoes fence_id */
+
+/* Control queue requests in flight (two descriptors each) */
+#define VIRTIO_GPU_MAX_REQUESTS 32
+
+/* Partial updates: most rects sent per frame, and the wasted pixels a merge
+ * may add (one transfer + flush round trip costs about as much as copying
+ * a 64x64 block) */
+#define VIRTIO_GPU_MAX_UPDATE_RECTS 8
+#define VIRTIO_GPU_RECT_SLACK       (64 * 64)
+
+/* Cursor plane: the host expects a 64x64 image */
+#define VIRTIO_GPU_CURSOR_SIZE      64
+#define VIRTIO_GPU_CURSOR_SLOTS     16  /* Cursor commands in flight */
+
 /* VirtIO GPU pixel formats */
 #define VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM   1
 #define VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM   2
@@ -62,9 +98,24 @@ typedef struct {
         virtio_gpu_rect_t r;
         uint32_t enabled;
         uint32_t flags;
-    } pmodes[16];
+    } pmodes[VIRTIO_GPU_MAX_SCANOUTS];
 } __attribute__((packed)) virtio_gpu_resp_display_info_t;
 
+/* VirtIO GPU get EDID */
+typedef struct {
+    virtio_gpu_ctrl_hdr_t hdr;
+    uint32_t scanout;
+    uint32_t padding;
+} __attribute__((packed)) virtio_gpu_get_edid_t;
+
+/* VirtIO GPU EDID response */
+typedef struct {
+    virtio_gpu_ctrl_hdr_t hdr;
+    uint32_t size;
+    uint32_t padding;
+    uint8_t edid[VIRTIO_GPU_EDID_SIZE];
+} __attribute__((packed)) virtio_gpu_resp_edid_t;
+
 /* VirtIO GPU 2D resource create */
 typedef struct {
     virtio_gpu_ctrl_hdr_t hdr;
@@ -74,6 +125,13 @@ typedef struct {
     uint32_t height;
 } __attribute__((packed)) virtio_gpu_resource_create_2d_t;
 
+/* VirtIO GPU resource unref (detaches the backing too) */
+typedef struct {
+    virtio_gpu_ctrl_hdr_t hdr;
+    uint32_t resource_id;
+    uint32_t padding;
+} __attribute__((packed)) virtio_gpu_resource_unref_t;
+
 /* VirtIO GPU set scanout */
 typedef struct {
     virtio_gpu_ctrl_hdr_t hdr;
@@ -114,15 +172,55 @@ typedef struct {
     /* Followed by virtio_gpu_mem_entry_t entries */
 } __attribute__((packed)) virtio_gpu_resource_attach_backing_t;
 
+/* VirtIO GPU cursor position */
+typedef struct {
+    uint32_t scanout_id;
+    uint32_t x;
+    uint32_t y;
+    uint32_t padding;
+} __attribute__((packed)) virtio_gpu_cursor_pos_t;
+
+/* VirtIO GPU update/move cursor (resource_id 0 hides the cursor) */
+typedef struct {
+    virtio_gpu_ctrl_hdr_t hdr;
+    virtio_gpu_cursor_pos_t pos;
+    uint32_t resource_id;
+    uint32_t hot_x;
+    uint32_t hot_y;
+    uint32_t padding;
+} __attribute__((packed)) virtio_gpu_update_cursor_t;
+
 /* VirtIO GPU driver state */
 typedef struct {
     virtio_device_t vdev;
     uint32_t num_scanouts;
     uint32_t resource_id;
-    uint32_t display_resource_id;   /* Resource ID for display (0 if not setup) */
+    uint32_t display_resource_id;   /* Resource ID on the scanout (0 if not setup) */
+    uint32_t irq;                   /* GIC interrupt of the MMIO slot */
     bool initialized;
+
+    /* Statistics */
+    uint64_t updates;               /* Display updates */
+    uint64_t commands;              /* Control commands submitted */
+    uint64_t notifies;              /* Queue notifications (batches) */
+    uint64_t interrupts;            /* Completion interrupts */
+    uint64_t errors;                /* Commands the device rejected */
+    uint64_t pixels_transferred;    /* Pixels copied to the host */
+    uint64_t cursor_moves;          /* Cursor queue commands */
 } virtio_gpu_t;
 
+/* VirtIO GPU statistics */
+typedef struct {
+    uint64_t updates;
+    uint64_t commands;
+    uint64_t notifies;
+    uint64_t interrupts;
+    uint64_t errors;
+    uint64_t pixels_transferred;
+    uint64_t cursor_moves;
+    uint32_t in_flight;
+} virtio_gpu_stats_t;
+
 /**
  * Initialize VirtIO GPU driver
  * @return 0 on success, -1 on error
@@ -173,12 +271,87 @@ int virtio_gpu_transfer_to_host(uint32_t resource_id, uint32_t x, uint32_t y,
 int virtio_gpu_flush(uint32_t resource_id, uint32_t x, uint32_t y,
                       uint32_t width, uint32_t height);
 
+/**
+ * Get the mode to drive scanout 0 at
+ * Asks the device with GET_DISPLAY_INFO, falling back to the preferred
+ * timing in the display's EDID, and fits the answer with fb_fit_mode().
+ * @param width Set to the mode's width
+ * @param height Set to the mode's height
+ * @return 0 on success, -1 if the device reported no usable mode
+ */
+int virtio_gpu_get_display_mode(uint32_t *width, uint32_t *height);
+
+/**
+ * Set the function called (from the interrupt) when the display's modes
+ * change, e.g. the host window was resized
+ */
+void virtio_gpu_set_mode_notify(void (*fn)(void));
+
+/**
+ * Check for a mode change reported since the last virtio_gpu_resize()
+ */
+bool virtio_gpu_mode_pending(void);
+
+/**
+ * Follow the display's mode
+ * Re-reads the mode and, if it changed, drops the host resources, resizes
+ * the framebuffer with fb_set_mode() and sets the display up again; the
+ * next present transfers the whole screen. Call from process context.
+ * @return 1 if the resolution changed, 0 if not, -1 on error
+ */
+int virtio_gpu_resize(void);
+
 /**
  * Update display with current framebuffer
+ * Sets the display up on first use, then presents the whole back buffer
+ * through fb_swap_buffers().
  * @return 0 on success, -1 on error
  */
 int virtio_gpu_update_display(void);
 
+/**
+ * Present handler for fb_swap_buffers()
+ * Transfers the changed areas of a buffer to its host resource, switches
+ * the scanout to that resource if needed and flushes. Nearby rects are
+ * coalesced into at most VIRTIO_GPU_MAX_UPDATE_RECTS. The commands are
+ * posted with one notification and complete in the background; the next
+ * present first waits for this one.
+ * @param buffer Framebuffer buffer index (0 or 1)
+ * @param rects Areas changed since the last present, in screen coordinates
+ * @param n Number of rects
+ * @return 0 on success, -1 on error
+ */
+int virtio_gpu_present(uint32_t buffer, const rect_t *rects, uint32_t n);
+
+/**
+ * Upload a cursor image to the cursor plane
+ * The image is copied into a 64x64 host resource once; moving the cursor
+ * afterwards costs one cursor queue command and no pixels.
+ * @param image ARGB8888 pixels, alpha 0 transparent
+ * @param width Image width (at most VIRTIO_GPU_CURSOR_SIZE)
+ * @param height Image height (at most VIRTIO_GPU_CURSOR_SIZE)
+ * @param hot_x Hotspot X within the image
+ * @param hot_y Hotspot Y within the image
+ * @return 0 on success, -1 on error (no cursor queue)
+ */
+int virtio_gpu_define_cursor(const uint32_t *image, uint32_t width, uint32_t height,
+                             uint32_t hot_x, uint32_t hot_y);
+
+/**
+ * Move the hardware cursor
+ * @param x Screen X of the hotspot
+ * @param y Screen Y of the hotspot
+ * @param visible false to hide the cursor
+ * @return 0 on success, -1 on error
+ */
+int virtio_gpu_move_cursor(int32_t x, int32_t y, bool visible);
+
+/**
+ * Get virtio-gpu statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void virtio_gpu_get_stats(virtio_gpu_stats_t *stats);
+
 #endif /* AEOS_VIRTIO_GPU_H */
 
 /* ============================================================================
@@ -52,6 +52,7 @@ typedef struct {
 /* VirtIO Input device state */
 typedef struct {
     virtio_device_t vdev;
+    uint32_t irq;               /* GIC INTID of the device's slot */
     bool is_keyboard;
     bool is_mouse;
     bool initialized;
@@ -66,7 +67,8 @@ int virtio_input_init(void);
 
 /**
  * Poll VirtIO input devices
- * Generates events for the event queue
+ * Events normally arrive by interrupt; this only looks at the used rings
+ * in memory, so it is cheap when nothing is pending.
  */
 void virtio_input_poll(void);
 
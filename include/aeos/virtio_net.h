@@ -0,0 +1,152 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/virtio_net.h
+ * Description: VirtIO network device driver interface
+ * ============================================================================ */
+
+#ifndef AEOS_VIRTIO_NET_H
+#define AEOS_VIRTIO_NET_H
+
+#include <aeos/types.h>
+#include <aeos/virtq.h>
+
+/*
+ * Receive buffers come from a page pool and are all posted at init. A
+ * frame is handed to the receive handler where the device wrote it; the
+ * handler may keep the buffer and give it back later instead of copying.
+ * A send is a chain of a copied link-level header and buffers of the
+ * caller's, which must stay untouched until the send's fence completes.
+ */
+
+/* Feature bits */
+#define VIRTIO_NET_F_MAC            (1U << 5)   /* Config space has a MAC */
+
+/* Device configuration (MMIO offset 0x100) */
+#define VIRTIO_NET_CFG_MAC          0x100       /* 6 bytes */
+
+#define VIRTIO_NET_ALEN             6           /* MAC address bytes */
+#define VIRTIO_NET_MTU              1500
+#define VIRTIO_NET_FRAME_MAX        (VIRTIO_NET_MTU + 14)
+
+/* Receive buffers posted, two per pool page */
+#define VIRTIO_NET_RX_BUFFERS       128
+#define VIRTIO_NET_RX_BUF_SIZE      2048
+
+/* Sends in flight at once */
+#define VIRTIO_NET_TX_SLOTS         64
+
+/* Header bytes a send copies (Ethernet, IPv4 and UDP headers fit) */
+#define VIRTIO_NET_TX_HEADROOM      64
+
+/* Caller buffers per send: an indirect table holds the rest of the chain */
+#define VIRTIO_NET_TX_BUFS          (VIRTQ_INDIRECT_MAX - 2)
+
+/* Header in front of every frame (legacy devices leave out num_buffers) */
+typedef struct {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+} __attribute__((packed)) virtio_net_hdr_t;
+
+/**
+ * Receive handler, called from the interrupt with the receive queue locked
+ * It may send (the transmit queue has a lock of its own). It may keep the
+ * frame by returning true and hand it back with virtio_net_rx_release()
+ * later, but not from the handler itself.
+ *
+ * @param frame Ethernet frame, in the receive buffer
+ * @param len Frame length in bytes
+ * @return true if the handler keeps the buffer
+ */
+typedef bool (*virtio_net_rx_fn)(void *frame, uint32_t len);
+
+/* VirtIO network statistics */
+typedef struct {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_waits;              /* Sends that found every slot in flight */
+    uint64_t interrupts;
+    uint64_t notifies;              /* Queue notifications, both queues */
+    uint64_t notifies_saved;        /* Publishes the device didn't need to hear of */
+    uint32_t rx_posted;             /* Receive buffers with the device */
+    uint32_t rx_held;               /* Receive buffers kept by the handler */
+    uint32_t tx_in_flight;
+    bool indirect;                  /* One ring slot per send */
+    bool event_idx;                 /* Interrupts and notifications by index */
+} virtio_net_stats_t;
+
+/**
+ * Initialize the VirtIO network device
+ * @return 0 on success, -1 if there is no device
+ */
+int virtio_net_init(void);
+
+/**
+ * Check whether a network device was initialized
+ */
+bool virtio_net_present(void);
+
+/**
+ * Get the device's MAC address
+ */
+void virtio_net_get_mac(uint8_t mac[VIRTIO_NET_ALEN]);
+
+/**
+ * Set the receive handler (NULL drops every frame)
+ */
+void virtio_net_set_rx_handler(virtio_net_rx_fn fn);
+
+/**
+ * Give a kept receive buffer back to the device
+ *
+ * @param frame Frame pointer the handler was given
+ */
+void virtio_net_rx_release(void *frame);
+
+/**
+ * Queue a frame for sending and notify the device if it wants to know
+ * Waits for a slot when all of them are in flight.
+ *
+ * @param head Start of the frame (copied), at most VIRTIO_NET_TX_HEADROOM bytes
+ * @param head_len Its length
+ * @param bufs Rest of the frame, referenced until the fence completes
+ * @param count Number of buffers, at most VIRTIO_NET_TX_BUFS
+ * @return Fence of the send, 0 on error
+ */
+uint64_t virtio_net_send(const void *head, uint32_t head_len,
+                         const virtq_buf_t *bufs, uint16_t count);
+
+/**
+ * Check whether every send up to a fence has completed
+ */
+bool virtio_net_tx_done(uint64_t fence);
+
+/**
+ * Wait for every send up to a fence to complete
+ *
+ * @return 0 on success, -1 on timeout
+ */
+int virtio_net_tx_wait(uint64_t fence);
+
+/**
+ * Process received frames without waiting for the interrupt
+ */
+void virtio_net_poll(void);
+
+/**
+ * Get virtio-net statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void virtio_net_get_stats(virtio_net_stats_t *stats);
+
+#endif /* AEOS_VIRTIO_NET_H */
+
+/* ============================================================================
+ * End of virtio_net.h
+ * ============================================================================ */
@@ -0,0 +1,151 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/virtq.h
+ * Description: Split virtqueues shared by the VirtIO drivers
+ * ============================================================================ */
+
+#ifndef AEOS_VIRTQ_H
+#define AEOS_VIRTQ_H
+
+#include <aeos/types.h>
+#include <aeos/virtio.h>
+
+/*
+ * A driver adds buffer chains with a token of its own, publishes them with
+ * one virtq_kick() and gets the tokens back from virtq_get_used() as the
+ * device finishes. Descriptors come from a free list. Negotiating
+ * VIRTIO_RING_F_INDIRECT_DESC puts each chain in a table of its own, so it
+ * takes one ring slot; VIRTIO_RING_F_EVENT_IDX lets both sides skip the
+ * notifications and interrupts the other one doesn't need.
+ *
+ * The publish is a store-release of the avail index, and the used index
+ * is read with a load-acquire, so the only full barriers are the ones
+ * that decide whether to notify or to expect an interrupt.
+ *
+ * The rings and indirect tables are DMA-coherent memory, so polling them
+ * never needs cache maintenance. Buffers are ordinary cached memory:
+ * when devices don't snoop the caches, virtq_add() cleans every buffer
+ * of a chain and virtq_get_used() invalidates the ones the device wrote.
+ *
+ * A virtqueue is not locked; its driver serializes the calls.
+ */
+
+/* Longest chain an indirect table holds (longer chains use the ring) */
+#define VIRTQ_INDIRECT_MAX  8
+
+/* One buffer of a chain: device-readable buffers come first */
+typedef struct {
+    uint64_t addr;                      /* Device address; for cached RAM its identity address */
+    uint32_t len;
+    bool write;                         /* Device writes it */
+} virtq_buf_t;
+
+/* A chain for virtq_add_many() */
+typedef struct {
+    const virtq_buf_t *bufs;
+    uint16_t count;
+    void *token;                        /* Returned by virtq_get_used() */
+} virtq_req_t;
+
+/* A split virtqueue */
+typedef struct {
+    volatile uint32_t *mmio;
+    uint32_t index;                     /* Queue number on the device */
+    uint16_t size;                      /* Ring size agreed with the device */
+    uint16_t num_free;                  /* Free descriptors */
+    uint16_t free_head;
+    uint16_t avail_idx;                 /* Next avail slot, published or not */
+    uint16_t kicked_idx;                /* Avail index the device was last given */
+    uint16_t last_used_idx;             /* Next used entry to reap */
+    bool event_idx;                     /* VIRTIO_RING_F_EVENT_IDX */
+    bool indirect;                      /* VIRTIO_RING_F_INDIRECT_DESC */
+    bool cb_enabled;                    /* Interrupts wanted (virtq_enable_cb) */
+    bool sync;                          /* Buffers need cache maintenance */
+
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    volatile uint16_t *avail_idx_p;     /* avail->idx */
+    volatile uint16_t *used_idx_p;      /* used->idx */
+    volatile uint16_t *used_event;      /* After the avail ring */
+    volatile uint16_t *avail_event;     /* After the used ring */
+    void **tokens;                      /* By head descriptor */
+    virtq_desc_t *tables;               /* Indirect tables, VIRTQ_INDIRECT_MAX per head */
+    uint64_t ring_dma;                  /* Device address of desc (rings follow) */
+    uint64_t tables_dma;                /* Device address of tables */
+
+    uint64_t kicks;                     /* Notifications sent */
+    uint64_t kicks_saved;               /* Publishes the device didn't need to hear of */
+} virtq_t;
+
+/**
+ * Set a virtqueue up and hand it to the device
+ * Call between virtio_negotiate() and virtio_driver_ok(); the negotiated
+ * features decide whether event indices and indirect tables are used.
+ *
+ * @param vq Virtqueue
+ * @param dev Device (mmio_base and features set)
+ * @param index Queue number
+ * @param max_size Largest ring wanted (rounded down to a power of two)
+ * @return 0 on success, -1 if the queue is missing or out of memory
+ */
+int virtq_init(virtq_t *vq, virtio_device_t *dev, uint32_t index, uint32_t max_size);
+
+/**
+ * Add a buffer chain, not yet visible to the device
+ *
+ * @param vq Virtqueue
+ * @param bufs Buffers, device-readable ones first
+ * @param count Number of buffers
+ * @param token Non-NULL value virtq_get_used() returns for the chain
+ * @return 0 on success, -1 if there are not enough free descriptors
+ */
+int virtq_add(virtq_t *vq, const virtq_buf_t *bufs, uint16_t count, void *token);
+
+/**
+ * Add several chains, published together by the next kick
+ *
+ * @return Chains added (fewer than count once descriptors run out)
+ */
+uint32_t virtq_add_many(virtq_t *vq, const virtq_req_t *reqs, uint32_t count);
+
+/**
+ * Publish the chains added since the last kick, notifying the device only
+ * if it asked to hear about them
+ *
+ * @return true if the device was notified
+ */
+bool virtq_kick(virtq_t *vq);
+
+/**
+ * Take the next chain the device has finished
+ *
+ * @param vq Virtqueue
+ * @param len Receives the bytes the device wrote (may be NULL)
+ * @return Its token, NULL if there is none
+ */
+void *virtq_get_used(virtq_t *vq, uint32_t *len);
+
+/**
+ * Check for finished chains without taking them
+ * Reads memory only, for cheap polling.
+ */
+bool virtq_has_used(virtq_t *vq);
+
+/**
+ * Ask the device not to interrupt, while draining
+ */
+void virtq_disable_cb(virtq_t *vq);
+
+/**
+ * Ask for an interrupt on the next finished chain again
+ *
+ * @return true if chains finished meanwhile: drain again before waiting
+ */
+bool virtq_enable_cb(virtq_t *vq);
+
+#endif /* AEOS_VIRTQ_H */
+
+/* ============================================================================
+ * End of virtq.h
+ * ============================================================================ */
@@ -0,0 +1,100 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/wait.h
+ * Description: Wait queues for processes blocked on a condition
+ * ============================================================================ */
+
+#ifndef AEOS_WAIT_H
+#define AEOS_WAIT_H
+
+#include <aeos/types.h>
+#include <aeos/spinlock.h>
+
+struct process;
+
+/*
+ * A waiter joins the queue before it checks its condition, so a wakeup
+ * between the check and the sleep is never lost:
+ *
+ *     waiter_t w = WAITER_INIT;
+ *
+ *     for (;;) {
+ *         wait_prepare(&wq, &w);
+ *         if (condition) {
+ *             break;
+ *         }
+ *         wait_sleep(&w, deadline);
+ *     }
+ *     wait_finish(&wq, &w);
+ *
+ * The waker makes the condition true and calls wake_up_all() (or
+ * wake_up_one()), which is safe from interrupt context. A wakeup takes
+ * the waiter off the queue; wait_prepare() puts it back for the next check.
+ *
+ * Without a process to block (early boot), or in a tasklet, wait_sleep()
+ * spins until woken or the deadline instead.
+ */
+
+/* No deadline */
+#define WAIT_FOREVER        ((uint64_t)-1)
+
+/* A process waiting on a queue; lives on the waiter's stack */
+typedef struct waiter {
+    struct process *proc;
+    struct waiter *next;
+    volatile bool woken;
+    bool queued;
+} waiter_t;
+
+/* A wait queue */
+typedef struct {
+    spinlock_t lock;
+    waiter_t *head;
+    waiter_t *tail;
+} wait_queue_t;
+
+#define WAITER_INIT         { NULL, NULL, false, false }
+#define WAIT_QUEUE_INIT     { SPINLOCK_INIT, NULL, NULL }
+
+/**
+ * Initialize a wait queue (empty)
+ */
+void wait_queue_init(wait_queue_t *wq);
+
+/**
+ * Join a wait queue before checking the condition
+ * Safe to call again on each pass of the wait loop.
+ */
+void wait_prepare(wait_queue_t *wq, waiter_t *w);
+
+/**
+ * Sleep until woken or a deadline
+ *
+ * @param w Waiter prepared on a queue
+ * @param deadline_ns Monotonic deadline (timer_get_ns()), or WAIT_FOREVER
+ * @return true if woken, false on timeout
+ */
+bool wait_sleep(waiter_t *w, uint64_t deadline_ns);
+
+/**
+ * Leave a wait queue once the wait is over
+ */
+void wait_finish(wait_queue_t *wq, waiter_t *w);
+
+/**
+ * Wake every process on a queue
+ * @return Number of waiters woken
+ */
+uint32_t wake_up_all(wait_queue_t *wq);
+
+/**
+ * Wake the longest-waiting process on a queue
+ * @return true if there was one
+ */
+bool wake_up_one(wait_queue_t *wq);
+
+#endif /* AEOS_WAIT_H */
+
+/* ============================================================================
+ * End of wait.h
+ * ============================================================================ */
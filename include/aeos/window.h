@@ -9,6 +9,7 @@
 
 #include <aeos/types.h>
 #include <aeos/event.h>
+#include <aeos/framebuffer.h>
 
 /* Maximum windows */
 #define MAX_WINDOWS 16
@@ -29,7 +30,7 @@
 #define WINDOW_FLAG_MINIMIZED   (1 << 4)
 #define WINDOW_FLAG_MAXIMIZED   (1 << 5)
 #define WINDOW_FLAG_DECORATED   (1 << 6)  /* Has title bar and border */
-#define WINDOW_FLAG_DIRTY       (1 << 7)  /* Needs redraw */
+#define WINDOW_FLAG_DIRTY       (1 << 7)  /* Content changed, backbuffer needs re-rendering */
 
 /* Window colors */
 #define WINDOW_TITLE_BG_FOCUSED     0xFF2060A0  /* Blue title bar */
@@ -40,6 +41,10 @@
 #define WINDOW_CLOSE_BTN_BG         0xFFC04040  /* Red close button */
 #define WINDOW_CLOSE_BTN_HOVER      0xFFFF4040  /* Brighter red on hover */
 
+/* Drop shadow of decorated windows, offset down and right (blended) */
+#define WINDOW_SHADOW_SIZE          6
+#define WINDOW_SHADOW_COLOR         0x60000000
+
 /* Forward declaration */
 struct window;
 
@@ -48,6 +53,7 @@ typedef void (*window_paint_fn)(struct window *win);
 typedef void (*window_key_fn)(struct window *win, key_event_t *key);
 typedef void (*window_mouse_fn)(struct window *win, mouse_event_t *mouse);
 typedef void (*window_close_fn)(struct window *win);
+typedef void (*window_tick_fn)(struct window *win);
 
 /* Window structure */
 typedef struct window {
@@ -67,9 +73,11 @@ typedef struct window {
     uint32_t client_width;
     uint32_t client_height;
 
-    /* Backbuffer (optional - for double buffering) */
+    /* Retained contents (width x height, decorations included); windows
+     * without one are painted straight to the screen */
     uint32_t *backbuffer;
-    uint32_t backbuffer_size;
+    uint32_t backbuffer_size;       /* Bytes */
+    rect_t dirty;                   /* Window-relative area to re-render */
 
     /* State */
     uint32_t flags;
@@ -86,6 +94,13 @@ typedef struct window {
     window_key_fn on_key;
     window_mouse_fn on_mouse;
     window_close_fn on_close;
+    window_tick_fn on_tick;         /* Each time the WM wakes, before compositing */
+    uint64_t tick_deadline;         /* Uptime (ms) on_tick next needs to run, 0 = none */
+
+    /* Re-renders by wm_redraw() (window_render, on_paint included) */
+    uint64_t paint_ns;              /* Last one */
+    uint64_t paint_total_ns;
+    uint64_t paints;
 
     /* User data */
     void *user_data;
@@ -140,19 +155,80 @@ void window_resize(window_t *win, uint32_t width, uint32_t height);
 
 /**
  * Mark window as needing redraw
+ * Damages the whole window on screen.
  */
 void window_invalidate(window_t *win);
 
 /**
- * Draw window (decorations + content)
+ * Mark part of the client area as needing redraw
+ * Coordinates are client-relative; only that area is repainted.
+ */
+void window_invalidate_rect(window_t *win, int32_t x, int32_t y,
+                            uint32_t w, uint32_t h);
+
+/**
+ * Scroll part of the client area up by dy pixels
+ * Moves the rendered pixels in the backbuffer, so nothing is repainted.
+ * The bottom dy rows keep stale pixels: the caller invalidates them.
+ *
+ * @return false if the contents could not be moved (no backbuffer, or
+ *         the area is not inside the client area); invalidate it instead
+ */
+bool window_scroll(window_t *win, int32_t x, int32_t y,
+                   uint32_t w, uint32_t h, uint32_t dy);
+
+/**
+ * Mark the title bar as needing redraw (title or focus changed)
+ */
+void window_invalidate_title(window_t *win);
+
+/**
+ * Re-render the dirty part of the window into its backbuffer
+ * Allocates the backbuffer on first use and after a resize. Does nothing if
+ * the window is clean.
+ * @return true if the window was painted
+ */
+bool window_render(window_t *win);
+
+/**
+ * Draw window on screen
+ * Blits the backbuffer, or paints directly if the window has none.
  */
 void window_draw(window_t *win);
 
+/**
+ * Free the backbuffer to give its memory back
+ * The window is marked dirty, so the next frame re-renders it into a new
+ * buffer, or paints it directly if none can be had. Called with the
+ * window manager lock held.
+ *
+ * @return Pages freed
+ */
+size_t window_drop_backbuffer(window_t *win);
+
 /**
  * Draw window decorations (title bar, border, close button)
  */
 void window_draw_decorations(window_t *win, bool focused);
 
+/**
+ * Screen strips of a window's drop shadow (right, then bottom)
+ * @return Number of strips, 0 if the window has no shadow
+ */
+uint32_t window_shadow_rects(const window_t *win, rect_t out[2]);
+
+/**
+ * Screen area a window changes: its bounds and its shadow
+ */
+void window_outer_bounds(const window_t *win, rect_t *r);
+
+/**
+ * Blend a window's drop shadow over what is below it, within the clip
+ * The shadow lies outside the window and its backbuffer, so the
+ * compositor draws it, clipped to what no window above covers.
+ */
+void window_draw_shadow(const window_t *win);
+
 /**
  * Check if point is in window
  */
@@ -196,6 +272,13 @@ void window_draw_rect(window_t *win, int32_t x, int32_t y,
 void window_puts(window_t *win, int32_t x, int32_t y,
                   const char *text, uint32_t fg, uint32_t bg);
 
+/**
+ * Draw len characters in one colour pair in window client area
+ * Characters that do not fit entirely inside the client area are dropped.
+ */
+void window_puts_run(window_t *win, int32_t x, int32_t y,
+                     const char *text, uint32_t len, uint32_t fg, uint32_t bg);
+
 /**
  * Draw single character in window client area
  */
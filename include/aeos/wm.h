@@ -10,11 +10,54 @@
 #include <aeos/types.h>
 #include <aeos/window.h>
 #include <aeos/event.h>
+#include <aeos/framebuffer.h>
 
 /* Mouse cursor size */
 #define CURSOR_WIDTH    12
 #define CURSOR_HEIGHT   20
 
+/**
+ * Compositor statistics
+ */
+typedef struct {
+    uint64_t frames;                /* Frames that repainted something */
+    uint64_t frame_dirty_pixels;    /* Pixels repainted by the last frame */
+    uint32_t frame_damage_rects;    /* Dirty rects in the last frame */
+    uint64_t total_dirty_pixels;    /* Pixels repainted since boot */
+    uint32_t frame_window_paints;   /* Windows re-rendered in the last frame */
+    uint64_t total_window_paints;   /* Window re-renders since boot */
+    uint32_t frame_windows_occluded;    /* Visible but fully covered */
+    uint32_t pending_damage_rects;  /* Dirty rects waiting for the next frame */
+    uint64_t wakeups;               /* Main loop iterations */
+    uint32_t refresh_hz;            /* Frame rate cap */
+} wm_stats_t;
+
+/* Frames kept for the moving frame-time figures */
+#define WM_FRAME_HISTORY    128
+
+/* Frame-time histogram: under 1 ms, then doubling (1-2 ms, ...), the last open */
+#define WM_FRAME_BUCKETS    7
+
+/**
+ * Frame timing, over the frames wm_run() presented
+ * The breakdown is of the last frame; window paints are the on_paint
+ * re-renders into backbuffers, compositing is the rest of wm_redraw().
+ */
+typedef struct {
+    uint32_t fps;                   /* Frames presented in the last second */
+    uint32_t history;               /* Frames behind the figures below */
+    uint64_t frame_ns;              /* Last frame, start to presented */
+    uint64_t paint_ns;              /* ... of which window paints */
+    uint64_t composite_ns;          /* ... compositing damage */
+    uint64_t cursor_ns;             /* ... software cursor */
+    uint64_t present_ns;            /* ... fb_swap_buffers (GPU submit) */
+    uint64_t pixels;                /* Pixels the last frame sent to the GPU */
+    uint64_t p50_ns;                /* Frame time over the history */
+    uint64_t p99_ns;
+    uint64_t max_ns;
+    uint32_t histogram[WM_FRAME_BUCKETS];
+} wm_frame_stats_t;
+
 /**
  * Initialize the window manager
  */
@@ -46,15 +89,27 @@ window_t *wm_get_focused_window(void);
 window_t *wm_window_at(int32_t x, int32_t y);
 
 /**
- * Redraw all windows (composite)
+ * Repaint the damaged areas (composite)
  */
 void wm_redraw(void);
 
 /**
- * Redraw screen and update display
+ * Run window ticks, then repaint damage, draw the cursor and update the
+ * display. The repaint is skipped when no damage is pending.
  */
 void wm_update_display(void);
 
+/**
+ * Add a screen area to the next frame's damage
+ * Overlapping and nearby areas are merged.
+ */
+void wm_add_damage(int32_t x, int32_t y, int32_t width, int32_t height);
+
+/**
+ * Damage the whole screen (full repaint on the next frame)
+ */
+void wm_damage_all(void);
+
 /**
  * Draw mouse cursor at current position
  */
@@ -67,7 +122,8 @@ void wm_handle_event(event_t *event);
 
 /**
  * Main window manager loop
- * Processes events and redraws
+ * Sleeps until input, damage or a timer deadline, handles events, and
+ * presents damage at most once per refresh period
  */
 void wm_run(void);
 
@@ -76,6 +132,38 @@ void wm_run(void);
  */
 void wm_request_exit(void);
 
+/**
+ * Wake the main loop
+ * Safe from interrupt context and any CPU.
+ */
+void wm_wake(void);
+
+/**
+ * Take the window manager lock
+ * wm_run() holds it for each pass of its loop, all but the idle wait, so
+ * holding it means no window paint, event handler or app is running. It
+ * guards the window list, the backbuffers and the desktop layer.
+ */
+void wm_lock(void);
+
+/**
+ * Try to take the window manager lock
+ * For shrinkers, which must not wait (see shrinker.h).
+ * @return true if taken
+ */
+bool wm_trylock(void);
+
+/**
+ * Release the window manager lock
+ */
+void wm_unlock(void);
+
+/**
+ * Set the frame rate cap
+ * @param hz Frames per second (0 restores the default)
+ */
+void wm_set_refresh_rate(uint32_t hz);
+
 /**
  * Check if window manager should exit
  */
@@ -98,4 +186,14 @@ window_t *wm_get_window_list(void);
  */
 uint32_t wm_get_window_count(void);
 
+/**
+ * Get compositor statistics
+ */
+void wm_get_stats(wm_stats_t *stats);
+
+/**
+ * Get frame timing over the last WM_FRAME_HISTORY frames
+ */
+void wm_get_frame_stats(wm_frame_stats_t *stats);
+
 #endif /* AEOS_WM_H */
@@ -0,0 +1,99 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: include/aeos/workqueue.h
+ * Description: Kernel workqueue run by worker processes
+ * ============================================================================ */
+
+#ifndef AEOS_WORKQUEUE_H
+#define AEOS_WORKQUEUE_H
+
+#include <aeos/types.h>
+#include <aeos/interrupts.h>
+
+/*
+ * Deferred work that may sleep: queue_work() appends an item to the
+ * system workqueue, and the next free worker process runs it. Items
+ * queued from an IRQ handler or a tasklet are fine; they start in order,
+ * but with several workers one may still run while a later one starts.
+ * An item never runs twice at once: queued again while it runs, it runs
+ * again afterwards.
+ *
+ * Workers are kernel processes with the usual PROCESS_STACK_SIZE stack.
+ * Items queued before workqueue_init() wait for the workers to start.
+ */
+
+/* Worker processes */
+#define WORKQUEUE_WORKERS   2
+
+typedef void (*work_fn_t)(void *arg);
+
+/* A work item */
+typedef struct work {
+    work_fn_t func;
+    void *arg;
+    struct work *next;                  /* On the queue */
+    uint64_t queued_at;                 /* Counter value when queued */
+    volatile bool pending;              /* Queued and not started yet */
+    volatile bool running;
+    bool again;                         /* Queued while running */
+} work_t;
+
+#define WORK_INIT(fn, a) { .func = (fn), .arg = (a) }
+
+/* Workqueue statistics */
+typedef struct {
+    irq_stat_t wait;                    /* Queued to started */
+    irq_stat_t run;                     /* Running time */
+    uint64_t queued;                    /* Items queued since boot */
+    uint32_t pending;                   /* On the queue now */
+    uint32_t workers;                   /* Workers started */
+    struct {
+        uint64_t pid;
+        uint64_t items;                 /* Items run */
+        bool busy;
+    } worker[WORKQUEUE_WORKERS];
+} workqueue_stats_t;
+
+/**
+ * Start the worker processes
+ * Call once the scheduler and the secondary CPUs are up.
+ *
+ * @return 0 on success, -1 if no worker could be started
+ */
+int workqueue_init(void);
+
+/**
+ * Prepare a work item
+ */
+void work_init(work_t *work, work_fn_t func, void *arg);
+
+/**
+ * Queue a work item on the system workqueue
+ * Safe from interrupt context.
+ *
+ * @return false if it was already pending
+ */
+bool queue_work(work_t *work);
+
+/**
+ * Check whether a work item is queued or running
+ */
+bool work_busy(const work_t *work);
+
+/**
+ * Wait until a work item is neither queued nor running
+ * Call from process context, not from the item itself.
+ */
+void work_flush(work_t *work);
+
+/**
+ * Get workqueue statistics
+ * @param stats Pointer to stats structure to fill
+ */
+void workqueue_get_stats(workqueue_stats_t *stats);
+
+#endif /* AEOS_WORKQUEUE_H */
+
+/* ============================================================================
+ * End of workqueue.h
+ * ============================================================================ */
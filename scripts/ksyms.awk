@@ -0,0 +1,40 @@
+# ============================================================================
+# AEOS - Abdalla's Educational Operating System
+# File: scripts/ksyms.awk
+# Description: Turn `nm -n` output into the kernel symbol table (assembly)
+# ============================================================================
+#
+# Keeps text symbols only (T/t), minus the $x/$d mapping symbols and .L
+# local labels. Input must be sorted by address, which nm -n does. With no
+# input it emits an empty table for the first link.
+
+BEGIN {
+    n = 0
+}
+
+NF == 3 && $2 ~ /^[Tt]$/ && $3 !~ /^\$/ && $3 !~ /^\.L/ {
+    addr[n] = $1
+    name[n] = $3
+    n++
+}
+
+END {
+    print "    .section .rodata.ksyms, \"a\""
+    print "    .balign 8"
+    print "    .globl ksyms_table"
+    print "ksyms_table:"
+    off = 0
+    for (i = 0; i < n; i++) {
+        printf "    .quad 0x%s\n    .long %d, 0\n", addr[i], off
+        off += length(name[i]) + 1
+    }
+    print "    .globl ksyms_count"
+    print "ksyms_count:"
+    printf "    .quad %d\n", n
+    print "    .globl ksyms_names"
+    print "ksyms_names:"
+    for (i = 0; i < n; i++) {
+        printf "    .asciz \"%s\"\n", name[i]
+    }
+    print "    .byte 0"
+}
@@ -0,0 +1,61 @@
+# ============================================================================
+# AEOS - Abdalla's Educational Operating System
+# File: scripts/trace2json.awk
+# Description: Convert a `trace dump` file to Chrome trace JSON
+# ============================================================================
+#
+# Usage: awk -f scripts/trace2json.awk trace.txt > trace.json
+# Then open trace.json in chrome://tracing or ui.perfetto.dev.
+#
+# Each CPU is a thread of one process. Span events (B/E, b/e) are named
+# after their event minus its last word, so irq_entry/irq_exit become
+# "irq" and virtio_submit/virtio_complete become "virtio".
+
+BEGIN {
+    n = 0
+    printf "{\"traceEvents\":["
+}
+
+$1 == "#" && $2 == "event" {
+    phase[$3] = $4
+    next
+}
+
+/^#/ || NF < 6 {
+    next
+}
+
+{
+    ns = $1; cpu = $2; pid = $3; ev = $4; a0 = $5; a1 = $6
+    ph = (ev in phase) ? phase[ev] : "i"
+
+    name = ev
+    if (ph != "i") {
+        sub(/_[^_]*$/, "", name)
+    }
+
+    if (!(cpu in cpus)) {
+        cpus[cpu] = 1
+        emit(sprintf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d," \
+                     "\"args\":{\"name\":\"CPU %d\"}}", cpu, cpu))
+    }
+
+    extra = ""
+    if (ph == "b" || ph == "e") {
+        extra = sprintf(",\"cat\":\"%s\",\"id\":\"%s:%s\"", name, a0, a1)
+    } else if (ph == "i") {
+        extra = ",\"s\":\"t\""
+    }
+
+    emit(sprintf("{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":0,\"tid\":%d%s," \
+                 "\"args\":{\"pid\":%d,\"a0\":\"0x%s\",\"a1\":\"0x%s\"}}",
+                 name, ph, ns / 1000.0, cpu, extra, pid, a0, a1))
+}
+
+END {
+    printf "\n],\"displayTimeUnit\":\"ns\"}\n"
+}
+
+function emit(s) {
+    printf "%s\n%s", (n++ ? "," : ""), s
+}
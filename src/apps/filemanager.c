@@ -9,6 +9,7 @@
 #include <aeos/wm.h>
 #include <aeos/framebuffer.h>
 #include <aeos/vfs.h>
+#include <aeos/task.h>
 #include <aeos/heap.h>
 #include <aeos/string.h>
 #include <aeos/kprintf.h>
@@ -28,11 +29,20 @@
 #define FM_ICON_WIDTH       16
 #define FM_PADDING          8
 
+/* Arena blocks (2^order pages) and the first size of the entry array */
+#define FM_ARENA_ORDER      1
+#define FM_ENTRIES_INITIAL  64
+
+/* Directory entries read per vfs_getdents() call */
+#define FM_DIRENT_BATCH     32
+
 /* Forward declarations */
 static void filemanager_paint(window_t *win);
 static void filemanager_key(window_t *win, key_event_t *key);
 static void filemanager_mouse(window_t *win, mouse_event_t *mouse);
 static void filemanager_close(window_t *win);
+static void filemanager_close_view(filemanager_t *fm);
+static void filemanager_release(filemanager_t *fm);
 
 /**
  * Create file manager
@@ -49,10 +59,18 @@ filemanager_t *filemanager_create(void)
 
     memset(fm, 0, sizeof(filemanager_t));
 
+    fm->arena = arena_create(FM_ARENA_ORDER);
+    if (!fm->arena) {
+        klog_error("Failed to allocate file manager arena");
+        kfree(fm);
+        return NULL;
+    }
+
     /* Create window */
     fm->window = window_create("Files", 150, 80, 400, 320,
                                 WINDOW_FLAG_VISIBLE);
     if (!fm->window) {
+        arena_destroy(fm->arena);
         kfree(fm);
         return NULL;
     }
@@ -70,6 +88,7 @@ filemanager_t *filemanager_create(void)
     fm->scroll_offset = 0;
     fm->visible_entries = (fm->window->client_height - FM_PATH_HEIGHT - FM_PADDING) /
                           FM_ENTRY_HEIGHT;
+    future_init(&fm->load);
 
     /* Register and load contents */
     wm_register_window(fm->window);
@@ -89,59 +108,147 @@ void filemanager_destroy(filemanager_t *fm)
         return;
     }
 
+    filemanager_release(fm);
+}
+
+/**
+ * Free a file manager once no file is being opened for it
+ */
+static void filemanager_release(filemanager_t *fm)
+{
+    if (fm->loading) {
+        /* filemanager_load_done() frees it */
+        fm->closing = true;
+        return;
+    }
+
+    filemanager_close_view(fm);
+    arena_destroy(fm->arena);
     kfree(fm);
 }
 
 /**
- * Refresh file list
+ * Make room for count more entries, doubling the array in the arena
+ * The old array is left behind until the next refresh resets the arena.
  */
-void filemanager_refresh(filemanager_t *fm)
+static bool filemanager_grow(filemanager_t *fm, uint32_t count)
 {
-    int dir_fd;
-    vfs_dirent_t dirent;
-    uint32_t index = 0;
+    file_entry_t *entries;
+    uint32_t capacity;
 
-    if (!fm) {
-        return;
+    if (fm->entry_count + count <= fm->entry_capacity) {
+        return true;
     }
 
-    fm->entry_count = 0;
+    capacity = fm->entry_capacity ? fm->entry_capacity * 2 : FM_ENTRIES_INITIAL;
+    while (capacity < fm->entry_count + count) {
+        capacity *= 2;
+    }
+    entries = (file_entry_t *)arena_alloc(fm->arena, capacity * sizeof(file_entry_t));
+    if (!entries) {
+        return false;
+    }
 
-    /* Add parent directory entry if not root */
-    if (strcmp(fm->current_path, "/") != 0) {
-        strcpy(fm->entries[index].name, "..");
-        fm->entries[index].is_directory = true;
-        fm->entries[index].size = 0;
-        index++;
+    if (fm->entry_count > 0) {
+        memcpy(entries, fm->entries, fm->entry_count * sizeof(file_entry_t));
+    }
+    fm->entries = entries;
+    fm->entry_capacity = capacity;
+    return true;
+}
+
+/**
+ * Load entries until at least count are held or the directory ends
+ * Reads whole batches from where the last load stopped, so a long listing
+ * costs nothing until it is scrolled through.
+ */
+static void filemanager_load(filemanager_t *fm, uint32_t count)
+{
+    vfs_dirent_t *dirent;
+    file_entry_t *entry;
+    ssize_t n, i;
+    int dir_fd;
+
+    if (fm->dir_done || fm->entry_count >= count) {
+        return;
     }
 
-    /* Open directory */
     dir_fd = vfs_open(fm->current_path, O_RDONLY, 0);
     if (dir_fd < 0) {
         klog_error("Failed to open %s", fm->current_path);
-        fm->entry_count = index;
+        fm->dir_done = true;
         return;
     }
+    vfs_seek(dir_fd, (int64_t)fm->dir_offset, SEEK_SET);
 
-    /* Read entries */
-    while (vfs_readdir(dir_fd, &dirent) == 0 && index < 64) {
-        /* Skip . and .. from VFS (we add our own ..) */
-        if (strcmp(dirent.name, ".") == 0 || strcmp(dirent.name, "..") == 0) {
-            continue;
+    while (fm->entry_count < count) {
+        /* Stop at the end, or when the arena is full */
+        if (!filemanager_grow(fm, FM_DIRENT_BATCH)) {
+            fm->dir_done = true;
+            break;
+        }
+        n = vfs_getdents(dir_fd, fm->batch, FM_DIRENT_BATCH);
+        if (n <= 0) {
+            fm->dir_done = true;
+            break;
         }
+        fm->dir_offset += (uint64_t)n;
+
+        for (i = 0; i < n; i++) {
+            dirent = &fm->batch[i];
 
-        strncpy(fm->entries[index].name, dirent.name, 63);
-        fm->entries[index].name[63] = '\0';
+            /* Skip . and .. from VFS (we add our own ..) */
+            if (strcmp(dirent->name, ".") == 0 || strcmp(dirent->name, "..") == 0) {
+                continue;
+            }
 
-        /* Use dirent info directly */
-        fm->entries[index].is_directory = (dirent.type == VFS_FILE_DIRECTORY);
-        fm->entries[index].size = (uint32_t)dirent.size;
+            entry = &fm->entries[fm->entry_count++];
+            strncpy(entry->name, dirent->name, 63);
+            entry->name[63] = '\0';
 
-        index++;
+            /* Use dirent info directly */
+            entry->is_directory = (dirent->type == VFS_FILE_DIRECTORY);
+            entry->size = (uint32_t)dirent->size;
+        }
     }
 
     vfs_close(dir_fd);
-    fm->entry_count = index;
+}
+
+/**
+ * Refresh file list
+ * The previous list and everything else in the arena go in one reset.
+ * Only the rows in view are read now; the rest as they scroll in.
+ */
+void filemanager_refresh(filemanager_t *fm)
+{
+    file_entry_t *entry;
+
+    if (!fm) {
+        return;
+    }
+
+    arena_reset(fm->arena);
+    fm->entries = NULL;
+    fm->entry_count = 0;
+    fm->entry_capacity = 0;
+    fm->dir_offset = 0;
+    fm->dir_done = false;
+
+    fm->batch = (vfs_dirent_t *)arena_alloc(fm->arena, FM_DIRENT_BATCH * sizeof(vfs_dirent_t));
+    if (!fm->batch) {
+        fm->dir_done = true;
+    }
+
+    /* Add parent directory entry if not root */
+    if (strcmp(fm->current_path, "/") != 0 && filemanager_grow(fm, 1)) {
+        entry = &fm->entries[fm->entry_count++];
+        strcpy(entry->name, "..");
+        entry->is_directory = true;
+        entry->size = 0;
+    }
+
+    filemanager_load(fm, fm->scroll_offset + fm->visible_entries);
 
     window_invalidate(fm->window);
 }
@@ -189,39 +296,117 @@ static void draw_file_icon(window_t *win, int32_t x, int32_t y)
 }
 
 /**
- * Open a file for viewing
+ * Leave the file viewer, dropping the file's mapping
  */
-static void filemanager_view_file(filemanager_t *fm, const char *name)
+static void filemanager_close_view(filemanager_t *fm)
+{
+    if (fm->view_map != NULL) {
+        vfs_munmap(fm->view_map, fm->view_content_len);
+        fm->view_map = NULL;
+    }
+    fm->view_data = fm->view_content;
+    fm->viewing_file = false;
+}
+
+/**
+ * Helper process: map or read the file in load_path
+ * @return 0 on success, -1 if it cannot be opened
+ */
+static int64_t filemanager_load_file(void *arg)
 {
-    char filepath[256];
+    filemanager_t *fm = (filemanager_t *)arg;
     int fd;
     ssize_t bytes_read;
+    int64_t size;
 
-    /* Build full path */
-    if (strcmp(fm->current_path, "/") == 0) {
-        snprintf(filepath, sizeof(filepath), "/%s", name);
-    } else {
-        snprintf(filepath, sizeof(filepath), "%s/%s", fm->current_path, name);
+    fd = vfs_open(fm->load_path, O_RDONLY, 0);
+    if (fd < 0) {
+        return -1;
     }
 
-    fd = vfs_open(filepath, O_RDONLY, 0);
-    if (fd < 0) {
-        return;
+    /* Show the whole file from its own pages; copy the start otherwise */
+    size = vfs_seek(fd, 0, SEEK_END);
+    vfs_seek(fd, 0, SEEK_SET);
+    if (size > 0 && size <= 0xFFFFFFFF) {
+        fm->view_map = vfs_mmap(fd, 0, (size_t)size, VFS_MAP_READ);
     }
 
-    bytes_read = vfs_read(fd, fm->view_content, sizeof(fm->view_content) - 1);
+    if (fm->view_map != NULL) {
+        fm->view_data = (const char *)fm->view_map;
+        fm->view_content_len = (uint32_t)size;
+    } else {
+        bytes_read = vfs_read(fd, fm->view_content, sizeof(fm->view_content) - 1);
+        if (bytes_read < 0) bytes_read = 0;
+        fm->view_content[bytes_read] = '\0';
+        fm->view_content_len = (uint32_t)bytes_read;
+    }
     vfs_close(fd);
+    return 0;
+}
+
+/**
+ * Task: show the file once the helper has loaded it
+ */
+static task_status_t filemanager_load_step(task_t *t)
+{
+    filemanager_t *fm = (filemanager_t *)t->arg;
+
+    TASK_BEGIN(t);
+
+    TASK_AWAIT(t, &fm->load);
+
+    if (fm->load.result == 0 && !fm->closing) {
+        fm->viewing_file = true;
+        fm->view_scroll = 0;
+        window_invalidate(fm->window);
+    }
+
+    TASK_END(t);
+}
+
+/**
+ * The load is over: free a closed file manager
+ */
+static void filemanager_load_done(task_t *t)
+{
+    filemanager_t *fm = (filemanager_t *)t->arg;
 
-    if (bytes_read < 0) bytes_read = 0;
-    fm->view_content[bytes_read] = '\0';
-    fm->view_content_len = (uint32_t)bytes_read;
+    fm->loading = false;
+    if (fm->closing) {
+        filemanager_release(fm);
+    }
+}
 
+/**
+ * Open a file for viewing
+ * The viewer appears when the file is loaded; the window stays live meanwhile.
+ */
+static void filemanager_view_file(filemanager_t *fm, const char *name)
+{
+    if (fm->loading) {
+        return;
+    }
+
+    /* Build full path */
+    if (strcmp(fm->current_path, "/") == 0) {
+        snprintf(fm->load_path, sizeof(fm->load_path), "/%s", name);
+    } else {
+        snprintf(fm->load_path, sizeof(fm->load_path), "%s/%s", fm->current_path, name);
+    }
+
+    filemanager_close_view(fm);
     strncpy(fm->view_filename, name, sizeof(fm->view_filename) - 1);
     fm->view_filename[sizeof(fm->view_filename) - 1] = '\0';
-    fm->viewing_file = true;
-    fm->view_scroll = 0;
 
-    window_invalidate(fm->window);
+    if (future_start(&fm->load, filemanager_load_file, fm) < 0) {
+        klog_error("File manager: cannot start loading %s", fm->load_path);
+        return;
+    }
+
+    fm->loading = true;
+    task_init(&fm->load_task, filemanager_load_step, fm);
+    fm->load_task.on_finish = filemanager_load_done;
+    task_spawn(&fm->load_task);
 }
 
 /**
@@ -250,7 +435,7 @@ static void filemanager_paint_viewer(window_t *win, filemanager_t *fm)
     y = FM_PATH_HEIGHT + 4;
 
     for (i = 0; i <= fm->view_content_len; i++) {
-        char c = (i < fm->view_content_len) ? fm->view_content[i] : '\n';
+        char c = (i < fm->view_content_len) ? fm->view_data[i] : '\n';
 
         if (c == '\n' || c == '\r' || line_pos >= sizeof(line_buf) - 1) {
             line_buf[line_pos] = '\0';
@@ -265,7 +450,7 @@ static void filemanager_paint_viewer(window_t *win, filemanager_t *fm)
             line_pos = 0;
 
             /* Skip \r\n pair */
-            if (c == '\r' && i + 1 < fm->view_content_len && fm->view_content[i + 1] == '\n') {
+            if (c == '\r' && i + 1 < fm->view_content_len && fm->view_data[i + 1] == '\n') {
                 i++;
             }
         } else {
@@ -303,7 +488,8 @@ static void filemanager_paint(window_t *win)
     /* Draw separator */
     window_fill_rect(win, 0, FM_PATH_HEIGHT, win->client_width, 1, FM_BORDER_COLOR);
 
-    /* Draw file entries */
+    /* Draw file entries, reading any that just scrolled into view */
+    filemanager_load(fm, fm->scroll_offset + fm->visible_entries);
     y = FM_PATH_HEIGHT + 4;
 
     for (i = fm->scroll_offset; i < fm->entry_count && y < (int32_t)(win->client_height - FM_ENTRY_HEIGHT); i++) {
@@ -358,7 +544,7 @@ static void filemanager_key(window_t *win, key_event_t *key)
         switch (key->keycode) {
             case KEY_BACKSPACE:
             case KEY_ESCAPE:
-                fm->viewing_file = false;
+                filemanager_close_view(fm);
                 break;
             case KEY_UP:
                 if (fm->view_scroll > 0) fm->view_scroll--;
@@ -384,6 +570,7 @@ static void filemanager_key(window_t *win, key_event_t *key)
             break;
 
         case KEY_DOWN:
+            filemanager_load(fm, (uint32_t)(fm->selected_index + 2));
             if (fm->selected_index < (int32_t)fm->entry_count - 1) {
                 fm->selected_index++;
                 if ((uint32_t)fm->selected_index >= fm->scroll_offset + fm->visible_entries) {
@@ -512,7 +699,8 @@ static void filemanager_close(window_t *win)
     window_destroy(win);
 
     if (fm) {
-        kfree(fm);
+        fm->window = NULL;
+        filemanager_release(fm);
     }
 }
 
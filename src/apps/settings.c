@@ -19,10 +19,19 @@
 #define SETTINGS_LABEL      0xFF888888
 #define SETTINGS_VALUE      0xFFFFFFFF
 #define SETTINGS_HEADER     0xFF00AAFF
+#define SETTINGS_BAR        0xFF55DD77
+
+/* Performance section: client area rows, redrawn while the window is open */
+#define SETTINGS_PERF_Y     246
+#define SETTINGS_PERF_H     140
+#define SETTINGS_REFRESH_MS 500
+#define SETTINGS_BAR_H      24
+#define SETTINGS_BAR_STEP   40
 
 /* Forward declarations */
 static void settings_paint(window_t *win);
 static void settings_close(window_t *win);
+static void settings_tick(window_t *win);
 
 /**
  * Format memory size
@@ -38,6 +47,19 @@ static void format_size(char *buf, size_t size, uint64_t bytes)
     }
 }
 
+/**
+ * Format nanoseconds as milliseconds with one decimal
+ */
+static void format_ms(char *buf, size_t size, uint64_t ns)
+{
+    uint64_t tenths = ns / 100000;
+
+    if (tenths > 99999) {
+        tenths = 99999;
+    }
+    snprintf(buf, size, "%u.%u", (uint32_t)(tenths / 10), (uint32_t)(tenths % 10));
+}
+
 /**
  * Create settings window
  */
@@ -53,7 +75,7 @@ settings_t *settings_create(void)
     memset(settings, 0, sizeof(settings_t));
 
     /* Create window */
-    settings->window = window_create("Settings", 200, 100, 350, 280,
+    settings->window = window_create("Settings", 200, 20, 350, 420,
                                       WINDOW_FLAG_VISIBLE);
     if (!settings->window) {
         kfree(settings);
@@ -63,6 +85,7 @@ settings_t *settings_create(void)
     /* Set callbacks */
     settings->window->on_paint = settings_paint;
     settings->window->on_close = settings_close;
+    settings->window->on_tick = settings_tick;
     settings->window->user_data = settings;
 
     /* Register with window manager */
@@ -83,6 +106,73 @@ void settings_destroy(settings_t *settings)
     kfree(settings);
 }
 
+/**
+ * Draw the compositor's frame timing and its frame-time histogram
+ */
+static void paint_performance(window_t *win)
+{
+    static const char *const labels[WM_FRAME_BUCKETS] = {
+        "<1", "<2", "<4", "<8", "<16", "<32", "32+"
+    };
+    wm_frame_stats_t stats;
+    char buf[64], a[12], b[12], c[12];
+    int32_t y = SETTINGS_PERF_Y;
+    uint32_t i, peak = 1, h;
+
+    wm_get_frame_stats(&stats);
+
+    window_fill_rect(win, 10, y, win->client_width - 20, SETTINGS_PERF_H,
+                     SETTINGS_SECTION_BG);
+    y += 8;
+
+    window_puts(win, 20, y, "Performance (F12: HUD)", SETTINGS_HEADER, SETTINGS_SECTION_BG);
+    y += 16;
+
+    window_puts(win, 20, y, "Frame rate:", SETTINGS_LABEL, SETTINGS_SECTION_BG);
+    snprintf(buf, sizeof(buf), "%u fps", stats.fps);
+    window_puts(win, 120, y, buf, SETTINGS_VALUE, SETTINGS_SECTION_BG);
+    y += 14;
+
+    window_puts(win, 20, y, "Frame time:", SETTINGS_LABEL, SETTINGS_SECTION_BG);
+    format_ms(a, sizeof(a), stats.p50_ns);
+    format_ms(b, sizeof(b), stats.p99_ns);
+    format_ms(c, sizeof(c), stats.max_ns);
+    snprintf(buf, sizeof(buf), "p50 %s p99 %s max %s", a, b, c);
+    window_puts(win, 120, y, buf, SETTINGS_VALUE, SETTINGS_SECTION_BG);
+    y += 14;
+
+    window_puts(win, 20, y, "Last frame:", SETTINGS_LABEL, SETTINGS_SECTION_BG);
+    format_ms(a, sizeof(a), stats.frame_ns);
+    snprintf(buf, sizeof(buf), "%s ms, %u px to GPU", a, (uint32_t)stats.pixels);
+    window_puts(win, 120, y, buf, SETTINGS_VALUE, SETTINGS_SECTION_BG);
+    y += 14;
+
+    window_puts(win, 20, y, "Breakdown:", SETTINGS_LABEL, SETTINGS_SECTION_BG);
+    format_ms(a, sizeof(a), stats.paint_ns);
+    format_ms(b, sizeof(b), stats.composite_ns);
+    format_ms(c, sizeof(c), stats.present_ns);
+    snprintf(buf, sizeof(buf), "pnt %s cmp %s gpu %s", a, b, c);
+    window_puts(win, 120, y, buf, SETTINGS_VALUE, SETTINGS_SECTION_BG);
+    y += 18;
+
+    /* Histogram of the last frames (ms), scaled to the fullest bucket */
+    for (i = 0; i < WM_FRAME_BUCKETS; i++) {
+        if (stats.histogram[i] > peak) {
+            peak = stats.histogram[i];
+        }
+    }
+    for (i = 0; i < WM_FRAME_BUCKETS; i++) {
+        h = stats.histogram[i] * SETTINGS_BAR_H / peak;
+        if (stats.histogram[i] > 0 && h == 0) {
+            h = 1;
+        }
+        window_fill_rect(win, 24 + (int32_t)i * SETTINGS_BAR_STEP,
+                         y + SETTINGS_BAR_H - (int32_t)h, 24, h, SETTINGS_BAR);
+        window_puts(win, 24 + (int32_t)i * SETTINGS_BAR_STEP, y + SETTINGS_BAR_H + 4,
+                    labels[i], SETTINGS_LABEL, SETTINGS_SECTION_BG);
+    }
+}
+
 /**
  * Draw settings content
  */
@@ -159,6 +249,31 @@ static void settings_paint(window_t *win)
 
     window_puts(win, 20, y, "Resolution:", SETTINGS_LABEL, SETTINGS_SECTION_BG);
     window_puts(win, 120, y, "640x480 @ 32bpp", SETTINGS_VALUE, SETTINGS_SECTION_BG);
+
+    paint_performance(win);
+}
+
+/**
+ * Redraw the frame timing every SETTINGS_REFRESH_MS
+ */
+static void settings_tick(window_t *win)
+{
+    settings_t *settings = (settings_t *)win->user_data;
+    uint64_t now;
+
+    if (!settings) {
+        return;
+    }
+
+    now = timer_get_uptime_ms();
+    if (now - settings->last_refresh >= SETTINGS_REFRESH_MS) {
+        settings->last_refresh = now;
+        window_invalidate_rect(win, 10, SETTINGS_PERF_Y, win->client_width - 20,
+                               SETTINGS_PERF_H);
+    }
+
+    /* The WM sleeps until the next refresh */
+    win->tick_deadline = settings->last_refresh + SETTINGS_REFRESH_MS;
 }
 
 /**
@@ -9,11 +9,26 @@
 #include <aeos/wm.h>
 #include <aeos/framebuffer.h>
 #include <aeos/shell.h>
+#include <aeos/task.h>
+#include <aeos/pipe.h>
+#include <aeos/vfs.h>
+#include <aeos/process.h>
 #include <aeos/heap.h>
 #include <aeos/string.h>
 #include <aeos/kprintf.h>
 #include <aeos/timer.h>
 
+/* Client-area position of the cell grid */
+#define TERM_ORIGIN_X   4
+#define TERM_ORIGIN_Y   2
+
+/* Cursor blink half-period (ms) */
+#define TERM_BLINK_MS   500
+
+/* Command output: bytes shown per step, and how often an idle pipe is polled */
+#define TERM_DRAIN_MAX      2048
+#define TERM_OUTPUT_POLL_MS 10
+
 /* Terminal colors (RGB values) */
 static const uint32_t term_colors[] = {
     0xFF000000,  /* Black */
@@ -35,43 +50,170 @@ static const uint32_t term_colors[] = {
     0xFFFFFFFF   /* Bright White */
 };
 
-/* Active terminal for output redirection */
+/* Most recently created terminal */
 static terminal_t *active_terminal = NULL;
 
+/* Forward declarations */
+static void terminal_paint(window_t *win);
+static void terminal_key(window_t *win, key_event_t *key);
+static void terminal_close(window_t *win);
+static void terminal_tick(window_t *win);
+static void terminal_release(terminal_t *term);
+
 /**
- * kprintf output hook — sends characters to the active terminal
+ * Get a screen row from the cell ring
  */
-static void terminal_kprintf_hook(char c)
+static inline terminal_cell_t *term_row(terminal_t *term, uint32_t row)
 {
-    if (active_terminal) {
-        terminal_putchar(active_terminal, c);
+    return term->cells[(term->top + row) % TERMINAL_ROWS];
+}
+
+/**
+ * Note that columns [x0, x1) of a screen row changed
+ */
+static void term_mark_dirty(terminal_t *term, uint32_t row, uint32_t x0, uint32_t x1)
+{
+    if (row >= TERMINAL_ROWS || x0 >= x1) {
+        return;
+    }
+
+    if (term->dirty_x1[row] == 0) {
+        term->dirty_x0[row] = (uint8_t)x0;
+        term->dirty_x1[row] = (uint8_t)x1;
+    } else {
+        if (x0 < term->dirty_x0[row]) term->dirty_x0[row] = (uint8_t)x0;
+        if (x1 > term->dirty_x1[row]) term->dirty_x1[row] = (uint8_t)x1;
     }
 }
 
-/* Forward declarations */
-static void terminal_paint(window_t *win);
-static void terminal_key(window_t *win, key_event_t *key);
-static void terminal_close(window_t *win);
+/**
+ * Blank a row in the current colours
+ */
+static void term_clear_row(terminal_t *term, terminal_cell_t *cells)
+{
+    uint32_t col;
+
+    for (col = 0; col < TERMINAL_COLS; col++) {
+        cells[col].ch = ' ';
+        cells[col].fg = term->current_fg;
+        cells[col].bg = term->current_bg;
+        cells[col].attr = 0;
+    }
+}
 
 /**
  * Scroll terminal up by one line
+ * The top line goes to the scrollback and its ring slot becomes the new
+ * bottom line. The rendered rows are moved in the window's backbuffer, so
+ * only the new line is repainted.
  */
 static void terminal_scroll(terminal_t *term)
 {
-    uint32_t row, col;
+    terminal_cell_t *line = term_row(term, 0);
+    terminal_packed_cell_t *saved;
+    uint32_t col;
 
-    /* Move all lines up */
-    for (row = 0; row < TERMINAL_ROWS - 1; row++) {
+    if (term->scrollback) {
+        saved = &term->scrollback[term->scrollback_head * TERMINAL_COLS];
         for (col = 0; col < TERMINAL_COLS; col++) {
-            term->cells[row][col] = term->cells[row + 1][col];
+            saved[col].ch = line[col].ch;
+            saved[col].color = (uint8_t)(((line[col].fg & 0x0F) << 4) |
+                                         (line[col].bg & 0x0F));
+        }
+        term->scrollback_head = (term->scrollback_head + 1) % term->scrollback_limit;
+        if (term->scrollback_count < term->scrollback_limit) {
+            term->scrollback_count++;
+        } else if (term->scroll_offset > 0) {
+            /* Oldest line dropped under a scrolled-back view */
+            term->dirty_all = true;
         }
     }
 
-    /* Clear last line */
-    for (col = 0; col < TERMINAL_COLS; col++) {
-        term->cells[TERMINAL_ROWS - 1][col].ch = ' ';
-        term->cells[TERMINAL_ROWS - 1][col].fg = term->current_fg;
-        term->cells[TERMINAL_ROWS - 1][col].bg = term->current_bg;
+    term->top = (term->top + 1) % TERMINAL_ROWS;
+    term_clear_row(term, line);
+
+    /* Pending changes move up with their rows */
+    memmove(term->dirty_x0, term->dirty_x0 + 1, TERMINAL_ROWS - 1);
+    memmove(term->dirty_x1, term->dirty_x1 + 1, TERMINAL_ROWS - 1);
+    term->dirty_x0[TERMINAL_ROWS - 1] = 0;
+    term->dirty_x1[TERMINAL_ROWS - 1] = TERMINAL_COLS;
+    if (term->drawn_cursor_y > 0) {
+        term->drawn_cursor_y--;
+    }
+
+    if (term->scroll_offset > 0) {
+        /* Keep a scrolled-back view on the same lines */
+        if (term->scroll_offset < term->scrollback_count) {
+            term->scroll_offset++;
+        }
+        return;
+    }
+
+    if (!term->dirty_all &&
+        !window_scroll(term->window, TERM_ORIGIN_X, TERM_ORIGIN_Y,
+                       TERMINAL_COLS * TERMINAL_CHAR_WIDTH,
+                       TERMINAL_ROWS * TERMINAL_CHAR_HEIGHT,
+                       TERMINAL_CHAR_HEIGHT)) {
+        term->dirty_all = true;
+    }
+}
+
+/**
+ * Move the view into or out of the scrollback
+ */
+static void terminal_scroll_view(terminal_t *term, int32_t lines)
+{
+    int32_t offset = (int32_t)term->scroll_offset + lines;
+
+    if (offset < 0) {
+        offset = 0;
+    }
+    if (offset > (int32_t)term->scrollback_count) {
+        offset = (int32_t)term->scrollback_count;
+    }
+
+    if ((uint32_t)offset != term->scroll_offset) {
+        term->scroll_offset = (uint32_t)offset;
+        term->dirty_all = true;
+    }
+}
+
+/**
+ * Hand the changed cells to the window manager (once per frame)
+ */
+static void terminal_flush(terminal_t *term)
+{
+    window_t *win = term->window;
+    uint32_t row;
+
+    /* A moved cursor changes its old and new cell */
+    if (term->drawn_cursor_x != term->cursor_x ||
+        term->drawn_cursor_y != term->cursor_y) {
+        term_mark_dirty(term, term->drawn_cursor_y,
+                        term->drawn_cursor_x, term->drawn_cursor_x + 1);
+        term_mark_dirty(term, term->cursor_y, term->cursor_x, term->cursor_x + 1);
+        term->drawn_cursor_x = term->cursor_x;
+        term->drawn_cursor_y = term->cursor_y;
+    }
+
+    if (term->dirty_all) {
+        window_invalidate_rect(win, 0, 0, win->client_width, win->client_height);
+        memset(term->dirty_x1, 0, sizeof(term->dirty_x1));
+        term->dirty_all = false;
+        return;
+    }
+
+    for (row = 0; row < TERMINAL_ROWS; row++) {
+        if (term->dirty_x1[row] == 0) {
+            continue;
+        }
+        window_invalidate_rect(win,
+                               TERM_ORIGIN_X + term->dirty_x0[row] * TERMINAL_CHAR_WIDTH,
+                               TERM_ORIGIN_Y + row * TERMINAL_CHAR_HEIGHT,
+                               (term->dirty_x1[row] - term->dirty_x0[row]) *
+                               TERMINAL_CHAR_WIDTH,
+                               TERMINAL_CHAR_HEIGHT);
+        term->dirty_x1[row] = 0;
     }
 }
 
@@ -81,8 +223,9 @@ static void terminal_scroll(terminal_t *term)
 terminal_t *terminal_create(void)
 {
     terminal_t *term;
+    process_t *self;
     uint32_t win_width, win_height;
-    uint32_t row, col;
+    uint32_t row;
 
     term = (terminal_t *)kmalloc(sizeof(terminal_t));
     if (!term) {
@@ -109,6 +252,7 @@ terminal_t *terminal_create(void)
     term->window->on_paint = terminal_paint;
     term->window->on_key = terminal_key;
     term->window->on_close = terminal_close;
+    term->window->on_tick = terminal_tick;
     term->window->user_data = term;
 
     /* Initialize state */
@@ -121,14 +265,23 @@ terminal_t *terminal_create(void)
     term->last_blink = timer_get_uptime_ms();
     term->input_pos = 0;
     term->input_ready = false;
+    term->out_fd = -1;
+    future_init(&term->cmd);
+
+    /* Commands start where the creator is */
+    self = process_current();
+    term->cwd = (self != NULL) ? self->cwd : NULL;
+    strcpy(term->cwd_path, vfs_getcwd());
 
     /* Clear cells */
     for (row = 0; row < TERMINAL_ROWS; row++) {
-        for (col = 0; col < TERMINAL_COLS; col++) {
-            term->cells[row][col].ch = ' ';
-            term->cells[row][col].fg = TERM_COLOR_WHITE;
-            term->cells[row][col].bg = TERM_COLOR_BLACK;
-        }
+        term_clear_row(term, term->cells[row]);
+    }
+    term->top = 0;
+    term->dirty_all = true;
+
+    if (terminal_set_scrollback(term, TERMINAL_SCROLLBACK_LINES) != 0) {
+        klog_warn("Terminal: no memory for scrollback");
     }
 
     /* Register with window manager */
@@ -161,17 +314,44 @@ void terminal_destroy(terminal_t *term)
     }
 
     /* Window destruction handled by close callback */
-    kfree(term);
+    terminal_release(term);
+}
+
+/**
+ * Draw one row of cells, one call per run of cells sharing colours
+ */
+static void terminal_draw_row(window_t *win, uint32_t row,
+                              const char *text, const uint8_t *color)
+{
+    int32_t y = TERM_ORIGIN_Y + row * TERMINAL_CHAR_HEIGHT;
+    uint32_t col = 0, start;
+
+    while (col < TERMINAL_COLS) {
+        start = col;
+        while (col < TERMINAL_COLS && color[col] == color[start]) {
+            col++;
+        }
+
+        window_puts_run(win, TERM_ORIGIN_X + start * TERMINAL_CHAR_WIDTH, y,
+                        &text[start], col - start,
+                        term_colors[color[start] >> 4],
+                        term_colors[color[start] & 0x0F]);
+    }
 }
 
 /**
  * Draw terminal content
+ * Everything inside the clip is drawn; the clip is the area invalidated
+ * by terminal_flush(), usually a few cells.
  */
 static void terminal_paint(window_t *win)
 {
     terminal_t *term = (terminal_t *)win->user_data;
-    uint32_t row, col;
-    uint32_t fg, bg;
+    char text[TERMINAL_COLS];
+    uint8_t color[TERMINAL_COLS];
+    const terminal_packed_cell_t *saved;
+    const terminal_cell_t *cells;
+    uint32_t row, col, line, first;
     int32_t x, y;
 
     if (!term) {
@@ -181,42 +361,71 @@ static void terminal_paint(window_t *win)
     /* Clear background */
     window_clear(win, term_colors[TERM_COLOR_BLACK]);
 
-    /* Draw cells */
+    /* View line i is scrollback line i, then the screen rows */
+    first = term->scrollback_count - term->scroll_offset;
     for (row = 0; row < TERMINAL_ROWS; row++) {
-        y = row * TERMINAL_CHAR_HEIGHT + 2;
-        for (col = 0; col < TERMINAL_COLS; col++) {
-            x = col * TERMINAL_CHAR_WIDTH + 4;
-
-            fg = term_colors[term->cells[row][col].fg & 0x0F];
-            bg = term_colors[term->cells[row][col].bg & 0x0F];
-
-            window_putchar(win, x, y, term->cells[row][col].ch, fg, bg);
+        line = first + row;
+        if (line < term->scrollback_count) {
+            saved = &term->scrollback[((term->scrollback_head + term->scrollback_limit -
+                                        term->scrollback_count + line) %
+                                       term->scrollback_limit) * TERMINAL_COLS];
+            for (col = 0; col < TERMINAL_COLS; col++) {
+                text[col] = saved[col].ch;
+                color[col] = saved[col].color;
+            }
+        } else {
+            cells = term_row(term, line - term->scrollback_count);
+            for (col = 0; col < TERMINAL_COLS; col++) {
+                text[col] = cells[col].ch;
+                color[col] = (uint8_t)(((cells[col].fg & 0x0F) << 4) |
+                                       (cells[col].bg & 0x0F));
+            }
         }
+        terminal_draw_row(win, row, text, color);
     }
 
-    /* Draw cursor */
-    if (term->cursor_visible && term->cursor_blink_state) {
-        x = term->cursor_x * TERMINAL_CHAR_WIDTH + 4;
-        y = term->cursor_y * TERMINAL_CHAR_HEIGHT + 2;
+    /* Draw cursor (live view only) */
+    if (term->scroll_offset == 0 &&
+        term->cursor_visible && term->cursor_blink_state) {
+        cells = term_row(term, term->cursor_y);
+        x = TERM_ORIGIN_X + term->cursor_x * TERMINAL_CHAR_WIDTH;
+        y = TERM_ORIGIN_Y + term->cursor_y * TERMINAL_CHAR_HEIGHT;
         window_fill_rect(win, x, y, TERMINAL_CHAR_WIDTH, TERMINAL_CHAR_HEIGHT,
                          term_colors[TERM_COLOR_WHITE]);
 
         /* Draw character under cursor in inverse */
-        if (term->cells[term->cursor_y][term->cursor_x].ch != ' ') {
-            window_putchar(win, x, y,
-                           term->cells[term->cursor_y][term->cursor_x].ch,
+        if (cells[term->cursor_x].ch != ' ') {
+            window_putchar(win, x, y, cells[term->cursor_x].ch,
                            term_colors[TERM_COLOR_BLACK],
                            term_colors[TERM_COLOR_WHITE]);
         }
     }
+}
+
+/**
+ * Per-frame update: blink the cursor, then invalidate what changed
+ * Only the changed cells are repainted.
+ */
+static void terminal_tick(window_t *win)
+{
+    terminal_t *term = (terminal_t *)win->user_data;
+    uint64_t now;
+
+    if (!term) {
+        return;
+    }
 
-    /* Update cursor blink */
-    uint64_t now = timer_get_uptime_ms();
-    if (now - term->last_blink > 500) {
+    now = timer_get_uptime_ms();
+    if (term->cursor_visible && now - term->last_blink >= TERM_BLINK_MS) {
         term->cursor_blink_state = !term->cursor_blink_state;
         term->last_blink = now;
-        window_invalidate(win);
+        term_mark_dirty(term, term->cursor_y, term->cursor_x, term->cursor_x + 1);
     }
+
+    /* The WM sleeps until the next blink */
+    win->tick_deadline = term->cursor_visible ? term->last_blink + TERM_BLINK_MS : 0;
+
+    terminal_flush(term);
 }
 
 /**
@@ -230,8 +439,8 @@ static void terminal_key(window_t *win, key_event_t *key)
         return;
     }
 
+    /* Changed cells are invalidated by the next tick */
     terminal_handle_key(term, key);
-    window_invalidate(win);
 }
 
 /**
@@ -248,7 +457,8 @@ static void terminal_close(window_t *win)
         if (active_terminal == term) {
             active_terminal = NULL;
         }
-        kfree(term);
+        term->window = NULL;
+        terminal_release(term);
     }
 }
 
@@ -257,6 +467,8 @@ static void terminal_close(window_t *win)
  */
 void terminal_putchar(terminal_t *term, char c)
 {
+    terminal_cell_t *cell;
+
     if (!term) {
         return;
     }
@@ -278,9 +490,11 @@ void terminal_putchar(terminal_t *term, char c)
         term->cursor_x = (term->cursor_x + 8) & ~7;
     } else if (c >= 32 && c < 127) {
         /* Printable character */
-        term->cells[term->cursor_y][term->cursor_x].ch = c;
-        term->cells[term->cursor_y][term->cursor_x].fg = term->current_fg;
-        term->cells[term->cursor_y][term->cursor_x].bg = term->current_bg;
+        cell = &term_row(term, term->cursor_y)[term->cursor_x];
+        cell->ch = c;
+        cell->fg = term->current_fg;
+        cell->bg = term->current_bg;
+        term_mark_dirty(term, term->cursor_y, term->cursor_x, term->cursor_x + 1);
         term->cursor_x++;
     }
 
@@ -295,8 +509,6 @@ void terminal_putchar(terminal_t *term, char c)
         terminal_scroll(term);
         term->cursor_y--;
     }
-
-    window_invalidate(term->window);
 }
 
 /**
@@ -318,24 +530,49 @@ void terminal_puts(terminal_t *term, const char *str)
  */
 void terminal_clear(terminal_t *term)
 {
-    uint32_t row, col;
+    uint32_t row;
 
     if (!term) {
         return;
     }
 
     for (row = 0; row < TERMINAL_ROWS; row++) {
-        for (col = 0; col < TERMINAL_COLS; col++) {
-            term->cells[row][col].ch = ' ';
-            term->cells[row][col].fg = term->current_fg;
-            term->cells[row][col].bg = term->current_bg;
-        }
+        term_clear_row(term, term->cells[row]);
     }
 
     term->cursor_x = 0;
     term->cursor_y = 0;
+    term->scroll_offset = 0;
+    term->dirty_all = true;
+}
+
+/**
+ * Set the scrollback line limit
+ */
+int terminal_set_scrollback(terminal_t *term, uint32_t lines)
+{
+    terminal_packed_cell_t *buf = NULL;
+
+    if (!term) {
+        return -1;
+    }
 
-    window_invalidate(term->window);
+    if (lines > 0) {
+        buf = (terminal_packed_cell_t *)kmalloc(lines * TERMINAL_COLS *
+                                                sizeof(terminal_packed_cell_t));
+    }
+
+    kfree(term->scrollback);
+    term->scrollback = buf;
+    term->scrollback_limit = buf ? lines : 0;
+    term->scrollback_head = 0;
+    term->scrollback_count = 0;
+    if (term->scroll_offset > 0) {
+        term->scroll_offset = 0;
+        term->dirty_all = true;
+    }
+
+    return (lines > 0 && !buf) ? -1 : 0;
 }
 
 /**
@@ -370,14 +607,139 @@ void terminal_show_prompt(terminal_t *term)
     terminal_puts(term, "$ ");
 }
 
+/**
+ * Free a terminal once no command uses it
+ */
+static void terminal_release(terminal_t *term)
+{
+    if (term->busy) {
+        /* terminal_cmd_done() frees it */
+        term->closing = true;
+        return;
+    }
+
+    kfree(term->scrollback);
+    kfree(term);
+}
+
+/**
+ * Check whether a command line ends in '&'
+ */
+static bool terminal_background(const char *line)
+{
+    size_t len = strlen(line);
+
+    while (len > 0 && line[len - 1] == ' ') {
+        len--;
+    }
+    return len > 0 && line[len - 1] == '&';
+}
+
+/**
+ * Helper process: run a command line in the terminal's directory
+ */
+static int64_t terminal_run_line(void *arg)
+{
+    terminal_t *term = (terminal_t *)arg;
+    process_t *self = process_current();
+    int ret;
+
+    self->cwd = term->cwd;
+    strcpy(self->cwd_path, term->cwd_path);
+
+    ret = shell_execute_line(term->cmd_line);
+
+    /* cd carries over to the next command */
+    term->cwd = self->cwd;
+    strcpy(term->cwd_path, self->cwd_path);
+    return ret;
+}
+
+/**
+ * Show what the command has written so far
+ * @return 1 if more is waiting, 0 if the pipe is empty, -1 at end of file
+ */
+static int terminal_drain(terminal_t *term)
+{
+    char buf[128];
+    size_t shown = 0;
+    ssize_t n, i;
+
+    while (shown < TERM_DRAIN_MAX) {
+        n = vfs_read(term->out_fd, buf, sizeof(buf));
+        if (n == VFS_WOULD_BLOCK) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        /* A closed window only throws it away */
+        if (!term->closing) {
+            for (i = 0; i < n; i++) {
+                terminal_putchar(term, buf[i]);
+            }
+        }
+        shown += (size_t)n;
+    }
+    return 1;
+}
+
+/**
+ * Task: show a command's output until it is over, then the prompt
+ */
+static task_status_t terminal_cmd_step(task_t *t)
+{
+    terminal_t *term = (terminal_t *)t->arg;
+    int more;
+
+    TASK_BEGIN(t);
+
+    for (;;) {
+        more = terminal_drain(term);
+        if (more < 0) {
+            break;
+        }
+        if (more > 0) {
+            /* Give the frame a chance between chunks */
+            TASK_YIELD(t);
+        } else {
+            TASK_SLEEP_MS(t, TERM_OUTPUT_POLL_MS);
+        }
+    }
+
+    vfs_close(term->out_fd);
+    term->out_fd = -1;
+
+    /* The helper closed its end on the way out; wait until it is gone */
+    TASK_AWAIT(t, &term->cmd);
+
+    if (!term->closing) {
+        terminal_show_prompt(term);
+    }
+
+    TASK_END(t);
+}
+
+/**
+ * The command is over: take input again, or free a closed terminal
+ */
+static void terminal_cmd_done(task_t *t)
+{
+    terminal_t *term = (terminal_t *)t->arg;
+
+    term->busy = false;
+    if (term->closing) {
+        terminal_release(term);
+    }
+}
+
 /**
  * Execute shell command
  */
 void terminal_execute_command(terminal_t *term, const char *cmd)
 {
     char line[SHELL_MAX_LINE];
-    char *argv[SHELL_MAX_ARGS];
-    int argc;
+    int fds[2];
 
     if (!term || !cmd || cmd[0] == '\0') {
         return;
@@ -409,18 +771,39 @@ void terminal_execute_command(terminal_t *term, const char *cmd)
         return;
     }
 
-    /* Parse command */
-    if (shell_parse(line, &argc, argv) == 0 && argc > 0) {
-        /* Set active terminal and redirect kprintf output */
-        active_terminal = term;
-        kprintf_output_hook = terminal_kprintf_hook;
+    if (term->busy) {
+        terminal_puts(term, "A command is still running.\n");
+        return;
+    }
+    if (terminal_background(line)) {
+        terminal_puts(term, "Background jobs need the text-mode shell.\n");
+        return;
+    }
 
-        /* Execute */
-        shell_execute(argc, argv);
+    /* The helper's kprintf() output comes back through a pipe */
+    if (pipe_open(fds, O_NONBLOCK) < 0) {
+        terminal_puts(term, "Cannot start the command: no pipe.\n");
+        return;
+    }
 
-        /* Restore normal UART output */
-        kprintf_output_hook = NULL;
+    strcpy(term->cmd_line, line);
+    term->cmd.out_fd = fds[1];
+    if (future_start(&term->cmd, terminal_run_line, term) < 0) {
+        vfs_close(fds[0]);
+        vfs_close(fds[1]);
+        terminal_puts(term, "Cannot start the command: out of memory.\n");
+        return;
     }
+
+    /* The helper holds the write end now; end of file once it exits */
+    vfs_close(fds[1]);
+    term->cmd.out_fd = -1;
+    term->out_fd = fds[0];
+    term->busy = true;
+
+    task_init(&term->task, terminal_cmd_step, term);
+    term->task.on_finish = terminal_cmd_done;
+    task_spawn(&term->task);
 }
 
 /**
@@ -432,6 +815,22 @@ void terminal_handle_key(terminal_t *term, key_event_t *key)
         return;
     }
 
+    /* Shift+Up/Down page through the scrollback */
+    if ((key->modifiers & MOD_SHIFT) &&
+        (key->keycode == KEY_UP || key->keycode == KEY_DOWN)) {
+        terminal_scroll_view(term, key->keycode == KEY_UP ?
+                             TERMINAL_ROWS / 2 : -(TERMINAL_ROWS / 2));
+        return;
+    }
+
+    /* Any other key returns to the live view */
+    terminal_scroll_view(term, -(int32_t)term->scroll_offset);
+
+    /* No type-ahead while a command runs */
+    if (term->busy) {
+        return;
+    }
+
     /* Handle printable characters */
     if (key->ascii >= 32 && key->ascii < 127) {
         if (term->input_pos < sizeof(term->input_buffer) - 1) {
@@ -452,10 +851,12 @@ void terminal_handle_key(terminal_t *term, key_event_t *key)
                 terminal_execute_command(term, term->input_buffer);
             }
 
-            /* Reset input and show prompt */
+            /* Reset input; a running command shows the prompt when it is over */
             term->input_pos = 0;
             term->input_buffer[0] = '\0';
-            terminal_show_prompt(term);
+            if (!term->busy) {
+                terminal_show_prompt(term);
+            }
             break;
 
         case KEY_BACKSPACE:
@@ -466,9 +867,10 @@ void terminal_handle_key(terminal_t *term, key_event_t *key)
                 /* Erase character visually */
                 if (term->cursor_x > 0) {
                     term->cursor_x--;
-                    term->cells[term->cursor_y][term->cursor_x].ch = ' ';
+                    term_row(term, term->cursor_y)[term->cursor_x].ch = ' ';
+                    term_mark_dirty(term, term->cursor_y,
+                                    term->cursor_x, term->cursor_x + 1);
                 }
-                window_invalidate(term->window);
             }
             break;
 
@@ -478,11 +880,12 @@ void terminal_handle_key(terminal_t *term, key_event_t *key)
                 term->input_pos--;
                 if (term->cursor_x > 0) {
                     term->cursor_x--;
-                    term->cells[term->cursor_y][term->cursor_x].ch = ' ';
+                    term_row(term, term->cursor_y)[term->cursor_x].ch = ' ';
+                    term_mark_dirty(term, term->cursor_y,
+                                    term->cursor_x, term->cursor_x + 1);
                 }
             }
             term->input_buffer[0] = '\0';
-            window_invalidate(term->window);
             break;
 
         default:
@@ -0,0 +1,937 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/bench/bench.c
+ * Description: Kernel microbenchmark suite
+ * ============================================================================ */
+
+#include <aeos/bench.h>
+#include <aeos/heap.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/vfs.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/event.h>
+#include <aeos/framebuffer.h>
+#include <aeos/wm.h>
+#include <aeos/gui.h>
+#include <aeos/virtio_gpu.h>
+#include <aeos/semihosting.h>
+#include <aeos/timer.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * Every benchmark runs its operation in batches: one untimed warm-up batch,
+ * then a number of timed ones. A batch is long enough that the counter's
+ * resolution (16 ns at QEMU's 62.5 MHz) doesn't matter, and each batch time
+ * is divided by its operation count. Interrupts stay enabled, so timer ticks
+ * and other CPUs show up in the p99 column; min and median are the figures
+ * to compare between builds.
+ *
+ * The suite keeps its samples in static storage and is not reentrant.
+ */
+
+/* Most timed batches per benchmark */
+#define BENCH_MAX_SAMPLES   256
+#define BENCH_SAMPLES       200
+
+/* Longest output line */
+#define BENCH_LINE_MAX      128
+
+/* Output columns */
+#define COL_VARIANT         12
+#define COL_NUMBERS         26
+#define NUMBER_WIDTH        12
+
+/* kmalloc churn: allocations live at once */
+#define KMALLOC_BATCH       64
+
+/* memcpy/memset: two halves of a 128 KB block */
+#define MEMBUF_ORDER        5
+#define MEMBUF_HALF         (PAGE_SIZE << (MEMBUF_ORDER - 1))
+
+/* str*: arg is the string length, with STR_SCALAR for the byte loops */
+#define STR_SCALAR          (1ULL << 32)
+#define STR_LEN(arg)        ((size_t)((arg) & 0xFFFFFFFFULL))
+#define STR_NEEDLE          "foxes"
+
+/* format: what each variant formats */
+#define FMT_U32             0
+#define FMT_U64             1
+#define FMT_LOG             2
+
+/* vfs: file and directories created under BENCH_DIR and removed after */
+#define BENCH_DIR           "/.bench"
+#define BENCH_FILE          BENCH_DIR "/file"
+#define BENCH_IO_SIZE       4096
+#define PATH_MAX_DEPTH      8
+
+/* fb: off-screen target */
+#define FB_TARGET_W         256
+#define FB_TARGET_H         64
+
+/* Setup results */
+#define BENCH_OK            0
+#define BENCH_SKIP          1
+#define BENCH_FAIL          (-1)
+
+typedef struct {
+    const char *name;
+    const char *variant;
+    int (*setup)(uint64_t arg);         /* NULL if nothing to prepare */
+    void (*op)(uint64_t arg, uint32_t ops);
+    void (*teardown)(uint64_t arg);     /* Runs after a successful setup */
+    uint64_t arg;
+    uint32_t ops;                       /* Operations per batch */
+    uint32_t samples;                   /* Timed batches (0 = BENCH_SAMPLES) */
+} bench_t;
+
+static struct {
+    uint64_t samples[BENCH_MAX_SAMPLES];
+    const char *skip_reason;            /* Set by a setup returning BENCH_SKIP */
+    bool failed;                        /* Set by an operation that failed */
+
+    void *ptrs[KMALLOC_BATCH];
+    uint8_t *membuf;
+    volatile uintptr_t sink;            /* Keeps str* results live */
+    uint32_t *fb_target;
+    char io_buf[BENCH_IO_SIZE];
+    char path[PATH_MAX_DEPTH * 2 + sizeof(BENCH_DIR)];
+    int fd;
+
+    /* Context-switch partner: started once, then blocked between runs */
+    process_t *partner;
+    process_t *waiter;
+    volatile bool ping;
+    volatile bool pong;
+} bench;
+
+static int skip(const char *reason)
+{
+    bench.skip_reason = reason;
+    return BENCH_SKIP;
+}
+
+/* ============================================================================
+ * Memory
+ * ============================================================================ */
+
+/**
+ * Allocate a batch of blocks, then free every other one before the rest
+ * so the free list sees holes and merges rather than a plain stack
+ */
+static void op_kmalloc(uint64_t size, uint32_t ops)
+{
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        bench.ptrs[i] = kmalloc(size);
+        if (bench.ptrs[i] == NULL) {
+            bench.failed = true;
+        }
+    }
+    for (i = 0; i < ops; i += 2) {
+        kfree(bench.ptrs[i]);
+    }
+    for (i = 1; i < ops; i += 2) {
+        kfree(bench.ptrs[i]);
+    }
+}
+
+static void op_pmm(uint64_t order, uint32_t ops)
+{
+    uint64_t addr;
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        addr = pmm_alloc_pages((uint32_t)order);
+        if (addr == 0) {
+            bench.failed = true;
+            return;
+        }
+        pmm_free_pages(addr, (uint32_t)order);
+    }
+}
+
+static int setup_membuf(uint64_t size)
+{
+    uint64_t base;
+
+    (void)size;
+    base = pmm_alloc_pages(MEMBUF_ORDER);
+    if (base == 0) {
+        return BENCH_FAIL;
+    }
+    bench.membuf = (uint8_t *)base;
+    memset(bench.membuf, 0xA5, 2 * MEMBUF_HALF);
+    return BENCH_OK;
+}
+
+static void teardown_membuf(uint64_t size)
+{
+    (void)size;
+    pmm_free_pages((uint64_t)bench.membuf, MEMBUF_ORDER);
+    bench.membuf = NULL;
+}
+
+static void op_memcpy(uint64_t size, uint32_t ops)
+{
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        memcpy(bench.membuf + MEMBUF_HALF, bench.membuf, size);
+    }
+}
+
+static void op_memset(uint64_t size, uint32_t ops)
+{
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        memset(bench.membuf, (int)i, size);
+    }
+}
+
+/* ============================================================================
+ * Strings
+ * ============================================================================ */
+
+/**
+ * Two equal text strings of the given length, one in each half of membuf
+ * The second starts one byte into its half, so the two are never aligned
+ * alike for strcmp.
+ * The text repeats "the quick brown fox ", so strstr's first and last
+ * character filter for STR_NEEDLE sees near misses but no match.
+ */
+static int setup_string(uint64_t arg)
+{
+    static const char text[] = "the quick brown fox ";
+    size_t len = STR_LEN(arg), i;
+    char *s;
+
+    if (setup_membuf(arg) != BENCH_OK) {
+        return BENCH_FAIL;
+    }
+
+    s = (char *)bench.membuf;
+    for (i = 0; i < len; i++) {
+        s[i] = text[i % (sizeof(text) - 1)];
+    }
+    s[len] = '\0';
+    memcpy(s + MEMBUF_HALF + 1, s, len + 1);
+    return BENCH_OK;
+}
+
+static void op_strlen(uint64_t arg, uint32_t ops)
+{
+    const char *s = (const char *)bench.membuf;
+    size_t (*fn)(const char *) = (arg & STR_SCALAR) ? strlen_generic : strlen;
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        bench.sink = fn(s);
+    }
+}
+
+static void op_strchr(uint64_t arg, uint32_t ops)
+{
+    const char *s = (const char *)bench.membuf;
+    char *(*fn)(const char *, int) = (arg & STR_SCALAR) ? strchr_generic : strchr;
+    uint32_t i;
+
+    /* Not in the text: runs to the terminator */
+    for (i = 0; i < ops; i++) {
+        bench.sink = (uintptr_t)fn(s, 'z');
+    }
+}
+
+static void op_strcmp(uint64_t arg, uint32_t ops)
+{
+    const char *a = (const char *)bench.membuf;
+    const char *b = a + MEMBUF_HALF + 1;
+    int (*fn)(const char *, const char *) = (arg & STR_SCALAR) ? strcmp_generic : strcmp;
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        bench.sink = (uintptr_t)fn(a, b);
+    }
+}
+
+static void op_strstr(uint64_t arg, uint32_t ops)
+{
+    const char *s = (const char *)bench.membuf;
+    char *(*fn)(const char *, const char *) = (arg & STR_SCALAR) ? strstr_generic : strstr;
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        bench.sink = (uintptr_t)fn(s, STR_NEEDLE);
+    }
+}
+
+/**
+ * snprintf, the engine behind kprintf and klog, into a line buffer
+ */
+static void op_format(uint64_t arg, uint32_t ops)
+{
+    char *buf = bench.io_buf;
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        switch (arg) {
+        case FMT_U32:
+            bench.sink = (uintptr_t)snprintf(buf, BENCH_LINE_MAX, "%u", 4000000000U - i);
+            break;
+        case FMT_U64:
+            bench.sink = (uintptr_t)snprintf(buf, BENCH_LINE_MAX, "%llu",
+                                             18000000000000000000ULL - i);
+            break;
+        default:
+            /* A typical klog line: prefix, string, a few numbers, a pointer */
+            bench.sink = (uintptr_t)snprintf(buf, BENCH_LINE_MAX,
+                                             "[INFO]  %-8s %5u pages, %llu bytes at %p",
+                                             "pmm", i, (uint64_t)i << 12,
+                                             (void *)(uintptr_t)(0x40000000ULL + i));
+            break;
+        }
+    }
+}
+
+/* ============================================================================
+ * Filesystem
+ * ============================================================================ */
+
+static int setup_file(uint64_t arg)
+{
+    (void)arg;
+    if (vfs_mkdir(BENCH_DIR, 0755) != 0) {
+        return BENCH_FAIL;
+    }
+
+    bench.fd = vfs_open(BENCH_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (bench.fd < 0) {
+        vfs_rmdir(BENCH_DIR);
+        return BENCH_FAIL;
+    }
+
+    memset(bench.io_buf, 'b', sizeof(bench.io_buf));
+    if (vfs_write(bench.fd, bench.io_buf, BENCH_IO_SIZE) != BENCH_IO_SIZE) {
+        vfs_close(bench.fd);
+        vfs_unlink(BENCH_FILE);
+        vfs_rmdir(BENCH_DIR);
+        return BENCH_FAIL;
+    }
+    return BENCH_OK;
+}
+
+static void teardown_file(uint64_t arg)
+{
+    (void)arg;
+    vfs_close(bench.fd);
+    vfs_unlink(BENCH_FILE);
+    vfs_rmdir(BENCH_DIR);
+}
+
+static void op_open(uint64_t arg, uint32_t ops)
+{
+    uint32_t i;
+    int fd;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        fd = vfs_open(BENCH_FILE, O_RDONLY, 0);
+        if (fd < 0) {
+            bench.failed = true;
+            return;
+        }
+        vfs_close(fd);
+    }
+}
+
+static void op_write(uint64_t arg, uint32_t ops)
+{
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        vfs_seek(bench.fd, 0, SEEK_SET);
+        if (vfs_write(bench.fd, bench.io_buf, BENCH_IO_SIZE) != BENCH_IO_SIZE) {
+            bench.failed = true;
+        }
+    }
+}
+
+static void op_read(uint64_t arg, uint32_t ops)
+{
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        vfs_seek(bench.fd, 0, SEEK_SET);
+        if (vfs_read(bench.fd, bench.io_buf, BENCH_IO_SIZE) != BENCH_IO_SIZE) {
+            bench.failed = true;
+        }
+    }
+}
+
+/**
+ * BENCH_DIR/d/d/... down to depth components below BENCH_DIR
+ */
+static void build_path(uint32_t depth)
+{
+    size_t len = strlen(BENCH_DIR);
+    uint32_t i;
+
+    memcpy(bench.path, BENCH_DIR, len);
+    for (i = 0; i < depth; i++) {
+        bench.path[len++] = '/';
+        bench.path[len++] = 'd';
+    }
+    bench.path[len] = '\0';
+}
+
+static void teardown_path(uint64_t depth)
+{
+    uint32_t d;
+
+    for (d = (uint32_t)depth; d > 0; d--) {
+        build_path(d);
+        vfs_rmdir(bench.path);
+    }
+    vfs_rmdir(BENCH_DIR);
+}
+
+static int setup_path(uint64_t depth)
+{
+    uint32_t d;
+
+    if (vfs_mkdir(BENCH_DIR, 0755) != 0) {
+        return BENCH_FAIL;
+    }
+    for (d = 1; d <= depth; d++) {
+        build_path(d);
+        if (vfs_mkdir(bench.path, 0755) != 0) {
+            teardown_path(d - 1);
+            return BENCH_FAIL;
+        }
+    }
+    return BENCH_OK;
+}
+
+static void op_path(uint64_t depth, uint32_t ops)
+{
+    vfs_inode_t *inode;
+    uint32_t i;
+
+    (void)depth;
+    for (i = 0; i < ops; i++) {
+        if (vfs_path_lookup(bench.path, &inode) != 0) {
+            bench.failed = true;
+            return;
+        }
+    }
+}
+
+/* ============================================================================
+ * Scheduler and events
+ * ============================================================================ */
+
+/**
+ * Answer each ping with a pong, blocked in between
+ */
+static void pingpong_partner(void)
+{
+    for (;;) {
+        while (!bench.ping) {
+            scheduler_block_unless(&bench.ping);
+        }
+        bench.ping = false;
+        bench.pong = true;
+        scheduler_wake(bench.waiter);
+    }
+}
+
+static int setup_ctxsw(uint64_t arg)
+{
+    (void)arg;
+    bench.waiter = process_current();
+    if (bench.waiter == NULL) {
+        return skip("no current process");
+    }
+
+    if (bench.partner == NULL) {
+        bench.partner = process_create(pingpong_partner, "bench-pong");
+        if (bench.partner == NULL) {
+            return BENCH_FAIL;
+        }
+    }
+    return BENCH_OK;
+}
+
+/**
+ * Wake the partner and block until it wakes us back: two switches each
+ * (on another CPU when the scheduler placed the partner there)
+ */
+static void op_ctxsw(uint64_t arg, uint32_t ops)
+{
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        bench.pong = false;
+        bench.ping = true;
+        scheduler_wake(bench.partner);
+        while (!bench.pong) {
+            scheduler_block_unless(&bench.pong);
+        }
+    }
+}
+
+static int setup_event(uint64_t arg)
+{
+    (void)arg;
+    if (gui_is_running()) {
+        return skip("the desktop owns the event queue");
+    }
+
+    /* Nothing reads the queue in text mode */
+    event_queue_clear();
+    return BENCH_OK;
+}
+
+static void op_event(uint64_t arg, uint32_t ops)
+{
+    event_t ev;
+    uint32_t i;
+
+    (void)arg;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EVENT_KEY_DOWN;
+    ev.data.key.keycode = KEY_A;
+
+    for (i = 0; i < ops; i++) {
+        if (!event_push(&ev) || !event_pop(&ev)) {
+            bench.failed = true;
+            return;
+        }
+    }
+}
+
+/* ============================================================================
+ * Graphics
+ * ============================================================================ */
+
+static int setup_fb(uint64_t arg)
+{
+    fb_info_t *fb = fb_get_info();
+
+    (void)arg;
+    if (!fb || !fb->initialized) {
+        return skip("no framebuffer");
+    }
+
+    bench.fb_target = (uint32_t *)kmalloc(FB_TARGET_W * FB_TARGET_H * sizeof(uint32_t));
+    if (bench.fb_target == NULL) {
+        return BENCH_FAIL;
+    }
+
+    /* Draw off-screen so the display is left alone */
+    fb_set_target(bench.fb_target, 0, 0, FB_TARGET_W, FB_TARGET_H);
+    return BENCH_OK;
+}
+
+static void teardown_fb(uint64_t arg)
+{
+    (void)arg;
+    fb_set_target(NULL, 0, 0, 0, 0);
+    kfree(bench.fb_target);
+    bench.fb_target = NULL;
+}
+
+static void op_fill_rect(uint64_t size, uint32_t ops)
+{
+    uint32_t i;
+
+    for (i = 0; i < ops; i++) {
+        fb_fill_rect(0, 0, (int32_t)size, (int32_t)size, i & 1 ? COLOR_WHITE : COLOR_BLACK);
+    }
+}
+
+static void op_blend_rect(uint64_t size, uint32_t ops)
+{
+    uint32_t i;
+
+    /* Half alpha: every pixel goes through the blend kernel */
+    for (i = 0; i < ops; i++) {
+        fb_blend_rect(0, 0, (int32_t)size, (int32_t)size, i & 1 ? 0x80FFFFFF : 0x80000000);
+    }
+}
+
+static void op_puts(uint64_t arg, uint32_t ops)
+{
+    /* 32 characters */
+    static const char text[] = "The quick brown fox jumps over 1";
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        fb_puts(0, (int32_t)(i % 8) * 8, text, COLOR_WHITE, COLOR_BLACK);
+    }
+}
+
+static int setup_frame(uint64_t arg)
+{
+    (void)arg;
+    if (!gui_is_running()) {
+        return skip("needs the desktop (startx)");
+    }
+    if (virtio_gpu_update_display() != 0) {
+        return skip("no virtio-gpu display");
+    }
+    return BENCH_OK;
+}
+
+/**
+ * Repaint and present the whole screen
+ */
+static void op_frame(uint64_t arg, uint32_t ops)
+{
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < ops; i++) {
+        wm_damage_all();
+        wm_redraw();
+        if (virtio_gpu_update_display() != 0) {
+            bench.failed = true;
+            return;
+        }
+    }
+}
+
+/* ============================================================================
+ * Benchmark Table
+ * ============================================================================ */
+
+static const bench_t benches[] = {
+    {"kmalloc", "32B",      NULL, op_kmalloc, NULL, 32,   KMALLOC_BATCH, 0},
+    {"kmalloc", "256B",     NULL, op_kmalloc, NULL, 256,  KMALLOC_BATCH, 0},
+    {"kmalloc", "4KB",      NULL, op_kmalloc, NULL, 4096, KMALLOC_BATCH, 0},
+    {"pmm",     "order 0",  NULL, op_pmm,     NULL, 0,    32, 0},
+    {"pmm",     "order 2",  NULL, op_pmm,     NULL, 2,    32, 0},
+    {"pmm",     "order 4",  NULL, op_pmm,     NULL, 4,    32, 0},
+    {"pmm",     "order 6",  NULL, op_pmm,     NULL, 6,    32, 0},
+    {"memcpy",  "64B",      setup_membuf, op_memcpy, teardown_membuf, 64,    256, 0},
+    {"memcpy",  "4KB",      setup_membuf, op_memcpy, teardown_membuf, 4096,  64, 0},
+    {"memcpy",  "64KB",     setup_membuf, op_memcpy, teardown_membuf, 65536, 4, 0},
+    {"memset",  "64B",      setup_membuf, op_memset, teardown_membuf, 64,    256, 0},
+    {"memset",  "4KB",      setup_membuf, op_memset, teardown_membuf, 4096,  64, 0},
+    {"memset",  "64KB",     setup_membuf, op_memset, teardown_membuf, 65536, 4, 0},
+    {"strlen",  "64B",      setup_string, op_strlen, teardown_membuf, 64, 256, 0},
+    {"strlen",  "64B scalar", setup_string, op_strlen, teardown_membuf, 64 | STR_SCALAR, 256, 0},
+    {"strlen",  "4KB",      setup_string, op_strlen, teardown_membuf, 4096, 64, 0},
+    {"strlen",  "4KB scalar", setup_string, op_strlen, teardown_membuf, 4096 | STR_SCALAR, 64, 0},
+    {"strchr",  "4KB",      setup_string, op_strchr, teardown_membuf, 4096, 64, 0},
+    {"strchr",  "4KB scalar", setup_string, op_strchr, teardown_membuf, 4096 | STR_SCALAR, 64, 0},
+    {"strcmp",  "16B",      setup_string, op_strcmp, teardown_membuf, 16, 256, 0},
+    {"strcmp",  "16B scalar", setup_string, op_strcmp, teardown_membuf, 16 | STR_SCALAR, 256, 0},
+    {"strcmp",  "4KB",      setup_string, op_strcmp, teardown_membuf, 4096, 64, 0},
+    {"strcmp",  "4KB scalar", setup_string, op_strcmp, teardown_membuf, 4096 | STR_SCALAR, 64, 0},
+    {"strstr",  "4KB",      setup_string, op_strstr, teardown_membuf, 4096, 16, 0},
+    {"strstr",  "4KB scalar", setup_string, op_strstr, teardown_membuf, 4096 | STR_SCALAR, 16, 0},
+    {"format",  "%u",       NULL, op_format, NULL, FMT_U32, 256, 0},
+    {"format",  "%llu",     NULL, op_format, NULL, FMT_U64, 256, 0},
+    {"format",  "log line", NULL, op_format, NULL, FMT_LOG, 64, 0},
+    {"vfs",     "open",     setup_file, op_open,  teardown_file, 0, 32, 0},
+    {"vfs",     "write 4KB", setup_file, op_write, teardown_file, 0, 32, 0},
+    {"vfs",     "read 4KB", setup_file, op_read,  teardown_file, 0, 32, 0},
+    {"path",    "depth 1",  setup_path, op_path,  teardown_path, 1, 64, 0},
+    {"path",    "depth 4",  setup_path, op_path,  teardown_path, 4, 64, 0},
+    {"path",    "depth 8",  setup_path, op_path,  teardown_path, 8, 64, 0},
+    {"ctxsw",   "round trip", setup_ctxsw, op_ctxsw, NULL, 0, 16, 100},
+    {"event",   "push+pop", setup_event, op_event, NULL, 0, 128, 0},
+    {"fb",      "fill 64x64", setup_fb, op_fill_rect, teardown_fb, 64, 32, 0},
+    {"fb",      "blend 64x64", setup_fb, op_blend_rect, teardown_fb, 64, 32, 0},
+    {"fb",      "puts 32",  setup_fb, op_puts,   teardown_fb, 0, 32, 0},
+    {"frame",   "full",     setup_frame, op_frame, NULL, 0, 1, 32},
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+/* What each benchmark measures, for bench_list() */
+static const struct {
+    const char *name;
+    const char *desc;
+} bench_descs[] = {
+    {"kmalloc", "kmalloc/kfree churn, 64 blocks live"},
+    {"pmm",     "pmm_alloc_pages/pmm_free_pages by order"},
+    {"memcpy",  "memcpy between two buffers"},
+    {"memset",  "memset of one buffer"},
+    {"strlen",  "strlen of a text string, NEON and byte loop"},
+    {"strchr",  "strchr for a missing character"},
+    {"strcmp",  "strcmp of equal strings, differently aligned"},
+    {"strstr",  "strstr for a missing word"},
+    {"format",  "snprintf (the kprintf engine) of numbers and a log line"},
+    {"vfs",     "open+close, write and read of a ramfs file"},
+    {"path",    "vfs_path_lookup by directory depth"},
+    {"ctxsw",   "block/wake round trip with a second process"},
+    {"event",   "event_push + event_pop"},
+    {"fb",      "fb_fill_rect, fb_blend_rect and fb_puts off-screen"},
+    {"frame",   "wm_redraw + virtio_gpu_update_display (desktop only)"},
+};
+
+#define NUM_DESCS (sizeof(bench_descs) / sizeof(bench_descs[0]))
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================ */
+
+typedef struct {
+    char buf[BENCH_LINE_MAX];
+    size_t len;
+} line_t;
+
+static void line_str(line_t *line, const char *str)
+{
+    while (*str != '\0' && line->len < sizeof(line->buf) - 1) {
+        line->buf[line->len++] = *str++;
+    }
+    line->buf[line->len] = '\0';
+}
+
+/* Spaces up to column col (at least one) */
+static void line_pad(line_t *line, size_t col)
+{
+    do {
+        line_str(line, " ");
+    } while (line->len < col && line->len < sizeof(line->buf) - 1);
+}
+
+/* tenths right-aligned as "123.4" in width characters */
+static void line_tenths(line_t *line, uint64_t tenths, size_t width)
+{
+    char tmp[24];
+    char *p = &tmp[sizeof(tmp) - 1];
+    size_t n;
+
+    *p = '\0';
+    *--p = (char)('0' + tenths % 10);
+    *--p = '.';
+    tenths /= 10;
+    do {
+        *--p = (char)('0' + tenths % 10);
+        tenths /= 10;
+    } while (tenths != 0);
+
+    for (n = strlen(p); n < width; n++) {
+        line_str(line, " ");
+    }
+    line_str(line, p);
+}
+
+/* Batch time in counter ticks to tenths of a nanosecond per operation */
+static uint64_t ticks_to_tenths(uint64_t ticks, uint64_t freq, uint32_t ops)
+{
+    uint64_t tenths = (ticks / freq) * 10000000000ULL +
+                      (ticks % freq) * 10000000000ULL / freq;
+
+    return tenths / ops;
+}
+
+static void sort_samples(uint64_t *s, uint32_t n)
+{
+    uint32_t i, j;
+    uint64_t v;
+
+    /* At most BENCH_MAX_SAMPLES, so an insertion sort does */
+    for (i = 1; i < n; i++) {
+        v = s[i];
+        for (j = i; j > 0 && s[j - 1] > v; j--) {
+            s[j] = s[j - 1];
+        }
+        s[j] = v;
+    }
+}
+
+static void print_result(const bench_t *b, const char *status, bench_print_fn out,
+                         void *ctx)
+{
+    line_t line = { .len = 0 };
+
+    line_str(&line, "  ");
+    line_str(&line, b->name);
+    line_pad(&line, COL_VARIANT);
+    line_str(&line, b->variant);
+    line_pad(&line, COL_NUMBERS);
+
+    if (status != NULL) {
+        line_str(&line, status);
+    } else {
+        uint64_t freq = timer_get_frequency();
+        uint32_t n = b->samples ? b->samples : BENCH_SAMPLES;
+
+        sort_samples(bench.samples, n);
+        line_tenths(&line, ticks_to_tenths(bench.samples[0], freq, b->ops), NUMBER_WIDTH);
+        line_tenths(&line, ticks_to_tenths(bench.samples[n / 2], freq, b->ops), NUMBER_WIDTH);
+        line_tenths(&line, ticks_to_tenths(bench.samples[(n * 99) / 100], freq, b->ops),
+                    NUMBER_WIDTH);
+    }
+    out(line.buf, ctx);
+}
+
+/* ============================================================================
+ * Running
+ * ============================================================================ */
+
+_Static_assert(BENCH_SAMPLES <= BENCH_MAX_SAMPLES, "too many samples per benchmark");
+
+/**
+ * Set up, warm up, time and report one benchmark
+ * @return 0 if it ran or was skipped, 1 if it failed
+ */
+static int run_one(const bench_t *b, bench_print_fn out, void *ctx)
+{
+    uint32_t n = b->samples ? b->samples : BENCH_SAMPLES;
+    uint64_t start;
+    uint32_t i;
+    int status = BENCH_OK;
+
+    bench.failed = false;
+    bench.skip_reason = NULL;
+
+    if (b->setup != NULL) {
+        status = b->setup(b->arg);
+    }
+    if (status == BENCH_SKIP) {
+        line_t reason = { .len = 0 };
+
+        line_str(&reason, "skipped: ");
+        line_str(&reason, bench.skip_reason);
+        print_result(b, reason.buf, out, ctx);
+        return 0;
+    }
+    if (status != BENCH_OK) {
+        print_result(b, "FAILED (setup)", out, ctx);
+        return 1;
+    }
+
+    /* Caches, the dcache and the glyph cache warm up untimed */
+    b->op(b->arg, b->ops);
+
+    for (i = 0; i < n && !bench.failed; i++) {
+        start = timer_get_counter();
+        b->op(b->arg, b->ops);
+        bench.samples[i] = timer_get_counter() - start;
+    }
+
+    if (b->teardown != NULL) {
+        b->teardown(b->arg);
+    }
+
+    if (bench.failed) {
+        print_result(b, "FAILED", out, ctx);
+        return 1;
+    }
+    print_result(b, NULL, out, ctx);
+    return 0;
+}
+
+/**
+ * Run benchmarks and report min/median/p99 time per operation
+ */
+int bench_run(const char *name, bench_print_fn out, void *ctx)
+{
+    line_t line = { .len = 0 };
+    uint32_t i, ran = 0;
+    int failed = 0;
+
+    if (out == NULL || timer_get_frequency() == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < NUM_BENCHES; i++) {
+        if (name != NULL && strcmp(benches[i].name, name) != 0) {
+            continue;
+        }
+
+        if (ran++ == 0) {
+            line_str(&line, "  benchmark");
+            line_pad(&line, COL_VARIANT);
+            line_str(&line, "variant");
+            line_pad(&line, COL_NUMBERS + NUMBER_WIDTH - 3);
+            line_str(&line, "min");
+            line_pad(&line, COL_NUMBERS + 2 * NUMBER_WIDTH - 6);
+            line_str(&line, "median");
+            line_pad(&line, COL_NUMBERS + 3 * NUMBER_WIDTH - 3);
+            line_str(&line, "p99  (ns/op)");
+            out(line.buf, ctx);
+        }
+        failed += run_one(&benches[i], out, ctx);
+    }
+
+    return ran == 0 ? -1 : failed;
+}
+
+/**
+ * List the benchmarks and what each measures
+ */
+void bench_list(bench_print_fn out, void *ctx)
+{
+    uint32_t i;
+
+    for (i = 0; i < NUM_DESCS; i++) {
+        line_t line = { .len = 0 };
+
+        line_str(&line, "  ");
+        line_str(&line, bench_descs[i].name);
+        line_pad(&line, COL_VARIANT);
+        line_str(&line, bench_descs[i].desc);
+        out(line.buf, ctx);
+    }
+}
+
+/* Console and host file together */
+typedef struct {
+    int fd;
+    bool failed;
+} host_out_t;
+
+static void print_to_host(const char *line, void *ctx)
+{
+    host_out_t *host = (host_out_t *)ctx;
+
+    kprintf("%s\n", line);
+    if (!host->failed &&
+        (semihost_write(host->fd, line, strlen(line)) != 0 ||
+         semihost_write(host->fd, "\n", 1) != 0)) {
+        host->failed = true;
+    }
+}
+
+/**
+ * Run every benchmark, copying the report to a host file
+ */
+int bench_run_to_host(const char *path)
+{
+    host_out_t host;
+    int failed;
+
+    if (path == NULL || !semihost_available()) {
+        return -1;
+    }
+
+    host.fd = semihost_open(path, SEMIHOST_OPEN_W);
+    if (host.fd < 0) {
+        return -1;
+    }
+    host.failed = false;
+
+    failed = bench_run(NULL, print_to_host, &host);
+    semihost_close(host.fd);
+
+    return host.failed ? -1 : failed;
+}
+
+/* ============================================================================
+ * End of bench.c
+ * ============================================================================ */
@@ -9,6 +9,7 @@ include(`src/boot/macros.m4')
 
     .section .text.boot
     .global _start
+    .global secondary_entry
 
 /* ============================================================================
  * _start - Kernel entry point
@@ -17,6 +18,8 @@ include(`src/boot/macros.m4')
  *   - MMU disabled
  *   - Caches disabled
  *   - x0 = device tree blob address (not used initially)
+ * Secondary cores stay powered off until smp_init() starts them at
+ * secondary_entry with PSCI CPU_ON.
  * ============================================================================ */
 _start:
     /* First, check which CPU core we are (only core 0 boots) */
@@ -24,7 +27,7 @@ _start:
     and x1, x1, 0xFF            /* Extract CPU ID */
     cbz x1, primary_cpu         /* If CPU 0, continue boot */
 
-    /* Secondary CPUs: park them in low-power mode */
+    /* Secondary CPUs released without PSCI: park them in low-power mode */
 secondary_cpu_park:
     WFI
     b secondary_cpu_park
@@ -32,11 +35,25 @@ secondary_cpu_park:
 primary_cpu:
     /* Save device tree pointer (x0) for later use */
     mov x19, x0
+    mov x20, 0                  /* x20 = 0: boot CPU */
+    b check_el
 
+/* ============================================================================
+ * secondary_entry - Entry point handed to PSCI CPU_ON
+ * Secondary cores start here with the MMU off, at the EL the kernel was
+ * booted in, and:
+ *   - x0 = context ID = address of this core's smp_boot_record_t
+ * ============================================================================ */
+secondary_entry:
+    mov x19, x0                 /* x19 = boot record */
+    mov x20, 1                  /* x20 = 1: secondary CPU */
+
+check_el:
     /* Check current exception level */
     mrs x0, CurrentEL
     and x0, x0, 0xC             /* Extract EL bits [3:2] */
     lsr x0, x0, 2               /* Shift to get EL number */
+    mov x21, x0                 /* Remember the boot EL */
 
     cmp x0, 2                   /* Are we in EL2? */
     b.eq drop_to_el1            /* Yes, drop to EL1 */
@@ -103,6 +120,8 @@ drop_to_el1:
  * EL1 Entry - Now running in EL1 (kernel mode)
  * ============================================================================ */
 el1_entry:
+    cbnz x20, secondary_el1     /* Secondaries skip the one-time setup */
+
     /* CRITICAL FIX: Set BOTH SP_EL0 and SP_EL1 to the SAME value */
     /* This way it doesn't matter if SPSel changes unexpectedly */
 
@@ -122,6 +141,7 @@ el1_entry:
     /* Interrupts will work regardless of SPSel value */
 
     /* Disable MMU and caches (should already be disabled) */
+    /* mmu_init() turns them back on once page tables are built */
     mrs x0, sctlr_el1
     bic x0, x0, 1               /* Clear M bit (MMU) */
     bic x0, x0, (1 << 2)        /* Clear C bit (data cache) */
@@ -134,6 +154,10 @@ el1_entry:
     ldr x1, =__bss_end
     ZERO_MEMORY(x0, x1, x2)
 
+    /* Record the boot EL (selects the PSCI conduit without a DTB) */
+    ldr x0, =smp_boot_el
+    str w21, [x0]
+
     /* Restore device tree pointer */
     mov x0, x19
 
@@ -145,6 +169,50 @@ halt:
     WFI
     b halt
 
+/* ============================================================================
+ * Secondary CPU EL1 entry
+ * Turns on the MMU with the boot CPU's translation registers (taken from
+ * the boot record at x19), switches to the per-CPU stack and enters C.
+ * ============================================================================ */
+secondary_el1:
+    /* Don't trap FP/SIMD at EL1 (CPACR_EL1.FPEN = 0b11) */
+    mov x0, (3 << 20)
+    msr cpacr_el1, x0
+
+    /* Same translation regime as the boot CPU */
+    ldp x0, x1, [x19, #0x08]    /* MAIR, TCR */
+    msr mair_el1, x0
+    msr tcr_el1, x1
+    ldr x0, [x19, #0x18]        /* TTBR0 */
+    msr ttbr0_el1, x0
+    ISB
+    tlbi vmalle1
+    ic iallu
+    dsb nsh
+    ISB
+    ldr x0, [x19, #0x20]        /* SCTLR: MMU and caches on */
+    msr sctlr_el1, x0
+    ISB
+
+    /* Exception vectors are shared by all cores */
+    ldr x0, =exception_vector_table
+    msr vbar_el1, x0
+    ISB
+
+    /* Per-CPU stack for both SP_EL0 and SP_EL1, as on the boot CPU */
+    ldr x0, [x19, #0x00]
+    msr spsel, #0
+    ISB
+    mov sp, x0
+    msr spsel, #1
+    ISB
+    mov sp, x0
+
+    /* secondary_main(cpu) does not return */
+    ldr x0, [x19, #0x28]
+    bl secondary_main
+    b halt
+
 /* ============================================================================
  * End of boot.asm
  * ============================================================================ */
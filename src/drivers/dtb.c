@@ -38,16 +38,16 @@ int dtb_init(void *dtb_addr)
         return -1;
     }
 
-    g_dtb_addr = dtb_addr;
-    g_dtb_header = (dtb_header_t *)dtb_addr;
-
-    /* Verify magic number */
-    uint32_t magic = fdt32_to_cpu(g_dtb_header->magic);
+    /* Verify magic number before trusting the blob */
+    uint32_t magic = fdt32_to_cpu(((dtb_header_t *)dtb_addr)->magic);
     if (magic != DTB_MAGIC) {
         klog_error("Invalid DTB magic: 0x%x (expected 0x%x)", magic, DTB_MAGIC);
         return -1;
     }
 
+    g_dtb_addr = dtb_addr;
+    g_dtb_header = (dtb_header_t *)dtb_addr;
+
     klog_info("DTB initialized at 0x%p", dtb_addr);
     klog_debug("  Total size: %u bytes", fdt32_to_cpu(g_dtb_header->totalsize));
     klog_debug("  Version: %u", fdt32_to_cpu(g_dtb_header->version));
@@ -55,6 +55,20 @@ int dtb_init(void *dtb_addr)
     return 0;
 }
 
+/**
+ * Read a big-endian value of one or two cells (only 4-byte aligned)
+ */
+static uint64_t dtb_read_cells(const uint8_t *b, uint32_t cells)
+{
+    uint64_t v = 0;
+    uint32_t i;
+
+    for (i = 0; i < 4 * cells; i++) {
+        v = (v << 8) | b[i];
+    }
+    return v;
+}
+
 /**
  * Get pointer to strings block
  */
@@ -162,6 +176,468 @@ int dtb_find_framebuffer(uint64_t *fb_addr, uint64_t *fb_size)
     return -1;
 }
 
+/**
+ * Find the PSCI conduit in the device tree
+ * Reads the "method" property of the top-level "psci" node
+ */
+int dtb_get_psci_method(void)
+{
+    if (g_dtb_header == NULL) {
+        return -1;
+    }
+
+    uint32_t struct_offset = fdt32_to_cpu(g_dtb_header->off_dt_struct);
+    uint32_t *p = (uint32_t *)((uint8_t *)g_dtb_addr + struct_offset);
+
+    uint32_t depth = 0;
+    bool in_psci_node = false;
+
+    while (1) {
+        uint32_t token = fdt32_to_cpu(*p++);
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+
+            depth++;
+            /* Root is depth 1, so /psci sits at depth 2 */
+            if (depth == 2 && strncmp(name, "psci", 4) == 0 &&
+                (name[4] == '\0' || name[4] == '@')) {
+                in_psci_node = true;
+            }
+
+            p = (uint32_t *)(((uintptr_t)p + strlen(name) + 1 + 3) & ~3);
+            break;
+        }
+
+        case FDT_END_NODE:
+            if (in_psci_node && depth == 2) {
+                in_psci_node = false;
+            }
+            depth--;
+            break;
+
+        case FDT_PROP: {
+            uint32_t len = fdt32_to_cpu(*p++);
+            uint32_t nameoff = fdt32_to_cpu(*p++);
+            const char *prop_name = dtb_get_string(nameoff);
+            const char *prop_data = (const char *)p;
+
+            if (in_psci_node && depth == 2 && strcmp(prop_name, "method") == 0) {
+                if (strcmp(prop_data, "hvc") == 0) {
+                    return DTB_PSCI_HVC;
+                }
+                if (strcmp(prop_data, "smc") == 0) {
+                    return DTB_PSCI_SMC;
+                }
+                klog_warn("Unknown PSCI method: %s", prop_data);
+                return -1;
+            }
+
+            p = (uint32_t *)(((uintptr_t)prop_data + len + 3) & ~3);
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            return -1;
+
+        default:
+            klog_error("Unknown DTB token: 0x%x", token);
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find a property of the top-level "chosen" node
+ * @param len Receives the property's length
+ * @return Property data (inside the blob), NULL if absent
+ */
+static const void *dtb_find_chosen_prop(const char *prop, uint32_t *len)
+{
+    if (g_dtb_header == NULL) {
+        return NULL;
+    }
+
+    uint32_t struct_offset = fdt32_to_cpu(g_dtb_header->off_dt_struct);
+    uint32_t *p = (uint32_t *)((uint8_t *)g_dtb_addr + struct_offset);
+
+    uint32_t depth = 0;
+    bool in_chosen_node = false;
+
+    while (1) {
+        uint32_t token = fdt32_to_cpu(*p++);
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+
+            depth++;
+            if (depth == 2 && strcmp(name, "chosen") == 0) {
+                in_chosen_node = true;
+            }
+
+            p = (uint32_t *)(((uintptr_t)p + strlen(name) + 1 + 3) & ~3);
+            break;
+        }
+
+        case FDT_END_NODE:
+            if (in_chosen_node && depth == 2) {
+                /* Only one /chosen */
+                return NULL;
+            }
+            depth--;
+            break;
+
+        case FDT_PROP: {
+            uint32_t prop_len = fdt32_to_cpu(*p++);
+            uint32_t nameoff = fdt32_to_cpu(*p++);
+            const char *prop_name = dtb_get_string(nameoff);
+            const uint8_t *prop_data = (const uint8_t *)p;
+
+            if (in_chosen_node && depth == 2 && strcmp(prop_name, prop) == 0) {
+                *len = prop_len;
+                return prop_data;
+            }
+
+            p = (uint32_t *)(((uintptr_t)prop_data + prop_len + 3) & ~3);
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            return NULL;
+
+        default:
+            klog_error("Unknown DTB token: 0x%x", token);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read a one- or two-cell address property
+ */
+static bool dtb_read_addr(const void *data, uint32_t len, uint64_t *addr)
+{
+    const uint8_t *b = (const uint8_t *)data;
+    uint32_t hi, lo;
+
+    if (len != 4 && len != 8) {
+        return false;
+    }
+
+    /* Properties are only 4-byte aligned: build the cells byte by byte */
+    lo = ((uint32_t)b[len - 4] << 24) | ((uint32_t)b[len - 3] << 16) |
+         ((uint32_t)b[len - 2] << 8) | b[len - 1];
+    hi = (len == 8) ? (((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+                       ((uint32_t)b[2] << 8) | b[3]) : 0;
+    *addr = ((uint64_t)hi << 32) | lo;
+    return true;
+}
+
+/**
+ * Find the kernel command line in the device tree
+ */
+const char *dtb_get_bootargs(void)
+{
+    const char *bootargs;
+    uint32_t len = 0;
+
+    bootargs = (const char *)dtb_find_chosen_prop("bootargs", &len);
+
+    /* The property includes its terminator */
+    if (bootargs == NULL || len == 0 || bootargs[len - 1] != '\0') {
+        return NULL;
+    }
+    return bootargs;
+}
+
+/**
+ * Find the initrd the loader placed in memory
+ */
+int dtb_get_initrd(uint64_t *start, uint64_t *end)
+{
+    const void *prop;
+    uint32_t len = 0;
+
+    prop = dtb_find_chosen_prop("linux,initrd-start", &len);
+    if (prop == NULL || !dtb_read_addr(prop, len, start)) {
+        return -1;
+    }
+
+    prop = dtb_find_chosen_prop("linux,initrd-end", &len);
+    if (prop == NULL || !dtb_read_addr(prop, len, end) || *end <= *start) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether the virtio-mmio transports snoop the CPU caches
+ */
+int dtb_virtio_dma_coherent(void)
+{
+    if (g_dtb_header == NULL) {
+        return -1;
+    }
+
+    uint32_t struct_offset = fdt32_to_cpu(g_dtb_header->off_dt_struct);
+    uint32_t *p = (uint32_t *)((uint8_t *)g_dtb_addr + struct_offset);
+
+    bool in_virtio_node = false;
+    uint32_t nodes = 0;
+    uint32_t coherent = 0;
+
+    while (1) {
+        uint32_t token = fdt32_to_cpu(*p++);
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+
+            if (strncmp(name, "virtio_mmio@", 12) == 0) {
+                in_virtio_node = true;
+                nodes++;
+            }
+
+            p = (uint32_t *)(((uintptr_t)p + strlen(name) + 1 + 3) & ~3);
+            break;
+        }
+
+        case FDT_END_NODE:
+            /* Transport nodes have no children */
+            in_virtio_node = false;
+            break;
+
+        case FDT_PROP: {
+            uint32_t len = fdt32_to_cpu(*p++);
+            uint32_t nameoff = fdt32_to_cpu(*p++);
+            const char *prop_name = dtb_get_string(nameoff);
+            const uint8_t *prop_data = (const uint8_t *)p;
+
+            if (in_virtio_node && strcmp(prop_name, "dma-coherent") == 0) {
+                coherent++;
+            }
+
+            p = (uint32_t *)(((uintptr_t)prop_data + len + 3) & ~3);
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            if (nodes == 0) {
+                return -1;
+            }
+            /* All or nothing: one cache policy serves every device */
+            return coherent == nodes;
+
+        default:
+            klog_error("Unknown DTB token: 0x%x", token);
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Append the (address, size) pairs of a reg property to regions
+ * @return New number of regions
+ */
+static uint32_t dtb_add_ranges(dtb_region_t *regions, uint32_t max, uint32_t n,
+                               const uint8_t *reg, uint32_t len,
+                               uint32_t addr_cells, uint32_t size_cells)
+{
+    uint32_t entry = 4 * (addr_cells + size_cells);
+    uint32_t off;
+
+    if (addr_cells == 0 || addr_cells > 2 || size_cells == 0 || size_cells > 2) {
+        klog_warn("DTB: unsupported reg cells %u/%u", addr_cells, size_cells);
+        return n;
+    }
+
+    for (off = 0; off + entry <= len && n < max; off += entry) {
+        regions[n].base = dtb_read_cells(reg + off, addr_cells);
+        regions[n].size = dtb_read_cells(reg + off + 4 * addr_cells, size_cells);
+        if (regions[n].size != 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Collect the reg ranges of /memory nodes, or of /reserved-memory children
+ */
+static uint32_t dtb_scan_memory(dtb_region_t *regions, uint32_t max, uint32_t n,
+                                bool reserved)
+{
+    if (g_dtb_header == NULL) {
+        return n;
+    }
+
+    uint32_t struct_offset = fdt32_to_cpu(g_dtb_header->off_dt_struct);
+    uint32_t *p = (uint32_t *)((uint8_t *)g_dtb_addr + struct_offset);
+
+    /* Cells default to 2 and 1 when a node does not say */
+    uint32_t root_ac = 2, root_sc = 1;
+    uint32_t rsv_ac = 2, rsv_sc = 1;
+    uint32_t depth = 0;
+    bool is_memory = false;             /* Depth-2 node is RAM */
+    bool in_reserved = false;           /* Inside /reserved-memory */
+    const uint8_t *node_reg = NULL;     /* reg of the depth-2 node */
+    const uint8_t *child_reg = NULL;    /* reg of a depth-3 node */
+    uint32_t node_reg_len = 0, child_reg_len = 0;
+
+    while (1) {
+        uint32_t token = fdt32_to_cpu(*p++);
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = (const char *)p;
+
+            depth++;
+            if (depth == 2) {
+                is_memory = strncmp(name, "memory", 6) == 0 &&
+                            (name[6] == '\0' || name[6] == '@');
+                in_reserved = strcmp(name, "reserved-memory") == 0;
+                rsv_ac = root_ac;
+                rsv_sc = root_sc;
+                node_reg = NULL;
+            }
+            child_reg = NULL;
+
+            p = (uint32_t *)(((uintptr_t)p + strlen(name) + 1 + 3) & ~3);
+            break;
+        }
+
+        case FDT_END_NODE:
+            if (!reserved && depth == 2 && is_memory && node_reg != NULL) {
+                n = dtb_add_ranges(regions, max, n, node_reg, node_reg_len,
+                                   root_ac, root_sc);
+            }
+            if (reserved && depth == 3 && in_reserved && child_reg != NULL) {
+                n = dtb_add_ranges(regions, max, n, child_reg, child_reg_len,
+                                   rsv_ac, rsv_sc);
+            }
+            if (depth == 2) {
+                is_memory = false;
+                in_reserved = false;
+            }
+            child_reg = NULL;
+            depth--;
+            break;
+
+        case FDT_PROP: {
+            uint32_t len = fdt32_to_cpu(*p++);
+            uint32_t nameoff = fdt32_to_cpu(*p++);
+            const char *prop_name = dtb_get_string(nameoff);
+            const uint8_t *prop_data = (const uint8_t *)p;
+            bool cells = len == 4 && (strcmp(prop_name, "#address-cells") == 0 ||
+                                      strcmp(prop_name, "#size-cells") == 0);
+            uint32_t value = cells ? (uint32_t)dtb_read_cells(prop_data, 1) : 0;
+
+            if (depth == 1 && cells) {
+                if (prop_name[1] == 'a') {
+                    root_ac = value;
+                } else {
+                    root_sc = value;
+                }
+            } else if (depth == 2 && in_reserved && cells) {
+                if (prop_name[1] == 'a') {
+                    rsv_ac = value;
+                } else {
+                    rsv_sc = value;
+                }
+            } else if (depth == 2 && strcmp(prop_name, "device_type") == 0) {
+                is_memory = strcmp((const char *)prop_data, "memory") == 0;
+            } else if (strcmp(prop_name, "reg") == 0) {
+                if (depth == 2) {
+                    node_reg = prop_data;
+                    node_reg_len = len;
+                } else if (depth == 3) {
+                    child_reg = prop_data;
+                    child_reg_len = len;
+                }
+            }
+
+            p = (uint32_t *)(((uintptr_t)prop_data + len + 3) & ~3);
+            break;
+        }
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            return n;
+
+        default:
+            klog_error("Unknown DTB token: 0x%x", token);
+            return n;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Find the RAM in the device tree
+ */
+uint32_t dtb_get_memory(dtb_region_t *regions, uint32_t max)
+{
+    if (regions == NULL) {
+        return 0;
+    }
+    return dtb_scan_memory(regions, max, 0, false);
+}
+
+/**
+ * Find the memory the device tree keeps from the OS
+ */
+uint32_t dtb_get_reserved(dtb_region_t *regions, uint32_t max)
+{
+    const uint64_t *rsv;
+    uint32_t n = 0;
+
+    if (regions == NULL || g_dtb_header == NULL || max == 0) {
+        return 0;
+    }
+
+    /* The blob: everything here keeps pointing into it */
+    regions[n].base = (uint64_t)g_dtb_addr;
+    regions[n].size = fdt32_to_cpu(g_dtb_header->totalsize);
+    n++;
+
+    /* Header reserve map: 8-byte aligned (address, size) pairs, ended by zeroes */
+    rsv = (const uint64_t *)((uint8_t *)g_dtb_addr +
+                             fdt32_to_cpu(g_dtb_header->off_mem_rsvmap));
+    for (; n < max; rsv += 2) {
+        uint64_t base = fdt64_to_cpu(rsv[0]);
+        uint64_t size = fdt64_to_cpu(rsv[1]);
+
+        if (base == 0 && size == 0) {
+            break;
+        }
+        regions[n].base = base;
+        regions[n].size = size;
+        n++;
+    }
+
+    return dtb_scan_memory(regions, max, n, true);
+}
+
 /* ============================================================================
  * End of dtb.c
  * ============================================================================ */
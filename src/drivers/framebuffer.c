@@ -7,7 +7,30 @@
 #include <aeos/framebuffer.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
 #include <aeos/heap.h>
+#include <aeos/semihosting.h>
+#include <aeos/fpsimd.h>
+
+/* Spans shorter than this are filled inline rather than by memset32() */
+#define FB_SHORT_SPAN   8
+
+/* Largest buffer: one huge buffer, a maximum-order PMM block */
+#define FB_MAX_SIZE     ((size_t)PAGE_SIZE << PMM_MAX_ORDER)
+
+/* Screenshot bytes converted per semihost_write() (whole rows) */
+#define FB_SHOT_CHUNK   (64 * 1024)
+
+/*
+ * Glyph cache
+ * Entries are 8x8 tiles already expanded to fg/bg pixels, direct-mapped on
+ * (char, fg, bg). The colours pick a base slot and the character is added
+ * to it, so the 96 printable characters of one colour pair never evict each
+ * other (fb_puts_run() relies on this).
+ */
+#define FB_GLYPH_CACHE_SIZE 256     /* Power of two, > 96 */
+#define FB_RUN_MAX          16      /* Glyphs looked up per fb_puts_run() pass */
 
 /* Simple 8x8 font (ASCII 32-127) - each char is 8 bytes */
 static const uint8_t font_8x8[96][8] = {
@@ -111,13 +134,93 @@ static const uint8_t font_8x8[96][8] = {
 /* Framebuffer state */
 static fb_info_t fb_info = {
     .base = NULL,  /* Will be allocated */
-    .width = FB_WIDTH,
-    .height = FB_HEIGHT,
-    .pitch = FB_WIDTH * 4,
+    .buffers = { NULL, NULL },
+    .back = 0,
+    .width = FB_DEFAULT_WIDTH,
+    .height = FB_DEFAULT_HEIGHT,
+    .pitch = FB_DEFAULT_WIDTH * 4,
     .bpp = FB_BPP,
     .initialized = false
 };
 
+/* Drawing clip rectangle, as [x0, x1) x [y0, y1); always inside the screen */
+static struct {
+    int32_t x0, y0;
+    int32_t x1, y1;
+} clip = { 0, 0, FB_DEFAULT_WIDTH, FB_DEFAULT_HEIGHT };
+
+/* Display driver hook used by fb_swap_buffers() */
+static fb_present_fn present_handler;
+
+/* Display driver hooks for a hardware cursor (NULL: software cursor) */
+static fb_cursor_define_fn cursor_define_handler;
+static fb_cursor_move_fn cursor_move_handler;
+
+/*
+ * Drawing target: the back buffer, or an off-screen buffer placed at
+ * (x, y) in screen coordinates. The clip always lies inside it.
+ */
+static struct {
+    uint32_t *pixels;   /* NULL: the back buffer */
+    int32_t x, y;
+    int32_t width, height;
+} target = { NULL, 0, 0, FB_DEFAULT_WIDTH, FB_DEFAULT_HEIGHT };
+
+/**
+ * Address of the target pixel at screen position (x, y)
+ */
+static inline uint32_t *pixel_at(int32_t x, int32_t y)
+{
+    if (target.pixels == NULL) {
+        return &fb_info.base[y * (int32_t)fb_info.width + x];
+    }
+    return &target.pixels[(y - target.y) * target.width + (x - target.x)];
+}
+
+/**
+ * Pixels per row of the target
+ */
+static inline int32_t target_stride(void)
+{
+    return target.pixels == NULL ? (int32_t)fb_info.width : target.width;
+}
+
+/**
+ * Fill an already clipped span; long spans go to memset32's NEON loop
+ */
+static inline void fill_span(uint32_t *dst, int32_t width, uint32_t color)
+{
+    int32_t i;
+
+    if (width < FB_SHORT_SPAN) {
+        for (i = 0; i < width; i++) {
+            dst[i] = color;
+        }
+    } else {
+        memset32(dst, color, (size_t)width);
+    }
+}
+
+/* Glyph cache */
+typedef struct {
+    uint32_t fg;
+    uint32_t bg;
+    char c;
+    bool valid;
+    uint32_t pixels[8 * 8];
+} glyph_tile_t;
+
+static struct {
+    glyph_tile_t tiles[FB_GLYPH_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+} glyphs;
+
+/* One 8-pixel glyph row, copied as a single 32-byte block */
+typedef struct {
+    uint32_t p[8];
+} __attribute__((may_alias)) glyph_row_t;
+
 /* Console state for fb_console_print */
 static struct {
     uint32_t cursor_x;
@@ -147,14 +250,15 @@ int fb_init(void)
     kprintf("  Framebuffer size: %u bytes (%u KB)\n",
             (uint32_t)fb_size, (uint32_t)(fb_size / 1024));
 
-    /* Allocate framebuffer from heap */
-    fb_info.base = (uint32_t *)kmalloc(fb_size);
+    /* One PMM block, under as few TLB entries as the linear map allows */
+    fb_info.base = (uint32_t *)mm_alloc_huge(fb_size);
     if (fb_info.base == NULL) {
         klog_error("Failed to allocate framebuffer memory");
         return -1;
     }
 
     kprintf("  Framebuffer allocated at: %p\n", fb_info.base);
+    fb_info.buffers[0] = fb_info.base;
 
     /* Mark as initialized */
     fb_info.initialized = true;
@@ -178,20 +282,712 @@ fb_info_t *fb_get_info(void)
 }
 
 /**
- * Clear screen to color
+ * Screen size
  */
-void fb_clear(uint32_t color)
+int32_t fb_width(void)
+{
+    return (int32_t)fb_info.width;
+}
+
+int32_t fb_height(void)
+{
+    return (int32_t)fb_info.height;
+}
+
+/* Common modes, largest first, for displays too large to hold */
+static const struct {
+    uint32_t width, height;
+} fb_modes[] = {
+    { 1920, 1080 }, { 1680, 1050 }, { 1600, 900 }, { 1440, 900 },
+    { 1280, 1024 }, { 1280, 800 }, { 1280, 720 }, { 1024, 768 },
+    { 800, 600 }, { 640, 480 },
+};
+
+static inline bool mode_fits(uint32_t width, uint32_t height)
+{
+    return (size_t)width * height * (FB_BPP / 8) <= FB_MAX_SIZE;
+}
+
+/**
+ * Fit a display's mode to what the framebuffer can hold
+ */
+void fb_fit_mode(uint32_t *width, uint32_t *height)
 {
     uint32_t i;
-    uint32_t pixels = fb_info.width * fb_info.height;
+
+    if (*width < FB_MIN_WIDTH || *height < FB_MIN_HEIGHT) {
+        *width = FB_MIN_WIDTH;
+        *height = FB_MIN_HEIGHT;
+        return;
+    }
+
+    if (mode_fits(*width, *height)) {
+        return;
+    }
+
+    for (i = 0; i < sizeof(fb_modes) / sizeof(fb_modes[0]); i++) {
+        if (fb_modes[i].width <= *width && fb_modes[i].height <= *height &&
+            mode_fits(fb_modes[i].width, fb_modes[i].height)) {
+            *width = fb_modes[i].width;
+            *height = fb_modes[i].height;
+            return;
+        }
+    }
+
+    *width = FB_MIN_WIDTH;
+    *height = FB_MIN_HEIGHT;
+}
+
+/**
+ * Set the resolution
+ */
+int fb_set_mode(uint32_t width, uint32_t height)
+{
+    uint32_t *buffers[2] = { NULL, NULL };
+    size_t old_size = (size_t)fb_info.pitch * fb_info.height;
+    size_t size = (size_t)width * height * (FB_BPP / 8);
+    uint32_t count, b;
+
+    if (width < FB_MIN_WIDTH || height < FB_MIN_HEIGHT || !mode_fits(width, height)) {
+        klog_error("fb_set_mode: %ux%u not supported", width, height);
+        return -1;
+    }
+
+    if (fb_info.initialized) {
+        if (width == fb_info.width && height == fb_info.height) {
+            return 0;
+        }
+
+        /* New buffers first, so a failure leaves the old mode working */
+        count = fb_info.buffers[1] ? 2 : 1;
+        for (b = 0; b < count; b++) {
+            buffers[b] = (uint32_t *)mm_alloc_huge(size);
+            if (buffers[b] == NULL) {
+                klog_error("fb_set_mode: no memory for %ux%u", width, height);
+                while (b-- > 0) {
+                    mm_free_huge(buffers[b], size);
+                }
+                return -1;
+            }
+        }
+
+        for (b = 0; b < 2; b++) {
+            mm_free_huge(fb_info.buffers[b], old_size);
+            fb_info.buffers[b] = buffers[b];
+        }
+        fb_info.back = 0;
+        fb_info.base = buffers[0];
+    }
+
+    fb_info.width = width;
+    fb_info.height = height;
+    fb_info.pitch = width * (FB_BPP / 8);
+
+    /* The target and clip follow the screen */
+    fb_set_target(NULL, 0, 0, 0, 0);
+    console.cursor_x = 0;
+    console.cursor_y = 0;
+
+    if (fb_info.initialized) {
+        fb_clear(COLOR_BLACK);
+        if (fb_info.buffers[1] != NULL) {
+            memset32(fb_info.buffers[1], COLOR_BLACK, (size_t)width * height);
+        }
+        klog_info("Framebuffer resized to %ux%u", width, height);
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate the second buffer for double buffering
+ */
+int fb_enable_double_buffer(void)
+{
+    size_t fb_size = fb_info.pitch * fb_info.height;
+    uint32_t *buf;
 
     if (!fb_info.initialized) {
+        return -1;
+    }
+
+    if (fb_info.buffers[1] != NULL) {
+        return 0;
+    }
+
+    buf = (uint32_t *)mm_alloc_huge(fb_size);
+    if (buf == NULL) {
+        klog_warn("No memory for a second framebuffer, staying single-buffered");
+        return -1;
+    }
+
+    memcpy(buf, fb_info.base, fb_size);
+    fb_info.buffers[1] = buf;
+
+    klog_info("Framebuffer double-buffered (second buffer at %p)", buf);
+    return 0;
+}
+
+/**
+ * Set the display driver's present handler
+ */
+void fb_set_present_handler(fb_present_fn fn)
+{
+    present_handler = fn;
+}
+
+/**
+ * Set the display driver's cursor handlers
+ */
+void fb_set_cursor_handlers(fb_cursor_define_fn define, fb_cursor_move_fn move)
+{
+    cursor_define_handler = define;
+    cursor_move_handler = move;
+}
+
+/**
+ * Put an image on the hardware cursor plane
+ */
+int fb_cursor_define(const uint32_t *image, uint32_t width, uint32_t height,
+                     uint32_t hot_x, uint32_t hot_y)
+{
+    if (!cursor_define_handler) {
+        return -1;
+    }
+    return cursor_define_handler(image, width, height, hot_x, hot_y);
+}
+
+/**
+ * Move the hardware cursor
+ */
+int fb_cursor_move(int32_t x, int32_t y, bool visible)
+{
+    if (!cursor_move_handler) {
+        return -1;
+    }
+    return cursor_move_handler(x, y, visible);
+}
+
+/**
+ * Show the back buffer and swap
+ */
+int fb_swap_buffers(const rect_t *rects, uint32_t n)
+{
+    rect_t screen = { 0, 0, (int32_t)fb_info.width, (int32_t)fb_info.height };
+    rect_t r;
+    uint32_t *front;
+    uint32_t i;
+    int32_t y;
+
+    if (!fb_info.initialized) {
+        return -1;
+    }
+
+    if (present_handler && present_handler(fb_info.back, rects, n) != 0) {
+        return -1;
+    }
+
+    if (fb_info.buffers[1] == NULL) {
+        return 0;
+    }
+
+    front = fb_info.base;
+    fb_info.back ^= 1;
+    fb_info.base = fb_info.buffers[fb_info.back];
+
+    /* The new back buffer is a frame behind: bring the changed rows across */
+    for (i = 0; i < n; i++) {
+        if (!rect_intersect(&rects[i], &screen, &r)) {
+            continue;
+        }
+        for (y = r.y; y < r.y + r.height; y++) {
+            memcpy(&fb_info.base[y * fb_info.width + r.x],
+                   &front[y * fb_info.width + r.x],
+                   (size_t)r.width * 4);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Clear screen to color
+ */
+void fb_clear(uint32_t color)
+{
+    fb_fill_rect(clip.x0, clip.y0, clip.x1 - clip.x0, clip.y1 - clip.y0, color);
+}
+
+/**
+ * Set the drawing clip rectangle
+ */
+void fb_set_clip(const rect_t *r)
+{
+    rect_t bounds = { target.x, target.y, target.width, target.height };
+    rect_t c;
+
+    if (r == NULL) {
+        c = bounds;
+    } else if (!rect_intersect(r, &bounds, &c)) {
+        /* Empty: nothing is drawn until the clip is reset */
+        c.x = 0;
+        c.y = 0;
+        c.width = 0;
+        c.height = 0;
+    }
+
+    clip.x0 = c.x;
+    clip.y0 = c.y;
+    clip.x1 = c.x + c.width;
+    clip.y1 = c.y + c.height;
+}
+
+/**
+ * Get the drawing clip rectangle
+ */
+void fb_get_clip(rect_t *r)
+{
+    r->x = clip.x0;
+    r->y = clip.y0;
+    r->width = clip.x1 - clip.x0;
+    r->height = clip.y1 - clip.y0;
+}
+
+/**
+ * Redirect drawing into an off-screen buffer
+ */
+void fb_set_target(uint32_t *pixels, int32_t x, int32_t y,
+                   uint32_t width, uint32_t height)
+{
+    if (pixels == NULL) {
+        target.pixels = NULL;
+        target.x = 0;
+        target.y = 0;
+        target.width = (int32_t)fb_info.width;
+        target.height = (int32_t)fb_info.height;
+    } else {
+        target.pixels = pixels;
+        target.x = x;
+        target.y = y;
+        target.width = (int32_t)width;
+        target.height = (int32_t)height;
+    }
+
+    fb_set_clip(NULL);
+}
+
+/**
+ * Clip a block at (x, y) and find its first source pixel
+ * @return false if nothing of it is inside the clip
+ */
+static bool clip_block(int32_t x, int32_t y, const uint32_t **src,
+                       uint32_t width, uint32_t height, uint32_t pitch,
+                       rect_t *area)
+{
+    rect_t block = { x, y, (int32_t)width, (int32_t)height };
+    rect_t c = { clip.x0, clip.y0, clip.x1 - clip.x0, clip.y1 - clip.y0 };
+
+    if (!fb_info.initialized || *src == NULL || !rect_intersect(&block, &c, area)) {
+        return false;
+    }
+
+    *src += (area->y - y) * (int32_t)pitch + (area->x - x);
+    return true;
+}
+
+/**
+ * Copy a block of pixels to the target, row by row
+ */
+void fb_blit(int32_t x, int32_t y, const uint32_t *src,
+             uint32_t width, uint32_t height, uint32_t pitch)
+{
+    rect_t area;
+    int32_t row;
+
+    if (!clip_block(x, y, &src, width, height, pitch, &area)) {
+        return;
+    }
+
+    for (row = 0; row < area.height; row++) {
+        memcpy(pixel_at(area.x, area.y + row), src, (size_t)area.width * 4);
+        src += pitch;
+    }
+}
+
+/**
+ * Copy a block of pixels, skipping fully transparent ones
+ */
+void fb_blit_masked(int32_t x, int32_t y, const uint32_t *src,
+                    uint32_t width, uint32_t height, uint32_t pitch)
+{
+    rect_t area;
+    uint32_t *dst;
+    int32_t row, i;
+
+    if (!clip_block(x, y, &src, width, height, pitch, &area)) {
+        return;
+    }
+
+    for (row = 0; row < area.height; row++) {
+        dst = pixel_at(area.x, area.y + row);
+        for (i = 0; i < area.width; i++) {
+            if (src[i] & 0xFF000000) {
+                dst[i] = src[i];
+            }
+        }
+        src += pitch;
+    }
+}
+
+/* ============================================================================
+ * Alpha Blending
+ *
+ * Blending is "source over" with premultiplied alpha: each channel becomes
+ * src + dst * (255 - src_alpha) / 255. The division rounds exactly:
+ * x / 255 is ((x + 128) + ((x + 128) >> 8)) >> 8 for any byte product.
+ * With NEON, four pixels go per step: umull/umull2 multiply the 16
+ * destination bytes by the inverse alphas, ursra and rshrn divide, and
+ * uqadd adds the source. As in the string routines, the loops run between
+ * kernel_neon_begin() and kernel_neon_end() where kernel_neon_usable().
+ * ============================================================================ */
+
+/* Pixels blended since boot, and spans they came in */
+static struct {
+    uint64_t pixels;
+    uint64_t spans;
+} blend_stats;
+
+/**
+ * Blend one premultiplied pixel over another
+ * Red/blue and alpha/green are done as two pairs of 16-bit lanes.
+ */
+static inline uint32_t blend_pixel(uint32_t dst, uint32_t src)
+{
+    uint32_t inv = 255 - (src >> 24);
+    uint32_t rb = (dst & 0x00FF00FF) * inv + 0x00800080;
+    uint32_t ag = ((dst >> 8) & 0x00FF00FF) * inv + 0x00800080;
+
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+    return src + (rb | ag);
+}
+
+/**
+ * Blend a span of premultiplied source pixels over dst
+ */
+static void blend_span(uint32_t *dst, const uint32_t *src, int32_t n)
+{
+    int32_t i;
+
+    blend_stats.pixels += (uint64_t)n;
+    blend_stats.spans++;
+
+#ifdef __aarch64__
+    if (n >= 4 && kernel_neon_usable()) {
+        uint64_t blocks = (uint64_t)n / 4;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "   dup v7.4s, %w[ones]\n"
+            "1: ld1 {v0.4s}, [%[s]], #16\n"
+            "   ld1 {v1.4s}, [%[d]]\n"
+            "   ushr v2.4s, v0.4s, #24\n"
+            "   mul v2.4s, v2.4s, v7.4s\n"
+            "   mvn v2.16b, v2.16b\n"
+            "   umull v3.8h, v1.8b, v2.8b\n"
+            "   umull2 v4.8h, v1.16b, v2.16b\n"
+            "   ursra v3.8h, v3.8h, #8\n"
+            "   ursra v4.8h, v4.8h, #8\n"
+            "   rshrn v3.8b, v3.8h, #8\n"
+            "   rshrn2 v3.16b, v4.8h, #8\n"
+            "   uqadd v3.16b, v3.16b, v0.16b\n"
+            "   st1 {v3.4s}, [%[d]], #16\n"
+            "   subs %[n], %[n], #1\n"
+            "   b.ne 1b\n"
+            : [d] "+r"(dst), [s] "+r"(src), [n] "+r"(blocks)
+            : [ones] "r"(0x01010101U)
+            : "v0", "v1", "v2", "v3", "v4", "v7", "cc", "memory");
+        kernel_neon_end();
+        n &= 3;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        dst[i] = blend_pixel(dst[i], src[i]);
+    }
+}
+
+/**
+ * Blend one premultiplied colour over a span of dst
+ */
+static void blend_span_solid(uint32_t *dst, uint32_t color, int32_t n)
+{
+    int32_t i;
+
+    blend_stats.pixels += (uint64_t)n;
+    blend_stats.spans++;
+
+#ifdef __aarch64__
+    if (n >= 4 && kernel_neon_usable()) {
+        uint64_t blocks = (uint64_t)n / 4;
+        uint32_t inv = (255 - (color >> 24)) * 0x01010101U;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "   dup v0.4s, %w[color]\n"
+            "   dup v2.4s, %w[inv]\n"
+            "1: ld1 {v1.4s}, [%[d]]\n"
+            "   umull v3.8h, v1.8b, v2.8b\n"
+            "   umull2 v4.8h, v1.16b, v2.16b\n"
+            "   ursra v3.8h, v3.8h, #8\n"
+            "   ursra v4.8h, v4.8h, #8\n"
+            "   rshrn v3.8b, v3.8h, #8\n"
+            "   rshrn2 v3.16b, v4.8h, #8\n"
+            "   uqadd v3.16b, v3.16b, v0.16b\n"
+            "   st1 {v3.4s}, [%[d]], #16\n"
+            "   subs %[n], %[n], #1\n"
+            "   b.ne 1b\n"
+            : [d] "+r"(dst), [n] "+r"(blocks)
+            : [color] "r"(color), [inv] "r"(inv)
+            : "v0", "v1", "v2", "v3", "v4", "cc", "memory");
+        kernel_neon_end();
+        n &= 3;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        dst[i] = blend_pixel(dst[i], color);
+    }
+}
+
+/**
+ * Premultiply a straight-alpha ARGB colour
+ */
+uint32_t fb_premultiply(uint32_t argb)
+{
+    uint32_t a = argb >> 24;
+    uint32_t rb = (argb & 0x00FF00FF) * a + 0x00800080;
+    uint32_t g = ((argb >> 8) & 0xFF) * a + 0x80;
+
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    g = (g + (g >> 8)) >> 8;
+    return (a << 24) | (g << 8) | rb;
+}
+
+/**
+ * Blend a translucent colour over a rectangle
+ */
+void fb_blend_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
+{
+    rect_t r = { x, y, width, height };
+    rect_t c = { clip.x0, clip.y0, clip.x1 - clip.x0, clip.y1 - clip.y0 };
+    rect_t area;
+    uint32_t *row;
+    int32_t stride = target_stride();
+    int32_t j;
+
+    if (!fb_info.initialized || (color >> 24) == 0 || !rect_intersect(&r, &c, &area)) {
+        return;
+    }
+
+    /* Opaque: a plain fill */
+    if ((color >> 24) == 0xFF) {
+        fb_fill_rect(area.x, area.y, area.width, area.height, color);
+        return;
+    }
+
+    color = fb_premultiply(color);
+    row = pixel_at(area.x, area.y);
+    for (j = 0; j < area.height; j++, row += stride) {
+        blend_span_solid(row, color, area.width);
+    }
+}
+
+/**
+ * Blend a block of premultiplied pixels over the target
+ */
+void fb_blit_alpha(int32_t x, int32_t y, const uint32_t *src,
+                   uint32_t width, uint32_t height, uint32_t pitch)
+{
+    rect_t area;
+    int32_t row;
+
+    if (!clip_block(x, y, &src, width, height, pitch, &area)) {
+        return;
+    }
+
+    for (row = 0; row < area.height; row++) {
+        blend_span(pixel_at(area.x, area.y + row), src, area.width);
+        src += pitch;
+    }
+}
+
+/**
+ * Get alpha blending statistics
+ */
+void fb_get_blend_stats(uint64_t *pixels, uint64_t *spans)
+{
+    if (pixels) {
+        *pixels = blend_stats.pixels;
+    }
+    if (spans) {
+        *spans = blend_stats.spans;
+    }
+}
+
+/**
+ * Intersect two rectangles
+ */
+bool rect_intersect(const rect_t *a, const rect_t *b, rect_t *out)
+{
+    int32_t x0 = a->x > b->x ? a->x : b->x;
+    int32_t y0 = a->y > b->y ? a->y : b->y;
+    int32_t x1 = (a->x + a->width < b->x + b->width) ?
+                 a->x + a->width : b->x + b->width;
+    int32_t y1 = (a->y + a->height < b->y + b->height) ?
+                 a->y + a->height : b->y + b->height;
+
+    if (x1 <= x0 || y1 <= y0) {
+        return false;
+    }
+
+    out->x = x0;
+    out->y = y0;
+    out->width = x1 - x0;
+    out->height = y1 - y0;
+    return true;
+}
+
+/**
+ * Bounding box of two rectangles
+ */
+void rect_union(const rect_t *a, const rect_t *b, rect_t *out)
+{
+    int32_t x0 = a->x < b->x ? a->x : b->x;
+    int32_t y0 = a->y < b->y ? a->y : b->y;
+    int32_t x1 = (a->x + a->width > b->x + b->width) ?
+                 a->x + a->width : b->x + b->width;
+    int32_t y1 = (a->y + a->height > b->y + b->height) ?
+                 a->y + a->height : b->y + b->height;
+
+    out->x = x0;
+    out->y = y0;
+    out->width = x1 - x0;
+    out->height = y1 - y0;
+}
+
+/**
+ * Check whether a fully contains b
+ */
+bool rect_contains(const rect_t *a, const rect_t *b)
+{
+    return b->x >= a->x && b->y >= a->y &&
+           b->x + b->width <= a->x + a->width &&
+           b->y + b->height <= a->y + a->height;
+}
+
+/**
+ * Subtract b from a
+ */
+uint32_t rect_subtract(const rect_t *a, const rect_t *b, rect_t out[4])
+{
+    rect_t in;
+    uint32_t n = 0;
+
+    if (!rect_intersect(a, b, &in)) {
+        out[0] = *a;
+        return 1;
+    }
+
+    /* Band above and below the overlap, full width of a */
+    if (in.y > a->y) {
+        out[n].x = a->x;
+        out[n].y = a->y;
+        out[n].width = a->width;
+        out[n].height = in.y - a->y;
+        n++;
+    }
+    if (in.y + in.height < a->y + a->height) {
+        out[n].x = a->x;
+        out[n].y = in.y + in.height;
+        out[n].width = a->width;
+        out[n].height = a->y + a->height - (in.y + in.height);
+        n++;
+    }
+
+    /* Left and right of the overlap, overlap's height */
+    if (in.x > a->x) {
+        out[n].x = a->x;
+        out[n].y = in.y;
+        out[n].width = in.x - a->x;
+        out[n].height = in.height;
+        n++;
+    }
+    if (in.x + in.width < a->x + a->width) {
+        out[n].x = in.x + in.width;
+        out[n].y = in.y;
+        out[n].width = a->x + a->width - (in.x + in.width);
+        out[n].height = in.height;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Add a rectangle to a rectangle list, merging where it pays off
+ */
+void rect_list_add(rect_t *list, uint32_t *count, uint32_t max,
+                   const rect_t *rect, uint64_t slack)
+{
+    rect_t r = *rect;
+    rect_t u, overlap;
+    uint64_t covered, growth, best_growth;
+    uint32_t i, best;
+
+    if (r.width <= 0 || r.height <= 0) {
         return;
     }
 
-    for (i = 0; i < pixels; i++) {
-        fb_info.base[i] = color;
+restart:
+    for (i = 0; i < *count; i++) {
+        if (rect_contains(&list[i], &r)) {
+            return;
+        }
+
+        /* Pixels actually covered by the pair, counting any overlap once */
+        covered = rect_area(&list[i]) + rect_area(&r);
+        if (rect_intersect(&list[i], &r, &overlap)) {
+            covered -= rect_area(&overlap);
+        }
+
+        rect_union(&list[i], &r, &u);
+        if (rect_area(&u) <= covered + slack) {
+            /* Merge, then re-check: the union may reach other entries */
+            r = u;
+            list[i] = list[--(*count)];
+            goto restart;
+        }
     }
+
+    if (*count == max) {
+        /* Full: fold into the entry whose bounding box grows the least */
+        best = 0;
+        best_growth = (uint64_t)-1;
+        for (i = 0; i < *count; i++) {
+            rect_union(&list[i], &r, &u);
+            growth = rect_area(&u) - rect_area(&list[i]);
+            if (growth < best_growth) {
+                best_growth = growth;
+                best = i;
+            }
+        }
+        rect_union(&list[best], &r, &r);
+        list[best] = list[--(*count)];
+        goto restart;
+    }
+
+    list[(*count)++] = r;
 }
 
 /**
@@ -199,11 +995,13 @@ void fb_clear(uint32_t color)
  */
 void fb_putpixel(uint32_t x, uint32_t y, uint32_t color)
 {
-    if (!fb_info.initialized || x >= fb_info.width || y >= fb_info.height) {
+    if (!fb_info.initialized ||
+        (int32_t)x < clip.x0 || (int32_t)x >= clip.x1 ||
+        (int32_t)y < clip.y0 || (int32_t)y >= clip.y1) {
         return;
     }
 
-    fb_info.base[y * fb_info.width + x] = color;
+    *pixel_at((int32_t)x, (int32_t)y) = color;
 }
 
 /**
@@ -218,31 +1016,65 @@ uint32_t fb_getpixel(uint32_t x, uint32_t y)
     return fb_info.base[y * fb_info.width + x];
 }
 
+/**
+ * Draw a horizontal span of pixels (accepts signed coordinates)
+ */
+void fb_fill_span(int32_t x, int32_t y, int32_t width, uint32_t color)
+{
+    if (!fb_info.initialized || y < clip.y0 || y >= clip.y1) {
+        return;
+    }
+
+    if (x < clip.x0) { width -= clip.x0 - x; x = clip.x0; }
+    if (x + width > clip.x1) width = clip.x1 - x;
+    if (width <= 0) return;
+
+    fill_span(pixel_at(x, y), width, color);
+}
+
 /**
  * Draw a filled rectangle (accepts signed coordinates, clips internally)
  */
 void fb_fill_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
 {
+    int32_t stride = target_stride();
+    uint32_t *row;
     int32_t i, j;
 
     if (!fb_info.initialized) {
         return;
     }
 
-    /* Clip negative x/y: reduce width/height and move start to 0 */
-    if (x < 0) { width += x; x = 0; }
-    if (y < 0) { height += y; y = 0; }
+    /* Clip left/top: reduce width/height and move start to the clip edge */
+    if (x < clip.x0) { width -= clip.x0 - x; x = clip.x0; }
+    if (y < clip.y0) { height -= clip.y0 - y; y = clip.y0; }
+    if (width <= 0 || height <= 0) return;
+
+    /* Clip right/bottom (the clip rectangle lies inside the target) */
+    if (x + width > clip.x1) width = clip.x1 - x;
+    if (y + height > clip.y1) height = clip.y1 - y;
     if (width <= 0 || height <= 0) return;
 
-    /* Clip to screen bounds */
-    if (x + width > (int32_t)fb_info.width) width = (int32_t)fb_info.width - x;
-    if (y + height > (int32_t)fb_info.height) height = (int32_t)fb_info.height - y;
+    row = pixel_at(x, y);
 
-    /* Direct pixel writes (skip fb_putpixel overhead for speed) */
-    for (j = 0; j < height; j++) {
-        for (i = 0; i < width; i++) {
-            fb_info.base[(y + j) * fb_info.width + (x + i)] = color;
+    /* Full-width rows are contiguous: one span for the whole rect */
+    if (width == stride) {
+        fill_span(row, width * height, color);
+        return;
+    }
+
+    /* Narrow columns (e.g. outline edges) as plain stores */
+    if (width < FB_SHORT_SPAN) {
+        for (j = 0; j < height; j++, row += stride) {
+            for (i = 0; i < width; i++) {
+                row[i] = color;
+            }
         }
+        return;
+    }
+
+    for (j = 0; j < height; j++, row += stride) {
+        memset32(row, color, (size_t)width);
     }
 }
 
@@ -251,47 +1083,15 @@ void fb_fill_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t
  */
 void fb_draw_rect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
 {
-    int32_t i;
-    int32_t x2 = x + width - 1;
-    int32_t y2 = y + height - 1;
-    int32_t sw = (int32_t)fb_info.width;
-    int32_t sh = (int32_t)fb_info.height;
-
     if (!fb_info.initialized || width <= 0 || height <= 0) {
         return;
     }
 
-    /* Top edge */
-    if (y >= 0 && y < sh) {
-        int32_t sx = x < 0 ? 0 : x;
-        int32_t ex = x2 >= sw ? sw - 1 : x2;
-        for (i = sx; i <= ex; i++)
-            fb_info.base[y * fb_info.width + i] = color;
-    }
-
-    /* Bottom edge */
-    if (y2 >= 0 && y2 < sh) {
-        int32_t sx = x < 0 ? 0 : x;
-        int32_t ex = x2 >= sw ? sw - 1 : x2;
-        for (i = sx; i <= ex; i++)
-            fb_info.base[y2 * fb_info.width + i] = color;
-    }
-
-    /* Left edge */
-    if (x >= 0 && x < sw) {
-        int32_t sy = y < 0 ? 0 : y;
-        int32_t ey = y2 >= sh ? sh - 1 : y2;
-        for (i = sy; i <= ey; i++)
-            fb_info.base[i * fb_info.width + x] = color;
-    }
-
-    /* Right edge */
-    if (x2 >= 0 && x2 < sw) {
-        int32_t sy = y < 0 ? 0 : y;
-        int32_t ey = y2 >= sh ? sh - 1 : y2;
-        for (i = sy; i <= ey; i++)
-            fb_info.base[i * fb_info.width + x2] = color;
-    }
+    /* Spans and one-pixel fills inherit the clipping */
+    fb_fill_span(x, y, width, color);                     /* Top edge */
+    fb_fill_span(x, y + height - 1, width, color);        /* Bottom edge */
+    fb_fill_rect(x, y, 1, height, color);                 /* Left edge */
+    fb_fill_rect(x + width - 1, y, 1, height, color);     /* Right edge */
 }
 
 /**
@@ -316,9 +1116,9 @@ void fb_draw_line(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t c
     }
 
     while (1) {
-        if (sx1 >= 0 && sx1 < (int32_t)fb_info.width &&
-            sy1 >= 0 && sy1 < (int32_t)fb_info.height) {
-            fb_info.base[sy1 * fb_info.width + sx1] = color;
+        if (sx1 >= clip.x0 && sx1 < clip.x1 &&
+            sy1 >= clip.y0 && sy1 < clip.y1) {
+            *pixel_at(sx1, sy1) = color;
         }
 
         if (sx1 == sx2 && sy1 == sy2) {
@@ -337,10 +1137,149 @@ void fb_draw_line(uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t c
     }
 }
 
+/**
+ * Find the expanded tile for a character, rendering it on a miss
+ */
+static const uint32_t *glyph_lookup(char c, uint32_t fg, uint32_t bg)
+{
+    uint32_t slot;
+    glyph_tile_t *t;
+    const uint8_t *glyph;
+    int32_t i, j;
+
+    if (c < 32 || c > 127) {
+        c = ' ';
+    }
+
+    slot = ((fg * 0x9E3779B1u) ^ (bg * 0x85EBCA77u)) >> 24;
+    slot = (slot + (uint32_t)(c - 32)) & (FB_GLYPH_CACHE_SIZE - 1);
+    t = &glyphs.tiles[slot];
+
+    if (t->valid && t->c == c && t->fg == fg && t->bg == bg) {
+        glyphs.hits++;
+        return t->pixels;
+    }
+
+    glyphs.misses++;
+    glyph = font_8x8[c - 32];
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 8; i++) {
+            t->pixels[j * 8 + i] = (glyph[j] & (1 << i)) ? fg : bg;
+        }
+    }
+    t->c = c;
+    t->fg = fg;
+    t->bg = bg;
+    t->valid = true;
+
+    return t->pixels;
+}
+
+/**
+ * Get glyph cache hit/miss counts
+ */
+void fb_get_glyph_stats(uint64_t *hits, uint64_t *misses)
+{
+    *hits = glyphs.hits;
+    *misses = glyphs.misses;
+}
+
 /**
  * Draw a character using 8x8 font (accepts signed coordinates)
  */
 void fb_putchar(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg)
+{
+    const uint32_t *tile;
+    const uint32_t *src;
+    uint32_t *dst;
+    int32_t x0, y0, x1, y1;
+    int32_t i, j;
+
+    if (!fb_info.initialized) {
+        return;
+    }
+
+    /* Skip if entirely outside the clip rectangle */
+    if (x + 8 <= clip.x0 || y + 8 <= clip.y0 ||
+        x >= clip.x1 || y >= clip.y1) {
+        return;
+    }
+
+    tile = glyph_lookup(c, fg, bg);
+
+    /* Unclipped: eight row copies */
+    if (x >= clip.x0 && y >= clip.y0 && x + 8 <= clip.x1 && y + 8 <= clip.y1) {
+        for (j = 0; j < 8; j++) {
+            *(glyph_row_t *)pixel_at(x, y + j) = *(const glyph_row_t *)&tile[j * 8];
+        }
+        return;
+    }
+
+    /* Partly clipped: the visible part of each row */
+    x0 = x > clip.x0 ? x : clip.x0;
+    y0 = y > clip.y0 ? y : clip.y0;
+    x1 = x + 8 < clip.x1 ? x + 8 : clip.x1;
+    y1 = y + 8 < clip.y1 ? y + 8 : clip.y1;
+    for (j = y0; j < y1; j++) {
+        dst = pixel_at(x0, j);
+        src = &tile[(j - y) * 8 + (x0 - x)];
+        for (i = 0; i < x1 - x0; i++) {
+            dst[i] = src[i];
+        }
+    }
+}
+
+/**
+ * Draw a run of characters in one colour pair (accepts signed coordinates)
+ */
+void fb_puts_run(int32_t x, int32_t y, const char *str, uint32_t len,
+                 uint32_t fg, uint32_t bg)
+{
+    const uint32_t *tiles[FB_RUN_MAX];
+    glyph_row_t *dst;
+    uint32_t n, k;
+    int32_t j;
+
+    if (!fb_info.initialized || str == NULL) {
+        return;
+    }
+
+    /* Skip if entirely outside the clip rectangle vertically */
+    if (y + 8 <= clip.y0 || y >= clip.y1) {
+        return;
+    }
+
+    while (len > 0 && x < clip.x1) {
+        n = len < FB_RUN_MAX ? len : FB_RUN_MAX;
+
+        if (x >= clip.x0 && x + (int32_t)n * 8 <= clip.x1 &&
+            y >= clip.y0 && y + 8 <= clip.y1) {
+            /* Unclipped: write each screen row across all n glyphs */
+            for (k = 0; k < n; k++) {
+                tiles[k] = glyph_lookup(str[k], fg, bg);
+            }
+            for (j = 0; j < 8; j++) {
+                dst = (glyph_row_t *)pixel_at(x, y + j);
+                for (k = 0; k < n; k++) {
+                    dst[k] = *(const glyph_row_t *)&tiles[k][j * 8];
+                }
+            }
+        } else {
+            for (k = 0; k < n; k++) {
+                fb_putchar(x + (int32_t)k * 8, y, str[k], fg, bg);
+            }
+        }
+
+        x += (int32_t)n * 8;
+        str += n;
+        len -= n;
+    }
+}
+
+/**
+ * Draw a character by decoding the font bitmap per pixel
+ */
+void fb_putchar_uncached(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg)
 {
     int32_t i, j;
     uint8_t row;
@@ -350,9 +1289,9 @@ void fb_putchar(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg)
         return;
     }
 
-    /* Skip if entirely off-screen */
-    if (x + 8 <= 0 || y + 8 <= 0 ||
-        x >= (int32_t)fb_info.width || y >= (int32_t)fb_info.height) {
+    /* Skip if entirely outside the clip rectangle */
+    if (x + 8 <= clip.x0 || y + 8 <= clip.y0 ||
+        x >= clip.x1 || y >= clip.y1) {
         return;
     }
 
@@ -365,15 +1304,15 @@ void fb_putchar(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg)
     /* Draw character - bit 0 is leftmost pixel */
     for (j = 0; j < 8; j++) {
         int32_t py = y + j;
-        if (py < 0 || py >= (int32_t)fb_info.height) continue;
+        if (py < clip.y0 || py >= clip.y1) continue;
         row = glyph[j];
         for (i = 0; i < 8; i++) {
             int32_t px = x + i;
-            if (px < 0 || px >= (int32_t)fb_info.width) continue;
+            if (px < clip.x0 || px >= clip.x1) continue;
             if (row & (1 << i)) {
-                fb_info.base[py * fb_info.width + px] = fg;
+                *pixel_at(px, py) = fg;
             } else {
-                fb_info.base[py * fb_info.width + px] = bg;
+                *pixel_at(px, py) = bg;
             }
         }
     }
@@ -384,26 +1323,49 @@ void fb_putchar(int32_t x, int32_t y, char c, uint32_t fg, uint32_t bg)
  */
 void fb_puts(int32_t x, int32_t y, const char *str, uint32_t fg, uint32_t bg)
 {
-    int32_t offset_x = 0;
-
-    if (!fb_info.initialized || str == NULL) {
+    if (str == NULL) {
         return;
     }
 
-    /* Skip if entirely off-screen vertically */
-    if (y + 8 <= 0 || y >= (int32_t)fb_info.height) {
+    fb_puts_run(x, y, str, (uint32_t)strlen(str), fg, bg);
+}
+
+/**
+ * Draw a string's set pixels only, leaving the background as it is
+ */
+void fb_puts_over(int32_t x, int32_t y, const char *str, uint32_t fg)
+{
+    const uint8_t *glyph;
+    int32_t i, j, px, py;
+    char c;
+
+    if (!fb_info.initialized || str == NULL) {
         return;
     }
 
-    while (*str) {
-        /* Only draw characters that are at least partially on-screen */
-        if (x + offset_x + 8 > 0 && x + offset_x < (int32_t)fb_info.width) {
-            fb_putchar(x + offset_x, y, *str, fg, bg);
+    for (; *str != '\0'; str++, x += 8) {
+        if (x + 8 <= clip.x0 || y + 8 <= clip.y0 || x >= clip.x1 || y >= clip.y1) {
+            continue;
+        }
+
+        c = *str;
+        if (c < 32 || c > 127) {
+            c = ' ';
+        }
+        glyph = font_8x8[c - 32];
+
+        for (j = 0; j < 8; j++) {
+            py = y + j;
+            if (py < clip.y0 || py >= clip.y1 || glyph[j] == 0) {
+                continue;
+            }
+            for (i = 0; i < 8; i++) {
+                px = x + i;
+                if ((glyph[j] & (1 << i)) && px >= clip.x0 && px < clip.x1) {
+                    *pixel_at(px, py) = fg;
+                }
+            }
         }
-        offset_x += 8;
-        str++;
-        /* Stop if we've gone past the right edge */
-        if (x + offset_x >= (int32_t)fb_info.width) break;
     }
 }
 
@@ -468,38 +1430,76 @@ void fb_console_print(const char *str, uint32_t color)
 }
 
 /**
- * Save framebuffer as PPM image
- * PPM is a simple image format that can be viewed with any image viewer
+ * Buffer on the display (the one not being drawn into)
  */
-void fb_screenshot_ppm(void)
+const uint32_t *fb_front_buffer(void)
 {
-    uint32_t x, y;
+    if (fb_info.buffers[1] == NULL) {
+        return fb_info.base;
+    }
+    return fb_info.buffers[fb_info.back ^ 1];
+}
+
+/**
+ * Save the screen as a binary (P6) PPM image on the host
+ * Rows are converted to RGB a chunk at a time and written in one
+ * semihosting call each, instead of formatting every pixel as text.
+ */
+int fb_screenshot(const char *path)
+{
+    const uint32_t *src;
+    uint8_t *buf, *out;
+    char header[32];
+    uint32_t rows, row, x, y;
+    size_t row_bytes;
     uint32_t pixel;
-    uint8_t r, g, b;
+    int fd, len, ret = 0;
 
-    if (!fb_info.initialized) {
-        return;
+    if (!fb_info.initialized || path == NULL || !semihost_available()) {
+        return -1;
     }
 
-    /* PPM header */
-    kprintf("P3\n");
-    kprintf("%u %u\n", fb_info.width, fb_info.height);
-    kprintf("255\n");
+    row_bytes = (size_t)fb_info.width * 3;
+    rows = (uint32_t)(FB_SHOT_CHUNK / row_bytes);
+    if (rows == 0) {
+        rows = 1;
+    }
+    buf = (uint8_t *)kmalloc(rows * row_bytes);
+    if (buf == NULL) {
+        return -1;
+    }
 
-    /* Pixel data */
-    for (y = 0; y < fb_info.height; y++) {
-        for (x = 0; x < fb_info.width; x++) {
-            pixel = fb_info.base[y * fb_info.width + x];
+    fd = semihost_open(path, SEMIHOST_OPEN_WB);
+    if (fd < 0) {
+        kfree(buf);
+        return -1;
+    }
 
-            /* Extract RGB (RGBA8888 format) */
-            r = (pixel >> 16) & 0xFF;
-            g = (pixel >> 8) & 0xFF;
-            b = pixel & 0xFF;
+    len = snprintf(header, sizeof(header), "P6\n%u %u\n255\n",
+                   fb_info.width, fb_info.height);
+    if (semihost_write(fd, header, (size_t)len) != 0) {
+        ret = -1;
+    }
 
-            kprintf("%u %u %u ", r, g, b);
+    src = fb_front_buffer();
+    for (y = 0; y < fb_info.height && ret == 0; y += row) {
+        out = buf;
+        for (row = 0; row < rows && y + row < fb_info.height; row++) {
+            for (x = 0; x < fb_info.width; x++) {
+                pixel = src[(y + row) * fb_info.width + x];
+                *out++ = (uint8_t)(pixel >> 16);
+                *out++ = (uint8_t)(pixel >> 8);
+                *out++ = (uint8_t)pixel;
+            }
+        }
+        if (semihost_write(fd, buf, (size_t)(out - buf)) != 0) {
+            ret = -1;
         }
-        kprintf("\n");
     }
+
+    semihost_close(fd);
+    kfree(buf);
+    return ret;
 }
 
 /**
@@ -1,15 +1,210 @@
 /* ============================================================================
  * AEOS - Abdalla's Educational Operating System
  * File: src/drivers/pflash.c
- * Description: Parallel flash (pflash) persistence - simple memory-mapped I/O
+ * Description: Parallel flash (pflash) persistence - CFI command set
  * ============================================================================ */
 
 #include <aeos/pflash.h>
+#include <aeos/blkdev.h>
+#include <aeos/pmm.h>
+#include <aeos/scheduler.h>
+#include <aeos/spinlock.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
 
+/*
+ * The flash reads like memory in read-array mode, but writes are commands
+ * (Intel/Sharp CFI command set). Programming can only clear bits; setting
+ * any back to 1 takes a sector erase. Both banks are two 16-bit chips side
+ * by side, so each command is repeated in both halves of the 32-bit word.
+ */
+
+/* Commands */
+#define CFI_CMD(c)          ((uint32_t)(c) | ((uint32_t)(c) << 16))
+#define CFI_READ_ARRAY      CFI_CMD(0xFF)
+#define CFI_CLEAR_STATUS    CFI_CMD(0x50)
+#define CFI_PROGRAM         CFI_CMD(0x40)
+#define CFI_ERASE           CFI_CMD(0x20)
+#define CFI_CONFIRM         CFI_CMD(0xD0)
+
+/* Status register (low chip) */
+#define CFI_STATUS_READY    0x80
+#define CFI_STATUS_ERROR    0x3A    /* Erase, program, VPP or lock error */
+
+/* Erased flash */
+#define PFLASH_ERASED       0xFFFFFFFFU
+
+/* Sector copy for erase cycles: 2^6 pages */
+#define PFLASH_SECTOR_ORDER 6
+
 static int pflash_initialized = 0;
 
+/* One command sequence at a time; the array reads wrong in between */
+static spinlock_t pflash_lock = SPINLOCK_INIT;
+
+/* Sector being rewritten */
+static uint32_t *pflash_sector;
+
+static int pflash_blk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf);
+static int pflash_blk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf);
+
+static const blkdev_ops_t pflash_blk_ops = {
+    .read = pflash_blk_read,
+    .write = pflash_blk_write,
+};
+
+static blkdev_t pflash_blk = {
+    .name = "pflash",
+    .num_blocks = PFLASH_SIZE / BLK_SIZE,
+    .ops = &pflash_blk_ops,
+};
+
+/* ============================================================================
+ * Command Sequences (pflash_lock held)
+ * ============================================================================ */
+
+static inline volatile uint32_t *pflash_word(uint32_t offset)
+{
+    return (volatile uint32_t *)(uintptr_t)(PFLASH_BASE + offset);
+}
+
+/**
+ * Wait for the current operation to finish, then go back to read-array mode
+ * @return 0 on success, -1 if the chip reports an error
+ */
+static int pflash_wait(volatile uint32_t *addr)
+{
+    uint32_t status;
+
+    do {
+        status = *addr;
+    } while (!(status & CFI_STATUS_READY));
+
+    if (status & CFI_STATUS_ERROR) {
+        *addr = CFI_CLEAR_STATUS;
+        *addr = CFI_READ_ARRAY;
+        return -1;
+    }
+    *addr = CFI_READ_ARRAY;
+    return 0;
+}
+
+/**
+ * Program one word; only clears bits
+ */
+static int pflash_program(uint32_t offset, uint32_t value)
+{
+    volatile uint32_t *addr = pflash_word(offset);
+
+    *addr = CFI_PROGRAM;
+    *addr = value;
+    return pflash_wait(addr);
+}
+
+/**
+ * Erase the sector at offset
+ */
+static int pflash_erase(uint32_t offset)
+{
+    volatile uint32_t *addr = pflash_word(offset);
+
+    *addr = CFI_ERASE;
+    *addr = CFI_CONFIRM;
+    return pflash_wait(addr);
+}
+
+/**
+ * Merge new bytes into the word at a 4-byte aligned offset
+ */
+static uint32_t pflash_merge(uint32_t word, uint32_t word_off, uint32_t start,
+                             uint32_t end, const uint8_t *data)
+{
+    uint32_t i;
+
+    for (i = 0; i < 4; i++) {
+        if (word_off + i >= start && word_off + i < end) {
+            word &= ~(0xFFU << (i * 8));
+            word |= (uint32_t)data[word_off + i - start] << (i * 8);
+        }
+    }
+    return word;
+}
+
+/**
+ * Write part of one sector
+ * Words are programmed in place when that only clears bits. Otherwise the
+ * sector is copied out, erased, and programmed back with the new bytes.
+ */
+static int pflash_write_sector(uint32_t sector, uint32_t start, uint32_t end,
+                               const uint8_t *data)
+{
+    uint32_t first = start & ~3U;
+    uint32_t off, old, word, i;
+    bool erase = false;
+
+    for (off = first; off < end; off += 4) {
+        old = *pflash_word(off);
+        word = pflash_merge(old, off, start, end, data);
+        if ((old & word) != word) {
+            erase = true;
+            break;
+        }
+    }
+
+    if (!erase) {
+        for (off = first; off < end; off += 4) {
+            old = *pflash_word(off);
+            word = pflash_merge(old, off, start, end, data);
+            if (word != old && pflash_program(off, word) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (pflash_sector == NULL) {
+        pflash_sector = (uint32_t *)(uintptr_t)pmm_alloc_pages(PFLASH_SECTOR_ORDER);
+        if (pflash_sector == NULL) {
+            klog_error("Pflash: no memory for sector copy");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < PFLASH_SECTOR_SIZE / 4; i++) {
+        off = sector + i * 4;
+        word = *pflash_word(off);
+        if (off + 4 > start && off < end) {
+            word = pflash_merge(word, off, start, end, data);
+        }
+        pflash_sector[i] = word;
+    }
+
+    if (pflash_erase(sector) != 0) {
+        return -1;
+    }
+    for (i = 0; i < PFLASH_SECTOR_SIZE / 4; i++) {
+        if (pflash_sector[i] != PFLASH_ERASED &&
+            pflash_program(sector + i * 4, pflash_sector[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take the flash, sleeping rather than spinning through an erase
+ */
+static void pflash_lock_acquire(void)
+{
+    while (!spin_trylock(&pflash_lock)) {
+        yield();
+    }
+}
+
+/* ============================================================================
+ * Pflash API
+ * ============================================================================ */
+
 /**
  * Initialize pflash persistence
  */
@@ -18,52 +213,97 @@ void pflash_init(void)
     kprintf("  [INFO] Pflash persistence: memory-mapped at 0x%x (size: %u MB)\n",
             PFLASH_BASE, PFLASH_SIZE / (1024 * 1024));
     pflash_initialized = 1;
+
+    blkdev_register(&pflash_blk);
 }
 
 /**
- * Write data to pflash (just a memcpy to the mapped address!)
+ * Write data to pflash
  */
 int pflash_write(uint32_t offset, const void *data, size_t size)
 {
+    const uint8_t *in = (const uint8_t *)data;
+    uint32_t end, sector, sector_end;
+    int ret = 0;
+
     if (!pflash_initialized) {
         klog_error("Pflash not initialized");
         return -1;
     }
 
-    if (offset + size > PFLASH_SIZE) {
+    if (offset > PFLASH_SIZE || size > PFLASH_SIZE - offset) {
         klog_error("Pflash write beyond bounds: offset=%u size=%u", offset, (uint32_t)size);
         return -1;
     }
 
-    void *dest = (void *)(uintptr_t)(PFLASH_BASE + offset);
-    memcpy(dest, data, size);
+    pflash_lock_acquire();
+    end = offset + (uint32_t)size;
+    while (offset < end && ret == 0) {
+        sector = offset & ~(PFLASH_SECTOR_SIZE - 1);
+        sector_end = sector + PFLASH_SECTOR_SIZE;
+        if (sector_end > end) {
+            sector_end = end;
+        }
+        ret = pflash_write_sector(sector, offset, sector_end, in);
+        in += sector_end - offset;
+        offset = sector_end;
+    }
+    spin_unlock(&pflash_lock);
 
-    kprintf("  [DEBUG] Pflash: wrote %u bytes to offset %u\n", (uint32_t)size, offset);
-    return 0;
+    if (ret != 0) {
+        klog_error("Pflash: program/erase failed near offset %u", offset);
+    }
+    return ret;
 }
 
 /**
- * Read data from pflash (just a memcpy from the mapped address!)
+ * Read data from pflash
  */
 int pflash_read(uint32_t offset, void *data, size_t size)
 {
+    uint8_t *out = (uint8_t *)data;
+    uint32_t word, i;
+
     if (!pflash_initialized) {
         klog_error("Pflash not initialized");
         return -1;
     }
 
-    if (offset + size > PFLASH_SIZE) {
+    if (offset > PFLASH_SIZE || size > PFLASH_SIZE - offset) {
         klog_error("Pflash read beyond bounds: offset=%u size=%u", offset, (uint32_t)size);
         return -1;
     }
 
-    void *src = (void *)(uintptr_t)(PFLASH_BASE + offset);
-    memcpy(data, src, size);
-
-    kprintf("  [DEBUG] Pflash: read %u bytes from offset %u\n", (uint32_t)size, offset);
+    /* Whole aligned words: the mapping is Device memory */
+    pflash_lock_acquire();
+    while (size > 0) {
+        word = *pflash_word(offset & ~3U);
+        for (i = offset & 3U; i < 4 && size > 0; i++) {
+            *out++ = (uint8_t)(word >> (i * 8));
+            size--;
+            offset++;
+        }
+    }
+    spin_unlock(&pflash_lock);
     return 0;
 }
 
+/* ============================================================================
+ * Block Device
+ * ============================================================================ */
+
+static int pflash_blk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf)
+{
+    (void)dev;
+    return pflash_read((uint32_t)(block * BLK_SIZE), buf, (size_t)count * BLK_SIZE);
+}
+
+static int pflash_blk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf)
+{
+    (void)dev;
+    return pflash_write((uint32_t)(block * BLK_SIZE), buf, (size_t)count * BLK_SIZE);
+}
+
 /* ============================================================================
  * End of pflash.c
  * ============================================================================ */
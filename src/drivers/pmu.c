@@ -0,0 +1,416 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/drivers/pmu.c
+ * Description: ARMv8 Performance Monitors Unit (PMU) driver
+ * ============================================================================ */
+
+#include <aeos/pmu.h>
+#include <aeos/process.h>
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * The cycle counter runs in 64-bit mode. The event counters are 32 bits
+ * wide, so each CPU extends them in software: a wrap sets the counter's
+ * overflow flag (and raises the overflow PPI), and whoever sees the flag
+ * first clears it and adds 2^32 to the counter's high word. All of it
+ * runs with IRQs masked on the CPU that owns the counters.
+ *
+ * Counts are charged to processes at context switch: the scheduler hands
+ * the outgoing process everything counted since the previous switch. A
+ * process's counts therefore follow it across CPUs.
+ */
+
+/* PMCR_EL0 bits */
+#define PMCR_E              (1U << 0)   /* Enable all counters */
+#define PMCR_P              (1U << 1)   /* Reset event counters */
+#define PMCR_C              (1U << 2)   /* Reset cycle counter */
+#define PMCR_LC             (1U << 6)   /* 64-bit cycle counter overflow */
+#define PMCR_N_SHIFT        11
+#define PMCR_N_MASK         0x1F
+
+/* Cycle counter bit in PMCNTEN / PMOVS / PMINTEN */
+#define PMU_CYCLE_BIT       (1U << 31)
+
+/* ID_AA64DFR0_EL1.PMUVer */
+#define DFR0_PMUVER_SHIFT   8
+#define DFR0_PMUVER_MASK    0xF
+#define DFR0_PMUVER_IMPDEF  0xF
+
+/* Event counters used (one per counted event) */
+#define PMU_MAX_EVENTS      3
+
+typedef struct {
+    uint64_t high[PMU_MAX_EVENTS];      /* Software upper halves */
+    uint64_t mark[PMU_NUM_COUNTS];      /* Values at the last switch */
+    uint64_t overflows;
+    bool running;
+} __attribute__((aligned(CACHE_LINE_SIZE))) pmu_cpu_t;
+
+static struct {
+    pmu_cpu_t cpus[MAX_CPUS];
+    uint32_t num_counters;
+    uint32_t num_events;                /* Event counters in use */
+    uint32_t event_type[PMU_MAX_EVENTS];
+    uint32_t event_count[PMU_MAX_EVENTS];   /* PMU_* slot each one feeds */
+    uint32_t enable_mask;               /* PMCNTENSET value */
+    uint32_t valid;
+    bool available;
+} pmu;
+
+/* ============================================================================
+ * PMU System Register Access
+ * ============================================================================ */
+
+static inline uint64_t read_id_aa64dfr0(void)
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, id_aa64dfr0_el1" : "=r"(val));
+    return val;
+}
+
+static inline uint32_t read_pmcr(void)
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, pmcr_el0" : "=r"(val));
+    return (uint32_t)val;
+}
+
+static inline void write_pmcr(uint32_t val)
+{
+    __asm__ volatile("msr pmcr_el0, %0; isb" : : "r"((uint64_t)val) : "memory");
+}
+
+static inline uint32_t read_pmceid0(void)
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, pmceid0_el0" : "=r"(val));
+    return (uint32_t)val;
+}
+
+static inline uint64_t read_pmccntr(void)
+{
+    uint64_t val;
+    __asm__ volatile("isb; mrs %0, pmccntr_el0" : "=r"(val) :: "memory");
+    return val;
+}
+
+static inline uint32_t read_pmovsset(void)
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, pmovsset_el0" : "=r"(val));
+    return (uint32_t)val;
+}
+
+static inline void write_pmovsclr(uint32_t val)
+{
+    __asm__ volatile("msr pmovsclr_el0, %0; isb" : : "r"((uint64_t)val) : "memory");
+}
+
+/* The counter number is part of the register name, so index by hand */
+
+static inline uint32_t read_evcntr(uint32_t n)
+{
+    uint64_t val = 0;
+
+    switch (n) {
+    case 0: __asm__ volatile("mrs %0, pmevcntr0_el0" : "=r"(val)); break;
+    case 1: __asm__ volatile("mrs %0, pmevcntr1_el0" : "=r"(val)); break;
+    case 2: __asm__ volatile("mrs %0, pmevcntr2_el0" : "=r"(val)); break;
+    default: break;
+    }
+    return (uint32_t)val;
+}
+
+static inline void write_evtyper(uint32_t n, uint32_t type)
+{
+    uint64_t val = type;
+
+    /* Filter bits clear: count EL0 and EL1, not EL2 */
+    switch (n) {
+    case 0: __asm__ volatile("msr pmevtyper0_el0, %0" : : "r"(val)); break;
+    case 1: __asm__ volatile("msr pmevtyper1_el0, %0" : : "r"(val)); break;
+    case 2: __asm__ volatile("msr pmevtyper2_el0, %0" : : "r"(val)); break;
+    default: break;
+    }
+}
+
+/* ============================================================================
+ * Counter Reading
+ * ============================================================================ */
+
+/**
+ * Read event counter n extended to 64 bits
+ * A wrap seen here is folded in and the counter re-read, since it may have
+ * wrapped between the read and the flag check.
+ */
+static uint64_t read_event(pmu_cpu_t *pc, uint32_t n)
+{
+    uint32_t lo = read_evcntr(n);
+
+    if (read_pmovsset() & (1U << n)) {
+        write_pmovsclr(1U << n);
+        pc->high[n] += 1ULL << 32;
+        pc->overflows++;
+        lo = read_evcntr(n);
+    }
+    return pc->high[n] + lo;
+}
+
+/**
+ * Read every count on this CPU (IRQs masked)
+ */
+static void sample(pmu_cpu_t *pc, uint64_t now[PMU_NUM_COUNTS])
+{
+    uint32_t n;
+
+    memset(now, 0, sizeof(uint64_t) * PMU_NUM_COUNTS);
+    now[PMU_CYCLES] = read_pmccntr();
+    for (n = 0; n < pmu.num_events; n++) {
+        now[pmu.event_count[n]] = read_event(pc, n);
+    }
+}
+
+/**
+ * Overflow interrupt: fold wrapped counters into their high words
+ */
+static void pmu_irq_handler(void)
+{
+    pmu_cpu_t *pc = &pmu.cpus[smp_processor_id()];
+    uint32_t n;
+
+    for (n = 0; n < pmu.num_events; n++) {
+        (void)read_event(pc, n);
+    }
+}
+
+/* ============================================================================
+ * Initialization
+ * ============================================================================ */
+
+/**
+ * Program and start this CPU's counters
+ */
+static void pmu_start_local(void)
+{
+    pmu_cpu_t *pc = &pmu.cpus[smp_processor_id()];
+    uint64_t flags;
+    uint32_t n;
+
+    flags = irq_save();
+
+    /* Stop everything while reprogramming */
+    __asm__ volatile("msr pmcntenclr_el0, %0" : : "r"(~0ULL));
+    __asm__ volatile("msr pmintenclr_el1, %0" : : "r"(~0ULL));
+    write_pmovsclr(~0U);
+
+    /* No EL0 access; cycle counter counts EL0 and EL1 */
+    __asm__ volatile("msr pmuserenr_el0, xzr");
+    __asm__ volatile("msr pmccfiltr_el0, xzr");
+
+    for (n = 0; n < pmu.num_events; n++) {
+        write_evtyper(n, pmu.event_type[n]);
+        pc->high[n] = 0;
+    }
+    __asm__ volatile("isb");
+
+    write_pmcr((read_pmcr() & ~PMCR_E) | PMCR_P | PMCR_C | PMCR_LC);
+    write_pmcr(read_pmcr() | PMCR_E);
+
+    /* The cycle counter is 64 bits and never needs the interrupt */
+    __asm__ volatile("msr pmintenset_el1, %0" : :
+                     "r"((uint64_t)(pmu.enable_mask & ~PMU_CYCLE_BIT)));
+    __asm__ volatile("msr pmcntenset_el0, %0; isb" : :
+                     "r"((uint64_t)pmu.enable_mask) : "memory");
+
+    gic_set_priority(PMU_PPI, GIC_PRIORITY_NORMAL);
+    gic_enable_irq(PMU_PPI);
+
+    sample(pc, pc->mark);
+    pc->running = true;
+
+    irq_restore(flags);
+}
+
+/**
+ * Add an event if the CPU implements it and a counter is left
+ */
+static void pmu_add_event(uint32_t pmceid0, uint32_t type, uint32_t slot)
+{
+    uint32_t n = pmu.num_events;
+
+    if (n >= pmu.num_counters || n >= PMU_MAX_EVENTS ||
+        type >= 32 || !(pmceid0 & (1U << type))) {
+        return;
+    }
+
+    pmu.event_type[n] = type;
+    pmu.event_count[n] = slot;
+    pmu.enable_mask |= 1U << n;
+    pmu.valid |= 1U << slot;
+    pmu.num_events++;
+}
+
+/**
+ * Initialize the PMU on the boot CPU
+ */
+void pmu_init(void)
+{
+    uint32_t ver, pmceid0;
+
+    ver = (uint32_t)(read_id_aa64dfr0() >> DFR0_PMUVER_SHIFT) & DFR0_PMUVER_MASK;
+    if (ver == 0 || ver == DFR0_PMUVER_IMPDEF) {
+        klog_info("PMU: not implemented, cycle and event counts unavailable");
+        return;
+    }
+
+    pmu.num_counters = (read_pmcr() >> PMCR_N_SHIFT) & PMCR_N_MASK;
+    pmceid0 = read_pmceid0();
+
+    pmu.enable_mask = PMU_CYCLE_BIT;
+    pmu.valid = 1U << PMU_CYCLES;
+    pmu_add_event(pmceid0, PMU_EV_INST_RETIRED, PMU_INSTRUCTIONS);
+    pmu_add_event(pmceid0, PMU_EV_L1D_CACHE_REFILL, PMU_CACHE_MISSES);
+    pmu_add_event(pmceid0, PMU_EV_BR_MIS_PRED, PMU_BRANCH_MISSES);
+
+    irq_register_handler(PMU_PPI, pmu_irq_handler);
+
+    pmu.available = true;
+    pmu_start_local();
+
+    klog_info("PMU: %u event counters, counting cycles%s%s%s",
+              pmu.num_counters,
+              (pmu.valid & (1U << PMU_INSTRUCTIONS)) ? ", instructions" : "",
+              (pmu.valid & (1U << PMU_CACHE_MISSES)) ? ", L1D refills" : "",
+              (pmu.valid & (1U << PMU_BRANCH_MISSES)) ? ", branch misses" : "");
+}
+
+/**
+ * Start counting on a secondary CPU
+ * The PPI is banked per CPU, so its priority and enable are set here too.
+ */
+void pmu_init_cpu(void)
+{
+    if (!pmu.available) {
+        return;
+    }
+    pmu_start_local();
+}
+
+/* ============================================================================
+ * PMU API
+ * ============================================================================ */
+
+/**
+ * Check whether PMU counts are available
+ */
+bool pmu_available(void)
+{
+    return pmu.available;
+}
+
+/**
+ * Bitmask of the counts being counted
+ */
+uint32_t pmu_valid_counts(void)
+{
+    return pmu.valid;
+}
+
+/**
+ * Read this CPU's cycle counter
+ */
+uint64_t pmu_cycles(void)
+{
+    if (!pmu.available) {
+        return 0;
+    }
+    return read_pmccntr();
+}
+
+/**
+ * Charge the counts since the last switch to the outgoing process
+ */
+void pmu_switch(pmu_counts_t *acc)
+{
+    pmu_cpu_t *pc;
+    uint64_t now[PMU_NUM_COUNTS];
+    uint32_t i;
+
+    if (!pmu.available) {
+        return;
+    }
+
+    pc = &pmu.cpus[smp_processor_id()];
+    if (!pc->running) {
+        return;
+    }
+
+    sample(pc, now);
+    for (i = 0; i < PMU_NUM_COUNTS; i++) {
+        if (acc != NULL) {
+            acc->count[i] += now[i] - pc->mark[i];
+        }
+        pc->mark[i] = now[i];
+    }
+}
+
+/**
+ * Read the current process's counts so far
+ */
+void pmu_read_self(pmu_counts_t *out)
+{
+    process_t *cur;
+    pmu_cpu_t *pc;
+    uint64_t now[PMU_NUM_COUNTS];
+    uint64_t flags;
+    uint32_t i;
+
+    if (!out) {
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    if (!pmu.available) {
+        return;
+    }
+
+    /* Masked, so the process can't be switched out between the two halves */
+    flags = irq_save();
+    cur = process_current();
+    pc = &pmu.cpus[smp_processor_id()];
+    if (cur != NULL && pc->running) {
+        sample(pc, now);
+        for (i = 0; i < PMU_NUM_COUNTS; i++) {
+            out->count[i] = cur->pmu.count[i] + (now[i] - pc->mark[i]);
+        }
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Get PMU statistics
+ */
+void pmu_get_stats(pmu_stats_t *stats)
+{
+    uint32_t cpu;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->available = pmu.available;
+    stats->num_counters = pmu.num_counters;
+    stats->valid = pmu.valid;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        stats->overflows += pmu.cpus[cpu].overflows;
+    }
+}
+
+/* ============================================================================
+ * End of pmu.c
+ * ============================================================================ */
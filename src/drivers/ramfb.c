@@ -10,92 +10,191 @@
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
 
-/* fw_cfg MMIO addresses for QEMU virt */
-#define FW_CFG_SELECTOR  0x09020008
+/*
+ * fw_cfg MMIO registers for QEMU virt. The selector and the DMA address
+ * are big-endian; the data register reads a byte at a time.
+ */
 #define FW_CFG_DATA      0x09020000
+#define FW_CFG_SELECTOR  0x09020008
+#define FW_CFG_DMA       0x09020010
 
-/* fw_cfg file selectors */
+/* fw_cfg selectors */
+#define FW_CFG_ID        0x0001
 #define FW_CFG_FILE_DIR  0x0019
 
+/* Directory entries read per transfer */
+#define FW_CFG_DIR_BATCH 8
+
+/* FW_CFG_ID feature bits */
+#define FW_CFG_VERSION_DMA      (1U << 1)
+
+/* FWCfgDmaAccess control bits */
+#define FW_CFG_DMA_CTL_ERROR    0x01
+#define FW_CFG_DMA_CTL_READ     0x02
+#define FW_CFG_DMA_CTL_SKIP     0x04
+#define FW_CFG_DMA_CTL_SELECT   0x08
+#define FW_CFG_DMA_CTL_WRITE    0x10
+
+/*
+ * DMA
+ *
+ * Every access to the data register is a VM exit, one per byte. With the
+ * DMA interface the driver writes the address of a descriptor to FW_CFG_DMA
+ * and QEMU moves the whole buffer before the write returns, so reading a
+ * directory entry or writing the ramfb config costs one exit. The byte
+ * path stays for QEMUs without it (no FW_CFG_VERSION_DMA in FW_CFG_ID).
+ */
+typedef struct {
+    uint32_t control;   /* Big-endian, as are the others */
+    uint32_t length;
+    uint64_t address;
+} __attribute__((packed)) fw_cfg_dma_access_t;
+
+static struct {
+    bool probed;
+    bool dma;                           /* DMA interface available */
+    uint64_t dma_transfers;
+    uint64_t pio_bytes;                 /* Bytes moved through the data register */
+} fw_cfg;
+
+/* The device reads and updates the descriptor in place */
+static volatile fw_cfg_dma_access_t fw_cfg_dma_access __attribute__((aligned(16)));
+
 /* ramfb state */
 static ramfb_cfg_t ramfb_config;
 static bool ramfb_initialized = false;
 
+/* Convert big-endian values to host byte order and back */
+static inline uint16_t be16_to_cpu(uint16_t be_val)
+{
+    return (uint16_t)((be_val >> 8) | (be_val << 8));
+}
+
+static inline uint32_t be32_to_cpu(uint32_t be_val)
+{
+    return ((be_val & 0xFF000000) >> 24) |
+           ((be_val & 0x00FF0000) >>  8) |
+           ((be_val & 0x0000FF00) <<  8) |
+           ((be_val & 0x000000FF) << 24);
+}
+
+static inline uint64_t cpu_to_be64(uint64_t val)
+{
+    return ((val & 0xFF00000000000000ULL) >> 56) |
+           ((val & 0x00FF000000000000ULL) >> 40) |
+           ((val & 0x0000FF0000000000ULL) >> 24) |
+           ((val & 0x000000FF00000000ULL) >>  8) |
+           ((val & 0x00000000FF000000ULL) <<  8) |
+           ((val & 0x0000000000FF0000ULL) << 24) |
+           ((val & 0x000000000000FF00ULL) << 40) |
+           ((val & 0x00000000000000FFULL) << 56);
+}
+
+#define cpu_to_be16(x)  be16_to_cpu(x)
+#define cpu_to_be32(x)  be32_to_cpu(x)
+
 /* Helper functions for fw_cfg access */
 static inline void fw_cfg_select(uint16_t key)
 {
     volatile uint16_t *selector = (volatile uint16_t *)FW_CFG_SELECTOR;
-    *selector = key;
+    *selector = cpu_to_be16(key);
 }
 
-static inline uint8_t fw_cfg_read_byte(void)
+static void fw_cfg_read_pio(void *buf, uint32_t len)
 {
     volatile uint8_t *data = (volatile uint8_t *)FW_CFG_DATA;
-    return *data;
-}
-
-static inline void fw_cfg_read(void *buf, uint32_t len)
-{
     uint8_t *ptr = (uint8_t *)buf;
+
     for (uint32_t i = 0; i < len; i++) {
-        ptr[i] = fw_cfg_read_byte();
+        ptr[i] = *data;
     }
+    fw_cfg.pio_bytes += len;
 }
 
-static inline void fw_cfg_write(const void *buf, uint32_t len)
+static void fw_cfg_write_pio(const void *buf, uint32_t len)
 {
     volatile uint8_t *data = (volatile uint8_t *)FW_CFG_DATA;
     const uint8_t *ptr = (const uint8_t *)buf;
+
     for (uint32_t i = 0; i < len; i++) {
-        data[i] = ptr[i];
+        *data = ptr[i];
     }
+    fw_cfg.pio_bytes += len;
 }
 
-/* Convert big-endian uint32 to host byte order */
-static inline uint32_t be32_to_cpu(uint32_t be_val)
+/**
+ * Run one DMA transfer on the selected item
+ * @param control FW_CFG_DMA_CTL_READ, _WRITE or _SKIP
+ * @return 0 on success, -1 if the device reported an error
+ */
+static int fw_cfg_dma(uint32_t control, void *buf, uint32_t len)
 {
-    return ((be_val & 0xFF000000) >> 24) |
-           ((be_val & 0x00FF0000) >>  8) |
-           ((be_val & 0x0000FF00) <<  8) |
-           ((be_val & 0x000000FF) << 24);
+    volatile uint64_t *reg = (volatile uint64_t *)FW_CFG_DMA;
+    uint32_t status;
+
+    fw_cfg_dma_access.control = cpu_to_be32(control);
+    fw_cfg_dma_access.length = cpu_to_be32(len);
+    fw_cfg_dma_access.address = cpu_to_be64((uint64_t)(uintptr_t)buf);
+
+    /* Descriptor and buffer must be in memory before the device looks */
+    __asm__ volatile("dsb sy" ::: "memory");
+    *reg = cpu_to_be64((uint64_t)(uintptr_t)&fw_cfg_dma_access);
+    __asm__ volatile("dsb sy" ::: "memory");
+
+    /* QEMU finishes within the write; the device clears control when done */
+    while ((status = be32_to_cpu(fw_cfg_dma_access.control)) & ~FW_CFG_DMA_CTL_ERROR) {
+        __asm__ volatile("yield");
+    }
+
+    fw_cfg.dma_transfers++;
+    return (status & FW_CFG_DMA_CTL_ERROR) ? -1 : 0;
 }
 
-/* Convert host byte order to big-endian */
-static inline uint64_t cpu_to_be64(uint64_t val)
+/**
+ * Find out whether the DMA interface is there
+ */
+static void fw_cfg_probe(void)
 {
-    return ((val & 0xFF00000000000000ULL) >> 56) |
-           ((val & 0x00FF000000000000ULL) >> 40) |
-           ((val & 0x0000FF0000000000ULL) >> 24) |
-           ((val & 0x000000FF00000000ULL) >>  8) |
-           ((val & 0x00000000FF000000ULL) <<  8) |
-           ((val & 0x0000000000FF0000ULL) << 24) |
-           ((val & 0x000000000000FF00ULL) << 40) |
-           ((val & 0x00000000000000FFULL) << 56);
+    uint32_t id = 0;
+
+    if (fw_cfg.probed) {
+        return;
+    }
+    fw_cfg.probed = true;
+
+    /* FW_CFG_ID is little-endian */
+    fw_cfg_select(FW_CFG_ID);
+    fw_cfg_read_pio(&id, sizeof(id));
+    fw_cfg.dma = (id & FW_CFG_VERSION_DMA) != 0;
+
+    klog_debug("fw_cfg: interface 0x%x, %s", id, fw_cfg.dma ? "DMA" : "byte access");
 }
 
-static inline uint32_t cpu_to_be32(uint32_t val)
+/**
+ * Read from the selected item
+ * @return 0 on success, -1 on a DMA error
+ */
+static int fw_cfg_read(void *buf, uint32_t len)
 {
-    return ((val & 0xFF000000) >> 24) |
-           ((val & 0x00FF0000) >>  8) |
-           ((val & 0x0000FF00) <<  8) |
-           ((val & 0x000000FF) << 24);
+    if (fw_cfg.dma) {
+        return fw_cfg_dma(FW_CFG_DMA_CTL_READ, buf, len);
+    }
+    fw_cfg_read_pio(buf, len);
+    return 0;
 }
 
 /**
- * Check if fw_cfg is accessible
- * Returns true if we can safely access fw_cfg
+ * Write to the selected item
+ * @return 0 on success, -1 on a DMA error
  */
-// static bool fw_cfg_is_available(void)
-// {
-//     /* For now, we'll just assume fw_cfg is available if QEMU was started
-//      * with -device ramfb. If accessing fw_cfg causes an exception,
-//      * the exception handler will catch it.
-//      *
-//      * A more robust implementation would check the device tree or
-//      * try a test read with exception handling.
-//      */
-//     return true;  /* Optimistically assume it's available */
-// }
+static int fw_cfg_write(const void *buf, uint32_t len)
+{
+    if (fw_cfg.dma) {
+        return fw_cfg_dma(FW_CFG_DMA_CTL_WRITE, (void *)buf, len);
+    }
+    fw_cfg_write_pio(buf, len);
+    return 0;
+}
 
 /**
  * Initialize ramfb driver
@@ -147,26 +246,38 @@ static uint16_t fw_cfg_find_file(const char *name)
         char name[56];
     } __attribute__((packed)) fw_cfg_file_t;
 
-    uint32_t count;
-    fw_cfg_file_t file;
+    fw_cfg_file_t files[FW_CFG_DIR_BATCH];
+    uint32_t count, n, i;
+    uint16_t selector;
+
+    fw_cfg_probe();
 
     /* Read file directory */
     fw_cfg_select(FW_CFG_FILE_DIR);
 
     /* First 4 bytes = number of files (big-endian) */
-    fw_cfg_read(&count, sizeof(count));
+    if (fw_cfg_read(&count, sizeof(count)) != 0) {
+        return 0;
+    }
     count = be32_to_cpu(count);
 
     klog_debug("fw_cfg: scanning %u files for '%s'", count, name);
 
-    /* Scan through files */
-    for (uint32_t i = 0; i < count; i++) {
-        fw_cfg_read(&file, sizeof(file));
-
-        if (strcmp(file.name, name) == 0) {
-            uint16_t selector = be32_to_cpu(file.selector) >> 16;
-            klog_debug("fw_cfg: found '%s' at selector 0x%x", name, selector);
-            return selector;
+    /* Scan through files, a batch of entries per read */
+    while (count > 0) {
+        n = count < FW_CFG_DIR_BATCH ? count : FW_CFG_DIR_BATCH;
+        if (fw_cfg_read(files, n * sizeof(files[0])) != 0) {
+            return 0;
+        }
+        count -= n;
+
+        for (i = 0; i < n; i++) {
+            files[i].name[sizeof(files[i].name) - 1] = '\0';
+            if (strcmp(files[i].name, name) == 0) {
+                selector = be16_to_cpu(files[i].selector);
+                klog_debug("fw_cfg: found '%s' at selector 0x%x", name, selector);
+                return selector;
+            }
         }
     }
 
@@ -192,8 +303,8 @@ int ramfb_enable(void)
     /* Find the etc/ramfb file */
     selector = fw_cfg_find_file("etc/ramfb");
     if (selector == 0) {
-        klog_error("fw_cfg file 'etc/ramfb' not found");
-        klog_error("Make sure QEMU is started with: -device ramfb");
+        /* Probed at every boot without virtio-gpu, so not an error */
+        klog_debug("fw_cfg file 'etc/ramfb' not found (no -device ramfb)");
         return -1;
     }
 
@@ -207,7 +318,12 @@ int ramfb_enable(void)
 
     /* Write configuration */
     fw_cfg_select(selector);
-    fw_cfg_write(&cfg_be, sizeof(cfg_be));
+    if (fw_cfg_write(&cfg_be, sizeof(cfg_be)) != 0) {
+        klog_error("ramfb: fw_cfg DMA write failed");
+        return -1;
+    }
+    klog_debug("fw_cfg: %llu DMA transfers, %llu bytes by byte access",
+               fw_cfg.dma_transfers, fw_cfg.pio_bytes);
 
     klog_info("[OK] ramfb configured successfully!");
     klog_info("  Address: 0x%llx", ramfb_config.addr);
@@ -5,12 +5,33 @@
  * ============================================================================ */
 
 #include <aeos/semihosting.h>
+#include <aeos/blkdev.h>
+#include <aeos/spinlock.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
 
 /* Semihosting availability flag */
 static bool semihosting_enabled = false;
 
+static int host_blk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf);
+static int host_blk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf);
+
+static const blkdev_ops_t host_blk_ops = {
+    .read = host_blk_read,
+    .write = host_blk_write,
+};
+
+/* The "host" block device: SEMIHOST_BLK_FILE, opened on first use */
+static struct {
+    blkdev_t dev;
+    spinlock_t lock;        /* A seek and its transfer go together */
+    int fd;
+} host_blk = {
+    .dev = { .name = "host", .num_blocks = SEMIHOST_BLK_BLOCKS, .ops = &host_blk_ops },
+    .lock = SPINLOCK_INIT,
+    .fd = -1,
+};
+
 /* ============================================================================
  * Low-level Semihosting Call
  * ============================================================================ */
@@ -59,6 +80,8 @@ int semihost_init(void)
     semihosting_enabled = true;
 
     klog_info("Semihosting initialized (assuming QEMU with -semihosting-config)");
+
+    blkdev_register(&host_blk.dev);
     return 0;
 }
 
@@ -202,6 +225,120 @@ int semihost_remove(const char *path)
     return (int)semihosting_call(SEMI_SYS_REMOVE, &args);
 }
 
+/**
+ * Get the command line QEMU was given for the program
+ */
+int semihost_get_cmdline(char *buf, size_t len)
+{
+    struct {
+        char *buf;
+        size_t len;
+    } args;
+
+    if (!semihosting_enabled || buf == NULL || len == 0) {
+        return -1;
+    }
+
+    args.buf = buf;
+    args.len = len;
+
+    /* The host sets len to the length written, without the terminator */
+    if (semihosting_call(SEMI_SYS_GET_CMDLINE, &args) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop QEMU with an exit status
+ */
+void semihost_exit(int code)
+{
+    /* AArch64 takes a block: reason, then the status for the host */
+    uint64_t args[2] = { ADP_STOPPED_APPLICATION_EXIT, (uint64_t)(uint32_t)code };
+
+    if (semihosting_enabled) {
+        semihosting_call(SEMI_SYS_EXIT, args);
+    }
+
+    /* Only reached without semihosting */
+    while (1) {
+        __asm__ volatile("wfi");
+    }
+}
+
+/* ============================================================================
+ * Host Block Device
+ * ============================================================================ */
+
+/**
+ * Open the backing file (lock held)
+ * @param create Create it if missing; reads of a missing file see zeros
+ * @return 0 on success, -1 if there is no file
+ */
+static int host_blk_open(bool create)
+{
+    if (host_blk.fd >= 0) {
+        return 0;
+    }
+
+    host_blk.fd = semihost_open(SEMIHOST_BLK_FILE, SEMIHOST_OPEN_RPB);
+    if (host_blk.fd < 0 && create) {
+        host_blk.fd = semihost_open(SEMIHOST_BLK_FILE, SEMIHOST_OPEN_WPB);
+    }
+    return (host_blk.fd >= 0) ? 0 : -1;
+}
+
+/**
+ * Read blocks from the host file
+ * Blocks past the end of the file read as zeros.
+ */
+static int host_blk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf)
+{
+    size_t len = (size_t)count * BLK_SIZE;
+    size_t missing = len;
+    uint64_t flags;
+
+    (void)dev;
+
+    flags = spin_lock_irqsave(&host_blk.lock);
+    if (host_blk_open(false) == 0) {
+        if (semihost_seek(host_blk.fd, (size_t)(block * BLK_SIZE)) != 0) {
+            spin_unlock_irqrestore(&host_blk.lock, flags);
+            return -1;
+        }
+        missing = semihost_read(host_blk.fd, buf, len);
+    }
+    spin_unlock_irqrestore(&host_blk.lock, flags);
+
+    if (missing > len) {
+        return -1;
+    }
+    memset((uint8_t *)buf + (len - missing), 0, missing);
+    return 0;
+}
+
+/**
+ * Write blocks to the host file
+ */
+static int host_blk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf)
+{
+    size_t len = (size_t)count * BLK_SIZE;
+    uint64_t flags;
+    int ret = -1;
+
+    (void)dev;
+
+    flags = spin_lock_irqsave(&host_blk.lock);
+    if (host_blk_open(true) == 0 &&
+        semihost_seek(host_blk.fd, (size_t)(block * BLK_SIZE)) == 0 &&
+        semihost_write(host_blk.fd, buf, len) == 0) {
+        ret = 0;
+    }
+    spin_unlock_irqrestore(&host_blk.lock, flags);
+    return ret;
+}
+
 /* ============================================================================
  * End of semihosting.c
  * ============================================================================ */
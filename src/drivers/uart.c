@@ -1,10 +1,16 @@
 /* ============================================================================
  * AEOS - Abdalla's Educational Operating System
  * File: src/drivers/uart.c
- * Description: PL011 UART driver implementation (polling mode)
+ * Description: PL011 UART driver implementation
  * ============================================================================ */
 
 #include <aeos/uart.h>
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/spinlock.h>
+#include <aeos/wait.h>
+#include <aeos/timer.h>
+#include <aeos/string.h>
 #include <aeos/types.h>
 
 /* Helper macros for MMIO register access */
@@ -14,6 +20,271 @@
 /* UART register access macros */
 #define UART_REG(offset) (UART0_BASE + (offset))
 
+/*
+ * Transmit buffering
+ *
+ * Writers copy into a software ring and return. The hardware FIFO gets a
+ * burst of up to UART_TX_BURST bytes right away and another from each TX
+ * interrupt, which fires once the FIFO has drained to half (16 bytes) and
+ * is unmasked only while the ring holds data. A writer waits on the FIFO
+ * only when the ring itself is full. Before uart_enable_irq() and after
+ * uart_panic_mode() every write drains synchronously instead.
+ *
+ * Receive buffering
+ *
+ * The RX interrupt (FIFO half full) and the receive timeout interrupt
+ * (FIFO not empty and the line idle for 32 bit periods) move everything
+ * in the FIFO to a software ring. Readers take bytes from the ring and
+ * sleep while it is empty; one blocked reader at a time is woken.
+ */
+#define UART_TX_BUF_SIZE    4096
+#define UART_TX_MASK        (UART_TX_BUF_SIZE - 1)
+#define UART_TX_BURST       16
+
+#define UART_RX_BUF_SIZE    1024
+#define UART_RX_MASK        (UART_RX_BUF_SIZE - 1)
+
+/* Longest single sleep of a blocked reader (ns); it then checks again */
+#define UART_RX_WAIT_NS     1000000000ULL
+
+static struct {
+    char tx_buf[UART_TX_BUF_SIZE];
+    uint32_t tx_head;               /* Next byte to queue */
+    uint32_t tx_tail;               /* Next byte for the FIFO */
+    spinlock_t lock;                /* Protects the TX ring and IMSC */
+    uint32_t imsc;
+
+    char rx_buf[UART_RX_BUF_SIZE];
+    uint32_t rx_head;               /* Next byte from the FIFO */
+    uint32_t rx_tail;               /* Next byte for a reader */
+    spinlock_t rx_lock;             /* Protects the RX ring */
+    wait_queue_t rx_wait;           /* Readers sleeping on an empty ring */
+    uart_rx_notify_fn rx_notify;
+
+    bool irq;                       /* Interrupts move the data */
+    volatile bool panic;            /* Synchronous and lock-free */
+    uart_stats_t stats;
+} uart = {
+    .lock = SPINLOCK_INIT,
+    .rx_lock = SPINLOCK_INIT,
+    .rx_wait = WAIT_QUEUE_INIT,
+};
+
+/* ============================================================================
+ * Transmit Ring (uart.lock held)
+ * ============================================================================ */
+
+static inline bool tx_fifo_full(void)
+{
+    return (MMIO_READ(UART_REG(UART_FR)) & UART_FR_TXFF) != 0;
+}
+
+/**
+ * Move one burst of queued bytes into the FIFO
+ * The TX interrupt stays unmasked while anything is left over.
+ */
+static void tx_fill_fifo(void)
+{
+    uint32_t imsc, n = 0;
+
+    while (n < UART_TX_BURST && uart.tx_tail != uart.tx_head && !tx_fifo_full()) {
+        MMIO_WRITE(UART_REG(UART_DR), (uint32_t)(uint8_t)uart.tx_buf[uart.tx_tail & UART_TX_MASK]);
+        uart.tx_tail++;
+        n++;
+    }
+    uart.stats.tx_bytes += n;
+
+    imsc = uart.imsc & ~UART_INT_TX;
+    if (uart.irq && uart.tx_tail != uart.tx_head) {
+        imsc |= UART_INT_TX;
+    }
+    if (imsc != uart.imsc) {
+        uart.imsc = imsc;
+        MMIO_WRITE(UART_REG(UART_IMSC), imsc);
+    }
+}
+
+/**
+ * Send one queued byte, waiting for FIFO space
+ */
+static void tx_send_one(void)
+{
+    while (tx_fifo_full()) {
+        /* Busy wait */
+    }
+    MMIO_WRITE(UART_REG(UART_DR), (uint32_t)(uint8_t)uart.tx_buf[uart.tx_tail & UART_TX_MASK]);
+    uart.tx_tail++;
+    uart.stats.tx_bytes++;
+}
+
+/**
+ * Queue one byte; with the ring full, make room the slow way
+ */
+static void tx_queue(char c)
+{
+    while (uart.tx_head - uart.tx_tail == UART_TX_BUF_SIZE) {
+        tx_send_one();
+    }
+    uart.tx_buf[uart.tx_head & UART_TX_MASK] = c;
+    uart.tx_head++;
+}
+
+/**
+ * Write bytes straight to the FIFO (panic mode)
+ */
+static void tx_write_sync(const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        while (tx_fifo_full()) {
+            /* Busy wait */
+        }
+        MMIO_WRITE(UART_REG(UART_DR), (uint32_t)(uint8_t)buf[i]);
+        if (buf[i] == '\n') {
+            while (tx_fifo_full()) {
+                /* Busy wait */
+            }
+            MMIO_WRITE(UART_REG(UART_DR), '\r');
+        }
+    }
+}
+
+/* ============================================================================
+ * Receive Ring
+ * ============================================================================ */
+
+/**
+ * Move everything in the RX FIFO to the ring (uart.rx_lock held)
+ * @return Bytes moved
+ */
+static uint32_t rx_drain_fifo(void)
+{
+    uint32_t n = 0;
+    char c;
+
+    while (!(MMIO_READ(UART_REG(UART_FR)) & UART_FR_RXFE)) {
+        c = (char)MMIO_READ(UART_REG(UART_DR));
+        if (uart.rx_head - uart.rx_tail == UART_RX_BUF_SIZE) {
+            uart.stats.rx_dropped++;
+            continue;
+        }
+        uart.rx_buf[uart.rx_head & UART_RX_MASK] = c;
+        uart.rx_head++;
+        n++;
+    }
+    uart.stats.rx_bytes += n;
+    return n;
+}
+
+/**
+ * Take one byte from the ring, or -1 when it is empty
+ * Without interrupts the FIFO is read directly.
+ */
+static int rx_take(void)
+{
+    uint64_t flags;
+    int c = -1;
+
+    flags = spin_lock_irqsave(&uart.rx_lock);
+    if (!uart.irq) {
+        rx_drain_fifo();
+    }
+    if (uart.rx_tail != uart.rx_head) {
+        c = (uint8_t)uart.rx_buf[uart.rx_tail & UART_RX_MASK];
+        uart.rx_tail++;
+    }
+    spin_unlock_irqrestore(&uart.rx_lock, flags);
+
+    return c;
+}
+
+/**
+ * Wait for a byte until an absolute deadline
+ * @return The byte, or -1 on timeout
+ */
+static int rx_wait(uint64_t deadline_ns)
+{
+    waiter_t w = WAITER_INIT;
+    uint64_t flags, now, until;
+    int c;
+
+    for (;;) {
+        /* Queued before the check, so the next RX interrupt wakes us */
+        wait_prepare(&uart.rx_wait, &w);
+
+        flags = spin_lock_irqsave(&uart.rx_lock);
+        if (!uart.irq) {
+            rx_drain_fifo();
+        }
+        if (uart.rx_tail != uart.rx_head) {
+            c = (uint8_t)uart.rx_buf[uart.rx_tail & UART_RX_MASK];
+            uart.rx_tail++;
+            spin_unlock_irqrestore(&uart.rx_lock, flags);
+            wait_finish(&uart.rx_wait, &w);
+            return c;
+        }
+        spin_unlock_irqrestore(&uart.rx_lock, flags);
+
+        now = timer_get_ns();
+        if (now >= deadline_ns) {
+            wait_finish(&uart.rx_wait, &w);
+            return -1;
+        }
+        until = deadline_ns;
+        if (until - now > UART_RX_WAIT_NS) {
+            until = now + UART_RX_WAIT_NS;
+        }
+
+        if (uart.irq) {
+            wait_sleep(&w, until);
+        } else {
+            __asm__ volatile("yield");
+        }
+        uart.stats.rx_waits++;
+    }
+}
+
+/* ============================================================================
+ * Interrupt Handler
+ * ============================================================================ */
+
+/**
+ * UART interrupt handler
+ */
+static void uart_irq_handler(void)
+{
+    uint32_t mis = MMIO_READ(UART_REG(UART_MIS));
+    uart_rx_notify_fn notify = NULL;
+    bool received = false;
+
+    uart.stats.interrupts++;
+
+    if (mis & (UART_INT_RX | UART_INT_RT)) {
+        spin_lock(&uart.rx_lock);
+        MMIO_WRITE(UART_REG(UART_ICR), UART_INT_RX | UART_INT_RT);
+        if (rx_drain_fifo() > 0) {
+            received = true;
+            notify = uart.rx_notify;
+        }
+        spin_unlock(&uart.rx_lock);
+
+        if (received) {
+            wake_up_all(&uart.rx_wait);
+        }
+        if (notify != NULL) {
+            notify();
+        }
+    }
+
+    if (mis & UART_INT_TX) {
+        spin_lock(&uart.lock);
+        MMIO_WRITE(UART_REG(UART_ICR), UART_INT_TX);
+        tx_fill_fifo();
+        spin_unlock(&uart.lock);
+    }
+}
+
 /**
  * Initialize the UART hardware
  *
@@ -32,6 +303,7 @@ void uart_init(void)
 
     /* Clear all interrupt masks */
     MMIO_WRITE(UART_REG(UART_IMSC), 0);
+    uart.imsc = 0;
 
     /* Clear any pending interrupts */
     MMIO_WRITE(UART_REG(UART_ICR), 0x7FF);
@@ -58,6 +330,9 @@ void uart_init(void)
      */
     MMIO_WRITE(UART_REG(UART_LCRH), UART_LCRH_WLEN_8BIT | UART_LCRH_FEN);
 
+    /* Interrupt when the TX FIFO drains to half, or the RX FIFO fills to half */
+    MMIO_WRITE(UART_REG(UART_IFLS), UART_IFLS_TX_HALF | UART_IFLS_RX_HALF);
+
     /*
      * Enable UART, transmit, and receive
      */
@@ -66,23 +341,79 @@ void uart_init(void)
 }
 
 /**
- * Send a single character to the UART
- * Waits until the transmit FIFO has space
+ * Switch transmission to the TX interrupt
  */
-void uart_putc(char c)
+void uart_enable_irq(void)
 {
-    /* Wait until transmit FIFO is not full */
-    while (MMIO_READ(UART_REG(UART_FR)) & UART_FR_TXFF) {
-        /* Busy wait */
+    uint64_t flags;
+
+    irq_register_handler(UART0_IRQ, uart_irq_handler);
+    gic_enable_irq(UART0_IRQ);
+
+    flags = spin_lock_irqsave(&uart.lock);
+    spin_lock(&uart.rx_lock);
+    uart.irq = true;
+    rx_drain_fifo();
+    uart.imsc |= UART_INT_RX | UART_INT_RT;
+    MMIO_WRITE(UART_REG(UART_IMSC), uart.imsc);
+    spin_unlock(&uart.rx_lock);
+    tx_fill_fifo();
+    spin_unlock_irqrestore(&uart.lock, flags);
+}
+
+/**
+ * Set the function called when input arrives
+ */
+void uart_set_rx_notify(uart_rx_notify_fn fn)
+{
+    uart.rx_notify = fn;
+}
+
+/**
+ * Check whether input is delivered by interrupt
+ */
+bool uart_rx_irq_enabled(void)
+{
+    return uart.irq;
+}
+
+/**
+ * Get UART statistics
+ */
+void uart_get_stats(uart_stats_t *stats)
+{
+    if (!stats) {
+        return;
     }
 
-    /* Write character to data register */
-    MMIO_WRITE(UART_REG(UART_DR), (uint32_t)c);
+    *stats = uart.stats;
+    stats->tx_queued = uart.tx_head - uart.tx_tail;
+    stats->rx_queued = uart.rx_head - uart.rx_tail;
+}
+
+/**
+ * Flush the ring and write synchronously from now on
+ */
+void uart_panic_mode(void)
+{
+    if (uart.panic) {
+        return;
+    }
+    uart.panic = true;
 
-    /* If newline, also send carriage return for proper terminal display */
-    if (c == '\n') {
-        uart_putc('\r');
+    /* Best effort: another CPU may still be queueing */
+    while (uart.tx_tail != uart.tx_head) {
+        tx_send_one();
     }
+    MMIO_WRITE(UART_REG(UART_IMSC), 0);
+}
+
+/**
+ * Send a single character to the UART
+ */
+void uart_putc(char c)
+{
+    uart_write(&c, 1);
 }
 
 /**
@@ -94,72 +425,113 @@ void uart_puts(const char *s)
         return;
     }
 
-    while (*s) {
-        uart_putc(*s++);
-    }
+    uart_write(s, strlen(s));
 }
 
 /**
  * Receive a single character from the UART
- * Blocks until a character is available
+ * Sleeps until a character is available
  */
 char uart_getc(void)
 {
-    /* Wait until receive FIFO is not empty */
-    while (MMIO_READ(UART_REG(UART_FR)) & UART_FR_RXFE) {
-        /* Busy wait */
-    }
+    int c;
+
+    do {
+        c = rx_wait(timer_get_ns() + UART_RX_WAIT_NS);
+    } while (c < 0);
 
-    /* Read character from data register */
-    return (char)MMIO_READ(UART_REG(UART_DR));
+    return (char)c;
+}
+
+/**
+ * Receive a character, giving up after a timeout
+ */
+int uart_getc_timeout(uint32_t ms)
+{
+    return rx_wait(timer_get_ns() + (uint64_t)ms * 1000000ULL);
 }
 
 /**
  * Check if data is available to read from the UART
- * Non-blocking check of the receive FIFO status
  */
 bool uart_data_available(void)
 {
-    /* Return true if receive FIFO is not empty */
-    return (MMIO_READ(UART_REG(UART_FR)) & UART_FR_RXFE) == 0;
+    uint64_t flags;
+    bool avail;
+
+    flags = spin_lock_irqsave(&uart.rx_lock);
+    if (!uart.irq) {
+        rx_drain_fifo();
+    }
+    avail = uart.rx_tail != uart.rx_head;
+    spin_unlock_irqrestore(&uart.rx_lock, flags);
+
+    return avail;
 }
 
 /**
  * Write a buffer of data to the UART
- * Returns the number of bytes written (always equals len for polling mode)
+ * Returns the number of bytes queued (always len)
  */
 size_t uart_write(const char *buf, size_t len)
 {
+    uint64_t flags;
     size_t i;
 
     if (buf == NULL) {
         return 0;
     }
 
+    if (uart.panic) {
+        tx_write_sync(buf, len);
+        return len;
+    }
+
+    flags = spin_lock_irqsave(&uart.lock);
     for (i = 0; i < len; i++) {
-        uart_putc(buf[i]);
+        tx_queue(buf[i]);
+        if (buf[i] == '\n') {
+            tx_queue('\r');
+        }
+    }
+
+    if (uart.irq) {
+        tx_fill_fifo();
+    } else {
+        while (uart.tx_tail != uart.tx_head) {
+            tx_send_one();
+        }
     }
+    spin_unlock_irqrestore(&uart.lock, flags);
 
+    uart.stats.writes++;
     return len;
 }
 
 /**
  * Read data from the UART into a buffer
- * Blocks until requested number of bytes are read
+ * Sleeps until the first byte arrives, then copies whatever else is
+ * already buffered, up to len
  */
 size_t uart_read(char *buf, size_t len)
 {
-    size_t i;
+    size_t n;
+    int c;
 
-    if (buf == NULL) {
+    if (buf == NULL || len == 0) {
         return 0;
     }
 
-    for (i = 0; i < len; i++) {
-        buf[i] = uart_getc();
+    buf[0] = uart_getc();
+    for (n = 1; n < len; n++) {
+        c = rx_take();
+        if (c < 0) {
+            break;
+        }
+        buf[n] = (char)c;
     }
 
-    return len;
+    return n;
 }
 
 /* ============================================================================
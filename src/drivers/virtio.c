@@ -0,0 +1,471 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/drivers/virtio.c
+ * Description: VirtIO MMIO transport - device setup and split virtqueues
+ * ============================================================================ */
+
+#include <aeos/virtio.h>
+#include <aeos/virtq.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/heap.h>
+#include <aeos/dma.h>
+
+#define VIRTIO_MAGIC        0x74726976  /* 'virt' in little-endian */
+
+/* Legacy devices find the used ring on the page after the avail ring */
+#define VIRTQ_ALIGN         4096
+
+/* ============================================================================
+ * Device Setup
+ * ============================================================================ */
+
+/**
+ * Initialize VirtIO device (generic)
+ */
+int virtio_init_device(volatile void *base, virtio_device_t *dev)
+{
+    volatile uint32_t *mmio = (volatile uint32_t *)base;
+    uint32_t magic, version;
+
+    /* Check magic number */
+    magic = virtio_mmio_read32(mmio, VIRTIO_MMIO_MAGIC);
+    if (magic != VIRTIO_MAGIC) {
+        klog_error("Invalid VirtIO magic: 0x%x", magic);
+        return -1;
+    }
+
+    /* Check version (accept both legacy v1 and modern v2) */
+    version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
+    if (version != 1 && version != 2) {
+        klog_error("Unsupported VirtIO version: %u (expected 1 or 2)", version);
+        return -1;
+    }
+
+    /* Read device ID */
+    dev->device_id = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_ID);
+    dev->vendor_id = virtio_mmio_read32(mmio, VIRTIO_MMIO_VENDOR_ID);
+    dev->mmio_base = mmio;
+    dev->features = 0;
+    dev->initialized = false;
+
+    klog_debug("VirtIO device found:");
+    klog_debug("  Type: %u", dev->device_id);
+    klog_debug("  Vendor: 0x%x", dev->vendor_id);
+    klog_debug("  Version: %u", version);
+
+    return 0;
+}
+
+/**
+ * Reset a device and agree on features
+ */
+int virtio_negotiate(virtio_device_t *dev, uint32_t want)
+{
+    volatile uint32_t *mmio = dev->mmio_base;
+    uint32_t version, status, features_lo, accept;
+
+    version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
+
+    /* Reset, then ACKNOWLEDGE and DRIVER */
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, 0);
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER);
+
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+    features_lo = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_FEATURES);
+    accept = features_lo & want;
+
+    if (version == 1) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_GUEST_PAGE_SIZE, VIRTQ_ALIGN);
+    }
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, accept);
+    dev->features = accept;
+    if (version != 1) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, 1);  /* Bit 32 = VERSION_1 */
+        dev->features |= VIRTIO_F_VERSION_1;
+    }
+
+    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_FEATURES_OK);
+    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
+    if (!(status & VIRTIO_STATUS_FEATURES_OK)) {
+        klog_error("VirtIO device %u did not accept our features", dev->device_id);
+        return -1;
+    }
+
+    klog_debug("VirtIO device %u: features 0x%x of 0x%x", dev->device_id, accept, features_lo);
+    return 0;
+}
+
+/**
+ * Tell a device the driver is ready
+ */
+void virtio_driver_ok(virtio_device_t *dev)
+{
+    uint32_t status = virtio_mmio_read32(dev->mmio_base, VIRTIO_MMIO_STATUS);
+
+    virtio_mmio_write32(dev->mmio_base, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+}
+
+/* ============================================================================
+ * Virtqueues
+ * ============================================================================ */
+
+/**
+ * Tell the device where the rings are
+ */
+static void virtq_register(virtq_t *vq, uint32_t version)
+{
+    volatile uint32_t *mmio = vq->mmio;
+    uint64_t desc_addr = vq->ring_dma;
+    uint64_t avail_addr = desc_addr + ((uint64_t)vq->avail - (uint64_t)vq->desc);
+    uint64_t used_addr = desc_addr + ((uint64_t)vq->used - (uint64_t)vq->desc);
+
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NUM, vq->size);
+
+    if (version == 1) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_ALIGN, VIRTQ_ALIGN);
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_PFN, (uint32_t)(desc_addr >> 12));
+        return;
+    }
+
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_LOW, (uint32_t)(desc_addr & 0xFFFFFFFF));
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_HIGH, (uint32_t)(desc_addr >> 32));
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_LOW, (uint32_t)(avail_addr & 0xFFFFFFFF));
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (uint32_t)(avail_addr >> 32));
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_LOW, (uint32_t)(used_addr & 0xFFFFFFFF));
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_HIGH, (uint32_t)(used_addr >> 32));
+
+    /* Ring addresses before the queue goes live */
+    __asm__ volatile("dmb sy" ::: "memory");
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+/**
+ * Set a virtqueue up and hand it to the device
+ */
+int virtq_init(virtq_t *vq, virtio_device_t *dev, uint32_t index, uint32_t max_size)
+{
+    volatile uint32_t *mmio = dev->mmio_base;
+    size_t desc_size, avail_size, used_size, used_offset;
+    uint8_t *mem;
+    uint32_t size, version, i;
+
+    memset(vq, 0, sizeof(*vq));
+    vq->mmio = mmio;
+    vq->index = index;
+
+    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_SEL, index);
+    size = virtio_mmio_read32(mmio, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (size == 0) {
+        klog_error("VirtIO device %u: queue %u not available", dev->device_id, index);
+        return -1;
+    }
+    if (size > max_size) {
+        size = max_size;
+    }
+    /* Split rings are a power of two long */
+    while (size & (size - 1)) {
+        size &= size - 1;
+    }
+
+    /* The rings hold the event indices too (one uint16_t each) */
+    desc_size = sizeof(virtq_desc_t) * size;
+    avail_size = sizeof(uint16_t) * (3 + size);
+    used_size = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * size;
+    used_offset = (desc_size + avail_size + VIRTQ_ALIGN - 1) & ~(size_t)(VIRTQ_ALIGN - 1);
+
+    /* Zeroed whole pages, so VIRTQ_ALIGN aligned */
+    mem = (uint8_t *)dma_alloc_coherent(used_offset + used_size, &vq->ring_dma);
+    vq->tokens = (void **)kcalloc(size, sizeof(void *));
+    if (mem == NULL || vq->tokens == NULL) {
+        goto nomem;
+    }
+
+    vq->desc = (virtq_desc_t *)mem;
+    vq->avail = (virtq_avail_t *)(mem + desc_size);
+    vq->used = (virtq_used_t *)(mem + used_offset);
+    vq->avail_idx_p = (volatile uint16_t *)(mem + desc_size + sizeof(uint16_t));
+    vq->used_event = (volatile uint16_t *)(mem + desc_size + sizeof(uint16_t) * (2 + size));
+    vq->used_idx_p = (volatile uint16_t *)(mem + used_offset + sizeof(uint16_t));
+    vq->avail_event = (volatile uint16_t *)(mem + used_offset + sizeof(uint16_t) * 2 +
+                                            sizeof(virtq_used_elem_t) * size);
+    vq->size = (uint16_t)size;
+    vq->event_idx = (dev->features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    vq->cb_enabled = true;
+    vq->sync = !dma_coherent();
+
+    if (dev->features & VIRTIO_RING_F_INDIRECT_DESC) {
+        /* Descriptor tables need 16-byte alignment; pages have it */
+        vq->tables = (virtq_desc_t *)dma_alloc_coherent(
+            sizeof(virtq_desc_t) * VIRTQ_INDIRECT_MAX * size, &vq->tables_dma);
+        if (vq->tables == NULL) {
+            goto nomem;
+        }
+        vq->indirect = true;
+    }
+
+    /* Every descriptor starts on the free list */
+    for (i = 0; i < size; i++) {
+        vq->desc[i].next = (uint16_t)(i + 1);
+    }
+    vq->num_free = vq->size;
+    vq->free_head = 0;
+
+    version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
+    virtq_register(vq, version);
+
+    klog_debug("VirtIO device %u: queue %u, %u entries%s%s", dev->device_id, index, size,
+               vq->event_idx ? ", event idx" : "", vq->indirect ? ", indirect" : "");
+    return 0;
+
+nomem:
+    klog_error("VirtIO device %u: no memory for queue %u", dev->device_id, index);
+    return -1;
+}
+
+/**
+ * Add a buffer chain, not yet visible to the device
+ */
+int virtq_add(virtq_t *vq, const virtq_buf_t *bufs, uint16_t count, void *token)
+{
+    virtq_desc_t *chain, *d;
+    uint16_t head, idx, i;
+    bool table;
+
+    if (count == 0 || token == NULL) {
+        return -1;
+    }
+
+    /* A chain in its own table takes one ring descriptor */
+    table = vq->indirect && count > 1 && count <= VIRTQ_INDIRECT_MAX;
+    if (vq->num_free < (table ? 1 : count)) {
+        return -1;
+    }
+
+    /* The device sees what the CPU wrote, and no dirty line of a buffer
+     * it writes can be evicted over its data later */
+    if (vq->sync) {
+        for (i = 0; i < count; i++) {
+            dma_sync_for_device((const void *)bufs[i].addr, bufs[i].len);
+        }
+    }
+
+    head = vq->free_head;
+    if (table) {
+        chain = &vq->tables[(uint32_t)head * VIRTQ_INDIRECT_MAX];
+        for (i = 0; i < count; i++) {
+            chain[i].addr = bufs[i].addr;
+            chain[i].len = bufs[i].len;
+            chain[i].flags = (bufs[i].write ? VIRTQ_DESC_F_WRITE : 0) |
+                             (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+            chain[i].next = (uint16_t)(i + 1);
+        }
+
+        d = &vq->desc[head];
+        vq->free_head = d->next;
+        d->addr = vq->tables_dma + sizeof(virtq_desc_t) * (uint64_t)(chain - vq->tables);
+        d->len = sizeof(virtq_desc_t) * count;
+        d->flags = VIRTQ_DESC_F_INDIRECT;
+        vq->num_free--;
+    } else {
+        /* Chain along the free list; the last keeps its link for later */
+        idx = head;
+        for (i = 0; i < count; i++) {
+            d = &vq->desc[idx];
+            d->addr = bufs[i].addr;
+            d->len = bufs[i].len;
+            d->flags = (bufs[i].write ? VIRTQ_DESC_F_WRITE : 0) |
+                       (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+            idx = d->next;
+        }
+        vq->free_head = idx;
+        vq->num_free -= count;
+    }
+
+    vq->tokens[head] = token;
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    return 0;
+}
+
+/**
+ * Add several chains, published together by the next kick
+ */
+uint32_t virtq_add_many(virtq_t *vq, const virtq_req_t *reqs, uint32_t count)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (virtq_add(vq, reqs[i].bufs, reqs[i].count, reqs[i].token) != 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Publish added chains, notifying the device if it wants to hear
+ */
+bool virtq_kick(virtq_t *vq)
+{
+    uint16_t old_idx = vq->kicked_idx;
+    uint16_t new_idx = vq->avail_idx;
+    bool notify;
+
+    if (old_idx == new_idx) {
+        return false;
+    }
+
+    /* Release: the descriptors and ring entries are seen before the index */
+    __atomic_store_n(vq->avail_idx_p, new_idx, __ATOMIC_RELEASE);
+    vq->kicked_idx = new_idx;
+
+    /* The index is out before reading what the device asked for */
+    __asm__ volatile("dmb ish" ::: "memory");
+    if (vq->event_idx) {
+        notify = virtq_need_event(*vq->avail_event, new_idx, old_idx);
+    } else {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (!notify) {
+        vq->kicks_saved++;
+        return false;
+    }
+
+    /* Ring memory reaches the device before the register write */
+    __asm__ volatile("dmb oshst" ::: "memory");
+    virtio_mmio_write32(vq->mmio, VIRTIO_MMIO_QUEUE_NOTIFY, vq->index);
+    vq->kicks++;
+    return true;
+}
+
+/**
+ * Drop stale lines of the buffers a device wrote in a finished chain
+ */
+static void virtq_sync_chain(virtq_t *vq, uint16_t head)
+{
+    const virtq_desc_t *d = &vq->desc[head];
+    const virtq_desc_t *chain = vq->desc;
+    uint32_t i;
+
+    if (d->flags & VIRTQ_DESC_F_INDIRECT) {
+        chain = &vq->tables[(uint32_t)head * VIRTQ_INDIRECT_MAX];
+        d = chain;
+    }
+
+    for (i = 0; i < vq->size; i++) {
+        if (d->flags & VIRTQ_DESC_F_WRITE) {
+            dma_sync_for_cpu((const void *)d->addr, d->len);
+        }
+        if (!(d->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
+        d = &chain[d->next];
+    }
+}
+
+/**
+ * Take the next chain the device has finished
+ */
+void *virtq_get_used(virtq_t *vq, uint32_t *len)
+{
+    virtq_used_elem_t *elem;
+    uint16_t last;
+    uint32_t id, written;
+    void *token;
+
+    for (;;) {
+        /* Acquire: the entry and the buffers are read after the index */
+        if (vq->last_used_idx == __atomic_load_n(vq->used_idx_p, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+
+        elem = &vq->used->ring[vq->last_used_idx % vq->size];
+        id = elem->id;
+        written = elem->len;
+        vq->last_used_idx++;
+
+        if (id < vq->size && vq->tokens[id] != NULL) {
+            break;
+        }
+        klog_error("VirtIO queue %u: bogus used descriptor %u", vq->index, id);
+    }
+
+    token = vq->tokens[id];
+    vq->tokens[id] = NULL;
+
+    if (vq->sync) {
+        virtq_sync_chain(vq, (uint16_t)id);
+    }
+
+    /* Back on the free list: the head alone for a table, else the chain */
+    last = (uint16_t)id;
+    vq->num_free++;
+    if (!(vq->desc[id].flags & VIRTQ_DESC_F_INDIRECT)) {
+        while (vq->desc[last].flags & VIRTQ_DESC_F_NEXT) {
+            last = vq->desc[last].next;
+            vq->num_free++;
+        }
+    }
+    vq->desc[last].next = vq->free_head;
+    vq->free_head = (uint16_t)id;
+
+    /* Interrupt for the next one; the store must be out before the next
+     * check of the used index, or a completion in between goes unnoticed */
+    if (vq->event_idx && vq->cb_enabled) {
+        *vq->used_event = vq->last_used_idx;
+        __asm__ volatile("dmb ish" ::: "memory");
+    }
+
+    if (len != NULL) {
+        *len = written;
+    }
+    return token;
+}
+
+/**
+ * Check for finished chains without taking them
+ */
+bool virtq_has_used(virtq_t *vq)
+{
+    return vq->last_used_idx != __atomic_load_n(vq->used_idx_p, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Ask the device not to interrupt, while draining
+ */
+void virtq_disable_cb(virtq_t *vq)
+{
+    /* With event indices, leaving used_event behind does the same */
+    vq->cb_enabled = false;
+    if (!vq->event_idx) {
+        vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+/**
+ * Ask for an interrupt on the next finished chain again
+ */
+bool virtq_enable_cb(virtq_t *vq)
+{
+    vq->cb_enabled = true;
+    if (vq->event_idx) {
+        *vq->used_event = vq->last_used_idx;
+    } else {
+        vq->avail->flags = 0;
+    }
+
+    /* The request is out before looking for completions it missed */
+    __asm__ volatile("dmb ish" ::: "memory");
+    return virtq_has_used(vq);
+}
+
+/* ============================================================================
+ * End of virtio.c
+ * ============================================================================ */
@@ -0,0 +1,406 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/drivers/virtio_blk.c
+ * Description: VirtIO block device driver
+ * ============================================================================ */
+
+#include <aeos/virtio_blk.h>
+#include <aeos/virtio.h>
+#include <aeos/virtq.h>
+#include <aeos/blkdev.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/heap.h>
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/spinlock.h>
+#include <aeos/softirq.h>
+#include <aeos/trace.h>
+
+/*
+ * Every request is a chain of three buffers: header, data and a status
+ * byte. With indirect descriptors the chain takes a single ring slot, so
+ * the whole ring is available for requests in flight. The request is the
+ * chain's token. Completions are reaped in a tasklet the interrupt
+ * schedules, and the bios finished outside the lock.
+ */
+
+/* Largest ring asked for: enough for every request without indirect */
+#define BLK_VIRTQ_SIZE      256
+
+/* Descriptors in a request chain */
+#define BLK_REQ_DESCS       3
+
+/* Bios the synchronous path keeps in flight */
+#define BLK_SYNC_BIOS       8
+
+/* A request */
+typedef struct {
+    virtio_blk_req_hdr_t hdr;
+    volatile uint8_t status;
+    bio_t *bio;                     /* NULL when the request is free */
+} blk_request_t;
+
+/* Device state */
+static struct {
+    spinlock_t lock;
+    virtio_device_t vdev;
+    virtq_t vq;
+    blk_request_t req[VIRTIO_BLK_MAX_REQUESTS];
+    uint32_t nreq;                  /* Usable requests (ring may be smaller) */
+    uint32_t irq;
+    bool read_only;
+    tasklet_t tasklet;              /* Reaps after an interrupt */
+    virtio_blk_stats_t stats;
+} vblk = { .lock = SPINLOCK_INIT };
+
+static int vblk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf);
+static int vblk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf);
+static int vblk_submit(blkdev_t *dev, bio_t *bio);
+static void vblk_poll(blkdev_t *dev);
+
+static const blkdev_ops_t vblk_ops = {
+    .read = vblk_read,
+    .write = vblk_write,
+    .submit = vblk_submit,
+    .poll = vblk_poll,
+};
+
+static blkdev_t vblk_dev = {
+    .name = "vda",
+    .ops = &vblk_ops,
+};
+
+/**
+ * Read the capacity from config space, in sectors
+ */
+static uint64_t vblk_read_capacity(volatile uint32_t *mmio)
+{
+    uint32_t version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
+    uint32_t gen, lo, hi;
+
+    /* Two 32-bit reads; modern devices say whether it changed in between */
+    do {
+        gen = version == 1 ? 0 : virtio_mmio_read32(mmio, VIRTIO_MMIO_CONFIG_GENERATION);
+        lo = virtio_mmio_read32(mmio, VIRTIO_BLK_CFG_CAPACITY);
+        hi = virtio_mmio_read32(mmio, VIRTIO_BLK_CFG_CAPACITY + 4);
+    } while (version != 1 && gen != virtio_mmio_read32(mmio, VIRTIO_MMIO_CONFIG_GENERATION));
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* ============================================================================
+ * Request Queue
+ * ============================================================================ */
+
+/**
+ * Retire the requests the device has finished
+ * Caller holds vblk.lock.
+ * @return Their bios, in completion order, to finish once unlocked
+ */
+static bio_t *vblk_reap_locked(void)
+{
+    bio_t *head = NULL, **tail = &head;
+    blk_request_t *req;
+
+    while ((req = (blk_request_t *)virtq_get_used(&vblk.vq, NULL)) != NULL) {
+        TRACEPOINT(VIRTIO_COMPLETE, VIRTIO_ID_BLOCK, (uint32_t)(req - vblk.req));
+        if (req->status != VIRTIO_BLK_S_OK) {
+            klog_error("VirtIO block: %s of sector %llu failed (status %u)",
+                       req->hdr.type == VIRTIO_BLK_T_OUT ? "write" : "read",
+                       req->hdr.sector, req->status);
+            req->bio->status = -1;
+            vblk.stats.errors++;
+        }
+
+        *tail = req->bio;
+        tail = &req->bio->next;
+        req->bio = NULL;
+        vblk.stats.in_flight--;
+    }
+
+    *tail = NULL;
+    return head;
+}
+
+/**
+ * Finish reaped bios
+ */
+static void vblk_finish(bio_t *bio)
+{
+    bio_t *next;
+
+    while (bio != NULL) {
+        next = bio->next;
+        bio_complete(bio, bio->status);
+        bio = next;
+    }
+}
+
+/**
+ * Start a request
+ * Waits for one to finish when all of them are in flight.
+ */
+static int vblk_submit(blkdev_t *dev, bio_t *bio)
+{
+    blk_request_t *req;
+    virtq_buf_t bufs[BLK_REQ_DESCS];
+    uint64_t flags;
+    uint32_t i;
+
+    (void)dev;
+
+    if (bio->write && vblk.read_only) {
+        klog_error("VirtIO block: device is read-only");
+        return -1;
+    }
+
+    for (;;) {
+        flags = spin_lock_irqsave(&vblk.lock);
+        for (i = 0; i < vblk.nreq; i++) {
+            if (vblk.req[i].bio == NULL) {
+                break;
+            }
+        }
+        if (i < vblk.nreq) {
+            break;
+        }
+
+        /* Full: reap here too, the interrupt may be on another CPU */
+        bio_t *done = vblk_reap_locked();
+        spin_unlock_irqrestore(&vblk.lock, flags);
+        vblk_finish(done);
+        __asm__ volatile("yield");
+    }
+
+    req = &vblk.req[i];
+    req->bio = bio;
+    req->hdr.type = bio->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req->hdr.reserved = 0;
+    req->hdr.sector = bio->block << (BLK_SHIFT - VIRTIO_BLK_SECTOR_SHIFT);
+    req->status = 0xFF;
+
+    bufs[0].addr = (uint64_t)&req->hdr;
+    bufs[0].len = sizeof(virtio_blk_req_hdr_t);
+    bufs[0].write = false;
+    bufs[1].addr = (uint64_t)bio->buf;
+    bufs[1].len = bio->count * BLK_SIZE;
+    bufs[1].write = !bio->write;
+    bufs[2].addr = (uint64_t)&req->status;
+    bufs[2].len = 1;
+    bufs[2].write = true;
+
+    /* nreq never needs more descriptors than the ring has */
+    virtq_add(&vblk.vq, bufs, BLK_REQ_DESCS, req);
+    TRACEPOINT(VIRTIO_SUBMIT, VIRTIO_ID_BLOCK, i);
+
+    vblk.stats.requests++;
+    vblk.stats.blocks += bio->count;
+    if (++vblk.stats.in_flight > vblk.stats.max_in_flight) {
+        vblk.stats.max_in_flight = vblk.stats.in_flight;
+    }
+
+    /* A device still working through the ring will see it anyway */
+    if (virtq_kick(&vblk.vq)) {
+        vblk.stats.notifies++;
+    }
+
+    spin_unlock_irqrestore(&vblk.lock, flags);
+    return 0;
+}
+
+/**
+ * Reap without waiting for the interrupt
+ */
+static void vblk_poll(blkdev_t *dev)
+{
+    uint64_t flags;
+    bio_t *done;
+
+    (void)dev;
+
+    flags = spin_lock_irqsave(&vblk.lock);
+    done = vblk_reap_locked();
+    spin_unlock_irqrestore(&vblk.lock, flags);
+    vblk_finish(done);
+}
+
+/**
+ * Completion tasklet: finish completed requests
+ */
+static void vblk_tasklet(void *arg)
+{
+    uint64_t flags;
+    bio_t *done;
+
+    (void)arg;
+
+    flags = spin_lock_irqsave(&vblk.lock);
+    done = vblk_reap_locked();
+    vblk.stats.interrupts++;
+    spin_unlock_irqrestore(&vblk.lock, flags);
+
+    vblk_finish(done);
+}
+
+/**
+ * VirtIO block interrupt: acknowledge, and reap in the tasklet
+ */
+static void vblk_irq_handler(void)
+{
+    volatile uint32_t *mmio = vblk.vdev.mmio_base;
+    uint32_t isr;
+
+    /* Level-triggered: acknowledge before reaping so nothing is lost */
+    isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (isr) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_INTERRUPT_ACK, isr);
+    }
+
+    tasklet_schedule(&vblk.tasklet);
+}
+
+/* ============================================================================
+ * Synchronous Block Operations
+ * ============================================================================ */
+
+/**
+ * Transfer blocks as several requests in flight together
+ */
+static int vblk_rw(blkdev_t *dev, uint64_t block, uint32_t count, void *buf, bool write)
+{
+    bio_t bios[BLK_SYNC_BIOS];
+    uint8_t *p = (uint8_t *)buf;
+    uint32_t n, i, chunk;
+    int ret = 0;
+
+    while (count > 0 && ret == 0) {
+        memset(bios, 0, sizeof(bios));
+
+        for (n = 0; n < BLK_SYNC_BIOS && count > 0; n++) {
+            chunk = count < VIRTIO_BLK_SPLIT_BLOCKS ? count : VIRTIO_BLK_SPLIT_BLOCKS;
+            bios[n].dev = dev;
+            bios[n].block = block;
+            bios[n].count = chunk;
+            bios[n].buf = p;
+            bios[n].write = write;
+            if (blk_submit(&bios[n]) != 0) {
+                ret = -1;
+                break;
+            }
+            block += chunk;
+            count -= chunk;
+            p += (size_t)chunk * BLK_SIZE;
+        }
+
+        /* Everything submitted must finish before the bios go away */
+        for (i = 0; i < n; i++) {
+            if (blk_wait(&bios[i]) != 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int vblk_read(blkdev_t *dev, uint64_t block, uint32_t count, void *buf)
+{
+    return vblk_rw(dev, block, count, buf, false);
+}
+
+static int vblk_write(blkdev_t *dev, uint64_t block, uint32_t count, const void *buf)
+{
+    return vblk_rw(dev, block, count, (void *)buf, true);
+}
+
+/* ============================================================================
+ * VirtIO Block API
+ * ============================================================================ */
+
+/**
+ * Initialize the VirtIO block device
+ */
+int virtio_blk_init(void)
+{
+    volatile uint32_t *mmio;
+    uint32_t i;
+    uint64_t addr, capacity;
+
+    for (i = 0; i < VIRTIO_MMIO_COUNT; i++) {
+        addr = VIRTIO_MMIO_BASE + (i * VIRTIO_MMIO_SIZE);
+        if (virtio_init_device((void *)addr, &vblk.vdev) == 0 &&
+            vblk.vdev.device_id == VIRTIO_ID_BLOCK) {
+            break;
+        }
+    }
+    if (i == VIRTIO_MMIO_COUNT) {
+        klog_debug("VirtIO block device not found");
+        return -1;
+    }
+
+    vblk.irq = VIRTIO_MMIO_IRQ_BASE + i;
+    mmio = vblk.vdev.mmio_base;
+
+    /*
+     * Only what the driver uses. Without VIRTIO_BLK_F_FLUSH the device has
+     * to complete writes through to the medium, so no flush is needed.
+     */
+    if (virtio_negotiate(&vblk.vdev, VIRTIO_BLK_F_RO | VIRTIO_RING_F_INDIRECT_DESC |
+                                     VIRTIO_RING_F_EVENT_IDX) != 0) {
+        return -1;
+    }
+    vblk.read_only = (vblk.vdev.features & VIRTIO_BLK_F_RO) != 0;
+
+    if (virtq_init(&vblk.vq, &vblk.vdev, 0,
+                   (vblk.vdev.features & VIRTIO_RING_F_INDIRECT_DESC) ?
+                   VIRTIO_BLK_MAX_REQUESTS : BLK_VIRTQ_SIZE) != 0) {
+        return -1;
+    }
+    vblk.stats.indirect = vblk.vq.indirect;
+    vblk.nreq = vblk.vq.indirect ? vblk.vq.size : vblk.vq.size / BLK_REQ_DESCS;
+    if (vblk.nreq > VIRTIO_BLK_MAX_REQUESTS) {
+        vblk.nreq = VIRTIO_BLK_MAX_REQUESTS;
+    }
+    if (vblk.nreq == 0) {
+        klog_error("VirtIO block: queue too small");
+        return -1;
+    }
+
+    capacity = vblk_read_capacity(mmio);
+
+    /* Completions are reaped after the interrupt (SPIs are routed to CPU 0) */
+    tasklet_init(&vblk.tasklet, vblk_tasklet, NULL);
+    irq_register_handler(vblk.irq, vblk_irq_handler);
+    gic_enable_irq(vblk.irq);
+
+    virtio_driver_ok(&vblk.vdev);
+    vblk.vdev.initialized = true;
+
+    kprintf("  [INFO] VirtIO block device: slot %u, %llu MB%s, %u requests in flight%s\n",
+            i, capacity >> (20 - VIRTIO_BLK_SECTOR_SHIFT), vblk.read_only ? " (read-only)" : "",
+            vblk.nreq, vblk.stats.indirect ? " (indirect)" : "");
+
+    vblk_dev.num_blocks = capacity >> (BLK_SHIFT - VIRTIO_BLK_SECTOR_SHIFT);
+    return blkdev_register(&vblk_dev);
+}
+
+/**
+ * Get virtio-blk statistics
+ */
+void virtio_blk_get_stats(virtio_blk_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&vblk.lock);
+    *stats = vblk.stats;
+    spin_unlock_irqrestore(&vblk.lock, flags);
+}
+
+/* ============================================================================
+ * End of virtio_blk.c
+ * ============================================================================ */
@@ -5,275 +5,474 @@
  * ============================================================================ */
 
 #include <aeos/virtio_gpu.h>
+#include <aeos/virtq.h>
 #include <aeos/framebuffer.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
 #include <aeos/heap.h>
-
-/* Virtqueue configuration */
-#define VIRTQ_SIZE 64  /* Queue size (must be power of 2) */
-
-/* Virtqueue structure */
-typedef struct {
-    virtq_desc_t *desc;      /* Descriptor table */
-    virtq_avail_t *avail;    /* Available ring */
-    virtq_used_t *used;      /* Used ring */
-    uint16_t last_used_idx;  /* Last processed used index */
-    uint16_t num_free;       /* Number of free descriptors */
-    uint16_t free_head;      /* First free descriptor */
-} virtqueue_t;
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/timer.h>
+#include <aeos/spinlock.h>
+#include <aeos/softirq.h>
+#include <aeos/wait.h>
+#include <aeos/trace.h>
+#include <aeos/dma.h>
 
 /* Global virtio-gpu device */
 static virtio_gpu_t gpu_dev;
 
+/* Reaps completions after an interrupt */
+static tasklet_t gpu_tasklet;
+
+/* Ring size asked for */
+#define GPU_VIRTQ_SIZE 64
+
+/* Descriptors of a control request without indirect tables */
+#define GPU_REQ_DESCS 2
+
 /* Control virtqueue (queue 0) */
-static virtqueue_t ctrl_vq;
+static virtq_t ctrl_vq;
+
+/* How long a command may take before it is given up on */
+#define GPU_CMD_TIMEOUT_MS 1000
+
+/* Longest a waiter sleeps before reaping for itself (a lost or late IRQ) */
+#define GPU_WAIT_SLICE_NS 2000000ULL
+
+/*
+ * A control queue request: a chain of the command (device-readable) and
+ * its response (device-writable), with the request as its token.
+ */
+typedef struct {
+    union {
+        virtio_gpu_ctrl_hdr_t hdr;
+        virtio_gpu_resource_create_2d_t create;
+        virtio_gpu_set_scanout_t scanout;
+        virtio_gpu_transfer_to_host_2d_t transfer;
+        virtio_gpu_resource_flush_t flush;
+        virtio_gpu_resource_unref_t unref;
+        virtio_gpu_get_edid_t get_edid;
+        struct {
+            virtio_gpu_resource_attach_backing_t hdr;
+            virtio_gpu_mem_entry_t mem;
+        } __attribute__((packed)) attach;
+    } cmd;
+    virtio_gpu_ctrl_hdr_t resp;
+    virtio_gpu_ctrl_hdr_t *reply;   /* Where the response goes: resp, or a
+                                       larger buffer for queries */
+    uint64_t fence_id;              /* 0 when the request is free */
+} gpu_request_t;
+
+/* Control queue state */
+static struct {
+    spinlock_t lock;
+    gpu_request_t req[VIRTIO_GPU_MAX_REQUESTS];
+    uint32_t in_flight;
+    uint64_t next_fence;
+    uint64_t error_fence;           /* Last fence whose command failed */
+    uint64_t frame_fence;           /* Last fence of the previous display update */
+    wait_queue_t waiters;           /* Processes waiting on a fence */
+    bool irq_ready;                 /* Completions wake the waiters */
+} ctrl = { .lock = SPINLOCK_INIT, .next_fence = 1, .waiters = WAIT_QUEUE_INIT };
+
+/* Cursor virtqueue (queue 1) */
+static virtq_t cursor_vq;
+
+/*
+ * Cursor queue state. Commands get no response, so slot i is a single
+ * device-readable buffer, free again once the device uses it.
+ */
+static struct {
+    spinlock_t lock;
+    virtio_gpu_update_cursor_t cmd[VIRTIO_GPU_CURSOR_SLOTS];
+    bool busy[VIRTIO_GPU_CURSOR_SLOTS];
+    uint32_t slots;                 /* Usable slots (ring may be smaller) */
+    uint32_t *image;                /* Backing store of the cursor resource */
+    uint32_t resource_id;           /* 0 until an image is defined */
+    uint32_t hot_x, hot_y;
+    int32_t x, y;                   /* Last position sent */
+    bool shown;                     /* Image on the cursor plane */
+    bool ready;                     /* Queue 1 is set up */
+} cursor = { .lock = SPINLOCK_INIT };
+
+/* Host resources backing the framebuffer's buffers */
+static struct {
+    uint32_t resource[2];           /* 0 if the buffer has none */
+    rect_t stale[2][VIRTIO_GPU_MAX_UPDATE_RECTS];   /* Not yet transferred */
+    uint32_t stale_count[2];
+    volatile bool mode_pending;     /* The device reported a mode change */
+    void (*mode_notify)(void);      /* Called from the interrupt when it does */
+} display;
+
+/*
+ * Query responses. Queries run one at a time (at boot, then from the
+ * window manager), so one buffer of each kind does.
+ */
+static virtio_gpu_resp_display_info_t display_info;
+static virtio_gpu_resp_edid_t edid_info;
 
 /**
- * Initialize a virtqueue
+ * Retire the requests the device has finished
+ * Caller holds ctrl.lock.
  */
-static int virtqueue_init(virtqueue_t *vq, volatile uint32_t *mmio, uint32_t queue_idx)
+static void gpu_reap_locked(void)
 {
-    uint32_t queue_size;
-    size_t desc_size, avail_size, used_size;
-    uint8_t *queue_mem;
-    uint64_t desc_addr, avail_addr, used_addr;
-    uint32_t i;
-
-    /* Select queue */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_SEL, queue_idx);
+    gpu_request_t *req;
+
+    while ((req = (gpu_request_t *)virtq_get_used(&ctrl_vq, NULL)) != NULL) {
+        TRACEPOINT(VIRTIO_COMPLETE, VIRTIO_ID_GPU, (uint32_t)(req - ctrl.req));
+        if (req->reply->type < VIRTIO_GPU_RESP_OK_NODATA ||
+            req->reply->type >= VIRTIO_GPU_RESP_ERR_UNSPEC) {
+            klog_error("GPU command 0x%x failed (response 0x%x)",
+                       req->cmd.hdr.type, req->reply->type);
+            ctrl.error_fence = req->fence_id;
+            gpu_dev.errors++;
+        }
 
-    /* Get maximum queue size */
-    queue_size = virtio_mmio_read32(mmio, VIRTIO_MMIO_QUEUE_NUM_MAX);
-    if (queue_size == 0) {
-        klog_error("Queue %u not available", queue_idx);
-        return -1;
+        req->fence_id = 0;
+        ctrl.in_flight--;
     }
+}
 
-    if (queue_size > VIRTQ_SIZE) {
-        queue_size = VIRTQ_SIZE;
+/**
+ * Make queued requests visible to the device with a single notification
+ * Caller holds ctrl.lock.
+ */
+static void gpu_kick_locked(void)
+{
+    if (virtq_kick(&ctrl_vq)) {
+        gpu_dev.notifies++;
     }
+}
 
-    /* Calculate sizes */
-    desc_size = sizeof(virtq_desc_t) * queue_size;
-    avail_size = sizeof(uint16_t) * (3 + queue_size);
-    used_size = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * queue_size;
-
-    /* For legacy VirtIO, used ring must be page-aligned after avail ring */
-    /* Calculate offset for used ring (page-aligned) */
-    size_t avail_offset = desc_size;
-    size_t used_offset = (desc_size + avail_size + 4095) & ~4095ULL;  /* Page-align used ring */
+/**
+ * Check whether every request up to a fence has completed
+ * Caller holds ctrl.lock.
+ */
+static bool gpu_fence_done_locked(uint64_t fence)
+{
+    uint32_t i;
 
-    /* Allocate memory (must be page-aligned for legacy v1) */
-    size_t total_size = used_offset + used_size + 8192;  /* Extra for alignment */
-    uint8_t *raw_mem = (uint8_t *)kmalloc(total_size);
-    if (!raw_mem) {
-        klog_error("Failed to allocate queue memory");
-        return -1;
+    for (i = 0; i < VIRTIO_GPU_MAX_REQUESTS; i++) {
+        if (ctrl.req[i].fence_id != 0 && ctrl.req[i].fence_id <= fence) {
+            return false;
+        }
     }
 
-    /* Align to 4KB page boundary (required for legacy VirtIO v1) */
-    uint64_t addr = (uint64_t)raw_mem;
-    uint64_t aligned_addr = (addr + 4095) & ~4095ULL;  /* Round up to next 4KB */
-    queue_mem = (uint8_t *)aligned_addr;
+    return true;
+}
+
+/**
+ * Wait for every request up to a fence to complete
+ * Completions are normally reaped by the completion tasklet, which wakes
+ * the waiters; until the interrupt is set up the waiter spins. The waiter
+ * reaps too, so a late or lost interrupt only costs a sleep slice.
+ * @return 0 on success, -1 on timeout
+ */
+static int gpu_wait_fence(uint64_t fence)
+{
+    uint64_t deadline = timer_get_ns() + GPU_CMD_TIMEOUT_MS * 1000000ULL;
+    waiter_t w = WAITER_INIT;
+    uint64_t flags, now, until;
+    bool done;
+
+    for (;;) {
+        wait_prepare(&ctrl.waiters, &w);
 
-    /* Clear queue memory */
-    memset(queue_mem, 0, used_offset + used_size);
+        flags = spin_lock_irqsave(&ctrl.lock);
+        gpu_reap_locked();
+        done = gpu_fence_done_locked(fence);
+        spin_unlock_irqrestore(&ctrl.lock, flags);
 
-    /* Set up descriptor table */
-    vq->desc = (virtq_desc_t *)queue_mem;
-    vq->avail = (virtq_avail_t *)(queue_mem + avail_offset);
-    vq->used = (virtq_used_t *)(queue_mem + used_offset);  /* Page-aligned for legacy */
+        if (done) {
+            break;
+        }
 
-    klog_debug("  Queue layout: desc=%p avail=%p used=%p",
-              vq->desc, vq->avail, vq->used);
+        now = timer_get_ns();
+        if (now >= deadline) {
+            wait_finish(&ctrl.waiters, &w);
+            /* The requests stay owned: the device may still write them */
+            klog_error("GPU command timeout! fence=%llu avail=%u last_used=%u",
+                       fence, ctrl_vq.avail_idx, ctrl_vq.last_used_idx);
+            return -1;
+        }
 
-    /* Initialize free list */
-    vq->num_free = queue_size;
-    vq->free_head = 0;
-    vq->last_used_idx = 0;
+        if (!ctrl.irq_ready) {
+            __asm__ volatile("yield");
+            continue;
+        }
 
-    for (i = 0; i < queue_size - 1; i++) {
-        vq->desc[i].next = i + 1;
+        until = now + GPU_WAIT_SLICE_NS;
+        wait_sleep(&w, until < deadline ? until : deadline);
     }
-    vq->desc[queue_size - 1].next = 0;
 
-    /* Get physical addresses (we're using identity mapping) */
-    desc_addr = (uint64_t)vq->desc;
-    avail_addr = (uint64_t)vq->avail;
-    used_addr = (uint64_t)vq->used;
+    wait_finish(&ctrl.waiters, &w);
+    return 0;
+}
 
-    /* Check device version for correct initialization */
-    uint32_t version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
+/**
+ * Queue a command on the control virtqueue without notifying the device
+ * Waits for the oldest request when all of them are in flight.
+ * @param cmd Command buffer (copied)
+ * @param cmd_len Command length
+ * @param reply Buffer for a response larger than a header, or NULL
+ * @param reply_len Its length
+ * @return fence ID of the request, 0 on error
+ */
+static uint64_t gpu_queue_cmd_reply(const void *cmd, size_t cmd_len,
+                                    void *reply, uint32_t reply_len)
+{
+    gpu_request_t *req;
+    virtq_buf_t bufs[GPU_REQ_DESCS];
+    uint64_t flags, oldest, fence;
+    uint32_t i;
 
-    /* Configure queue in device */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NUM, queue_size);
-    klog_debug("  Queue %u: size=%u, version=%u", queue_idx, queue_size, version);
+    if (!gpu_dev.initialized || cmd_len > sizeof(ctrl.req[0].cmd)) {
+        return 0;
+    }
 
-    if (version == 1) {
-        /* Legacy VirtIO v1: Use QUEUE_ALIGN and QUEUE_PFN */
-        klog_debug("  Using legacy queue initialization (v1)");
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_ALIGN, 4096);  /* Page size */
+    flags = spin_lock_irqsave(&ctrl.lock);
+    for (;;) {
+        gpu_reap_locked();
+
+        req = NULL;
+        oldest = 0;
+        for (i = 0; i < VIRTIO_GPU_MAX_REQUESTS; i++) {
+            if (ctrl.req[i].fence_id == 0) {
+                if (req == NULL) {
+                    req = &ctrl.req[i];
+                }
+            } else if (oldest == 0 || ctrl.req[i].fence_id < oldest) {
+                oldest = ctrl.req[i].fence_id;
+            }
+        }
+        /* A small ring may run out of descriptors before requests */
+        if (req && ctrl_vq.num_free >= GPU_REQ_DESCS) {
+            break;
+        }
+        if (oldest == 0) {
+            spin_unlock_irqrestore(&ctrl.lock, flags);
+            return 0;
+        }
 
-        /* Calculate page frame number (descriptor table address / page size) */
-        uint32_t pfn = (uint32_t)(desc_addr >> 12);  /* Divide by 4096 */
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_PFN, pfn);
+        /* Queue full: post what is queued and wait for the oldest request */
+        gpu_kick_locked();
+        spin_unlock_irqrestore(&ctrl.lock, flags);
+        if (gpu_wait_fence(oldest) != 0) {
+            return 0;
+        }
+        flags = spin_lock_irqsave(&ctrl.lock);
+    }
 
-        klog_debug("  Queue PFN=0x%x (desc_addr=0x%p)", pfn, (void*)desc_addr);
-    } else {
-        /* Modern VirtIO v2: Use separate descriptor/avail/used addresses */
-        klog_debug("  Using modern queue initialization (v2)");
-        klog_debug("  desc=0x%x avail=0x%x used=0x%x",
-                  (uint32_t)desc_addr, (uint32_t)avail_addr, (uint32_t)used_addr);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_LOW, (uint32_t)(desc_addr & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_HIGH, (uint32_t)(desc_addr >> 32));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_LOW, (uint32_t)(avail_addr & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (uint32_t)(avail_addr >> 32));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_LOW, (uint32_t)(used_addr & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_HIGH, (uint32_t)(used_addr >> 32));
+    /* Fenced, so the response carries the fence ID back */
+    fence = ctrl.next_fence++;
+    memcpy(&req->cmd, cmd, cmd_len);
+    req->cmd.hdr.flags |= VIRTIO_GPU_FLAG_FENCE;
+    req->cmd.hdr.fence_id = fence;
+    if (reply == NULL) {
+        reply = &req->resp;
+        reply_len = sizeof(req->resp);
+    }
+    memset(reply, 0, reply_len);
+    req->reply = (virtio_gpu_ctrl_hdr_t *)reply;
+    req->fence_id = fence;
+
+    bufs[0].addr = (uint64_t)&req->cmd;
+    bufs[0].len = (uint32_t)cmd_len;
+    bufs[0].write = false;
+    bufs[1].addr = (uint64_t)reply;
+    bufs[1].len = reply_len;
+    bufs[1].write = true;
+    virtq_add(&ctrl_vq, bufs, GPU_REQ_DESCS, req);
+    ctrl.in_flight++;
+    gpu_dev.commands++;
+    TRACEPOINT(VIRTIO_SUBMIT, VIRTIO_ID_GPU, (uint32_t)(req - ctrl.req));
+
+    spin_unlock_irqrestore(&ctrl.lock, flags);
+    return fence;
+}
 
-        /* Memory barrier before marking queue ready */
-        __asm__ volatile("dmb sy" ::: "memory");
+/**
+ * Queue a command whose response is just a header
+ */
+static uint64_t gpu_queue_cmd(const void *cmd, size_t cmd_len)
+{
+    return gpu_queue_cmd_reply(cmd, cmd_len, NULL, 0);
+}
 
-        /* Mark queue as ready */
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_READY, 1);
+/**
+ * Notify the device and wait for a queued command to complete
+ * @param fence Fence returned by gpu_queue_cmd() (0 = queueing failed)
+ * @return 0 on success, -1 on error
+ */
+static int gpu_complete(uint64_t fence)
+{
+    uint64_t flags;
 
-        /* Verify queue is ready (use (void) to suppress unused warning in release builds) */
-        uint32_t ready = virtio_mmio_read32(mmio, VIRTIO_MMIO_QUEUE_READY);
-        (void)ready;
-        klog_debug("  Queue ready: %u", ready);
+    if (fence == 0) {
+        return -1;
     }
 
-    /* Verify queue is ready */
-    uint32_t queue_ready = (version == 1) ? 1 : virtio_mmio_read32(mmio, VIRTIO_MMIO_QUEUE_READY);
-    (void)queue_ready;  /* Used only in debug output */
-    klog_debug("Virtqueue %u initialized (size=%u, ready=%u)", queue_idx, queue_size, queue_ready);
+    flags = spin_lock_irqsave(&ctrl.lock);
+    gpu_kick_locked();
+    spin_unlock_irqrestore(&ctrl.lock, flags);
 
-    /* Debug: Show queue configuration */
-    klog_debug("  desc=0x%p avail=0x%p used=0x%p", vq->desc, vq->avail, vq->used);
+    if (gpu_wait_fence(fence) != 0) {
+        return -1;
+    }
 
-    return 0;
+    return (ctrl.error_fence == fence) ? -1 : 0;
 }
 
 /**
- * Submit a command to the control virtqueue
- * @param cmd Command buffer (read-only)
+ * Submit a command to the control virtqueue and wait for it
+ * @param cmd Command buffer (copied)
  * @param cmd_len Command length
- * @param resp Response buffer (write-only)
- * @param resp_len Response length
  * @return 0 on success, -1 on error
  */
-static int virtio_gpu_submit_cmd(void *cmd, size_t cmd_len, void *resp, size_t resp_len)
+static int virtio_gpu_submit_cmd(const void *cmd, size_t cmd_len)
 {
-    volatile uint32_t *mmio = gpu_dev.vdev.mmio_base;
-    uint16_t cmd_desc, resp_desc;
-    uint16_t old_avail_idx;
+    return gpu_complete(gpu_queue_cmd(cmd, cmd_len));
+}
 
-    if (!gpu_dev.initialized || ctrl_vq.num_free < 2) {
-        return -1;
+/**
+ * Free the cursor slots the device has consumed
+ * Caller holds cursor.lock.
+ */
+static void gpu_cursor_reap_locked(void)
+{
+    virtio_gpu_update_cursor_t *cmd;
+
+    while ((cmd = (virtio_gpu_update_cursor_t *)virtq_get_used(&cursor_vq, NULL)) != NULL) {
+        cursor.busy[cmd - cursor.cmd] = false;
     }
+}
+
+/**
+ * Post a command on the cursor queue
+ * The device answers nothing, so this returns once the command is on the
+ * ring. Waits for a free slot when all of them are in flight.
+ * @return 0 on success, -1 on timeout
+ */
+static int gpu_cursor_cmd(uint32_t type, uint32_t resource_id, int32_t x, int32_t y)
+{
+    virtio_gpu_update_cursor_t *cmd = NULL;
+    virtq_buf_t buf;
+    uint64_t start = timer_get_counter();
+    uint64_t timeout = (uint64_t)timer_get_frequency() * GPU_CMD_TIMEOUT_MS / 1000;
+    uint64_t flags;
+    uint32_t i;
+
+    for (;;) {
+        flags = spin_lock_irqsave(&cursor.lock);
+        gpu_cursor_reap_locked();
+        for (i = 0; i < cursor.slots; i++) {
+            if (!cursor.busy[i]) {
+                cmd = &cursor.cmd[i];
+                break;
+            }
+        }
+        if (cmd) {
+            break;
+        }
+        spin_unlock_irqrestore(&cursor.lock, flags);
 
-    /* Allocate descriptor for command */
-    cmd_desc = ctrl_vq.free_head;
-    ctrl_vq.free_head = ctrl_vq.desc[cmd_desc].next;
-    ctrl_vq.num_free--;
-
-    /* Allocate descriptor for response */
-    resp_desc = ctrl_vq.free_head;
-    ctrl_vq.free_head = ctrl_vq.desc[resp_desc].next;
-    ctrl_vq.num_free--;
-
-    /* Set up command descriptor (device reads from this) */
-    ctrl_vq.desc[cmd_desc].addr = (uint64_t)cmd;
-    ctrl_vq.desc[cmd_desc].len = cmd_len;
-    ctrl_vq.desc[cmd_desc].flags = VIRTQ_DESC_F_NEXT;
-    ctrl_vq.desc[cmd_desc].next = resp_desc;
-
-    /* Set up response descriptor (device writes to this) */
-    ctrl_vq.desc[resp_desc].addr = (uint64_t)resp;
-    ctrl_vq.desc[resp_desc].len = resp_len;
-    ctrl_vq.desc[resp_desc].flags = VIRTQ_DESC_F_WRITE;
-    ctrl_vq.desc[resp_desc].next = 0;
-
-    /* Add to available ring */
-    old_avail_idx = ctrl_vq.avail->idx;
-    ctrl_vq.avail->ring[old_avail_idx % VIRTQ_SIZE] = cmd_desc;
-
-    /* Memory barrier - ensure all memory writes are visible */
-    __asm__ volatile("dmb ish" ::: "memory");
-    __asm__ volatile("dsb ish" ::: "memory");
-
-    ctrl_vq.avail->idx = old_avail_idx + 1;
-
-    /* Another barrier after updating avail idx */
-    __asm__ volatile("dmb ish" ::: "memory");
-    __asm__ volatile("dsb ish" ::: "memory");
-
-    /* Notify device (write to queue notify register) */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
-
-    /* Wait for response (with timeout to prevent infinite hang) */
-    uint32_t timeout = 1000000;  /* ~1 second timeout */
-    while (ctrl_vq.used->idx == ctrl_vq.last_used_idx) {
-        if (--timeout == 0) {
-            /* Check interrupt status to see if device tried to signal */
-            uint32_t isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
-            klog_error("GPU command timeout! used->idx=%u last_used=%u isr=0x%x",
-                       ctrl_vq.used->idx, ctrl_vq.last_used_idx, isr);
-            /* Return descriptors to free list */
-            ctrl_vq.desc[resp_desc].next = ctrl_vq.free_head;
-            ctrl_vq.free_head = cmd_desc;
-            ctrl_vq.num_free += 2;
+        if (timer_get_counter() - start > timeout) {
+            klog_error("GPU cursor queue timeout");
             return -1;
         }
-        /* Memory barrier before reading used ring */
-        __asm__ volatile("dmb ish" ::: "memory");
+        __asm__ volatile("yield");
     }
 
-    /* Process completion and free descriptors */
-    ctrl_vq.last_used_idx++;
+    /* Off-screen positions are clamped: the fields are unsigned */
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->hdr.type = type;
+    cmd->pos.scanout_id = 0;
+    cmd->pos.x = (x > 0) ? (uint32_t)x : 0;
+    cmd->pos.y = (y > 0) ? (uint32_t)y : 0;
+    cmd->resource_id = resource_id;
+    cmd->hot_x = cursor.hot_x;
+    cmd->hot_y = cursor.hot_y;
+    cursor.busy[i] = true;
+
+    /* A slot per ring descriptor, so this always fits */
+    buf.addr = (uint64_t)cmd;
+    buf.len = sizeof(*cmd);
+    buf.write = false;
+    virtq_add(&cursor_vq, &buf, 1, cmd);
+    virtq_kick(&cursor_vq);
+
+    gpu_dev.cursor_moves++;
+    spin_unlock_irqrestore(&cursor.lock, flags);
+    return 0;
+}
 
-    /* Return descriptors to free list */
-    ctrl_vq.desc[resp_desc].next = ctrl_vq.free_head;
-    ctrl_vq.free_head = cmd_desc;
-    ctrl_vq.num_free += 2;
+/**
+ * Set up the cursor queue (queue 1)
+ * Called before DRIVER_OK. Without it the cursor stays in software.
+ */
+static void gpu_cursor_queue_init(void)
+{
+    if (virtq_init(&cursor_vq, &gpu_dev.vdev, 1, VIRTIO_GPU_CURSOR_SLOTS) != 0) {
+        klog_warn("GPU: no cursor queue, using a software cursor");
+        return;
+    }
 
-    return 0;
+    cursor.slots = cursor_vq.size;
+    cursor.ready = true;
 }
 
 /**
- * Initialize VirtIO device (generic)
+ * Completion tasklet: reap completed requests
  */
-int virtio_init_device(volatile void *base, virtio_device_t *dev)
+static void gpu_complete_tasklet(void *arg)
 {
-    volatile uint32_t *mmio = (volatile uint32_t *)base;
+    uint64_t flags;
 
-    /* Check magic number */
-    uint32_t magic = virtio_mmio_read32(mmio, VIRTIO_MMIO_MAGIC);
-    if (magic != 0x74726976) {  /* 'virt' in little-endian */
-        klog_error("Invalid VirtIO magic: 0x%x", magic);
-        return -1;
-    }
+    (void)arg;
 
-    /* Check version (accept both legacy v1 and modern v2) */
-    uint32_t version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
-    if (version != 1 && version != 2) {
-        klog_error("Unsupported VirtIO version: %u (expected 1 or 2)", version);
-        return -1;
+    flags = spin_lock_irqsave(&ctrl.lock);
+    gpu_reap_locked();
+    spin_unlock_irqrestore(&ctrl.lock, flags);
+    wake_up_all(&ctrl.waiters);
+
+    if (cursor.ready) {
+        flags = spin_lock_irqsave(&cursor.lock);
+        gpu_cursor_reap_locked();
+        spin_unlock_irqrestore(&cursor.lock, flags);
     }
+}
+
+/**
+ * VirtIO GPU interrupt: acknowledge, and reap in the tasklet
+ */
+static void virtio_gpu_irq_handler(void)
+{
+    volatile uint32_t *mmio = gpu_dev.vdev.mmio_base;
+    uint32_t isr, events;
 
-    /* Read device ID */
-    dev->device_id = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_ID);
-    dev->vendor_id = virtio_mmio_read32(mmio, VIRTIO_MMIO_VENDOR_ID);
-    dev->mmio_base = mmio;
-    dev->initialized = false;
+    /* Level-triggered: acknowledge before reaping so nothing is lost */
+    isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (isr) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_INTERRUPT_ACK, isr);
+    }
 
-    klog_debug("VirtIO device found:");
-    klog_debug("  Type: %u", dev->device_id);
-    klog_debug("  Vendor: 0x%x", dev->vendor_id);
-    klog_debug("  Version: %u", version);
+    /* Display modes changed (host window resized): the loop resizes */
+    if (isr & VIRTIO_MMIO_INT_CONFIG) {
+        events = virtio_mmio_read32(mmio, VIRTIO_GPU_CFG_EVENTS_READ);
+        if (events & VIRTIO_GPU_EVENT_DISPLAY) {
+            virtio_mmio_write32(mmio, VIRTIO_GPU_CFG_EVENTS_CLEAR,
+                                VIRTIO_GPU_EVENT_DISPLAY);
+            display.mode_pending = true;
+            if (display.mode_notify) {
+                display.mode_notify();
+            }
+        }
+    }
 
-    return 0;
+    tasklet_schedule(&gpu_tasklet);
+    gpu_dev.interrupts++;
 }
 
 /**
@@ -298,6 +497,7 @@ int virtio_gpu_init(void)
         /* Check if this is a GPU device */
         if (gpu_dev.vdev.device_id == VIRTIO_ID_GPU) {
             klog_info("VirtIO GPU device found at slot %u (0x%x)", i, (uint32_t)addr);
+            gpu_dev.irq = VIRTIO_MMIO_IRQ_BASE + i;
             goto found_gpu;
         }
 
@@ -310,79 +510,39 @@ int virtio_gpu_init(void)
 
 found_gpu:
 
-    volatile uint32_t *mmio = gpu_dev.vdev.mmio_base;
-
-    /* Reset device */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, 0);
-
-    /* Set ACKNOWLEDGE status */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
-
-    /* Set DRIVER status */
-    uint32_t status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER);
-
-    /* Read device features using selector register */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);  /* Select low 32 bits */
-    uint32_t features_lo = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_FEATURES);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);  /* Select high 32 bits */
-    uint32_t features_hi = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_FEATURES);
-
-    gpu_dev.vdev.features = ((uint64_t)features_hi << 32) | features_lo;
-    klog_debug("Device features: 0x%x%x", features_hi, features_lo);
-
-    /* Check device version */
-    uint32_t dev_version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
-
-    /* For version 1 (legacy), feature negotiation is optional */
-    /* For version 2 (modern), we MUST negotiate VIRTIO_F_VERSION_1 */
-    if (dev_version == 1) {
-        /* Legacy device - must set guest page size first */
-        klog_debug("Using legacy VirtIO (version 1)");
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_GUEST_PAGE_SIZE, 4096);
-    } else {
-        /* Modern device - write driver features */
-        /* We must accept VIRTIO_F_VERSION_1 (bit 32) */
-        klog_debug("Using modern VirtIO (version 2)");
-
-        /* Write low 32 bits of features (accept all device features) */
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, features_lo);
-
-        /* Write high 32 bits - MUST include VERSION_1 (bit 0 of high word = bit 32) */
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, features_hi | 1);  /* Bit 32 = VERSION_1 */
-    }
-
-    /* Set FEATURES_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_FEATURES_OK);
-
-    /* Verify FEATURES_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    if (!(status & VIRTIO_STATUS_FEATURES_OK)) {
-        klog_error("Device did not accept our features");
+    /* EDID for the display's preferred mode; VIRGL (3D) is not used */
+    if (virtio_negotiate(&gpu_dev.vdev, (1U << VIRTIO_GPU_F_EDID) |
+                                        VIRTIO_RING_F_EVENT_IDX |
+                                        VIRTIO_RING_F_INDIRECT_DESC) != 0) {
         return -1;
     }
 
     /* Initialize control virtqueue (queue 0) */
-    if (virtqueue_init(&ctrl_vq, mmio, 0) != 0) {
+    if (virtq_init(&ctrl_vq, &gpu_dev.vdev, 0, GPU_VIRTQ_SIZE) != 0) {
         klog_error("Failed to initialize control virtqueue");
         return -1;
     }
 
-    /* Set DRIVER_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+    /* Initialize cursor virtqueue (queue 1, optional) */
+    gpu_cursor_queue_init();
+
+    virtio_driver_ok(&gpu_dev.vdev);
 
     gpu_dev.initialized = true;
     gpu_dev.num_scanouts = 1;  /* Assume 1 display for now */
     gpu_dev.resource_id = 1;   /* Start resource IDs at 1 */
     gpu_dev.display_resource_id = 0;  /* Display not yet set up */
 
-    /* Verify device status */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    klog_debug("Final device status: 0x%x", status);
+    /* The window manager moves a hardware cursor through these */
+    if (cursor.ready) {
+        fb_set_cursor_handlers(virtio_gpu_define_cursor, virtio_gpu_move_cursor);
+    }
+
+    /* Completions are reaped after the interrupt (SPIs are routed to CPU 0) */
+    tasklet_init(&gpu_tasklet, gpu_complete_tasklet, NULL);
+    irq_register_handler(gpu_dev.irq, virtio_gpu_irq_handler);
+    gic_enable_irq(gpu_dev.irq);
+    ctrl.irq_ready = true;
 
     klog_info("VirtIO GPU initialized successfully!");
 
@@ -395,7 +555,6 @@ found_gpu:
 uint32_t virtio_gpu_create_resource(uint32_t width, uint32_t height, uint32_t format)
 {
     virtio_gpu_resource_create_2d_t cmd;
-    virtio_gpu_ctrl_hdr_t resp;
     uint32_t resource_id;
 
     if (!gpu_dev.initialized) {
@@ -416,8 +575,7 @@ uint32_t virtio_gpu_create_resource(uint32_t width, uint32_t height, uint32_t fo
                cmd.hdr.type, resource_id, width, height, format);
 
     /* Submit command */
-    memset(&resp, 0, sizeof(resp));
-    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd), &resp, sizeof(resp)) != 0) {
+    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd)) != 0) {
         klog_error("Failed to create resource");
         return 0;
     }
@@ -427,17 +585,13 @@ uint32_t virtio_gpu_create_resource(uint32_t width, uint32_t height, uint32_t fo
 }
 
 /**
- * Set scanout
+ * Queue a scanout change
+ * @return fence ID, 0 on error
  */
-int virtio_gpu_set_scanout(uint32_t scanout_id, uint32_t resource_id,
-                            uint32_t width, uint32_t height)
+static uint64_t gpu_queue_scanout(uint32_t scanout_id, uint32_t resource_id,
+                                  uint32_t width, uint32_t height)
 {
     virtio_gpu_set_scanout_t cmd;
-    virtio_gpu_ctrl_hdr_t resp;
-
-    if (!gpu_dev.initialized) {
-        return -1;
-    }
 
     /* Prepare command */
     memset(&cmd, 0, sizeof(cmd));
@@ -449,9 +603,20 @@ int virtio_gpu_set_scanout(uint32_t scanout_id, uint32_t resource_id,
     cmd.r.width = width;
     cmd.r.height = height;
 
-    /* Submit command */
-    memset(&resp, 0, sizeof(resp));
-    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd), &resp, sizeof(resp)) != 0) {
+    return gpu_queue_cmd(&cmd, sizeof(cmd));
+}
+
+/**
+ * Set scanout
+ */
+int virtio_gpu_set_scanout(uint32_t scanout_id, uint32_t resource_id,
+                            uint32_t width, uint32_t height)
+{
+    if (!gpu_dev.initialized) {
+        return -1;
+    }
+
+    if (gpu_complete(gpu_queue_scanout(scanout_id, resource_id, width, height)) != 0) {
         klog_error("Failed to set scanout");
         return -1;
     }
@@ -461,31 +626,66 @@ int virtio_gpu_set_scanout(uint32_t scanout_id, uint32_t resource_id,
 }
 
 /**
- * Transfer to host
+ * Queue a transfer of a rect of the backing store to the host resource
+ * @return fence ID, 0 on error
  */
-int virtio_gpu_transfer_to_host(uint32_t resource_id, uint32_t x, uint32_t y,
-                                  uint32_t width, uint32_t height)
+static uint64_t gpu_queue_transfer(uint32_t resource_id, uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height)
 {
     virtio_gpu_transfer_to_host_2d_t cmd;
-    virtio_gpu_ctrl_hdr_t resp;
+    fb_info_t *fb = fb_get_info();
+    uint64_t fence;
 
-    if (!gpu_dev.initialized) {
-        return -1;
+    /* Prepare command */
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+    cmd.r.x = x;
+    cmd.r.y = y;
+    cmd.r.width = width;
+    cmd.r.height = height;
+    /* Byte offset of the rect's first pixel in the backing store */
+    cmd.offset = (uint64_t)y * fb->pitch + (uint64_t)x * (fb->bpp / 8);
+    cmd.resource_id = resource_id;
+
+    fence = gpu_queue_cmd(&cmd, sizeof(cmd));
+    if (fence != 0) {
+        gpu_dev.pixels_transferred += (uint64_t)width * height;
     }
+    return fence;
+}
+
+/**
+ * Queue a flush of a rect of the host resource to the display
+ * @return fence ID, 0 on error
+ */
+static uint64_t gpu_queue_flush(uint32_t resource_id, uint32_t x, uint32_t y,
+                                uint32_t width, uint32_t height)
+{
+    virtio_gpu_resource_flush_t cmd;
 
     /* Prepare command */
     memset(&cmd, 0, sizeof(cmd));
-    cmd.hdr.type = VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D;
+    cmd.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
     cmd.r.x = x;
     cmd.r.y = y;
     cmd.r.width = width;
     cmd.r.height = height;
-    cmd.offset = 0;
     cmd.resource_id = resource_id;
 
-    /* Submit command */
-    memset(&resp, 0, sizeof(resp));
-    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd), &resp, sizeof(resp)) != 0) {
+    return gpu_queue_cmd(&cmd, sizeof(cmd));
+}
+
+/**
+ * Transfer to host
+ */
+int virtio_gpu_transfer_to_host(uint32_t resource_id, uint32_t x, uint32_t y,
+                                  uint32_t width, uint32_t height)
+{
+    if (!gpu_dev.initialized) {
+        return -1;
+    }
+
+    if (gpu_complete(gpu_queue_transfer(resource_id, x, y, width, height)) != 0) {
         klog_error("Failed to transfer to host");
         return -1;
     }
@@ -499,25 +699,11 @@ int virtio_gpu_transfer_to_host(uint32_t resource_id, uint32_t x, uint32_t y,
 int virtio_gpu_flush(uint32_t resource_id, uint32_t x, uint32_t y,
                       uint32_t width, uint32_t height)
 {
-    virtio_gpu_resource_flush_t cmd;
-    virtio_gpu_ctrl_hdr_t resp;
-
     if (!gpu_dev.initialized) {
         return -1;
     }
 
-    /* Prepare command */
-    memset(&cmd, 0, sizeof(cmd));
-    cmd.hdr.type = VIRTIO_GPU_CMD_RESOURCE_FLUSH;
-    cmd.r.x = x;
-    cmd.r.y = y;
-    cmd.r.width = width;
-    cmd.r.height = height;
-    cmd.resource_id = resource_id;
-
-    /* Submit command */
-    memset(&resp, 0, sizeof(resp));
-    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd), &resp, sizeof(resp)) != 0) {
+    if (gpu_complete(gpu_queue_flush(resource_id, x, y, width, height)) != 0) {
         klog_error("Failed to flush resource");
         return -1;
     }
@@ -534,7 +720,6 @@ static int virtio_gpu_attach_backing(uint32_t resource_id, void *addr, uint32_t
         virtio_gpu_resource_attach_backing_t hdr;
         virtio_gpu_mem_entry_t mem;
     } __attribute__((packed)) cmd;
-    virtio_gpu_ctrl_hdr_t resp;
 
     if (!gpu_dev.initialized) {
         return -1;
@@ -549,8 +734,7 @@ static int virtio_gpu_attach_backing(uint32_t resource_id, void *addr, uint32_t
     cmd.mem.length = size;
 
     /* Submit command */
-    memset(&resp, 0, sizeof(resp));
-    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd), &resp, sizeof(resp)) != 0) {
+    if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd)) != 0) {
         klog_error("Failed to attach backing");
         return -1;
     }
@@ -559,14 +743,233 @@ static int virtio_gpu_attach_backing(uint32_t resource_id, void *addr, uint32_t
     return 0;
 }
 
+/**
+ * First-time display setup: a resource with backing for each buffer
+ * The first present then transfers everything and sets the scanout.
+ */
+static int virtio_gpu_setup_display(fb_info_t *fb)
+{
+    rect_t screen = { 0, 0, (int32_t)fb->width, (int32_t)fb->height };
+    uint32_t resource_id;
+    uint32_t format;
+    uint32_t b;
+
+    klog_info("Setting up VirtIO GPU display:");
+    klog_info("  Framebuffer: %ux%u @ %p", fb->width, fb->height, fb->base);
+
+    /* Determine pixel format (our framebuffer is XRGB8888) */
+    format = VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM;
+
+    /* Draw into one buffer while the host reads the other */
+    fb_enable_double_buffer();
+
+    for (b = 0; b < 2; b++) {
+        if (fb->buffers[b] == NULL) {
+            continue;
+        }
+
+        /* Step 1: Create 2D resource */
+        resource_id = virtio_gpu_create_resource(fb->width, fb->height, format);
+        if (resource_id == 0) {
+            klog_error("Failed to create display resource");
+            return -1;
+        }
+
+        /* Step 2: Attach the buffer as backing store */
+        if (virtio_gpu_attach_backing(resource_id, fb->buffers[b],
+                                      fb->pitch * fb->height) != 0) {
+            klog_error("Failed to attach framebuffer backing");
+            return -1;
+        }
+        klog_debug("  Buffer %u: resource %u, backing %p", b, resource_id, fb->buffers[b]);
+
+        /* Nothing has been transferred to the new resource yet */
+        display.resource[b] = resource_id;
+        display.stale[b][0] = screen;
+        display.stale_count[b] = 1;
+    }
+
+    /* From now on fb_swap_buffers() puts frames on screen */
+    fb_set_present_handler(virtio_gpu_present);
+
+    klog_info("VirtIO GPU display setup complete (%s-buffered)",
+              fb->buffers[1] ? "double" : "single");
+    klog_info("Graphics should now appear in QEMU window");
+
+    return 0;
+}
+
+/**
+ * Read the preferred mode from scanout 0's EDID
+ * It is the first detailed timing descriptor (base block, offset 54).
+ * @return 0 on success, -1 if there is no EDID or no timing in it
+ */
+static int gpu_edid_mode(uint32_t *width, uint32_t *height)
+{
+    static const uint8_t header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    virtio_gpu_get_edid_t cmd;
+    const uint8_t *dtd;
+
+    if (!(gpu_dev.vdev.features & (1ULL << VIRTIO_GPU_F_EDID))) {
+        return -1;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.hdr.type = VIRTIO_GPU_CMD_GET_EDID;
+    cmd.scanout = 0;
+
+    if (gpu_complete(gpu_queue_cmd_reply(&cmd, sizeof(cmd), &edid_info,
+                                         sizeof(edid_info))) != 0 ||
+        edid_info.hdr.type != VIRTIO_GPU_RESP_OK_EDID || edid_info.size < 128 ||
+        memcmp(edid_info.edid, header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    /* A zero pixel clock means the descriptor is not a timing */
+    dtd = &edid_info.edid[54];
+    if (dtd[0] == 0 && dtd[1] == 0) {
+        return -1;
+    }
+
+    *width = dtd[2] | ((uint32_t)(dtd[4] & 0xF0) << 4);
+    *height = dtd[5] | ((uint32_t)(dtd[7] & 0xF0) << 4);
+    return 0;
+}
+
+/**
+ * Get the mode to drive scanout 0 at
+ */
+int virtio_gpu_get_display_mode(uint32_t *width, uint32_t *height)
+{
+    virtio_gpu_ctrl_hdr_t cmd;
+    uint32_t w = 0, h = 0;
+
+    if (!gpu_dev.initialized) {
+        return -1;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = VIRTIO_GPU_CMD_GET_DISPLAY_INFO;
+
+    if (gpu_complete(gpu_queue_cmd_reply(&cmd, sizeof(cmd), &display_info,
+                                         sizeof(display_info))) == 0 &&
+        display_info.hdr.type == VIRTIO_GPU_RESP_OK_DISPLAY_INFO &&
+        display_info.pmodes[0].enabled) {
+        w = display_info.pmodes[0].r.width;
+        h = display_info.pmodes[0].r.height;
+    }
+
+    if ((w == 0 || h == 0) && gpu_edid_mode(&w, &h) != 0) {
+        klog_warn("virtio-gpu: display reported no mode");
+        return -1;
+    }
+
+    klog_info("virtio-gpu: display mode %ux%u", w, h);
+    fb_fit_mode(&w, &h);
+
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+/**
+ * Set the mode change callback
+ */
+void virtio_gpu_set_mode_notify(void (*fn)(void))
+{
+    display.mode_notify = fn;
+}
+
+/**
+ * Check for a pending mode change
+ */
+bool virtio_gpu_mode_pending(void)
+{
+    return display.mode_pending;
+}
+
+/**
+ * Drop the display's host resources
+ * Takes the resources off the scanout first, so the host stops reading the
+ * buffers and they can be freed.
+ */
+static int gpu_teardown_display(void)
+{
+    virtio_gpu_resource_unref_t cmd;
+    uint32_t b;
+    int ret = 0;
+
+    if (ctrl.frame_fence != 0 && gpu_wait_fence(ctrl.frame_fence) != 0) {
+        return -1;
+    }
+    ctrl.frame_fence = 0;
+
+    if (gpu_dev.display_resource_id != 0 &&
+        gpu_complete(gpu_queue_scanout(0, 0, 0, 0)) != 0) {
+        return -1;
+    }
+    gpu_dev.display_resource_id = 0;
+
+    for (b = 0; b < 2; b++) {
+        if (display.resource[b] == 0) {
+            continue;
+        }
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.hdr.type = VIRTIO_GPU_CMD_RESOURCE_UNREF;
+        cmd.resource_id = display.resource[b];
+        if (virtio_gpu_submit_cmd(&cmd, sizeof(cmd)) != 0) {
+            ret = -1;
+        }
+
+        display.resource[b] = 0;
+        display.stale_count[b] = 0;
+    }
+
+    return ret;
+}
+
+/**
+ * Follow the display's mode
+ */
+int virtio_gpu_resize(void)
+{
+    fb_info_t *fb = fb_get_info();
+    uint32_t width, height;
+    int ret;
+
+    display.mode_pending = false;
+
+    if (!gpu_dev.initialized || !fb->initialized ||
+        virtio_gpu_get_display_mode(&width, &height) != 0) {
+        return -1;
+    }
+
+    if (width == fb->width && height == fb->height) {
+        return 0;
+    }
+
+    if (display.resource[0] != 0 && gpu_teardown_display() != 0) {
+        klog_error("virtio-gpu: could not release the display for a resize");
+        return -1;
+    }
+
+    /* A failed resize keeps the old mode; set the display up again either way */
+    ret = fb_set_mode(width, height) == 0 ? 1 : -1;
+    if (virtio_gpu_setup_display(fb) != 0) {
+        return -1;
+    }
+
+    return ret;
+}
+
 /**
  * Update display - complete display setup and update
  */
 int virtio_gpu_update_display(void)
 {
     fb_info_t *fb;
-    uint32_t resource_id;
-    uint32_t format;
+    rect_t full;
 
     if (!gpu_dev.initialized) {
         return -1;
@@ -579,80 +982,244 @@ int virtio_gpu_update_display(void)
         return -1;
     }
 
-    /* Check if display is already set up */
-    if (gpu_dev.display_resource_id != 0) {
-        /* Display already configured - just transfer and flush */
-        resource_id = gpu_dev.display_resource_id;
+    /* The first update sets the display up */
+    if (display.resource[0] == 0 && virtio_gpu_setup_display(fb) != 0) {
+        return -1;
+    }
 
-        /* Transfer framebuffer data to host */
-        if (virtio_gpu_transfer_to_host(resource_id, 0, 0, fb->width, fb->height) != 0) {
-            /* Transfer failed - don't log error on every frame */
-            return -1;
+    full.x = 0;
+    full.y = 0;
+    full.width = (int32_t)fb->width;
+    full.height = (int32_t)fb->height;
+
+    return fb_swap_buffers(&full, 1);
+}
+
+/**
+ * Present a framebuffer buffer
+ */
+int virtio_gpu_present(uint32_t buffer, const rect_t *rects, uint32_t n)
+{
+    rect_t list[VIRTIO_GPU_MAX_UPDATE_RECTS];
+    rect_t screen, r;
+    uint32_t resource_id, other;
+    uint32_t count, i;
+    uint64_t fence = 0, flags;
+    fb_info_t *fb = fb_get_info();
+    int ret = -1;
+
+    if (!gpu_dev.initialized || buffer > 1 || display.resource[buffer] == 0) {
+        return -1;
+    }
+
+    resource_id = display.resource[buffer];
+    other = buffer ^ 1;
+
+    /*
+     * The host may still be reading the buffer the previous present showed,
+     * so let it finish first. It has had a whole frame of rendering to do so.
+     */
+    if (ctrl.frame_fence != 0 && gpu_wait_fence(ctrl.frame_fence) != 0) {
+        return -1;
+    }
+
+    /*
+     * Each resource is a host-side copy of its buffer. Transfer what changed
+     * in this frame plus what changed while the other buffer was shown, and
+     * remember this frame's rects for the other resource. Clip and coalesce:
+     * each rect costs a transfer and a flush.
+     */
+    screen.x = 0;
+    screen.y = 0;
+    screen.width = (int32_t)fb->width;
+    screen.height = (int32_t)fb->height;
+    count = display.stale_count[buffer];
+    memcpy(list, display.stale[buffer], count * sizeof(rect_t));
+    display.stale_count[buffer] = 0;
+    for (i = 0; i < n; i++) {
+        if (!rect_intersect(&rects[i], &screen, &r)) {
+            continue;
         }
+        rect_list_add(list, &count, VIRTIO_GPU_MAX_UPDATE_RECTS, &r,
+                      VIRTIO_GPU_RECT_SLACK);
+        if (display.resource[other] != 0) {
+            rect_list_add(display.stale[other], &display.stale_count[other],
+                          VIRTIO_GPU_MAX_UPDATE_RECTS, &r, VIRTIO_GPU_RECT_SLACK);
+        }
+    }
 
-        /* Flush to update display */
-        if (virtio_gpu_flush(resource_id, 0, 0, fb->width, fb->height) != 0) {
-            return -1;
+    /* Copy the changed pixels to the host resource; it reads the backing
+     * behind the caches, so clean just those rows first */
+    for (i = 0; i < count; i++) {
+        dma_sync_2d_for_device((const uint8_t *)fb->buffers[buffer] +
+                               (size_t)list[i].y * fb->pitch + (size_t)list[i].x * 4,
+                               fb->pitch, (size_t)list[i].width * 4,
+                               (uint32_t)list[i].height);
+        fence = gpu_queue_transfer(resource_id,
+                                   (uint32_t)list[i].x, (uint32_t)list[i].y,
+                                   (uint32_t)list[i].width, (uint32_t)list[i].height);
+        if (fence == 0) {
+            /* Queueing failed - don't log error on every frame */
+            goto out;
         }
+    }
 
-        return 0;
+    /* Page flip: scan out the resource that was just completed */
+    if (gpu_dev.display_resource_id != resource_id) {
+        fence = gpu_queue_scanout(0, resource_id, fb->width, fb->height);
+        if (fence == 0) {
+            goto out;
+        }
+        gpu_dev.display_resource_id = resource_id;
     }
 
-    /* First-time setup */
-    klog_info("Setting up VirtIO GPU display:");
-    klog_info("  Framebuffer: %ux%u @ %p", fb->width, fb->height, fb->base);
+    /* Flush to update those parts of the display */
+    for (i = 0; i < count; i++) {
+        fence = gpu_queue_flush(resource_id,
+                                (uint32_t)list[i].x, (uint32_t)list[i].y,
+                                (uint32_t)list[i].width, (uint32_t)list[i].height);
+        if (fence == 0) {
+            goto out;
+        }
+    }
 
-    /* Determine pixel format (our framebuffer is XRGB8888) */
-    format = VIRTIO_GPU_FORMAT_X8R8G8B8_UNORM;
+    if (count > 0) {
+        gpu_dev.updates++;
+    }
+    ret = 0;
 
-    /* Step 1: Create 2D resource */
-    klog_debug("Step 1: Creating 2D resource...");
-    resource_id = virtio_gpu_create_resource(fb->width, fb->height, format);
-    if (resource_id == 0) {
-        klog_error("Failed to create display resource");
-        return -1;
+out:
+    /* Post everything queued with one notify */
+    flags = spin_lock_irqsave(&ctrl.lock);
+    gpu_kick_locked();
+    spin_unlock_irqrestore(&ctrl.lock, flags);
+
+    if (fence != 0) {
+        ctrl.frame_fence = fence;
     }
-    klog_debug("  Resource created: ID=%u", resource_id);
 
-    /* Step 2: Attach our framebuffer as backing store */
-    klog_debug("Step 2: Attaching backing store...");
-    if (virtio_gpu_attach_backing(resource_id, fb->base, fb->pitch * fb->height) != 0) {
-        klog_error("Failed to attach framebuffer backing");
+    return ret;
+}
+
+/**
+ * Upload a cursor image to the cursor plane
+ */
+int virtio_gpu_define_cursor(const uint32_t *image, uint32_t width, uint32_t height,
+                             uint32_t hot_x, uint32_t hot_y)
+{
+    uint32_t size = VIRTIO_GPU_CURSOR_SIZE * VIRTIO_GPU_CURSOR_SIZE * sizeof(uint32_t);
+    uint32_t row;
+
+    if (!gpu_dev.initialized || !cursor.ready || !image ||
+        width > VIRTIO_GPU_CURSOR_SIZE || height > VIRTIO_GPU_CURSOR_SIZE) {
         return -1;
     }
-    klog_debug("  Backing attached");
 
-    /* Step 3: Set scanout to connect resource to display 0 */
-    klog_debug("Step 3: Setting scanout...");
-    if (virtio_gpu_set_scanout(0, resource_id, fb->width, fb->height) != 0) {
-        klog_error("Failed to set scanout");
+    /* One resource for the lifetime of the driver; redefining re-uploads */
+    if (cursor.resource_id == 0) {
+        if (!cursor.image) {
+            cursor.image = (uint32_t *)kmalloc(size);
+            if (!cursor.image) {
+                klog_error("GPU: no memory for cursor image");
+                return -1;
+            }
+        }
+
+        /* ARGB8888 with alpha, so the cursor's transparent pixels blend */
+        cursor.resource_id = virtio_gpu_create_resource(VIRTIO_GPU_CURSOR_SIZE,
+                                                        VIRTIO_GPU_CURSOR_SIZE,
+                                                        VIRTIO_GPU_FORMAT_B8G8R8A8_UNORM);
+        if (cursor.resource_id == 0) {
+            return -1;
+        }
+        if (virtio_gpu_attach_backing(cursor.resource_id, cursor.image, size) != 0) {
+            cursor.resource_id = 0;
+            return -1;
+        }
+    }
+
+    memset(cursor.image, 0, size);
+    for (row = 0; row < height; row++) {
+        memcpy(&cursor.image[row * VIRTIO_GPU_CURSOR_SIZE], &image[row * width],
+               width * sizeof(uint32_t));
+    }
+
+    /* A transfer at (0,0) starts at offset 0 whatever the pitch */
+    dma_sync_for_device(cursor.image, size);
+    if (gpu_complete(gpu_queue_transfer(cursor.resource_id, 0, 0,
+                                        VIRTIO_GPU_CURSOR_SIZE,
+                                        VIRTIO_GPU_CURSOR_SIZE)) != 0) {
+        klog_error("Failed to upload cursor image");
         return -1;
     }
-    klog_debug("  Scanout configured");
 
-    /* Step 4: Transfer framebuffer data to host */
-    klog_debug("Step 4: Transferring to host...");
-    if (virtio_gpu_transfer_to_host(resource_id, 0, 0, fb->width, fb->height) != 0) {
-        klog_error("Failed to transfer to host");
+    cursor.hot_x = hot_x;
+    cursor.hot_y = hot_y;
+    if (gpu_cursor_cmd(VIRTIO_GPU_CMD_UPDATE_CURSOR, cursor.resource_id,
+                       cursor.x, cursor.y) != 0) {
         return -1;
     }
-    klog_debug("  Transfer complete");
+    cursor.shown = true;
+
+    klog_debug("Cursor image uploaded to resource %u", cursor.resource_id);
+    return 0;
+}
+
+/**
+ * Move the hardware cursor
+ */
+int virtio_gpu_move_cursor(int32_t x, int32_t y, bool visible)
+{
+    int ret;
 
-    /* Step 5: Flush to update display */
-    klog_debug("Step 5: Flushing display...");
-    if (virtio_gpu_flush(resource_id, 0, 0, fb->width, fb->height) != 0) {
-        klog_error("Failed to flush display");
+    if (!gpu_dev.initialized || !cursor.ready || cursor.resource_id == 0) {
         return -1;
     }
-    klog_debug("  Flush complete");
 
-    /* Save resource ID for future updates */
-    gpu_dev.display_resource_id = resource_id;
+    cursor.x = x;
+    cursor.y = y;
 
-    klog_info("VirtIO GPU display setup complete!");
-    klog_info("Graphics should now appear in QEMU window");
+    if (!visible) {
+        /* Resource 0 takes the image off the cursor plane */
+        if (!cursor.shown) {
+            return 0;
+        }
+        ret = gpu_cursor_cmd(VIRTIO_GPU_CMD_UPDATE_CURSOR, 0, x, y);
+        if (ret == 0) {
+            cursor.shown = false;
+        }
+        return ret;
+    }
 
-    return 0;
+    if (!cursor.shown) {
+        ret = gpu_cursor_cmd(VIRTIO_GPU_CMD_UPDATE_CURSOR, cursor.resource_id, x, y);
+        if (ret == 0) {
+            cursor.shown = true;
+        }
+        return ret;
+    }
+
+    /* A move only repositions the plane: the host keeps the image */
+    return gpu_cursor_cmd(VIRTIO_GPU_CMD_MOVE_CURSOR, 0, x, y);
+}
+
+/**
+ * Get virtio-gpu statistics
+ */
+void virtio_gpu_get_stats(virtio_gpu_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    stats->updates = gpu_dev.updates;
+    stats->commands = gpu_dev.commands;
+    stats->notifies = gpu_dev.notifies;
+    stats->interrupts = gpu_dev.interrupts;
+    stats->errors = gpu_dev.errors;
+    stats->in_flight = ctrl.in_flight;
+    stats->pixels_transferred = gpu_dev.pixels_transferred;
+    stats->cursor_moves = gpu_dev.cursor_moves;
 }
 
 /* ============================================================================
@@ -6,33 +6,41 @@
 
 #include <aeos/virtio_input.h>
 #include <aeos/virtio.h>
+#include <aeos/virtq.h>
 #include <aeos/event.h>
 #include <aeos/framebuffer.h>
 #include <aeos/kprintf.h>
 #include <aeos/heap.h>
 #include <aeos/string.h>
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/spinlock.h>
+#include <aeos/softirq.h>
+#include <aeos/dma.h>
 
 /* Virtqueue configuration */
 #define INPUT_VIRTQ_SIZE 64
 
-/* Virtqueue structure */
+/* Event queue: one device-writable event buffer per ring slot */
 typedef struct {
-    virtq_desc_t *desc;
-    virtq_avail_t *avail;
-    virtq_used_t *used;
-    virtio_input_event_t *events;  /* Event buffer array */
-    uint16_t last_used_idx;
-    uint16_t num_free;
-    uint16_t free_head;
+    virtq_t vq;
+    virtio_input_event_t *events;  /* Event buffer array, vq.size long */
+    uint64_t events_dma;           /* Device address of events */
+    spinlock_t lock;               /* The tasklet and the poll both drain */
+    tasklet_t tasklet;             /* Drains after an interrupt */
 } input_virtqueue_t;
 
 /* Input devices */
 static virtio_input_t keyboard_dev;
 static virtio_input_t mouse_dev;
-static input_virtqueue_t keyboard_eventq;
-static input_virtqueue_t mouse_eventq;
+static input_virtqueue_t keyboard_eventq = { .lock = SPINLOCK_INIT };
+static input_virtqueue_t mouse_eventq = { .lock = SPINLOCK_INIT };
 
-/* Event buffers are now allocated inside virtqueue_init and stored in input_virtqueue_t */
+/* Mouse motion since the last EV_SYN, delivered as one event (mouse_eventq.lock) */
+static struct {
+    int32_t dx, dy;                /* Relative */
+    int32_t x, y;                  /* Absolute (tablet), -1 = unchanged */
+} motion = { .x = -1, .y = -1 };
 
 /* Keyboard scancode to keycode mapping (simplified) */
 static const uint8_t scancode_to_keycode[] = {
@@ -51,211 +59,227 @@ static const uint8_t scancode_to_keycode[] = {
 };
 
 /**
- * Initialize a virtqueue for input device
+ * Give an event buffer to the device
  */
-static int input_virtqueue_init(input_virtqueue_t *vq, volatile uint32_t *mmio,
-                                 uint32_t queue_idx)
+static void input_post_buffer(input_virtqueue_t *eventq, virtio_input_event_t *event)
 {
-    uint32_t queue_size;
-    size_t desc_size, avail_size, used_size;
-    uint8_t *queue_mem;
-    uint64_t desc_addr;
-    uint32_t i;
+    virtq_buf_t buf;
 
-    /* Select queue */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_SEL, queue_idx);
+    buf.addr = eventq->events_dma + (uint64_t)(event - eventq->events) * sizeof(*event);
+    buf.len = sizeof(*event);
+    buf.write = true;
+    virtq_add(&eventq->vq, &buf, 1, event);
+}
 
-    /* Get maximum queue size */
-    queue_size = virtio_mmio_read32(mmio, VIRTIO_MMIO_QUEUE_NUM_MAX);
-    if (queue_size == 0) {
+/**
+ * Initialize a single VirtIO input device
+ */
+static int init_input_device(uint64_t addr, virtio_input_t *dev,
+                              input_virtqueue_t *eventq)
+{
+    uint32_t i;
+
+    if (virtio_init_device((volatile void *)addr, &dev->vdev) != 0 ||
+        dev->vdev.device_id != VIRTIO_ID_INPUT) {
         return -1;
     }
 
-    if (queue_size > INPUT_VIRTQ_SIZE) {
-        queue_size = INPUT_VIRTQ_SIZE;
+    /* The only feature used is interrupt suppression by index */
+    if (virtio_negotiate(&dev->vdev, VIRTIO_RING_F_EVENT_IDX) != 0) {
+        return -1;
     }
 
-    /* Calculate sizes */
-    desc_size = sizeof(virtq_desc_t) * queue_size;
-    avail_size = sizeof(uint16_t) * (3 + queue_size);
-    used_size = sizeof(uint16_t) * 3 + sizeof(virtq_used_elem_t) * queue_size;
-
-    /* Calculate used ring offset (page-aligned for legacy) */
-    size_t avail_offset = desc_size;
-    size_t used_offset = (desc_size + avail_size + 4095) & ~4095ULL;
-
-    /* Calculate total size including event buffers */
-    size_t event_buf_size = sizeof(virtio_input_event_t) * queue_size;
-    size_t total_size = used_offset + used_size + event_buf_size + 8192;
-    uint8_t *raw_mem = (uint8_t *)kmalloc(total_size);
-    if (!raw_mem) {
+    /* Initialize event virtqueue (queue 0) */
+    if (virtq_init(&eventq->vq, &dev->vdev, 0, INPUT_VIRTQ_SIZE) != 0) {
         return -1;
     }
 
-    /* Align to 4KB page boundary */
-    uint64_t addr = (uint64_t)raw_mem;
-    uint64_t aligned_addr = (addr + 4095) & ~4095ULL;
-    queue_mem = (uint8_t *)aligned_addr;
-
-    memset(queue_mem, 0, used_offset + used_size + event_buf_size);
-
-    /* Place event buffers right after used ring */
-    virtio_input_event_t *local_event_buf = (virtio_input_event_t *)(queue_mem + used_offset + used_size);
-
-    /* Set up structures */
-    vq->desc = (virtq_desc_t *)queue_mem;
-    vq->avail = (virtq_avail_t *)(queue_mem + avail_offset);
-    vq->used = (virtq_used_t *)(queue_mem + used_offset);
-    vq->events = local_event_buf;  /* Store pointer for later access */
-    vq->num_free = queue_size;
-    vq->free_head = 0;
-    vq->last_used_idx = 0;
-
-    /* Initialize descriptors with local event buffers (but don't add to avail yet) */
-    for (i = 0; i < queue_size; i++) {
-        vq->desc[i].addr = (uint64_t)&local_event_buf[i];
-        vq->desc[i].len = sizeof(virtio_input_event_t);
-        vq->desc[i].flags = VIRTQ_DESC_F_WRITE;  /* Device writes to buffer */
-        vq->desc[i].next = 0;  /* Not chained */
+    /* Polled by both sides, so coherent: reading one needs no maintenance */
+    eventq->events = (virtio_input_event_t *)dma_alloc_coherent(
+        eventq->vq.size * sizeof(virtio_input_event_t), &eventq->events_dma);
+    if (!eventq->events) {
+        klog_error("Failed to allocate input event buffers");
+        return -1;
     }
 
-    /* Initialize avail ring flags (no interrupt suppression) */
-    vq->avail->flags = 0;
-    vq->avail->idx = 0;
-
-    /* Configure queue */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NUM, queue_size);
-
-    uint32_t version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
-    desc_addr = (uint64_t)vq->desc;
-
-    klog_info("VirtIO input queue setup: version=%u, queue_size=%u", version, queue_size);
-    klog_info("  desc=%p, avail=%p, used=%p", vq->desc, vq->avail, vq->used);
-    klog_info("  events=%p", local_event_buf);
-
-    if (version == 1) {
-        /* Legacy VirtIO */
-        klog_info("  Using legacy VirtIO, PFN=0x%x", (uint32_t)(desc_addr >> 12));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_ALIGN, 4096);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_PFN, (uint32_t)(desc_addr >> 12));
-    } else {
-        /* Modern VirtIO */
-        klog_info("  Using modern VirtIO v%u", version);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_LOW, (uint32_t)(desc_addr & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_DESC_HIGH, (uint32_t)(desc_addr >> 32));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_LOW, (uint32_t)((uint64_t)vq->avail & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, (uint32_t)((uint64_t)vq->avail >> 32));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_LOW, (uint32_t)((uint64_t)vq->used & 0xFFFFFFFF));
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_USED_HIGH, (uint32_t)((uint64_t)vq->used >> 32));
-        __asm__ volatile("dmb sy" ::: "memory");
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_READY, 1);
+    /* Every buffer goes to the device up front */
+    for (i = 0; i < eventq->vq.size; i++) {
+        input_post_buffer(eventq, &eventq->events[i]);
     }
 
-    /* Now populate the available ring AFTER queue is registered */
-    __asm__ volatile("dmb sy" ::: "memory");
-    for (i = 0; i < queue_size; i++) {
-        vq->avail->ring[i] = i;
-    }
-    __asm__ volatile("dmb sy" ::: "memory");
-    vq->avail->idx = queue_size;
-    __asm__ volatile("dmb sy" ::: "memory");
+    virtio_driver_ok(&dev->vdev);
+
+    /* Tell the device the buffers are there */
+    virtq_kick(&eventq->vq);
 
-    klog_info("  Queue populated: avail->idx=%u", vq->avail->idx);
+    /* Store device info */
+    dev->vdev.initialized = true;
+    dev->initialized = true;
+    dev->irq = VIRTIO_MMIO_IRQ_BASE + (uint32_t)((addr - VIRTIO_MMIO_BASE) / VIRTIO_MMIO_SIZE);
 
     return 0;
 }
 
+/* ============================================================================
+ * Event Delivery
+ * ============================================================================ */
+
 /**
- * Initialize a single VirtIO input device
+ * Deliver the mouse motion gathered since the last EV_SYN
  */
-static int init_input_device(uint64_t addr, virtio_input_t *dev,
-                              input_virtqueue_t *eventq)
+static void mouse_flush_motion(void)
 {
-    volatile uint32_t *mmio = (volatile uint32_t *)addr;
-    uint32_t status;
+    if (motion.dx != 0 || motion.dy != 0) {
+        event_generate_mouse_move(motion.dx, motion.dy);
+        motion.dx = 0;
+        motion.dy = 0;
+    }
 
-    /* Check magic and version */
-    if (virtio_mmio_read32(mmio, VIRTIO_MMIO_MAGIC) != 0x74726976) {
-        return -1;
+    if (motion.x >= 0 || motion.y >= 0) {
+        event_set_mouse_position(motion.x, motion.y);
+        motion.x = -1;
+        motion.y = -1;
     }
+}
 
-    uint32_t version = virtio_mmio_read32(mmio, VIRTIO_MMIO_VERSION);
-    if (version != 1 && version != 2) {
-        return -1;
+/**
+ * Handle one mouse/tablet event
+ * Axes accumulate until EV_SYN, so a diagonal move is one event.
+ */
+static void handle_mouse_event(const virtio_input_event_t *ev)
+{
+    switch (ev->type) {
+        case EV_REL:
+            if (ev->code == REL_X) {
+                motion.dx += (int32_t)ev->value;
+            } else if (ev->code == REL_Y) {
+                motion.dy += (int32_t)ev->value;
+            }
+            break;
+        case EV_ABS:
+            /* Absolute tablet positioning - scale from 0-32767 to screen */
+            if (ev->code == ABS_X) {
+                motion.x = (int32_t)((ev->value * fb_width()) / 32768);
+            } else if (ev->code == ABS_Y) {
+                motion.y = (int32_t)((ev->value * fb_height()) / 32768);
+            }
+            break;
+        case EV_KEY:
+            /* Buttons act where the pointer has got to */
+            mouse_flush_motion();
+            if (ev->code == BTN_LEFT) {
+                event_generate_mouse_button(MOUSE_BUTTON_LEFT, ev->value != 0);
+            } else if (ev->code == BTN_RIGHT) {
+                event_generate_mouse_button(MOUSE_BUTTON_RIGHT, ev->value != 0);
+            } else if (ev->code == BTN_MIDDLE) {
+                event_generate_mouse_button(MOUSE_BUTTON_MIDDLE, ev->value != 0);
+            }
+            break;
+        case EV_SYN:
+            mouse_flush_motion();
+            break;
+        default:
+            break;
     }
+}
 
-    /* Check device type */
-    uint32_t device_id = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_ID);
-    if (device_id != VIRTIO_ID_INPUT) {
-        return -1;
+/**
+ * Handle one keyboard event
+ */
+static void handle_key_event(const virtio_input_event_t *ev)
+{
+    if (ev->type == EV_KEY && ev->code < sizeof(scancode_to_keycode)) {
+        keycode_t kc = scancode_to_keycode[ev->code];
+        if (kc != KEY_NONE) {
+            /* value: 0 = release, 1 = press, 2 = repeat */
+            if (ev->value == 1) {
+                event_generate_key(kc, true);
+            } else if (ev->value == 0) {
+                event_generate_key(kc, false);
+            }
+            /* Ignore repeat (value == 2) for now */
+        }
     }
+}
 
-    /* Reset device */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, 0);
+/**
+ * Process the events an input device has delivered and give the buffers back
+ * Interrupts stay suppressed while draining; once they are re-enabled the
+ * ring is checked again so nothing arriving in between is left behind. The
+ * recycled buffers are published with one kick, which notifies the device
+ * only if it wants to know.
+ * Caller holds eventq->lock.
+ */
+static void input_drain_locked(input_virtqueue_t *eventq, bool is_mouse)
+{
+    virtio_input_event_t *event;
+    bool recycled = false;
 
-    /* Set ACKNOWLEDGE */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    do {
+        virtq_disable_cb(&eventq->vq);
 
-    /* Set DRIVER */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER);
+        while ((event = (virtio_input_event_t *)virtq_get_used(&eventq->vq, NULL)) != NULL) {
+            if (is_mouse) {
+                handle_mouse_event(event);
+            } else {
+                handle_key_event(event);
+            }
 
-    /* For legacy devices, set guest page size */
-    if (version == 1) {
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_GUEST_PAGE_SIZE, 4096);
-    }
+            /* Back to the device, published below */
+            input_post_buffer(eventq, event);
+            recycled = true;
+        }
+    } while (virtq_enable_cb(&eventq->vq));
 
-    /* Read and accept features */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
-    uint32_t features_lo = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_FEATURES);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
-    uint32_t features_hi = virtio_mmio_read32(mmio, VIRTIO_MMIO_DEVICE_FEATURES);
-
-    if (version == 2) {
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, features_lo);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_DRIVER_FEATURES, features_hi | 1);
+    if (recycled) {
+        virtq_kick(&eventq->vq);
     }
+}
 
-    /* Set FEATURES_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_FEATURES_OK);
-
-    /* Verify FEATURES_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    if (!(status & VIRTIO_STATUS_FEATURES_OK)) {
-        return -1;
-    }
+/**
+ * Input tasklet: drain the device's event queue
+ */
+static void input_tasklet(void *arg)
+{
+    input_virtqueue_t *vq = (input_virtqueue_t *)arg;
+    uint64_t flags;
 
-    /* Initialize event virtqueue (queue 0) */
-    if (input_virtqueue_init(eventq, mmio, 0) != 0) {
-        return -1;
-    }
+    flags = spin_lock_irqsave(&vq->lock);
+    input_drain_locked(vq, vq == &mouse_eventq);
+    spin_unlock_irqrestore(&vq->lock, flags);
+}
 
-    /* Set DRIVER_OK */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+/**
+ * VirtIO input interrupt: acknowledge, and drain in the tasklet
+ */
+static void input_irq(virtio_input_t *dev, input_virtqueue_t *vq)
+{
+    volatile uint32_t *mmio = dev->vdev.mmio_base;
+    uint32_t isr;
 
-    /* Verify device accepted our configuration */
-    status = virtio_mmio_read32(mmio, VIRTIO_MMIO_STATUS);
-    klog_info("  Device status after DRIVER_OK: 0x%x", status);
+    /* Level-triggered: acknowledge before draining so nothing is lost */
+    isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (isr) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_INTERRUPT_ACK, isr);
+    }
 
-    /* Select queue 0 and notify device to start receiving events */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_SEL, 0);
-    __asm__ volatile("dmb sy" ::: "memory");
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
-    klog_info("  Queue 0 notified");
+    tasklet_schedule(&vq->tasklet);
+}
 
-    /* Store device info */
-    dev->vdev.mmio_base = mmio;
-    dev->vdev.device_id = device_id;
-    dev->vdev.initialized = true;
-    dev->initialized = true;
+static void keyboard_irq_handler(void)
+{
+    input_irq(&keyboard_dev, &keyboard_eventq);
+}
 
-    return 0;
+static void mouse_irq_handler(void)
+{
+    input_irq(&mouse_dev, &mouse_eventq);
 }
 
+/* ============================================================================
+ * VirtIO Input API
+ * ============================================================================ */
+
 /**
  * Initialize VirtIO input devices
  */
@@ -307,7 +331,11 @@ int virtio_input_init(void)
         addr = VIRTIO_MMIO_BASE + (keyboard_slot * VIRTIO_MMIO_SIZE);
         if (init_input_device(addr, &keyboard_dev, &keyboard_eventq) == 0) {
             keyboard_dev.is_keyboard = true;
-            klog_info("VirtIO keyboard initialized at slot %d", keyboard_slot);
+            tasklet_init(&keyboard_eventq.tasklet, input_tasklet, &keyboard_eventq);
+            irq_register_handler(keyboard_dev.irq, keyboard_irq_handler);
+            gic_enable_irq(keyboard_dev.irq);
+            klog_info("VirtIO keyboard initialized at slot %d (IRQ %u)",
+                      keyboard_slot, keyboard_dev.irq);
         }
     }
 
@@ -316,7 +344,11 @@ int virtio_input_init(void)
         addr = VIRTIO_MMIO_BASE + (mouse_slot * VIRTIO_MMIO_SIZE);
         if (init_input_device(addr, &mouse_dev, &mouse_eventq) == 0) {
             mouse_dev.is_mouse = true;
-            klog_info("VirtIO mouse initialized at slot %d", mouse_slot);
+            tasklet_init(&mouse_eventq.tasklet, input_tasklet, &mouse_eventq);
+            irq_register_handler(mouse_dev.irq, mouse_irq_handler);
+            gic_enable_irq(mouse_dev.irq);
+            klog_info("VirtIO mouse initialized at slot %d (IRQ %u)",
+                      mouse_slot, mouse_dev.irq);
         }
     }
 
@@ -329,122 +361,33 @@ int virtio_input_init(void)
 }
 
 /**
- * Process events from an input device
+ * Drain one device's ring if the used index moved
+ * Reads memory only; the MMIO accesses happen just when there is work.
  */
-static void process_input_events(virtio_input_t *dev, input_virtqueue_t *vq, bool is_mouse)
+static void input_poll_queue(virtio_input_t *dev, input_virtqueue_t *vq, bool is_mouse)
 {
-    volatile uint32_t *mmio;
-    uint32_t isr;
+    uint64_t flags;
 
     if (!dev->initialized) {
         return;
     }
 
-    mmio = dev->vdev.mmio_base;
-
-    /* Check and acknowledge interrupt status */
-    isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
-    if (isr) {
-        virtio_mmio_write32(mmio, VIRTIO_MMIO_INTERRUPT_ACK, isr);
-    }
-
-    /* Memory barrier before reading used ring */
-    __asm__ volatile("dmb ish" ::: "memory");
-
-    /* Process all used descriptors */
-    while (vq->last_used_idx != vq->used->idx) {
-        uint32_t desc_idx = vq->used->ring[vq->last_used_idx % INPUT_VIRTQ_SIZE].id;
-        virtio_input_event_t *ev = &vq->events[desc_idx];
-
-        /* Debug: only log button clicks */
-        if (is_mouse && ev->type == EV_KEY) {
-            klog_info("CLICK: code=%u val=%d", ev->code, (int32_t)ev->value);
-        }
-
-        /* Process the event */
-        if (is_mouse) {
-            /* Mouse/tablet event */
-            switch (ev->type) {
-                case EV_REL:
-                    /* Relative mouse movement */
-                    if (ev->code == REL_X) {
-                        event_generate_mouse_move((int32_t)ev->value, 0);
-                    } else if (ev->code == REL_Y) {
-                        event_generate_mouse_move(0, (int32_t)ev->value);
-                    }
-                    break;
-                case EV_ABS:
-                    /* Absolute tablet positioning - scale from 0-32767 to screen */
-                    if (ev->code == ABS_X) {
-                        int32_t x = (ev->value * FB_WIDTH) / 32768;
-                        event_set_mouse_position(x, -1);  /* -1 = don't change Y */
-                    } else if (ev->code == ABS_Y) {
-                        int32_t y = (ev->value * FB_HEIGHT) / 32768;
-                        event_set_mouse_position(-1, y);  /* -1 = don't change X */
-                    }
-                    break;
-                case EV_KEY:
-                    if (ev->code == BTN_LEFT) {
-                        event_generate_mouse_button(MOUSE_BUTTON_LEFT, ev->value != 0);
-                    } else if (ev->code == BTN_RIGHT) {
-                        event_generate_mouse_button(MOUSE_BUTTON_RIGHT, ev->value != 0);
-                    } else if (ev->code == BTN_MIDDLE) {
-                        event_generate_mouse_button(MOUSE_BUTTON_MIDDLE, ev->value != 0);
-                    }
-                    break;
-                default:
-                    break;
-            }
-        } else {
-            /* Keyboard event */
-            if (ev->type == EV_KEY && ev->code < sizeof(scancode_to_keycode)) {
-                keycode_t kc = scancode_to_keycode[ev->code];
-                if (kc != KEY_NONE) {
-                    /* value: 0 = release, 1 = press, 2 = repeat */
-                    if (ev->value == 1) {
-                        event_generate_key(kc, true);
-                    } else if (ev->value == 0) {
-                        event_generate_key(kc, false);
-                    }
-                    /* Ignore repeat (value == 2) for now */
-                }
-            }
-        }
-
-        /* Re-add descriptor to available ring */
-        vq->avail->ring[vq->avail->idx % INPUT_VIRTQ_SIZE] = desc_idx;
-        __asm__ volatile("dmb ish" ::: "memory");
-        vq->avail->idx++;
-
-        vq->last_used_idx++;
+    if (!virtq_has_used(&vq->vq)) {
+        return;
     }
 
-    /* Notify device */
-    virtio_mmio_write32(mmio, VIRTIO_MMIO_QUEUE_NOTIFY, 0);
+    flags = spin_lock_irqsave(&vq->lock);
+    input_drain_locked(vq, is_mouse);
+    spin_unlock_irqrestore(&vq->lock, flags);
 }
 
-/* Debug counter for logging */
-static uint32_t poll_count = 0;
-static uint16_t last_mouse_used_idx = 0;
-
 /**
  * Poll VirtIO input devices
  */
 void virtio_input_poll(void)
 {
-    poll_count++;
-
-    /* Removed verbose polling logs */
-    (void)poll_count;
-    (void)last_mouse_used_idx;
-
-    if (keyboard_dev.initialized) {
-        process_input_events(&keyboard_dev, &keyboard_eventq, false);
-    }
-
-    if (mouse_dev.initialized) {
-        process_input_events(&mouse_dev, &mouse_eventq, true);
-    }
+    input_poll_queue(&keyboard_dev, &keyboard_eventq, false);
+    input_poll_queue(&mouse_dev, &mouse_eventq, true);
 }
 
 /**
@@ -0,0 +1,557 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/drivers/virtio_net.c
+ * Description: VirtIO network device driver
+ * ============================================================================ */
+
+#include <aeos/virtio_net.h>
+#include <aeos/virtio.h>
+#include <aeos/virtq.h>
+#include <aeos/virtio_gpu.h>  /* VIRTIO_MMIO_IRQ_BASE */
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/interrupts.h>
+#include <aeos/gic.h>
+#include <aeos/spinlock.h>
+#include <aeos/timer.h>
+#include <aeos/softirq.h>
+#include <aeos/trace.h>
+
+/*
+ * Queue 0 receives and queue 1 sends. Receive buffers are the token of
+ * their chain, so a completion leads straight back to where the frame is.
+ * They are re-posted in a batch, published by one kick per drain.
+ *
+ * Send completions never interrupt: their callbacks stay disabled and the
+ * senders reap them, in virtio_net_send() and virtio_net_tx_wait(). With
+ * event indices, receive interrupts are suppressed while a drain runs,
+ * so a burst of frames costs a single interrupt. The interrupt itself
+ * only acknowledges the device: the drain runs in a tasklet.
+ */
+
+/* Receive buffer pool: VIRTIO_NET_RX_BUFFERS buffers in 2^order pages */
+#define NET_RX_POOL_ORDER   6
+
+_Static_assert((PAGE_SIZE << NET_RX_POOL_ORDER) ==
+               VIRTIO_NET_RX_BUFFERS * VIRTIO_NET_RX_BUF_SIZE,
+               "the receive pool holds every buffer");
+
+/* Largest send ring asked for: enough for every slot without indirect */
+#define NET_TX_VIRTQ_SIZE   256
+
+/* How long a send may wait for a slot, or a fence for its sends */
+#define NET_TX_TIMEOUT_MS   1000
+
+/* MAC address used when the device doesn't offer one (locally administered) */
+static const uint8_t net_default_mac[VIRTIO_NET_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+/* A send: the device header and copied frame header in front of the chain */
+typedef struct {
+    virtio_net_hdr_t hdr;
+    uint8_t head[VIRTIO_NET_TX_HEADROOM];
+    uint64_t fence;                 /* 0 when the slot is free */
+} net_tx_slot_t;
+
+/* Device state */
+static struct {
+    virtio_device_t vdev;
+    uint32_t irq;
+    uint8_t mac[VIRTIO_NET_ALEN];
+    uint32_t hdr_len;               /* Device header bytes in front of a frame */
+    bool split_hdr;                 /* The header needs a descriptor of its own */
+    virtio_net_rx_fn rx_handler;
+
+    struct {
+        spinlock_t lock;
+        virtq_t vq;
+        uint8_t *pool;              /* VIRTIO_NET_RX_BUFFERS buffers */
+        uint32_t nbuf;              /* Buffers in use (ring may be smaller) */
+        tasklet_t tasklet;          /* Drains after an interrupt */
+    } rx;
+
+    struct {
+        spinlock_t lock;
+        virtq_t vq;
+        net_tx_slot_t slot[VIRTIO_NET_TX_SLOTS];
+        uint64_t next_fence;
+    } tx;
+
+    virtio_net_stats_t stats;       /* rx fields under rx.lock, tx under tx.lock */
+} vnet = {
+    .rx.lock = SPINLOCK_INIT,
+    .tx.lock = SPINLOCK_INIT,
+    .tx.next_fence = 1,
+};
+
+/* ============================================================================
+ * Receive Queue
+ * ============================================================================ */
+
+/**
+ * Give a receive buffer to the device, published by the next kick
+ * Caller holds vnet.rx.lock.
+ */
+static void vnet_rx_post_locked(uint8_t *buf)
+{
+    virtq_buf_t bufs[2];
+    uint16_t count = 0;
+
+    if (vnet.split_hdr) {
+        bufs[count].addr = (uint64_t)buf;
+        bufs[count].len = vnet.hdr_len;
+        bufs[count].write = true;
+        count++;
+        bufs[count].addr = (uint64_t)buf + vnet.hdr_len;
+        bufs[count].len = VIRTIO_NET_RX_BUF_SIZE - vnet.hdr_len;
+    } else {
+        bufs[count].addr = (uint64_t)buf;
+        bufs[count].len = VIRTIO_NET_RX_BUF_SIZE;
+    }
+    bufs[count].write = true;
+    count++;
+
+    /* nbuf never needs more descriptors than the ring has */
+    virtq_add(&vnet.rx.vq, bufs, count, buf);
+    vnet.stats.rx_posted++;
+}
+
+/**
+ * Hand received frames up and give their buffers back
+ * Interrupts stay suppressed while draining; once they are re-enabled the
+ * ring is checked again so nothing arriving in between is left behind.
+ * Caller holds vnet.rx.lock.
+ */
+static void vnet_rx_drain_locked(void)
+{
+    uint8_t *buf;
+    uint32_t len;
+    bool reposted = false;
+
+    do {
+        virtq_disable_cb(&vnet.rx.vq);
+
+        while ((buf = (uint8_t *)virtq_get_used(&vnet.rx.vq, &len)) != NULL) {
+            vnet.stats.rx_posted--;
+
+            if (len > vnet.hdr_len) {
+                len -= vnet.hdr_len;
+                vnet.stats.rx_packets++;
+                vnet.stats.rx_bytes += len;
+
+                /* No copy: the handler reads the frame where it landed */
+                if (vnet.rx_handler != NULL && vnet.rx_handler(buf + vnet.hdr_len, len)) {
+                    vnet.stats.rx_held++;
+                    continue;
+                }
+            }
+
+            vnet_rx_post_locked(buf);
+            reposted = true;
+        }
+    } while (virtq_enable_cb(&vnet.rx.vq));
+
+    if (reposted) {
+        virtq_kick(&vnet.rx.vq);
+    }
+}
+
+/**
+ * Give a kept receive buffer back to the device
+ */
+void virtio_net_rx_release(void *frame)
+{
+    uint8_t *buf = (uint8_t *)frame - vnet.hdr_len;
+    uint64_t offset = (uint64_t)(buf - vnet.rx.pool);
+    uint64_t flags;
+
+    if (vnet.rx.pool == NULL || buf < vnet.rx.pool ||
+        offset >= (uint64_t)vnet.rx.nbuf * VIRTIO_NET_RX_BUF_SIZE ||
+        offset % VIRTIO_NET_RX_BUF_SIZE != 0) {
+        klog_error("VirtIO net: released frame %p is not a receive buffer", frame);
+        return;
+    }
+
+    flags = spin_lock_irqsave(&vnet.rx.lock);
+    vnet.stats.rx_held--;
+    vnet_rx_post_locked(buf);
+    virtq_kick(&vnet.rx.vq);
+    spin_unlock_irqrestore(&vnet.rx.lock, flags);
+}
+
+/* ============================================================================
+ * Send Queue
+ * ============================================================================ */
+
+/**
+ * Free the slots of sends the device has finished
+ * Caller holds vnet.tx.lock.
+ */
+static void vnet_tx_reap_locked(void)
+{
+    net_tx_slot_t *slot;
+
+    while ((slot = (net_tx_slot_t *)virtq_get_used(&vnet.tx.vq, NULL)) != NULL) {
+        TRACEPOINT(VIRTIO_COMPLETE, VIRTIO_ID_NETWORK, (uint32_t)(slot - vnet.tx.slot));
+        slot->fence = 0;
+        vnet.stats.tx_in_flight--;
+    }
+}
+
+/**
+ * Check whether every send up to a fence has completed
+ * Caller holds vnet.tx.lock.
+ */
+static bool vnet_tx_done_locked(uint64_t fence)
+{
+    uint32_t i;
+
+    for (i = 0; i < VIRTIO_NET_TX_SLOTS; i++) {
+        if (vnet.tx.slot[i].fence != 0 && vnet.tx.slot[i].fence <= fence) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Queue a frame for sending
+ */
+uint64_t virtio_net_send(const void *head, uint32_t head_len,
+                         const virtq_buf_t *bufs, uint16_t count)
+{
+    virtq_buf_t chain[VIRTQ_INDIRECT_MAX];
+    net_tx_slot_t *slot;
+    uint64_t start = timer_get_counter();
+    uint64_t timeout = (uint64_t)timer_get_frequency() * NET_TX_TIMEOUT_MS / 1000;
+    uint64_t flags, fence, bytes;
+    uint16_t n, need, i;
+    bool waited = false;
+
+    if (!vnet.vdev.initialized || head_len > VIRTIO_NET_TX_HEADROOM ||
+        count > VIRTIO_NET_TX_BUFS || (head_len == 0 && count == 0)) {
+        return 0;
+    }
+
+    n = 1 + (head_len > 0 ? 1 : 0) + count;
+    need = vnet.tx.vq.indirect ? 1 : n;
+
+    flags = spin_lock_irqsave(&vnet.tx.lock);
+    for (;;) {
+        vnet_tx_reap_locked();
+
+        slot = NULL;
+        for (i = 0; i < VIRTIO_NET_TX_SLOTS; i++) {
+            if (vnet.tx.slot[i].fence == 0) {
+                slot = &vnet.tx.slot[i];
+                break;
+            }
+        }
+        if (slot != NULL && vnet.tx.vq.num_free >= need) {
+            break;
+        }
+
+        /* Full: the device has been kicked, wait for it to catch up */
+        if (!waited) {
+            vnet.stats.tx_waits++;
+            waited = true;
+        }
+        spin_unlock_irqrestore(&vnet.tx.lock, flags);
+        if (timer_get_counter() - start > timeout) {
+            klog_error("VirtIO net: send timeout, %u in flight", vnet.stats.tx_in_flight);
+            return 0;
+        }
+        __asm__ volatile("yield");
+        flags = spin_lock_irqsave(&vnet.tx.lock);
+    }
+
+    /* No offloads negotiated: the header is all zeroes */
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+    memcpy(slot->head, head, head_len);
+
+    n = 0;
+    chain[n].addr = (uint64_t)&slot->hdr;
+    chain[n].len = vnet.hdr_len;
+    chain[n].write = false;
+    n++;
+    if (head_len > 0) {
+        chain[n].addr = (uint64_t)slot->head;
+        chain[n].len = head_len;
+        chain[n].write = false;
+        n++;
+    }
+    bytes = head_len;
+    for (i = 0; i < count; i++) {
+        chain[n].addr = bufs[i].addr;
+        chain[n].len = bufs[i].len;
+        chain[n].write = false;
+        bytes += bufs[i].len;
+        n++;
+    }
+
+    virtq_add(&vnet.tx.vq, chain, n, slot);
+    TRACEPOINT(VIRTIO_SUBMIT, VIRTIO_ID_NETWORK, (uint32_t)(slot - vnet.tx.slot));
+
+    fence = vnet.tx.next_fence++;
+    slot->fence = fence;
+    vnet.stats.tx_packets++;
+    vnet.stats.tx_bytes += bytes;
+    vnet.stats.tx_in_flight++;
+
+    virtq_kick(&vnet.tx.vq);
+
+    spin_unlock_irqrestore(&vnet.tx.lock, flags);
+    return fence;
+}
+
+/**
+ * Check whether every send up to a fence has completed
+ */
+bool virtio_net_tx_done(uint64_t fence)
+{
+    uint64_t flags;
+    bool done;
+
+    flags = spin_lock_irqsave(&vnet.tx.lock);
+    vnet_tx_reap_locked();
+    done = vnet_tx_done_locked(fence);
+    spin_unlock_irqrestore(&vnet.tx.lock, flags);
+
+    return done;
+}
+
+/**
+ * Wait for every send up to a fence to complete
+ */
+int virtio_net_tx_wait(uint64_t fence)
+{
+    uint64_t start = timer_get_counter();
+    uint64_t timeout = (uint64_t)timer_get_frequency() * NET_TX_TIMEOUT_MS / 1000;
+
+    while (!virtio_net_tx_done(fence)) {
+        if (timer_get_counter() - start > timeout) {
+            /* The slots stay owned: the device may still read them */
+            klog_error("VirtIO net: send fence %llu timed out", fence);
+            return -1;
+        }
+        __asm__ volatile("yield");
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * Interrupts and Polling
+ * ============================================================================ */
+
+/**
+ * Receive tasklet: drain the receive queue
+ */
+static void vnet_rx_tasklet(void *arg)
+{
+    uint64_t flags;
+
+    (void)arg;
+
+    flags = spin_lock_irqsave(&vnet.rx.lock);
+    vnet_rx_drain_locked();
+    vnet.stats.interrupts++;
+    spin_unlock_irqrestore(&vnet.rx.lock, flags);
+}
+
+/**
+ * VirtIO network interrupt: acknowledge, and drain in the tasklet
+ */
+static void vnet_irq_handler(void)
+{
+    volatile uint32_t *mmio = vnet.vdev.mmio_base;
+    uint32_t isr;
+
+    /* Level-triggered: acknowledge before draining so nothing is lost */
+    isr = virtio_mmio_read32(mmio, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (isr) {
+        virtio_mmio_write32(mmio, VIRTIO_MMIO_INTERRUPT_ACK, isr);
+    }
+
+    tasklet_schedule(&vnet.rx.tasklet);
+}
+
+/**
+ * Process received frames without waiting for the interrupt
+ * Reads memory only unless there is work.
+ */
+void virtio_net_poll(void)
+{
+    uint64_t flags;
+
+    if (!vnet.vdev.initialized || !virtq_has_used(&vnet.rx.vq)) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&vnet.rx.lock);
+    vnet_rx_drain_locked();
+    spin_unlock_irqrestore(&vnet.rx.lock, flags);
+}
+
+/* ============================================================================
+ * VirtIO Network API
+ * ============================================================================ */
+
+/**
+ * Initialize the VirtIO network device
+ */
+int virtio_net_init(void)
+{
+    volatile uint8_t *config;
+    uint32_t i, slot, version;
+    uint64_t addr, pool;
+    char mac[18];
+
+    for (i = 0; i < VIRTIO_MMIO_COUNT; i++) {
+        addr = VIRTIO_MMIO_BASE + (i * VIRTIO_MMIO_SIZE);
+        if (virtio_init_device((void *)addr, &vnet.vdev) == 0 &&
+            vnet.vdev.device_id == VIRTIO_ID_NETWORK) {
+            break;
+        }
+    }
+    if (i == VIRTIO_MMIO_COUNT) {
+        klog_debug("VirtIO network device not found");
+        return -1;
+    }
+
+    slot = i;
+    vnet.irq = VIRTIO_MMIO_IRQ_BASE + slot;
+
+    /* No checksum or segmentation offloads: frames go as they are */
+    if (virtio_negotiate(&vnet.vdev, VIRTIO_NET_F_MAC | VIRTIO_F_ANY_LAYOUT |
+                                     VIRTIO_RING_F_INDIRECT_DESC |
+                                     VIRTIO_RING_F_EVENT_IDX) != 0) {
+        return -1;
+    }
+
+    /* Legacy devices have no num_buffers without mergeable buffers */
+    version = virtio_mmio_read32(vnet.vdev.mmio_base, VIRTIO_MMIO_VERSION);
+    vnet.hdr_len = version == 1 ? sizeof(virtio_net_hdr_t) - sizeof(uint16_t)
+                                : sizeof(virtio_net_hdr_t);
+    vnet.split_hdr = !(vnet.vdev.features & (VIRTIO_F_ANY_LAYOUT | VIRTIO_F_VERSION_1));
+
+    if (vnet.vdev.features & VIRTIO_NET_F_MAC) {
+        config = (volatile uint8_t *)vnet.vdev.mmio_base + VIRTIO_NET_CFG_MAC;
+        for (i = 0; i < VIRTIO_NET_ALEN; i++) {
+            vnet.mac[i] = config[i];
+        }
+    } else {
+        memcpy(vnet.mac, net_default_mac, VIRTIO_NET_ALEN);
+    }
+
+    if (virtq_init(&vnet.rx.vq, &vnet.vdev, 0, VIRTIO_NET_RX_BUFFERS * 2) != 0 ||
+        virtq_init(&vnet.tx.vq, &vnet.vdev, 1,
+                   (vnet.vdev.features & VIRTIO_RING_F_INDIRECT_DESC) ?
+                   VIRTIO_NET_TX_SLOTS : NET_TX_VIRTQ_SIZE) != 0) {
+        return -1;
+    }
+    vnet.stats.indirect = vnet.tx.vq.indirect;
+    vnet.stats.event_idx = vnet.rx.vq.event_idx;
+
+    pool = pmm_alloc_pages(NET_RX_POOL_ORDER);
+    if (pool == 0) {
+        klog_error("VirtIO net: no memory for receive buffers");
+        return -1;
+    }
+    vnet.rx.pool = (uint8_t *)pool;
+
+    /* Every buffer goes to the device up front */
+    vnet.rx.nbuf = (vnet.split_hdr && !vnet.rx.vq.indirect) ? vnet.rx.vq.size / 2
+                                                               : vnet.rx.vq.size;
+    if (vnet.rx.nbuf > VIRTIO_NET_RX_BUFFERS) {
+        vnet.rx.nbuf = VIRTIO_NET_RX_BUFFERS;
+    }
+    for (i = 0; i < vnet.rx.nbuf; i++) {
+        vnet_rx_post_locked(vnet.rx.pool + (size_t)i * VIRTIO_NET_RX_BUF_SIZE);
+    }
+
+    /* Senders reap their own completions */
+    virtq_disable_cb(&vnet.tx.vq);
+
+    /* Received frames are handled after the interrupt (SPIs are routed to CPU 0) */
+    tasklet_init(&vnet.rx.tasklet, vnet_rx_tasklet, NULL);
+    irq_register_handler(vnet.irq, vnet_irq_handler);
+    gic_enable_irq(vnet.irq);
+
+    virtio_driver_ok(&vnet.vdev);
+    virtq_kick(&vnet.rx.vq);
+    vnet.vdev.initialized = true;
+
+    snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x", vnet.mac[0], vnet.mac[1],
+             vnet.mac[2], vnet.mac[3], vnet.mac[4], vnet.mac[5]);
+    kprintf("  [INFO] VirtIO network device: slot %u, MAC %s, %u receive buffers%s\n",
+            slot, mac, vnet.rx.nbuf,
+            vnet.stats.indirect ? " (indirect)" : "");
+    return 0;
+}
+
+/**
+ * Check whether a network device was initialized
+ */
+bool virtio_net_present(void)
+{
+    return vnet.vdev.initialized;
+}
+
+/**
+ * Get the device's MAC address
+ */
+void virtio_net_get_mac(uint8_t mac[VIRTIO_NET_ALEN])
+{
+    memcpy(mac, vnet.mac, VIRTIO_NET_ALEN);
+}
+
+/**
+ * Set the receive handler
+ */
+void virtio_net_set_rx_handler(virtio_net_rx_fn fn)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&vnet.rx.lock);
+    vnet.rx_handler = fn;
+    spin_unlock_irqrestore(&vnet.rx.lock, flags);
+}
+
+/**
+ * Get virtio-net statistics
+ */
+void virtio_net_get_stats(virtio_net_stats_t *stats)
+{
+    virtio_net_stats_t rx;
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&vnet.rx.lock);
+    rx = vnet.stats;
+    rx.notifies = vnet.rx.vq.kicks;
+    rx.notifies_saved = vnet.rx.vq.kicks_saved;
+    spin_unlock_irqrestore(&vnet.rx.lock, flags);
+
+    flags = spin_lock_irqsave(&vnet.tx.lock);
+    *stats = vnet.stats;
+    stats->notifies = rx.notifies + vnet.tx.vq.kicks;
+    stats->notifies_saved = rx.notifies_saved + vnet.tx.vq.kicks_saved;
+    spin_unlock_irqrestore(&vnet.tx.lock, flags);
+
+    /* Receive-side fields from the receive lock's copy */
+    stats->rx_packets = rx.rx_packets;
+    stats->rx_bytes = rx.rx_bytes;
+    stats->rx_posted = rx.rx_posted;
+    stats->rx_held = rx.rx_held;
+    stats->interrupts = rx.interrupts;
+}
+
+/* ============================================================================
+ * End of virtio_net.c
+ * ============================================================================ */
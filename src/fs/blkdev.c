@@ -0,0 +1,706 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/fs/blkdev.c
+ * Description: Block device registry and write-back block cache
+ * ============================================================================ */
+
+#include <aeos/blkdev.h>
+#include <aeos/pmm.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/timer.h>
+#include <aeos/spinlock.h>
+#include <aeos/mutex.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/shrinker.h>
+
+/*
+ * Writes land in cached blocks and are marked dirty. The flusher process
+ * wakes every BCACHE_FLUSH_MS, or early once half the cache is dirty, and
+ * writes the dirty blocks back in runs of adjacent ones, so a large sequential
+ * write becomes a few large device requests. A run is copied to a bounce
+ * buffer first: the blocks can be written again while the device is busy,
+ * and then they are simply dirty once more.
+ *
+ * Under memory pressure a shrinker takes the pages of unused buffers, and
+ * then of clean unpinned blocks, least recently used first.
+ */
+
+#define BCACHE_HASH_SIZE 256    /* Buckets, a power of two */
+
+/* Bounce buffer for one run: 2^6 pages, BCACHE_RUN_MAX blocks */
+#define BCACHE_RUN_ORDER 6
+
+/* Buffer flags */
+#define BUF_VALID       0x1     /* Holds the block's data */
+#define BUF_DIRTY       0x2     /* Newer than the device */
+#define BUF_WRITEBACK   0x4     /* In a run being written */
+#define BUF_LOADING     0x8     /* Being read or filled; wait for it */
+
+/* One cached block */
+typedef struct bcache_buf {
+    blkdev_t *dev;                      /* NULL = free */
+    uint64_t block;
+    uint8_t *data;                      /* One page, kept once allocated */
+    uint32_t flags;
+    uint32_t pins;                      /* Users copying in or out */
+    struct bcache_buf *hash_next;
+    struct bcache_buf *lru_prev;        /* Least recently used first */
+    struct bcache_buf *lru_next;
+} bcache_buf_t;
+
+/* Cache state */
+static struct {
+    spinlock_t lock;
+    mutex_t run_lock;                   /* One writeback at a time: owns bounce */
+    bcache_buf_t bufs[BCACHE_BLOCKS];
+    bcache_buf_t *hash[BCACHE_HASH_SIZE];
+    bcache_buf_t *lru_head;
+    bcache_buf_t *lru_tail;
+    uint8_t *bounce;
+    process_t *flusher;
+    bcache_stats_t stats;
+} bcache = { .lock = SPINLOCK_INIT, .run_lock = MUTEX_INIT };
+
+/* Registered devices */
+static struct {
+    blkdev_t *devs[BLKDEV_MAX];
+    uint32_t count;
+} blkdevs;
+
+/* ============================================================================
+ * Device Registry
+ * ============================================================================ */
+
+/**
+ * Register a block device
+ */
+int blkdev_register(blkdev_t *dev)
+{
+    if (dev == NULL || dev->ops == NULL || blkdevs.count >= BLKDEV_MAX) {
+        klog_error("Cannot register block device");
+        return -1;
+    }
+
+    dev->index = blkdevs.count;
+    blkdevs.devs[blkdevs.count++] = dev;
+    klog_info("Block device '%s': %llu blocks", dev->name, dev->num_blocks);
+    return 0;
+}
+
+/**
+ * Find a registered block device by name
+ */
+blkdev_t *blkdev_find(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < blkdevs.count; i++) {
+        if (strcmp(blkdevs.devs[i]->name, name) == 0) {
+            return blkdevs.devs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get a registered block device by index
+ */
+blkdev_t *blkdev_get(uint32_t index)
+{
+    return index < blkdevs.count ? blkdevs.devs[index] : NULL;
+}
+
+/* ============================================================================
+ * Asynchronous Requests
+ * ============================================================================ */
+
+/**
+ * Start a block request
+ */
+int blk_submit(bio_t *bio)
+{
+    blkdev_t *dev;
+    int ret;
+
+    if (bio == NULL || bio->dev == NULL || bio->buf == NULL || bio->count == 0) {
+        return -1;
+    }
+
+    dev = bio->dev;
+    if (bio->block > dev->num_blocks || bio->count > dev->num_blocks - bio->block) {
+        klog_error("Block request beyond '%s': block %llu count %u",
+                   dev->name, bio->block, bio->count);
+        return -1;
+    }
+
+    bio->status = 0;
+    bio->done = false;
+    bio->next = NULL;
+
+    if (dev->ops->submit != NULL) {
+        return dev->ops->submit(dev, bio);
+    }
+
+    if (bio->write) {
+        ret = dev->ops->write(dev, bio->block, bio->count, bio->buf);
+    } else {
+        ret = dev->ops->read(dev, bio->block, bio->count, bio->buf);
+    }
+    bio_complete(bio, ret);
+    return 0;
+}
+
+/**
+ * Wait for a submitted bio to finish
+ * Interrupts normally complete it; polling as well covers the time before
+ * they are enabled and CPUs other than the one taking the device's IRQ.
+ */
+int blk_wait(bio_t *bio)
+{
+    blkdev_t *dev = bio->dev;
+
+    while (!bio->done) {
+        if (dev->ops->poll != NULL) {
+            dev->ops->poll(dev);
+        }
+        if (!bio->done) {
+            __asm__ volatile("yield");
+        }
+    }
+
+    __asm__ volatile("dmb ish" ::: "memory");
+    return bio->status;
+}
+
+/**
+ * Finish a bio
+ */
+void bio_complete(bio_t *bio, int status)
+{
+    bio_end_t end_io = bio->end_io;
+
+    bio->status = status == 0 ? 0 : -1;
+
+    /* Status and data before done */
+    __asm__ volatile("dmb ish" ::: "memory");
+    bio->done = true;
+
+    if (end_io != NULL) {
+        end_io(bio);
+    }
+}
+
+/* ============================================================================
+ * Cache Lookup (cache lock held)
+ * ============================================================================ */
+
+static inline uint32_t bcache_hash(blkdev_t *dev, uint64_t block)
+{
+    return (uint32_t)(block * 2654435761U + dev->index) & (BCACHE_HASH_SIZE - 1);
+}
+
+/**
+ * Find a cached block
+ */
+static bcache_buf_t *bcache_lookup(blkdev_t *dev, uint64_t block)
+{
+    bcache_buf_t *b;
+
+    for (b = bcache.hash[bcache_hash(dev, block)]; b != NULL; b = b->hash_next) {
+        if (b->dev == dev && b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(bcache_buf_t *b)
+{
+    if (b->lru_prev != NULL) {
+        b->lru_prev->lru_next = b->lru_next;
+    } else {
+        bcache.lru_head = b->lru_next;
+    }
+    if (b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        bcache.lru_tail = b->lru_prev;
+    }
+    b->lru_prev = NULL;
+    b->lru_next = NULL;
+}
+
+static void lru_append(bcache_buf_t *b)
+{
+    b->lru_prev = bcache.lru_tail;
+    b->lru_next = NULL;
+    if (bcache.lru_tail != NULL) {
+        bcache.lru_tail->lru_next = b;
+    } else {
+        bcache.lru_head = b;
+    }
+    bcache.lru_tail = b;
+}
+
+/**
+ * Drop a block from the cache; its page stays with the buffer
+ */
+static void bcache_evict(bcache_buf_t *b)
+{
+    bcache_buf_t **link = &bcache.hash[bcache_hash(b->dev, b->block)];
+
+    while (*link != b) {
+        link = &(*link)->hash_next;
+    }
+    *link = b->hash_next;
+    b->hash_next = NULL;
+    lru_unlink(b);
+    b->dev = NULL;
+    b->flags = 0;
+    bcache.stats.cached--;
+}
+
+/**
+ * Get a buffer for a new block: a free one, else the least recently used
+ * clean one
+ * @return Buffer, NULL if every buffer is dirty or in use
+ */
+static bcache_buf_t *bcache_alloc(void)
+{
+    bcache_buf_t *b;
+    uint32_t i;
+
+    for (i = 0; i < BCACHE_BLOCKS; i++) {
+        b = &bcache.bufs[i];
+        if (b->dev == NULL && b->data != NULL) {
+            return b;
+        }
+    }
+    for (i = 0; i < BCACHE_BLOCKS; i++) {
+        b = &bcache.bufs[i];
+        if (b->data == NULL) {
+            b->data = (uint8_t *)(uintptr_t)pmm_alloc_page();
+            return (b->data != NULL) ? b : NULL;
+        }
+    }
+
+    for (b = bcache.lru_head; b != NULL; b = b->lru_next) {
+        if (b->pins == 0 && (b->flags & (BUF_DIRTY | BUF_WRITEBACK | BUF_LOADING)) == 0) {
+            bcache_evict(b);
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a buffer's page could go (lock held)
+ */
+static bool bcache_reclaimable(const bcache_buf_t *b)
+{
+    return b->data != NULL && b->pins == 0 &&
+           (b->flags & (BUF_DIRTY | BUF_WRITEBACK | BUF_LOADING)) == 0;
+}
+
+/**
+ * Shrinker: pages the cache could give back
+ */
+static size_t bcache_shrink_count(void)
+{
+    size_t n = 0;
+    uint32_t i;
+
+    /* Reclaim may run under the lock; then there is nothing to give */
+    if (!spin_trylock(&bcache.lock)) {
+        return 0;
+    }
+    for (i = 0; i < BCACHE_BLOCKS; i++) {
+        if (bcache_reclaimable(&bcache.bufs[i])) {
+            n++;
+        }
+    }
+    spin_unlock(&bcache.lock);
+    return n;
+}
+
+/**
+ * Shrinker: free up to nr pages, unused buffers first, then the LRU
+ */
+static size_t bcache_shrink_scan(size_t nr)
+{
+    bcache_buf_t *b, *next;
+    size_t freed = 0;
+    uint32_t i;
+
+    if (!spin_trylock(&bcache.lock)) {
+        return 0;
+    }
+
+    for (i = 0; i < BCACHE_BLOCKS && freed < nr; i++) {
+        b = &bcache.bufs[i];
+        if (b->dev == NULL && b->data != NULL) {
+            pmm_free_page((uint64_t)(uintptr_t)b->data);
+            b->data = NULL;
+            freed++;
+        }
+    }
+    for (b = bcache.lru_head; b != NULL && freed < nr; b = next) {
+        next = b->lru_next;
+        if (bcache_reclaimable(b)) {
+            bcache_evict(b);
+            pmm_free_page((uint64_t)(uintptr_t)b->data);
+            b->data = NULL;
+            freed++;
+        }
+    }
+
+    bcache.stats.reclaimed += freed;
+    spin_unlock(&bcache.lock);
+    return freed;
+}
+
+static shrinker_t bcache_shrinker = {
+    .name = "bcache",
+    .count = bcache_shrink_count,
+    .scan = bcache_shrink_scan,
+};
+
+/* ============================================================================
+ * Writeback
+ * ============================================================================ */
+
+/**
+ * Write back one run of adjacent dirty blocks
+ * The earliest dirty block goes first, so passes sweep each device in order.
+ * @param dev Only this device, or NULL for any
+ * @return Blocks written, 0 if nothing was dirty, -1 on a device error
+ */
+static int bcache_write_run(blkdev_t *dev)
+{
+    bcache_buf_t *run[BCACHE_RUN_MAX];
+    bcache_buf_t *b, *first;
+    uint64_t flags;
+    uint32_t count, i;
+    int ret;
+
+    /* A mutex: the run holds it across the device request */
+    mutex_lock(&bcache.run_lock);
+    if (bcache.bounce == NULL) {
+        bcache.bounce = (uint8_t *)(uintptr_t)pmm_alloc_pages(BCACHE_RUN_ORDER);
+        if (bcache.bounce == NULL) {
+            mutex_unlock(&bcache.run_lock);
+            klog_error("Block cache: no memory for writeback");
+            return -1;
+        }
+    }
+
+    flags = spin_lock_irqsave(&bcache.lock);
+
+    first = NULL;
+    for (i = 0; i < BCACHE_BLOCKS; i++) {
+        b = &bcache.bufs[i];
+        if ((b->flags & (BUF_DIRTY | BUF_LOADING)) != BUF_DIRTY ||
+            (dev != NULL && b->dev != dev)) {
+            continue;
+        }
+        if (first == NULL || b->dev->index < first->dev->index ||
+            (b->dev == first->dev && b->block < first->block)) {
+            first = b;
+        }
+    }
+    if (first == NULL) {
+        spin_unlock_irqrestore(&bcache.lock, flags);
+        mutex_unlock(&bcache.run_lock);
+        return 0;
+    }
+
+    /* Extend through the blocks that follow while they are dirty too */
+    dev = first->dev;
+    count = 0;
+    b = first;
+    while (b != NULL && (b->flags & (BUF_DIRTY | BUF_LOADING)) == BUF_DIRTY &&
+           count < BCACHE_RUN_MAX) {
+        memcpy(bcache.bounce + (size_t)count * BLK_SIZE, b->data, BLK_SIZE);
+        b->flags = (b->flags & ~BUF_DIRTY) | BUF_WRITEBACK;
+        bcache.stats.dirty--;
+        run[count++] = b;
+        b = bcache_lookup(dev, first->block + count);
+    }
+
+    spin_unlock_irqrestore(&bcache.lock, flags);
+
+    ret = dev->ops->write(dev, first->block, count, bcache.bounce);
+
+    /* Buffers in writeback are never evicted, so run[] is still theirs */
+    flags = spin_lock_irqsave(&bcache.lock);
+    for (i = 0; i < count; i++) {
+        run[i]->flags &= ~BUF_WRITEBACK;
+        if (ret != 0 && !(run[i]->flags & BUF_DIRTY)) {
+            run[i]->flags |= BUF_DIRTY;
+            bcache.stats.dirty++;
+        }
+    }
+    bcache.stats.runs++;
+    if (ret != 0) {
+        bcache.stats.errors++;
+    } else {
+        bcache.stats.written += count;
+    }
+    spin_unlock_irqrestore(&bcache.lock, flags);
+    mutex_unlock(&bcache.run_lock);
+
+    if (ret != 0) {
+        klog_error("Block cache: write of %u blocks at %llu on '%s' failed",
+                   count, first->block, dev->name);
+        return -1;
+    }
+    return (int)count;
+}
+
+/**
+ * Flusher process: write back everything dirty, then sleep
+ */
+static void bcache_flusher(void)
+{
+    for (;;) {
+        timer_sleep_ms(BCACHE_FLUSH_MS);
+
+        /* A failing device is retried on the next pass */
+        while (bcache_write_run(NULL) > 0) {
+        }
+    }
+}
+
+/**
+ * Start the background flusher
+ */
+void bcache_init(void)
+{
+    shrinker_register(&bcache_shrinker);
+
+    bcache.flusher = process_create(bcache_flusher, "bflush");
+    if (bcache.flusher == NULL) {
+        klog_error("Block cache: failed to start flusher");
+        return;
+    }
+    klog_info("Block cache: %u blocks, flushing every %u ms",
+              BCACHE_BLOCKS, BCACHE_FLUSH_MS);
+}
+
+/**
+ * Write back every dirty block of a device
+ */
+int bcache_sync(blkdev_t *dev)
+{
+    int total = 0;
+    int ret;
+
+    /* Taking the run lock in each pass also waits out the flusher's run */
+    while ((ret = bcache_write_run(dev)) > 0) {
+        total += ret;
+    }
+    return (ret < 0) ? -1 : total;
+}
+
+/* ============================================================================
+ * Cached I/O
+ * ============================================================================ */
+
+/**
+ * Get a block pinned in the cache
+ * @param fill Read it from the device if it is not cached; without fill
+ *             the caller overwrites all of it and the buffer is returned
+ *             BUF_LOADING until bcache_put()
+ * @return Buffer, NULL on a device error or when out of memory
+ */
+static bcache_buf_t *bcache_get(blkdev_t *dev, uint64_t block, bool fill)
+{
+    bcache_buf_t *b;
+    uint64_t flags;
+    uint32_t slot;
+
+    for (;;) {
+        flags = spin_lock_irqsave(&bcache.lock);
+
+        b = bcache_lookup(dev, block);
+        if (b != NULL) {
+            if (b->flags & BUF_LOADING) {
+                spin_unlock_irqrestore(&bcache.lock, flags);
+                yield();
+                continue;
+            }
+            b->pins++;
+            lru_unlink(b);
+            lru_append(b);
+            bcache.stats.hits++;
+            spin_unlock_irqrestore(&bcache.lock, flags);
+            return b;
+        }
+
+        b = bcache_alloc();
+        if (b == NULL) {
+            /* Full of dirty blocks: write some back here and retry */
+            spin_unlock_irqrestore(&bcache.lock, flags);
+            if (bcache_write_run(NULL) < 0) {
+                return NULL;
+            }
+            continue;
+        }
+
+        slot = bcache_hash(dev, block);
+        b->dev = dev;
+        b->block = block;
+        b->flags = BUF_LOADING;
+        b->pins = 1;
+        b->hash_next = bcache.hash[slot];
+        bcache.hash[slot] = b;
+        lru_append(b);
+        bcache.stats.cached++;
+        bcache.stats.misses++;
+        spin_unlock_irqrestore(&bcache.lock, flags);
+        break;
+    }
+
+    if (!fill) {
+        return b;
+    }
+
+    if (dev->ops->read(dev, block, 1, b->data) != 0) {
+        flags = spin_lock_irqsave(&bcache.lock);
+        bcache.stats.errors++;
+        bcache_evict(b);
+        b->pins = 0;
+        spin_unlock_irqrestore(&bcache.lock, flags);
+        klog_error("Block cache: read of block %llu on '%s' failed", block, dev->name);
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&bcache.lock);
+    b->flags = (b->flags & ~BUF_LOADING) | BUF_VALID;
+    spin_unlock_irqrestore(&bcache.lock, flags);
+    return b;
+}
+
+/**
+ * Unpin a block, marking it dirty after a write
+ */
+static void bcache_put(bcache_buf_t *b, bool dirty)
+{
+    uint64_t flags;
+    bool kick = false;
+
+    flags = spin_lock_irqsave(&bcache.lock);
+    b->flags = (b->flags & ~BUF_LOADING) | BUF_VALID;
+    if (dirty && !(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        bcache.stats.dirty++;
+        kick = (bcache.stats.dirty == BCACHE_BLOCKS / 2);
+    }
+    b->pins--;
+    spin_unlock_irqrestore(&bcache.lock, flags);
+
+    /* Half the cache is dirty: start the flusher before writers must wait */
+    if (kick && bcache.flusher != NULL) {
+        scheduler_wake(bcache.flusher);
+    }
+}
+
+/**
+ * Check that a byte range lies on a device
+ */
+static bool bcache_in_range(blkdev_t *dev, uint64_t offset, size_t len)
+{
+    uint64_t size = dev->num_blocks << BLK_SHIFT;
+
+    return offset <= size && len <= size - offset;
+}
+
+/**
+ * Read bytes from a device through the cache
+ */
+int bcache_read(blkdev_t *dev, uint64_t offset, void *buf, size_t len)
+{
+    uint8_t *out = (uint8_t *)buf;
+    bcache_buf_t *b;
+    size_t in_blk, n;
+
+    if (dev == NULL || buf == NULL || !bcache_in_range(dev, offset, len)) {
+        return -1;
+    }
+
+    while (len > 0) {
+        in_blk = (size_t)(offset & (BLK_SIZE - 1));
+        n = BLK_SIZE - in_blk;
+        if (n > len) {
+            n = len;
+        }
+
+        b = bcache_get(dev, offset >> BLK_SHIFT, true);
+        if (b == NULL) {
+            return -1;
+        }
+        memcpy(out, b->data + in_blk, n);
+        bcache_put(b, false);
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Write bytes to a device through the cache
+ */
+int bcache_write(blkdev_t *dev, uint64_t offset, const void *buf, size_t len)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    bcache_buf_t *b;
+    size_t in_blk, n;
+
+    if (dev == NULL || buf == NULL || !bcache_in_range(dev, offset, len)) {
+        return -1;
+    }
+
+    while (len > 0) {
+        in_blk = (size_t)(offset & (BLK_SIZE - 1));
+        n = BLK_SIZE - in_blk;
+        if (n > len) {
+            n = len;
+        }
+
+        /* A whole block need not be read first */
+        b = bcache_get(dev, offset >> BLK_SHIFT, n != BLK_SIZE);
+        if (b == NULL) {
+            return -1;
+        }
+        memcpy(b->data + in_blk, in, n);
+        bcache_put(b, true);
+
+        in += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Get block cache statistics
+ */
+void bcache_get_stats(bcache_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+    flags = spin_lock_irqsave(&bcache.lock);
+    *stats = bcache.stats;
+    spin_unlock_irqrestore(&bcache.lock, flags);
+}
+
+/* ============================================================================
+ * End of blkdev.c
+ * ============================================================================ */
@@ -10,275 +10,1174 @@
 #include <aeos/heap.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
-#include <aeos/pflash.h>
-#include <aeos/semihosting.h>
+#include <aeos/lz4.h>
+#include <aeos/blkdev.h>
+#include <aeos/arena.h>
+#include <aeos/timer.h>
+
+/* Longest directory record accepted when loading */
+#define FS_DIR_RECORD_MAX (16 * 1024 * 1024)
+
+/* Directory listings are copied into an arena of 2^order page blocks */
+#define FS_LOAD_ARENA_ORDER 4
+
+/* FNV-1a, the segment checksum */
+#define FS_FNV_OFFSET 0x811C9DC5U
+#define FS_FNV_PRIME  0x01000193U
+
+/* Persistent storage buffer: a huge buffer, allocated on first use */
+static char *fs_storage;
+
+/* Staging buffer for device reads */
+static uint8_t fs_chunk[FS_CHUNK_SIZE] __attribute__((aligned(64)));
+
+/* How the stored image relates to the filesystem */
+static struct {
+    blkdev_t *dev;          /* Device holding the image */
+    bool synced;            /* Image holds everything up to saved_gen */
+    bool compressed;        /* Image is FS_IMAGE_LZ4 */
+    uint32_t epoch;         /* Epoch of the image's segments */
+    uint64_t saved_gen;     /* ramfs generation of the last save or load */
+    uint64_t log_size;      /* Bytes in the image */
+    fs_persist_stats_t last;
+} persist;
 
-/* Default filename for persistent storage on host */
-#define FS_IMAGE_FILENAME "aeos_fs.img"
+/* ============================================================================
+ * Image I/O
+ * ============================================================================ */
 
-/* Persistent storage buffer (allocated at fixed address) */
-static char fs_storage[FS_IMAGE_MAX_SIZE] __attribute__((aligned(4096)));
+/* Output: a block device through the cache, or a memory buffer */
+typedef struct fs_writer {
+    blkdev_t *dev;          /* NULL for memory */
+    uint64_t base;          /* Device offset the output starts at */
+    uint8_t *mem;
+    size_t mem_size;
+    uint64_t written;       /* Bytes emitted */
+    uint32_t sum;           /* Checksum of the current segment */
+    bool failed;
+
+    /* Compression (FS_IMAGE_LZ4) */
+    bool compress;
+    uint8_t *block;         /* Raw bytes of the open block */
+    size_t block_fill;
+    uint8_t *packed;        /* Compressed block */
+    uint16_t *table;        /* Compressor hash table */
+    uint64_t raw;           /* Bytes before compression */
+} fs_writer_t;
+
+/* Input: the same two sources */
+typedef struct fs_reader {
+    blkdev_t *dev;          /* NULL for memory */
+    const uint8_t *mem;
+    uint64_t size;          /* Image bytes */
+    uint64_t pos;           /* Bytes consumed */
+    size_t head;            /* Next unread byte in fs_chunk */
+    size_t fill;            /* Bytes in fs_chunk */
+    uint32_t sum;           /* Checksum of what was consumed */
+
+    /* Decompression (FS_IMAGE_LZ4) */
+    bool compressed;
+    uint8_t *block;         /* Current block, decompressed */
+    size_t block_len;
+    size_t block_head;      /* Next unread byte in block */
+    uint8_t *packed;        /* Compressed block as read */
+} fs_reader_t;
 
 /**
- * Recursively serialize an inode and its children
+ * Fold bytes into an FNV-1a checksum
  */
-static ssize_t serialize_inode(vfs_inode_t *inode, void *buffer, size_t buffer_size,
-                                size_t *offset, uint64_t parent_ino, const char *name)
+static uint32_t fs_checksum(uint32_t sum, const void *data, size_t len)
 {
-    fs_inode_entry_t entry;
-    ramfs_inode_t *ramfs_data;
-    ramfs_dirent_t *child;
-    size_t entry_offset;
-    size_t data_offset;
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum = (sum ^ p[i]) * FS_FNV_PRIME;
+    }
+    return sum;
+}
+
+/**
+ * Append bytes to the image as they are
+ */
+static void fs_emit(fs_writer_t *w, const void *data, size_t len)
+{
+    if (w->failed) {
+        return;
+    }
+
+    if (w->dev == NULL) {
+        if (len > w->mem_size - w->written) {
+            klog_error("Buffer too small for filesystem image");
+            w->failed = true;
+            return;
+        }
+        memcpy(w->mem + w->written, data, len);
+    } else if (bcache_write(w->dev, w->base + w->written, data, len) != 0) {
+        klog_error("Failed to write filesystem image to '%s'", w->dev->name);
+        w->failed = true;
+        return;
+    }
+    w->written += len;
+}
+
+/**
+ * Compress the open block and write it out as a frame
+ * A block that does not shrink is stored as it is.
+ */
+static void fs_pack(fs_writer_t *w)
+{
+    fs_block_t frame;
+    size_t packed;
+
+    if (w->block_fill == 0) {
+        return;
+    }
+
+    packed = lz4_compress(w->block, w->block_fill, w->packed,
+                          LZ4_BOUND(FS_BLOCK_SIZE), w->table);
+
+    frame.raw_len = (uint32_t)w->block_fill;
+    if (packed == 0 || packed >= w->block_fill) {
+        frame.packed_len = 0;
+        fs_emit(w, &frame, sizeof(frame));
+        fs_emit(w, w->block, w->block_fill);
+    } else {
+        frame.packed_len = (uint32_t)packed;
+        fs_emit(w, &frame, sizeof(frame));
+        fs_emit(w, w->packed, packed);
+    }
+    w->block_fill = 0;
+}
+
+/**
+ * Append bytes to the image
+ */
+static void fs_put(fs_writer_t *w, const void *data, size_t len)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    size_t n;
+
+    if (w->failed) {
+        return;
+    }
+    w->sum = fs_checksum(w->sum, in, len);
+    w->raw += len;
+
+    if (!w->compress) {
+        fs_emit(w, in, len);
+        return;
+    }
+
+    while (len > 0) {
+        n = FS_BLOCK_SIZE - w->block_fill;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->block + w->block_fill, in, n);
+        w->block_fill += n;
+        in += n;
+        len -= n;
+        if (w->block_fill == FS_BLOCK_SIZE) {
+            fs_pack(w);
+        }
+    }
+}
+
+/**
+ * Close the open block
+ */
+static void fs_flush(fs_writer_t *w)
+{
+    if (w->compress) {
+        fs_pack(w);
+    }
+}
+
+/**
+ * Switch a writer to compressed output
+ * @return 0 on success, -1 if out of memory
+ */
+static int fs_writer_compress(fs_writer_t *w)
+{
+    w->block = (uint8_t *)kmalloc(FS_BLOCK_SIZE);
+    w->packed = (uint8_t *)kmalloc(LZ4_BOUND(FS_BLOCK_SIZE));
+    w->table = (uint16_t *)kmalloc(LZ4_HASH_SIZE * sizeof(uint16_t));
+    if (w->block == NULL || w->packed == NULL || w->table == NULL) {
+        klog_error("Out of memory for image compression");
+        return -1;
+    }
+    w->compress = true;
+    return 0;
+}
+
+/**
+ * Free a writer's compression buffers
+ */
+static void fs_writer_release(fs_writer_t *w)
+{
+    kfree(w->block);
+    kfree(w->packed);
+    kfree(w->table);
+    w->block = NULL;
+    w->packed = NULL;
+    w->table = NULL;
+    w->compress = false;
+}
+
+/**
+ * Take up to want bytes of the stored image without copying
+ * @return Pointer to len bytes, NULL at the end or on a read error
+ */
+static const uint8_t *fs_next_raw(fs_reader_t *r, size_t want, size_t *len)
+{
+    const uint8_t *p;
+    uint64_t left;
+    size_t n;
+
+    left = r->size - r->pos;
+    if (left == 0 || want == 0) {
+        return NULL;
+    }
+
+    if (r->dev == NULL) {
+        n = (want < left) ? want : (size_t)left;
+        p = r->mem + r->pos;
+    } else {
+        if (r->head == r->fill) {
+            n = (left < FS_CHUNK_SIZE) ? (size_t)left : FS_CHUNK_SIZE;
+            if (bcache_read(r->dev, r->pos, fs_chunk, n) != 0) {
+                klog_error("Failed to read filesystem image from '%s'", r->dev->name);
+                return NULL;
+            }
+            r->head = 0;
+            r->fill = n;
+        }
+        n = r->fill - r->head;
+        if (n > want) {
+            n = want;
+        }
+        p = fs_chunk + r->head;
+        r->head += n;
+    }
+
+    r->pos += n;
+    *len = n;
+    return p;
+}
 
-    klog_debug("serialize_inode: inode=%p name='%s' offset=%u", (void *)inode, name, (uint32_t)*offset);
+/**
+ * Read exactly len bytes of the stored image
+ */
+static int fs_read_raw(fs_reader_t *r, void *buf, size_t len)
+{
+    uint8_t *out = (uint8_t *)buf;
+    const uint8_t *p;
+    size_t n;
 
-    if (*offset + sizeof(fs_inode_entry_t) > buffer_size) {
-        klog_error("Buffer too small for inode entry");
+    while (len > 0) {
+        p = fs_next_raw(r, len, &n);
+        if (p == NULL) {
+            return -1;
+        }
+        memcpy(out, p, n);
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Read and decompress the next block
+ */
+static int fs_unpack(fs_reader_t *r)
+{
+    fs_block_t frame;
+
+    if (fs_read_raw(r, &frame, sizeof(frame)) != 0) {
+        return -1;
+    }
+    if (frame.raw_len == 0) {
+        /* Never-written device space */
+        return -1;
+    }
+    if (frame.raw_len > FS_BLOCK_SIZE ||
+        frame.packed_len > LZ4_BOUND(FS_BLOCK_SIZE)) {
+        klog_error("Bad block in filesystem image");
         return -1;
     }
 
-    /* Prepare inode entry */
-    klog_debug("serialize_inode: preparing entry");
-    entry.ino = inode->ino;
-    klog_debug("serialize_inode: set ino=%llu", entry.ino);
-    entry.type = inode->type;
-    klog_debug("serialize_inode: set type=%u", entry.type);
-    entry.mode = inode->mode;
-    klog_debug("serialize_inode: set mode=%u", entry.mode);
-    entry.size = inode->size;
-    klog_debug("serialize_inode: set size=%llu", entry.size);
-    entry.parent_ino = parent_ino;
-    klog_debug("serialize_inode: set parent_ino=%llu", parent_ino);
-
-    /* Manual string copy to avoid potential strncpy issues */
-    klog_debug("serialize_inode: copying name '%s'", name);
-    {
-        size_t i;
-        for (i = 0; i < sizeof(entry.name) - 1 && name[i] != '\0'; i++) {
-            entry.name[i] = name[i];
-        }
-        entry.name[i] = '\0';
-    }
-    klog_debug("serialize_inode: name copied");
-
-    entry.data_offset = 0;
-    entry.num_children = 0;
-    klog_debug("serialize_inode: entry prepared");
-
-    klog_debug("serialize_inode: getting fs_data");
-    ramfs_data = (ramfs_inode_t *)inode->fs_data;
-    klog_debug("serialize_inode: ramfs_data=%p", (void *)ramfs_data);
-
-    /* If it's a file with data, save data offset */
-    if (inode->type == VFS_FILE_REGULAR && ramfs_data->data != NULL && inode->size > 0) {
-        klog_debug("serialize_inode: file with data, size=%llu", inode->size);
-        /* Reserve space for entry first */
-        entry_offset = *offset;
-        *offset += sizeof(fs_inode_entry_t);
-
-        /* Write file data */
-        data_offset = *offset;
-        if (*offset + inode->size > buffer_size) {
-            klog_error("Buffer too small for file data");
+    if (frame.packed_len == 0) {
+        if (fs_read_raw(r, r->block, frame.raw_len) != 0) {
             return -1;
         }
+    } else if (fs_read_raw(r, r->packed, frame.packed_len) != 0 ||
+               lz4_decompress(r->packed, frame.packed_len, r->block, FS_BLOCK_SIZE) !=
+               (ssize_t)frame.raw_len) {
+        klog_error("Bad block in filesystem image");
+        return -1;
+    }
 
-        klog_debug("serialize_inode: copying file data");
-        memcpy((char *)buffer + *offset, ramfs_data->data, inode->size);
-        *offset += inode->size;
-
-        entry.data_offset = (uint32_t)data_offset;
-
-        /* Write entry */
-        klog_debug("serialize_inode: writing file entry");
-        memcpy((char *)buffer + entry_offset, &entry, sizeof(entry));
-    } else if (inode->type == VFS_FILE_DIRECTORY) {
-        klog_debug("serialize_inode: directory with %u children", (uint32_t)ramfs_data->num_entries);
-        /* For directories, count children */
-        entry.num_children = (uint32_t)ramfs_data->num_entries;
-
-        /* Write entry */
-        entry_offset = *offset;
-        klog_debug("serialize_inode: writing directory entry");
-        memcpy((char *)buffer + *offset, &entry, sizeof(entry));
-        *offset += sizeof(fs_inode_entry_t);
-
-        /* Recursively serialize children */
-        klog_debug("serialize_inode: serializing children");
-        child = ramfs_data->entries;
-        while (child != NULL) {
-            klog_debug("serialize_inode: serializing child '%s'", child->name);
-            ssize_t ret = serialize_inode(child->inode, buffer, buffer_size, offset,
-                                          inode->ino, child->name);
-            if (ret < 0) {
-                return ret;
-            }
-            child = child->next;
+    r->block_len = frame.raw_len;
+    r->block_head = 0;
+    return 0;
+}
+
+/**
+ * Take up to want bytes of the image without copying
+ * @return Pointer to len bytes, NULL at the end or on a read error
+ */
+static const uint8_t *fs_next(fs_reader_t *r, size_t want, size_t *len)
+{
+    const uint8_t *p;
+    size_t n;
+
+    if (!r->compressed) {
+        p = fs_next_raw(r, want, &n);
+        if (p == NULL) {
+            return NULL;
         }
     } else {
-        /* Empty file or other type */
-        klog_debug("serialize_inode: empty file or other type");
-        memcpy((char *)buffer + *offset, &entry, sizeof(entry));
-        *offset += sizeof(fs_inode_entry_t);
+        if (want == 0) {
+            return NULL;
+        }
+        if (r->block_head == r->block_len && fs_unpack(r) != 0) {
+            return NULL;
+        }
+        n = r->block_len - r->block_head;
+        if (n > want) {
+            n = want;
+        }
+        p = r->block + r->block_head;
+        r->block_head += n;
     }
 
-    klog_debug("serialize_inode: done for '%s'", name);
+    r->sum = fs_checksum(r->sum, p, n);
+    *len = n;
+    return p;
+}
+
+/**
+ * Check that no decompressed bytes are left over
+ * Segments end on block boundaries; the stored offset is only
+ * meaningful there.
+ */
+static inline bool fs_at_boundary(const fs_reader_t *r)
+{
+    return r->block_head == r->block_len;
+}
+
+/**
+ * Switch a reader to compressed input
+ * @return 0 on success, -1 if out of memory
+ */
+static int fs_reader_compress(fs_reader_t *r)
+{
+    r->block = (uint8_t *)kmalloc(FS_BLOCK_SIZE);
+    r->packed = (uint8_t *)kmalloc(LZ4_BOUND(FS_BLOCK_SIZE));
+    if (r->block == NULL || r->packed == NULL) {
+        klog_error("Out of memory for image decompression");
+        return -1;
+    }
+    r->compressed = true;
     return 0;
 }
 
 /**
- * Save filesystem to memory buffer
+ * Free a reader's decompression buffers
  */
-ssize_t fs_save(vfs_filesystem_t *fs, void *buffer, size_t buffer_size)
+static void fs_reader_release(fs_reader_t *r)
 {
-    fs_image_header_t header;
-    size_t offset;
+    kfree(r->block);
+    kfree(r->packed);
+    r->block = NULL;
+    r->packed = NULL;
+    r->compressed = false;
+}
 
-    if (fs == NULL || buffer == NULL || buffer_size < sizeof(header)) {
-        klog_error("Invalid parameters for fs_save");
+/**
+ * Read exactly len bytes, or skip them when buf is NULL
+ * @return 0 on success, -1 if the image ends first
+ */
+static int fs_get(fs_reader_t *r, void *buf, size_t len)
+{
+    uint8_t *out = (uint8_t *)buf;
+    const uint8_t *p;
+    size_t n;
+
+    while (len > 0) {
+        p = fs_next(r, len, &n);
+        if (p == NULL) {
+            return -1;
+        }
+        if (out != NULL) {
+            memcpy(out, p, n);
+            out += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Move to an absolute image offset
+ */
+static int fs_seek(fs_reader_t *r, uint64_t pos)
+{
+    if (pos > r->size) {
         return -1;
     }
+    r->pos = pos;
+    r->head = 0;
+    r->fill = 0;
+    r->block_len = 0;
+    r->block_head = 0;
+    return 0;
+}
 
-    klog_info("Saving filesystem...");
+/* ============================================================================
+ * Saving (v2)
+ * ============================================================================ */
+
+/* One save pass over the tree */
+typedef struct fs_saver {
+    fs_writer_t w;
+    bool full;              /* Write every inode, not just changed ones */
+    bool track;             /* Saving the device image: mark what went out clean */
+    uint64_t since;         /* Generation of the last save */
+    uint32_t records;
+    uint32_t inodes;        /* Inodes written */
+    uint64_t live;          /* Bytes a full image would take */
+} fs_saver_t;
+
+/**
+ * Start a record
+ */
+static void save_record(fs_saver_t *s, uint32_t type, uint64_t ino, size_t length)
+{
+    fs_record_t rec;
+
+    rec.type = type;
+    rec.length = (uint32_t)length;
+    rec.ino = ino;
+    fs_put(&s->w, &rec, sizeof(rec));
+    s->records++;
+}
+
+/**
+ * Write the data in a byte range of a file, holes left out
+ */
+static void save_extents(fs_saver_t *s, vfs_inode_t *inode, uint64_t start, uint64_t end)
+{
+    fs_data_record_t data;
+    const void *page;
+    uint64_t run;
+    size_t len;
+
+    while (start < end && !s->w.failed) {
+        page = ramfs_file_page(inode, start, &len);
+        if (len == 0) {
+            break;
+        }
+        if (page == NULL) {
+            start += len;
+            continue;
+        }
+
+        /* Measure the run of present pages, up to one record's worth */
+        run = 0;
+        while (start + run < end && run < FS_EXTENT_MAX &&
+               ramfs_file_page(inode, start + run, &len) != NULL) {
+            run += len;
+        }
+        if (run > end - start) {
+            run = end - start;
+        }
+        if (run > FS_EXTENT_MAX) {
+            run = FS_EXTENT_MAX;
+        }
+
+        data.offset = start;
+        save_record(s, FS_REC_DATA, inode->ino, sizeof(data) + (size_t)run);
+        fs_put(&s->w, &data, sizeof(data));
+
+        /* Pages go to the writer in place */
+        while (run > 0) {
+            page = ramfs_file_page(inode, start, &len);
+            if (len > run) {
+                len = (size_t)run;
+            }
+            fs_put(&s->w, page, len);
+            start += len;
+            run -= len;
+        }
+    }
+}
+
+/**
+ * Write an inode if it changed, then walk a directory's children
+ */
+static void save_inode(fs_saver_t *s, vfs_inode_t *inode)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+    bool changed = s->full || data->dirty_gen > s->since;
+    ramfs_dirent_t *child;
+    size_t length;
+
+    if (inode->type == VFS_FILE_REGULAR) {
+        s->live += sizeof(fs_record_t) * 2 + sizeof(fs_file_record_t) + inode->size;
+
+        if (changed) {
+            fs_file_record_t rec;
+            uint64_t start = 0;
+            uint64_t end = inode->size;
+
+            rec.mode = inode->mode;
+            rec.reserved = 0;
+            rec.size = inode->size;
+            rec.trunc = 0;
+            if (!s->full) {
+                /* Only what was written needs to go out again */
+                rec.trunc = (data->trunc_size < inode->size) ? data->trunc_size : inode->size;
+                start = data->dirty_start;
+                end = (data->dirty_end < inode->size) ? data->dirty_end : inode->size;
+            }
+
+            save_record(s, FS_REC_FILE, inode->ino, sizeof(rec));
+            fs_put(&s->w, &rec, sizeof(rec));
+            save_extents(s, inode, start, end);
+            if (s->track) {
+                ramfs_mark_clean(inode);
+            }
+            s->inodes++;
+        }
+        return;
+    }
+
+    if (inode->type != VFS_FILE_DIRECTORY) {
+        return;
+    }
+
+    /* Directories still in the initrd are read in, so the image is whole */
+    if (ramfs_dir_populate(inode) != 0) {
+        s->w.failed = true;
+        return;
+    }
+
+    length = sizeof(fs_dir_record_t);
+    for (child = data->entries; child != NULL; child = child->next) {
+        length += sizeof(fs_dir_child_t) + strlen(child->name);
+    }
+    s->live += sizeof(fs_record_t) + length;
+
+    if (changed) {
+        fs_dir_record_t rec;
+        fs_dir_child_t entry;
+
+        rec.mode = inode->mode;
+        rec.num_children = (uint32_t)data->num_entries;
+        save_record(s, FS_REC_DIR, inode->ino, length);
+        fs_put(&s->w, &rec, sizeof(rec));
+
+        for (child = data->entries; child != NULL; child = child->next) {
+            entry.ino = child->inode->ino;
+            entry.name_len = (uint32_t)strlen(child->name);
+            entry.reserved = 0;
+            fs_put(&s->w, &entry, sizeof(entry));
+            fs_put(&s->w, child->name, entry.name_len);
+        }
+        s->inodes++;
+    }
+
+    for (child = data->entries; child != NULL && !s->w.failed; child = child->next) {
+        save_inode(s, child->inode);
+    }
+}
+
+/**
+ * Write one segment: the changed inodes (or all of them) and a commit record
+ * @return 0 on success, -1 on error
+ */
+static int save_segment(fs_saver_t *s, vfs_filesystem_t *fs, uint32_t epoch,
+                        uint64_t generation)
+{
+    fs_segment_t seg;
+    fs_commit_t commit;
+
+    seg.magic = FS_SEGMENT_MAGIC;
+    seg.epoch = epoch;
+    seg.generation = generation;
+    seg.root_ino = fs->root->ino;
+
+    s->w.sum = FS_FNV_OFFSET;
+    fs_put(&s->w, &seg, sizeof(seg));
+
+    save_inode(s, fs->root);
+
+    commit.checksum = s->w.sum;
+    commit.records = s->records;
+    save_record(s, FS_REC_COMMIT, 0, sizeof(commit));
+    fs_put(&s->w, &commit, sizeof(commit));
+    fs_flush(&s->w);
+
+    return s->w.failed ? -1 : 0;
+}
+
+/**
+ * Write the image header
+ */
+static void save_header(fs_writer_t *w, uint32_t epoch, uint32_t flags)
+{
+    fs_image_header_t header;
 
-    /* Prepare header */
     header.magic = FS_MAGIC;
     header.version = FS_VERSION;
     header.timestamp = 0;  /* TODO: Get real timestamp when RTC is implemented */
-    header.num_inodes = 0;  /* Will be calculated during serialization */
-    header.data_size = 0;
+    header.epoch = epoch;  /* v2 keeps counts in the segments */
+    header.flags = flags;
 
-    /* Write header */
-    offset = 0;
-    klog_debug("Writing header at offset %u", (uint32_t)offset);
-    memcpy((char *)buffer + offset, &header, sizeof(header));
-    offset += sizeof(header);
-    klog_debug("Header written, offset now %u", (uint32_t)offset);
+    /* Never compressed, so a load can tell how to read the rest */
+    fs_emit(w, &header, sizeof(header));
+}
 
-    /* Serialize filesystem tree starting from root */
-    if (fs->root != NULL) {
-        klog_debug("Serializing root inode at %p", (void *)fs->root);
-        ssize_t ret = serialize_inode(fs->root, buffer, buffer_size, &offset, 0, "/");
-        if (ret < 0) {
-            klog_error("Failed to serialize filesystem");
-            return ret;
+/**
+ * Save filesystem to memory buffer
+ */
+ssize_t fs_save(vfs_filesystem_t *fs, void *buffer, size_t buffer_size, uint32_t flags)
+{
+    bool compress = (flags & FS_SAVE_COMPRESS) != 0;
+    fs_saver_t s;
+    int ret;
+
+    if (fs == NULL || fs->root == NULL || buffer == NULL ||
+        buffer_size < sizeof(fs_image_header_t)) {
+        klog_error("Invalid parameters for fs_save");
+        return -1;
+    }
+
+    klog_info("Saving filesystem...");
+
+    memset(&s, 0, sizeof(s));
+    s.w.mem = (uint8_t *)buffer;
+    s.w.mem_size = buffer_size;
+    s.full = true;
+
+    save_header(&s.w, 0, compress ? FS_IMAGE_LZ4 : 0);
+    ret = -1;
+    if (!compress || fs_writer_compress(&s.w) == 0) {
+        ret = save_segment(&s, fs, 0, ramfs_get_generation());
+    }
+    fs_writer_release(&s.w);
+    if (ret != 0) {
+        klog_error("Failed to serialize filesystem");
+        return -1;
+    }
+
+    klog_info("Filesystem saved (%u bytes, %u before compression)",
+              (uint32_t)s.w.written, (uint32_t)s.w.raw);
+    return (ssize_t)s.w.written;
+}
+
+/* ============================================================================
+ * Loading (v2)
+ * ============================================================================ */
+
+/* An inode seen while replaying */
+typedef struct fs_load_node {
+    uint64_t ino;           /* 0 = free slot */
+    vfs_inode_t *inode;
+    uint8_t *children;      /* Entries of the latest directory record (arena) */
+    uint32_t children_len;
+    uint32_t num_children;
+    bool linked;            /* Reached from the root */
+} fs_load_node_t;
+
+/* Replay state: inodes by number */
+typedef struct fs_loader {
+    vfs_filesystem_t *fs;
+    uint32_t epoch;         /* Segments of other epochs are stale */
+    fs_load_node_t *nodes;
+    size_t size;            /* Slots, a power of two */
+    size_t count;
+    size_t records;         /* File and directory records in complete segments */
+    arena_t *arena;         /* Directory listings, freed with the loader */
+    uint64_t root_ino;
+} fs_loader_t;
+
+/**
+ * Rehash the inode table into a larger one
+ * @return 0 on success, -1 if out of memory
+ */
+static int load_resize(fs_loader_t *l, size_t size)
+{
+    fs_load_node_t *nodes;
+    size_t i, j;
+
+    nodes = (fs_load_node_t *)kcalloc(size, sizeof(fs_load_node_t));
+    if (nodes == NULL) {
+        return -1;
+    }
+    for (i = 0; i < l->size; i++) {
+        if (l->nodes[i].ino == 0) {
+            continue;
+        }
+        j = (size_t)l->nodes[i].ino & (size - 1);
+        while (nodes[j].ino != 0) {
+            j = (j + 1) & (size - 1);
+        }
+        nodes[j] = l->nodes[i];
+    }
+    kfree(l->nodes);
+    l->nodes = nodes;
+    l->size = size;
+    return 0;
+}
+
+/**
+ * Size the inode table for what the check pass counted
+ * Every inode has at least one record, so the table never grows again.
+ */
+static void load_reserve(fs_loader_t *l, size_t inodes)
+{
+    size_t size = 64;
+
+    while ((inodes + 1) * 4 > size * 3) {
+        size *= 2;
+    }
+    if (size > l->size) {
+        /* Too large to get: load_find() grows it as it goes instead */
+        load_resize(l, size);
+    }
+}
+
+/**
+ * Find an inode's slot, optionally adding it
+ */
+static fs_load_node_t *load_find(fs_loader_t *l, uint64_t ino, bool create)
+{
+    size_t i;
+
+    if (ino == 0) {
+        return NULL;
+    }
+
+    if (create && (l->count + 1) * 4 > l->size * 3 &&
+        load_resize(l, (l->size != 0) ? l->size * 2 : 64) != 0) {
+        return NULL;
+    }
+
+    if (l->size == 0) {
+        return NULL;
+    }
+
+    i = (size_t)ino & (l->size - 1);
+    while (l->nodes[i].ino != 0) {
+        if (l->nodes[i].ino == ino) {
+            return &l->nodes[i];
+        }
+        i = (i + 1) & (l->size - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    l->nodes[i].ino = ino;
+    l->count++;
+    return &l->nodes[i];
+}
+
+/**
+ * Get the inode a record is about, creating it on first sight
+ */
+static fs_load_node_t *load_node(fs_loader_t *l, uint64_t ino, vfs_file_type_t type,
+                                 uint32_t mode)
+{
+    fs_load_node_t *node;
+
+    node = load_find(l, ino, true);
+    if (node == NULL) {
+        klog_error("Out of memory loading inode %llu", ino);
+        return NULL;
+    }
+
+    if (node->inode == NULL) {
+        node->inode = ramfs_alloc_inode(l->fs, ino, type, mode);
+        if (node->inode == NULL) {
+            klog_error("Out of memory loading inode %llu", ino);
+            return NULL;
+        }
+    } else if (node->inode->type != type) {
+        klog_error("Inode %llu changes type in image", ino);
+        return NULL;
+    }
+
+    node->inode->mode = mode;
+    return node;
+}
+
+/**
+ * Apply one record
+ * The payload is always consumed, so the checksum covers it.
+ */
+static int load_record(fs_loader_t *l, fs_reader_t *r, const fs_record_t *rec, bool apply)
+{
+    fs_load_node_t *node;
+    const uint8_t *p;
+    size_t len;
+
+    switch (rec->type) {
+    case FS_REC_FILE: {
+        fs_file_record_t file;
+
+        if (rec->length != sizeof(file) || fs_get(r, &file, sizeof(file)) != 0) {
+            return -1;
+        }
+        if (!apply) {
+            return 0;
+        }
+        if (file.size > RAMFS_MAX_FILE_SIZE || file.trunc > file.size) {
+            klog_error("Bad size for inode %llu", rec->ino);
+            return -1;
+        }
+
+        node = load_node(l, rec->ino, VFS_FILE_REGULAR, file.mode);
+        if (node == NULL) {
+            return -1;
+        }
+        if (file.trunc < node->inode->size && ramfs_truncate(node->inode, file.trunc) != 0) {
+            return -1;
+        }
+        /* Anything past what the data records fill in is a hole */
+        if (file.size > node->inode->size) {
+            node->inode->size = file.size;
+        }
+        return 0;
+    }
+
+    case FS_REC_DIR: {
+        fs_dir_record_t dir;
+        uint8_t *children;
+        uint32_t children_len;
+
+        if (rec->length < sizeof(dir) || rec->length > FS_DIR_RECORD_MAX ||
+            fs_get(r, &dir, sizeof(dir)) != 0) {
+            return -1;
+        }
+        children_len = rec->length - (uint32_t)sizeof(dir);
+        if (!apply) {
+            return fs_get(r, NULL, children_len);
+        }
+
+        children = NULL;
+        if (children_len > 0) {
+            children = (uint8_t *)arena_alloc(l->arena, children_len);
+            if (children == NULL) {
+                klog_error("Out of memory loading directory %llu", rec->ino);
+                return -1;
+            }
+        }
+        node = load_node(l, rec->ino, VFS_FILE_DIRECTORY, dir.mode);
+        if (node == NULL || fs_get(r, children, children_len) != 0) {
+            return -1;
+        }
+
+        /* The latest listing wins (an older one stays in the arena);
+         * entries are linked once all are read */
+        node->children = children;
+        node->children_len = children_len;
+        node->num_children = dir.num_children;
+        return 0;
+    }
+
+    case FS_REC_DATA: {
+        fs_data_record_t data;
+        uint64_t offset;
+        size_t left;
+
+        if (rec->length < sizeof(data) || fs_get(r, &data, sizeof(data)) != 0) {
+            return -1;
+        }
+        left = rec->length - sizeof(data);
+        if (!apply) {
+            return fs_get(r, NULL, left);
+        }
+
+        node = load_find(l, rec->ino, false);
+        if (node == NULL || node->inode == NULL ||
+            node->inode->type != VFS_FILE_REGULAR) {
+            klog_error("Data for unknown inode %llu", rec->ino);
+            return -1;
+        }
+
+        /* Straight from the read chunk into the file's pages */
+        offset = data.offset;
+        while (left > 0) {
+            p = fs_next(r, left, &len);
+            if (p == NULL) {
+                return -1;
+            }
+            if (ramfs_write_data(node->inode, offset, p, len) != (ssize_t)len) {
+                klog_error("Failed to allocate file data");
+                return -1;
+            }
+            offset += len;
+            left -= len;
+        }
+        return 0;
+    }
+
+    default:
+        /* Unknown records are skipped */
+        return fs_get(r, NULL, rec->length);
+    }
+}
+
+/**
+ * Replay segments from the reader's position
+ * Without apply, this only finds where the last complete segment ends.
+ * @return End offset of the last segment with a matching commit
+ */
+static uint64_t load_segments(fs_loader_t *l, fs_reader_t *r, uint64_t limit, bool apply)
+{
+    uint64_t valid_end = r->pos;
+    fs_segment_t seg;
+    fs_record_t rec;
+    fs_commit_t commit;
+    uint32_t records, inodes;
+    uint32_t sum;
+
+    while (r->pos < limit) {
+        r->sum = FS_FNV_OFFSET;
+        if (fs_get(r, &seg, sizeof(seg)) != 0 || seg.magic != FS_SEGMENT_MAGIC ||
+            seg.epoch != l->epoch) {
+            break;
+        }
+
+        records = 0;
+        inodes = 0;
+        for (;;) {
+            sum = r->sum;
+            if (fs_get(r, &rec, sizeof(rec)) != 0) {
+                return valid_end;
+            }
+            if (rec.type == FS_REC_COMMIT) {
+                break;
+            }
+            if (load_record(l, r, &rec, apply) != 0) {
+                return valid_end;
+            }
+            if (rec.type == FS_REC_FILE || rec.type == FS_REC_DIR) {
+                inodes++;
+            }
+            records++;
+        }
+
+        if (rec.length != sizeof(commit) || fs_get(r, &commit, sizeof(commit)) != 0 ||
+            commit.checksum != sum || commit.records != records || !fs_at_boundary(r)) {
+            break;
+        }
+
+        if (apply) {
+            l->root_ino = seg.root_ino;
+        } else {
+            l->records += inodes;
+        }
+        valid_end = r->pos;
+    }
+
+    return valid_end;
+}
+
+/**
+ * Link a directory's entries, depth first
+ */
+static void load_link(fs_loader_t *l, fs_load_node_t *dir)
+{
+    const uint8_t *p = dir->children;
+    const uint8_t *end = dir->children + dir->children_len;
+    fs_dir_child_t entry;
+    fs_load_node_t *child;
+    char name[64];
+    uint32_t i, n;
+
+    /* Build the index once; a listing can't hold more than fit in it */
+    n = dir->children_len / (uint32_t)sizeof(entry);
+    ramfs_dir_reserve(dir->inode, (dir->num_children < n) ? dir->num_children : n);
+
+    for (i = 0; i < dir->num_children; i++) {
+        if ((size_t)(end - p) < sizeof(entry)) {
+            break;
+        }
+        memcpy(&entry, p, sizeof(entry));
+        p += sizeof(entry);
+        if (entry.name_len >= sizeof(name) || (size_t)(end - p) < entry.name_len) {
+            break;
+        }
+        memcpy(name, p, entry.name_len);
+        name[entry.name_len] = '\0';
+        p += entry.name_len;
+
+        /* A name of a removed inode, or a second name for one, is dropped */
+        child = load_find(l, entry.ino, false);
+        if (child == NULL || child->inode == NULL || child->linked) {
+            continue;
+        }
+        if (ramfs_dir_link(dir->inode, name, child->inode) != 0) {
+            continue;
+        }
+        child->linked = true;
+        child->inode->parent = dir->inode;
+        ramfs_mark_clean(child->inode);
+
+        if (child->inode->type == VFS_FILE_DIRECTORY) {
+            load_link(l, child);
         }
     }
+}
 
-    /* Update header with final size */
-    header.data_size = (uint32_t)(offset - sizeof(header));
-    memcpy(buffer, &header, sizeof(header));
+/**
+ * Free the replay state, and the inodes the tree did not take
+ */
+static void load_finish(fs_loader_t *l)
+{
+    size_t i;
 
-    klog_info("Filesystem saved (%u bytes)", (uint32_t)offset);
-    return (ssize_t)offset;
+    for (i = 0; i < l->size; i++) {
+        if (l->nodes[i].inode != NULL && !l->nodes[i].linked) {
+            ramfs_free_inode(l->nodes[i].inode);
+        }
+    }
+    kfree(l->nodes);
+    arena_destroy(l->arena);
 }
 
 /**
- * Recursively deserialize inodes
+ * Load a v2 image from the reader's position
+ * @param end Receives the end of the last complete segment
+ * @return 0 on success, -1 on error
  */
-static int deserialize_inodes(vfs_filesystem_t *fs, const void *buffer, size_t buffer_size,
-                               size_t *offset, vfs_inode_t *parent, uint32_t num_entries)
+static int load_v2(vfs_filesystem_t *fs, fs_reader_t *r, uint32_t epoch, uint64_t *end)
+{
+    fs_loader_t l;
+    fs_load_node_t *root;
+    uint64_t start = r->pos;
+    uint64_t valid_end;
+    uint64_t t0 = timer_get_ns();
+
+    memset(&l, 0, sizeof(l));
+    l.fs = fs;
+    l.epoch = epoch;
+
+    /* Find the complete segments first, so a torn save is never half applied */
+    valid_end = load_segments(&l, r, r->size, false);
+    if (valid_end == start || fs_seek(r, start) != 0) {
+        klog_error("No complete segment in filesystem image");
+        return -1;
+    }
+
+    /* Their checksums matched: size the replay state from what they hold */
+    l.arena = arena_create(FS_LOAD_ARENA_ORDER);
+    if (l.arena == NULL) {
+        klog_error("Out of memory loading filesystem image");
+        return -1;
+    }
+    load_reserve(&l, l.records);
+
+    if (load_segments(&l, r, valid_end, true) != valid_end) {
+        klog_error("Failed to replay filesystem image");
+        load_finish(&l);
+        return -1;
+    }
+
+    root = load_find(&l, l.root_ino, false);
+    if (root == NULL || root->inode == NULL || root->inode->type != VFS_FILE_DIRECTORY) {
+        klog_error("Filesystem image has no root directory");
+        load_finish(&l);
+        return -1;
+    }
+
+    root->linked = true;
+    root->inode->parent = NULL;
+    load_link(&l, root);
+    ramfs_mark_clean(root->inode);
+
+    /* Called before mounting: nothing refers to the empty root yet */
+    if (fs->root != NULL) {
+        ramfs_free_inode(fs->root);
+    }
+    fs->root = root->inode;
+
+    klog_info("Loaded %u inodes in %u us", (uint32_t)l.count,
+              (uint32_t)((timer_get_ns() - t0) / 1000));
+    load_finish(&l);
+
+    *end = valid_end;
+    return 0;
+}
+
+/* ============================================================================
+ * Loading (v1)
+ * ============================================================================ */
+
+/**
+ * Recursively deserialize v1 inodes
+ */
+static int deserialize_inodes(vfs_filesystem_t *fs, fs_reader_t *r,
+                               vfs_inode_t *parent, uint32_t num_entries)
 {
     uint32_t i;
     fs_inode_entry_t entry;
     vfs_inode_t *inode;
-    ramfs_inode_t *ramfs_data;
-    ramfs_dirent_t *dir_entry;
-    ramfs_inode_t *parent_data;
+    const uint8_t *p;
+    uint64_t offset, left;
+    size_t len;
 
     for (i = 0; i < num_entries; i++) {
         /* Read entry */
-        if (*offset + sizeof(entry) > buffer_size) {
+        if (fs_get(r, &entry, sizeof(entry)) != 0) {
             klog_error("Buffer underrun reading inode entry");
             return -1;
         }
 
-        memcpy(&entry, (const char *)buffer + *offset, sizeof(entry));
-        *offset += sizeof(entry);
-
         /* Create inode */
-        inode = (vfs_inode_t *)kmalloc(sizeof(vfs_inode_t));
+        inode = ramfs_alloc_inode(fs, entry.ino, (vfs_file_type_t)entry.type, entry.mode);
         if (inode == NULL) {
             klog_error("Failed to allocate inode");
             return -1;
         }
+        inode->parent = parent;
 
-        ramfs_data = (ramfs_inode_t *)kmalloc(sizeof(ramfs_inode_t));
-        if (ramfs_data == NULL) {
-            kfree(inode);
-            klog_error("Failed to allocate ramfs data");
-            return -1;
-        }
-
-        /* Initialize inode */
-        inode->ino = entry.ino;
-        inode->type = (vfs_file_type_t)entry.type;
-        inode->mode = entry.mode;
-        inode->size = entry.size;
-        inode->blocks = 0;
-        inode->atime = 0;
-        inode->mtime = 0;
-        inode->ctime = 0;
-        inode->nlinks = 1;
-        inode->uid = 0;
-        inode->gid = 0;
-        inode->fs_data = ramfs_data;
-        inode->fs = fs;
-
-        /* Initialize ramfs data */
-        ramfs_data->data = NULL;
-        ramfs_data->data_size = 0;
-        ramfs_data->entries = NULL;
-        ramfs_data->num_entries = 0;
-
-        /* Load file data if present */
+        /* Load file data if present; it follows the entry */
         if (inode->type == VFS_FILE_REGULAR && entry.data_offset > 0 && entry.size > 0) {
-            ramfs_data->data = (char *)kmalloc(entry.size);
-            if (ramfs_data->data == NULL) {
-                kfree(ramfs_data);
-                kfree(inode);
-                klog_error("Failed to allocate file data");
-                return -1;
-            }
-
-            if (entry.data_offset + entry.size > buffer_size) {
-                kfree(ramfs_data->data);
-                kfree(ramfs_data);
-                kfree(inode);
+            if (entry.data_offset < r->pos || entry.size > RAMFS_MAX_FILE_SIZE ||
+                fs_get(r, NULL, entry.data_offset - r->pos) != 0) {
+                ramfs_free_inode(inode);
                 klog_error("Invalid data offset");
                 return -1;
             }
 
-            memcpy(ramfs_data->data, (const char *)buffer + entry.data_offset, entry.size);
-            ramfs_data->data_size = entry.size;
-
-            /* Advance offset past the file data */
-            *offset = (size_t)entry.data_offset + (size_t)entry.size;
+            offset = 0;
+            while (offset < entry.size) {
+                p = fs_next(r, (size_t)(entry.size - offset), &len);
+                if (p == NULL ||
+                    ramfs_write_data(inode, offset, p, len) != (ssize_t)len) {
+                    ramfs_free_inode(inode);
+                    klog_error("Failed to load file data");
+                    return -1;
+                }
+                offset += len;
+            }
         }
 
         /* Add to parent directory if not root */
         if (parent != NULL) {
-            parent_data = (ramfs_inode_t *)parent->fs_data;
-
-            dir_entry = (ramfs_dirent_t *)kmalloc(sizeof(ramfs_dirent_t));
-            if (dir_entry == NULL) {
-                if (ramfs_data->data != NULL) {
-                    kfree(ramfs_data->data);
-                }
-                kfree(ramfs_data);
-                kfree(inode);
-                klog_error("Failed to allocate directory entry");
+            /* Saved in directory order, so appending restores it */
+            entry.name[sizeof(entry.name) - 1] = '\0';
+            if (ramfs_dir_link(parent, entry.name, inode) != 0) {
+                ramfs_free_inode(inode);
+                klog_error("Failed to add directory entry");
                 return -1;
             }
-
-            strncpy(dir_entry->name, entry.name, sizeof(dir_entry->name) - 1);
-            dir_entry->name[sizeof(dir_entry->name) - 1] = '\0';
-            dir_entry->inode = inode;
-            dir_entry->next = parent_data->entries;
-
-            parent_data->entries = dir_entry;
-            parent_data->num_entries++;
         } else {
             /* This is the root inode */
             fs->root = inode;
@@ -287,10 +1186,14 @@ static int deserialize_inodes(vfs_filesystem_t *fs, const void *buffer, size_t b
         klog_debug("Loaded inode %llu: %s (type=%d, size=%llu)",
                    inode->ino, entry.name, inode->type, inode->size);
 
-        /* Recursively load children if directory */
+        /* Recursively load children if directory, into an index sized
+         * for as many as the rest of the image can hold */
         if (inode->type == VFS_FILE_DIRECTORY && entry.num_children > 0) {
-            int ret = deserialize_inodes(fs, buffer, buffer_size, offset,
-                                         inode, entry.num_children);
+            int ret;
+
+            left = (r->size - r->pos) / sizeof(entry);
+            ramfs_dir_reserve(inode, (entry.num_children < left) ? entry.num_children : left);
+            ret = deserialize_inodes(fs, r, inode, entry.num_children);
             if (ret < 0) {
                 return ret;
             }
@@ -301,44 +1204,76 @@ static int deserialize_inodes(vfs_filesystem_t *fs, const void *buffer, size_t b
 }
 
 /**
- * Load filesystem from memory buffer
+ * Load an image of either version from a reader
+ * @param end Receives the end of the usable image
+ * @return Image version, -1 on error
  */
-int fs_load(vfs_filesystem_t *fs, const void *buffer, size_t buffer_size)
+static int load_image(vfs_filesystem_t *fs, fs_reader_t *r, uint32_t *epoch, uint64_t *end)
 {
     fs_image_header_t header;
-    size_t offset;
 
-    if (fs == NULL || buffer == NULL || buffer_size < sizeof(header)) {
-        klog_error("Invalid parameters for fs_load");
+    if (fs_get(r, &header, sizeof(header)) != 0) {
+        klog_error("Filesystem image too short");
         return -1;
     }
 
-    /* Read header */
-    memcpy(&header, buffer, sizeof(header));
-
     /* Validate header */
     if (header.magic != FS_MAGIC) {
-        klog_debug("Invalid filesystem magic (expected 0x%x, got 0x%x)",
-                   FS_MAGIC, header.magic);
+        klog_warn("Invalid filesystem image (bad magic: 0x%x)", header.magic);
         return -1;
     }
 
-    if (header.version != FS_VERSION) {
-        klog_warn("Filesystem version mismatch (expected %u, got %u)",
-                  FS_VERSION, header.version);
-        return -1;
+    if (header.version == FS_VERSION) {
+        klog_info("Loading filesystem (version %u, %llu bytes%s)...",
+                  header.version, r->size,
+                  (header.flags & FS_IMAGE_LZ4) ? ", compressed" : "");
+        if ((header.flags & FS_IMAGE_LZ4) && fs_reader_compress(r) != 0) {
+            return -1;
+        }
+        *epoch = header.epoch;
+        return (load_v2(fs, r, header.epoch, end) == 0) ? FS_VERSION : -1;
+    }
+
+    if (header.version == FS_VERSION_V1) {
+        klog_info("Loading filesystem (version %u, %u bytes)...",
+                  header.version, header.data_size);
+        if (deserialize_inodes(fs, r, NULL, 1) < 0) {
+            return -1;
+        }
+        *epoch = 0;
+        *end = r->pos;
+        return FS_VERSION_V1;
     }
 
-    klog_info("Loading filesystem (version %u, %u bytes)...",
-              header.version, header.data_size);
+    klog_warn("Filesystem version mismatch (expected %u, got %u)",
+              FS_VERSION, header.version);
+    return -1;
+}
 
-    offset = sizeof(header);
+/**
+ * Load filesystem from memory buffer
+ */
+int fs_load(vfs_filesystem_t *fs, const void *buffer, size_t buffer_size)
+{
+    fs_reader_t r;
+    uint32_t epoch;
+    uint64_t end;
+    int ret;
 
-    /* Deserialize the root inode and its children */
-    int ret = deserialize_inodes(fs, buffer, buffer_size, &offset, NULL, 1);
+    if (fs == NULL || buffer == NULL || buffer_size < sizeof(fs_image_header_t)) {
+        klog_error("Invalid parameters for fs_load");
+        return -1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.mem = (const uint8_t *)buffer;
+    r.size = buffer_size;
+
+    ret = load_image(fs, &r, &epoch, &end);
+    fs_reader_release(&r);
     if (ret < 0) {
         klog_error("Failed to deserialize filesystem");
-        return ret;
+        return -1;
     }
 
     klog_info("Filesystem loaded successfully");
@@ -350,6 +1285,14 @@ int fs_load(vfs_filesystem_t *fs, const void *buffer, size_t buffer_size)
  */
 void *fs_get_storage_buffer(void)
 {
+    if (fs_storage == NULL) {
+        fs_storage = (char *)mm_alloc_huge(FS_IMAGE_MAX_SIZE);
+        if (fs_storage == NULL) {
+            klog_error("Failed to allocate filesystem storage buffer");
+            return NULL;
+        }
+        memset(fs_storage, 0, FS_IMAGE_MAX_SIZE);
+    }
     return fs_storage;
 }
 
@@ -361,141 +1304,241 @@ size_t fs_get_storage_size(void)
     return FS_IMAGE_MAX_SIZE;
 }
 
+/* ============================================================================
+ * Device Image
+ * ============================================================================ */
+
 /**
- * Save filesystem to disk via semihosting
- * Writes filesystem image to host file system
+ * Get the device saves go to
  */
-int fs_save_to_disk(vfs_filesystem_t *fs)
+static blkdev_t *persist_device(void)
 {
-    void *buffer;
-    size_t buffer_size;
-    ssize_t bytes_saved;
-    int host_fd;
-    size_t not_written;
-
-    klog_info("Saving filesystem via semihosting...");
-
-    /* Check if semihosting is available */
-    if (!semihost_available()) {
-        klog_warn("Semihosting not available - cannot save to host");
-        klog_info("Start QEMU with: -semihosting-config enable=on,target=native");
-        return -1;
+    if (persist.dev == NULL) {
+        persist.dev = blkdev_find(FS_DEVICE_DISK);
     }
-
-    /* Get storage buffer */
-    buffer = fs_get_storage_buffer();
-    buffer_size = fs_get_storage_size();
-
-    /* Save to memory buffer first */
-    bytes_saved = fs_save(fs, buffer, buffer_size);
-    if (bytes_saved < 0) {
-        klog_error("Failed to save filesystem to buffer");
-        return -1;
+    if (persist.dev == NULL) {
+        persist.dev = blkdev_find(FS_DEVICE_DEFAULT);
+    }
+    if (persist.dev == NULL) {
+        persist.dev = blkdev_find(FS_DEVICE_ALT);
     }
+    return persist.dev;
+}
 
-    klog_debug("Writing %d bytes to host file '%s'", (int)bytes_saved, FS_IMAGE_FILENAME);
+/**
+ * Choose the block device later saves go to
+ */
+int fs_set_persist_device(const char *name)
+{
+    blkdev_t *dev = blkdev_find(name);
 
-    /* Open host file for writing (create/truncate) */
-    host_fd = semihost_open(FS_IMAGE_FILENAME, SEMIHOST_OPEN_WB);
-    if (host_fd < 0) {
-        klog_error("Failed to open host file for writing");
+    if (dev == NULL) {
+        klog_error("No block device '%s'", name);
         return -1;
     }
-
-    /* Write data to host file */
-    not_written = semihost_write(host_fd, buffer, (size_t)bytes_saved);
-    if (not_written != 0) {
-        klog_error("Failed to write to host file (%u bytes not written)", (uint32_t)not_written);
-        semihost_close(host_fd);
-        return -1;
+    if (dev != persist.dev) {
+        persist.dev = dev;
+        persist.synced = false;
     }
-
-    /* Close file */
-    semihost_close(host_fd);
-
-    klog_info("Filesystem saved to '%s' (%d bytes)", FS_IMAGE_FILENAME, (int)bytes_saved);
     return 0;
 }
 
 /**
- * Load filesystem from disk via semihosting
- * Reads filesystem image from host file system
+ * Save filesystem to disk through the block cache
+ * Appends to the image when it can; the flusher writes it back
  */
-int fs_load_from_disk(vfs_filesystem_t *fs)
+int fs_save_to_disk(vfs_filesystem_t *fs, uint32_t flags)
 {
-    void *buffer;
-    size_t buffer_size;
+    blkdev_t *dev;
+    fs_saver_t s;
+    uint64_t generation;
+    uint64_t live;
+    uint32_t epoch;
+    bool compress;
     int ret;
-    int host_fd;
-    ssize_t file_len;
-    size_t not_read;
-    fs_image_header_t *header;
 
-    klog_info("Loading filesystem via semihosting...");
+    if (fs == NULL || fs->root == NULL) {
+        klog_error("Invalid parameters for fs_save_to_disk");
+        return -1;
+    }
 
-    /* Check if semihosting is available */
-    if (!semihost_available()) {
-        klog_info("Semihosting not available - starting with fresh filesystem");
+    dev = persist_device();
+    if (dev == NULL) {
+        klog_warn("No block device to save the filesystem to");
+        klog_info("Start QEMU with: -semihosting-config enable=on,target=native");
         return -1;
     }
 
-    /* Get storage buffer */
-    buffer = fs_get_storage_buffer();
-    buffer_size = fs_get_storage_size();
+    klog_info("Saving filesystem to '%s'...", dev->name);
 
-    /* Try to open host file for reading */
-    host_fd = semihost_open(FS_IMAGE_FILENAME, SEMIHOST_OPEN_RB);
-    if (host_fd < 0) {
-        klog_info("No saved filesystem found on host ('%s')", FS_IMAGE_FILENAME);
-        return -1;
+    /* Appends follow the image; asking for compression rewrites a raw one */
+    compress = (flags & FS_SAVE_COMPRESS) != 0;
+    if (persist.synced && persist.compressed) {
+        compress = true;
     }
 
-    /* Get file length */
-    file_len = semihost_flen(host_fd);
-    if (file_len <= 0) {
-        klog_warn("Host file is empty or error reading length");
-        semihost_close(host_fd);
-        return -1;
+    generation = ramfs_get_generation();
+    if (persist.synced && compress == persist.compressed &&
+        generation == persist.saved_gen) {
+        memset(&persist.last, 0, sizeof(persist.last));
+        persist.last.compressed = compress;
+        persist.last.image_size = persist.log_size;
+        persist.last.device = dev->name;
+        klog_info("Filesystem unchanged since last save");
+        return 0;
     }
 
-    if ((size_t)file_len > buffer_size) {
-        klog_error("Host file too large (%d bytes, max %u)", (int)file_len, (uint32_t)buffer_size);
-        semihost_close(host_fd);
-        return -1;
+    memset(&s, 0, sizeof(s));
+    s.since = persist.saved_gen;
+    s.full = !persist.synced || compress != persist.compressed;
+    s.track = true;
+
+    for (;;) {
+        /* A full save starts a new epoch over whatever the device held */
+        if (s.full) {
+            persist.epoch++;
+        }
+        epoch = persist.epoch;
+
+        s.w.dev = dev;
+        s.w.base = s.full ? 0 : persist.log_size;
+        if (s.full) {
+            save_header(&s.w, epoch, compress ? FS_IMAGE_LZ4 : 0);
+        }
+        ret = -1;
+        if (!compress || fs_writer_compress(&s.w) == 0) {
+            ret = save_segment(&s, fs, epoch, generation);
+        }
+        fs_writer_release(&s.w);
+
+        if (ret != 0) {
+            /* The image may end in a torn segment: rewrite it next time */
+            klog_error("Failed to write filesystem image");
+            persist.synced = false;
+            return -1;
+        }
+
+        if (s.full) {
+            persist.log_size = s.w.written;
+            break;
+        }
+        persist.log_size += s.w.written;
+
+        /* Once the log is mostly superseded records, compact it */
+        live = s.live;
+        if (persist.log_size <= live * 2 + FS_LOG_SLACK) {
+            break;
+        }
+        klog_info("Compacting filesystem image (%llu bytes, %llu live)",
+                  persist.log_size, live);
+        memset(&s, 0, sizeof(s));
+        s.full = true;
+        s.track = true;
     }
 
-    klog_debug("Reading %d bytes from host file", (int)file_len);
+    persist.synced = true;
+    persist.compressed = compress;
+    persist.saved_gen = generation;
 
-    /* Read file into buffer */
-    not_read = semihost_read(host_fd, buffer, (size_t)file_len);
-    if (not_read != 0) {
-        klog_error("Failed to read host file (%u bytes not read)", (uint32_t)not_read);
-        semihost_close(host_fd);
-        return -1;
+    persist.last.full = s.full;
+    persist.last.compressed = compress;
+    persist.last.inodes = s.inodes;
+    persist.last.raw_bytes = s.w.raw;
+    persist.last.written = s.w.written;
+    persist.last.image_size = persist.log_size;
+    persist.last.device = dev->name;
+
+    klog_info("Filesystem saved to '%s' (%s, %u inodes, %llu bytes written)",
+              dev->name, s.full ? "full" : "incremental", s.inodes, s.w.written);
+    return 0;
+}
+
+/**
+ * Get what the last save wrote
+ */
+void fs_get_persist_stats(fs_persist_stats_t *stats)
+{
+    if (stats != NULL) {
+        *stats = persist.last;
     }
+}
 
-    semihost_close(host_fd);
+/**
+ * Load the image on one device
+ * @return 0 on success, -1 on error, 1 if the device holds no image
+ */
+static int load_device(vfs_filesystem_t *fs, blkdev_t *dev)
+{
+    fs_image_header_t header;
+    fs_reader_t r;
+    uint64_t end = 0;
+    uint32_t epoch = 0;
+    int version;
 
-    /* Validate header */
-    header = (fs_image_header_t *)buffer;
-    if (header->magic != FS_MAGIC) {
-        klog_warn("Invalid filesystem image (bad magic: 0x%x)", header->magic);
+    if (bcache_read(dev, 0, &header, sizeof(header)) != 0) {
         return -1;
     }
+    if (header.magic != FS_MAGIC) {
+        klog_info("No saved filesystem found on '%s'", dev->name);
+        return 1;
+    }
 
-    klog_debug("Found filesystem: version %u, %u bytes data", header->version, header->data_size);
+    /* The image has no recorded length: it ends where its segments do */
+    memset(&r, 0, sizeof(r));
+    r.dev = dev;
+    r.size = dev->num_blocks << BLK_SHIFT;
 
-    /* Load from buffer into filesystem */
-    ret = fs_load(fs, buffer, buffer_size);
-    if (ret < 0) {
+    version = load_image(fs, &r, &epoch, &end);
+    persist.compressed = r.compressed;
+    fs_reader_release(&r);
+    if (version < 0) {
         klog_error("Failed to deserialize filesystem");
         return -1;
     }
 
-    klog_info("Filesystem loaded from '%s' successfully", FS_IMAGE_FILENAME);
+    /*
+     * A v2 image can take appended segments after its last complete one;
+     * anything past that is stale or torn and is overwritten. A v1 image
+     * is rewritten by the first save.
+     */
+    persist.dev = dev;
+    persist.synced = (version == FS_VERSION);
+    persist.epoch = epoch;
+    persist.saved_gen = ramfs_get_generation();
+    persist.log_size = end;
+
+    klog_info("Filesystem loaded from '%s' successfully", dev->name);
     return 0;
 }
 
+/**
+ * Load filesystem from disk
+ * Streams the image straight from the block cache into ramfs
+ */
+int fs_load_from_disk(vfs_filesystem_t *fs)
+{
+    const char *names[] = { FS_DEVICE_DISK, FS_DEVICE_DEFAULT, FS_DEVICE_ALT };
+    blkdev_t *dev;
+    uint32_t i;
+    int ret;
+
+    klog_info("Loading filesystem from block devices...");
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        dev = blkdev_find(names[i]);
+        if (dev == NULL) {
+            continue;
+        }
+        ret = load_device(fs, dev);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    klog_info("No saved filesystem - starting with fresh filesystem");
+    return -1;
+}
+
 /* ============================================================================
  * End of fs_persist.c
  * ============================================================================ */
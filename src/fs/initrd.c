@@ -0,0 +1,479 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/fs/initrd.c
+ * Description: Read-only initrd image, layered under ramfs
+ * ============================================================================ */
+
+#include <aeos/initrd.h>
+#include <aeos/ramfs.h>
+#include <aeos/dtb.h>
+#include <aeos/memblock.h>
+#include <aeos/mm.h>
+#include <aeos/heap.h>
+#include <aeos/semihosting.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/* Names ramfs can hold, with the NUL */
+#define INITRD_NAME_MAX     64
+
+/* The image found by initrd_probe() */
+static struct {
+    const uint8_t *base;                /* NULL if there is none */
+    uint64_t size;
+    const initrd_header_t *header;
+    const initrd_inode_t *inodes;
+    const initrd_entry_t *entries;
+    const char *names;
+} initrd;
+
+/**
+ * Check that a table of count records fits in an image of size bytes
+ */
+static bool table_fits(uint64_t off, uint64_t count, uint64_t record, uint64_t size)
+{
+    return off <= size && count <= (size - off) / record;
+}
+
+/**
+ * Validate an image header
+ *
+ * @param limit Bytes the image may span
+ * @return 0 if the image is usable, -1 if not
+ */
+static int check_header(const initrd_header_t *h, uint64_t limit)
+{
+    const initrd_inode_t *root;
+
+    if (h->magic != INITRD_MAGIC) {
+        return -1;
+    }
+    if (h->version != INITRD_VERSION) {
+        klog_warn("initrd: unsupported version %u", h->version);
+        return -1;
+    }
+    if (h->size < sizeof(initrd_header_t) || h->size > limit ||
+        h->num_inodes == 0 ||
+        !table_fits(h->inodes_off, h->num_inodes, sizeof(initrd_inode_t), h->size) ||
+        !table_fits(h->entries_off, h->num_entries, sizeof(initrd_entry_t), h->size) ||
+        !table_fits(h->names_off, h->names_size, 1, h->size) ||
+        (h->inodes_off % 8) != 0 || (h->entries_off % 4) != 0) {
+        klog_warn("initrd: bad header");
+        return -1;
+    }
+
+    root = (const initrd_inode_t *)((const uint8_t *)h + h->inodes_off);
+    if (root->type != VFS_FILE_DIRECTORY) {
+        klog_warn("initrd: root is not a directory");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the initrd and reserve it in memblock
+ */
+int initrd_probe(void)
+{
+    const initrd_header_t *h;
+    uint64_t start, end;
+
+    if (dtb_get_initrd(&start, &end) == 0) {
+        if (start >= end || (start & (PAGE_SIZE - 1)) != 0 ||
+            start < memblock_start() || end > memblock_end()) {
+            klog_warn("initrd: bad range 0x%llx-0x%llx", start, end);
+            return -1;
+        }
+    } else {
+        start = INITRD_LOAD_ADDR;
+        end = memblock_end();
+        if (start >= end) {
+            return -1;
+        }
+    }
+
+    h = (const initrd_header_t *)(uintptr_t)start;
+    if (check_header(h, end - start) != 0) {
+        return -1;
+    }
+
+    if (memblock_reserve(start, h->size) != 0) {
+        klog_warn("initrd: could not reserve its memory, ignoring it");
+        return -1;
+    }
+
+    initrd.base = (const uint8_t *)h;
+    initrd.size = h->size;
+    initrd.header = h;
+    initrd.inodes = (const initrd_inode_t *)(initrd.base + h->inodes_off);
+    initrd.entries = (const initrd_entry_t *)(initrd.base + h->entries_off);
+    initrd.names = (const char *)(initrd.base + h->names_off);
+
+    klog_info("initrd: %u inodes, %llu bytes at 0x%llx",
+              h->num_inodes, h->size, start);
+    return 0;
+}
+
+/**
+ * Check whether initrd_probe() found an image
+ */
+bool initrd_present(void)
+{
+    return initrd.base != NULL;
+}
+
+/**
+ * Get an entry's name, NULL if it runs off the name table or is too long
+ */
+static const char *entry_name(const initrd_entry_t *e)
+{
+    const char *name;
+    uint64_t left, len;
+
+    if (e->name_off >= initrd.header->names_size) {
+        return NULL;
+    }
+    name = initrd.names + e->name_off;
+    left = initrd.header->names_size - e->name_off;
+    for (len = 0; len < left && len < INITRD_NAME_MAX; len++) {
+        if (name[len] == '\0') {
+            return len > 0 ? name : NULL;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Link an image directory's entries into a ramfs directory (ramfs callback)
+ */
+static int initrd_populate(vfs_inode_t *dir, const void *lower_dir)
+{
+    const initrd_inode_t *node = (const initrd_inode_t *)lower_dir;
+    const initrd_inode_t *child;
+    const initrd_entry_t *e;
+    const char *name;
+    uint64_t i;
+
+    if (node->offset > initrd.header->num_entries ||
+        node->size > initrd.header->num_entries - node->offset) {
+        klog_warn("initrd: directory entries out of range");
+        return -1;
+    }
+
+    for (i = 0; i < node->size; i++) {
+        e = &initrd.entries[node->offset + i];
+        name = entry_name(e);
+        if (name == NULL || e->ino == 0 || e->ino >= initrd.header->num_inodes) {
+            klog_warn("initrd: skipping bad entry");
+            continue;
+        }
+
+        child = &initrd.inodes[e->ino];
+        if (child->type == VFS_FILE_DIRECTORY) {
+            if (ramfs_add_lower(dir, name, VFS_FILE_DIRECTORY, child->mode, 0, child) == NULL) {
+                return -1;
+            }
+        } else if (child->type == VFS_FILE_REGULAR) {
+            if ((child->offset & (PAGE_SIZE - 1)) != 0 ||
+                !table_fits(child->offset, child->size, 1, initrd.size)) {
+                klog_warn("initrd: skipping %s, data out of range", name);
+                continue;
+            }
+            if (ramfs_add_lower(dir, name, VFS_FILE_REGULAR, child->mode, child->size,
+                                initrd.base + child->offset) == NULL) {
+                return -1;
+            }
+        } else {
+            klog_warn("initrd: skipping %s, unknown type %u", name, child->type);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Layer the initrd under a ramfs
+ */
+int initrd_attach(vfs_filesystem_t *fs)
+{
+    if (initrd.base == NULL || fs == NULL || fs->root == NULL) {
+        return -1;
+    }
+
+    ramfs_set_populate(initrd_populate);
+    ramfs_set_lower_dir(fs->root, &initrd.inodes[0]);
+    return 0;
+}
+
+/* ============================================================================
+ * Packing
+ * ============================================================================ */
+
+/* An image being built: inodes in breadth-first order, so each directory's
+ * entries are contiguous */
+typedef struct {
+    vfs_inode_t **nodes;
+    initrd_inode_t *inodes;
+    uint32_t num_inodes, cap_inodes;
+    initrd_entry_t *entries;
+    uint32_t num_entries, cap_entries;
+    char *names;
+    uint64_t names_size, cap_names;
+} pack_t;
+
+/* Output through semihosting */
+typedef struct {
+    int fd;
+    uint64_t pos;
+    bool failed;
+    const uint8_t *zero;                /* A page of zeroes, for padding and holes */
+} pack_out_t;
+
+/**
+ * Add an inode to the image
+ */
+static int pack_add_inode(pack_t *p, vfs_inode_t *inode)
+{
+    vfs_inode_t **nodes;
+    initrd_inode_t *inodes;
+    uint32_t cap;
+
+    if (p->num_inodes == p->cap_inodes) {
+        cap = p->cap_inodes != 0 ? p->cap_inodes * 2 : 64;
+        nodes = (vfs_inode_t **)krealloc(p->nodes, (size_t)cap * sizeof(*nodes));
+        if (nodes == NULL) {
+            return -1;
+        }
+        p->nodes = nodes;
+        inodes = (initrd_inode_t *)krealloc(p->inodes, (size_t)cap * sizeof(*inodes));
+        if (inodes == NULL) {
+            return -1;
+        }
+        p->inodes = inodes;
+        p->cap_inodes = cap;
+    }
+
+    p->nodes[p->num_inodes] = inode;
+    p->inodes[p->num_inodes].type = inode->type;
+    p->inodes[p->num_inodes].mode = inode->mode;
+    p->inodes[p->num_inodes].size = inode->type == VFS_FILE_REGULAR ? inode->size : 0;
+    p->inodes[p->num_inodes].offset = 0;
+    p->num_inodes++;
+    return 0;
+}
+
+/**
+ * Add a directory entry for the inode added last
+ */
+static int pack_add_entry(pack_t *p, const char *name)
+{
+    uint64_t len = strlen(name) + 1;
+    initrd_entry_t *entries;
+    uint64_t cap;
+    char *names;
+
+    if (p->num_entries == p->cap_entries) {
+        cap = p->cap_entries != 0 ? p->cap_entries * 2 : 64;
+        entries = (initrd_entry_t *)krealloc(p->entries, (size_t)cap * sizeof(*entries));
+        if (entries == NULL) {
+            return -1;
+        }
+        p->entries = entries;
+        p->cap_entries = (uint32_t)cap;
+    }
+
+    if (p->names_size + len > p->cap_names) {
+        cap = p->cap_names != 0 ? p->cap_names * 2 : 1024;
+        while (cap < p->names_size + len) {
+            cap *= 2;
+        }
+        names = (char *)krealloc(p->names, (size_t)cap);
+        if (names == NULL) {
+            return -1;
+        }
+        p->names = names;
+        p->cap_names = cap;
+    }
+
+    p->entries[p->num_entries].ino = p->num_inodes - 1;
+    p->entries[p->num_entries].name_off = (uint32_t)p->names_size;
+    p->num_entries++;
+    memcpy(p->names + p->names_size, name, len);
+    p->names_size += len;
+    return 0;
+}
+
+/**
+ * Walk the tree under the root breadth-first
+ */
+static int pack_walk(pack_t *p, vfs_inode_t *root)
+{
+    ramfs_dirent_t *entry;
+    vfs_inode_t *dir;
+    uint32_t i;
+
+    if (pack_add_inode(p, root) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < p->num_inodes; i++) {
+        dir = p->nodes[i];
+        if (dir->type != VFS_FILE_DIRECTORY) {
+            continue;
+        }
+        if (ramfs_dir_populate(dir) != 0) {
+            return -1;
+        }
+
+        p->inodes[i].offset = p->num_entries;
+        for (entry = ((ramfs_inode_t *)dir->fs_data)->entries; entry != NULL;
+             entry = entry->next) {
+            if (entry->inode->type != VFS_FILE_REGULAR &&
+                entry->inode->type != VFS_FILE_DIRECTORY) {
+                continue;
+            }
+            if (pack_add_inode(p, entry->inode) != 0 ||
+                pack_add_entry(p, entry->name) != 0) {
+                return -1;
+            }
+        }
+        p->inodes[i].size = p->num_entries - p->inodes[i].offset;
+    }
+    return 0;
+}
+
+static void pack_write(pack_out_t *out, const void *buf, uint64_t len)
+{
+    if (len == 0 || out->failed) {
+        return;
+    }
+    if (semihost_write(out->fd, buf, (size_t)len) != 0) {
+        out->failed = true;
+        return;
+    }
+    out->pos += len;
+}
+
+/**
+ * Write zeroes up to an offset
+ */
+static void pack_pad(pack_out_t *out, uint64_t to)
+{
+    uint64_t n;
+
+    while (out->pos < to && !out->failed) {
+        n = to - out->pos;
+        pack_write(out, out->zero, n < PAGE_SIZE ? n : PAGE_SIZE);
+    }
+}
+
+/**
+ * Write a file's data, holes as zeroes
+ */
+static void pack_file(pack_out_t *out, vfs_inode_t *inode)
+{
+    const void *page;
+    uint64_t offset = 0;
+    size_t len;
+
+    while (offset < inode->size && !out->failed) {
+        page = ramfs_file_page(inode, offset, &len);
+        if (len == 0) {
+            break;
+        }
+        pack_write(out, page != NULL ? page : out->zero, len);
+        offset += len;
+    }
+}
+
+/**
+ * Pack a ramfs directory tree into an initrd image on the host
+ */
+ssize_t initrd_pack(const char *dir, const char *host_path)
+{
+    initrd_header_t header;
+    pack_out_t out;
+    pack_t p;
+    vfs_inode_t *root;
+    uint64_t data_off;
+    uint32_t i;
+    ssize_t ret = -1;
+
+    if (dir == NULL || host_path == NULL || !semihost_available()) {
+        return -1;
+    }
+    if (vfs_path_lookup(dir, &root) != 0 || root->type != VFS_FILE_DIRECTORY ||
+        strcmp(root->fs->name, "ramfs") != 0) {
+        klog_error("mkinitrd: %s is not a ramfs directory", dir);
+        return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    if (pack_walk(&p, root) != 0) {
+        klog_error("mkinitrd: out of memory");
+        goto out;
+    }
+
+    /* Lay out the tables, then the file data page by page */
+    memset(&header, 0, sizeof(header));
+    header.magic = INITRD_MAGIC;
+    header.version = INITRD_VERSION;
+    header.num_inodes = p.num_inodes;
+    header.num_entries = p.num_entries;
+    header.inodes_off = sizeof(header);
+    header.entries_off = header.inodes_off + (uint64_t)p.num_inodes * sizeof(initrd_inode_t);
+    header.names_off = header.entries_off + (uint64_t)p.num_entries * sizeof(initrd_entry_t);
+    header.names_size = p.names_size;
+
+    data_off = PAGE_ALIGN_UP(header.names_off + header.names_size);
+    for (i = 0; i < p.num_inodes; i++) {
+        if (p.inodes[i].type == VFS_FILE_REGULAR) {
+            p.inodes[i].offset = data_off;
+            data_off += PAGE_ALIGN_UP(p.inodes[i].size);
+        }
+    }
+    header.size = data_off;
+
+    out.zero = (const uint8_t *)kcalloc(1, PAGE_SIZE);
+    if (out.zero == NULL) {
+        goto out;
+    }
+    out.fd = semihost_open(host_path, SEMIHOST_OPEN_WB);
+    if (out.fd < 0) {
+        klog_error("mkinitrd: cannot open %s on the host", host_path);
+        kfree((void *)out.zero);
+        goto out;
+    }
+    out.pos = 0;
+    out.failed = false;
+
+    pack_write(&out, &header, sizeof(header));
+    pack_write(&out, p.inodes, (uint64_t)p.num_inodes * sizeof(initrd_inode_t));
+    pack_write(&out, p.entries, (uint64_t)p.num_entries * sizeof(initrd_entry_t));
+    pack_write(&out, p.names, p.names_size);
+    for (i = 0; i < p.num_inodes; i++) {
+        if (p.inodes[i].type == VFS_FILE_REGULAR) {
+            pack_pad(&out, p.inodes[i].offset);
+            pack_file(&out, p.nodes[i]);
+        }
+    }
+    pack_pad(&out, data_off);
+
+    semihost_close(out.fd);
+    kfree((void *)out.zero);
+    if (out.failed) {
+        klog_error("mkinitrd: write to %s failed", host_path);
+    } else {
+        ret = (ssize_t)data_off;
+    }
+
+out:
+    kfree(p.nodes);
+    kfree(p.inodes);
+    kfree(p.entries);
+    kfree(p.names);
+    return ret;
+}
+
+/* ============================================================================
+ * End of initrd.c
+ * ============================================================================ */
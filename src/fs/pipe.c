@@ -0,0 +1,281 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/fs/pipe.c
+ * Description: Kernel pipes between processes
+ * ============================================================================ */
+
+#include <aeos/pipe.h>
+#include <aeos/vfs.h>
+#include <aeos/wait.h>
+#include <aeos/spinlock.h>
+#include <aeos/heap.h>
+#include <aeos/pmm.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * head and tail count bytes written and read since the pipe was made;
+ * head - tail is what the buffer holds, and their low bits its position
+ * in the ring. The lock covers them and the end counts. Waiters sleep on
+ * readable or writable with the lock dropped, and are woken after it is.
+ */
+
+/* A pipe; its inode is embedded, so it has no directory entry */
+typedef struct {
+    spinlock_t lock;
+    uint8_t *buf;                       /* PIPE_SIZE bytes */
+    uint64_t head;                      /* Bytes written */
+    uint64_t tail;                      /* Bytes read */
+    uint32_t readers;                   /* Open read ends */
+    uint32_t writers;                   /* Open write ends */
+    wait_queue_t readable;              /* Readers waiting for data */
+    wait_queue_t writable;              /* Writers waiting for room */
+    vfs_inode_t inode;
+} pipe_t;
+
+static ssize_t pipe_file_read(vfs_file_t *file, void *buf, size_t count);
+static ssize_t pipe_file_write(vfs_file_t *file, const void *buf, size_t count);
+static int pipe_file_close(vfs_file_t *file);
+
+/* Pipe operations */
+static vfs_fs_ops_t pipe_ops = {
+    .file_read = pipe_file_read,
+    .file_write = pipe_file_write,
+    .file_close = pipe_file_close,
+};
+
+/* Never mounted; owns every pipe inode */
+static vfs_filesystem_t pipe_fs = {
+    .name = "pipefs",
+    .ops = &pipe_ops,
+};
+
+static uint64_t next_ino = 1;
+
+/**
+ * Check whether a waiting reader or writer may go on (lock held)
+ */
+static bool pipe_ready(const pipe_t *p, bool reading)
+{
+    if (reading) {
+        return p->head != p->tail || p->writers == 0;
+    }
+    return p->head - p->tail < PIPE_SIZE || p->readers == 0;
+}
+
+/**
+ * Sleep until a read (or write) can make progress
+ */
+static void pipe_wait(pipe_t *p, bool reading)
+{
+    wait_queue_t *wq = reading ? &p->readable : &p->writable;
+    waiter_t w = WAITER_INIT;
+    uint64_t flags;
+    bool ready;
+
+    for (;;) {
+        wait_prepare(wq, &w);
+        flags = spin_lock_irqsave(&p->lock);
+        ready = pipe_ready(p, reading);
+        spin_unlock_irqrestore(&p->lock, flags);
+        if (ready) {
+            break;
+        }
+        wait_sleep(&w, WAIT_FOREVER);
+    }
+    wait_finish(wq, &w);
+}
+
+/**
+ * Read from a pipe: block while it is empty, 0 at end of file
+ * @return VFS_WOULD_BLOCK instead of blocking on an O_NONBLOCK end
+ */
+static ssize_t pipe_file_read(vfs_file_t *file, void *buf, size_t count)
+{
+    pipe_t *p = (pipe_t *)file->inode->fs_data;
+    uint8_t *out = (uint8_t *)buf;
+    uint64_t flags;
+    size_t n, pos, first;
+    bool eof;
+
+    if ((file->flags & O_RDONLY) == 0 || buf == NULL) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    for (;;) {
+        if ((file->flags & O_NONBLOCK) == 0) {
+            pipe_wait(p, true);
+        }
+
+        flags = spin_lock_irqsave(&p->lock);
+        n = p->head - p->tail;
+        if (n > count) {
+            n = count;
+        }
+        pos = p->tail & (PIPE_SIZE - 1);
+        first = PIPE_SIZE - pos;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(out, p->buf + pos, first);
+        memcpy(out + first, p->buf, n - first);
+        p->tail += n;
+        eof = (p->writers == 0);
+        spin_unlock_irqrestore(&p->lock, flags);
+
+        if (n > 0) {
+            wake_up_all(&p->writable);
+            return (ssize_t)n;
+        }
+        if (eof) {
+            return 0;
+        }
+        if (file->flags & O_NONBLOCK) {
+            return VFS_WOULD_BLOCK;
+        }
+        /* Another reader emptied it first */
+    }
+}
+
+/**
+ * Write to a pipe: block while it is full
+ * @return Bytes written, -1 if no reader is left before any were
+ */
+static ssize_t pipe_file_write(vfs_file_t *file, const void *buf, size_t count)
+{
+    pipe_t *p = (pipe_t *)file->inode->fs_data;
+    const uint8_t *in = (const uint8_t *)buf;
+    uint64_t flags;
+    size_t done = 0, n, pos, first;
+    bool broken;
+
+    if ((file->flags & O_WRONLY) == 0 || buf == NULL) {
+        return -1;
+    }
+
+    while (done < count) {
+        pipe_wait(p, false);
+
+        flags = spin_lock_irqsave(&p->lock);
+        broken = (p->readers == 0);
+        n = 0;
+        if (!broken) {
+            n = PIPE_SIZE - (p->head - p->tail);
+            if (n > count - done) {
+                n = count - done;
+            }
+            pos = p->head & (PIPE_SIZE - 1);
+            first = PIPE_SIZE - pos;
+            if (first > n) {
+                first = n;
+            }
+            memcpy(p->buf + pos, in + done, first);
+            memcpy(p->buf, in + done + first, n - first);
+            p->head += n;
+        }
+        spin_unlock_irqrestore(&p->lock, flags);
+
+        if (broken) {
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        if (n > 0) {
+            done += n;
+            wake_up_all(&p->readable);
+        }
+    }
+    return (ssize_t)done;
+}
+
+/**
+ * Close one end: wake the other side, free the pipe with its last end
+ */
+static int pipe_file_close(vfs_file_t *file)
+{
+    pipe_t *p = (pipe_t *)file->inode->fs_data;
+    uint64_t flags;
+    bool last;
+
+    flags = spin_lock_irqsave(&p->lock);
+    if (file->flags & O_WRONLY) {
+        p->writers--;
+    } else {
+        p->readers--;
+    }
+    last = (p->readers == 0 && p->writers == 0);
+    spin_unlock_irqrestore(&p->lock, flags);
+
+    if (last) {
+        pmm_free_pages((uint64_t)p->buf, PIPE_ORDER);
+        kfree(p);
+        return 0;
+    }
+
+    /* Readers see end of file, writers a broken pipe */
+    wake_up_all(&p->readable);
+    wake_up_all(&p->writable);
+    return 0;
+}
+
+/**
+ * Create a pipe in the current process
+ */
+int pipe_open(int fds[2], uint32_t flags)
+{
+    pipe_t *p;
+    uint64_t page;
+
+    if (fds == NULL) {
+        return -1;
+    }
+
+    p = (pipe_t *)kcalloc(1, sizeof(pipe_t));
+    if (p == NULL) {
+        klog_error("pipe: out of memory");
+        return -1;
+    }
+
+    page = pmm_alloc_pages(PIPE_ORDER);
+    if (page == 0) {
+        klog_error("pipe: no pages for the buffer");
+        kfree(p);
+        return -1;
+    }
+
+    spin_lock_init(&p->lock);
+    wait_queue_init(&p->readable);
+    wait_queue_init(&p->writable);
+    p->buf = (uint8_t *)page;
+    p->readers = 1;
+    p->writers = 1;
+
+    p->inode.ino = __atomic_fetch_add(&next_ino, 1, __ATOMIC_RELAXED);
+    p->inode.type = VFS_FILE_PIPE;
+    p->inode.mode = 0600;
+    p->inode.fs = &pipe_fs;
+    p->inode.fs_data = p;
+
+    fds[0] = vfs_open_inode(&p->inode, O_RDONLY | (flags & O_NONBLOCK));
+    if (fds[0] < 0) {
+        pmm_free_pages(page, PIPE_ORDER);
+        kfree(p);
+        return -1;
+    }
+
+    fds[1] = vfs_open_inode(&p->inode, O_WRONLY);
+    if (fds[1] < 0) {
+        /* Closing the read end frees the pipe */
+        p->writers = 0;
+        vfs_close(fds[0]);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * End of pipe.c
+ * ============================================================================ */
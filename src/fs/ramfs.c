@@ -9,6 +9,8 @@
 #include <aeos/heap.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
+#include <aeos/pmm.h>
+#include <aeos/mm.h>
 
 /* Forward declarations */
 static int ramfs_inode_lookup(vfs_inode_t *parent, const char *name, vfs_inode_t **result);
@@ -16,10 +18,16 @@ static int ramfs_inode_create(vfs_inode_t *parent, const char *name, uint32_t mo
 static int ramfs_inode_mkdir(vfs_inode_t *parent, const char *name, uint32_t mode, vfs_inode_t **result);
 static int ramfs_inode_unlink(vfs_inode_t *parent, const char *name);
 static int ramfs_inode_rmdir(vfs_inode_t *parent, const char *name);
+static int ramfs_inode_rename(vfs_inode_t *old_dir, const char *old_name,
+                              vfs_inode_t *new_dir, const char *new_name);
 static ssize_t ramfs_file_read(vfs_file_t *file, void *buf, size_t count);
 static ssize_t ramfs_file_write(vfs_file_t *file, const void *buf, size_t count);
 static int ramfs_file_close(vfs_file_t *file);
+static ssize_t ramfs_file_copy_range(vfs_file_t *src, vfs_file_t *dst, size_t count);
+static int ramfs_file_mmap(vfs_file_t *file, uint64_t offset, size_t pages, uint64_t *phys);
+static void ramfs_file_munmap(vfs_inode_t *inode, uint64_t offset, size_t pages);
 static int ramfs_dir_readdir(vfs_file_t *file, vfs_dirent_t **dirent);
+static ssize_t ramfs_dir_getdents(vfs_file_t *file, vfs_dirent_t *buf, size_t count);
 
 /* Ramfs operations */
 static vfs_fs_ops_t ramfs_ops = {
@@ -28,59 +36,825 @@ static vfs_fs_ops_t ramfs_ops = {
     .inode_mkdir = ramfs_inode_mkdir,
     .inode_unlink = ramfs_inode_unlink,
     .inode_rmdir = ramfs_inode_rmdir,
+    .inode_rename = ramfs_inode_rename,
     .file_read = ramfs_file_read,
     .file_write = ramfs_file_write,
     .file_close = ramfs_file_close,
+    .file_copy_range = ramfs_file_copy_range,
+    .file_mmap = ramfs_file_mmap,
+    .file_munmap = ramfs_file_munmap,
     .dir_readdir = ramfs_dir_readdir,
+    .dir_getdents = ramfs_dir_getdents,
 };
 
+/* An inode and its ramfs data share one allocation */
+typedef struct ramfs_node {
+    vfs_inode_t inode;
+    ramfs_inode_t data;
+} ramfs_node_t;
+
 /* Global inode counter */
 static uint64_t next_ino = 1;
 
+/* Change generation, see ramfs_get_generation() */
+static uint64_t generation;
+
+/* Links lower directories in, see ramfs_set_populate() */
+static ramfs_populate_fn populate_lower;
+
+/**
+ * Stamp an inode with a new change generation
+ */
+static inline void ramfs_touch(ramfs_inode_t *data)
+{
+    data->dirty_gen = ++generation;
+}
+
+/**
+ * Record a byte range of a file as written
+ */
+static void ramfs_mark_dirty(ramfs_inode_t *data, uint64_t offset, uint64_t len)
+{
+    if (len == 0) {
+        return;
+    }
+    if (data->dirty_start >= data->dirty_end) {
+        data->dirty_start = offset;
+        data->dirty_end = offset + len;
+    } else {
+        if (offset < data->dirty_start) {
+            data->dirty_start = offset;
+        }
+        if (offset + len > data->dirty_end) {
+            data->dirty_end = offset + len;
+        }
+    }
+    ramfs_touch(data);
+}
+
+/**
+ * Get the current change generation
+ */
+uint64_t ramfs_get_generation(void)
+{
+    return generation;
+}
+
+/**
+ * Forget an inode's dirty byte range
+ */
+void ramfs_mark_clean(vfs_inode_t *inode)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+
+    data->dirty_start = 0;
+    data->dirty_end = 0;
+    data->trunc_size = inode->size;
+}
+
+/**
+ * Create a new ramfs inode
+ */
+static vfs_inode_t *ramfs_create_inode(vfs_file_type_t type, uint32_t mode)
+{
+    ramfs_node_t *node;
+    vfs_inode_t *inode;
+    ramfs_inode_t *ramfs_data;
+
+    /* VFS inode and ramfs-specific data in one allocation */
+    node = (ramfs_node_t *)kmalloc(sizeof(ramfs_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+    inode = &node->inode;
+    ramfs_data = &node->data;
+
+    /* Initialize inode */
+    inode->ino = next_ino++;
+    inode->type = type;
+    inode->mode = mode;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size = 0;
+    inode->blocks = 0;
+    inode->atime = 0;
+    inode->mtime = 0;
+    inode->ctime = 0;
+    inode->nlinks = 1;
+    inode->fs_data = ramfs_data;
+    inode->fs = NULL;  /* Set by caller */
+    inode->parent = NULL;
+
+    /* Initialize ramfs data */
+    ramfs_data->pages = NULL;
+    ramfs_data->pages_height = 0;
+    ramfs_data->map_count = 0;
+    ramfs_data->unlinked = false;
+    ramfs_data->entries = NULL;
+    ramfs_data->last = NULL;
+    ramfs_data->num_entries = 0;
+    ramfs_data->index = NULL;
+    ramfs_data->index_size = 0;
+    ramfs_data->index_deleted = 0;
+    ramfs_data->readdir_entry = NULL;
+    ramfs_data->readdir_pos = 0;
+    ramfs_data->dirty_start = 0;
+    ramfs_data->dirty_end = 0;
+    ramfs_data->trunc_size = 0;
+    ramfs_data->lower = NULL;
+    ramfs_data->lower_dir = NULL;
+    ramfs_touch(ramfs_data);
+
+    klog_debug("Created ramfs inode %llu (type=%d)", inode->ino, type);
+    return inode;
+}
+
+/**
+ * Create a detached inode with a given number
+ */
+vfs_inode_t *ramfs_alloc_inode(vfs_filesystem_t *fs, uint64_t ino,
+                               vfs_file_type_t type, uint32_t mode)
+{
+    vfs_inode_t *inode;
+
+    inode = ramfs_create_inode(type, mode);
+    if (inode == NULL) {
+        return NULL;
+    }
+
+    /* A loaded inode keeps its saved number: new ones must not reuse it.
+     * The number ramfs_create_inode() took is simply skipped. */
+    inode->ino = ino;
+    inode->fs = fs;
+    if (ino >= next_ino) {
+        next_ino = ino + 1;
+    }
+    return inode;
+}
+
+/* ============================================================================
+ * File Pages
+ * ============================================================================ */
+
+/**
+ * Pages a tree of the given height can hold
+ */
+static inline uint64_t ramfs_tree_capacity(uint32_t height)
+{
+    return 1ULL << (height * RAMFS_RADIX_SHIFT);
+}
+
+/**
+ * Allocate a zeroed page (tree node or file data)
+ */
+static void *ramfs_alloc_page(void)
+{
+    uint64_t page = pmm_alloc_page();
+
+    if (page == 0) {
+        return NULL;
+    }
+
+    memset((void *)page, 0, PAGE_SIZE);
+    return (void *)page;
+}
+
+/**
+ * Free a subtree: level 0 is a data page, above that a node
+ */
+static void ramfs_free_tree(void *node, uint32_t level)
+{
+    uint32_t i;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (level > 0) {
+        for (i = 0; i < RAMFS_RADIX_SLOTS; i++) {
+            ramfs_free_tree(((void **)node)[i], level - 1);
+        }
+    }
+
+    pmm_free_page((uint64_t)node);
+}
+
+/**
+ * Find the slot holding a file page
+ * With create set, missing tree levels are added (the page itself is
+ * not); otherwise a page past the tree gives NULL.
+ * @return Slot, or NULL (beyond the tree, or out of memory)
+ */
+static void **ramfs_page_slot(ramfs_inode_t *data, uint64_t index, bool create)
+{
+    void **node;
+    void **slot;
+    uint32_t level;
+
+    /* Grow from the top: the old tree becomes slot 0 of a new root */
+    while (index >= ramfs_tree_capacity(data->pages_height)) {
+        if (!create) {
+            return NULL;
+        }
+        if (data->pages != NULL) {
+            node = (void **)ramfs_alloc_page();
+            if (node == NULL) {
+                return NULL;
+            }
+            node[0] = data->pages;
+            data->pages = node;
+        }
+        data->pages_height++;
+    }
+
+    slot = &data->pages;
+    for (level = data->pages_height; level > 0; level--) {
+        if (*slot == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            *slot = ramfs_alloc_page();
+            if (*slot == NULL) {
+                return NULL;
+            }
+        }
+        node = (void **)*slot;
+        slot = &node[(index >> ((level - 1) * RAMFS_RADIX_SHIFT)) & (RAMFS_RADIX_SLOTS - 1)];
+    }
+
+    return slot;
+}
+
+/**
+ * Get the page holding a file offset
+ */
+const void *ramfs_file_page(vfs_inode_t *inode, uint64_t offset, size_t *len)
+{
+    ramfs_inode_t *data;
+    void **slot;
+    size_t in_page;
+
+    if (len == NULL) {
+        return NULL;
+    }
+    *len = 0;
+    if (inode == NULL || inode->type != VFS_FILE_REGULAR || offset >= inode->size) {
+        return NULL;
+    }
+
+    data = (ramfs_inode_t *)inode->fs_data;
+    in_page = (size_t)(offset & (PAGE_SIZE - 1));
+    *len = PAGE_SIZE - in_page;
+    if (*len > inode->size - offset) {
+        *len = (size_t)(inode->size - offset);
+    }
+
+    /* Not copied up yet: the data is in the image */
+    if (data->lower != NULL) {
+        return data->lower + offset;
+    }
+
+    slot = ramfs_page_slot(data, offset >> PAGE_SHIFT, false);
+    if (slot == NULL || *slot == NULL) {
+        return NULL;    /* Hole: reads as zeroes */
+    }
+
+    return (const uint8_t *)*slot + in_page;
+}
+
+/**
+ * Read file data at an offset
+ */
+ssize_t ramfs_read_data(vfs_inode_t *inode, uint64_t offset, void *buf, size_t count)
+{
+    uint8_t *out = (uint8_t *)buf;
+    const void *page;
+    size_t done = 0;
+    size_t chunk;
+
+    if (inode == NULL || buf == NULL || inode->type != VFS_FILE_REGULAR) {
+        return -1;
+    }
+
+    /* Check if offset is beyond file size */
+    if (offset >= inode->size) {
+        return 0;  /* EOF */
+    }
+    if (count > inode->size - offset) {
+        count = (size_t)(inode->size - offset);
+    }
+
+    /* One copy per page; holes read as zeroes */
+    while (done < count) {
+        page = ramfs_file_page(inode, offset + done, &chunk);
+        if (chunk == 0) {
+            break;
+        }
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+        if (page != NULL) {
+            memcpy(out + done, page, chunk);
+        } else {
+            memset(out + done, 0, chunk);
+        }
+        done += chunk;
+    }
+
+    return (ssize_t)done;
+}
+
+/**
+ * Copy a lower-layer file into pages of its own before its first change
+ * A mapped file can't move: its mappings point into the image.
+ * @return 0 on success, -1 if mapped or out of memory
+ */
+static int ramfs_copy_up(vfs_inode_t *inode)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+    const uint8_t *lower = data->lower;
+    uint64_t size = inode->size;
+
+    if (lower == NULL) {
+        return 0;
+    }
+    if (data->map_count > 0) {
+        klog_error("ramfs: inode %llu is mapped from the initrd, can't change it",
+                   inode->ino);
+        return -1;
+    }
+
+    data->lower = NULL;
+    inode->size = 0;
+    if (size > 0 && ramfs_write_data(inode, 0, lower, (size_t)size) != (ssize_t)size) {
+        ramfs_truncate(inode, 0);
+        data->lower = lower;
+        inode->size = size;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write file data at an offset
+ */
+ssize_t ramfs_write_data(vfs_inode_t *inode, uint64_t offset, const void *buf, size_t count)
+{
+    const uint8_t *in = (const uint8_t *)buf;
+    ramfs_inode_t *data;
+    void **slot;
+    size_t done = 0;
+    size_t in_page, chunk;
+    uint64_t page;
+
+    if (inode == NULL || buf == NULL || inode->type != VFS_FILE_REGULAR) {
+        return -1;
+    }
+
+    /* Check size limit */
+    if (offset > RAMFS_MAX_FILE_SIZE || count > RAMFS_MAX_FILE_SIZE - offset) {
+        klog_error("ramfs_write: File too large (max %llu bytes)",
+                   (uint64_t)RAMFS_MAX_FILE_SIZE);
+        return -1;
+    }
+
+    data = (ramfs_inode_t *)inode->fs_data;
+    if (ramfs_copy_up(inode) != 0) {
+        return -1;
+    }
+
+    while (done < count) {
+        in_page = (size_t)((offset + done) & (PAGE_SIZE - 1));
+        chunk = PAGE_SIZE - in_page;
+        if (chunk > count - done) {
+            chunk = count - done;
+        }
+
+        slot = ramfs_page_slot(data, (offset + done) >> PAGE_SHIFT, true);
+        if (slot == NULL) {
+            break;
+        }
+        if (*slot == NULL) {
+            /* A page the write fills completely needs no zeroing */
+            if (chunk == PAGE_SIZE) {
+                page = pmm_alloc_page();
+                *slot = (void *)page;
+            } else {
+                *slot = ramfs_alloc_page();
+            }
+            if (*slot == NULL) {
+                break;
+            }
+            inode->blocks++;
+        }
+
+        memcpy((uint8_t *)*slot + in_page, in + done, chunk);
+        done += chunk;
+    }
+
+    /* Update file size (a partial write still counts) */
+    if (offset + done > inode->size) {
+        inode->size = offset + done;
+    }
+    ramfs_mark_dirty(data, offset, done);
+
+    if (done < count) {
+        klog_error("ramfs_write: Out of memory for file pages");
+        return (done > 0) ? (ssize_t)done : -1;
+    }
+
+    return (ssize_t)done;
+}
+
+/**
+ * Cut a file down to a size
+ */
+int ramfs_truncate(vfs_inode_t *inode, uint64_t size)
+{
+    ramfs_inode_t *data;
+    uint64_t index, end;
+    void **slot;
+    size_t tail;
+
+    if (inode == NULL || inode->type != VFS_FILE_REGULAR) {
+        return -1;
+    }
+
+    /* Size 0 always frees the tree: a failed write may have left nodes */
+    if (size >= inode->size && size != 0) {
+        return 0;
+    }
+
+    data = (ramfs_inode_t *)inode->fs_data;
+
+    /* A mapping may still point at the pages that would be freed */
+    if (data->map_count > 0) {
+        klog_error("ramfs_truncate: inode %llu is mapped", inode->ino);
+        return -1;
+    }
+
+    /* Emptying a lower file just lets go of the image; cutting it copies up */
+    if (size == 0) {
+        data->lower = NULL;
+    } else if (ramfs_copy_up(inode) != 0) {
+        return -1;
+    }
+
+    /* A save must cut the saved copy down too, not just overwrite it */
+    if (size < data->trunc_size) {
+        data->trunc_size = size;
+    }
+    if (data->dirty_end > size) {
+        data->dirty_end = size;
+    }
+    ramfs_touch(data);
+
+    if (size == 0) {
+        ramfs_free_tree(data->pages, data->pages_height);
+        data->pages = NULL;
+        data->pages_height = 0;
+        inode->blocks = 0;
+        inode->size = 0;
+        return 0;
+    }
+
+    /* Drop whole pages past the new end */
+    end = (inode->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    for (index = (size + PAGE_SIZE - 1) >> PAGE_SHIFT; index < end; index++) {
+        slot = ramfs_page_slot(data, index, false);
+        if (slot != NULL && *slot != NULL) {
+            pmm_free_page((uint64_t)*slot);
+            *slot = NULL;
+            inode->blocks--;
+        }
+    }
+
+    /* Growing again must read zeroes past the old end */
+    tail = (size_t)(size & (PAGE_SIZE - 1));
+    if (tail != 0) {
+        slot = ramfs_page_slot(data, size >> PAGE_SHIFT, false);
+        if (slot != NULL && *slot != NULL) {
+            memset((uint8_t *)*slot + tail, 0, PAGE_SIZE - tail);
+        }
+    }
+
+    inode->size = size;
+    return 0;
+}
+
+/* Index slot of a removed entry: probes continue past it, inserts reuse it */
+#define RAMFS_INDEX_DELETED ((ramfs_dirent_t *)1)
+
+/**
+ * Hash an entry name (FNV-1a)
+ */
+static uint32_t ramfs_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Find the index slot holding a name
+ * @return Slot, or NULL if the directory has no such entry
+ */
+static ramfs_dirent_t **ramfs_index_find(ramfs_inode_t *dir, const char *name, uint32_t hash)
+{
+    ramfs_dirent_t *entry;
+    size_t mask, i;
+
+    if (dir->index == NULL) {
+        return NULL;
+    }
+
+    /* The index is never full, so every probe reaches an empty slot */
+    mask = dir->index_size - 1;
+    for (i = hash & mask; ; i = (i + 1) & mask) {
+        entry = dir->index[i];
+        if (entry == NULL) {
+            return NULL;
+        }
+        if (entry != RAMFS_INDEX_DELETED && entry->hash == hash &&
+            strcmp(entry->name, name) == 0) {
+            return &dir->index[i];
+        }
+    }
+}
+
+/**
+ * Put an entry in the first free slot of its probe sequence
+ * @return true if that slot was a removed entry's
+ */
+static bool ramfs_index_insert(ramfs_dirent_t **index, size_t size, ramfs_dirent_t *entry)
+{
+    size_t mask = size - 1;
+    size_t i;
+
+    for (i = entry->hash & mask; ; i = (i + 1) & mask) {
+        if (index[i] == NULL || index[i] == RAMFS_INDEX_DELETED) {
+            bool reused = (index[i] == RAMFS_INDEX_DELETED);
+            index[i] = entry;
+            return reused;
+        }
+    }
+}
+
+/**
+ * Make room in a directory's index for more entries
+ * Past 3/4 occupancy the index is rebuilt, doubling until at most half of
+ * it is live. A rebuild also drops the slots of removed entries.
+ * @return 0 on success, -1 if out of memory
+ */
+static int ramfs_index_reserve(ramfs_inode_t *dir, size_t count)
+{
+    ramfs_dirent_t **index;
+    ramfs_dirent_t *entry;
+    size_t size;
+
+    if ((dir->num_entries + dir->index_deleted + count) * 4 <= dir->index_size * 3) {
+        return 0;
+    }
+
+    size = (dir->index_size != 0) ? dir->index_size : RAMFS_INDEX_MIN;
+    while ((dir->num_entries + count) * 2 > size) {
+        size *= 2;
+    }
+
+    index = (ramfs_dirent_t **)kmalloc(size * sizeof(*index));
+    if (index == NULL) {
+        return -1;
+    }
+    memset(index, 0, size * sizeof(*index));
+
+    for (entry = dir->entries; entry != NULL; entry = entry->next) {
+        ramfs_index_insert(index, size, entry);
+    }
+
+    kfree(dir->index);
+    dir->index = index;
+    dir->index_size = size;
+    dir->index_deleted = 0;
+    return 0;
+}
+
+/**
+ * Add an existing inode to a ramfs directory
+ */
+int ramfs_dir_link(vfs_inode_t *dir, const char *name, vfs_inode_t *inode)
+{
+    ramfs_inode_t *dir_data;
+    ramfs_dirent_t *entry;
+    uint32_t hash;
+
+    if (dir == NULL || name == NULL || inode == NULL || dir->type != VFS_FILE_DIRECTORY) {
+        return -1;
+    }
+
+    dir_data = (ramfs_inode_t *)dir->fs_data;
+
+    if (strlen(name) >= sizeof(entry->name)) {
+        klog_error("ramfs: Name '%s' is too long", name);
+        return -1;
+    }
+
+    hash = ramfs_name_hash(name);
+    if (ramfs_index_find(dir_data, name, hash) != NULL) {
+        klog_error("ramfs: '%s' already exists", name);
+        return -1;
+    }
+
+    if (ramfs_index_reserve(dir_data, 1) != 0) {
+        klog_error("ramfs: Failed to grow directory index");
+        return -1;
+    }
+
+    entry = (ramfs_dirent_t *)kmalloc(sizeof(ramfs_dirent_t));
+    if (entry == NULL) {
+        klog_error("ramfs: Failed to allocate entry");
+        return -1;
+    }
+
+    strcpy(entry->name, name);
+    entry->hash = hash;
+    entry->inode = inode;
+
+    /* Append, so listings come out in creation order */
+    entry->next = NULL;
+    entry->prev = dir_data->last;
+    if (dir_data->last != NULL) {
+        dir_data->last->next = entry;
+    } else {
+        dir_data->entries = entry;
+    }
+    dir_data->last = entry;
+
+    if (ramfs_index_insert(dir_data->index, dir_data->index_size, entry)) {
+        dir_data->index_deleted--;
+    }
+    dir_data->num_entries++;
+    ramfs_touch(dir_data);
+
+    return 0;
+}
+
+/**
+ * Size a directory's index for more entries
+ */
+int ramfs_dir_reserve(vfs_inode_t *dir, size_t count)
+{
+    if (dir == NULL || dir->type != VFS_FILE_DIRECTORY) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    return ramfs_index_reserve((ramfs_inode_t *)dir->fs_data, count);
+}
+
+/**
+ * Take the entry in an index slot out of its directory and free it
+ * The child inode is left to the caller.
+ */
+static void ramfs_dir_remove(ramfs_inode_t *dir, ramfs_dirent_t **slot)
+{
+    ramfs_dirent_t *entry = *slot;
+
+    *slot = RAMFS_INDEX_DELETED;
+    dir->index_deleted++;
+
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        dir->entries = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        dir->last = entry->prev;
+    }
+    dir->num_entries--;
+    ramfs_touch(dir);
+
+    /* Positions after the entry shift down */
+    dir->readdir_entry = NULL;
+
+    /* An emptied directory gives its index back */
+    if (dir->num_entries == 0) {
+        kfree(dir->index);
+        dir->index = NULL;
+        dir->index_size = 0;
+        dir->index_deleted = 0;
+    }
+
+    kfree(entry);
+}
+
+/**
+ * Free an inode's ramfs data
+ */
+void ramfs_free_inode(vfs_inode_t *inode)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+    ramfs_dirent_t *entry;
+    ramfs_dirent_t *next;
+
+    for (entry = data->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        kfree(entry);
+    }
+
+    ramfs_free_tree(data->pages, data->pages_height);
+    kfree(data->index);
+    kfree(inode);  /* The ramfs_node_t holding both */
+}
+
+/**
+ * Drop a file that lost its last name
+ * A mapped file keeps its pages until the last unmap.
+ */
+static void ramfs_release_inode(vfs_inode_t *inode)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+
+    if (data->map_count > 0) {
+        data->unlinked = true;
+    } else {
+        ramfs_free_inode(inode);
+    }
+}
+
+/**
+ * Set the callback that populates lower directories
+ */
+void ramfs_set_populate(ramfs_populate_fn fn)
+{
+    populate_lower = fn;
+}
+
 /**
- * Create a new ramfs inode
+ * Layer a lower directory under an empty ramfs directory
  */
-static vfs_inode_t *ramfs_create_inode(vfs_file_type_t type, uint32_t mode)
+void ramfs_set_lower_dir(vfs_inode_t *dir, const void *lower_dir)
+{
+    ((ramfs_inode_t *)dir->fs_data)->lower_dir = lower_dir;
+}
+
+/**
+ * Add an entry backed by the lower layer to a directory
+ */
+vfs_inode_t *ramfs_add_lower(vfs_inode_t *dir, const char *name, vfs_file_type_t type,
+                             uint32_t mode, uint64_t size, const void *lower)
 {
     vfs_inode_t *inode;
-    ramfs_inode_t *ramfs_data;
+    ramfs_inode_t *data;
 
-    /* Allocate VFS inode */
-    inode = (vfs_inode_t *)kmalloc(sizeof(vfs_inode_t));
+    inode = ramfs_create_inode(type, mode);
     if (inode == NULL) {
         return NULL;
     }
+    inode->fs = dir->fs;
+
+    data = (ramfs_inode_t *)inode->fs_data;
+    if (type == VFS_FILE_DIRECTORY) {
+        data->lower_dir = lower;
+        inode->parent = dir;
+    } else {
+        data->lower = (const uint8_t *)lower;
+        inode->size = size;
+    }
 
-    /* Allocate ramfs-specific data */
-    ramfs_data = (ramfs_inode_t *)kmalloc(sizeof(ramfs_inode_t));
-    if (ramfs_data == NULL) {
-        kfree(inode);
+    if (ramfs_dir_link(dir, name, inode) != 0) {
+        ramfs_free_inode(inode);
         return NULL;
     }
+    return inode;
+}
 
-    /* Initialize inode */
-    inode->ino = next_ino++;
-    inode->type = type;
-    inode->mode = mode;
-    inode->uid = 0;
-    inode->gid = 0;
-    inode->size = 0;
-    inode->blocks = 0;
-    inode->atime = 0;
-    inode->mtime = 0;
-    inode->ctime = 0;
-    inode->nlinks = 1;
-    inode->fs_data = ramfs_data;
-    inode->fs = NULL;  /* Set by caller */
+/**
+ * Link a directory's lower entries in, if not done yet
+ */
+int ramfs_dir_populate(vfs_inode_t *dir)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)dir->fs_data;
+    const void *lower_dir = data->lower_dir;
 
-    /* Initialize ramfs data */
-    ramfs_data->data = NULL;
-    ramfs_data->data_size = 0;
-    ramfs_data->entries = NULL;
-    ramfs_data->num_entries = 0;
+    if (lower_dir == NULL || dir->type != VFS_FILE_DIRECTORY) {
+        return 0;
+    }
 
-    klog_debug("Created ramfs inode %llu (type=%d)", inode->ino, type);
-    return inode;
+    /* Cleared first: the callback links through ramfs_dir_link() */
+    data->lower_dir = NULL;
+    if (populate_lower == NULL || populate_lower(dir, lower_dir) != 0) {
+        klog_error("ramfs: failed to read directory ino %llu from the initrd", dir->ino);
+        return -1;
+    }
+    return 0;
 }
 
 /**
@@ -89,7 +863,7 @@ static vfs_inode_t *ramfs_create_inode(vfs_file_type_t type, uint32_t mode)
 static int ramfs_inode_lookup(vfs_inode_t *parent, const char *name, vfs_inode_t **result)
 {
     ramfs_inode_t *parent_data;
-    ramfs_dirent_t *entry;
+    ramfs_dirent_t **slot;
 
     if (parent == NULL || name == NULL || result == NULL) {
         return -1;
@@ -100,31 +874,28 @@ static int ramfs_inode_lookup(vfs_inode_t *parent, const char *name, vfs_inode_t
         return -1;
     }
 
+    ramfs_dir_populate(parent);
     parent_data = (ramfs_inode_t *)parent->fs_data;
 
-    /* Search directory entries */
-    entry = parent_data->entries;
-    while (entry != NULL) {
-        if (strcmp(entry->name, name) == 0) {
-            /* Found it */
-            *result = entry->inode;
-            klog_debug("ramfs_lookup: Found '%s' (ino=%llu)", name, entry->inode->ino);
-            return 0;
-        }
-        entry = entry->next;
+    /* Search directory index */
+    slot = ramfs_index_find(parent_data, name, ramfs_name_hash(name));
+    if (slot == NULL) {
+        klog_debug("ramfs_lookup: Entry '%s' not found", name);
+        return -1;
     }
 
-    klog_debug("ramfs_lookup: Entry '%s' not found", name);
-    return -1;
+    *result = (*slot)->inode;
+    klog_debug("ramfs_lookup: Found '%s' (ino=%llu)", name, (*slot)->inode->ino);
+    return 0;
 }
 
 /**
- * Create a new file
+ * Create a file or directory in a directory
  */
-static int ramfs_inode_create(vfs_inode_t *parent, const char *name, uint32_t mode, vfs_inode_t **result)
+static int ramfs_add_child(vfs_inode_t *parent, const char *name, vfs_file_type_t type,
+                           uint32_t mode, vfs_inode_t **result)
 {
     ramfs_inode_t *parent_data;
-    ramfs_dirent_t *new_entry;
     vfs_inode_t *new_inode;
 
     if (parent == NULL || name == NULL || result == NULL) {
@@ -136,364 +907,470 @@ static int ramfs_inode_create(vfs_inode_t *parent, const char *name, uint32_t mo
         return -1;
     }
 
+    if (ramfs_dir_populate(parent) != 0) {
+        return -1;
+    }
     parent_data = (ramfs_inode_t *)parent->fs_data;
 
     /* Check if already exists */
-    ramfs_dirent_t *entry = parent_data->entries;
-    while (entry != NULL) {
-        if (strcmp(entry->name, name) == 0) {
-            klog_error("ramfs_create: File '%s' already exists", name);
-            return -1;
-        }
-        entry = entry->next;
-    }
-
-    /* Check limit */
-    if (parent_data->num_entries >= RAMFS_MAX_FILES) {
-        klog_error("ramfs_create: Directory full");
+    if (ramfs_index_find(parent_data, name, ramfs_name_hash(name)) != NULL) {
+        klog_error("ramfs_create: '%s' already exists", name);
         return -1;
     }
 
     /* Create new inode */
-    new_inode = ramfs_create_inode(VFS_FILE_REGULAR, mode);
+    new_inode = ramfs_create_inode(type, mode);
     if (new_inode == NULL) {
         klog_error("ramfs_create: Failed to create inode");
         return -1;
     }
     new_inode->fs = parent->fs;
 
-    /* Create directory entry */
-    new_entry = (ramfs_dirent_t *)kmalloc(sizeof(ramfs_dirent_t));
-    if (new_entry == NULL) {
-        kfree(new_inode->fs_data);
-        kfree(new_inode);
-        klog_error("ramfs_create: Failed to allocate entry");
+    /* Add to directory */
+    if (ramfs_dir_link(parent, name, new_inode) != 0) {
+        ramfs_free_inode(new_inode);
         return -1;
     }
 
-    strncpy(new_entry->name, name, sizeof(new_entry->name) - 1);
-    new_entry->name[sizeof(new_entry->name) - 1] = '\0';
-    new_entry->inode = new_inode;
-    new_entry->next = parent_data->entries;
-
-    /* Add to directory */
-    parent_data->entries = new_entry;
-    parent_data->num_entries++;
-
     *result = new_inode;
-    klog_debug("ramfs_create: Created file '%s' (ino=%llu)", name, new_inode->ino);
+    klog_debug("ramfs_create: Created %s '%s' (ino=%llu)",
+               type == VFS_FILE_DIRECTORY ? "directory" : "file", name, new_inode->ino);
     return 0;
 }
 
+/**
+ * Create a new file
+ */
+static int ramfs_inode_create(vfs_inode_t *parent, const char *name, uint32_t mode, vfs_inode_t **result)
+{
+    return ramfs_add_child(parent, name, VFS_FILE_REGULAR, mode, result);
+}
+
 /**
  * Create a new directory
  */
 static int ramfs_inode_mkdir(vfs_inode_t *parent, const char *name, uint32_t mode, vfs_inode_t **result)
+{
+    return ramfs_add_child(parent, name, VFS_FILE_DIRECTORY, mode, result);
+}
+
+/**
+ * Delete a file
+ */
+static int ramfs_inode_unlink(vfs_inode_t *parent, const char *name)
 {
     ramfs_inode_t *parent_data;
-    ramfs_dirent_t *new_entry;
-    vfs_inode_t *new_inode;
+    ramfs_dirent_t **slot;
+    vfs_inode_t *child;
 
-    if (parent == NULL || name == NULL || result == NULL) {
+    if (parent == NULL || name == NULL) {
         return -1;
     }
 
     if (parent->type != VFS_FILE_DIRECTORY) {
-        klog_error("ramfs_mkdir: Parent is not a directory");
+        klog_error("ramfs_unlink: Parent is not a directory");
         return -1;
     }
 
+    ramfs_dir_populate(parent);
     parent_data = (ramfs_inode_t *)parent->fs_data;
 
-    /* Check if already exists */
-    ramfs_dirent_t *entry = parent_data->entries;
-    while (entry != NULL) {
-        if (strcmp(entry->name, name) == 0) {
-            klog_error("ramfs_mkdir: Directory '%s' already exists", name);
-            return -1;
-        }
-        entry = entry->next;
-    }
-
-    /* Check limit */
-    if (parent_data->num_entries >= RAMFS_MAX_FILES) {
-        klog_error("ramfs_mkdir: Directory full");
-        return -1;
-    }
-
-    /* Create new directory inode */
-    new_inode = ramfs_create_inode(VFS_FILE_DIRECTORY, mode);
-    if (new_inode == NULL) {
-        klog_error("ramfs_mkdir: Failed to create inode");
+    /* Find the entry */
+    slot = ramfs_index_find(parent_data, name, ramfs_name_hash(name));
+    if (slot == NULL) {
+        klog_error("ramfs_unlink: File '%s' not found", name);
         return -1;
     }
-    new_inode->fs = parent->fs;
 
-    /* Create directory entry */
-    new_entry = (ramfs_dirent_t *)kmalloc(sizeof(ramfs_dirent_t));
-    if (new_entry == NULL) {
-        kfree(new_inode->fs_data);
-        kfree(new_inode);
-        klog_error("ramfs_mkdir: Failed to allocate entry");
+    /* Check it's not a directory */
+    child = (*slot)->inode;
+    if (child->type == VFS_FILE_DIRECTORY) {
+        klog_error("ramfs_unlink: '%s' is a directory (use rmdir)", name);
         return -1;
     }
 
-    strncpy(new_entry->name, name, sizeof(new_entry->name) - 1);
-    new_entry->name[sizeof(new_entry->name) - 1] = '\0';
-    new_entry->inode = new_inode;
-    new_entry->next = parent_data->entries;
-
-    /* Add to directory */
-    parent_data->entries = new_entry;
-    parent_data->num_entries++;
+    /* Remove from directory, then free the inode and its data */
+    ramfs_dir_remove(parent_data, slot);
+    ramfs_release_inode(child);
 
-    *result = new_inode;
-    klog_debug("ramfs_mkdir: Created directory '%s' (ino=%llu)", name, new_inode->ino);
+    klog_debug("ramfs_unlink: Deleted file '%s'", name);
     return 0;
 }
 
 /**
- * Delete a file
+ * Delete a directory
  */
-static int ramfs_inode_unlink(vfs_inode_t *parent, const char *name)
+static int ramfs_inode_rmdir(vfs_inode_t *parent, const char *name)
 {
     ramfs_inode_t *parent_data;
-    ramfs_dirent_t *entry, *prev;
-    ramfs_inode_t *child_data;
+    ramfs_dirent_t **slot;
+    vfs_inode_t *child;
 
     if (parent == NULL || name == NULL) {
         return -1;
     }
 
     if (parent->type != VFS_FILE_DIRECTORY) {
-        klog_error("ramfs_unlink: Parent is not a directory");
+        klog_error("ramfs_rmdir: Parent is not a directory");
         return -1;
     }
 
+    ramfs_dir_populate(parent);
     parent_data = (ramfs_inode_t *)parent->fs_data;
 
     /* Find the entry */
-    prev = NULL;
-    entry = parent_data->entries;
-    while (entry != NULL) {
-        if (strcmp(entry->name, name) == 0) {
-            /* Found it - check it's not a directory */
-            if (entry->inode->type == VFS_FILE_DIRECTORY) {
-                klog_error("ramfs_unlink: '%s' is a directory (use rmdir)", name);
-                return -1;
-            }
-
-            /* Remove from list */
-            if (prev == NULL) {
-                parent_data->entries = entry->next;
-            } else {
-                prev->next = entry->next;
-            }
-            parent_data->num_entries--;
+    slot = ramfs_index_find(parent_data, name, ramfs_name_hash(name));
+    if (slot == NULL) {
+        klog_error("ramfs_rmdir: Directory '%s' not found", name);
+        return -1;
+    }
 
-            /* Free the inode and its data */
-            child_data = (ramfs_inode_t *)entry->inode->fs_data;
-            if (child_data->data != NULL) {
-                kfree(child_data->data);
-            }
-            kfree(child_data);
-            kfree(entry->inode);
-            kfree(entry);
+    /* Check it's a directory */
+    child = (*slot)->inode;
+    if (child->type != VFS_FILE_DIRECTORY) {
+        klog_error("ramfs_rmdir: '%s' is not a directory", name);
+        return -1;
+    }
 
-            klog_debug("ramfs_unlink: Deleted file '%s'", name);
-            return 0;
-        }
-        prev = entry;
-        entry = entry->next;
+    /* Check if directory is empty (entries still in the initrd count) */
+    if (ramfs_dir_populate(child) != 0 ||
+        ((ramfs_inode_t *)child->fs_data)->num_entries > 0) {
+        klog_error("ramfs_rmdir: Directory '%s' is not empty", name);
+        return -1;
     }
 
-    klog_error("ramfs_unlink: File '%s' not found", name);
-    return -1;
+    /* Remove from directory, then free the inode */
+    ramfs_dir_remove(parent_data, slot);
+    ramfs_free_inode(child);
+
+    klog_debug("ramfs_rmdir: Deleted directory '%s'", name);
+    return 0;
 }
 
 /**
- * Delete a directory
+ * Move a directory entry, replacing a file of the new name
+ * No data is touched; the VFS has checked that a directory does not move
+ * below itself and that only files are replaced.
  */
-static int ramfs_inode_rmdir(vfs_inode_t *parent, const char *name)
+static int ramfs_inode_rename(vfs_inode_t *old_dir, const char *old_name,
+                              vfs_inode_t *new_dir, const char *new_name)
 {
-    ramfs_inode_t *parent_data;
-    ramfs_dirent_t *entry, *prev;
-    ramfs_inode_t *child_data;
+    ramfs_inode_t *old_data;
+    ramfs_inode_t *new_data;
+    ramfs_dirent_t **slot;
+    ramfs_dirent_t **target;
+    vfs_inode_t *inode;
+    vfs_inode_t *replaced;
 
-    if (parent == NULL || name == NULL) {
+    if (old_dir == NULL || new_dir == NULL || old_name == NULL || new_name == NULL ||
+        old_dir->type != VFS_FILE_DIRECTORY || new_dir->type != VFS_FILE_DIRECTORY) {
         return -1;
     }
 
-    if (parent->type != VFS_FILE_DIRECTORY) {
-        klog_error("ramfs_rmdir: Parent is not a directory");
+    if (ramfs_dir_populate(old_dir) != 0 || ramfs_dir_populate(new_dir) != 0) {
         return -1;
     }
+    old_data = (ramfs_inode_t *)old_dir->fs_data;
+    new_data = (ramfs_inode_t *)new_dir->fs_data;
 
-    parent_data = (ramfs_inode_t *)parent->fs_data;
+    slot = ramfs_index_find(old_data, old_name, ramfs_name_hash(old_name));
+    if (slot == NULL) {
+        klog_error("ramfs_rename: '%s' not found", old_name);
+        return -1;
+    }
+    inode = (*slot)->inode;
+
+    target = ramfs_index_find(new_data, new_name, ramfs_name_hash(new_name));
+    if (target != NULL) {
+        /* Point the existing entry at the inode: nothing to allocate */
+        replaced = (*target)->inode;
+        if (replaced->type == VFS_FILE_DIRECTORY) {
+            klog_error("ramfs_rename: '%s' is a directory", new_name);
+            return -1;
+        }
+        (*target)->inode = inode;
+        ramfs_touch(new_data);
+        ramfs_release_inode(replaced);
+    } else if (ramfs_dir_link(new_dir, new_name, inode) != 0) {
+        return -1;
+    }
 
-    /* Find the entry */
-    prev = NULL;
-    entry = parent_data->entries;
-    while (entry != NULL) {
-        if (strcmp(entry->name, name) == 0) {
-            /* Found it - check it's a directory */
-            if (entry->inode->type != VFS_FILE_DIRECTORY) {
-                klog_error("ramfs_rmdir: '%s' is not a directory", name);
-                return -1;
-            }
+    /* Linking may have rebuilt the index the old slot was in */
+    slot = ramfs_index_find(old_data, old_name, ramfs_name_hash(old_name));
+    if (slot != NULL) {
+        ramfs_dir_remove(old_data, slot);
+    }
 
-            /* Check if directory is empty */
-            child_data = (ramfs_inode_t *)entry->inode->fs_data;
-            if (child_data->num_entries > 0) {
-                klog_error("ramfs_rmdir: Directory '%s' is not empty", name);
-                return -1;
-            }
+    klog_debug("ramfs_rename: '%s' -> '%s'", old_name, new_name);
+    return 0;
+}
 
-            /* Remove from list */
-            if (prev == NULL) {
-                parent_data->entries = entry->next;
-            } else {
-                prev->next = entry->next;
-            }
-            parent_data->num_entries--;
+/**
+ * Read from a file
+ */
+static ssize_t ramfs_file_read(vfs_file_t *file, void *buf, size_t count)
+{
+    ssize_t ret;
 
-            /* Free the inode */
-            kfree(child_data);
-            kfree(entry->inode);
-            kfree(entry);
+    if (file == NULL || buf == NULL || file->inode == NULL) {
+        return -1;
+    }
 
-            klog_debug("ramfs_rmdir: Deleted directory '%s'", name);
-            return 0;
-        }
-        prev = entry;
-        entry = entry->next;
+    ret = ramfs_read_data(file->inode, file->offset, buf, count);
+    if (ret > 0) {
+        file->offset += (uint64_t)ret;
     }
 
-    klog_error("ramfs_rmdir: Directory '%s' not found", name);
-    return -1;
+    klog_debug("ramfs_read: %d bytes at offset %llu", (int)ret, file->offset);
+    return ret;
 }
 
 /**
- * Read from a file
+ * Write to a file
  */
-static ssize_t ramfs_file_read(vfs_file_t *file, void *buf, size_t count)
+static ssize_t ramfs_file_write(vfs_file_t *file, const void *buf, size_t count)
 {
-    ramfs_inode_t *ramfs_data;
-    size_t bytes_to_read;
+    ssize_t ret;
 
     if (file == NULL || buf == NULL || file->inode == NULL) {
         return -1;
     }
 
-    ramfs_data = (ramfs_inode_t *)file->inode->fs_data;
+    ret = ramfs_write_data(file->inode, file->offset, buf, count);
+    if (ret > 0) {
+        file->offset += (uint64_t)ret;
+    }
 
-    /* Check if offset is beyond file size */
-    if (file->offset >= file->inode->size) {
-        return 0;  /* EOF */
+    klog_debug("ramfs_write: %d bytes, offset now %llu", (int)ret, file->offset);
+    return ret;
+}
+
+/**
+ * Close a file
+ */
+static int ramfs_file_close(vfs_file_t *file)
+{
+#ifndef DEBUG_ENABLED
+    (void)file;  /* Unused when debug logging is disabled */
+#endif
+    /* Nothing special to do for ramfs */
+    klog_debug("ramfs_close: inode %llu", file->inode->ino);
+    return 0;
+}
+
+/**
+ * Copy between two ramfs files, page to page
+ * Source holes stay holes where they land past the end of the target.
+ */
+static ssize_t ramfs_file_copy_range(vfs_file_t *src, vfs_file_t *dst, size_t count)
+{
+    const void *page;
+    ramfs_inode_t *dst_data;
+    uint64_t end;
+    size_t done = 0;
+    size_t len, in_page;
+    void **slot;
+    ssize_t ret;
+
+    if (src == NULL || dst == NULL || src->inode->type != VFS_FILE_REGULAR ||
+        dst->inode->type != VFS_FILE_REGULAR) {
+        return -1;
     }
 
-    /* Calculate bytes to read */
-    bytes_to_read = count;
-    if (file->offset + bytes_to_read > file->inode->size) {
-        bytes_to_read = file->inode->size - file->offset;
+    end = src->inode->size;
+    if (src->offset >= end) {
+        return 0;
+    }
+    if (count > end - src->offset) {
+        count = (size_t)(end - src->offset);
+    }
+    if (dst->offset > RAMFS_MAX_FILE_SIZE || count > RAMFS_MAX_FILE_SIZE - dst->offset) {
+        klog_error("ramfs_copy_range: File too large (max %llu bytes)",
+                   (uint64_t)RAMFS_MAX_FILE_SIZE);
+        return -1;
     }
 
-    /* Copy data */
-    if (ramfs_data->data != NULL) {
-        memcpy(buf, ramfs_data->data + file->offset, bytes_to_read);
+    dst_data = (ramfs_inode_t *)dst->inode->fs_data;
+    if (ramfs_copy_up(dst->inode) != 0) {
+        return -1;
     }
 
-    /* Update offset */
-    file->offset += bytes_to_read;
+    while (done < count) {
+        page = ramfs_file_page(src->inode, src->offset + done, &len);
+        if (len > count - done) {
+            len = count - done;
+        }
+
+        if (page != NULL) {
+            /* Straight from the source page into the target's pages */
+            ret = ramfs_write_data(dst->inode, dst->offset + done, page, len);
+            if (ret < 0 || (size_t)ret != len) {
+                break;
+            }
+        } else {
+            /* A hole: zero what the target already has, extend past it */
+            uint64_t at = dst->offset + done;
+            size_t left = len;
+            size_t chunk;
+
+            while (left > 0 && at < dst->inode->size) {
+                in_page = (size_t)(at & (PAGE_SIZE - 1));
+                chunk = PAGE_SIZE - in_page;
+                if (chunk > left) {
+                    chunk = left;
+                }
+                slot = ramfs_page_slot(dst_data, at >> PAGE_SHIFT, false);
+                if (slot != NULL && *slot != NULL) {
+                    memset((uint8_t *)*slot + in_page, 0, chunk);
+                    ramfs_mark_dirty(dst_data, at, chunk);
+                }
+                at += chunk;
+                left -= chunk;
+            }
+            if (dst->offset + done + len > dst->inode->size) {
+                dst->inode->size = dst->offset + done + len;
+                ramfs_touch(dst_data);
+            }
+        }
+
+        done += len;
+    }
 
-    klog_debug("ramfs_read: %u bytes from offset %llu",
-               (uint32_t)bytes_to_read, file->offset - bytes_to_read);
+    src->offset += done;
+    dst->offset += done;
 
-    return (ssize_t)bytes_to_read;
+    klog_debug("ramfs_copy_range: %u bytes", (uint32_t)done);
+    return (done > 0 || count == 0) ? (ssize_t)done : -1;
 }
 
 /**
- * Write to a file
+ * Hand out the pages behind a file range for mapping
+ * Holes get a page now, so the mapping sees later writes there too.
  */
-static ssize_t ramfs_file_write(vfs_file_t *file, const void *buf, size_t count)
+static int ramfs_file_mmap(vfs_file_t *file, uint64_t offset, size_t pages, uint64_t *phys)
 {
-    ramfs_inode_t *ramfs_data;
-    size_t new_size;
-    char *new_data;
+    vfs_inode_t *inode;
+    ramfs_inode_t *data;
+    void **slot;
+    size_t i;
 
-    if (file == NULL || buf == NULL || file->inode == NULL) {
+    if (file == NULL || file->inode == NULL || phys == NULL) {
         return -1;
     }
 
-    ramfs_data = (ramfs_inode_t *)file->inode->fs_data;
-
-    /* Calculate new file size */
-    new_size = file->offset + count;
+    inode = file->inode;
+    data = (ramfs_inode_t *)inode->fs_data;
 
-    /* Check size limit */
-    if (new_size > RAMFS_MAX_FILE_SIZE) {
-        klog_error("ramfs_write: File too large (%u > %u)",
-                   (uint32_t)new_size, RAMFS_MAX_FILE_SIZE);
-        return -1;
+    /* Straight from the image: file data there is page-aligned and padded */
+    if (data->lower != NULL) {
+        for (i = 0; i < pages; i++) {
+            phys[i] = (uint64_t)(uintptr_t)(data->lower + offset) + (i << PAGE_SHIFT);
+        }
+        data->map_count++;
+        return 0;
     }
 
-    /* Resize buffer if needed */
-    if (new_size > ramfs_data->data_size) {
-        new_data = (char *)kmalloc(new_size);
-        if (new_data == NULL) {
-            klog_error("ramfs_write: Failed to allocate buffer");
+    for (i = 0; i < pages; i++) {
+        slot = ramfs_page_slot(data, (offset >> PAGE_SHIFT) + i, true);
+        if (slot == NULL) {
             return -1;
         }
-
-        /* Copy existing data */
-        if (ramfs_data->data != NULL) {
-            memcpy(new_data, ramfs_data->data, file->inode->size);
-            kfree(ramfs_data->data);
+        if (*slot == NULL) {
+            *slot = ramfs_alloc_page();
+            if (*slot == NULL) {
+                return -1;
+            }
+            inode->blocks++;
         }
-
-        ramfs_data->data = new_data;
-        ramfs_data->data_size = new_size;
+        phys[i] = (uint64_t)*slot;
     }
 
-    /* Write data */
-    memcpy(ramfs_data->data + file->offset, buf, count);
+    data->map_count++;
+    return 0;
+}
+
+/**
+ * Release a mapping's hold on a file's pages
+ */
+static void ramfs_file_munmap(vfs_inode_t *inode, uint64_t offset, size_t pages)
+{
+    ramfs_inode_t *data = (ramfs_inode_t *)inode->fs_data;
+
+    (void)offset;
+    (void)pages;
 
-    /* Update file size and offset */
-    if (new_size > file->inode->size) {
-        file->inode->size = new_size;
+    if (--data->map_count == 0 && data->unlinked) {
+        ramfs_free_inode(inode);
     }
-    file->offset += count;
+}
+
+/**
+ * Find the entry at a readdir offset, carrying on from where the last
+ * readdir of the directory stopped if it is at or before the offset
+ */
+static ramfs_dirent_t *ramfs_dir_seek(ramfs_inode_t *dir, size_t index)
+{
+    ramfs_dirent_t *entry;
+    size_t pos;
 
-    klog_debug("ramfs_write: %u bytes at offset %llu",
-               (uint32_t)count, file->offset - count);
+    if (index >= dir->num_entries) {
+        return NULL;
+    }
 
-    return (ssize_t)count;
+    if (dir->readdir_entry != NULL && dir->readdir_pos <= index) {
+        entry = dir->readdir_entry;
+        pos = dir->readdir_pos;
+    } else {
+        entry = dir->entries;
+        pos = 0;
+    }
+    while (pos < index && entry != NULL) {
+        entry = entry->next;
+        pos++;
+    }
+    return entry;
 }
 
 /**
- * Close a file
+ * Convert a ramfs entry to a VFS directory entry
  */
-static int ramfs_file_close(vfs_file_t *file)
+static void ramfs_fill_dirent(vfs_dirent_t *out, const ramfs_dirent_t *entry)
 {
-#ifndef DEBUG_ENABLED
-    (void)file;  /* Unused when debug logging is disabled */
-#endif
-    /* Nothing special to do for ramfs */
-    klog_debug("ramfs_close: inode %llu", file->inode->ino);
-    return 0;
+    out->ino = entry->inode->ino;
+    out->type = entry->inode->type;
+    out->size = entry->inode->size;
+    strncpy(out->name, entry->name, MAX_FILENAME_LEN - 1);
+    out->name[MAX_FILENAME_LEN - 1] = '\0';
+    out->next = NULL;
 }
 
 /**
  * Read directory entries
  */
 static int ramfs_dir_readdir(vfs_file_t *file, vfs_dirent_t **dirent)
+{
+    static vfs_dirent_t vfs_entry;  /* Static buffer for return */
+
+    if (dirent == NULL || ramfs_dir_getdents(file, &vfs_entry, 1) != 1) {
+        return -1;
+    }
+
+    *dirent = &vfs_entry;
+    klog_debug("ramfs_readdir: returning entry '%s' (ino=%llu, type=%d)",
+               vfs_entry.name, vfs_entry.ino, vfs_entry.type);
+    return 0;
+}
+
+/**
+ * Read up to count directory entries from the file offset on
+ */
+static ssize_t ramfs_dir_getdents(vfs_file_t *file, vfs_dirent_t *buf, size_t count)
 {
     ramfs_inode_t *ramfs_data;
     ramfs_dirent_t *entry;
-    static vfs_dirent_t vfs_entry;  /* Static buffer for return */
-    size_t index;
+    size_t index, n;
 
-    if (file == NULL || dirent == NULL || file->inode == NULL) {
+    if (file == NULL || buf == NULL || file->inode == NULL) {
         return -1;
     }
 
@@ -501,6 +1378,7 @@ static int ramfs_dir_readdir(vfs_file_t *file, vfs_dirent_t **dirent)
         return -1;
     }
 
+    ramfs_dir_populate(file->inode);
     ramfs_data = (ramfs_inode_t *)file->inode->fs_data;
 
     /* Use offset as entry index */
@@ -508,43 +1386,24 @@ static int ramfs_dir_readdir(vfs_file_t *file, vfs_dirent_t **dirent)
 
     /* TODO: Add . and .. support - currently disabled for debugging */
 
-    if (index >= ramfs_data->num_entries) {
-        return -1;  /* No more entries */
-    }
-
-    /* Find entry at index */
-    entry = ramfs_data->entries;
-    while (index > 0 && entry != NULL) {
+    entry = ramfs_dir_seek(ramfs_data, index);
+    for (n = 0; n < count && entry != NULL; n++) {
+        /* Safety check: ensure entry has valid inode */
+        if (entry->inode == NULL) {
+            klog_error("ramfs_readdir: entry->inode is NULL for '%s'", entry->name);
+            break;
+        }
+        ramfs_fill_dirent(&buf[n], entry);
         entry = entry->next;
-        index--;
-    }
-
-    if (entry == NULL) {
-        klog_debug("ramfs_readdir: entry is NULL at index %zu", index);
-        return -1;
     }
 
-    /* Safety check: ensure entry has valid inode */
-    if (entry->inode == NULL) {
-        klog_error("ramfs_readdir: entry->inode is NULL for '%s'", entry->name);
-        return -1;
+    /* Leave the cursor after the last entry returned */
+    if (n > 0) {
+        file->offset += n;
+        ramfs_data->readdir_entry = entry;
+        ramfs_data->readdir_pos = index + n;
     }
-
-    /* Convert ramfs_dirent_t to vfs_dirent_t */
-    vfs_entry.ino = entry->inode->ino;
-    vfs_entry.type = entry->inode->type;
-    vfs_entry.size = entry->inode->size;
-    strncpy(vfs_entry.name, entry->name, MAX_FILENAME_LEN - 1);
-    vfs_entry.name[MAX_FILENAME_LEN - 1] = '\0';
-    vfs_entry.next = NULL;
-
-    *dirent = &vfs_entry;
-    file->offset++;
-
-    klog_debug("ramfs_readdir: returning entry '%s' (ino=%llu, type=%d)",
-               vfs_entry.name, vfs_entry.ino, vfs_entry.type);
-
-    return 0;
+    return (ssize_t)n;
 }
 
 /**
@@ -7,8 +7,66 @@
 #include <aeos/vfs.h>
 #include <aeos/process.h>
 #include <aeos/heap.h>
+#include <aeos/objpool.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
+#include <aeos/spinlock.h>
+#include <aeos/mmu.h>
+#include <aeos/pmm.h>
+
+/* Dentry cache slots (power of two), direct-mapped on the name hash */
+#define VFS_DCACHE_SIZE 256
+
+/* dcache_lookup() results */
+#define DCACHE_MISS     0
+#define DCACHE_HIT      1
+#define DCACHE_NEGATIVE 2
+
+/* Cached lookup of one name in one directory */
+typedef struct {
+    vfs_inode_t *dir;               /* NULL: slot unused */
+    vfs_inode_t *inode;             /* NULL: the name does not exist */
+    uint32_t hash;
+    uint32_t len;
+    char name[MAX_FILENAME_LEN];
+} vfs_dentry_t;
+
+/* Dentry cache */
+static struct {
+    spinlock_t lock;
+    vfs_dentry_t entries[VFS_DCACHE_SIZE];
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t misses;
+} dcache = { .lock = SPINLOCK_INIT };
+
+static void fd_table_ctor(void *obj);
+
+/* Open files and descriptor tables: opens and spawns pop a ready one */
+static objpool_t file_pool = OBJPOOL_INIT("vfs-file", vfs_file_t, NULL);
+static objpool_t fd_table_pool = OBJPOOL_INIT("vfs-fd-table", vfs_fd_table_t,
+                                              fd_table_ctor);
+
+/* Low bit of a mapping's page entry: a private copy made on write */
+#define VFS_PAGE_COPIED 1ULL
+
+/* A live vfs_mmap() view */
+typedef struct {
+    uint64_t va;                    /* 0: slot unused */
+    size_t pages;
+    uint32_t flags;
+    vfs_inode_t *inode;
+    uint64_t offset;                /* File offset of the first page */
+    uint64_t *phys;                 /* Page behind each mapped page */
+} vfs_mapping_t;
+
+/* File mappings */
+static struct {
+    spinlock_t lock;
+    vfs_mapping_t maps[VFS_MAX_MAPPINGS];
+} mappings = { .lock = SPINLOCK_INIT };
+
+static int vfs_mmap_fault(uint64_t va, bool write);
 
 /* Global VFS state */
 static struct {
@@ -31,6 +89,8 @@ void vfs_init(void)
     vfs.root = NULL;
     vfs.initialized = true;
 
+    mmu_set_vmap_fault_handler(vfs_mmap_fault);
+
     klog_info("VFS initialized");
 }
 
@@ -81,9 +141,10 @@ int vfs_mount(const char *path, vfs_filesystem_t *fs)
     mount->fs = fs;
     mount->mountpoint = NULL;  /* TODO: lookup mountpoint inode */
 
-    /* Special case: mounting root filesystem */
+    /* Special case: mounting root filesystem (cached inodes belong to the old one) */
     if (strcmp(path, "/") == 0) {
         vfs.root = fs->root;
+        vfs_dcache_flush();
         klog_info("Root filesystem mounted");
     }
 
@@ -127,28 +188,74 @@ int vfs_unmount(const char *path)
  * File Descriptor Table Operations
  * ============================================================================ */
 
-vfs_fd_table_t *vfs_fd_table_create(void)
+/**
+ * Constructed state of a pooled table: every fd unused
+ * A table returns to the pool that way, its files all closed.
+ */
+static void fd_table_ctor(void *obj)
 {
-    vfs_fd_table_t *table;
+    vfs_fd_table_t *table = (vfs_fd_table_t *)obj;
     int i;
 
-    table = (vfs_fd_table_t *)kmalloc(sizeof(vfs_fd_table_t));
-    if (table == NULL) {
-        return NULL;
-    }
-
-    /* Initialize all fds as unused */
     for (i = 0; i < MAX_OPEN_FILES; i++) {
         table->fds[i].file = NULL;
         table->fds[i].flags = 0;
     }
 
     table->next_fd = 0;
+    table->refcount = 0;
+    spin_lock_init(&table->lock);
+}
+
+vfs_fd_table_t *vfs_fd_table_create(void)
+{
+    vfs_fd_table_t *table;
+
+    table = (vfs_fd_table_t *)objpool_alloc(&fd_table_pool);
+    if (table == NULL) {
+        return NULL;
+    }
 
+    table->refcount = 1;
     klog_debug("Created file descriptor table");
     return table;
 }
 
+vfs_fd_table_t *vfs_fd_table_get(vfs_fd_table_t *table)
+{
+    if (table != NULL) {
+        __atomic_add_fetch(&table->refcount, 1, __ATOMIC_RELAXED);
+    }
+    return table;
+}
+
+/**
+ * Drop a table's reference to an open file, closing it with the last one
+ */
+static void fd_table_free(vfs_fd_table_t *table, int fd)
+{
+    vfs_file_t *file;
+    uint64_t flags;
+
+    /* Out of the slot under the lock, closed outside it: closing may sleep */
+    flags = spin_lock_irqsave(&table->lock);
+    file = table->fds[fd].file;
+    table->fds[fd].file = NULL;
+    table->fds[fd].flags = 0;
+    spin_unlock_irqrestore(&table->lock, flags);
+
+    if (file != NULL) {
+        /* Tables may share it (vfs_fd_install), on other CPUs; the last
+         * one to close it closes the file */
+        if (__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+            if (file->inode && file->inode->fs && file->inode->fs->ops->file_close) {
+                file->inode->fs->ops->file_close(file);
+            }
+            objpool_free(&file_pool, file);
+        }
+    }
+}
+
 void vfs_fd_table_destroy(vfs_fd_table_t *table)
 {
     int i;
@@ -157,14 +264,20 @@ void vfs_fd_table_destroy(vfs_fd_table_t *table)
         return;
     }
 
-    /* Close all open files */
+    /* Cloned processes share the table: the last one closes it */
+    if (__atomic_sub_fetch(&table->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    /* Close all open files; the table need not be the caller's */
     for (i = 0; i < MAX_OPEN_FILES; i++) {
         if (table->fds[i].file != NULL) {
-            vfs_close(i);
+            fd_table_free(table, i);
         }
     }
 
-    kfree(table);
+    table->next_fd = 0;
+    objpool_free(&fd_table_pool, table);
     klog_debug("Destroyed file descriptor table");
 }
 
@@ -172,6 +285,7 @@ int vfs_fd_alloc(vfs_file_t *file, uint32_t flags)
 {
     process_t *proc;
     vfs_fd_table_t *table;
+    uint64_t irq;
     int fd;
 
     proc = process_current();
@@ -183,15 +297,45 @@ int vfs_fd_alloc(vfs_file_t *file, uint32_t flags)
     table = proc->fd_table;
 
     /* Find free fd */
+    irq = spin_lock_irqsave(&table->lock);
     for (fd = 0; fd < MAX_OPEN_FILES; fd++) {
         if (table->fds[fd].file == NULL) {
             table->fds[fd].file = file;
             table->fds[fd].flags = flags;
-            file->refcount++;
+            __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+            spin_unlock_irqrestore(&table->lock, irq);
             klog_debug("Allocated fd %d", fd);
             return fd;
         }
     }
+    spin_unlock_irqrestore(&table->lock, irq);
+
+    klog_error("No free file descriptors");
+    return -1;
+}
+
+int vfs_fd_install(vfs_fd_table_t *table, int fd)
+{
+    vfs_file_t *file;
+    uint64_t irq;
+    int slot;
+
+    file = vfs_fd_to_file(fd);
+    if (file == NULL || table == NULL) {
+        return -1;
+    }
+
+    irq = spin_lock_irqsave(&table->lock);
+    for (slot = 0; slot < MAX_OPEN_FILES; slot++) {
+        if (table->fds[slot].file == NULL) {
+            __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+            table->fds[slot].file = file;
+            table->fds[slot].flags = 0;
+            spin_unlock_irqrestore(&table->lock, irq);
+            return slot;
+        }
+    }
+    spin_unlock_irqrestore(&table->lock, irq);
 
     klog_error("No free file descriptors");
     return -1;
@@ -219,37 +363,141 @@ vfs_file_t *vfs_fd_to_file(int fd)
 void vfs_fd_free(int fd)
 {
     process_t *proc;
-    vfs_fd_table_t *table;
-    vfs_file_t *file;
 
     proc = process_current();
     if (proc == NULL || proc->fd_table == NULL) {
         return;
     }
 
-    table = proc->fd_table;
-
     if (fd < 0 || fd >= MAX_OPEN_FILES) {
         return;
     }
 
-    file = table->fds[fd].file;
-    if (file != NULL) {
-        file->refcount--;
+    fd_table_free(proc->fd_table, fd);
 
-        /* If no more references, close the file */
-        if (file->refcount == 0) {
-            if (file->inode && file->inode->fs && file->inode->fs->ops->file_close) {
-                file->inode->fs->ops->file_close(file);
-            }
-            kfree(file);
+    klog_debug("Freed fd %d", fd);
+}
+
+/* ============================================================================
+ * Dentry Cache
+ * ============================================================================ */
+
+/**
+ * Hash a (directory, name) pair (FNV-1a over the name, mixed with the directory)
+ */
+static uint32_t dcache_hash(const vfs_inode_t *dir, const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash ^ ((uint32_t)((uint64_t)dir >> 4) * 0x9E3779B1u);
+}
+
+/**
+ * Look a name up in the dentry cache
+ * @param inode Receives the inode on a positive hit
+ * @return DCACHE_HIT, DCACHE_NEGATIVE (known absent) or DCACHE_MISS
+ */
+static int dcache_lookup(vfs_inode_t *dir, const char *name, size_t len, uint32_t hash,
+                         vfs_inode_t **inode)
+{
+    vfs_dentry_t *d;
+    uint64_t flags;
+    int ret = DCACHE_MISS;
+
+    flags = spin_lock_irqsave(&dcache.lock);
+    d = &dcache.entries[hash & (VFS_DCACHE_SIZE - 1)];
+    if (d->dir == dir && d->hash == hash && d->len == len &&
+        memcmp(d->name, name, len) == 0) {
+        if (d->inode != NULL) {
+            *inode = d->inode;
+            ret = DCACHE_HIT;
+            dcache.hits++;
+        } else {
+            ret = DCACHE_NEGATIVE;
+            dcache.negative_hits++;
         }
+    } else {
+        dcache.misses++;
     }
+    spin_unlock_irqrestore(&dcache.lock, flags);
 
-    table->fds[fd].file = NULL;
-    table->fds[fd].flags = 0;
+    return ret;
+}
 
-    klog_debug("Freed fd %d", fd);
+/**
+ * Record what a name resolves to (NULL: it does not exist)
+ * Replaces whatever held the slot.
+ */
+static void dcache_store(vfs_inode_t *dir, const char *name, size_t len, vfs_inode_t *inode)
+{
+    uint32_t hash = dcache_hash(dir, name, len);
+    vfs_dentry_t *d;
+    uint64_t flags;
+
+    if (len >= MAX_FILENAME_LEN) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&dcache.lock);
+    d = &dcache.entries[hash & (VFS_DCACHE_SIZE - 1)];
+    d->dir = dir;
+    d->inode = inode;
+    d->hash = hash;
+    d->len = (uint32_t)len;
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+    spin_unlock_irqrestore(&dcache.lock, flags);
+}
+
+/**
+ * Drop every entry that belongs to, or points at, a directory being freed
+ * Its address may come back as a different inode.
+ */
+static void dcache_forget(vfs_inode_t *inode)
+{
+    uint64_t flags;
+    uint32_t i;
+
+    flags = spin_lock_irqsave(&dcache.lock);
+    for (i = 0; i < VFS_DCACHE_SIZE; i++) {
+        if (dcache.entries[i].dir == inode || dcache.entries[i].inode == inode) {
+            dcache.entries[i].dir = NULL;
+            dcache.entries[i].inode = NULL;
+        }
+    }
+    spin_unlock_irqrestore(&dcache.lock, flags);
+}
+
+/**
+ * Empty the dentry cache
+ */
+void vfs_dcache_flush(void)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&dcache.lock);
+    memset(dcache.entries, 0, sizeof(dcache.entries));
+    spin_unlock_irqrestore(&dcache.lock, flags);
+}
+
+/**
+ * Get dentry cache statistics
+ */
+void vfs_get_dcache_stats(vfs_dcache_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    stats->hits = dcache.hits;
+    stats->negative_hits = dcache.negative_hits;
+    stats->misses = dcache.misses;
 }
 
 /* ============================================================================
@@ -257,114 +505,273 @@ void vfs_fd_free(int fd)
  * ============================================================================ */
 
 /**
- * Split path into components (helper function)
- * Example: "/foo/bar/baz" -> ["foo", "bar", "baz"]
+ * Look up one component in a directory, through the dentry cache
+ * @param name Component, not NUL-terminated
+ * @param len Component length
+ * @return 0 on success, -1 if not found
  */
-static int split_path(const char *path, char **components, int max_components)
+static int vfs_lookup_child(vfs_inode_t *dir, const char *name, size_t len,
+                            vfs_inode_t **result)
 {
-    char *path_copy;
-    char *token;
-    char *saveptr;
-    int count = 0;
+    char buf[MAX_FILENAME_LEN];
+    uint32_t hash;
+    int ret;
+
+    hash = dcache_hash(dir, name, len);
+    ret = dcache_lookup(dir, name, len, hash, result);
+    if (ret != DCACHE_MISS) {
+        return (ret == DCACHE_HIT) ? 0 : -1;
+    }
 
-    if (path == NULL || components == NULL) {
+    /* No filesystem name can be this long */
+    if (len >= MAX_FILENAME_LEN) {
         return -1;
     }
 
-    /* Make a copy since strtok modifies the string */
-    path_copy = kmalloc(strlen(path) + 1);
-    if (path_copy == NULL) {
+    if (dir->fs == NULL || dir->fs->ops == NULL || dir->fs->ops->inode_lookup == NULL) {
+        klog_error("Filesystem doesn't support lookup");
         return -1;
     }
-    strcpy(path_copy, path);
 
-    /* Tokenize by '/' */
-    token = strtok_r(path_copy, "/", &saveptr);
-    while (token != NULL && count < max_components) {
-        components[count] = kmalloc(strlen(token) + 1);
-        if (components[count] == NULL) {
-            /* Cleanup on error */
-            int i;
-            for (i = 0; i < count; i++) {
-                kfree(components[i]);
+    /* Filesystems take NUL-terminated names */
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+
+    ret = dir->fs->ops->inode_lookup(dir, buf, result);
+    dcache_store(dir, buf, len, (ret == 0) ? *result : NULL);
+    if (ret < 0) {
+        klog_debug("Component not found: %s", buf);
+        return -1;
+    }
+
+    /* ".." walks back up through this */
+    if ((*result)->type == VFS_FILE_DIRECTORY) {
+        (*result)->parent = dir;
+    }
+
+    return 0;
+}
+
+/**
+ * Inode a path is resolved from: the root or the working directory
+ */
+static vfs_inode_t *vfs_walk_start(const char *path)
+{
+    process_t *proc;
+
+    if (path[0] != '/') {
+        proc = process_current();
+        if (proc != NULL && proc->cwd != NULL) {
+            return proc->cwd;
+        }
+    }
+
+    return vfs.root;
+}
+
+/**
+ * Walk the first len characters of a path
+ * Components are (pointer, length) slices of the caller's string, so the
+ * walk allocates nothing. "." stays put and ".." goes to the parent (the
+ * root is its own parent).
+ * @return 0 on success, -1 on error
+ */
+static int vfs_walk(const char *path, size_t len, vfs_inode_t **result)
+{
+    const char *p = path;
+    const char *end = path + len;
+    const char *name;
+    size_t name_len;
+    vfs_inode_t *current;
+
+    current = vfs_walk_start(path);
+    if (current == NULL) {
+        klog_error("No root filesystem mounted");
+        return -1;
+    }
+
+    for (;;) {
+        /* Next component */
+        while (p < end && *p == '/') {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+        name = p;
+        while (p < end && *p != '/') {
+            p++;
+        }
+        name_len = (size_t)(p - name);
+
+        /* Check if current is a directory */
+        if (current->type != VFS_FILE_DIRECTORY) {
+            klog_debug("Not a directory in path: %s", path);
+            return -1;
+        }
+
+        if (name_len == 1 && name[0] == '.') {
+            continue;
+        }
+        if (name_len == 2 && name[0] == '.' && name[1] == '.') {
+            if (current->parent != NULL) {
+                current = current->parent;
             }
-            kfree(path_copy);
+            continue;
+        }
+
+        if (vfs_lookup_child(current, name, name_len, &current) < 0) {
             return -1;
         }
-        strcpy(components[count], token);
-        count++;
-        token = strtok_r(NULL, "/", &saveptr);
     }
 
-    kfree(path_copy);
-    return count;
+    *result = current;
+    return 0;
 }
 
 int vfs_path_lookup(const char *path, vfs_inode_t **result)
 {
-    char *components[32];  /* Max path depth */
-    int num_components;
-    vfs_inode_t *current;
-    int i;
-    int ret;
-
     if (!vfs.initialized || path == NULL || result == NULL) {
         return -1;
     }
 
-    /* Start at root */
-    current = vfs.root;
-    if (current == NULL) {
-        klog_error("No root filesystem mounted");
-        return -1;
+    return vfs_walk(path, strlen(path), result);
+}
+
+/**
+ * Split a path into its parent directory and last component
+ * @param parent Receives the directory the last component lives in
+ * @param name Receives the last component (MAX_FILENAME_LEN bytes)
+ * @return 0 on success, -1 on error
+ */
+static int vfs_lookup_parent(const char *path, vfs_inode_t **parent, char *name)
+{
+    size_t len = strlen(path);
+    size_t start;
+
+    /* Trailing slashes don't count: "/a/b/" names b */
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    start = len;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
     }
 
-    /* Handle root path specially */
-    if (strcmp(path, "/") == 0) {
-        *result = current;
-        return 0;
+    if (start == len || len - start >= MAX_FILENAME_LEN ||
+        (len - start == 1 && path[start] == '.') ||
+        (len - start == 2 && path[start] == '.' && path[start + 1] == '.')) {
+        klog_error("Invalid path: %s", path);
+        return -1;
     }
 
-    /* Split path into components */
-    num_components = split_path(path, components, 32);
-    if (num_components < 0) {
+    memcpy(name, path + start, len - start);
+    name[len - start] = '\0';
+
+    if (vfs_walk(path, start, parent) < 0 || (*parent)->type != VFS_FILE_DIRECTORY) {
+        klog_error("Parent directory not found");
         return -1;
     }
 
-    /* Walk the path */
-    for (i = 0; i < num_components; i++) {
-        /* Check if current is a directory */
-        if (current->type != VFS_FILE_DIRECTORY) {
-            klog_error("Not a directory: component %d", i);
-            ret = -1;
-            goto cleanup;
-        }
+    return 0;
+}
 
-        /* Lookup next component */
-        if (current->fs == NULL || current->fs->ops == NULL ||
-            current->fs->ops->inode_lookup == NULL) {
-            klog_error("Filesystem doesn't support lookup");
-            ret = -1;
-            goto cleanup;
-        }
+/**
+ * Build the absolute, normalised form of a path
+ * Relative paths are taken from base; "." and ".." are folded away.
+ * @return 0 on success, -1 if the result does not fit
+ */
+static int vfs_normalize_path(const char *base, const char *path, char *out, size_t size)
+{
+    const char *p, *name;
+    size_t len = 0, name_len;
+    int pass;
+
+    out[0] = '\0';
+
+    /* Pass 0 copies the base, pass 1 applies the path */
+    for (pass = (path[0] == '/') ? 1 : 0; pass < 2; pass++) {
+        p = (pass == 0) ? base : path;
+        while (*p != '\0') {
+            while (*p == '/') {
+                p++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            name = p;
+            while (*p != '\0' && *p != '/') {
+                p++;
+            }
+            name_len = (size_t)(p - name);
+
+            if (name_len == 1 && name[0] == '.') {
+                continue;
+            }
+            if (name_len == 2 && name[0] == '.' && name[1] == '.') {
+                while (len > 0 && out[len - 1] != '/') {
+                    len--;
+                }
+                if (len > 0) {
+                    len--;
+                }
+                out[len] = '\0';
+                continue;
+            }
 
-        ret = current->fs->ops->inode_lookup(current, components[i], &current);
-        if (ret < 0) {
-            klog_error("Component not found: %s", components[i]);
-            goto cleanup;
+            if (len + 1 + name_len >= size) {
+                return -1;
+            }
+            out[len++] = '/';
+            memcpy(out + len, name, name_len);
+            len += name_len;
+            out[len] = '\0';
         }
     }
 
-    *result = current;
-    ret = 0;
+    if (len == 0) {
+        strcpy(out, "/");
+    }
+
+    return 0;
+}
+
+/**
+ * Change the current process's working directory
+ */
+int vfs_chdir(const char *path)
+{
+    char new_path[MAX_PATH_LEN];
+    process_t *proc;
+    vfs_inode_t *dir;
 
-cleanup:
-    /* Free component strings */
-    for (i = 0; i < num_components; i++) {
-        kfree(components[i]);
+    proc = process_current();
+    if (!vfs.initialized || path == NULL || proc == NULL) {
+        return -1;
     }
 
-    return ret;
+    if (vfs_path_lookup(path, &dir) < 0 || dir->type != VFS_FILE_DIRECTORY) {
+        return -1;
+    }
+
+    if (vfs_normalize_path(proc->cwd_path, path, new_path, sizeof(new_path)) < 0) {
+        klog_error("Path too long: %s", path);
+        return -1;
+    }
+
+    proc->cwd = dir;
+    strcpy(proc->cwd_path, new_path);
+    return 0;
+}
+
+/**
+ * Get the current process's working directory
+ */
+const char *vfs_getcwd(void)
+{
+    process_t *proc = process_current();
+
+    return (proc != NULL) ? proc->cwd_path : "/";
 }
 
 /* ============================================================================
@@ -408,7 +815,7 @@ int vfs_open(const char *path, uint32_t flags, uint32_t mode)
     }
 
     /* Allocate file structure */
-    file = (vfs_file_t *)kmalloc(sizeof(vfs_file_t));
+    file = (vfs_file_t *)objpool_alloc(&file_pool);
     if (file == NULL) {
         klog_error("Failed to allocate file structure");
         return -1;
@@ -423,7 +830,7 @@ int vfs_open(const char *path, uint32_t flags, uint32_t mode)
     /* Allocate file descriptor */
     fd = vfs_fd_alloc(file, 0);
     if (fd < 0) {
-        kfree(file);
+        objpool_free(&file_pool, file);
         return -1;
     }
 
@@ -431,6 +838,35 @@ int vfs_open(const char *path, uint32_t flags, uint32_t mode)
     return fd;
 }
 
+int vfs_open_inode(vfs_inode_t *inode, uint32_t flags)
+{
+    vfs_file_t *file;
+    int fd;
+
+    if (inode == NULL) {
+        return -1;
+    }
+
+    file = (vfs_file_t *)objpool_alloc(&file_pool);
+    if (file == NULL) {
+        klog_error("Failed to allocate file structure");
+        return -1;
+    }
+
+    file->inode = inode;
+    file->flags = flags;
+    file->offset = 0;
+    file->refcount = 0;
+    file->private_data = NULL;
+
+    fd = vfs_fd_alloc(file, 0);
+    if (fd < 0) {
+        objpool_free(&file_pool, file);
+        return -1;
+    }
+    return fd;
+}
+
 int vfs_close(int fd)
 {
     klog_debug("vfs_close: fd=%d", fd);
@@ -499,7 +935,7 @@ int64_t vfs_seek(int fd, int64_t offset, int whence)
     int64_t new_offset;
 
     file = vfs_fd_to_file(fd);
-    if (file == NULL) {
+    if (file == NULL || file->inode->type == VFS_FILE_PIPE) {
         return -1;
     }
 
@@ -575,20 +1011,297 @@ int vfs_readdir(int fd, vfs_dirent_t *dirent)
     return 0;
 }
 
+ssize_t vfs_getdents(int fd, vfs_dirent_t *buf, size_t count)
+{
+    vfs_file_t *file;
+    vfs_fs_ops_t *ops;
+    vfs_dirent_t *result;
+    size_t n;
+
+    file = vfs_fd_to_file(fd);
+    if (file == NULL || buf == NULL) {
+        return -1;
+    }
+
+    if (file->inode->type != VFS_FILE_DIRECTORY ||
+        file->inode->fs == NULL || file->inode->fs->ops == NULL) {
+        return -1;
+    }
+
+    ops = file->inode->fs->ops;
+    if (ops->dir_getdents != NULL) {
+        return ops->dir_getdents(file, buf, count);
+    }
+    if (ops->dir_readdir == NULL) {
+        return -1;
+    }
+
+    /* One entry at a time */
+    for (n = 0; n < count; n++) {
+        if (ops->dir_readdir(file, &result) < 0 || result == NULL) {
+            break;
+        }
+        buf[n] = *result;
+    }
+    return (ssize_t)n;
+}
+
+ssize_t vfs_copy_file_range(int src_fd, int dst_fd, size_t len)
+{
+    vfs_file_t *src;
+    vfs_file_t *dst;
+    vfs_fs_ops_t *ops;
+    uint8_t *bounce;
+    ssize_t total = 0;
+    ssize_t got, put;
+    size_t want;
+
+    src = vfs_fd_to_file(src_fd);
+    dst = vfs_fd_to_file(dst_fd);
+    if (src == NULL || dst == NULL || src->inode == NULL || dst->inode == NULL ||
+        src->inode->fs == NULL || dst->inode->fs == NULL) {
+        return -1;
+    }
+
+    if (!(src->flags & O_RDONLY) || !(dst->flags & O_WRONLY)) {
+        return -1;
+    }
+
+    /* Same filesystem: let it move pages itself (not within one file,
+     * where the ranges could overlap) */
+    ops = src->inode->fs->ops;
+    if (src->inode->fs == dst->inode->fs && src->inode != dst->inode &&
+        ops != NULL && ops->file_copy_range != NULL) {
+        return ops->file_copy_range(src, dst, len);
+    }
+
+    if (src->inode->fs->ops == NULL || src->inode->fs->ops->file_read == NULL ||
+        dst->inode->fs->ops == NULL || dst->inode->fs->ops->file_write == NULL) {
+        return -1;
+    }
+
+    bounce = (uint8_t *)kmalloc(VFS_COPY_CHUNK);
+    if (bounce == NULL) {
+        return -1;
+    }
+
+    while ((size_t)total < len) {
+        want = len - (size_t)total;
+        if (want > VFS_COPY_CHUNK) {
+            want = VFS_COPY_CHUNK;
+        }
+
+        got = src->inode->fs->ops->file_read(src, bounce, want);
+        if (got <= 0) {
+            if (got < 0 && total == 0) {
+                total = -1;
+            }
+            break;
+        }
+
+        put = dst->inode->fs->ops->file_write(dst, bounce, (size_t)got);
+        if (put != got) {
+            total = -1;
+            break;
+        }
+        total += got;
+    }
+
+    kfree(bounce);
+    return total;
+}
+
+/* ============================================================================
+ * File Mapping
+ * ============================================================================ */
+
+/**
+ * Resolve a write fault in a copy-on-write mapping
+ * Runs from the exception handler, so it only takes the mapping lock and
+ * one PMM page.
+ */
+static int vfs_mmap_fault(uint64_t va, bool write)
+{
+    vfs_mapping_t *map = NULL;
+    uint64_t copy;
+    uint64_t irq;
+    size_t index;
+    int i;
+
+    if (!write) {
+        return -1;
+    }
+
+    irq = spin_lock_irqsave(&mappings.lock);
+
+    for (i = 0; i < VFS_MAX_MAPPINGS; i++) {
+        vfs_mapping_t *m = &mappings.maps[i];
+        if (m->va != 0 && va >= m->va && va < m->va + (m->pages << PAGE_SHIFT)) {
+            map = m;
+            break;
+        }
+    }
+
+    if (map == NULL || !(map->flags & VFS_MAP_COW)) {
+        spin_unlock_irqrestore(&mappings.lock, irq);
+        return -1;
+    }
+
+    index = (va - map->va) >> PAGE_SHIFT;
+    if (map->phys[index] & VFS_PAGE_COPIED) {
+        /* Another CPU copied it while this one was faulting */
+        spin_unlock_irqrestore(&mappings.lock, irq);
+        return 0;
+    }
+
+    copy = pmm_alloc_page();
+    if (copy == 0) {
+        spin_unlock_irqrestore(&mappings.lock, irq);
+        klog_error("vfs_mmap: out of memory for copy-on-write page");
+        return -1;
+    }
+
+    memcpy((void *)copy, (const void *)map->phys[index], PAGE_SIZE);
+    if (mmu_vmap_replace(va, copy, MEM_KERNEL_RW) != 0) {
+        spin_unlock_irqrestore(&mappings.lock, irq);
+        pmm_free_page(copy);
+        return -1;
+    }
+    map->phys[index] = copy | VFS_PAGE_COPIED;
+
+    spin_unlock_irqrestore(&mappings.lock, irq);
+    return 0;
+}
+
+void *vfs_mmap(int fd, uint64_t offset, size_t len, uint32_t flags)
+{
+    vfs_file_t *file;
+    vfs_fs_ops_t *ops;
+    vfs_mapping_t *map = NULL;
+    uint64_t *phys;
+    uint64_t va;
+    uint64_t irq;
+    size_t pages;
+    int i;
+
+    file = vfs_fd_to_file(fd);
+    if (file == NULL || file->inode == NULL || file->inode->fs == NULL) {
+        return NULL;
+    }
+
+    ops = file->inode->fs->ops;
+    if (ops == NULL || ops->file_mmap == NULL || ops->file_munmap == NULL ||
+        !mmu_enabled()) {
+        return NULL;
+    }
+
+    if (file->inode->type != VFS_FILE_REGULAR || !(file->flags & O_RDONLY) ||
+        !(flags & (VFS_MAP_READ | VFS_MAP_COW)) || !IS_PAGE_ALIGNED(offset) ||
+        len == 0 || offset >= file->inode->size || len > file->inode->size - offset) {
+        return NULL;
+    }
+
+    pages = (len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    phys = (uint64_t *)kmalloc(pages * sizeof(uint64_t));
+    if (phys == NULL) {
+        return NULL;
+    }
+
+    /* Claim a slot first so a full table fails before pinning any pages */
+    irq = spin_lock_irqsave(&mappings.lock);
+    for (i = 0; i < VFS_MAX_MAPPINGS; i++) {
+        if (mappings.maps[i].va == 0 && mappings.maps[i].phys == NULL) {
+            map = &mappings.maps[i];
+            map->phys = phys;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&mappings.lock, irq);
+
+    if (map == NULL) {
+        klog_warn("vfs_mmap: all %u mappings in use", VFS_MAX_MAPPINGS);
+        kfree(phys);
+        return NULL;
+    }
+
+    if (ops->file_mmap(file, offset, pages, phys) < 0) {
+        goto fail;
+    }
+
+    /* Copy-on-write pages start read-only too: the first write faults */
+    va = mmu_vmap(phys, pages, MEM_KERNEL_RO);
+    if (va == 0) {
+        ops->file_munmap(file->inode, offset, pages);
+        goto fail;
+    }
+
+    irq = spin_lock_irqsave(&mappings.lock);
+    map->pages = pages;
+    map->flags = flags;
+    map->inode = file->inode;
+    map->offset = offset;
+    map->va = va;
+    spin_unlock_irqrestore(&mappings.lock, irq);
+
+    klog_debug("vfs_mmap: fd=%d, %u pages at %p", fd, (uint32_t)pages, (void *)va);
+    return (void *)va;
+
+fail:
+    irq = spin_lock_irqsave(&mappings.lock);
+    map->phys = NULL;
+    spin_unlock_irqrestore(&mappings.lock, irq);
+    kfree(phys);
+    return NULL;
+}
+
+int vfs_munmap(void *addr, size_t len)
+{
+    vfs_mapping_t map;
+    uint64_t irq;
+    size_t i;
+
+    irq = spin_lock_irqsave(&mappings.lock);
+    for (i = 0; i < VFS_MAX_MAPPINGS; i++) {
+        if (mappings.maps[i].va != 0 && mappings.maps[i].va == (uint64_t)addr) {
+            break;
+        }
+    }
+
+    if (i == VFS_MAX_MAPPINGS ||
+        mappings.maps[i].pages != (len + PAGE_SIZE - 1) >> PAGE_SHIFT) {
+        spin_unlock_irqrestore(&mappings.lock, irq);
+        klog_error("vfs_munmap: %p is not a mapping of %u bytes", addr, (uint32_t)len);
+        return -1;
+    }
+
+    map = mappings.maps[i];
+    mappings.maps[i].va = 0;
+    mappings.maps[i].phys = NULL;
+    spin_unlock_irqrestore(&mappings.lock, irq);
+
+    mmu_vunmap(map.va, map.pages);
+
+    /* Copies belong to the mapping, the rest back to the filesystem */
+    for (i = 0; i < map.pages; i++) {
+        if (map.phys[i] & VFS_PAGE_COPIED) {
+            pmm_free_page(map.phys[i] & ~VFS_PAGE_COPIED);
+        }
+    }
+    map.inode->fs->ops->file_munmap(map.inode, map.offset, map.pages);
+
+    kfree(map.phys);
+    return 0;
+}
+
 /* ============================================================================
  * File/Directory Creation/Deletion
  * ============================================================================ */
 
 int vfs_create(const char *path, uint32_t mode)
 {
-    char *components[32];
-    char *filename;
-    char *dir_path;
+    char filename[MAX_FILENAME_LEN];
     vfs_inode_t *parent_inode;
     vfs_inode_t *new_inode;
-    int num_components;
-    int ret;
-    int i;
 
     if (!vfs.initialized || path == NULL) {
         return -1;
@@ -596,86 +1309,36 @@ int vfs_create(const char *path, uint32_t mode)
 
     klog_debug("vfs_create: %s (mode=0x%x)", path, mode);
 
-    /* Split path to get parent directory and filename */
-    num_components = split_path(path, components, 32);
-    if (num_components <= 0) {
-        /* Creating file in root */
-        filename = (char *)path;
-        parent_inode = vfs.root;
-    } else {
-        /* Last component is the filename */
-        filename = components[num_components - 1];
-
-        if (num_components == 1) {
-            /* Creating in root directory */
-            parent_inode = vfs.root;
-        } else {
-            /* Build parent directory path */
-            size_t path_len = 0;
-            for (i = 0; i < num_components - 1; i++) {
-                path_len += strlen(components[i]) + 1; /* +1 for '/' */
-            }
-            dir_path = (char *)kmalloc(path_len + 2);
-            if (dir_path == NULL) {
-                ret = -1;
-                goto cleanup;
-            }
-
-            strcpy(dir_path, "/");
-            for (i = 0; i < num_components - 1; i++) {
-                strcat(dir_path, components[i]);
-                if (i < num_components - 2) {
-                    strcat(dir_path, "/");
-                }
-            }
-
-            /* Lookup parent directory */
-            ret = vfs_path_lookup(dir_path, &parent_inode);
-            kfree(dir_path);
-            if (ret < 0) {
-                klog_error("Parent directory not found");
-                goto cleanup;
-            }
-        }
+    /* Get parent directory and filename */
+    if (vfs_lookup_parent(path, &parent_inode, filename) < 0) {
+        return -1;
     }
 
     /* Check if parent supports file creation */
     if (parent_inode->fs == NULL || parent_inode->fs->ops == NULL ||
         parent_inode->fs->ops->inode_create == NULL) {
         klog_error("Filesystem doesn't support file creation");
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
     /* Create the file */
-    ret = parent_inode->fs->ops->inode_create(parent_inode, filename, mode, &new_inode);
-    if (ret < 0) {
+    if (parent_inode->fs->ops->inode_create(parent_inode, filename, mode, &new_inode) < 0) {
         klog_error("Failed to create file: %s", filename);
-        goto cleanup;
+        return -1;
     }
 
-    klog_debug("Created file: %s", path);
-    ret = 0;
+    /* The name now exists (it may have been cached as absent) */
+    dcache_store(parent_inode, filename, strlen(filename), new_inode);
 
-cleanup:
-    if (num_components > 0) {
-        for (i = 0; i < num_components; i++) {
-            kfree(components[i]);
-        }
-    }
-    return ret;
+    klog_debug("Created file: %s", path);
+    return 0;
 }
 
 int vfs_mkdir(const char *path, uint32_t mode)
 {
-    char *components[32];
-    char *dirname;
-    char *parent_path;
+    char dirname[MAX_FILENAME_LEN];
     vfs_inode_t *parent_inode;
     vfs_inode_t *new_inode;
-    int num_components;
-    int ret;
-    int i;
 
     if (!vfs.initialized || path == NULL) {
         return -1;
@@ -683,83 +1346,35 @@ int vfs_mkdir(const char *path, uint32_t mode)
 
     klog_debug("vfs_mkdir: %s (mode=0x%x)", path, mode);
 
-    /* Split path to get parent directory and dirname */
-    num_components = split_path(path, components, 32);
-    if (num_components <= 0) {
-        /* Can't create root */
-        klog_error("Invalid path for mkdir");
+    /* Get parent directory and dirname */
+    if (vfs_lookup_parent(path, &parent_inode, dirname) < 0) {
         return -1;
     }
 
-    /* Last component is the new directory name */
-    dirname = components[num_components - 1];
-
-    if (num_components == 1) {
-        /* Creating in root directory */
-        parent_inode = vfs.root;
-    } else {
-        /* Build parent directory path */
-        size_t path_len = 0;
-        for (i = 0; i < num_components - 1; i++) {
-            path_len += strlen(components[i]) + 1;
-        }
-        parent_path = (char *)kmalloc(path_len + 2);
-        if (parent_path == NULL) {
-            ret = -1;
-            goto cleanup;
-        }
-
-        strcpy(parent_path, "/");
-        for (i = 0; i < num_components - 1; i++) {
-            strcat(parent_path, components[i]);
-            if (i < num_components - 2) {
-                strcat(parent_path, "/");
-            }
-        }
-
-        /* Lookup parent directory */
-        ret = vfs_path_lookup(parent_path, &parent_inode);
-        kfree(parent_path);
-        if (ret < 0) {
-            klog_error("Parent directory not found");
-            goto cleanup;
-        }
-    }
-
     /* Check if parent supports directory creation */
     if (parent_inode->fs == NULL || parent_inode->fs->ops == NULL ||
         parent_inode->fs->ops->inode_mkdir == NULL) {
         klog_error("Filesystem doesn't support directory creation");
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
     /* Create the directory */
-    ret = parent_inode->fs->ops->inode_mkdir(parent_inode, dirname, mode, &new_inode);
-    if (ret < 0) {
+    if (parent_inode->fs->ops->inode_mkdir(parent_inode, dirname, mode, &new_inode) < 0) {
         klog_error("Failed to create directory: %s", dirname);
-        goto cleanup;
+        return -1;
     }
 
-    klog_debug("Created directory: %s", path);
-    ret = 0;
+    new_inode->parent = parent_inode;
+    dcache_store(parent_inode, dirname, strlen(dirname), new_inode);
 
-cleanup:
-    for (i = 0; i < num_components; i++) {
-        kfree(components[i]);
-    }
-    return ret;
+    klog_debug("Created directory: %s", path);
+    return 0;
 }
 
 int vfs_unlink(const char *path)
 {
-    char *components[32];
-    char *filename;
-    char *parent_path;
+    char filename[MAX_FILENAME_LEN];
     vfs_inode_t *parent_inode;
-    int num_components;
-    int ret;
-    int i;
 
     if (!vfs.initialized || path == NULL) {
         return -1;
@@ -767,82 +1382,37 @@ int vfs_unlink(const char *path)
 
     klog_debug("vfs_unlink: %s", path);
 
-    /* Split path to get parent directory and filename */
-    num_components = split_path(path, components, 32);
-    if (num_components <= 0) {
-        klog_error("Invalid path for unlink");
+    /* Get parent directory and filename */
+    if (vfs_lookup_parent(path, &parent_inode, filename) < 0) {
         return -1;
     }
 
-    /* Last component is the filename */
-    filename = components[num_components - 1];
-
-    if (num_components == 1) {
-        /* Deleting from root directory */
-        parent_inode = vfs.root;
-    } else {
-        /* Build parent directory path */
-        size_t path_len = 0;
-        for (i = 0; i < num_components - 1; i++) {
-            path_len += strlen(components[i]) + 1;
-        }
-        parent_path = (char *)kmalloc(path_len + 2);
-        if (parent_path == NULL) {
-            ret = -1;
-            goto cleanup;
-        }
-
-        strcpy(parent_path, "/");
-        for (i = 0; i < num_components - 1; i++) {
-            strcat(parent_path, components[i]);
-            if (i < num_components - 2) {
-                strcat(parent_path, "/");
-            }
-        }
-
-        /* Lookup parent directory */
-        ret = vfs_path_lookup(parent_path, &parent_inode);
-        kfree(parent_path);
-        if (ret < 0) {
-            klog_error("Parent directory not found");
-            goto cleanup;
-        }
-    }
-
     /* Check if parent supports file deletion */
     if (parent_inode->fs == NULL || parent_inode->fs->ops == NULL ||
         parent_inode->fs->ops->inode_unlink == NULL) {
         klog_error("Filesystem doesn't support file deletion");
-        ret = -1;
-        goto cleanup;
+        return -1;
     }
 
     /* Delete the file */
-    ret = parent_inode->fs->ops->inode_unlink(parent_inode, filename);
-    if (ret < 0) {
+    if (parent_inode->fs->ops->inode_unlink(parent_inode, filename) < 0) {
         klog_error("Failed to delete file: %s", filename);
-        goto cleanup;
+        return -1;
     }
 
-    klog_debug("Deleted file: %s", path);
-    ret = 0;
+    /* The inode is gone; remember the name as absent */
+    dcache_store(parent_inode, filename, strlen(filename), NULL);
 
-cleanup:
-    for (i = 0; i < num_components; i++) {
-        kfree(components[i]);
-    }
-    return ret;
+    klog_debug("Deleted file: %s", path);
+    return 0;
 }
 
 int vfs_rmdir(const char *path)
 {
-    char *components[32];
-    char *dirname;
-    char *parent_path;
+    char dirname[MAX_FILENAME_LEN];
     vfs_inode_t *parent_inode;
-    int num_components;
-    int ret;
-    int i;
+    vfs_inode_t *dir = NULL;
+    process_t *proc;
 
     if (!vfs.initialized || path == NULL) {
         return -1;
@@ -850,71 +1420,120 @@ int vfs_rmdir(const char *path)
 
     klog_debug("vfs_rmdir: %s", path);
 
-    /* Split path to get parent directory and dirname */
-    num_components = split_path(path, components, 32);
-    if (num_components <= 0) {
-        klog_error("Invalid path for rmdir");
+    /* Get parent directory and dirname */
+    if (vfs_lookup_parent(path, &parent_inode, dirname) < 0) {
         return -1;
     }
 
-    /* Last component is the directory name */
-    dirname = components[num_components - 1];
+    /* Check if parent supports directory deletion */
+    if (parent_inode->fs == NULL || parent_inode->fs->ops == NULL ||
+        parent_inode->fs->ops->inode_rmdir == NULL) {
+        klog_error("Filesystem doesn't support directory deletion");
+        return -1;
+    }
 
-    if (num_components == 1) {
-        /* Deleting from root directory */
-        parent_inode = vfs.root;
-    } else {
-        /* Build parent directory path */
-        size_t path_len = 0;
-        for (i = 0; i < num_components - 1; i++) {
-            path_len += strlen(components[i]) + 1;
+    /* The working directory holds a pointer to its inode */
+    proc = process_current();
+    if (vfs_lookup_child(parent_inode, dirname, strlen(dirname), &dir) == 0 &&
+        proc != NULL && proc->cwd == dir) {
+        klog_error("Directory is in use: %s", dirname);
+        return -1;
+    }
+
+    /* Delete the directory */
+    if (parent_inode->fs->ops->inode_rmdir(parent_inode, dirname) < 0) {
+        klog_error("Failed to delete directory: %s", dirname);
+        return -1;
+    }
+
+    /* Negative entries under the freed inode must not outlive it */
+    if (dir != NULL) {
+        dcache_forget(dir);
+    }
+    dcache_store(parent_inode, dirname, strlen(dirname), NULL);
+
+    klog_debug("Deleted directory: %s", path);
+    return 0;
+}
+
+int vfs_rename(const char *old_path, const char *new_path)
+{
+    char old_name[MAX_FILENAME_LEN];
+    char new_name[MAX_FILENAME_LEN];
+    vfs_inode_t *old_dir;
+    vfs_inode_t *new_dir;
+    vfs_inode_t *inode;
+    vfs_inode_t *target = NULL;
+    vfs_inode_t *p;
+    process_t *proc;
+
+    if (!vfs.initialized || old_path == NULL || new_path == NULL) {
+        return -1;
+    }
+
+    klog_debug("vfs_rename: %s -> %s", old_path, new_path);
+
+    if (vfs_lookup_parent(old_path, &old_dir, old_name) < 0 ||
+        vfs_lookup_parent(new_path, &new_dir, new_name) < 0) {
+        return -1;
+    }
+
+    if (vfs_lookup_child(old_dir, old_name, strlen(old_name), &inode) < 0) {
+        klog_error("File not found: %s", old_path);
+        return -1;
+    }
+
+    /* Only an entry within one filesystem can be relinked */
+    if (old_dir->fs != new_dir->fs || old_dir->fs == NULL || old_dir->fs->ops == NULL ||
+        old_dir->fs->ops->inode_rename == NULL) {
+        return VFS_RENAME_XDEV;
+    }
+
+    if (vfs_lookup_child(new_dir, new_name, strlen(new_name), &target) == 0) {
+        if (target == inode) {
+            return 0;
         }
-        parent_path = (char *)kmalloc(path_len + 2);
-        if (parent_path == NULL) {
-            ret = -1;
-            goto cleanup;
+        if (target->type == VFS_FILE_DIRECTORY || inode->type == VFS_FILE_DIRECTORY) {
+            klog_error("Cannot replace '%s' with '%s'", new_path, old_path);
+            return -1;
         }
+    } else {
+        target = NULL;
+    }
 
-        strcpy(parent_path, "/");
-        for (i = 0; i < num_components - 1; i++) {
-            strcat(parent_path, components[i]);
-            if (i < num_components - 2) {
-                strcat(parent_path, "/");
+    if (inode->type == VFS_FILE_DIRECTORY) {
+        /* A directory cannot move below itself */
+        for (p = new_dir; p != NULL; p = p->parent) {
+            if (p == inode) {
+                klog_error("Cannot move '%s' into itself", old_path);
+                return -1;
             }
         }
 
-        /* Lookup parent directory */
-        ret = vfs_path_lookup(parent_path, &parent_inode);
-        kfree(parent_path);
-        if (ret < 0) {
-            klog_error("Parent directory not found");
-            goto cleanup;
+        /* The working directory's path string would go stale */
+        proc = process_current();
+        for (p = (proc != NULL) ? proc->cwd : NULL; p != NULL; p = p->parent) {
+            if (p == inode) {
+                klog_error("Directory is in use: %s", old_name);
+                return -1;
+            }
         }
     }
 
-    /* Check if parent supports directory deletion */
-    if (parent_inode->fs == NULL || parent_inode->fs->ops == NULL ||
-        parent_inode->fs->ops->inode_rmdir == NULL) {
-        klog_error("Filesystem doesn't support directory deletion");
-        ret = -1;
-        goto cleanup;
+    if (old_dir->fs->ops->inode_rename(old_dir, old_name, new_dir, new_name) < 0) {
+        klog_error("Failed to rename %s to %s", old_path, new_path);
+        return -1;
     }
 
-    /* Delete the directory */
-    ret = parent_inode->fs->ops->inode_rmdir(parent_inode, dirname);
-    if (ret < 0) {
-        klog_error("Failed to delete directory: %s", dirname);
-        goto cleanup;
+    if (inode->type == VFS_FILE_DIRECTORY) {
+        inode->parent = new_dir;
     }
 
-    klog_debug("Deleted directory: %s", path);
-    ret = 0;
+    dcache_store(old_dir, old_name, strlen(old_name), NULL);
+    dcache_store(new_dir, new_name, strlen(new_name), inode);
 
-cleanup:
-    for (i = 0; i < num_components; i++) {
-        kfree(components[i]);
-    }
-    return ret;
+    klog_debug("Renamed %s -> %s", old_path, new_path);
+    return 0;
 }
 
 /**
@@ -7,19 +7,69 @@
 #include <aeos/interrupts.h>
 #include <aeos/gic.h>
 #include <aeos/timer.h>
+#include <aeos/mmu.h>
+#include <aeos/process.h>
+#include <aeos/profile.h>
+#include <aeos/trace.h>
+#include <aeos/softirq.h>
+#include <aeos/percpu.h>
+#include <aeos/smp.h>
 #include <aeos/kprintf.h>
+#include <aeos/string.h>
 #include <aeos/types.h>
 
 /* IRQ handler table */
 static irq_handler_t irq_handlers[GIC_MAX_IRQ];
 
-/* Exception statistics */
-static struct {
-    uint64_t sync_count;
-    uint64_t irq_count;
-    uint64_t fiq_count;
-    uint64_t serr_count;
-} exception_stats;
+/* Exception statistics, a copy per CPU (summed by exception_get_stats) */
+typedef struct {
+    uint64_t types[4];                  /* By exception_type_t */
+    uint64_t spurious;
+    irq_stat_t irqs[IRQ_STATS_NR];
+} PERCPU_ALIGNED exc_cpu_stats_t;
+
+static exc_cpu_stats_t exception_stats[MAX_CPUS];
+
+/* Vector entry counts, a row per CPU (vectors.asm) */
+extern uint64_t exception_counters[MAX_CPUS][16];
+
+static inline exc_cpu_stats_t *this_cpu_stats(void)
+{
+    return &exception_stats[smp_processor_id()];
+}
+
+/**
+ * Histogram bucket for a latency: floor(log2(ticks)), 0 for 0 or 1
+ */
+static inline uint32_t latency_bucket(uint64_t ticks)
+{
+    uint32_t b;
+
+    if (ticks < 2) {
+        return 0;
+    }
+    b = 63 - (uint32_t)__builtin_clzll(ticks);
+    return b < IRQ_LAT_BUCKETS ? b : IRQ_LAT_BUCKETS - 1;
+}
+
+/**
+ * Count one sample of a latency statistic
+ */
+void irq_stat_add(irq_stat_t *st, uint64_t ticks)
+{
+    percpu_add(&st->count, 1);
+    percpu_add(&st->ticks, ticks);
+    percpu_add(&st->hist[latency_bucket(ticks)], 1);
+}
+
+/**
+ * Count an IRQ and the ticks from its acknowledge to its EOI
+ */
+static void account_irq(uint32_t irq, uint64_t ticks)
+{
+    irq_stat_add(&this_cpu_stats()->irqs[irq < IRQ_STATS_NR ? irq : IRQ_STATS_NR - 1],
+                 ticks);
+}
 
 /**
  * Get Exception Syndrome Register (ESR_EL1)
@@ -69,6 +119,30 @@ static void print_exception_class(uint32_t ec)
     }
 }
 
+/**
+ * Decide whether a fault belongs to the current user process
+ * @return true if the process should be killed (after reporting it)
+ */
+static bool user_fault_kill(uint32_t source, uint32_t ec, uint64_t far,
+                            const cpu_context_t *context)
+{
+    process_t *proc = process_current();
+
+    if (proc == NULL || proc->mm == NULL) {
+        return false;
+    }
+
+    if (source != EXC_FROM_LOWER_A64 && source != EXC_FROM_LOWER_A32 &&
+        !(ec == ESR_EC_DABT_CUR && far >= MMU_USER_BASE && far < MMU_USER_TOP)) {
+        return false;
+    }
+
+    kprintf("\nPID %u '%s' killed: ", (uint32_t)proc->pid, proc->name);
+    print_exception_class(ec);
+    kprintf(" at pc %p, address %p\n", (void *)context->pc, (void *)far);
+    return true;
+}
+
 /**
  * Generic exception handler
  * Called from assembly exception vectors
@@ -82,11 +156,8 @@ void handle_exception(uint32_t source, uint32_t type, cpu_context_t *context)
     uint64_t esr, far, ec;
 
     /* Update statistics */
-    switch (type) {
-        case EXC_SYNC: exception_stats.sync_count++; break;
-        case EXC_IRQ:  exception_stats.irq_count++; break;
-        case EXC_FIQ:  exception_stats.fiq_count++; break;
-        case EXC_SERR: exception_stats.serr_count++; break;
+    if (type <= EXC_SERR) {
+        percpu_add(&this_cpu_stats()->types[type], 1);
     }
 
     /* Get exception information */
@@ -94,6 +165,19 @@ void handle_exception(uint32_t source, uint32_t type, cpu_context_t *context)
     far = get_fault_address();
     ec = get_exception_class(esr);
 
+    /* Copy-on-write or demand-zero fault: retry the access */
+    if (type == EXC_SYNC && mmu_handle_fault(esr, far) == 0) {
+        return;
+    }
+
+    /* A user program's fault, or a bad pointer it passed in: kill it */
+    if (type == EXC_SYNC && user_fault_kill(source, ec, far, context)) {
+        process_exit();
+    }
+
+    /* The report has to get out even if no interrupt ever runs again */
+    kprintf_panic_mode();
+
     /* Print exception details */
     kprintf("\n");
     kprintf("======== EXCEPTION ========\n");
@@ -143,34 +227,48 @@ void handle_exception(uint32_t source, uint32_t type, cpu_context_t *context)
  */
 void handle_irq(uint32_t source, uint32_t type, cpu_context_t *context)
 {
+    uint32_t iar;
     uint32_t irq;
+    uint64_t start;
     irq_handler_t handler;
 
-    (void)source;   /* Unused */
     (void)type;     /* Unused */
-    (void)context;  /* Unused for now */
 
     /* Update statistics */
-    exception_stats.irq_count++;
+    percpu_add(&this_cpu_stats()->types[EXC_IRQ], 1);
 
     /* Acknowledge interrupt and get IRQ number */
-    irq = gic_acknowledge_irq();
+    iar = gic_acknowledge_irq();
+    irq = GIC_IAR_IRQ(iar);
+    start = timer_get_counter();
 
     /* Spurious interrupt check */
     if (irq >= GIC_MAX_IRQ) {
+        percpu_add(&this_cpu_stats()->spurious, 1);
         return;
     }
 
+    /* The timer tick is the profiler's sampling clock */
+    if (irq == TIMER_VIRT_PPI) {
+        profile_sample(context, source == EXC_FROM_LOWER_A64);
+    }
+
     /* Call registered handler */
+    TRACEPOINT(IRQ_ENTRY, irq, 0);
     handler = irq_handlers[irq];
     if (handler != NULL) {
         handler();
     } else {
         klog_warn("Unhandled IRQ: %u", irq);
     }
+    TRACEPOINT(IRQ_EXIT, irq, 0);
 
     /* Signal end of interrupt */
-    gic_end_of_irq(irq);
+    account_irq(irq, timer_get_counter() - start);
+    gic_end_of_irq(iar);
+
+    /* Bottom halves the handler scheduled, with IRQs unmasked again */
+    softirq_run();
 }
 
 /**
@@ -180,28 +278,39 @@ void handle_irq(uint32_t source, uint32_t type, cpu_context_t *context)
  */
 void handle_fiq(uint32_t source, uint32_t type, cpu_context_t *context)
 {
-    (void)source;
+    uint64_t start;
+
     (void)type;
-    (void)context;
 
     /* Update statistics */
-    exception_stats.fiq_count++;
+    percpu_add(&this_cpu_stats()->types[EXC_FIQ], 1);
 
-    /* Try to handle timer interrupt directly */
+    /* Try to handle timer interrupt directly (no GIC acknowledge) */
+    start = timer_get_counter();
     if (timer_handle_fiq()) {
+        profile_sample(context, source == EXC_FROM_LOWER_A64);
+        account_irq(TIMER_VIRT_PPI, timer_get_counter() - start);
+        softirq_run();
         return;  /* Timer interrupt handled */
     }
 
     /* Unknown FIQ source - try GIC acknowledge as fallback */
-    uint32_t irq = gic_acknowledge_irq();
+    uint32_t iar = gic_acknowledge_irq();
+    uint32_t irq = GIC_IAR_IRQ(iar);
+    start = timer_get_counter();
     if (irq < GIC_MAX_IRQ) {
         irq_handler_t handler = irq_handlers[irq];
+        TRACEPOINT(IRQ_ENTRY, irq, 1);
         if (handler != NULL) {
             handler();
         }
-        gic_end_of_irq(irq);
+        TRACEPOINT(IRQ_EXIT, irq, 1);
+        account_irq(irq, timer_get_counter() - start);
+        gic_end_of_irq(iar);
+        softirq_run();
+    } else {
+        percpu_add(&this_cpu_stats()->spurious, 1);
     }
-    /* If irq >= GIC_MAX_IRQ (spurious), just return */
 }
 
 /**
@@ -232,6 +341,97 @@ void irq_unregister_handler(uint32_t irq)
     klog_debug("Unregistered handler for IRQ %u", irq);
 }
 
+/**
+ * Get the handler registered for an IRQ
+ */
+irq_handler_t irq_get_handler(uint32_t irq)
+{
+    if (irq >= GIC_MAX_IRQ) {
+        return NULL;
+    }
+    return irq_handlers[irq];
+}
+
+/**
+ * Get exception and vector counts
+ */
+void exception_get_stats(exception_stats_t *stats)
+{
+    uint32_t i;
+
+    if (!stats) {
+        return;
+    }
+
+    for (i = 0; i < 16; i++) {
+        stats->vectors[i / 4][i % 4] =
+            percpu_sum(&exception_counters[0][i], sizeof(exception_counters[0]));
+    }
+    for (i = 0; i < 4; i++) {
+        stats->types[i] = percpu_sum(&exception_stats[0].types[i],
+                                     sizeof(exception_stats[0]));
+    }
+    stats->spurious = percpu_sum(&exception_stats[0].spurious,
+                                 sizeof(exception_stats[0]));
+}
+
+/**
+ * Get one IRQ number's count and latency histogram
+ */
+int irq_get_stat(uint32_t irq, irq_stat_t *stat)
+{
+    const irq_stat_t *first;
+    uint32_t b;
+
+    if (irq >= IRQ_STATS_NR || !stat) {
+        return -1;
+    }
+
+    first = &exception_stats[0].irqs[irq];
+    stat->count = percpu_sum(&first->count, sizeof(exception_stats[0]));
+    stat->ticks = percpu_sum(&first->ticks, sizeof(exception_stats[0]));
+    for (b = 0; b < IRQ_LAT_BUCKETS; b++) {
+        stat->hist[b] = percpu_sum(&first->hist[b], sizeof(exception_stats[0]));
+    }
+    return 0;
+}
+
+/**
+ * Latency at a percentile, from the histogram
+ */
+uint64_t irq_stat_percentile(const irq_stat_t *stat, uint32_t pct)
+{
+    uint64_t total = 0, want, seen = 0;
+    uint32_t b;
+
+    if (!stat || pct == 0) {
+        return 0;
+    }
+    if (pct > 100) {
+        pct = 100;
+    }
+
+    for (b = 0; b < IRQ_LAT_BUCKETS; b++) {
+        total += stat->hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    /* Rank of the wanted IRQ, rounded up */
+    want = (total * pct + 99) / 100;
+    for (b = 0; b < IRQ_LAT_BUCKETS; b++) {
+        seen += stat->hist[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+    if (b >= IRQ_LAT_BUCKETS - 1) {
+        return ~0ULL;
+    }
+    return (2ULL << b) - 1;
+}
+
 /**
  * Dump critical system registers for debugging
  */
@@ -248,7 +448,7 @@ void dump_system_registers(void)
     /* Read basic registers one at a time with debugging */
     kprintf("Reading VBAR_EL1...\n");
     __asm__ volatile("mrs %0, vbar_el1" : "=r"(vbar));
-    kprintf("  VBAR_EL1:  0x%016x\n", vbar);
+    kprintf("  VBAR_EL1:  0x%016llx\n", vbar);
 
     kprintf("Reading CurrentEL...\n");
     __asm__ volatile("mrs %0, currentel" : "=r"(currentel));
@@ -260,7 +460,7 @@ void dump_system_registers(void)
 
     kprintf("Reading SP...\n");
     __asm__ volatile("mov %0, sp" : "=r"(sp));
-    kprintf("  SP:         0x%016x\n", sp);
+    kprintf("  SP:         0x%016llx\n", sp);
 
     kprintf("Reading DAIF...\n");
     __asm__ volatile("mrs %0, daif" : "=r"(daif));
@@ -310,16 +510,16 @@ void dump_system_registers(void)
     kprintf("========================================\n");
 
     kprintf("Exception Handling:\n");
-    kprintf("  VBAR_EL1:  0x%016x\n", vbar);
-    kprintf("  ELR_EL1:   0x%016x\n", elr);
-    kprintf("  SPSR_EL1:  0x%016x\n", spsr);
-    kprintf("  ESR_EL1:   0x%016x\n", esr);
-    kprintf("  FAR_EL1:   0x%016x\n", far);
+    kprintf("  VBAR_EL1:  0x%016llx\n", vbar);
+    kprintf("  ELR_EL1:   0x%016llx\n", elr);
+    kprintf("  SPSR_EL1:  0x%016llx\n", spsr);
+    kprintf("  ESR_EL1:   0x%016llx\n", esr);
+    kprintf("  FAR_EL1:   0x%016llx\n", far);
 
     kprintf("\nStack Pointers:\n");
-    kprintf("  Current SP: 0x%016x\n", sp);
-    kprintf("  SP_EL0:     0x%016x\n", sp_el0);
-    kprintf("  SP_EL1:     0x%016x\n", sp_el1);
+    kprintf("  Current SP: 0x%016llx\n", sp);
+    kprintf("  SP_EL0:     0x%016llx\n", sp_el0);
+    kprintf("  SP_EL1:     0x%016llx\n", sp_el1);
     kprintf("  SPSel:      %u (0=SP_EL0, 1=SP_EL1)\n", (uint32_t)(spsel & 1));
 
     kprintf("\nException Level:\n");
@@ -332,13 +532,13 @@ void dump_system_registers(void)
     kprintf("  F (FIQ):    %u\n", (uint32_t)((daif >> 6) & 1));
 
     kprintf("\nMMU Configuration:\n");
-    kprintf("  SCTLR_EL1:  0x%016x\n", sctlr);
+    kprintf("  SCTLR_EL1:  0x%016llx\n", sctlr);
     kprintf("    M (MMU):    %u\n", (uint32_t)(sctlr & 1));
     kprintf("    C (DCache): %u\n", (uint32_t)((sctlr >> 2) & 1));
     kprintf("    I (ICache): %u\n", (uint32_t)((sctlr >> 12) & 1));
-    kprintf("  TCR_EL1:    0x%016x\n", tcr);
-    kprintf("  TTBR0_EL1:  0x%016x\n", ttbr0);
-    kprintf("  TTBR1_EL1:  0x%016x\n", ttbr1);
+    kprintf("  TCR_EL1:    0x%016llx\n", tcr);
+    kprintf("  TTBR0_EL1:  0x%016llx\n", ttbr0);
+    kprintf("  TTBR1_EL1:  0x%016llx\n", ttbr1);
 
     kprintf("========================================\n");
     kprintf("\n");
@@ -361,10 +561,7 @@ void interrupts_init(void)
     }
 
     /* Clear exception statistics */
-    exception_stats.sync_count = 0;
-    exception_stats.irq_count = 0;
-    exception_stats.fiq_count = 0;
-    exception_stats.serr_count = 0;
+    memset(exception_stats, 0, sizeof(exception_stats));
 
     /* Install exception vector table */
     vbar = (uint64_t)&exception_vector_table;
@@ -92,7 +92,32 @@ void gic_init(void)
     /* Enable distributor for Group 1 interrupts */
     MMIO_WRITE(GICD_CTLR, GICD_CTLR_ENABLE_GRP1);
 
-    /* Configure CPU interface */
+    /* Configure the boot CPU's interface */
+    gic_init_cpu();
+
+    kprintf("  GIC base: GICD=%p, GICC=%p\n",
+            (void *)GICD_BASE, (void *)GICC_BASE);
+    klog_info("GIC initialized");
+}
+
+/**
+ * Initialize the calling CPU's GIC state
+ *
+ * SGIs and PPIs (IRQs 0-31) have banked enable, group and priority
+ * registers in the distributor, and each CPU has its own CPU interface,
+ * so every core has to run this for itself.
+ */
+void gic_init_cpu(void)
+{
+    uint32_t i;
+
+    /* Banked SGI/PPI state: disabled, Group 1, lowest priority */
+    MMIO_WRITE(GICD_ICENABLER, 0xFFFFFFFF);
+    MMIO_WRITE(GICD_IGROUPR, 0xFFFFFFFF);
+    for (i = 0; i < 32; i += 4) {
+        MMIO_WRITE(GICD_IPRIORITYR + i, 0xA0A0A0A0);
+    }
+
     /* Set priority mask to allow all priorities */
     MMIO_WRITE(GICC_PMR, 0xFF);
 
@@ -101,10 +126,6 @@ void gic_init(void)
 
     /* Enable CPU interface for Group 1 interrupts (IRQ) */
     MMIO_WRITE(GICC_CTLR, GICC_CTLR_ENABLE_GRP1);
-
-    kprintf("  GIC base: GICD=%p, GICC=%p\n",
-            (void *)GICD_BASE, (void *)GICC_BASE);
-    klog_info("GIC initialized");
 }
 
 /**
@@ -172,24 +193,20 @@ void gic_set_priority(uint32_t irq, uint8_t priority)
 
 /**
  * Acknowledge an interrupt
- * Returns the IRQ number
+ * Returns the raw IAR: IRQ number in bits [9:0], SGI source CPU in [12:10]
  */
 uint32_t gic_acknowledge_irq(void)
 {
-    uint32_t iar;
-
-    iar = MMIO_READ(GICC_IAR);
-
-    /* Return IRQ number (lower 10 bits) */
-    return iar & 0x3FF;
+    return MMIO_READ(GICC_IAR) & 0x1FFF;
 }
 
 /**
  * Signal end of interrupt
+ * EOIR must get the full IAR value back, including the SGI source CPU
  */
-void gic_end_of_irq(uint32_t irq)
+void gic_end_of_irq(uint32_t iar)
 {
-    MMIO_WRITE(GICC_EOIR, irq);
+    MMIO_WRITE(GICC_EOIR, iar);
 }
 
 /**
@@ -209,8 +226,8 @@ void gic_send_sgi(uint32_t sgi_num, uint32_t target_cpu)
         return;
     }
 
-    /* GICD_SGIR register */
-    val = (target_cpu << 16) | sgi_num;
+    /* GICD_SGIR register: CPUTargetList is a bitmask in bits [23:16] */
+    val = ((1U << target_cpu) << 16) | sgi_num;
     MMIO_WRITE(GICD_BASE + 0xF00, val);
 }
 
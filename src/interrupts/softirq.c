@@ -0,0 +1,222 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/interrupts/softirq.c
+ * Description: Bottom halves (tasklets) run on IRQ exit
+ * ============================================================================ */
+
+#include <aeos/softirq.h>
+#include <aeos/spinlock.h>
+#include <aeos/percpu.h>
+#include <aeos/timer.h>
+#include <aeos/trace.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * Each CPU has a FIFO of queued tasklets. A pass detaches the whole queue
+ * and runs it, so a tasklet that keeps scheduling itself runs once per
+ * pass and cannot hold the CPU in its interrupt for good.
+ *
+ * One lock protects the tasklet states and every queue: a tasklet may be
+ * scheduled from any CPU, and it is held for a few stores at a time.
+ */
+
+/* A CPU's queue and statistics */
+typedef struct {
+    tasklet_t *head;
+    tasklet_t *tail;
+    uint32_t count;                     /* Queued, not yet detached */
+    volatile bool active;               /* Running tasklets now */
+    irq_stat_t wait;
+    irq_stat_t run;
+    uint64_t passes;
+    uint64_t left_over;
+} PERCPU_ALIGNED softirq_cpu_t;
+
+static struct {
+    spinlock_t lock;
+    softirq_cpu_t cpus[MAX_CPUS];
+} softirq = {
+    .lock = SPINLOCK_INIT,
+};
+
+static inline softirq_cpu_t *this_cpu_softirq(void)
+{
+    return &softirq.cpus[smp_processor_id()];
+}
+
+/**
+ * Append a tasklet to a CPU's queue (lock held)
+ */
+static void softirq_enqueue(softirq_cpu_t *sc, tasklet_t *t)
+{
+    t->next = NULL;
+    t->queued = true;
+    if (sc->head == NULL) {
+        sc->head = t;
+    } else {
+        sc->tail->next = t;
+    }
+    sc->tail = t;
+    sc->count++;
+}
+
+/**
+ * Prepare a tasklet
+ */
+void tasklet_init(tasklet_t *t, tasklet_fn_t func, void *arg)
+{
+    memset(t, 0, sizeof(*t));
+    t->func = func;
+    t->arg = arg;
+}
+
+/**
+ * Queue a tasklet on the calling CPU
+ */
+bool tasklet_schedule(tasklet_t *t)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&softirq.lock);
+
+    if (t->queued || t->again) {
+        spin_unlock_irqrestore(&softirq.lock, flags);
+        return false;
+    }
+
+    t->queued_at = timer_get_counter();
+    if (t->running) {
+        /* Its CPU runs it again once this run is over */
+        t->again = true;
+    } else {
+        softirq_enqueue(this_cpu_softirq(), t);
+    }
+
+    spin_unlock_irqrestore(&softirq.lock, flags);
+    return true;
+}
+
+/**
+ * Run one tasklet with IRQs unmasked
+ * Returns with the caller's IRQ mask back in place.
+ */
+static void softirq_run_one(softirq_cpu_t *sc, tasklet_t *t, uint64_t queued_at,
+                            uint64_t daif)
+{
+    uint64_t start;
+
+    start = timer_get_counter();
+    irq_stat_add(&sc->wait, start - queued_at);
+
+    TRACEPOINT(SOFTIRQ_ENTRY, (uintptr_t)t->func, 0);
+    __asm__ volatile("msr daifclr, #3" ::: "memory");
+    t->func(t->arg);
+    irq_restore(daif);
+    TRACEPOINT(SOFTIRQ_EXIT, (uintptr_t)t->func, 0);
+
+    irq_stat_add(&sc->run, timer_get_counter() - start);
+}
+
+/**
+ * Run the calling CPU's queued tasklets
+ */
+void softirq_run(void)
+{
+    softirq_cpu_t *sc = this_cpu_softirq();
+    tasklet_t *list, *t;
+    uint64_t daif, queued_at;
+    uint32_t pass;
+
+    /* A nested interrupt leaves the queue to the exit it interrupted */
+    if (sc->active || sc->head == NULL) {
+        return;
+    }
+    sc->active = true;
+
+    __asm__ volatile("mrs %0, daif" : "=r"(daif));
+
+    for (pass = 0; pass < SOFTIRQ_MAX_PASSES && sc->head != NULL; pass++) {
+        spin_lock(&softirq.lock);
+        list = sc->head;
+        sc->head = NULL;
+        sc->tail = NULL;
+        sc->count = 0;
+        spin_unlock(&softirq.lock);
+        sc->passes++;
+
+        while (list != NULL) {
+            spin_lock(&softirq.lock);
+            t = list;
+            list = t->next;
+            t->next = NULL;
+            t->queued = false;
+            t->running = true;
+            queued_at = t->queued_at;
+            spin_unlock(&softirq.lock);
+
+            softirq_run_one(sc, t, queued_at, daif);
+
+            spin_lock(&softirq.lock);
+            t->running = false;
+            if (t->again) {
+                t->again = false;
+                softirq_enqueue(sc, t);
+            }
+            spin_unlock(&softirq.lock);
+        }
+    }
+
+    if (sc->head != NULL) {
+        sc->left_over++;
+    }
+    sc->active = false;
+}
+
+/**
+ * Check whether the calling CPU has tasklets queued
+ */
+bool softirq_pending(void)
+{
+    return this_cpu_softirq()->head != NULL;
+}
+
+/**
+ * Check whether the calling CPU is running a tasklet
+ */
+bool in_softirq(void)
+{
+    return this_cpu_softirq()->active;
+}
+
+/**
+ * Get bottom half statistics
+ */
+void softirq_get_stats(softirq_stats_t *stats)
+{
+    const softirq_cpu_t *first = &softirq.cpus[0];
+    uint32_t i, b;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->wait.count = percpu_sum(&first->wait.count, sizeof(*first));
+    stats->wait.ticks = percpu_sum(&first->wait.ticks, sizeof(*first));
+    stats->run.count = percpu_sum(&first->run.count, sizeof(*first));
+    stats->run.ticks = percpu_sum(&first->run.ticks, sizeof(*first));
+    for (b = 0; b < IRQ_LAT_BUCKETS; b++) {
+        stats->wait.hist[b] = percpu_sum(&first->wait.hist[b], sizeof(*first));
+        stats->run.hist[b] = percpu_sum(&first->run.hist[b], sizeof(*first));
+    }
+    stats->passes = percpu_sum(&first->passes, sizeof(*first));
+    stats->left_over = percpu_sum(&first->left_over, sizeof(*first));
+    for (i = 0; i < MAX_CPUS; i++) {
+        stats->pending[i] = softirq.cpus[i].count;
+    }
+}
+
+/* ============================================================================
+ * End of softirq.c
+ * ============================================================================ */
@@ -10,12 +10,47 @@
 #include <aeos/kprintf.h>
 #include <aeos/types.h>
 #include <aeos/scheduler.h>
+#include <aeos/process.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/trace.h>
+
+/* CNTV_CTL_EL0 bits */
+#define CNTV_CTL_ENABLE     (1 << 0)
+#define CNTV_CTL_IMASK      (1 << 1)
+#define CNTV_CTL_ISTATUS    (1 << 2)
+
+/* No deadline to program */
+#define TIMER_NO_DEADLINE   ((uint64_t)-1)
+
+#define NSEC_PER_SEC        1000000000ULL
+
+/*
+ * Per-CPU timer state
+ *
+ * Each CPU's virtual timer is one-shot: it is programmed for the earlier
+ * of the next periodic tick and the earliest queued event. The events
+ * form a binary min-heap on their deadline. Idle CPUs stop the periodic
+ * tick (timer_idle_enter), so an idle CPU only wakes for its own events
+ * or an IPI.
+ */
+typedef struct {
+    spinlock_t lock;            /* Protects the heap */
+    timer_event_t *heap[TIMER_MAX_EVENTS];
+    uint32_t count;             /* Events in the heap */
+    timer_event_t *running;     /* Event whose callback is running */
+    uint64_t next_tick;         /* Counter value of the next periodic tick */
+    bool tick_stopped;          /* Tickless idle */
+    uint64_t events_fired;
+    uint64_t idle_entries;
+} __attribute__((aligned(CACHE_LINE_SIZE))) cpu_timer_t;
 
 /* Timer state */
 static struct {
-    uint64_t ticks;             /* Total ticks since boot */
+    cpu_timer_t cpus[MAX_CPUS];
+    uint64_t boot_counter;      /* Counter value at timer_init() */
     uint32_t frequency;         /* Timer frequency in Hz */
-    uint32_t tick_interval;     /* Ticks between interrupts */
+    uint32_t tick_interval;     /* Counter ticks between scheduler ticks */
     bool initialized;
 } timer;
 
@@ -35,14 +70,14 @@ static inline uint32_t read_cntfrq(void)
 static inline uint64_t read_cntvct(void)
 {
     uint64_t val;
-    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(val) :: "memory");
     return val;
 }
 
-/* Write virtual timer interval value */
-static inline void write_cntv_tval(int32_t val)
+/* Write virtual timer compare value (absolute deadline) */
+static inline void write_cntv_cval(uint64_t val)
 {
-    __asm__ volatile("msr cntv_tval_el0, %0" : : "r"(val));
+    __asm__ volatile("msr cntv_cval_el0, %0" : : "r"(val));
     __asm__ volatile("isb");
 }
 
@@ -61,31 +96,189 @@ static inline void write_cntv_ctl(uint32_t val)
     __asm__ volatile("isb");
 }
 
+/* ============================================================================
+ * Time Conversion
+ * ============================================================================ */
+
+/* Split the conversions so the 64-bit products cannot overflow */
+
+static uint64_t counter_to_ns(uint64_t count)
+{
+    return (count / timer.frequency) * NSEC_PER_SEC +
+           ((count % timer.frequency) * NSEC_PER_SEC) / timer.frequency;
+}
+
+static uint64_t ns_to_counter(uint64_t ns)
+{
+    return (ns / NSEC_PER_SEC) * timer.frequency +
+           ((ns % NSEC_PER_SEC) * timer.frequency) / NSEC_PER_SEC;
+}
+
+/* ============================================================================
+ * Event Heap
+ * ============================================================================ */
+
+static inline cpu_timer_t *this_timer(void)
+{
+    return &timer.cpus[smp_processor_id()];
+}
+
+static void heap_swap(cpu_timer_t *ct, uint32_t a, uint32_t b)
+{
+    timer_event_t *tmp = ct->heap[a];
+
+    ct->heap[a] = ct->heap[b];
+    ct->heap[b] = tmp;
+    ct->heap[a]->index = (int32_t)a;
+    ct->heap[b]->index = (int32_t)b;
+}
+
+static void heap_sift_up(cpu_timer_t *ct, uint32_t i)
+{
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (ct->heap[parent]->deadline <= ct->heap[i]->deadline) {
+            break;
+        }
+        heap_swap(ct, i, parent);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(cpu_timer_t *ct, uint32_t i)
+{
+    uint32_t left, right, smallest;
+
+    while (1) {
+        left = 2 * i + 1;
+        right = left + 1;
+        smallest = i;
+
+        if (left < ct->count &&
+            ct->heap[left]->deadline < ct->heap[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < ct->count &&
+            ct->heap[right]->deadline < ct->heap[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(ct, i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * Remove the event in heap slot i (lock held)
+ */
+static void heap_remove(cpu_timer_t *ct, uint32_t i)
+{
+    timer_event_t *ev = ct->heap[i];
+
+    ct->count--;
+    if (i != ct->count) {
+        ct->heap[i] = ct->heap[ct->count];
+        ct->heap[i]->index = (int32_t)i;
+        heap_sift_down(ct, i);
+        heap_sift_up(ct, i);
+    }
+    ev->index = -1;
+}
+
+/**
+ * Program this CPU's timer for its next deadline (lock held, IRQs masked)
+ */
+static void timer_program(cpu_timer_t *ct)
+{
+    uint64_t deadline = TIMER_NO_DEADLINE;
+
+    if (!ct->tick_stopped) {
+        deadline = ct->next_tick;
+    }
+    if (ct->count > 0 && ct->heap[0]->deadline < deadline) {
+        deadline = ct->heap[0]->deadline;
+    }
+
+    if (deadline == TIMER_NO_DEADLINE) {
+        /* Nothing to wait for: only an IPI wakes this CPU */
+        write_cntv_ctl(CNTV_CTL_ENABLE | CNTV_CTL_IMASK);
+        return;
+    }
+
+    /* A deadline already in the past fires as soon as IRQs are unmasked */
+    write_cntv_cval(deadline);
+    write_cntv_ctl(CNTV_CTL_ENABLE);
+}
+
 /* ============================================================================
  * Timer Interrupt Handler
  * ============================================================================ */
 
 /**
- * Timer interrupt handler
- * Called at TIMER_FREQ_HZ rate (100 Hz = every 10ms)
+ * Run expired events, the periodic tick, and re-arm the timer
+ * Shared by the IRQ and FIQ delivery paths.
  */
-static void timer_irq_handler(void)
+static void timer_interrupt(void)
 {
-    /* Increment tick count */
-    timer.ticks++;
+    cpu_timer_t *ct = this_timer();
+    timer_event_t *ev;
+    timer_callback_t callback;
+    void *arg;
+    uint64_t now;
+    bool tick = false;
+
+    spin_lock(&ct->lock);
+    now = read_cntvct();
+
+    /*
+     * Callbacks may queue new events, so run them with the lock dropped.
+     * The event may be on its owner's stack: take what the callback needs
+     * now, and mark it running so timer_event_cancel() waits for it.
+     */
+    while (ct->count > 0 && ct->heap[0]->deadline <= now) {
+        ev = ct->heap[0];
+        heap_remove(ct, 0);
+        ct->events_fired++;
+        callback = ev->callback;
+        arg = ev->arg;
+        ct->running = ev;
+
+        spin_unlock(&ct->lock);
+        callback(arg);
+        spin_lock(&ct->lock);
+        ct->running = NULL;
+    }
 
-    /* Set next timer interrupt using virtual timer */
-    write_cntv_tval(timer.tick_interval);
+    if (!ct->tick_stopped && now >= ct->next_tick) {
+        ct->next_tick += timer.tick_interval;
+        if (ct->next_tick <= now) {
+            /* Missed ticks (IRQs were masked): don't replay them */
+            ct->next_tick = now + timer.tick_interval;
+        }
+        tick = true;
+    }
 
-    /* Call scheduler tick for preemptive scheduling */
-    scheduler_tick();
+    timer_program(ct);
+    spin_unlock(&ct->lock);
 
-    /* Optional: print tick count every 10 seconds for debugging (avoid spam) */
-    if ((timer.ticks % (TIMER_FREQ_HZ * 10)) == 0) {
-        klog_debug("Uptime: %u seconds", (uint32_t)(timer.ticks / TIMER_FREQ_HZ));
+    if (tick) {
+        /* Call scheduler tick for preemptive scheduling */
+        scheduler_tick();
     }
 }
 
+/**
+ * Timer interrupt handler (GIC-delivered IRQ)
+ */
+static void timer_irq_handler(void)
+{
+    timer_interrupt();
+}
+
 /* ============================================================================
  * Timer Functions
  * ============================================================================ */
@@ -96,6 +289,8 @@ static void timer_irq_handler(void)
  */
 void timer_init(void)
 {
+    uint32_t i;
+
     klog_info("Initializing ARM Generic Timer (virtual)...");
 
     /* Get timer frequency */
@@ -108,22 +303,28 @@ void timer_init(void)
             timer.tick_interval,
             1000 / TIMER_FREQ_HZ);
 
-    /* Initialize tick count */
-    timer.ticks = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+        spin_lock_init(&timer.cpus[i].lock);
+        timer.cpus[i].count = 0;
+        timer.cpus[i].running = NULL;
+        timer.cpus[i].next_tick = TIMER_NO_DEADLINE;
+        timer.cpus[i].tick_stopped = false;
+        timer.cpus[i].events_fired = 0;
+        timer.cpus[i].idle_entries = 0;
+    }
+
+    /* Uptime counts from here */
+    timer.boot_counter = read_cntvct();
 
     /* Disable virtual timer while configuring */
     write_cntv_ctl(0);
 
-    /* Set initial timer value */
-    write_cntv_tval(timer.tick_interval);
-
     /* Register timer interrupt handler */
-    /* IRQ 27 = virtual timer PPI on QEMU virt platform */
-    irq_register_handler(27, timer_irq_handler);
+    irq_register_handler(TIMER_VIRT_PPI, timer_irq_handler);
 
     /* Enable timer interrupt in GIC */
-    gic_set_priority(27, GIC_PRIORITY_HIGH);
-    gic_enable_irq(27);
+    gic_set_priority(TIMER_VIRT_PPI, GIC_PRIORITY_HIGH);
+    gic_enable_irq(TIMER_VIRT_PPI);
 
     /* DO NOT start timer yet - will be started after interrupts_enable() */
     /* This prevents spurious interrupts during initialization */
@@ -133,26 +334,54 @@ void timer_init(void)
     klog_info("Timer initialized (not started yet)");
 }
 
+/**
+ * Arm the calling CPU's first periodic tick
+ */
+static void timer_start_local(void)
+{
+    cpu_timer_t *ct = this_timer();
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&ct->lock);
+    ct->next_tick = read_cntvct() + timer.tick_interval;
+    timer_program(ct);
+    spin_unlock_irqrestore(&ct->lock, flags);
+}
+
 /**
  * Start the timer
  * Should be called after interrupts are enabled
  */
 void timer_start(void)
 {
-    uint32_t ctl;
-
     if (!timer.initialized) {
         klog_error("Timer not initialized");
         return;
     }
 
-    /* Enable virtual timer (enable bit, unmask interrupt) */
-    ctl = (1 << 0);  /* ENABLE bit */
-    write_cntv_ctl(ctl);
+    timer_start_local();
 
     klog_info("Timer started");
 }
 
+/**
+ * Start the calling secondary CPU's timer
+ * The PPI is banked per CPU, so its priority and enable are set here too.
+ */
+void timer_init_cpu(void)
+{
+    if (!timer.initialized) {
+        return;
+    }
+
+    write_cntv_ctl(0);
+
+    gic_set_priority(TIMER_VIRT_PPI, GIC_PRIORITY_HIGH);
+    gic_enable_irq(TIMER_VIRT_PPI);
+
+    timer_start_local();
+}
+
 /**
  * Handle timer interrupt from FIQ
  * Called directly from FIQ handler when timer interrupt is pending
@@ -166,31 +395,221 @@ bool timer_handle_fiq(void)
         return false;
     }
 
-    /* Check if timer interrupt is pending (ISTATUS bit) */
+    /* Check if timer interrupt is pending (ISTATUS bit, not masked) */
     ctl = read_cntv_ctl();
-    if (!(ctl & (1 << 2))) {
+    if (!(ctl & CNTV_CTL_ISTATUS) || (ctl & CNTV_CTL_IMASK)) {
         /* No timer interrupt pending */
         return false;
     }
 
-    /* Increment tick count */
-    timer.ticks++;
+    /* Re-programming the compare value clears the interrupt */
+    TRACEPOINT(IRQ_ENTRY, TIMER_VIRT_PPI, 1);
+    timer_interrupt();
+    TRACEPOINT(IRQ_EXIT, TIMER_VIRT_PPI, 1);
 
-    /* Re-arm timer (this clears the interrupt) */
-    write_cntv_tval(timer.tick_interval);
+    return true;
+}
 
-    /* Call scheduler tick for preemptive scheduling */
-    scheduler_tick();
+/**
+ * Stop the periodic tick while this CPU idles
+ */
+void timer_idle_enter(void)
+{
+    cpu_timer_t *ct = this_timer();
 
-    return true;
+    if (!timer.initialized) {
+        return;
+    }
+
+    spin_lock(&ct->lock);
+    ct->tick_stopped = true;
+    ct->idle_entries++;
+    timer_program(ct);
+    spin_unlock(&ct->lock);
+}
+
+/**
+ * Restart the periodic tick after idling
+ */
+void timer_idle_exit(void)
+{
+    cpu_timer_t *ct = this_timer();
+
+    if (!timer.initialized) {
+        return;
+    }
+
+    spin_lock(&ct->lock);
+    ct->tick_stopped = false;
+    ct->next_tick = read_cntvct() + timer.tick_interval;
+    timer_program(ct);
+    spin_unlock(&ct->lock);
+}
+
+/**
+ * Prepare an event for timer_event_add()
+ */
+void timer_event_init(timer_event_t *ev, timer_callback_t callback, void *arg)
+{
+    ev->deadline = 0;
+    ev->callback = callback;
+    ev->arg = arg;
+    ev->index = -1;
+    ev->cpu = 0;
+}
+
+/**
+ * Queue a one-shot event on the calling CPU
+ */
+int timer_event_add(timer_event_t *ev, uint64_t deadline_ns)
+{
+    cpu_timer_t *ct;
+    uint64_t flags;
+
+    if (!timer.initialized || ev == NULL || ev->callback == NULL ||
+        ev->index >= 0) {
+        return -1;
+    }
+
+    flags = irq_save();
+    ct = this_timer();
+    spin_lock(&ct->lock);
+
+    if (ct->count >= TIMER_MAX_EVENTS) {
+        spin_unlock_irqrestore(&ct->lock, flags);
+        klog_warn("timer: event queue full on CPU %u", smp_processor_id());
+        return -1;
+    }
+
+    ev->deadline = ns_to_counter(deadline_ns);
+    ev->cpu = smp_processor_id();
+    ev->index = (int32_t)ct->count;
+    ct->heap[ct->count++] = ev;
+    heap_sift_up(ct, (uint32_t)ev->index);
+
+    /* New earliest deadline: bring the interrupt forward */
+    if (ct->heap[0] == ev) {
+        timer_program(ct);
+    }
+
+    spin_unlock_irqrestore(&ct->lock, flags);
+    return 0;
+}
+
+/**
+ * Remove a queued event before it fires
+ * A callback already running on another CPU is waited for, so the event
+ * can be reused or go out of scope once this returns. On the event's own
+ * CPU it cannot be running: callbacks finish before the interrupt returns.
+ */
+bool timer_event_cancel(timer_event_t *ev)
+{
+    cpu_timer_t *ct;
+    uint64_t flags;
+    bool queued = false;
+
+    if (ev == NULL || ev->cpu >= MAX_CPUS) {
+        return false;
+    }
+
+    ct = &timer.cpus[ev->cpu];
+    flags = spin_lock_irqsave(&ct->lock);
+    if (ev->index >= 0) {
+        heap_remove(ct, (uint32_t)ev->index);
+        queued = true;
+    } else if (ev->cpu != smp_processor_id()) {
+        while (ct->running == ev) {
+            spin_unlock(&ct->lock);
+            __asm__ volatile("yield");
+            spin_lock(&ct->lock);
+        }
+    }
+    spin_unlock_irqrestore(&ct->lock, flags);
+
+    return queued;
+}
+
+/**
+ * Wake a sleeping process (timer event callback)
+ */
+static void sleep_wakeup(void *arg)
+{
+    scheduler_wake((process_t *)arg);
+}
+
+/**
+ * Block the current process until a deadline
+ */
+void timer_sleep_until(uint64_t ns)
+{
+    /* A stray scheduler_wake() can end one wait early */
+    while (timer.initialized && timer_get_ns() < ns) {
+        timer_wait_until(ns, NULL);
+    }
+}
+
+/**
+ * Block until a deadline or a flagged wakeup
+ */
+void timer_wait_until(uint64_t ns, const volatile bool *cond)
+{
+    timer_event_t ev;
+    process_t *self = process_current();
+    uint64_t deadline;
+    uint64_t flags;
+
+    if (!timer.initialized) {
+        return;
+    }
+
+    /* Masked until we are switched out, so the wakeup cannot come first */
+    flags = irq_save();
+
+    if (timer_get_ns() >= ns || (cond != NULL && *cond)) {
+        irq_restore(flags);
+        return;
+    }
+
+    timer_event_init(&ev, sleep_wakeup, self);
+    if (self == NULL || timer_event_add(&ev, ns) != 0) {
+        /* No process to block (or no free event slot): spin instead */
+        irq_restore(flags);
+        deadline = ns_to_counter(ns);
+        while (read_cntvct() < deadline && (cond == NULL || !*cond)) {
+            __asm__ volatile("yield");
+        }
+        return;
+    }
+
+    scheduler_block_unless(cond);
+
+    /*
+     * Normally already gone: it fired to wake us. If it is still queued
+     * the wakeup came from elsewhere; the caller checks again.
+     */
+    timer_event_cancel(&ev);
+
+    irq_restore(flags);
+}
+
+/**
+ * Sleep for a number of milliseconds
+ */
+void timer_sleep_ms(uint32_t ms)
+{
+    timer_sleep_until(timer_get_ns() + (uint64_t)ms * 1000000ULL);
 }
 
 /**
  * Get current system tick count
+ * Derived from the counter, so stopped ticks on an idle CPU don't lose time.
  */
 uint64_t timer_get_ticks(void)
 {
-    return timer.ticks;
+    if (timer.tick_interval == 0) {
+        return 0;
+    }
+    return (read_cntvct() - timer.boot_counter) / timer.tick_interval;
 }
 
 /**
@@ -198,7 +617,10 @@ uint64_t timer_get_ticks(void)
  */
 uint64_t timer_get_uptime_ms(void)
 {
-    return (timer.ticks * 1000) / TIMER_FREQ_HZ;
+    if (timer.frequency == 0) {
+        return 0;
+    }
+    return counter_to_ns(read_cntvct() - timer.boot_counter) / 1000000ULL;
 }
 
 /**
@@ -206,7 +628,21 @@ uint64_t timer_get_uptime_ms(void)
  */
 uint64_t timer_get_uptime_sec(void)
 {
-    return timer.ticks / TIMER_FREQ_HZ;
+    if (timer.frequency == 0) {
+        return 0;
+    }
+    return (read_cntvct() - timer.boot_counter) / timer.frequency;
+}
+
+/**
+ * Get monotonic time in nanoseconds
+ */
+uint64_t timer_get_ns(void)
+{
+    if (timer.frequency == 0) {
+        return 0;
+    }
+    return counter_to_ns(read_cntvct());
 }
 
 /**
@@ -217,6 +653,32 @@ uint32_t timer_get_frequency(void)
     return timer.frequency;
 }
 
+/**
+ * Read the raw virtual counter
+ */
+uint64_t timer_get_counter(void)
+{
+    return read_cntvct();
+}
+
+/**
+ * Get timer event statistics
+ */
+void timer_get_stats(timer_stats_t *stats)
+{
+    uint32_t i;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        stats->cpus[i].pending = timer.cpus[i].count;
+        stats->cpus[i].events_fired = timer.cpus[i].events_fired;
+        stats->cpus[i].idle_entries = timer.cpus[i].idle_entries;
+    }
+}
+
 /**
  * Delay for specified milliseconds
  * Uses busy-wait on hardware counter
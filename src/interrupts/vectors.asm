@@ -11,6 +11,9 @@ include(`src/boot/macros.m4')
 
 /* ============================================================================
  * Macros for saving and restoring CPU context
+ *
+ * Only the general purpose registers: kernel C is built with
+ * -mgeneral-regs-only, so a handler leaves the FP/SIMD registers alone.
  * ============================================================================ */
 
 .macro SAVE_CONTEXT
@@ -77,32 +80,87 @@ include(`src/boot/macros.m4')
     add sp, sp, #CONTEXT_SIZE
 .endm
 
+/*
+ * Count an exception in the calling CPU's row of exception_counters
+ * Each CPU has a 128-byte row of its own, so the vectors never pull a
+ * counter line between cores. Exceptions are masked on entry, so a plain
+ * add cannot lose a count. x0 and x1 are preserved.
+ */
+.macro COUNT_EXCEPTION slot
+    stp x0, x1, [sp, #-16]!
+    adr x0, exception_counters
+    mrs x1, mpidr_el1
+    and x1, x1, #3          /* Aff0 & (MAX_CPUS - 1), as smp_processor_id() */
+    add x0, x0, x1, lsl #7
+    ldr x1, [x0, #(\slot * 8)]
+    add x1, x1, #1
+    str x1, [x0, #(\slot * 8)]
+    ldp x0, x1, [sp], #16
+.endm
+
 /* ============================================================================
  * Exception vector table
  * Must be aligned to 2KB (0x800)
  * Each entry is 128 bytes (0x80)
  * Total size: 16 entries * 128 bytes = 2KB
+ *
+ * A slot holds only 32 instructions, less than any handler below needs,
+ * so each entry just branches to its handler.
  * ============================================================================ */
 
     .section .text.vectors
     .balign 2048
     .global exception_vector_table
 exception_vector_table:
+    /* Current EL with SP0 */
+    .balign 128
+    b el1_sp0_sync
+    .balign 128
+    b el1_sp0_irq
+    .balign 128
+    b el1_sp0_fiq
+    .balign 128
+    b el1_sp0_serror
+    /* Current EL with SPx */
+    .balign 128
+    b el1_spx_sync
+    .balign 128
+    b el1_spx_irq
+    .balign 128
+    b el1_spx_fiq
+    .balign 128
+    b el1_spx_serror
+    /* Lower EL using AArch64 */
+    .balign 128
+    b el0_aarch64_sync
+    .balign 128
+    b el0_aarch64_irq
+    .balign 128
+    b el0_aarch64_fiq
+    .balign 128
+    b el0_aarch64_serror
+    /* Lower EL using AArch32 */
+    .balign 128
+    b el0_aarch32_sync
+    .balign 128
+    b el0_aarch32_irq
+    .balign 128
+    b el0_aarch32_fiq
+    .balign 128
+    b el0_aarch32_serror
+
+/* ============================================================================
+ * Exception handlers
+ * ============================================================================ */
 
 /* ----------------------------------------------------------------------------
  * Current EL with SP0
  * ---------------------------------------------------------------------------- */
-    .balign 128
+    .balign 4
 el1_sp0_sync:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: sp0_sync_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #0]        /* Load sp0_sync_count */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #0]        /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 0
 
     /* DEBUG: Print that we entered SP0 SYNC handler */
     stp x0, x1, [sp, #-16]!
@@ -140,17 +198,11 @@ el1_sp0_sync:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_sp0_irq:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: sp0_irq_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #8]        /* Load counter[1] = sp0_irq */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #8]        /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 1
 
     mov x0, #0
     mov x1, #1          /* exception_type = IRQ */
@@ -159,17 +211,11 @@ el1_sp0_irq:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_sp0_fiq:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: sp0_fiq_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #16]       /* Load counter[2] = sp0_fiq */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #16]       /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 2
 
     /* Handle FIQ (timer interrupt on QEMU virt) */
     mov x0, #0
@@ -179,7 +225,7 @@ el1_sp0_fiq:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_sp0_serror:
     SAVE_CONTEXT
     mov x0, #0
@@ -191,18 +237,20 @@ el1_sp0_serror:
 
 /* ----------------------------------------------------------------------------
  * Current EL with SPx
+ *
+ * Processes run on SP_EL1, so their interrupts land here with the
+ * interrupted context saved on the process's own stack. That makes it
+ * safe to switch processes before RESTORE_CONTEXT: the IRQ and FIQ
+ * handlers call scheduler_irq_exit() after the GIC EOI, and the
+ * preempted process resumes at the eret when it is switched back to.
+ * The SP0 vectors above share SP_EL1 between whatever was interrupted,
+ * so they never switch; a pending reschedule waits for the next exit here.
  * ---------------------------------------------------------------------------- */
-    .balign 128
+    .balign 4
 el1_spx_sync:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: spx_sync_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #32]       /* Load counter[4] = spx_sync */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #32]       /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 4
 
     /* Check if this is an SVC instruction by examining ESR_EL1 */
     mrs x0, esr_el1
@@ -237,46 +285,40 @@ el1_spx_sync:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_spx_irq:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: spx_irq_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #40]       /* Load counter[5] = spx_irq */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #40]       /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 5
 
     mov x0, #1
     mov x1, #1          /* exception_type = IRQ */
     mov x2, sp
     bl handle_irq
+
+    /* Preempt on the way out: the full context is saved on this stack */
+    bl scheduler_irq_exit
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_spx_fiq:
     SAVE_CONTEXT
 
-    /* INCREMENT COUNTER: spx_fiq_count */
-    stp x0, x1, [sp, #-16]!
-    adr x0, exception_counters
-    ldr x1, [x0, #48]       /* Load counter[6] = spx_fiq */
-    add x1, x1, #1          /* Increment */
-    str x1, [x0, #48]       /* Store back */
-    ldp x0, x1, [sp], #16
+    COUNT_EXCEPTION 6
 
     /* Handle FIQ (timer interrupt on QEMU virt) */
     mov x0, #1
     mov x1, #2          /* exception_type = FIQ */
     mov x2, sp
     bl handle_fiq
+
+    /* Preempt on the way out: the full context is saved on this stack */
+    bl scheduler_irq_exit
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el1_spx_serror:
     SAVE_CONTEXT
     mov x0, #1
@@ -288,38 +330,75 @@ el1_spx_serror:
 
 /* ----------------------------------------------------------------------------
  * Lower EL using AArch64
+ *
+ * User processes trap here on SP_EL1, their kernel stack. SP_EL0 belongs
+ * to the process, so it goes into the frame's SP slot and comes back from
+ * there: a process switched away in the handler gets its own SP_EL0 back
+ * when it resumes. As for SPx, IRQ and FIQ may switch before returning.
  * ---------------------------------------------------------------------------- */
-    .balign 128
+    .balign 4
 el0_aarch64_sync:
     SAVE_CONTEXT
+    mrs x0, sp_el0
+    str x0, [sp, #248]
+
+    COUNT_EXCEPTION 8
+
+    /* SVC from a user program: same calling convention as above */
+    mrs x0, esr_el1
+    lsr x1, x0, #26
+    cmp x1, #0x15
+    bne 1f
+
+    ldr x0, [sp, #(16 * 4)]     /* x8 = syscall number */
+    ldr x1, [sp, #(16 * 0)]     /* x0 = arg0 */
+    ldr x2, [sp, #(16 * 0 + 8)] /* x1 = arg1 */
+    ldr x3, [sp, #(16 * 1)]     /* x2 = arg2 */
+    ldr x4, [sp, #(16 * 1 + 8)] /* x3 = arg3 */
+    ldr x5, [sp, #(16 * 2)]     /* x4 = arg4 */
+    ldr x6, [sp, #(16 * 2 + 8)] /* x5 = arg5 */
+    bl syscall_handler
+    str x0, [sp, #(16 * 0)]
+    b el0_return
+
+1:  /* Page faults and everything else (kills the process if unresolved) */
     mov x0, #2          /* exception_source = 2 */
     mov x1, #0          /* exception_type = SYNC */
     mov x2, sp
     bl handle_exception
-    RESTORE_CONTEXT
-    eret
+    b el0_return
 
-    .balign 128
+    .balign 4
 el0_aarch64_irq:
     SAVE_CONTEXT
+    mrs x0, sp_el0
+    str x0, [sp, #248]
+
+    COUNT_EXCEPTION 9
+
     mov x0, #2
     mov x1, #1          /* exception_type = IRQ */
     mov x2, sp
-    bl handle_exception
-    RESTORE_CONTEXT
-    eret
+    bl handle_irq
+    bl scheduler_irq_exit
+    b el0_return
 
-    .balign 128
+    .balign 4
 el0_aarch64_fiq:
     SAVE_CONTEXT
+    mrs x0, sp_el0
+    str x0, [sp, #248]
+
+    COUNT_EXCEPTION 10
+
     mov x0, #2
     mov x1, #2          /* exception_type = FIQ */
     mov x2, sp
-    bl handle_exception
-    RESTORE_CONTEXT
-    eret
+    bl handle_fiq
+    bl scheduler_irq_exit
+    b el0_return
 
-    .balign 128
+    .balign 4
 el0_aarch64_serror:
     SAVE_CONTEXT
     mov x0, #2
@@ -332,7 +411,7 @@ el0_aarch64_serror:
 /* ----------------------------------------------------------------------------
  * Lower EL using AArch32
  * ---------------------------------------------------------------------------- */
-    .balign 128
+    .balign 4
 el0_aarch32_sync:
     SAVE_CONTEXT
     mov x0, #3          /* exception_source = 3 */
@@ -342,7 +421,7 @@ el0_aarch32_sync:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el0_aarch32_irq:
     SAVE_CONTEXT
     mov x0, #3
@@ -352,7 +431,7 @@ el0_aarch32_irq:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el0_aarch32_fiq:
     SAVE_CONTEXT
     mov x0, #3
@@ -362,7 +441,7 @@ el0_aarch32_fiq:
     RESTORE_CONTEXT
     eret
 
-    .balign 128
+    .balign 4
 el0_aarch32_serror:
     SAVE_CONTEXT
     mov x0, #3
@@ -376,6 +455,32 @@ el0_aarch32_serror:
  * Helper functions
  * ============================================================================ */
 
+/**
+ * Resume a process at EL0 from a copy of such a frame
+ * void user_resume(cpu_context_t *frame): the frame must sit at the top of
+ * the process's kernel stack, so exceptions from EL0 start empty again.
+ */
+    .global user_resume
+    .balign 4
+user_resume:
+    msr daifset, #3     /* No IRQ between here and the eret */
+    mov sp, x0
+    b el0_return
+
+/**
+ * Return to EL0 from a frame built by the lower-EL vectors
+ * The handler may have unmasked IRQs; mask them again so no switch comes
+ * between loading the process's FP/SIMD registers and the eret.
+ */
+    .balign 4
+el0_return:
+    msr daifset, #3
+    bl fpsimd_user_return
+    ldr x0, [sp, #248]
+    msr sp_el0, x0
+    RESTORE_CONTEXT
+    eret
+
 /**
  * Enable IRQ interrupts
  */
@@ -401,23 +506,14 @@ interrupts_disable:
  * ============================================================================ */
     .section .data
     .global exception_counters
+    .balign 64
 exception_counters:
-    .quad 0  /*  0: el1_sp0_sync */
-    .quad 0  /*  1: el1_sp0_irq */
-    .quad 0  /*  2: el1_sp0_fiq */
-    .quad 0  /*  3: el1_sp0_serror */
-    .quad 0  /*  4: el1_spx_sync */
-    .quad 0  /*  5: el1_spx_irq */
-    .quad 0  /*  6: el1_spx_fiq */
-    .quad 0  /*  7: el1_spx_serror */
-    .quad 0  /*  8: el0_aarch64_sync */
-    .quad 0  /*  9: el0_aarch64_irq */
-    .quad 0  /* 10: el0_aarch64_fiq */
-    .quad 0  /* 11: el0_aarch64_serror */
-    .quad 0  /* 12: el0_aarch32_sync */
-    .quad 0  /* 13: el0_aarch32_irq */
-    .quad 0  /* 14: el0_aarch32_fiq */
-    .quad 0  /* 15: el0_aarch32_serror */
+    /* [MAX_CPUS][16], each CPU's row in vector table order:
+     *  0-3:   el1_sp0    sync, irq, fiq, serror
+     *  4-7:   el1_spx    sync, irq, fiq, serror
+     *  8-11:  el0_aarch64 sync, irq, fiq, serror
+     *  12-15: el0_aarch32 sync, irq, fiq, serror */
+    .fill 64, 8, 0
 
     .section .rodata
 sp0_sync_msg:
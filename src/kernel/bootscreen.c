@@ -20,9 +20,9 @@
 #define BOOT_PROGRESS_FG    0xFF00D9FF  /* Progress bar fill (cyan) */
 #define BOOT_BORDER_COLOR   0xFF404060  /* Border color */
 
-/* Screen layout constants */
-#define SCREEN_WIDTH        640
-#define SCREEN_HEIGHT       480
+/* Screen layout (centred across the current mode, footer at its bottom) */
+#define SCREEN_WIDTH        fb_width()
+#define SCREEN_HEIGHT       fb_height()
 #define LOGO_Y              100
 #define PROGRESS_BAR_Y      300
 #define PROGRESS_BAR_WIDTH  400
@@ -0,0 +1,168 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/boottime.c
+ * Description: Boot timeline and deferred boot work
+ * ============================================================================ */
+
+#include <aeos/boottime.h>
+#include <aeos/timer.h>
+#include <aeos/smp.h>
+#include <aeos/spinlock.h>
+#include <aeos/wait.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/* One recorded stage */
+typedef struct {
+    const char *stage;
+    uint64_t counter;                   /* CNTVCT when the stage finished */
+    uint32_t cpu;
+} boottime_entry_t;
+
+static struct {
+    boottime_entry_t entries[BOOTTIME_MAX_STAGES];
+    uint32_t count;
+    volatile bool deferred;             /* Background boot work still running */
+    wait_queue_t waiters;               /* Commands waiting for it */
+    spinlock_t lock;                    /* Protects the entries */
+} boottime = {
+    .waiters = WAIT_QUEUE_INIT,
+    .lock = SPINLOCK_INIT,
+};
+
+/**
+ * Convert counter ticks to microseconds
+ */
+static uint64_t ticks_to_us(uint64_t ticks)
+{
+    uint32_t freq = timer_get_frequency();
+
+    if (freq == 0) {
+        return 0;
+    }
+    return ticks / freq * 1000000ULL + (ticks % freq) * 1000000ULL / freq;
+}
+
+/**
+ * Format microseconds as milliseconds with three decimals
+ */
+static void format_ms(char *buf, size_t size, uint64_t us)
+{
+    snprintf(buf, size, "%u.%03u", (uint32_t)(us / 1000), (uint32_t)(us % 1000));
+}
+
+/**
+ * Record the end of an init stage
+ */
+void boottime_mark(const char *stage)
+{
+    uint64_t flags;
+
+    /* Read under the lock, so marks from two CPUs stay in counter order */
+    flags = spin_lock_irqsave(&boottime.lock);
+    if (boottime.count < BOOTTIME_MAX_STAGES) {
+        boottime.entries[boottime.count].stage = stage;
+        boottime.entries[boottime.count].counter = timer_get_counter();
+        boottime.entries[boottime.count].cpu = smp_processor_id();
+        boottime.count++;
+    }
+    spin_unlock_irqrestore(&boottime.lock, flags);
+}
+
+/**
+ * Record a stage that ended earlier
+ */
+void boottime_mark_at(const char *stage, uint64_t counter)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&boottime.lock);
+    if (boottime.count < BOOTTIME_MAX_STAGES) {
+        boottime.entries[boottime.count].stage = stage;
+        boottime.entries[boottime.count].counter = counter;
+        boottime.entries[boottime.count].cpu = smp_processor_id();
+        boottime.count++;
+    }
+    spin_unlock_irqrestore(&boottime.lock, flags);
+}
+
+/**
+ * Print the boot timeline
+ */
+void boottime_print(void)
+{
+    boottime_entry_t entries[BOOTTIME_MAX_STAGES];
+    uint64_t flags, at, prev;
+    uint32_t count, i;
+    char at_ms[16], took_ms[16];
+
+    flags = spin_lock_irqsave(&boottime.lock);
+    count = boottime.count;
+    for (i = 0; i < count; i++) {
+        entries[i] = boottime.entries[i];
+    }
+    spin_unlock_irqrestore(&boottime.lock, flags);
+
+    if (count == 0) {
+        kprintf("No boot timeline recorded\n");
+        return;
+    }
+
+    kprintf("\nBoot timeline (counter at %u Hz):\n", timer_get_frequency());
+    kprintf("  %-24s CPU %12s %12s  %s\n", "Stage", "at ms", "took ms", "CNTVCT");
+
+    prev = 0;
+    for (i = 0; i < count; i++) {
+        at = ticks_to_us(entries[i].counter);
+        format_ms(at_ms, sizeof(at_ms), at);
+        format_ms(took_ms, sizeof(took_ms), at - prev);
+        prev = at;
+        kprintf("  %-24s  %u  %12s %12s  %llu\n", entries[i].stage,
+                entries[i].cpu, at_ms, took_ms, entries[i].counter);
+    }
+
+    if (boottime.deferred) {
+        kprintf("  (background boot work still running)\n");
+    }
+    kprintf("\n");
+}
+
+/**
+ * Note that boot work has been handed to a background process
+ */
+void boottime_defer_begin(void)
+{
+    boottime.deferred = true;
+}
+
+/**
+ * Note that the background boot work has finished
+ */
+void boottime_defer_end(void)
+{
+    __asm__ volatile("dmb ish" ::: "memory");
+    boottime.deferred = false;
+    wake_up_all(&boottime.waiters);
+}
+
+/**
+ * Wait until the background boot work has finished
+ */
+void boottime_wait(void)
+{
+    waiter_t w = WAITER_INIT;
+
+    for (;;) {
+        wait_prepare(&boottime.waiters, &w);
+        if (!boottime.deferred) {
+            break;
+        }
+        wait_sleep(&w, WAIT_FOREVER);
+    }
+    wait_finish(&boottime.waiters, &w);
+    __asm__ volatile("dmb ish" ::: "memory");
+}
+
+/* ============================================================================
+ * End of boottime.c
+ * ============================================================================ */
@@ -6,6 +6,9 @@
 
 #include <aeos/desktop.h>
 #include <aeos/framebuffer.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/shrinker.h>
 #include <aeos/wm.h>
 #include <aeos/timer.h>
 #include <aeos/kprintf.h>
@@ -21,10 +24,29 @@
 #define START_BTN_HOVER     0xFF00cc66
 #define ICON_SELECTED_BG    0x4000aaff  /* Semi-transparent blue */
 #define ICON_LABEL_BG       0xC0000000  /* Semi-transparent black */
+#define START_MENU_BG       0xD80f0f23  /* TASKBAR_BG, translucent */
 #define CLOCK_COLOR         0xFFcccccc
 #define TASKBAR_BTN_BG      0xFF1a1a3a
 #define TASKBAR_BTN_ACTIVE  0xFF2a2a5a
 #define TASKBAR_BTN_BORDER  0xFF3a3a6a
+#define HUD_COLOR           0xFF55dd77
+
+/*
+ * Cached layer
+ *
+ * The background gradient, the icons and the taskbar's fixed parts (its
+ * background, border and start button) only change when an icon does, so
+ * they are rendered once into a screen-sized huge buffer and a paint is a
+ * blit of the clip rectangle from it. The window buttons, clock and HUD are
+ * drawn on top each time; the window manager damages just their strips.
+ * A resolution change reallocates the layer at the new size.
+ *
+ * Under memory pressure the "desktop-layer" shrinker frees the layer (with
+ * the window manager lock, like the backbuffers) and the next paint makes
+ * a new one. If that allocation fails the desktop is drawn directly, and
+ * no new layer is tried until free memory is back at the PMM's high
+ * watermark.
+ */
 
 /* Desktop state */
 static struct {
@@ -32,11 +54,113 @@ static struct {
     uint32_t icon_count;
     int32_t selected_icon;
     bool start_menu_visible;
+    bool hud_visible;
     bool initialized;
     uint64_t last_click_time;
     int32_t last_click_icon;
+    uint32_t *layer;            /* Cached layer, NULL if it could not be had */
+    size_t layer_size;          /* Its size in bytes (screen size when made) */
+    bool layer_valid;
+    bool layer_failed;          /* Don't retry the allocation every paint */
 } desktop;
 
+/* Outside desktop, which desktop_init() clears on every GUI run */
+static bool desktop_shrinker_registered;
+
+/**
+ * Shrinker: count the pages held by the layer
+ */
+static size_t desktop_shrink_count(void)
+{
+    size_t pages = 0;
+
+    if (!wm_trylock()) {
+        return 0;
+    }
+    if (desktop.layer != NULL) {
+        pages = PAGE_ALIGN_UP(desktop.layer_size) >> PAGE_SHIFT;
+    }
+    wm_unlock();
+    return pages;
+}
+
+/**
+ * Shrinker: free the layer
+ */
+static size_t desktop_shrink_scan(size_t nr)
+{
+    size_t pages = 0;
+
+    (void)nr;
+    if (!wm_trylock()) {
+        return 0;
+    }
+    if (desktop.layer != NULL) {
+        pages = PAGE_ALIGN_UP(desktop.layer_size) >> PAGE_SHIFT;
+        mm_free_huge(desktop.layer, desktop.layer_size);
+        desktop.layer = NULL;
+        desktop.layer_size = 0;
+        desktop.layer_failed = false;
+        desktop_invalidate();
+    }
+    wm_unlock();
+    return pages;
+}
+
+/* Gives back the cached layer (Cached layer, above) */
+static shrinker_t desktop_shrinker = {
+    .name = "desktop-layer",
+    .count = desktop_shrink_count,
+    .scan = desktop_shrink_scan,
+};
+
+/**
+ * Check whether free memory is back at the PMM's high watermark
+ */
+static bool memory_recovered(void)
+{
+    pmm_stats_t stats;
+
+    pmm_get_stats(&stats);
+    return stats.free_pages >= stats.wmark_high;
+}
+
+/**
+ * Format nanoseconds as milliseconds with one decimal
+ */
+static void format_ms(char *buf, size_t size, uint64_t ns)
+{
+    uint64_t tenths = ns / 100000;
+
+    if (tenths > 99999) {
+        tenths = 99999;
+    }
+    snprintf(buf, size, "%u.%u", (uint32_t)(tenths / 10), (uint32_t)(tenths % 10));
+}
+
+/**
+ * Draw the performance HUD: moving FPS and p99, then the last frame's parts
+ */
+static void draw_hud(uint32_t taskbar_y)
+{
+    wm_frame_stats_t stats;
+    char line[TASKBAR_HUD_CHARS + 1];
+    char a[12], b[12], c[12];
+
+    wm_get_frame_stats(&stats);
+
+    format_ms(a, sizeof(a), stats.p99_ns);
+    format_ms(b, sizeof(b), stats.frame_ns);
+    snprintf(line, sizeof(line), "%u fps p99 %s last %s", stats.fps, a, b);
+    fb_puts(TASKBAR_HUD_X, taskbar_y + 6, line, HUD_COLOR, TASKBAR_BG);
+
+    format_ms(a, sizeof(a), stats.paint_ns);
+    format_ms(b, sizeof(b), stats.composite_ns);
+    format_ms(c, sizeof(c), stats.present_ns);
+    snprintf(line, sizeof(line), "pnt %s cmp %s gpu %s", a, b, c);
+    fb_puts(TASKBAR_HUD_X, taskbar_y + 18, line, HUD_COLOR, TASKBAR_BG);
+}
+
 /**
  * Draw a simple icon (geometric shape)
  */
@@ -87,9 +211,9 @@ static void draw_desktop_icon(desktop_icon_t *icon, int type)
 
     /* Selection highlight */
     if (icon->selected) {
-        fb_fill_rect(icon->x - 4, icon->y - 4,
-                     ICON_WIDTH + 8, ICON_HEIGHT + ICON_LABEL_HEIGHT + 12,
-                     ICON_SELECTED_BG);
+        fb_blend_rect(icon->x - 4, icon->y - 4,
+                      ICON_WIDTH + 8, ICON_HEIGHT + ICON_LABEL_HEIGHT + 12,
+                      ICON_SELECTED_BG);
     }
 
     /* Draw icon shape */
@@ -100,12 +224,11 @@ static void draw_desktop_icon(desktop_icon_t *icon, int type)
     label_x = icon->x + (ICON_WIDTH - label_width) / 2;
 
     /* Label background */
-    fb_fill_rect(label_x - 2, icon->y + ICON_HEIGHT + 2,
-                 label_width + 4, 12, ICON_LABEL_BG);
+    fb_blend_rect(label_x - 2, icon->y + ICON_HEIGHT + 2,
+                  label_width + 4, 12, ICON_LABEL_BG);
 
     /* Label text */
-    fb_puts(label_x, icon->y + ICON_HEIGHT + 4,
-            icon->name, 0xFFFFFFFF, ICON_LABEL_BG);
+    fb_puts_over(label_x, icon->y + ICON_HEIGHT + 4, icon->name, 0xFFFFFFFF);
 }
 
 /**
@@ -113,15 +236,26 @@ static void draw_desktop_icon(desktop_icon_t *icon, int type)
  */
 void desktop_init(void)
 {
+    uint32_t *layer = desktop.layer;
+    size_t layer_size = desktop.layer_size;
+
     klog_info("Initializing desktop environment...");
 
+    /* Keep the layer buffer of an earlier run; it is re-rendered on use */
     memset(&desktop, 0, sizeof(desktop));
+    desktop.layer = layer;
+    desktop.layer_size = layer_size;
     desktop.selected_icon = -1;
     desktop.start_menu_visible = false;
     desktop.initialized = true;
     desktop.last_click_time = 0;
     desktop.last_click_icon = -1;
 
+    if (!desktop_shrinker_registered) {
+        shrinker_register(&desktop_shrinker);
+        desktop_shrinker_registered = true;
+    }
+
     klog_info("Desktop environment initialized");
 }
 
@@ -131,7 +265,7 @@ void desktop_init(void)
 void desktop_draw_background(void)
 {
     uint32_t y;
-    uint32_t height = FB_HEIGHT - TASKBAR_HEIGHT;
+    uint32_t height = fb_height() - TASKBAR_HEIGHT;
 
     /* Draw vertical gradient */
     for (y = 0; y < height; y++) {
@@ -150,7 +284,7 @@ void desktop_draw_background(void)
 
         uint32_t color = 0xFF000000 | (r << 16) | (g << 8) | b;
 
-        fb_fill_rect(0, y, FB_WIDTH, 1, color);
+        fb_fill_span(0, y, fb_width(), color);
     }
 }
 
@@ -167,34 +301,47 @@ void desktop_draw_icons(void)
 }
 
 /**
- * Draw taskbar
+ * Draw the taskbar's fixed parts: background, border and start button
  */
-void desktop_draw_taskbar(void)
+static void draw_taskbar_base(void)
 {
-    uint32_t taskbar_y = FB_HEIGHT - TASKBAR_HEIGHT;
-    window_t *win;
-    int32_t btn_x;
-    char time_str[16];
-    uint64_t uptime_sec;
-    uint32_t hours, minutes;
+    uint32_t taskbar_y = fb_height() - TASKBAR_HEIGHT;
 
     /* Taskbar background */
-    fb_fill_rect(0, taskbar_y, FB_WIDTH, TASKBAR_HEIGHT, TASKBAR_BG);
+    fb_fill_rect(0, taskbar_y, fb_width(), TASKBAR_HEIGHT, TASKBAR_BG);
 
     /* Top border */
-    fb_fill_rect(0, taskbar_y, FB_WIDTH, 1, TASKBAR_BORDER);
+    fb_fill_rect(0, taskbar_y, fb_width(), 1, TASKBAR_BORDER);
 
     /* Start button */
     fb_fill_rect(4, taskbar_y + 4, START_BUTTON_WIDTH, TASKBAR_HEIGHT - 8, START_BTN_BG);
     fb_puts(12, taskbar_y + 10, "AEOS", 0xFFFFFFFF, START_BTN_BG);
+}
+
+/**
+ * Draw the taskbar's changing parts: window buttons, clock and HUD
+ */
+static void draw_taskbar_items(void)
+{
+    uint32_t taskbar_y = fb_height() - TASKBAR_HEIGHT;
+    window_t *win;
+    int32_t btn_x;
+    char time_str[16];
+    uint64_t uptime_sec;
+    uint32_t hours, minutes;
 
     /* Window buttons */
-    btn_x = START_BUTTON_WIDTH + 12;
+    btn_x = TASKBAR_BUTTONS_X;
     for (win = wm_get_window_list(); win != NULL; win = win->next) {
         if (!(win->flags & WINDOW_FLAG_VISIBLE)) {
             continue;
         }
 
+        /* Buttons give way to the HUD */
+        if (desktop.hud_visible && btn_x + TASKBAR_BUTTON_WIDTH > TASKBAR_HUD_X) {
+            break;
+        }
+
         uint32_t btn_bg = (win->flags & WINDOW_FLAG_FOCUSED) ?
                           TASKBAR_BTN_ACTIVE : TASKBAR_BTN_BG;
 
@@ -219,7 +366,7 @@ void desktop_draw_taskbar(void)
         btn_x += TASKBAR_BUTTON_WIDTH + 4;
 
         /* Stop if we run out of space */
-        if (btn_x > FB_WIDTH - 100) {
+        if (btn_x > fb_width() - 100) {
             break;
         }
     }
@@ -237,7 +384,20 @@ void desktop_draw_taskbar(void)
     time_str[4] = '0' + (minutes % 10);
     time_str[5] = '\0';
 
-    fb_puts(FB_WIDTH - 50, taskbar_y + 10, time_str, CLOCK_COLOR, TASKBAR_BG);
+    fb_puts(TASKBAR_CLOCK_X, taskbar_y + 10, time_str, CLOCK_COLOR, TASKBAR_BG);
+
+    if (desktop.hud_visible) {
+        draw_hud(taskbar_y);
+    }
+}
+
+/**
+ * Draw taskbar
+ */
+void desktop_draw_taskbar(void)
+{
+    draw_taskbar_base();
+    draw_taskbar_items();
 }
 
 /**
@@ -246,7 +406,7 @@ void desktop_draw_taskbar(void)
 static void draw_start_menu(void)
 {
     int32_t menu_x = 4;
-    int32_t menu_y = FB_HEIGHT - TASKBAR_HEIGHT - 160;
+    int32_t menu_y = fb_height() - TASKBAR_HEIGHT - 160;
     int32_t menu_width = 150;
     int32_t menu_height = 156;
     int32_t item_y;
@@ -255,48 +415,115 @@ static void draw_start_menu(void)
         return;
     }
 
-    /* Menu background */
-    fb_fill_rect(menu_x, menu_y, menu_width, menu_height, TASKBAR_BG);
+    /* Menu background: the desktop shows through */
+    fb_blend_rect(menu_x, menu_y, menu_width, menu_height, START_MENU_BG);
     fb_draw_rect(menu_x, menu_y, menu_width, menu_height, TASKBAR_BORDER);
 
     /* Menu items with color indicators */
     item_y = menu_y + 8;
 
     fb_fill_rect(menu_x + 12, item_y + 2, 8, 8, 0xFF00CC00);  /* Green */
-    fb_puts(menu_x + 26, item_y, "Terminal", 0xFFFFFFFF, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "Terminal", 0xFFFFFFFF);
     item_y += 24;
 
     fb_fill_rect(menu_x + 12, item_y + 2, 8, 8, 0xFFCCCC00);  /* Yellow */
-    fb_puts(menu_x + 26, item_y, "Files", 0xFFFFFFFF, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "Files", 0xFFFFFFFF);
     item_y += 24;
 
     fb_fill_rect(menu_x + 12, item_y + 2, 8, 8, 0xFF6688CC);  /* Blue-gray */
-    fb_puts(menu_x + 26, item_y, "Settings", 0xFFFFFFFF, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "Settings", 0xFFFFFFFF);
     item_y += 24;
 
     fb_fill_rect(menu_x + 12, item_y + 2, 8, 8, 0xFF0099FF);  /* Blue */
-    fb_puts(menu_x + 26, item_y, "About", 0xFFFFFFFF, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "About", 0xFFFFFFFF);
     item_y += 24;
 
     /* Separator */
     fb_fill_rect(menu_x + 8, item_y, menu_width - 16, 1, TASKBAR_BORDER);
     item_y += 12;
 
-    fb_puts(menu_x + 26, item_y, "Text Mode", 0xFF888888, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "Text Mode", 0xFF888888);
     item_y += 24;
 
     fb_fill_rect(menu_x + 12, item_y + 2, 8, 8, 0xFFFF4444);  /* Red */
-    fb_puts(menu_x + 26, item_y, "Shutdown", 0xFFff6666, TASKBAR_BG);
+    fb_puts_over(menu_x + 26, item_y, "Shutdown", 0xFFff6666);
 }
 
 /**
- * Full desktop paint
+ * Render the cached layer
+ * Called from a paint, so the caller's clip is put back afterwards.
+ *
+ * @return true if the layer is ready to blit from
  */
-void desktop_paint(void)
+static bool render_layer(void)
 {
+    size_t size = (size_t)fb_width() * fb_height() * sizeof(uint32_t);
+    rect_t saved;
+
+    /* The screen was resized */
+    if (desktop.layer_size != size) {
+        mm_free_huge(desktop.layer, desktop.layer_size);
+        desktop.layer = NULL;
+        desktop.layer_size = size;
+        desktop.layer_failed = false;
+    }
+
+    if (desktop.layer == NULL) {
+        if (desktop.layer_failed && !memory_recovered()) {
+            return false;
+        }
+        desktop.layer = mm_alloc_huge(size);
+        if (desktop.layer == NULL) {
+            /* A retry that fails again (fragmentation) has been reported */
+            if (!desktop.layer_failed) {
+                klog_warn("desktop: no memory for the cached layer, drawing directly");
+            }
+            desktop.layer_failed = true;
+            return false;
+        }
+        desktop.layer_failed = false;
+    }
+
+    fb_get_clip(&saved);
+    fb_set_target(desktop.layer, 0, 0, fb_width(), fb_height());
     desktop_draw_background();
     desktop_draw_icons();
-    desktop_draw_taskbar();
+    draw_taskbar_base();
+    fb_set_target(NULL, 0, 0, 0, 0);
+    fb_set_clip(&saved);
+
+    desktop.layer_valid = true;
+    return true;
+}
+
+/**
+ * Throw away the cached layer
+ */
+void desktop_invalidate(void)
+{
+    desktop.layer_valid = false;
+}
+
+/**
+ * Full desktop paint
+ */
+void desktop_paint(void)
+{
+    rect_t clip;
+
+    if (desktop.layer_valid || render_layer()) {
+        fb_blit(0, 0, desktop.layer, fb_width(), fb_height(), fb_width());
+    } else {
+        desktop_draw_background();
+        desktop_draw_icons();
+        draw_taskbar_base();
+    }
+
+    /* Clock and buttons only when the clip reaches the taskbar */
+    fb_get_clip(&clip);
+    if (clip.y + clip.height > (int32_t)(fb_height() - TASKBAR_HEIGHT)) {
+        draw_taskbar_items();
+    }
     draw_start_menu();
 }
 
@@ -325,7 +552,7 @@ static int find_icon_at(int32_t x, int32_t y)
 static bool handle_start_menu_click(int32_t x, int32_t y)
 {
     int32_t menu_x = 4;
-    int32_t menu_y = FB_HEIGHT - TASKBAR_HEIGHT - 160;
+    int32_t menu_y = fb_height() - TASKBAR_HEIGHT - 160;
     int32_t menu_width = 150;
     int32_t menu_height = 156;
     int32_t item_y;
@@ -409,6 +636,7 @@ void desktop_handle_click(int32_t x, int32_t y, bool double_click)
     /* Deselect current icon */
     if (desktop.selected_icon >= 0) {
         desktop.icons[desktop.selected_icon].selected = false;
+        desktop_invalidate();
     }
 
     /* Find clicked icon */
@@ -428,6 +656,7 @@ void desktop_handle_click(int32_t x, int32_t y, bool double_click)
             /* Single click - select */
             desktop.selected_icon = icon_idx;
             desktop.icons[icon_idx].selected = true;
+            desktop_invalidate();
         }
 
         desktop.last_click_icon = icon_idx;
@@ -465,6 +694,7 @@ int desktop_add_icon(const char *name, uint32_t icon_color, void (*on_launch)(vo
     icon->y = ICON_MARGIN + row * (ICON_HEIGHT + ICON_LABEL_HEIGHT + 20);
 
     desktop.icon_count++;
+    desktop_invalidate();
 
     return desktop.icon_count - 1;
 }
@@ -482,7 +712,7 @@ void desktop_update_taskbar(void)
  */
 bool desktop_is_taskbar_click(int32_t y)
 {
-    return y >= (int32_t)(FB_HEIGHT - TASKBAR_HEIGHT);
+    return y >= (int32_t)(fb_height() - TASKBAR_HEIGHT);
 }
 
 /**
@@ -517,7 +747,7 @@ void desktop_handle_taskbar_click(int32_t x, int32_t y)
 
         btn_x += TASKBAR_BUTTON_WIDTH + 4;
 
-        if (btn_x > FB_WIDTH - 100) {
+        if (btn_x > fb_width() - 100) {
             break;
         }
     }
@@ -547,6 +777,22 @@ bool desktop_start_menu_visible(void)
     return desktop.start_menu_visible;
 }
 
+/**
+ * Show/hide the performance HUD
+ */
+void desktop_toggle_hud(void)
+{
+    desktop.hud_visible = !desktop.hud_visible;
+}
+
+/**
+ * Is the performance HUD visible
+ */
+bool desktop_hud_visible(void)
+{
+    return desktop.hud_visible;
+}
+
 /* ============================================================================
  * End of desktop.c
  * ============================================================================ */
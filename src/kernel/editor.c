@@ -10,7 +10,6 @@
 #include <aeos/string.h>
 #include <aeos/heap.h>
 #include <aeos/vfs.h>
-#include <aeos/timer.h>
 
 /* ============================================================================
  * ANSI Escape Codes for Terminal Control
@@ -26,14 +25,48 @@
 #define ESC_BOLD            "\x1b[1m"
 #define ESC_DIM             "\x1b[2m"
 
+/* How long the rest of an escape sequence may take to arrive */
+#define EDITOR_ESC_TIMEOUT_MS 20
+
 /* Tab display width (matches insert mode behavior) */
 #define TAB_WIDTH           4
 
-/* Move cursor to row, col (1-based) */
-static void term_move_cursor(int row, int col)
-{
-    kprintf("\x1b[%d;%dH", row + 1, col + 1);
-}
+/* Width of the line number gutter */
+#define LINE_NUM_WIDTH      4
+
+/* Rows of file text; the status bar and message line follow */
+#define TEXT_ROWS           (EDITOR_TERM_ROWS - 2)
+
+/* Scroll the terminal instead of repainting when the view moves this little */
+#define SCROLL_MAX_LINES    (TEXT_ROWS / 2)
+
+/* Output assembled per refresh (a full repaint fits with room to spare) */
+#define TERM_OUT_SIZE       8192
+
+/* Cell attributes */
+#define ATTR_NORMAL         0
+#define ATTR_DIM            1
+#define ATTR_REVERSE        2
+
+/* One screen of cells */
+typedef struct {
+    char ch[EDITOR_TERM_ROWS][EDITOR_TERM_COLS];
+    uint8_t attr[EDITOR_TERM_ROWS][EDITOR_TERM_COLS];
+} term_frame_t;
+
+/*
+ * Each refresh renders into frame and sends only the cells that differ from
+ * shadow, the last frame the terminal was sent. Everything goes out through
+ * one buffer and a single uart_write.
+ */
+static struct {
+    term_frame_t frame;                 /* Frame being built */
+    term_frame_t shadow;                /* What the terminal shows */
+    int shadow_scroll;                  /* scroll_row the shadow was drawn at */
+    uint8_t out_attr;                   /* Attribute the terminal has selected */
+    size_t out_len;
+    char out[TERM_OUT_SIZE];
+} term;
 
 /**
  * Compute visual column width from byte column, accounting for tabs.
@@ -111,140 +144,434 @@ static int line_grow(editor_line_t *line, size_t needed)
     return 0;
 }
 
+/* ============================================================================
+ * Editor Buffer Management
+ * ============================================================================ */
+
+/*
+ * The text lives in a piece table; lines are the runs between newlines and
+ * are found through its newline counts, so nothing is shifted per line.
+ * The document holds the lines joined by '\n', and saving adds the final
+ * newline back. Display and search read one line at a time through a view
+ * that is copied out on demand.
+ */
+
+/**
+ * Offset of a row and column in the text
+ */
+static uint32_t text_offset(editor_t *ed, int row, int col)
+{
+    return pt_line_start(&ed->text, (uint32_t)row) + (uint32_t)col;
+}
+
 /**
- * Insert character at position
+ * Length of a line
  */
-static int line_insert_char(editor_line_t *line, int pos, char c)
+static int line_length(editor_t *ed, int row)
 {
-    if (pos < 0 || (size_t)pos > line->len) {
-        return -1;
+    return (int)pt_line_length(&ed->text, (uint32_t)row);
+}
+
+/**
+ * Copy a line into the line view
+ * The view stays valid until the next edit or another row is asked for.
+ */
+static editor_line_t *editor_get_line(editor_t *ed, int row)
+{
+    editor_line_t *line = &ed->line;
+    uint32_t start, len;
+
+    if (row == ed->line_row) {
+        return line;
     }
 
-    if (line_grow(line, line->len + 2) < 0) {
-        return -1;
+    start = pt_line_start(&ed->text, (uint32_t)row);
+    len = pt_line_length(&ed->text, (uint32_t)row);
+    if (line_grow(line, len + 1) < 0) {
+        len = (uint32_t)line->capacity - 1;    /* Show what fits */
     }
 
-    /* Shift characters right */
-    memmove(&line->chars[pos + 1], &line->chars[pos], line->len - pos + 1);
-    line->chars[pos] = c;
-    line->len++;
-    return 0;
+    line->len = pt_read(&ed->text, start, line->chars, len);
+    line->chars[line->len] = '\0';
+    ed->line_row = row;
+    return line;
 }
 
 /**
- * Delete character at position
+ * Note an edit: recount lines and drop the line view
  */
-static int line_delete_char(editor_line_t *line, int pos)
+static void editor_text_changed(editor_t *ed)
 {
-    if (pos < 0 || (size_t)pos >= line->len) {
-        return -1;
+    ed->num_lines = (int)pt_line_count(&ed->text);
+    ed->line_row = -1;
+    ed->modified = true;
+}
+
+/* ============================================================================
+ * Undo Journal
+ * ============================================================================ */
+
+/*
+ * Every change to the text is an insert or a delete of one range, and the
+ * journal keeps one entry per change. An entry whose text is out of the
+ * document holds the pieces cut out for it; one whose text is in holds
+ * nothing. Undo and redo both just flip an entry: cut its range out and
+ * keep the pieces, or merge the kept pieces back in. That costs the same
+ * for one character as for a thousand pasted lines, and the journal only
+ * ever holds piece nodes, never copies of text.
+ *
+ * Entries made by one command share a group, and undo/redo step a group at
+ * a time. A whole insert session is one group; typing in it extends a
+ * single entry.
+ */
+
+static void undo_unlink_head(editor_t *ed)
+{
+    editor_undo_t *u = ed->undo_head;
+
+    ed->undo_head = u->next;
+    if (ed->undo_head != NULL) {
+        ed->undo_head->prev = NULL;
+    }
+    if (ed->undo_top == u) {
+        ed->undo_top = NULL;
     }
 
-    /* Shift characters left */
-    memmove(&line->chars[pos], &line->chars[pos + 1], line->len - pos);
-    line->len--;
-    return 0;
+    /* What was saved is now the oldest state, or out of reach */
+    if (ed->undo_saved == u) {
+        ed->undo_saved = NULL;
+    } else if (ed->undo_saved == NULL) {
+        ed->undo_saved_valid = false;
+    }
+
+    pt_free_pieces(u->pieces);
+    kfree(u);
+    ed->undo_count--;
 }
 
 /**
- * Set line content
+ * Drop the entries after undo_top; a new change ends redo
  */
-static int line_set(editor_line_t *line, const char *str, size_t len)
+static void undo_drop_redo(editor_t *ed)
 {
-    if (line_grow(line, len + 1) < 0) {
-        return -1;
+    editor_undo_t *u = ed->undo_top ? ed->undo_top->next : ed->undo_head;
+
+    while (u != NULL) {
+        editor_undo_t *next = u->next;
+
+        if (ed->undo_saved == u) {
+            ed->undo_saved_valid = false;
+        }
+        pt_free_pieces(u->pieces);
+        kfree(u);
+        ed->undo_count--;
+        u = next;
     }
 
-    memcpy(line->chars, str, len);
-    line->chars[len] = '\0';
-    line->len = len;
-    return 0;
+    if (ed->undo_top != NULL) {
+        ed->undo_top->next = NULL;
+    } else {
+        ed->undo_head = NULL;
+    }
 }
 
-/* ============================================================================
- * Editor Buffer Management
- * ============================================================================ */
-
 /**
- * Add a new line to the editor
+ * Make sure recording the next change cannot fail
  */
-static int editor_add_line(editor_t *ed, int pos, const char *text, size_t len)
+static int undo_reserve(editor_t *ed)
 {
-    /* Grow lines array if needed */
-    if (ed->num_lines >= ed->lines_capacity) {
-        int new_cap = ed->lines_capacity * 2;
-        editor_line_t *new_lines = (editor_line_t *)kmalloc(new_cap * sizeof(editor_line_t));
-        if (new_lines == NULL) {
+    if (ed->undo_spare == NULL) {
+        ed->undo_spare = (editor_undo_t *)kmalloc(sizeof(editor_undo_t));
+        if (ed->undo_spare == NULL) {
             return -1;
         }
-        memcpy(new_lines, ed->lines, ed->num_lines * sizeof(editor_line_t));
-        kfree(ed->lines);
-        ed->lines = new_lines;
-        ed->lines_capacity = new_cap;
     }
+    return 0;
+}
+
+/**
+ * Record a change that has just been made
+ *
+ * @param pieces For a delete, the pieces cut out
+ */
+static void undo_push(editor_t *ed, bool insert, uint32_t pos, uint32_t len,
+                      pt_node_t *pieces)
+{
+    editor_undo_t *u;
 
-    /* Shift lines down */
-    if (pos < ed->num_lines) {
-        memmove(&ed->lines[pos + 1], &ed->lines[pos],
-                (ed->num_lines - pos) * sizeof(editor_line_t));
+    undo_drop_redo(ed);
+    if (!ed->undo_group_open) {
+        ed->undo_group++;
+        ed->undo_group_open = true;
     }
 
-    /* Initialize new line */
-    if (line_init(&ed->lines[pos]) < 0) {
-        return -1;
+    /* Typing on from the last insert extends it */
+    u = ed->undo_top;
+    if (insert && u != NULL && u->insert && u->group == ed->undo_group &&
+        pos == u->pos + u->len &&
+        !(ed->undo_saved_valid && ed->undo_saved == u)) {
+        u->len += len;
+        return;
     }
 
-    if (text != NULL && len > 0) {
-        if (line_set(&ed->lines[pos], text, len) < 0) {
-            return -1;
+    /* Full: forget the oldest command */
+    if (ed->undo_count >= EDITOR_MAX_UNDO) {
+        uint32_t oldest = ed->undo_head->group;
+
+        while (ed->undo_head != NULL && ed->undo_head->group == oldest) {
+            undo_unlink_head(ed);
         }
     }
 
-    ed->num_lines++;
-    return 0;
+    u = ed->undo_spare;
+    ed->undo_spare = NULL;
+    u->prev = ed->undo_top;
+    u->next = NULL;
+    u->pieces = pieces;
+    u->pos = pos;
+    u->len = len;
+    u->group = ed->undo_group;
+    u->insert = insert;
+
+    if (ed->undo_top != NULL) {
+        ed->undo_top->next = u;
+    } else {
+        ed->undo_head = u;
+    }
+    ed->undo_top = u;
+    ed->undo_count++;
 }
 
 /**
- * Delete a line from the editor
+ * Undo or redo one entry
  */
-static int editor_delete_line(editor_t *ed, int pos)
+static int undo_flip(editor_t *ed, editor_undo_t *u)
 {
-    if (pos < 0 || pos >= ed->num_lines) {
+    if (u->pieces == NULL) {
+        return pt_cut(&ed->text, u->pos, u->len, &u->pieces);
+    }
+    if (pt_paste(&ed->text, u->pos, u->pieces) < 0) {
         return -1;
     }
+    u->pieces = NULL;
+    return 0;
+}
 
-    line_free(&ed->lines[pos]);
+/**
+ * Revert and forget the last entry (an operation failing halfway)
+ */
+static void undo_discard_last(editor_t *ed)
+{
+    editor_undo_t *u = ed->undo_top;
 
-    /* Shift lines up */
-    if (pos < ed->num_lines - 1) {
-        memmove(&ed->lines[pos], &ed->lines[pos + 1],
-                (ed->num_lines - pos - 1) * sizeof(editor_line_t));
+    if (u == NULL || undo_flip(ed, u) < 0) {
+        return;
     }
 
-    ed->num_lines--;
+    ed->undo_top = u->prev;
+    undo_drop_redo(ed);
+    editor_text_changed(ed);
+}
 
-    /* Ensure at least one empty line */
-    if (ed->num_lines == 0) {
-        editor_add_line(ed, 0, NULL, 0);
+/**
+ * Put the cursor on a changed offset and settle the modified flag
+ */
+static void undo_finish(editor_t *ed, uint32_t pos)
+{
+    int len;
+
+    editor_text_changed(ed);
+    ed->modified = !(ed->undo_saved_valid && ed->undo_saved == ed->undo_top);
+
+    ed->cursor_row = (int)pt_line_of(&ed->text, pos);
+    ed->cursor_col = (int)(pos - pt_line_start(&ed->text, (uint32_t)ed->cursor_row));
+    len = line_length(ed, ed->cursor_row);
+    if (ed->cursor_col > len) {
+        ed->cursor_col = len;
     }
+}
 
-    return 0;
+/**
+ * Undo the last command
+ */
+static void editor_undo(editor_t *ed)
+{
+    editor_undo_t *u = ed->undo_top;
+    uint32_t group, pos = 0;
+
+    if (u == NULL) {
+        editor_set_status(ed, "Already at oldest change");
+        return;
+    }
+
+    group = u->group;
+    while (u != NULL && u->group == group) {
+        if (undo_flip(ed, u) < 0) {
+            editor_set_status(ed, "Out of memory");
+            break;
+        }
+        pos = u->pos;
+        u = u->prev;
+        ed->undo_top = u;
+    }
+
+    ed->undo_group_open = false;
+    undo_finish(ed, pos);
+}
+
+/**
+ * Redo the last undone command
+ */
+static void editor_redo(editor_t *ed)
+{
+    editor_undo_t *u = ed->undo_top ? ed->undo_top->next : ed->undo_head;
+    uint32_t group, pos = 0;
+
+    if (u == NULL) {
+        editor_set_status(ed, "Already at newest change");
+        return;
+    }
+
+    group = u->group;
+    while (u != NULL && u->group == group) {
+        if (undo_flip(ed, u) < 0) {
+            editor_set_status(ed, "Out of memory");
+            break;
+        }
+        pos = u->pos;
+        ed->undo_top = u;
+        u = u->next;
+    }
+
+    ed->undo_group_open = false;
+    undo_finish(ed, pos);
+}
+
+static void undo_free_all(editor_t *ed)
+{
+    ed->undo_top = NULL;
+    undo_drop_redo(ed);
+    if (ed->undo_spare != NULL) {
+        kfree(ed->undo_spare);
+        ed->undo_spare = NULL;
+    }
 }
 
 /* ============================================================================
- * Input Handling
+ * Text Changes
  * ============================================================================ */
 
+/* All edits go through these three, which keep the journal */
+
+static int text_insert(editor_t *ed, uint32_t pos, const char *text, uint32_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    if (undo_reserve(ed) < 0 || pt_insert(&ed->text, pos, text, len) < 0) {
+        editor_set_status(ed, "Out of memory");
+        return -1;
+    }
+    undo_push(ed, true, pos, len, NULL);
+    editor_text_changed(ed);
+    return 0;
+}
+
+static int text_insert_spans(editor_t *ed, uint32_t pos, const pt_span_list_t *list)
+{
+    if (list->len == 0) {
+        return 0;
+    }
+    if (undo_reserve(ed) < 0 || pt_insert_spans(&ed->text, pos, list) < 0) {
+        editor_set_status(ed, "Out of memory");
+        return -1;
+    }
+    undo_push(ed, true, pos, list->len, NULL);
+    editor_text_changed(ed);
+    return 0;
+}
+
+static int text_delete(editor_t *ed, uint32_t pos, uint32_t len)
+{
+    pt_node_t *pieces;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (undo_reserve(ed) < 0 || pt_cut(&ed->text, pos, len, &pieces) < 0) {
+        editor_set_status(ed, "Out of memory");
+        return -1;
+    }
+    undo_push(ed, false, pos, len, pieces);
+    editor_text_changed(ed);
+    return 0;
+}
+
+/**
+ * Insert text at a row and column
+ */
+static int editor_insert_text(editor_t *ed, int row, int col, const char *text, size_t len)
+{
+    return text_insert(ed, text_offset(ed, row, col), text, (uint32_t)len);
+}
+
 /**
- * Check if UART has data available (non-blocking check)
+ * Delete a line from the editor
+ * The last line takes the newline before it; a lone line is emptied.
  */
-static bool uart_has_data(void)
+static int editor_delete_line(editor_t *ed, int row)
 {
-    /* PL011 UART Flag Register - check RX FIFO not empty */
-    volatile uint32_t *fr = (volatile uint32_t *)0x09000018;
-    return (*fr & (1 << 4)) == 0;  /* RXFE = 0 means data available */
+    uint32_t start, end;
+
+    if (row < 0 || row >= ed->num_lines) {
+        return -1;
+    }
+
+    start = pt_line_start(&ed->text, (uint32_t)row);
+    if (row + 1 < ed->num_lines) {
+        end = pt_line_start(&ed->text, (uint32_t)row + 1);
+    } else {
+        end = pt_length(&ed->text);
+        if (row > 0) {
+            start--;
+        }
+    }
+
+    return text_delete(ed, start, end - start);
 }
 
+/**
+ * Insert the yank register as a new line at row
+ */
+static int editor_paste_line(editor_t *ed, int row)
+{
+    uint32_t pos;
+
+    if (row < ed->num_lines) {
+        /* Newline first, then the text in front of it */
+        pos = pt_line_start(&ed->text, (uint32_t)row);
+        if (text_insert(ed, pos, "\n", 1) < 0) {
+            return -1;
+        }
+    } else {
+        pos = pt_length(&ed->text);
+        if (text_insert(ed, pos, "\n", 1) < 0) {
+            return -1;
+        }
+        pos++;
+    }
+
+    if (text_insert_spans(ed, pos, &ed->yank) < 0) {
+        undo_discard_last(ed);
+        return -1;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Input Handling
+ * ============================================================================ */
+
 /**
  * Read a key with escape sequence handling
  */
@@ -254,23 +581,16 @@ int editor_read_key(void)
 
     /* Handle escape sequences */
     if (c == '\x1b') {
-        /* Wait a bit for more characters */
-        timer_delay_ms(20);
-
-        if (!uart_has_data()) {
-            return KEY_ESCAPE;
-        }
-
-        char seq[3];
-        seq[0] = uart_getc();
+        /* The rest of a sequence follows within a few ms; block for it */
+        int seq[3];
+        seq[0] = uart_getc_timeout(EDITOR_ESC_TIMEOUT_MS);
 
         if (seq[0] == '[') {
-            if (!uart_has_data()) {
+            seq[1] = uart_getc_timeout(EDITOR_ESC_TIMEOUT_MS);
+            if (seq[1] < 0) {
                 return KEY_ESCAPE;
             }
 
-            seq[1] = uart_getc();
-
             /* Arrow keys and simple sequences */
             switch (seq[1]) {
                 case 'A': return KEY_UP;
@@ -283,8 +603,8 @@ int editor_read_key(void)
 
             /* Extended sequences: ESC [ n ~ */
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (uart_has_data()) {
-                    seq[2] = uart_getc();
+                seq[2] = uart_getc_timeout(EDITOR_ESC_TIMEOUT_MS);
+                if (seq[2] >= 0) {
                     if (seq[2] == '~') {
                         switch (seq[1]) {
                             case '1': return KEY_HOME;
@@ -310,96 +630,242 @@ int editor_read_key(void)
 }
 
 /* ============================================================================
- * Screen Drawing
+ * Terminal Output
  * ============================================================================ */
 
+static void term_flush(void)
+{
+    if (term.out_len > 0) {
+        uart_write(term.out, term.out_len);
+        term.out_len = 0;
+    }
+}
+
+static void term_write(const char *s, size_t len)
+{
+    while (len > 0) {
+        size_t room = TERM_OUT_SIZE - term.out_len;
+
+        if (room == 0) {
+            term_flush();
+            continue;
+        }
+        if (room > len) {
+            room = len;
+        }
+        memcpy(&term.out[term.out_len], s, room);
+        term.out_len += room;
+        s += room;
+        len -= room;
+    }
+}
+
+static void term_puts(const char *s)
+{
+    term_write(s, strlen(s));
+}
+
+/* Move cursor to row, col (0-based) */
+static void term_move_cursor(int row, int col)
+{
+    char seq[16];
+    int len = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row + 1, col + 1);
+
+    term_write(seq, (size_t)len);
+}
+
+static void term_set_attr(uint8_t attr)
+{
+    if (attr == term.out_attr) {
+        return;
+    }
+
+    term_puts(ESC_RESET_ATTR);
+    if (attr == ATTR_DIM) {
+        term_puts(ESC_DIM);
+    } else if (attr == ATTR_REVERSE) {
+        term_puts(ESC_REVERSE_VIDEO);
+    }
+    term.out_attr = attr;
+}
+
+static void frame_blank_row(term_frame_t *f, int row)
+{
+    memset(f->ch[row], ' ', EDITOR_TERM_COLS);
+    memset(f->attr[row], ATTR_NORMAL, EDITOR_TERM_COLS);
+}
+
 /**
- * Draw the editor screen
+ * Forget the shadow after the terminal was cleared
  */
-void editor_refresh_screen(editor_t *ed)
+static void term_reset(editor_t *ed)
 {
-    int row, col;
-    int line_num_width = 4;  /* Width for line numbers */
+    for (int row = 0; row < EDITOR_TERM_ROWS; row++) {
+        frame_blank_row(&term.shadow, row);
+    }
+    term.shadow_scroll = ed->scroll_row;
+    term.out_attr = ATTR_NORMAL;
+    term.out_len = 0;
+}
 
-    /* Hide cursor during redraw */
-    kprintf(ESC_CURSOR_HIDE);
+/**
+ * Scroll the text rows by delta lines (positive moves text up)
+ * The terminal shifts the lines it already shows; the shadow follows so
+ * only the rows scrolled in are drawn.
+ */
+static void term_scroll_text(int delta)
+{
+    char seq[16];
+    int n = delta > 0 ? delta : -delta;
+    int len, row;
+
+    /* Scrolled-in lines take the current attribute */
+    term_set_attr(ATTR_NORMAL);
+
+    len = snprintf(seq, sizeof(seq), "\x1b[1;%dr", TEXT_ROWS);
+    term_write(seq, (size_t)len);
+    len = snprintf(seq, sizeof(seq), "\x1b[%d%c", n, delta > 0 ? 'S' : 'T');
+    term_write(seq, (size_t)len);
+    term_puts("\x1b[r");
+
+    if (delta > 0) {
+        for (row = 0; row < TEXT_ROWS - n; row++) {
+            memcpy(term.shadow.ch[row], term.shadow.ch[row + n], EDITOR_TERM_COLS);
+            memcpy(term.shadow.attr[row], term.shadow.attr[row + n], EDITOR_TERM_COLS);
+        }
+        for (; row < TEXT_ROWS; row++) {
+            frame_blank_row(&term.shadow, row);
+        }
+    } else {
+        for (row = TEXT_ROWS - 1; row >= n; row--) {
+            memcpy(term.shadow.ch[row], term.shadow.ch[row - n], EDITOR_TERM_COLS);
+            memcpy(term.shadow.attr[row], term.shadow.attr[row - n], EDITOR_TERM_COLS);
+        }
+        for (; row >= 0; row--) {
+            frame_blank_row(&term.shadow, row);
+        }
+    }
+}
 
-    /* Move to top-left */
-    kprintf(ESC_CURSOR_HOME);
+/**
+ * Send the changed span of one row and update its shadow
+ */
+static void term_draw_row(int row)
+{
+    const char *nc = term.frame.ch[row];
+    const uint8_t *na = term.frame.attr[row];
+    int first = 0, last = EDITOR_TERM_COLS - 1, end, col;
 
-    /* Draw each row */
-    for (row = 0; row < EDITOR_TERM_ROWS - 2; row++) {
-        int file_row = row + ed->scroll_row;
+    while (first < EDITOR_TERM_COLS &&
+           nc[first] == term.shadow.ch[row][first] &&
+           na[first] == term.shadow.attr[row][first]) {
+        first++;
+    }
+    if (first == EDITOR_TERM_COLS) {
+        return;
+    }
+    while (nc[last] == term.shadow.ch[row][last] &&
+           na[last] == term.shadow.attr[row][last]) {
+        last--;
+    }
 
-        /* Clear line */
-        kprintf(ESC_CLEAR_LINE);
+    /* Trailing blanks are cheaper to clear than to write */
+    end = EDITOR_TERM_COLS;
+    while (end > first && nc[end - 1] == ' ' && na[end - 1] == ATTR_NORMAL) {
+        end--;
+    }
 
-        if (file_row < ed->num_lines) {
-            /* Draw line number */
-            kprintf(ESC_DIM);
-            kprintf("%3d ", file_row + 1);
-            kprintf(ESC_RESET_ATTR);
+    term_move_cursor(row, first);
+    for (col = first; col <= last && col < end; col++) {
+        term_set_attr(na[col]);
+        term_write(&nc[col], 1);
+    }
+    if (end <= last) {
+        term_set_attr(ATTR_NORMAL);
+        term_puts(ESC_CLEAR_LINE);
+    }
 
-            /* Draw line content */
-            editor_line_t *line = &ed->lines[file_row];
-            int start_col = ed->scroll_col;
-            int draw_len = EDITOR_TERM_COLS - line_num_width;
+    memcpy(term.shadow.ch[row], nc, EDITOR_TERM_COLS);
+    memcpy(term.shadow.attr[row], na, EDITOR_TERM_COLS);
+}
 
-            if (start_col < (int)line->len) {
-                int avail = (int)line->len - start_col;
-                if (avail > draw_len) {
-                    avail = draw_len;
-                }
+/* ============================================================================
+ * Screen Drawing
+ * ============================================================================ */
 
-                /* Check for visual mode highlighting */
-                if (ed->mode == MODE_VISUAL) {
-                    /* Simple highlighting - just reverse video the selected region */
-                    int sel_start = ed->selection.start_col;
-                    int sel_end = ed->cursor_col;
-                    if (ed->selection.start_row == file_row ||
-                        (file_row > ed->selection.start_row && file_row < ed->cursor_row) ||
-                        (file_row < ed->selection.start_row && file_row > ed->cursor_row)) {
-                        kprintf(ESC_REVERSE_VIDEO);
-                    }
-                    (void)sel_start;
-                    (void)sel_end;
-                }
+/**
+ * Put text into a frame row, returning the column after it
+ */
+static int frame_put(int row, int col, const char *s, int len, uint8_t attr)
+{
+    for (int i = 0; i < len && col < EDITOR_TERM_COLS; i++, col++) {
+        char ch = s[i];
 
-                /* Print the visible portion of the line */
-                int chars_drawn = 0;
-                for (int i = 0; i < avail && chars_drawn < draw_len; i++) {
-                    char ch = line->chars[start_col + i];
-                    if (ch >= 32 && ch < 127) {
-                        uart_putc(ch);
-                        chars_drawn++;
-                    } else if (ch == '\t') {
-                        for (int t = 0; t < TAB_WIDTH && chars_drawn < draw_len; t++) {
-                            uart_putc(' ');
-                            chars_drawn++;
-                        }
-                    } else {
-                        uart_putc('?');  /* Non-printable */
-                        chars_drawn++;
-                    }
-                }
+        term.frame.ch[row][col] = (ch >= 32 && ch < 127) ? ch : '?';
+        term.frame.attr[row][col] = attr;
+    }
+    return col;
+}
 
-                if (ed->mode == MODE_VISUAL) {
-                    kprintf(ESC_RESET_ATTR);
-                }
+/**
+ * Render one row of file text with its line number
+ */
+static void render_text_row(editor_t *ed, int row)
+{
+    int file_row = row + ed->scroll_row;
+    char num[16];
+
+    frame_blank_row(&term.frame, row);
+
+    if (file_row >= ed->num_lines) {
+        /* Empty line marker */
+        frame_put(row, 0, "~", 1, ATTR_DIM);
+        return;
+    }
+
+    /* Line number */
+    snprintf(num, sizeof(num), "%3d ", file_row + 1);
+    frame_put(row, 0, num, LINE_NUM_WIDTH, ATTR_DIM);
+
+    /* Line content */
+    editor_line_t *line = editor_get_line(ed, file_row);
+    int start_col = ed->scroll_col;
+    uint8_t attr = ATTR_NORMAL;
+
+    if (start_col >= (int)line->len) {
+        return;
+    }
+
+    /* Visual mode - reverse video the selected lines */
+    if (ed->mode == MODE_VISUAL &&
+        (ed->selection.start_row == file_row ||
+         (file_row > ed->selection.start_row && file_row < ed->cursor_row) ||
+         (file_row < ed->selection.start_row && file_row > ed->cursor_row))) {
+        attr = ATTR_REVERSE;
+    }
+
+    int col = LINE_NUM_WIDTH;
+    for (int i = start_col; i < (int)line->len && col < EDITOR_TERM_COLS; i++) {
+        if (line->chars[i] == '\t') {
+            for (int t = 0; t < TAB_WIDTH && col < EDITOR_TERM_COLS; t++) {
+                col = frame_put(row, col, " ", 1, attr);
             }
         } else {
-            /* Empty line marker */
-            kprintf(ESC_DIM "~" ESC_RESET_ATTR);
+            col = frame_put(row, col, &line->chars[i], 1, attr);
         }
-
-        kprintf("\r\n");
     }
+}
 
-    /* Draw status bar */
-    kprintf(ESC_REVERSE_VIDEO);
-
-    /* Left side: mode and filename */
+/**
+ * Render the status bar: mode and filename left, position right
+ */
+static void render_status_bar(editor_t *ed, int row)
+{
+    char left[EDITOR_TERM_COLS + 1];
+    char pos_str[32];
     const char *mode_str;
+    int left_len, pos_len;
+
     switch (ed->mode) {
         case MODE_INSERT: mode_str = "INSERT"; break;
         case MODE_VISUAL: mode_str = "VISUAL"; break;
@@ -407,46 +873,86 @@ void editor_refresh_screen(editor_t *ed)
         default:          mode_str = "COMMAND"; break;
     }
 
-    int left_len = kprintf(" %s | %.40s%s",
-                           mode_str,
-                           ed->filename[0] ? ed->filename : "[No Name]",
-                           ed->modified ? " [+]" : "");
-
-    /* Right side: format position into buffer first, then pad, then print */
-    char pos_str[32];
-    int pos_len = snprintf(pos_str, sizeof(pos_str), " %d:%d ",
-                           ed->cursor_row + 1, ed->cursor_col + 1);
-
-    /* Pad middle */
-    for (col = left_len; col < EDITOR_TERM_COLS - pos_len; col++) {
-        uart_putc(' ');
+    left_len = snprintf(left, sizeof(left), " %s | %.40s%s",
+                        mode_str,
+                        ed->filename[0] ? ed->filename : "[No Name]",
+                        ed->modified ? " [+]" : "");
+    if (left_len > EDITOR_TERM_COLS) {
+        left_len = EDITOR_TERM_COLS;
     }
+    pos_len = snprintf(pos_str, sizeof(pos_str), " %d:%d ",
+                       ed->cursor_row + 1, ed->cursor_col + 1);
 
-    /* Print position on the right */
-    kprintf("%s", pos_str);
+    memset(term.frame.ch[row], ' ', EDITOR_TERM_COLS);
+    memset(term.frame.attr[row], ATTR_REVERSE, EDITOR_TERM_COLS);
+    frame_put(row, 0, left, left_len, ATTR_REVERSE);
+    frame_put(row, EDITOR_TERM_COLS - pos_len, pos_str, pos_len, ATTR_REVERSE);
+}
 
-    kprintf(ESC_RESET_ATTR "\r\n");
+/**
+ * Render the message line or the ex command being typed
+ */
+static void render_message(editor_t *ed, int row)
+{
+    frame_blank_row(&term.frame, row);
 
-    /* Draw message line or ex command */
-    kprintf(ESC_CLEAR_LINE);
     if (ed->mode == MODE_EX) {
-        kprintf(":%s", ed->ex_command);
+        int col = frame_put(row, 0, ":", 1, ATTR_NORMAL);
+        frame_put(row, col, ed->ex_command, (int)strlen(ed->ex_command), ATTR_NORMAL);
     } else if (ed->status_msg[0]) {
-        kprintf("%s", ed->status_msg);
+        frame_put(row, 0, ed->status_msg, (int)strlen(ed->status_msg), ATTR_NORMAL);
+    }
+}
+
+/**
+ * Draw the editor screen
+ * Sends the difference from the previous frame, scrolling the terminal when
+ * the view moved by a few lines.
+ */
+void editor_refresh_screen(editor_t *ed)
+{
+    int row, delta;
+
+    /* Full repaint on request (the console may have been written over) */
+    if (ed->redraw_needed) {
+        ed->redraw_needed = false;
+        term_reset(ed);
+        term_puts(ESC_RESET_ATTR ESC_CLEAR_SCREEN);
+    }
+
+    /* Hide cursor during redraw */
+    term_puts(ESC_CURSOR_HIDE);
+
+    delta = ed->scroll_row - term.shadow_scroll;
+    if (delta != 0 && delta >= -SCROLL_MAX_LINES && delta <= SCROLL_MAX_LINES) {
+        term_scroll_text(delta);
     }
+    term.shadow_scroll = ed->scroll_row;
+
+    for (row = 0; row < TEXT_ROWS; row++) {
+        render_text_row(ed, row);
+    }
+    render_status_bar(ed, TEXT_ROWS);
+    render_message(ed, TEXT_ROWS + 1);
+
+    for (row = 0; row < EDITOR_TERM_ROWS; row++) {
+        term_draw_row(row);
+    }
+    term_set_attr(ATTR_NORMAL);
 
     /* Position cursor (use visual column to account for tabs) */
     int cursor_screen_row = ed->cursor_row - ed->scroll_row;
-    int cursor_visual_col = byte_col_to_visual(&ed->lines[ed->cursor_row], ed->cursor_col);
-    int scroll_visual_col = byte_col_to_visual(&ed->lines[ed->cursor_row], ed->scroll_col);
-    int cursor_screen_col = line_num_width + cursor_visual_col - scroll_visual_col;
+    int cursor_visual_col = byte_col_to_visual(editor_get_line(ed, ed->cursor_row), ed->cursor_col);
+    int scroll_visual_col = byte_col_to_visual(editor_get_line(ed, ed->cursor_row), ed->scroll_col);
+    int cursor_screen_col = LINE_NUM_WIDTH + cursor_visual_col - scroll_visual_col;
 
-    if (cursor_screen_row >= 0 && cursor_screen_row < EDITOR_TERM_ROWS - 2) {
+    if (cursor_screen_row >= 0 && cursor_screen_row < TEXT_ROWS) {
         term_move_cursor(cursor_screen_row, cursor_screen_col);
     }
 
     /* Show cursor */
-    kprintf(ESC_CURSOR_SHOW);
+    term_puts(ESC_CURSOR_SHOW);
+    term_flush();
 }
 
 /* ============================================================================
@@ -461,8 +967,8 @@ static void cursor_up(editor_t *ed)
     if (ed->cursor_row > 0) {
         ed->cursor_row--;
         /* Clamp column to line length */
-        if (ed->cursor_col > (int)ed->lines[ed->cursor_row].len) {
-            ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+        if (ed->cursor_col > line_length(ed, ed->cursor_row)) {
+            ed->cursor_col = line_length(ed, ed->cursor_row);
         }
     }
 }
@@ -475,8 +981,8 @@ static void cursor_down(editor_t *ed)
     if (ed->cursor_row < ed->num_lines - 1) {
         ed->cursor_row++;
         /* Clamp column to line length */
-        if (ed->cursor_col > (int)ed->lines[ed->cursor_row].len) {
-            ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+        if (ed->cursor_col > line_length(ed, ed->cursor_row)) {
+            ed->cursor_col = line_length(ed, ed->cursor_row);
         }
     }
 }
@@ -491,7 +997,7 @@ static void cursor_left(editor_t *ed)
     } else if (ed->cursor_row > 0) {
         /* Move to end of previous line */
         ed->cursor_row--;
-        ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+        ed->cursor_col = line_length(ed, ed->cursor_row);
     }
 }
 
@@ -500,7 +1006,7 @@ static void cursor_left(editor_t *ed)
  */
 static void cursor_right(editor_t *ed)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
+    editor_line_t *line = editor_get_line(ed, ed->cursor_row);
     if (ed->cursor_col < (int)line->len) {
         ed->cursor_col++;
     } else if (ed->cursor_row < ed->num_lines - 1) {
@@ -523,7 +1029,7 @@ static void cursor_home(editor_t *ed)
  */
 static void cursor_end(editor_t *ed)
 {
-    ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+    ed->cursor_col = line_length(ed, ed->cursor_row);
 }
 
 /**
@@ -531,7 +1037,7 @@ static void cursor_end(editor_t *ed)
  */
 static void cursor_word_forward(editor_t *ed)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
+    editor_line_t *line = editor_get_line(ed, ed->cursor_row);
 
     /* Skip current word */
     while (ed->cursor_col < (int)line->len &&
@@ -560,14 +1066,14 @@ static void cursor_word_backward(editor_t *ed)
     /* If at start of line, go to previous line */
     if (ed->cursor_col == 0 && ed->cursor_row > 0) {
         ed->cursor_row--;
-        ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+        ed->cursor_col = line_length(ed, ed->cursor_row);
     }
 
     if (ed->cursor_col > 0) {
         ed->cursor_col--;
     }
 
-    editor_line_t *line = &ed->lines[ed->cursor_row];
+    editor_line_t *line = editor_get_line(ed, ed->cursor_row);
 
     /* Skip spaces */
     while (ed->cursor_col > 0 && line->chars[ed->cursor_col] == ' ') {
@@ -589,15 +1095,14 @@ static void editor_scroll(editor_t *ed)
     if (ed->cursor_row < ed->scroll_row) {
         ed->scroll_row = ed->cursor_row;
     }
-    if (ed->cursor_row >= ed->scroll_row + EDITOR_TERM_ROWS - 2) {
-        ed->scroll_row = ed->cursor_row - EDITOR_TERM_ROWS + 3;
+    if (ed->cursor_row >= ed->scroll_row + TEXT_ROWS) {
+        ed->scroll_row = ed->cursor_row - TEXT_ROWS + 1;
     }
 
     /* Horizontal scroll (use visual column for proper tab handling) */
-    int line_num_width = 4;
-    int visible_cols = EDITOR_TERM_COLS - line_num_width;
-    int cursor_visual = byte_col_to_visual(&ed->lines[ed->cursor_row], ed->cursor_col);
-    int scroll_visual = byte_col_to_visual(&ed->lines[ed->cursor_row], ed->scroll_col);
+    int visible_cols = EDITOR_TERM_COLS - LINE_NUM_WIDTH;
+    int cursor_visual = byte_col_to_visual(editor_get_line(ed, ed->cursor_row), ed->cursor_col);
+    int scroll_visual = byte_col_to_visual(editor_get_line(ed, ed->cursor_row), ed->scroll_col);
 
     if (cursor_visual < scroll_visual) {
         ed->scroll_col = ed->cursor_col;
@@ -607,7 +1112,7 @@ static void editor_scroll(editor_t *ed)
         ed->scroll_col = ed->cursor_col;
         /* Back up to fill visible area */
         while (ed->scroll_col > 0) {
-            int test_visual = byte_col_to_visual(&ed->lines[ed->cursor_row], ed->scroll_col - 1);
+            int test_visual = byte_col_to_visual(editor_get_line(ed, ed->cursor_row), ed->scroll_col - 1);
             if (cursor_visual - test_visual >= visible_cols) break;
             ed->scroll_col--;
         }
@@ -623,11 +1128,8 @@ static void editor_scroll(editor_t *ed)
  */
 static void editor_insert_char(editor_t *ed, char c)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
-
-    if (line_insert_char(line, ed->cursor_col, c) == 0) {
+    if (editor_insert_text(ed, ed->cursor_row, ed->cursor_col, &c, 1) == 0) {
         ed->cursor_col++;
-        ed->modified = true;
     }
 }
 
@@ -636,46 +1138,26 @@ static void editor_insert_char(editor_t *ed, char c)
  */
 static void editor_insert_newline(editor_t *ed)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
-
-    /* Text after cursor goes to new line */
-    const char *after = &line->chars[ed->cursor_col];
-    size_t after_len = line->len - ed->cursor_col;
-
-    /* Insert new line */
-    if (editor_add_line(ed, ed->cursor_row + 1, after, after_len) < 0) {
+    if (editor_insert_text(ed, ed->cursor_row, ed->cursor_col, "\n", 1) < 0) {
         return;
     }
 
-    /* Truncate current line */
-    line->chars[ed->cursor_col] = '\0';
-    line->len = ed->cursor_col;
-
     /* Move cursor to start of new line */
     ed->cursor_row++;
     ed->cursor_col = 0;
-    ed->modified = true;
 }
 
 /**
  * Delete character at cursor
+ * At the end of a line this deletes the newline, joining the next line.
  */
 static void editor_delete_char(editor_t *ed)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
+    int len = line_length(ed, ed->cursor_row);
 
-    if (ed->cursor_col < (int)line->len) {
-        line_delete_char(line, ed->cursor_col);
-        ed->modified = true;
-    } else if (ed->cursor_row < ed->num_lines - 1) {
-        /* Join with next line */
-        editor_line_t *next = &ed->lines[ed->cursor_row + 1];
-        if (line_grow(line, line->len + next->len + 1) == 0) {
-            memcpy(&line->chars[line->len], next->chars, next->len + 1);
-            line->len += next->len;
-            editor_delete_line(ed, ed->cursor_row + 1);
-            ed->modified = true;
-        }
+    if (ed->cursor_col < len ||
+        (ed->cursor_col == len && ed->cursor_row < ed->num_lines - 1)) {
+        text_delete(ed, text_offset(ed, ed->cursor_row, ed->cursor_col), 1);
     }
 }
 
@@ -690,33 +1172,48 @@ static void editor_backspace(editor_t *ed)
     } else if (ed->cursor_row > 0) {
         /* Join with previous line */
         ed->cursor_row--;
-        ed->cursor_col = (int)ed->lines[ed->cursor_row].len;
+        ed->cursor_col = line_length(ed, ed->cursor_row);
         editor_delete_char(ed);
     }
 }
 
+/**
+ * Copy the current line into the yank register
+ * The register holds runs of the text buffers, not a copy of the text.
+ */
+static int editor_copy_line(editor_t *ed)
+{
+    pt_spans_clear(&ed->yank);
+    ed->yank_is_line = true;
+
+    if (pt_copy_spans(&ed->text, pt_line_start(&ed->text, (uint32_t)ed->cursor_row),
+                      (uint32_t)line_length(ed, ed->cursor_row), &ed->yank) < 0) {
+        pt_spans_clear(&ed->yank);
+        ed->yank_is_line = false;
+        editor_set_status(ed, "Out of memory");
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Delete current line
  */
 static void editor_delete_current_line(editor_t *ed)
 {
     /* Yank the line first */
-    editor_line_t *line = &ed->lines[ed->cursor_row];
-    size_t copy_len = line->len < EDITOR_MAX_YANK - 1 ? line->len : EDITOR_MAX_YANK - 1;
-    memcpy(ed->yank_buffer, line->chars, copy_len);
-    ed->yank_buffer[copy_len] = '\0';
-    ed->yank_len = copy_len;
-    ed->yank_is_line = true;
+    editor_copy_line(ed);
 
     /* Delete the line */
-    editor_delete_line(ed, ed->cursor_row);
+    if (editor_delete_line(ed, ed->cursor_row) < 0) {
+        return;
+    }
 
     /* Adjust cursor */
     if (ed->cursor_row >= ed->num_lines) {
         ed->cursor_row = ed->num_lines - 1;
     }
     ed->cursor_col = 0;
-    ed->modified = true;
 }
 
 /**
@@ -724,14 +1221,18 @@ static void editor_delete_current_line(editor_t *ed)
  */
 static void editor_yank_line(editor_t *ed)
 {
-    editor_line_t *line = &ed->lines[ed->cursor_row];
-    size_t copy_len = line->len < EDITOR_MAX_YANK - 1 ? line->len : EDITOR_MAX_YANK - 1;
-    memcpy(ed->yank_buffer, line->chars, copy_len);
-    ed->yank_buffer[copy_len] = '\0';
-    ed->yank_len = copy_len;
-    ed->yank_is_line = true;
+    if (editor_copy_line(ed) == 0) {
+        editor_set_status(ed, "Yanked line");
+    }
+}
 
-    editor_set_status(ed, "Yanked line");
+/**
+ * Paste yanked text inline at the cursor
+ */
+static int editor_paste_inline(editor_t *ed)
+{
+    return text_insert_spans(ed, text_offset(ed, ed->cursor_row, ed->cursor_col),
+                             &ed->yank);
 }
 
 /**
@@ -739,28 +1240,22 @@ static void editor_yank_line(editor_t *ed)
  */
 static void editor_paste_after(editor_t *ed)
 {
-    if (ed->yank_len == 0) {
+    if (!ed->yank_is_line && ed->yank.len == 0) {
         editor_set_status(ed, "Nothing to paste");
         return;
     }
 
     if (ed->yank_is_line) {
         /* Paste as new line below */
-        if (editor_add_line(ed, ed->cursor_row + 1, ed->yank_buffer, ed->yank_len) == 0) {
+        if (editor_paste_line(ed, ed->cursor_row + 1) == 0) {
             ed->cursor_row++;
             ed->cursor_col = 0;
-            ed->modified = true;
         }
     } else {
         /* Paste inline */
-        editor_line_t *line = &ed->lines[ed->cursor_row];
-        for (size_t i = 0; i < ed->yank_len; i++) {
-            if (line_insert_char(line, ed->cursor_col + (int)i, ed->yank_buffer[i]) < 0) {
-                break;
-            }
+        if (editor_paste_inline(ed) == 0) {
+            ed->cursor_col += (int)ed->yank.len;
         }
-        ed->cursor_col += (int)ed->yank_len;
-        ed->modified = true;
     }
 }
 
@@ -769,26 +1264,19 @@ static void editor_paste_after(editor_t *ed)
  */
 static void editor_paste_before(editor_t *ed)
 {
-    if (ed->yank_len == 0) {
+    if (!ed->yank_is_line && ed->yank.len == 0) {
         editor_set_status(ed, "Nothing to paste");
         return;
     }
 
     if (ed->yank_is_line) {
         /* Paste as new line above */
-        if (editor_add_line(ed, ed->cursor_row, ed->yank_buffer, ed->yank_len) == 0) {
+        if (editor_paste_line(ed, ed->cursor_row) == 0) {
             ed->cursor_col = 0;
-            ed->modified = true;
         }
     } else {
         /* Paste inline at cursor */
-        editor_line_t *line = &ed->lines[ed->cursor_row];
-        for (size_t i = 0; i < ed->yank_len; i++) {
-            if (line_insert_char(line, ed->cursor_col + (int)i, ed->yank_buffer[i]) < 0) {
-                break;
-            }
-        }
-        ed->modified = true;
+        editor_paste_inline(ed);
     }
 }
 
@@ -818,7 +1306,7 @@ static bool editor_find_next(editor_t *ed, bool forward)
             row = (start_row - i + ed->num_lines) % ed->num_lines;
         }
 
-        editor_line_t *line = &ed->lines[row];
+        editor_line_t *line = editor_get_line(ed, row);
         char *found = NULL;
 
         if (row == start_row && i == 0) {
@@ -993,6 +1481,21 @@ static void process_command_mode(editor_t *ed, int key)
             ed->cursor_col = 0;
             break;
 
+        /* Undo / redo */
+        case 'u':
+            editor_undo(ed);
+            break;
+
+        case 18:
+            /* Ctrl-R */
+            editor_redo(ed);
+            break;
+
+        case 12:
+            /* Ctrl-L - repaint the whole screen */
+            ed->redraw_needed = true;
+            break;
+
         /* Mode switching */
         case 'i':
             ed->mode = MODE_INSERT;
@@ -1002,7 +1505,7 @@ static void process_command_mode(editor_t *ed, int key)
         case 'a':
             /* Append after cursor */
             ed->mode = MODE_INSERT;
-            if (ed->cursor_col < (int)ed->lines[ed->cursor_row].len) {
+            if (ed->cursor_col < line_length(ed, ed->cursor_row)) {
                 ed->cursor_col++;
             }
             editor_set_status(ed, "-- INSERT --");
@@ -1010,20 +1513,23 @@ static void process_command_mode(editor_t *ed, int key)
 
         case 'o':
             /* Open line below */
-            editor_add_line(ed, ed->cursor_row + 1, NULL, 0);
+            if (editor_insert_text(ed, ed->cursor_row, line_length(ed, ed->cursor_row),
+                                   "\n", 1) < 0) {
+                break;
+            }
             ed->cursor_row++;
             ed->cursor_col = 0;
             ed->mode = MODE_INSERT;
-            ed->modified = true;
             editor_set_status(ed, "-- INSERT --");
             break;
 
         case 'O':
             /* Open line above */
-            editor_add_line(ed, ed->cursor_row, NULL, 0);
+            if (editor_insert_text(ed, ed->cursor_row, 0, "\n", 1) < 0) {
+                break;
+            }
             ed->cursor_col = 0;
             ed->mode = MODE_INSERT;
-            ed->modified = true;
             editor_set_status(ed, "-- INSERT --");
             break;
 
@@ -1255,6 +1761,11 @@ void editor_process_key(editor_t *ed, int key)
         ed->status_msg[0] = '\0';
     }
 
+    /* Each command starts an undo group; insert mode keeps adding to one */
+    if (ed->mode != MODE_INSERT) {
+        ed->undo_group_open = false;
+    }
+
     switch (ed->mode) {
         case MODE_COMMAND:
             process_command_mode(ed, key);
@@ -1281,16 +1792,43 @@ void editor_process_key(editor_t *ed, int key)
  * File Operations
  * ============================================================================ */
 
+/**
+ * Turn \r\n and lone \r into \n in place
+ * @return New length, less one final newline (lines are joined by '\n')
+ */
+static uint32_t normalize_newlines(char *data, uint32_t len)
+{
+    uint32_t out = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] == '\r') {
+            if (i + 1 < len && data[i + 1] == '\n') {
+                i++;
+            }
+            data[out++] = '\n';
+        } else {
+            data[out++] = data[i];
+        }
+    }
+
+    if (out > 0 && data[out - 1] == '\n') {
+        out--;
+    }
+    return out;
+}
+
 /**
  * Open a file
+ * The file is read in one go into a single buffer that becomes the piece
+ * table's original text; lines are never allocated individually.
  */
 int editor_open(editor_t *ed, const char *filename)
 {
     int fd;
-    char buffer[512];
+    char *data;
+    size_t file_size;
+    size_t got = 0;
     ssize_t bytes_read;
-    char line_buf[EDITOR_MAX_LINE_LEN];
-    int line_pos = 0;
 
     strncpy(ed->filename, filename, EDITOR_MAX_FILENAME - 1);
     ed->filename[EDITOR_MAX_FILENAME - 1] = '\0';
@@ -1302,50 +1840,51 @@ int editor_open(editor_t *ed, const char *filename)
         return 0;
     }
 
-    /* Read file content */
-    while ((bytes_read = vfs_read(fd, buffer, sizeof(buffer))) > 0) {
-        for (int i = 0; i < bytes_read; i++) {
-            char c = buffer[i];
-
-            if (c == '\n' || c == '\r') {
-                /* End of line */
-                line_buf[line_pos] = '\0';
-                editor_add_line(ed, ed->num_lines, line_buf, line_pos);
-                line_pos = 0;
-
-                /* Skip \r\n pair */
-                if (c == '\r' && i + 1 < bytes_read && buffer[i + 1] == '\n') {
-                    i++;
-                }
-            } else if (line_pos < EDITOR_MAX_LINE_LEN - 1) {
-                line_buf[line_pos++] = c;
-            }
-        }
+    file_size = (size_t)vfs_seek(fd, 0, SEEK_END);
+    vfs_seek(fd, 0, SEEK_SET);
+    if (file_size == 0) {
+        vfs_close(fd);
+        return 0;
     }
 
-    /* Add last line if file doesn't end with newline */
-    if (line_pos > 0) {
-        line_buf[line_pos] = '\0';
-        editor_add_line(ed, ed->num_lines, line_buf, line_pos);
+    data = (char *)kmalloc(file_size);
+    if (data == NULL) {
+        vfs_close(fd);
+        editor_set_status(ed, "File too large");
+        return -1;
     }
 
+    while (got < file_size &&
+           (bytes_read = vfs_read(fd, data + got, file_size - got)) > 0) {
+        got += (size_t)bytes_read;
+    }
     vfs_close(fd);
 
-    /* Remove the initial empty line if we loaded content */
-    if (ed->num_lines > 1 && ed->lines[0].len == 0) {
-        editor_delete_line(ed, 0);
+    if (pt_load(&ed->text, data, normalize_newlines(data, (uint32_t)got)) < 0) {
+        editor_set_status(ed, "Out of memory");
+        return -1;
     }
 
+    editor_text_changed(ed);
+    ed->modified = false;
     return 0;
 }
 
+/* Write one run of the document to the file */
+static int save_run(void *ctx, const char *text, uint32_t len)
+{
+    int fd = *(int *)ctx;
+
+    return vfs_write(fd, text, len) == (ssize_t)len ? 0 : -1;
+}
+
 /**
  * Save editor buffer to file
  */
 int editor_save(editor_t *ed)
 {
     int fd;
-    int row;
+    int rc;
 
     if (ed->filename[0] == '\0') {
         editor_set_status(ed, "No filename");
@@ -1358,18 +1897,21 @@ int editor_save(editor_t *ed)
         return -1;
     }
 
-    /* Write each line */
-    for (row = 0; row < ed->num_lines; row++) {
-        editor_line_t *line = &ed->lines[row];
-        if (line->len > 0) {
-            vfs_write(fd, line->chars, line->len);
-        }
-        vfs_write(fd, "\n", 1);
+    /* Write the pieces in order, then the final newline */
+    rc = pt_for_each(&ed->text, save_run, &fd);
+    if (rc == 0) {
+        rc = save_run(&fd, "\n", 1);
     }
 
     vfs_close(fd);
+    if (rc != 0) {
+        editor_set_status(ed, "Write error");
+        return -1;
+    }
     ed->modified = false;
     ed->new_file = false;
+    ed->undo_saved = ed->undo_top;
+    ed->undo_saved_valid = true;
 
     editor_set_status(ed, "\"%s\" written, %d lines", ed->filename, ed->num_lines);
     return 0;
@@ -1397,18 +1939,17 @@ int editor_init(editor_t *ed, const char *filename)
     /* Clear everything */
     memset(ed, 0, sizeof(editor_t));
 
-    /* Allocate initial line array */
-    ed->lines_capacity = 64;
-    ed->lines = (editor_line_t *)kmalloc(ed->lines_capacity * sizeof(editor_line_t));
-    if (ed->lines == NULL) {
+    /* Empty document: one empty line */
+    if (pt_init(&ed->text) < 0) {
         return -1;
     }
-
-    /* Add one empty line */
-    if (editor_add_line(ed, 0, NULL, 0) < 0) {
-        kfree(ed->lines);
+    if (line_init(&ed->line) < 0) {
+        pt_destroy(&ed->text);
         return -1;
     }
+    ed->num_lines = 1;
+    ed->line_row = -1;
+    ed->undo_saved_valid = true;
 
     ed->mode = MODE_COMMAND;
 
@@ -1425,15 +1966,10 @@ int editor_init(editor_t *ed, const char *filename)
  */
 void editor_cleanup(editor_t *ed)
 {
-    /* Free all lines */
-    for (int i = 0; i < ed->num_lines; i++) {
-        line_free(&ed->lines[i]);
-    }
-
-    if (ed->lines != NULL) {
-        kfree(ed->lines);
-        ed->lines = NULL;
-    }
+    undo_free_all(ed);
+    pt_spans_free(&ed->yank);
+    line_free(&ed->line);
+    pt_destroy(&ed->text);
 }
 
 /**
@@ -1449,8 +1985,9 @@ void editor_run(const char *filename)
         return;
     }
 
-    /* Clear screen */
+    /* Clear screen; the first refresh draws everything */
     kprintf(ESC_CLEAR_SCREEN ESC_CURSOR_HOME);
+    term_reset(&ed);
 
     /* Main loop */
     while (!ed.should_quit) {
@@ -8,14 +8,48 @@
 #include <aeos/timer.h>
 #include <aeos/uart.h>
 #include <aeos/kprintf.h>
-#include <aeos/string.h>
 #include <aeos/framebuffer.h>
 
+/*
+ * The queue is a bounded lock-free ring: input drivers push from their
+ * interrupt handlers (and the UART poll from the window manager) while the
+ * window manager alone pops. Each slot carries a sequence number. A slot
+ * at position p is free when seq == p and holds the event for p when
+ * seq == p + 1; the consumer frees it for the next lap with p + SIZE.
+ * Producers claim a position by advancing tail with a compare-and-swap, so
+ * there is no shared count.
+ *
+ * A mouse move pushed right after another one that is still unread is
+ * merged into it, so a fast mouse cannot fill the queue. The slot's busy
+ * word keeps that from racing with the consumer copying the event out.
+ *
+ * Every new slot calls the notify hook so the window manager can sleep
+ * until input arrives. A merged move doesn't: the event it joins already
+ * woke the consumer.
+ */
+
+#define EVENT_QUEUE_MASK (EVENT_QUEUE_SIZE - 1)
+
+_Static_assert((EVENT_QUEUE_SIZE & EVENT_QUEUE_MASK) == 0,
+               "EVENT_QUEUE_SIZE must be a power of two");
+
+/* One queue slot */
+typedef struct {
+    uint32_t seq;
+    uint32_t busy;                      /* Being read or merged into */
+    event_t event;
+} event_slot_t;
+
 /* Event queue */
-static event_t event_queue[EVENT_QUEUE_SIZE];
-static uint32_t queue_head = 0;
-static uint32_t queue_tail = 0;
-static uint32_t queue_count = 0;
+static struct {
+    event_slot_t slots[EVENT_QUEUE_SIZE];
+    uint32_t tail __attribute__((aligned(64)));     /* Producers */
+    uint32_t head __attribute__((aligned(64)));     /* Consumer only */
+    uint32_t move_pos;                  /* Newest mouse move (mouse driver only) */
+    bool move_valid;
+    bool ready;
+    event_notify_fn notify;             /* Wakes the consumer */
+} queue;
 
 /* Mouse state */
 static int32_t mouse_x = 320;  /* Start at center */
@@ -48,20 +82,124 @@ static const char ascii_upper[] = {
     '?', 0  /* 56-57 */
 };
 
+/* ============================================================================
+ * Atomics
+ * ============================================================================ */
+
+/**
+ * Compare and swap with acquire/release ordering
+ * @return true if *p was old and is now new_val
+ */
+static inline bool cas32(uint32_t *p, uint32_t old, uint32_t new_val)
+{
+    return __atomic_compare_exchange_n(p, &old, new_val, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/* ============================================================================
+ * Event Queue
+ * ============================================================================ */
+
+/**
+ * Reserve the next position and store an event in it
+ * @return Position used, or -1 if the queue is full
+ */
+static int64_t ring_push(const event_t *event)
+{
+    event_slot_t *slot;
+    uint32_t pos, seq;
+
+    pos = __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE);
+    for (;;) {
+        slot = &queue.slots[pos & EVENT_QUEUE_MASK];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (cas32(&queue.tail, pos, pos + 1)) {
+                break;
+            }
+        } else if ((int32_t)(seq - pos) < 0) {
+            return -1;  /* Queue full: the slot still holds last lap's event */
+        }
+        pos = __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE);
+    }
+
+    slot->event = *event;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (queue.notify) {
+        queue.notify();
+    }
+    return pos;
+}
+
+/**
+ * Merge a mouse move into the previous one if nothing came after it and
+ * the window manager has not read it yet
+ */
+static bool ring_merge_move(const event_t *event)
+{
+    event_slot_t *slot;
+    bool merged;
+
+    if (!queue.move_valid ||
+        __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE) != queue.move_pos + 1) {
+        return false;
+    }
+
+    slot = &queue.slots[queue.move_pos & EVENT_QUEUE_MASK];
+    if (!cas32(&slot->busy, 0, 1)) {
+        return false;  /* Being copied out right now */
+    }
+
+    merged = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == queue.move_pos + 1;
+    if (merged) {
+        slot->event.timestamp = event->timestamp;
+        slot->event.data.mouse = event->data.mouse;
+    }
+    __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+    return merged;
+}
+
+/**
+ * Push a mouse move, merging it with an unread one
+ * Mouse moves come from one producer, the mouse driver.
+ */
+static void event_push_move(const event_t *event)
+{
+    int64_t pos;
+
+    if (ring_merge_move(event)) {
+        return;
+    }
+
+    pos = ring_push(event);
+    queue.move_valid = pos >= 0;
+    queue.move_pos = (uint32_t)pos;
+}
+
 /**
  * Initialize the event system
  */
 void event_init(void)
 {
+    uint32_t i;
+
     klog_info("Initializing event system...");
 
-    queue_head = 0;
-    queue_tail = 0;
-    queue_count = 0;
+    /* Input interrupts may already be feeding a queue from an earlier run */
+    if (queue.ready) {
+        event_queue_clear();
+    } else {
+        for (i = 0; i < EVENT_QUEUE_SIZE; i++) {
+            queue.slots[i].seq = i;
+        }
+        queue.ready = true;
+    }
 
     /* Initialize mouse at center of screen */
-    mouse_x = FB_WIDTH / 2;
-    mouse_y = FB_HEIGHT / 2;
+    mouse_x = fb_width() / 2;
+    mouse_y = fb_height() / 2;
     mouse_buttons = 0;
 
     modifiers = 0;
@@ -71,35 +209,55 @@ void event_init(void)
 
 /**
  * Push an event to the queue
- * Uses memcpy instead of struct assignment for AArch64 safety with -O2
  */
 bool event_push(const event_t *event)
 {
-    if (queue_count >= EVENT_QUEUE_SIZE) {
-        return false;  /* Queue full */
-    }
-
-    memcpy(&event_queue[queue_tail], event, sizeof(event_t));
-    queue_tail = (queue_tail + 1) % EVENT_QUEUE_SIZE;
-    queue_count++;
+    return ring_push(event) >= 0;
+}
 
-    return true;
+/**
+ * Set the consumer wakeup hook
+ */
+void event_set_notify(event_notify_fn fn)
+{
+    queue.notify = fn;
 }
 
 /**
- * Pop an event from the queue
+ * Pop up to n events from the queue
  */
-bool event_pop(event_t *event)
+uint32_t event_pop_many(event_t *out, uint32_t n)
 {
-    if (queue_count == 0) {
-        return false;  /* Queue empty */
+    event_slot_t *slot;
+    uint32_t pos = queue.head;
+    uint32_t count = 0;
+
+    while (count < n) {
+        slot = &queue.slots[pos & EVENT_QUEUE_MASK];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;  /* Empty, or a producer is still storing it */
+        }
+
+        /* A merge into this slot finishes first; later ones see it gone */
+        while (!cas32(&slot->busy, 0, 1)) {
+            __asm__ volatile("yield");
+        }
+        out[count++] = slot->event;
+        __atomic_store_n(&slot->seq, pos + EVENT_QUEUE_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+        pos++;
     }
 
-    memcpy(event, &event_queue[queue_head], sizeof(event_t));
-    queue_head = (queue_head + 1) % EVENT_QUEUE_SIZE;
-    queue_count--;
+    queue.head = pos;
+    return count;
+}
 
-    return true;
+/**
+ * Pop an event from the queue
+ */
+bool event_pop(event_t *event)
+{
+    return event_pop_many(event, 1) == 1;
 }
 
 /**
@@ -107,11 +265,17 @@ bool event_pop(event_t *event)
  */
 bool event_peek(event_t *event)
 {
-    if (queue_count == 0) {
+    event_slot_t *slot = &queue.slots[queue.head & EVENT_QUEUE_MASK];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue.head + 1) {
         return false;
     }
 
-    memcpy(event, &event_queue[queue_head], sizeof(event_t));
+    while (!cas32(&slot->busy, 0, 1)) {
+        __asm__ volatile("yield");
+    }
+    *event = slot->event;
+    __atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
     return true;
 }
 
@@ -120,7 +284,9 @@ bool event_peek(event_t *event)
  */
 bool event_queue_empty(void)
 {
-    return queue_count == 0;
+    event_slot_t *slot = &queue.slots[queue.head & EVENT_QUEUE_MASK];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue.head + 1;
 }
 
 /**
@@ -128,9 +294,10 @@ bool event_queue_empty(void)
  */
 void event_queue_clear(void)
 {
-    queue_head = 0;
-    queue_tail = 0;
-    queue_count = 0;
+    event_t discard;
+
+    while (event_pop(&discard)) {
+    }
 }
 
 /**
@@ -272,8 +439,8 @@ void event_set_mouse_pos(int32_t x, int32_t y)
     /* Clamp to screen bounds */
     if (x < 0) x = 0;
     if (y < 0) y = 0;
-    if (x >= FB_WIDTH) x = FB_WIDTH - 1;
-    if (y >= FB_HEIGHT) y = FB_HEIGHT - 1;
+    if (x >= fb_width()) x = fb_width() - 1;
+    if (y >= fb_height()) y = fb_height() - 1;
 
     mouse_x = x;
     mouse_y = y;
@@ -320,8 +487,8 @@ void event_generate_mouse_move(int32_t dx, int32_t dy)
     /* Clamp to screen bounds */
     if (mouse_x < 0) mouse_x = 0;
     if (mouse_y < 0) mouse_y = 0;
-    if (mouse_x >= FB_WIDTH) mouse_x = FB_WIDTH - 1;
-    if (mouse_y >= FB_HEIGHT) mouse_y = FB_HEIGHT - 1;
+    if (mouse_x >= fb_width()) mouse_x = fb_width() - 1;
+    if (mouse_y >= fb_height()) mouse_y = fb_height() - 1;
 
     event.type = EVENT_MOUSE_MOVE;
     event.timestamp = (uint32_t)timer_get_ticks();
@@ -330,7 +497,7 @@ void event_generate_mouse_move(int32_t dx, int32_t dy)
     event.data.mouse.buttons = mouse_buttons;
     event.data.mouse.scroll = 0;
 
-    event_push(&event);
+    event_push_move(&event);
 }
 
 /**
@@ -343,14 +510,14 @@ void event_set_mouse_position(int32_t x, int32_t y)
 
     /* Update position if specified (not -1) */
     if (x >= 0) {
-        if (x >= FB_WIDTH) x = FB_WIDTH - 1;
+        if (x >= fb_width()) x = fb_width() - 1;
         if (mouse_x != x) {
             mouse_x = x;
             changed = true;
         }
     }
     if (y >= 0) {
-        if (y >= FB_HEIGHT) y = FB_HEIGHT - 1;
+        if (y >= fb_height()) y = fb_height() - 1;
         if (mouse_y != y) {
             mouse_y = y;
             changed = true;
@@ -366,7 +533,7 @@ void event_set_mouse_position(int32_t x, int32_t y)
         event.data.mouse.buttons = mouse_buttons;
         event.data.mouse.scroll = 0;
 
-        event_push(&event);
+        event_push_move(&event);
     }
 }
 
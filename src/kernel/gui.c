@@ -11,6 +11,7 @@
 #include <aeos/virtio_input.h>
 #include <aeos/virtio_gpu.h>
 #include <aeos/framebuffer.h>
+#include <aeos/task.h>
 #include <aeos/apps/terminal.h>
 #include <aeos/apps/filemanager.h>
 #include <aeos/apps/settings.h>
@@ -19,6 +20,7 @@
 
 /* GUI state */
 static bool gui_running = false;
+static bool input_ready = false;        /* Input devices are set up once */
 
 /* Desktop icon launchers */
 static void launch_terminal_icon(void)
@@ -42,13 +44,16 @@ static void launch_about_icon(void)
 }
 
 /**
- * Initialize GUI subsystem
+ * Set up the event queue and input devices
  */
-int gui_init(void)
+void gui_init_input(void)
 {
-    klog_info("Initializing GUI subsystem...");
+    if (input_ready) {
+        return;
+    }
+    input_ready = true;
 
-    /* Initialize event system */
+    /* The queue must be ready before the devices start interrupting */
     event_init();
 
     /* Initialize VirtIO input devices */
@@ -57,6 +62,24 @@ int gui_init(void)
     } else {
         klog_warn("VirtIO input devices not available, using UART fallback");
     }
+}
+
+/**
+ * Initialize GUI subsystem
+ */
+int gui_init(void)
+{
+    klog_info("Initializing GUI subsystem...");
+
+    /* Devices stay live between runs; each run starts with an empty queue */
+    if (input_ready) {
+        event_init();
+    } else {
+        gui_init_input();
+    }
+
+    /* Shrinkers of the last run may look at the windows and the layer */
+    wm_lock();
 
     /* Initialize window manager */
     wm_init();
@@ -64,6 +87,8 @@ int gui_init(void)
     /* Initialize desktop */
     desktop_init();
 
+    wm_unlock();
+
     /* Set desktop as the background paint callback */
     wm_set_desktop_paint(desktop_paint);
 
@@ -111,6 +136,92 @@ bool gui_is_running(void)
     return gui_running;
 }
 
+/**
+ * Print compositor statistics
+ */
+void gui_print_stats(void)
+{
+    static const char *const bucket_labels[WM_FRAME_BUCKETS] = {
+        "<1", "<2", "<4", "<8", "<16", "<32", "32+"
+    };
+    wm_stats_t stats;
+    wm_frame_stats_t frame;
+    virtio_gpu_stats_t gpu;
+    task_stats_t tasks;
+    window_t *win;
+    uint64_t blend_pixels, blend_spans;
+    uint64_t screen = (uint64_t)fb_width() * fb_height();
+    uint32_t i;
+
+    wm_get_stats(&stats);
+    virtio_gpu_get_stats(&gpu);
+
+    kprintf("\nCompositor:\n");
+    kprintf("  Resolution:         %dx%d\n", fb_width(), fb_height());
+    kprintf("  Frames painted:     %llu\n", stats.frames);
+    kprintf("  Last frame:         %llu dirty pixels in %u rects (%llu%% of screen)\n",
+            stats.frame_dirty_pixels, stats.frame_damage_rects,
+            stats.frame_dirty_pixels * 100 / screen);
+    if (stats.frames > 0) {
+        kprintf("  Average per frame:  %llu dirty pixels\n",
+                stats.total_dirty_pixels / stats.frames);
+    }
+    kprintf("  Window paints:      %u last frame, %llu total\n",
+            stats.frame_window_paints, stats.total_window_paints);
+    kprintf("  Windows occluded:   %u\n", stats.frame_windows_occluded);
+    kprintf("  Pending damage:     %u rects\n", stats.pending_damage_rects);
+    kprintf("  Loop wakeups:       %llu (frame cap %u Hz)\n",
+            stats.wakeups, stats.refresh_hz);
+    fb_get_blend_stats(&blend_pixels, &blend_spans);
+    kprintf("  Pixels blended:     %llu in %llu spans\n", blend_pixels, blend_spans);
+
+    wm_get_frame_stats(&frame);
+    if (frame.history > 0) {
+        kprintf("\nFrame timing (last %u frames, us):\n", frame.history);
+        kprintf("  Frame rate:         %u fps\n", frame.fps);
+        kprintf("  Frame time:         p50 %llu, p99 %llu, max %llu\n",
+                frame.p50_ns / 1000, frame.p99_ns / 1000, frame.max_ns / 1000);
+        kprintf("  Last frame:         %llu = paint %llu + composite %llu + cursor %llu + present %llu\n",
+                frame.frame_ns / 1000, frame.paint_ns / 1000, frame.composite_ns / 1000,
+                frame.cursor_ns / 1000, frame.present_ns / 1000);
+        kprintf("  Pixels to GPU:      %llu last frame\n", frame.pixels);
+        kprintf("  Histogram (ms):    ");
+        for (i = 0; i < WM_FRAME_BUCKETS; i++) {
+            kprintf(" %s:%u", bucket_labels[i], frame.histogram[i]);
+        }
+        kprintf("\n");
+
+        kprintf("  Window paints (us, last / average):\n");
+        for (win = wm_get_window_list(); win != NULL; win = win->next) {
+            if (win->paints > 0) {
+                kprintf("    %-20s %llu / %llu\n", win->title, win->paint_ns / 1000,
+                        win->paint_total_ns / win->paints / 1000);
+            }
+        }
+    }
+
+    task_get_stats(&tasks);
+    kprintf("\nTasks (%llu us budget per pass):\n", TASK_BUDGET_NS / 1000);
+    kprintf("  Running:            %u tasks, %u futures\n", tasks.tasks, tasks.futures);
+    kprintf("  Steps run:          %llu in %llu passes\n", tasks.steps, tasks.passes);
+    kprintf("  Over budget:        %llu passes\n", tasks.over_budget);
+    kprintf("  Longest step:       %llu us\n", tasks.max_step_ns / 1000);
+
+    kprintf("\nVirtIO GPU:\n");
+    kprintf("  Display updates:    %llu\n", gpu.updates);
+    kprintf("  Commands sent:      %llu in %llu notifies (%u in flight)\n",
+            gpu.commands, gpu.notifies, gpu.in_flight);
+    kprintf("  Interrupts:         %llu\n", gpu.interrupts);
+    kprintf("  Errors:             %llu\n", gpu.errors);
+    kprintf("  Pixels transferred: %llu\n", gpu.pixels_transferred);
+    kprintf("  Cursor commands:    %llu\n", gpu.cursor_moves);
+    if (gpu.updates > 0) {
+        kprintf("  Average per update: %llu pixels\n",
+                gpu.pixels_transferred / gpu.updates);
+    }
+    kprintf("\n");
+}
+
 /**
  * Launch Terminal app
  */
@@ -5,262 +5,178 @@
  * ============================================================================ */
 
 #include <aeos/kprintf.h>
+#include <aeos/logbuf.h>
 #include <aeos/uart.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/softirq.h>
+#include <aeos/process.h>
+#include <aeos/vfs.h>
+#include <aeos/string.h>
+#include <aeos/format.h>
+#include <aeos/stdarg.h>
 #include <aeos/types.h>
+#include <asm/registers.h>
 
-/* Variable argument list support */
-typedef __builtin_va_list va_list;
-#define va_start(ap, last) __builtin_va_start(ap, last)
-#define va_arg(ap, type)   __builtin_va_arg(ap, type)
-#define va_end(ap)         __builtin_va_end(ap)
 
 /* Output hook for redirecting kprintf output (e.g., to GUI terminal) */
 kprintf_hook_fn kprintf_output_hook = NULL;
 
-/* Helper function to print a single character */
-static void putchar(char c)
+/*
+ * Output is formatted (format.c) into a per-CPU line buffer with IRQs
+ * masked, so no lock is needed. At the end of each call (or when the
+ * buffer fills) the text becomes one record in the log ring (logbuf.c)
+ * and is queued on the UART, or passed to the output hook, as one write;
+ * the TX interrupt sends it. Nothing here waits on the
+ * serial line unless the UART's own buffer is full.
+ *
+ * A process with a stdout_fd (a shell pipeline stage) has its kprintf()
+ * text written there instead, bypassing the log and the output hook.
+ * That write may block on a full pipe, so it only happens for callers
+ * with IRQs unmasked, outside tasklets; klog() always goes to the console.
+ */
+typedef struct {
+    char text[LOGBUF_RECORD_MAX];
+    uint32_t len;
+    uint8_t level;
+    int out_fd;                         /* This call's stdout, -1: the console */
+} __attribute__((aligned(CACHE_LINE_SIZE))) kprintf_cpu_t;
+
+static kprintf_cpu_t kprintf_cpus[MAX_CPUS];
+
+/* Set for a crash report: everything goes to the console */
+static bool panic_mode;
+
+/**
+ * Descriptor a call's text goes to, -1 for the console
+ * @param daif The caller's IRQ mask
+ */
+static int output_fd(uint64_t daif)
 {
-    if (kprintf_output_hook) {
-        kprintf_output_hook(c);
-    } else {
-        uart_putc(c);
+    process_t *proc;
+
+    if (panic_mode || (daif & DAIF_IRQ_BIT) || in_softirq()) {
+        return -1;
     }
+
+    proc = process_current();
+    return proc != NULL ? proc->stdout_fd : -1;
 }
 
-/* Helper function to print a string */
-static int putstring(const char *s)
+/**
+ * Write a redirected line to its descriptor
+ * Unmasks IRQs around the write, which may block; the process may come
+ * back on another CPU, so the call goes on in that CPU's buffer.
+ */
+static void __attribute__((noinline)) flush_to_fd(kprintf_cpu_t *kc)
 {
-    int count = 0;
+    char text[LOGBUF_RECORD_MAX];
+    uint32_t len = kc->len;
+    uint8_t level = kc->level;
+    int fd = kc->out_fd;
 
-    if (s == NULL) {
-        uart_puts("(null)");
-        return 6;
-    }
+    memcpy(text, kc->text, len);
+    kc->len = 0;
 
-    while (*s) {
-        putchar(*s++);
-        count++;
-    }
+    __asm__ volatile("msr daifclr, #2" ::: "memory");
+    vfs_write(fd, text, len);
+    (void)irq_save();
 
-    return count;
+    kc = &kprintf_cpus[smp_processor_id()];
+    kc->level = level;
+    kc->out_fd = fd;
 }
 
-/* Helper function to print an unsigned integer in a given base */
-static int print_uint(uint64_t value, int base, int uppercase)
+/**
+ * Log and output what this CPU has formatted so far
+ */
+static void flush_line(kprintf_cpu_t *kc)
 {
-    char buf[32];
-    int i = 0;
-    int count = 0;
-    const char *digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
-
-    /* Handle zero specially */
-    if (value == 0) {
-        putchar('0');
-        return 1;
+    if (kc->len == 0) {
+        return;
     }
 
-    /* Convert to string (reversed) */
-    while (value > 0) {
-        buf[i++] = digits[value % base];
-        value /= base;
+    if (kc->out_fd >= 0) {
+        flush_to_fd(kc);
+        return;
     }
 
-    /* Print in correct order */
-    while (i > 0) {
-        putchar(buf[--i]);
-        count++;
+    logbuf_append(kc->level, kc->text, kc->len);
+    if (kprintf_output_hook) {
+        kprintf_output_hook(kc->text, kc->len);
+    } else {
+        uart_write(kc->text, kc->len);
     }
-
-    return count;
+    kc->len = 0;
 }
 
-/* Helper function to print a signed integer */
-static int print_int(int64_t value)
+/**
+ * Flush a full line buffer, then carry on in this CPU's
+ */
+static void kprintf_flush(fmt_out_t *out)
 {
-    int count = 0;
+    kprintf_cpu_t *kc = &kprintf_cpus[smp_processor_id()];
 
-    if (value < 0) {
-        putchar('-');
-        count++;
-        value = -value;
-    }
+    kc->len = (uint32_t)out->len;
+    flush_line(kc);
 
-    count += print_uint((uint64_t)value, 10, 0);
-    return count;
+    /* A redirected write may have moved the caller to another CPU */
+    kc = &kprintf_cpus[smp_processor_id()];
+    out->buf = kc->text;
+    out->len = kc->len;
 }
 
-/* Helper function to print a pointer */
-static int print_pointer(void *ptr)
+/**
+ * Start a call: IRQs stay masked until output_end()
+ * @param out Set up to format into this CPU's line buffer
+ */
+static uint64_t output_begin(uint8_t level, fmt_out_t *out)
 {
-    int count = 0;
-    uint64_t addr = (uint64_t)ptr;
-
-    /* Print "0x" prefix */
-    putchar('0');
-    putchar('x');
-    count += 2;
-
-    /* Print address in hex (16 digits for 64-bit) */
-    char buf[16];
-    int i;
-
-    for (i = 15; i >= 0; i--) {
-        buf[i] = "0123456789abcdef"[addr & 0xF];
-        addr >>= 4;
-    }
+    uint64_t flags = irq_save();
+    kprintf_cpu_t *kc = &kprintf_cpus[smp_processor_id()];
+
+    kc->level = level;
+    kc->out_fd = (level == LOGBUF_LEVEL_NONE) ? output_fd(flags) : -1;
+
+    out->buf = kc->text;
+    out->size = sizeof(kc->text);
+    out->len = kc->len;
+    out->total = 0;
+    out->flush = kprintf_flush;
+    return flags;
+}
 
-    for (i = 0; i < 16; i++) {
-        putchar(buf[i]);
-        count++;
-    }
+/**
+ * End a call: log and output what is left, once
+ */
+static void output_end(fmt_out_t *out, uint64_t flags)
+{
+    kprintf_cpu_t *kc = &kprintf_cpus[smp_processor_id()];
 
-    return count;
+    kc->len = (uint32_t)out->len;
+    flush_line(kc);
+    irq_restore(flags);
 }
 
 /**
  * Kernel printf - formatted output to console
- * Supports: %d, %u, %x, %X, %llu, %lld, %p, %s, %c, %%
- * Supports width modifiers: %-10s, %10s
  */
 int kprintf(const char *fmt, ...)
 {
     va_list args;
-    int count = 0;
-    int width = 0;
-    int left_align = 0;
-    int long_long = 0;
-    const char *str;
-    int str_len, padding, i;
+    fmt_out_t out;
+    uint64_t flags;
+    int count;
 
     if (fmt == NULL) {
         return 0;
     }
 
+    flags = output_begin(LOGBUF_LEVEL_NONE, &out);
     va_start(args, fmt);
-
-    while (*fmt) {
-        if (*fmt == '%') {
-            fmt++;
-            width = 0;
-            left_align = 0;
-            long_long = 0;
-
-            /* Check for left alignment '-' */
-            if (*fmt == '-') {
-                left_align = 1;
-                fmt++;
-            }
-
-            /* Parse width */
-            while (*fmt >= '0' && *fmt <= '9') {
-                width = width * 10 + (*fmt - '0');
-                fmt++;
-            }
-
-            /* Check for 'l' or 'll' modifier */
-            if (*fmt == 'l') {
-                fmt++;
-                if (*fmt == 'l') {
-                    long_long = 1;
-                    fmt++;
-                }
-            }
-
-            switch (*fmt) {
-                case 'd':  /* Signed decimal */
-                case 'i':
-                    if (long_long) {
-                        count += print_int(va_arg(args, int64_t));
-                    } else {
-                        count += print_int(va_arg(args, int));
-                    }
-                    break;
-
-                case 'u':  /* Unsigned decimal */
-                    if (long_long) {
-                        count += print_uint(va_arg(args, uint64_t), 10, 0);
-                    } else {
-                        count += print_uint(va_arg(args, unsigned int), 10, 0);
-                    }
-                    break;
-
-                case 'x':  /* Hexadecimal lowercase */
-                    if (long_long) {
-                        count += print_uint(va_arg(args, uint64_t), 16, 0);
-                    } else {
-                        count += print_uint(va_arg(args, unsigned int), 16, 0);
-                    }
-                    break;
-
-                case 'X':  /* Hexadecimal uppercase */
-                    if (long_long) {
-                        count += print_uint(va_arg(args, uint64_t), 16, 1);
-                    } else {
-                        count += print_uint(va_arg(args, unsigned int), 16, 1);
-                    }
-                    break;
-
-                case 'p':  /* Pointer */
-                    count += print_pointer(va_arg(args, void *));
-                    break;
-
-                case 's':  /* String */
-                    str = va_arg(args, const char *);
-                    if (str == NULL) {
-                        str = "(null)";
-                    }
-                    str_len = 0;
-                    while (str[str_len] != '\0') {
-                        str_len++;
-                    }
-
-                    /* Handle width and alignment */
-                    if (width > 0 && width > str_len) {
-                        padding = width - str_len;
-                        if (left_align) {
-                            count += putstring(str);
-                            for (i = 0; i < padding; i++) {
-                                putchar(' ');
-                                count++;
-                            }
-                        } else {
-                            for (i = 0; i < padding; i++) {
-                                putchar(' ');
-                                count++;
-                            }
-                            count += putstring(str);
-                        }
-                    } else {
-                        count += putstring(str);
-                    }
-                    break;
-
-                case 'c':  /* Character */
-                    putchar((char)va_arg(args, int));
-                    count++;
-                    break;
-
-                case '%':  /* Literal % */
-                    putchar('%');
-                    count++;
-                    break;
-
-                default:
-                    /* Unknown format specifier, print as-is */
-                    putchar('%');
-                    putchar(*fmt);
-                    count += 2;
-                    break;
-            }
-
-            fmt++;
-        } else {
-            putchar(*fmt++);
-            count++;
-        }
-    }
-
+    count = fmt_vformat(&out, fmt, args);
     va_end(args);
+    output_end(&out, flags);
     return count;
 }
 
@@ -270,12 +186,9 @@ int kprintf(const char *fmt, ...)
 void klog(log_level_t level, const char *fmt, ...)
 {
     va_list args;
+    fmt_out_t out;
     const char *prefix;
-    int width = 0;
-    int left_align = 0;
-    int long_long = 0;
-    const char *str;
-    int str_len, padding, i;
+    uint64_t flags;
 
     /* Select prefix based on log level */
     switch (level) {
@@ -299,123 +212,56 @@ void klog(log_level_t level, const char *fmt, ...)
             break;
     }
 
-    /* Print prefix */
-    putstring(prefix);
+    /* The system is going down: don't leave the report in a buffer */
+    if (level == LOG_FATAL) {
+        kprintf_panic_mode();
+    }
+
+    flags = output_begin((uint8_t)level, &out);
 
-    /* Print formatted message */
+    /* Prefix, formatted message and newline */
+    fmt_write(&out, prefix, strlen(prefix));
     va_start(args, fmt);
+    fmt_vformat(&out, fmt, args);
+    va_end(args);
+    fmt_write(&out, "\n", 1);
+
+    output_end(&out, flags);
+}
 
-    while (*fmt) {
-        if (*fmt == '%') {
-            fmt++;
-            width = 0;
-            left_align = 0;
-            long_long = 0;
-
-            /* Check for left alignment '-' */
-            if (*fmt == '-') {
-                left_align = 1;
-                fmt++;
-            }
-
-            /* Parse width */
-            while (*fmt >= '0' && *fmt <= '9') {
-                width = width * 10 + (*fmt - '0');
-                fmt++;
-            }
-
-            /* Check for 'l' or 'll' modifier */
-            if (*fmt == 'l') {
-                fmt++;
-                if (*fmt == 'l') {
-                    long_long = 1;
-                    fmt++;
-                }
-            }
-
-            switch (*fmt) {
-                case 'd':
-                case 'i':
-                    if (long_long) {
-                        print_int(va_arg(args, int64_t));
-                    } else {
-                        print_int(va_arg(args, int));
-                    }
-                    break;
-                case 'u':
-                    if (long_long) {
-                        print_uint(va_arg(args, uint64_t), 10, 0);
-                    } else {
-                        print_uint(va_arg(args, unsigned int), 10, 0);
-                    }
-                    break;
-                case 'x':
-                    if (long_long) {
-                        print_uint(va_arg(args, uint64_t), 16, 0);
-                    } else {
-                        print_uint(va_arg(args, unsigned int), 16, 0);
-                    }
-                    break;
-                case 'X':
-                    if (long_long) {
-                        print_uint(va_arg(args, uint64_t), 16, 1);
-                    } else {
-                        print_uint(va_arg(args, unsigned int), 16, 1);
-                    }
-                    break;
-                case 'p':
-                    print_pointer(va_arg(args, void *));
-                    break;
-                case 's':
-                    str = va_arg(args, const char *);
-                    if (str == NULL) {
-                        str = "(null)";
-                    }
-                    str_len = 0;
-                    while (str[str_len] != '\0') {
-                        str_len++;
-                    }
-
-                    /* Handle width and alignment */
-                    if (width > 0 && width > str_len) {
-                        padding = width - str_len;
-                        if (left_align) {
-                            putstring(str);
-                            for (i = 0; i < padding; i++) {
-                                putchar(' ');
-                            }
-                        } else {
-                            for (i = 0; i < padding; i++) {
-                                putchar(' ');
-                            }
-                            putstring(str);
-                        }
-                    } else {
-                        putstring(str);
-                    }
-                    break;
-                case 'c':
-                    putchar((char)va_arg(args, int));
-                    break;
-                case '%':
-                    putchar('%');
-                    break;
-                default:
-                    putchar('%');
-                    putchar(*fmt);
-                    break;
-            }
-
-            fmt++;
-        } else {
-            putchar(*fmt++);
-        }
+/**
+ * Console output that bypasses the log
+ */
+void console_write(const char *buf, size_t len)
+{
+    uint64_t daif;
+    int fd;
+
+    if (buf == NULL) {
+        return;
     }
 
-    va_end(args);
+    __asm__ volatile("mrs %0, daif" : "=r"(daif));
+    fd = output_fd(daif);
+    if (fd >= 0) {
+        vfs_write(fd, buf, len);
+        return;
+    }
+
+    if (kprintf_output_hook) {
+        kprintf_output_hook(buf, len);
+    } else {
+        uart_write(buf, len);
+    }
+}
 
-    /* Add newline */
-    putchar('\n');
+/**
+ * Synchronous output for crash reports
+ */
+void kprintf_panic_mode(void)
+{
+    panic_mode = true;
+    uart_panic_mode();
 }
 
 /* ============================================================================
@@ -0,0 +1,100 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/ksyms.c
+ * Description: Kernel symbol table lookup
+ * ============================================================================ */
+
+#include <aeos/ksyms.h>
+
+/*
+ * The kernel is linked twice. The first link carries an empty table; the
+ * table generated from its `nm -n` output goes into the second. The table
+ * lives in .rodata, which follows .text, so no code address it lists moves
+ * between the two links.
+ */
+
+typedef struct {
+    uint64_t addr;
+    uint32_t name;                      /* Offset into ksyms_names */
+    uint32_t reserved;
+} ksym_t;
+
+extern const ksym_t ksyms_table[];
+extern const uint64_t ksyms_count;
+extern const char ksyms_names[];
+
+/* Linker symbol: end of kernel text */
+extern char __text_end[];
+
+/**
+ * Find the text symbol an address falls in
+ */
+uint32_t ksym_index(uint64_t addr)
+{
+    uint32_t lo = 0, hi = (uint32_t)ksyms_count, mid;
+
+    if (hi == 0 || addr < ksyms_table[0].addr || addr >= (uint64_t)__text_end) {
+        return KSYM_NONE;
+    }
+
+    /* Last entry at or below addr */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (ksyms_table[mid].addr <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Name of a symbol
+ */
+const char *ksym_name(uint32_t index)
+{
+    if (index >= ksyms_count) {
+        return "?";
+    }
+    return &ksyms_names[ksyms_table[index].name];
+}
+
+/**
+ * Start address of a symbol
+ */
+uint64_t ksym_addr(uint32_t index)
+{
+    if (index >= ksyms_count) {
+        return 0;
+    }
+    return ksyms_table[index].addr;
+}
+
+/**
+ * Number of symbols in the table
+ */
+uint32_t ksym_count(void)
+{
+    return (uint32_t)ksyms_count;
+}
+
+/**
+ * Symbolize an address
+ */
+const char *ksym_lookup(uint64_t addr, uint64_t *offset)
+{
+    uint32_t index = ksym_index(addr);
+
+    if (index == KSYM_NONE) {
+        return NULL;
+    }
+    if (offset != NULL) {
+        *offset = addr - ksyms_table[index].addr;
+    }
+    return ksym_name(index);
+}
+
+/* ============================================================================
+ * End of ksyms.c
+ * ============================================================================ */
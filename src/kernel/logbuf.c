@@ -0,0 +1,246 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/logbuf.c
+ * Description: Per-CPU kernel log ring buffers
+ * ============================================================================ */
+
+#include <aeos/logbuf.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/string.h>
+
+/*
+ * Each CPU appends to its own ring with IRQs masked, so writers never
+ * share a lock or a cache line. A record is an 8-byte header and its
+ * text, padded to 8 bytes so headers never wrap. Positions only grow and
+ * are reduced modulo the ring size on access.
+ *
+ * When a ring is full the writer drops its oldest records: it publishes
+ * the new tail, then overwrites. A reader on another CPU copies a record
+ * out and re-reads the tail afterwards; if the tail has passed the record
+ * it was overwritten meanwhile and is skipped. The global sequence number
+ * orders records across CPUs for the replay.
+ */
+
+#define LOGBUF_MASK         (LOGBUF_CPU_SIZE - 1)
+#define LOGBUF_ALIGN(n)     (((n) + 7U) & ~7U)
+
+_Static_assert((LOGBUF_CPU_SIZE & LOGBUF_MASK) == 0,
+               "LOGBUF_CPU_SIZE must be a power of two");
+
+/* Record header */
+typedef struct {
+    uint32_t seq;
+    uint16_t len;                       /* Text bytes that follow */
+    uint8_t level;
+    uint8_t cpu;
+} log_hdr_t;
+
+_Static_assert(sizeof(log_hdr_t) == 8, "log header must stay 8 bytes");
+
+/* One CPU's ring */
+typedef struct {
+    char buf[LOGBUF_CPU_SIZE];
+    uint64_t head;                      /* End of the newest record */
+    uint64_t tail;                      /* Start of the oldest record */
+    uint32_t held;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t overwritten;
+} __attribute__((aligned(CACHE_LINE_SIZE))) log_cpu_t;
+
+static struct {
+    log_cpu_t cpus[MAX_CPUS];
+    uint32_t seq;
+} logbuf;
+
+/* ============================================================================
+ * Ring Access
+ * ============================================================================ */
+
+static void ring_copy_in(log_cpu_t *lc, uint64_t pos, const char *src, uint32_t len)
+{
+    uint32_t off = (uint32_t)(pos & LOGBUF_MASK);
+    uint32_t first = LOGBUF_CPU_SIZE - off;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(&lc->buf[off], src, first);
+    memcpy(&lc->buf[0], src + first, len - first);
+}
+
+static void ring_copy_out(const log_cpu_t *lc, uint64_t pos, char *dst, uint32_t len)
+{
+    uint32_t off = (uint32_t)(pos & LOGBUF_MASK);
+    uint32_t first = LOGBUF_CPU_SIZE - off;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, &lc->buf[off], first);
+    memcpy(dst + first, &lc->buf[0], len - first);
+}
+
+static inline log_hdr_t *ring_hdr(log_cpu_t *lc, uint64_t pos)
+{
+    return (log_hdr_t *)&lc->buf[pos & LOGBUF_MASK];
+}
+
+static inline uint32_t record_size(uint32_t len)
+{
+    return (uint32_t)sizeof(log_hdr_t) + LOGBUF_ALIGN(len);
+}
+
+/* ============================================================================
+ * Log Ring API
+ * ============================================================================ */
+
+/**
+ * Append a record to this CPU's ring
+ */
+void logbuf_append(uint8_t level, const char *text, uint32_t len)
+{
+    log_cpu_t *lc;
+    log_hdr_t *hdr;
+    uint64_t flags, head, tail;
+    uint32_t cpu, size;
+    bool dropped = false;
+
+    if (text == NULL || len == 0) {
+        return;
+    }
+    if (len > LOGBUF_RECORD_MAX) {
+        len = LOGBUF_RECORD_MAX;
+    }
+
+    flags = irq_save();
+    cpu = smp_processor_id();
+    lc = &logbuf.cpus[cpu];
+    size = record_size(len);
+    head = lc->head;
+    tail = lc->tail;
+
+    /* Make room: readers see the new tail before the old bytes change */
+    while (head + size - tail > LOGBUF_CPU_SIZE) {
+        tail += record_size(ring_hdr(lc, tail)->len);
+        lc->held--;
+        lc->overwritten++;
+        dropped = true;
+    }
+    if (dropped) {
+        __atomic_store_n(&lc->tail, tail, __ATOMIC_RELEASE);
+        __asm__ volatile("dmb ish" ::: "memory");
+    }
+
+    hdr = ring_hdr(lc, head);
+    hdr->seq = __atomic_add_fetch(&logbuf.seq, 1, __ATOMIC_ACQ_REL);
+    hdr->len = (uint16_t)len;
+    hdr->level = level;
+    hdr->cpu = (uint8_t)cpu;
+    ring_copy_in(lc, head + sizeof(log_hdr_t), text, len);
+
+    lc->held++;
+    lc->records++;
+    lc->bytes += len;
+    __atomic_store_n(&lc->head, head + size, __ATOMIC_RELEASE);
+
+    irq_restore(flags);
+}
+
+/**
+ * Replay held records in sequence order
+ */
+void logbuf_replay(logbuf_out_fn out)
+{
+    char text[LOGBUF_RECORD_MAX];
+    uint64_t pos[MAX_CPUS], end[MAX_CPUS];
+    log_hdr_t hdr[MAX_CPUS];
+    bool have[MAX_CPUS];
+    log_cpu_t *lc;
+    uint64_t tail;
+    uint32_t cpu, best;
+    bool found;
+
+    if (out == NULL) {
+        return;
+    }
+
+    /* Only what is there now: the replay's own output doesn't extend it */
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        lc = &logbuf.cpus[cpu];
+        end[cpu] = __atomic_load_n(&lc->head, __ATOMIC_ACQUIRE);
+        pos[cpu] = __atomic_load_n(&lc->tail, __ATOMIC_ACQUIRE);
+        have[cpu] = false;
+    }
+
+    for (;;) {
+        found = false;
+        best = 0;
+
+        for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+            lc = &logbuf.cpus[cpu];
+
+            /* Next header, unless the writer has lapped us */
+            while (!have[cpu] && pos[cpu] < end[cpu]) {
+                ring_copy_out(lc, pos[cpu], (char *)&hdr[cpu], sizeof(log_hdr_t));
+                __asm__ volatile("dmb ishld" ::: "memory");
+                tail = __atomic_load_n(&lc->tail, __ATOMIC_ACQUIRE);
+                if (tail > pos[cpu]) {
+                    pos[cpu] = tail;
+                    continue;
+                }
+                have[cpu] = true;
+            }
+
+            if (have[cpu] &&
+                (!found || (int32_t)(hdr[cpu].seq - hdr[best].seq) < 0)) {
+                best = cpu;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            break;
+        }
+
+        lc = &logbuf.cpus[best];
+        ring_copy_out(lc, pos[best] + sizeof(log_hdr_t), text, hdr[best].len);
+        __asm__ volatile("dmb ishld" ::: "memory");
+        tail = __atomic_load_n(&lc->tail, __ATOMIC_ACQUIRE);
+        have[best] = false;
+        if (tail > pos[best]) {
+            pos[best] = tail;       /* Overwritten while copying */
+            continue;
+        }
+        pos[best] += record_size(hdr[best].len);
+
+        out(text, hdr[best].len);
+    }
+}
+
+/**
+ * Get log ring statistics
+ */
+void logbuf_get_stats(logbuf_stats_t *stats)
+{
+    log_cpu_t *lc;
+    uint32_t cpu;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        lc = &logbuf.cpus[cpu];
+        stats->records += lc->records;
+        stats->bytes += lc->bytes;
+        stats->overwritten += lc->overwritten;
+        stats->held += lc->held;
+    }
+}
+
+/* ============================================================================
+ * End of logbuf.c
+ * ============================================================================ */
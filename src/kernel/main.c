@@ -13,8 +13,10 @@
 #include <aeos/interrupts.h>
 #include <aeos/gic.h>
 #include <aeos/timer.h>
+#include <aeos/pmu.h>
 #include <aeos/process.h>
 #include <aeos/scheduler.h>
+#include <aeos/workqueue.h>
 #include <aeos/syscall.h>
 #include <aeos/vfs.h>
 #include <aeos/ramfs.h>
@@ -22,13 +24,24 @@
 #include <aeos/string.h>
 #include <aeos/framebuffer.h>
 #include <aeos/dtb.h>
+#include <aeos/smp.h>
 #include <aeos/ramfb.h>
 #include <aeos/virtio_gpu.h>
 #include <aeos/pflash.h>
+#include <aeos/virtio_blk.h>
+#include <aeos/virtio_net.h>
+#include <aeos/net.h>
 #include <aeos/semihosting.h>
+#include <aeos/blkdev.h>
 #include <aeos/shell.h>
 #include <aeos/bootscreen.h>
 #include <aeos/gui.h>
+#include <aeos/bench.h>
+#include <aeos/boottime.h>
+#include <aeos/initrd.h>
+#include <aeos/dma.h>
+#include <aeos/shrinker.h>
+#include <aeos/memblock.h>
 
 /* External symbols from linker script */
 extern char _kernel_start;
@@ -40,6 +53,17 @@ extern char __stack_top;
 /* External symbols from vectors.asm */
 extern uint64_t exception_counters[16];
 
+/* Fast boot (boot option 'fastboot'): no self-tests or boot screen, and the
+ * filesystem and input devices come up in the background */
+static bool fast_boot = false;
+
+/* Worker processes started */
+static bool workqueue_up = false;
+
+/* User program images (user_images.asm) */
+extern const char user_hello_start[];
+extern const char user_hello_end[];
+
 /**
  * Print exception handler counters (for debugging syscalls)
  */
@@ -241,16 +265,24 @@ static void test_heap(void)
  */
 static bool init_graphics(void)
 {
+    uint32_t width, height;
+    bool gpu;
+
     klog_info("Initializing graphical display...");
 
+    /* Probe virtio-gpu first: the display's mode sizes the framebuffer */
+    gpu = virtio_gpu_init() == 0;
+    if (gpu && virtio_gpu_get_display_mode(&width, &height) == 0) {
+        fb_set_mode(width, height);
+    }
+
     /* Initialize framebuffer */
     if (fb_init() < 0) {
         klog_error("Failed to initialize framebuffer");
         return false;
     }
 
-    /* Try virtio-gpu */
-    if (virtio_gpu_init() == 0) {
+    if (gpu) {
         klog_info("VirtIO GPU driver initialized");
 
         /* Set up the display with our framebuffer */
@@ -264,6 +296,12 @@ static bool init_graphics(void)
         klog_warn("VirtIO GPU not available");
     }
 
+    /* QEMU's ramfb scans the framebuffer out of RAM, no updates needed */
+    if (ramfb_init() == 0 && ramfb_enable() == 0) {
+        klog_info("Display activated via ramfb");
+        return true;
+    }
+
     klog_info("Graphics rendered to memory only");
     return false;
 }
@@ -278,8 +316,10 @@ static void test_vfs(void)
 
     klog_info("Testing Virtual File System:");
 
-    /* Initialize semihosting for filesystem persistence */
-    semihost_init();
+    /* Block devices for filesystem persistence: flash and a disk (the host
+     * file registered with semihosting) */
+    pflash_init();
+    virtio_blk_init();
 
     /* Create ramfs */
     ramfs = ramfs_create();
@@ -288,22 +328,27 @@ static void test_vfs(void)
         return;
     }
 
-    /* Try to load saved filesystem from host via semihosting */
+    /* Try to load a saved filesystem from the block devices */
 #ifdef FS_NO_LOAD
     kprintf("  [INFO] Fresh filesystem mode (FS_NO_LOAD defined)\n");
     load_ret = -1;
 #else
-    kprintf("  Attempting to load filesystem from host...\n");
+    kprintf("  Attempting to load saved filesystem...\n");
     load_ret = fs_load_from_disk(ramfs);
 
     if (load_ret == 0) {
-        kprintf("  [OK] Loaded filesystem from host (aeos_fs.img)\n");
+        kprintf("  [OK] Loaded saved filesystem\n");
     } else {
-        kprintf("  [INFO] No saved filesystem on host, creating fresh filesystem\n");
+        kprintf("  [INFO] No saved filesystem, creating fresh filesystem\n");
         /* ramfs_create already created an empty root, so we're good */
     }
 #endif
 
+    /* A saved filesystem takes precedence over the initrd */
+    if (load_ret != 0 && initrd_attach(ramfs) == 0) {
+        kprintf("  [OK] Mounted initrd under ramfs\n");
+    }
+
     vfs_register_filesystem(ramfs);
     kprintf("  Registered ramfs\n");
 
@@ -317,6 +362,133 @@ static void test_vfs(void)
     klog_info("VFS initialized successfully!");
 }
 
+/**
+ * Copy the built-in user programs into /bin, unless already there
+ * Needs a current process for the file descriptors, so runs after the
+ * scheduler is up. A saved filesystem keeps whatever version it holds.
+ */
+static void install_user_programs(void)
+{
+    vfs_inode_t *inode;
+    size_t len = (size_t)(user_hello_end - user_hello_start);
+    int fd;
+
+    if (vfs_path_lookup("/bin/hello", &inode) == 0) {
+        return;
+    }
+    if (vfs_path_lookup("/bin", &inode) != 0 && vfs_mkdir("/bin", 0755) != 0) {
+        klog_warn("Cannot create /bin for user programs");
+        return;
+    }
+
+    fd = vfs_open("/bin/hello", O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        klog_warn("Cannot install /bin/hello");
+        return;
+    }
+    if (vfs_write(fd, user_hello_start, len) != (ssize_t)len) {
+        klog_warn("Short write installing /bin/hello");
+    }
+    vfs_close(fd);
+
+    kprintf("  Installed /bin/hello (%u bytes, 'run /bin/hello')\n", (uint32_t)len);
+}
+
+/**
+ * Check a command line for a word
+ */
+static bool cmdline_has(const char *p, const char *opt)
+{
+    size_t len = strlen(opt);
+
+    while (*p != '\0') {
+        while (*p == ' ') {
+            p++;
+        }
+        if (strncmp(p, opt, len) == 0 && (p[len] == '\0' || p[len] == ' ')) {
+            return true;
+        }
+        while (*p != '\0' && *p != ' ') {
+            p++;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check the command lines for a boot option
+ * Options come from the device tree's /chosen/bootargs (QEMU's -append) or
+ * the semihosting command line, whose first word names the program.
+ */
+static bool boot_option(const char *opt)
+{
+    const char *bootargs = dtb_get_bootargs();
+    char cmdline[128];
+    char *p;
+
+    if (bootargs != NULL && cmdline_has(bootargs, opt)) {
+        return true;
+    }
+
+    if (semihost_get_cmdline(cmdline, sizeof(cmdline)) != 0) {
+        return false;
+    }
+
+    p = cmdline;
+    while (*p != '\0' && *p != ' ') {
+        p++;
+    }
+    return cmdline_has(p, opt);
+}
+
+/**
+ * Background half of a fast boot: what the shell prompt doesn't need
+ * Commands wait for it (boottime_wait()), so none sees a missing root.
+ */
+static void deferred_boot_work(void)
+{
+    test_vfs();
+    boottime_mark("filesystem");
+
+    install_user_programs();
+    boottime_mark("user programs");
+
+    gui_init_input();
+    boottime_mark("input devices");
+
+    boottime_defer_end();
+    klog_info("Background boot work done");
+}
+
+/**
+ * Work item running the background half of a fast boot
+ */
+static void deferred_init(void *arg)
+{
+    (void)arg;
+    deferred_boot_work();
+}
+
+static work_t boot_work = WORK_INIT(deferred_init, NULL);
+
+/**
+ * Run the benchmark suite and stop QEMU ('make bench')
+ */
+static void run_boot_bench(void)
+{
+    int failed;
+
+    kprintf("\n");
+    klog_info("Running benchmarks (results in %s on the host)...", BENCH_RESULTS_FILE);
+    failed = bench_run_to_host(BENCH_RESULTS_FILE);
+    if (failed < 0) {
+        klog_error("Cannot write %s", BENCH_RESULTS_FILE);
+    } else if (failed > 0) {
+        klog_error("%d benchmarks failed", failed);
+    }
+    semihost_exit(failed == 0 ? 0 : 1);
+}
+
 /**
  * Read current exception level
  */
@@ -347,6 +519,8 @@ static void display_cpu_info(void *dtb_addr)
  */
 void kernel_main(void *dtb_addr)
 {
+    /* The counter runs from CPU start: this is time spent before C */
+    uint64_t entry_counter = timer_get_counter();
     bool graphical_mode = false;
     bool use_gui = false;
 
@@ -362,9 +536,29 @@ void kernel_main(void *dtb_addr)
     /* Display memory layout */
     display_memory_info();
 
+    /* The device tree gives the RAM and may name an initrd, which must be
+     * reserved before memblock hands out memory */
+    if ((uint64_t)dtb_addr >= PHYS_RAM_START && (uint64_t)dtb_addr < PHYS_RAM_LIMIT) {
+        dtb_init(dtb_addr);
+    }
+    memblock_init();
+    initrd_probe();
+
     /* Initialize memory management */
     kprintf("\n");
     mm_init();
+    boottime_mark_at("kernel entry", entry_counter);
+    boottime_mark("memory");
+
+    /* Boot options live in the device tree and the semihosting command line */
+    semihost_init();
+    fast_boot = boot_option("fastboot");
+    if (fast_boot) {
+        klog_info("Fast boot: filesystem and input devices load in the background");
+    }
+
+    /* Before any driver allocates DMA memory */
+    dma_init(boot_option("dma-noncoherent"));
 
     /* Initialize exception vector table */
     kprintf("\n");
@@ -380,29 +574,48 @@ void kernel_main(void *dtb_addr)
     /* Initialize timer */
     timer_init();
 
+    /* Cycle and event counters */
+    pmu_init();
+
     /* Enable interrupts and start timer */
     klog_info("Enabling IRQs...");
     interrupts_enable();
     timer_start();
     klog_info("Timer started - preemptive scheduling active");
 
+    /* Console output is interrupt-driven from here on */
+    uart_enable_irq();
+    boottime_mark("interrupts and timer");
+
     /* Test basic functionality */
-    kprintf("\n");
-    test_kprintf();
-    kprintf("\n");
-    test_pmm();
-    kprintf("\n");
-    test_heap();
+    if (!fast_boot) {
+        kprintf("\n");
+        test_kprintf();
+        kprintf("\n");
+        test_pmm();
+        kprintf("\n");
+        test_heap();
+        boottime_mark("self-tests");
+    }
 
-    /* Initialize Virtual File System */
+    /* Initialize Virtual File System (a fast boot mounts the root later) */
     kprintf("\n");
     klog_info("Initializing Virtual File System...");
     vfs_init();
-    test_vfs();
+    if (!fast_boot) {
+        test_vfs();
+        boottime_mark("filesystem");
+    }
 
     /* Initialize graphics */
     kprintf("\n");
     graphical_mode = init_graphics();
+    boottime_mark("graphics");
+
+    /* Networking, when QEMU has a virtio-net device ('make run-net') */
+    if (virtio_net_init() == 0 && net_init() == 0) {
+        boottime_mark("network");
+    }
 
     /* Initialize Process Management */
     kprintf("\n");
@@ -411,18 +624,51 @@ void kernel_main(void *dtb_addr)
     scheduler_init();
     klog_info("Process management initialized");
 
+    /* Bring up the secondary cores, each with its own ready queue */
+    kprintf("\n");
+    smp_init();
+    boottime_mark("processes and SMP");
+
+    /* Deferred work that may sleep runs in worker processes */
+    workqueue_up = workqueue_init() == 0;
+
+    /* Caches give memory back in the background below the low watermark */
+    reclaim_init();
+
+    /* Dirty filesystem blocks go out in the background from here on */
+    bcache_init();
+
     /* Initialize System Calls */
     kprintf("\n");
     klog_info("Initializing System Calls...");
     syscall_init();
+    if (fast_boot) {
+        /* A worker on another CPU can take it while this one brings up the shell */
+        boottime_defer_begin();
+        if (!workqueue_up) {
+            klog_error("Cannot start background boot work, doing it now");
+            deferred_boot_work();
+        } else {
+            queue_work(&boot_work);
+        }
+    } else {
+        install_user_programs();
+    }
 
     /* Initialize Shell */
     kprintf("\n");
     klog_info("Initializing Shell...");
     shell_init();
 
-    /* If graphics available, show boot screen and launch GUI */
-    if (graphical_mode) {
+    /* Headless benchmark run: report and stop before any UI starts */
+    if (boot_option("bench")) {
+        boottime_wait();
+        run_boot_bench();
+    }
+
+    /* If graphics available, show boot screen and launch GUI (a fast boot
+     * goes straight to the shell, 'startx' starts the desktop) */
+    if (graphical_mode && !fast_boot) {
         kprintf("\n");
         klog_info("Graphical mode available!");
 
@@ -470,6 +716,10 @@ void kernel_main(void *dtb_addr)
     klog_info("==================================================");
     kprintf("\n");
 
+    boottime_mark("shell");
+    klog_info("Shell up %u ms after CPU start ('boottime' shows the timeline)",
+              (uint32_t)(timer_get_counter() / (timer_get_frequency() / 1000)));
+
     /* Start the shell - this never returns */
     shell_run();
 
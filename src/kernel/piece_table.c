@@ -0,0 +1,810 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/piece_table.c
+ * Description: Piece table text storage
+ * ============================================================================ */
+
+#include <aeos/piece_table.h>
+#include <aeos/heap.h>
+#include <aeos/string.h>
+
+/*
+ * Pieces live in a treap ordered by document position. Every structural
+ * change is a split at an offset followed by merges, each O(log n) in the
+ * number of pieces. A range cut out stays a valid treap, so it can be kept
+ * aside and merged back whole, however many pieces it holds.
+ *
+ * A split that falls inside a piece cuts it in two, using a node reserved
+ * beforehand so a split itself never fails halfway.
+ *
+ * Each buffer keeps a sorted array of its newline offsets. Counting the
+ * newlines in a run, or finding the k-th one, is a binary search there,
+ * so no operation ever scans text.
+ */
+
+#define PT_ADD_INITIAL      4096
+#define PT_NEWLINES_INITIAL 256
+#define PT_SPANS_INITIAL    8
+
+struct pt_node {
+    pt_node_t *left;
+    pt_node_t *right;
+    uint32_t prio;
+    uint32_t start;                     /* Run in bufs[buf] */
+    uint32_t len;
+    uint32_t nl;                        /* Newlines in the run */
+    uint32_t sum_len;                   /* Bytes in this subtree */
+    uint32_t sum_nl;                    /* Newlines in this subtree */
+    uint32_t sum_cnt;                   /* Pieces in this subtree */
+    uint8_t buf;
+};
+
+/* Treap priorities; any spread-out sequence does */
+static uint32_t pt_seed = 0x9E3779B9;
+
+static uint32_t next_prio(void)
+{
+    pt_seed ^= pt_seed << 13;
+    pt_seed ^= pt_seed >> 17;
+    pt_seed ^= pt_seed << 5;
+    return pt_seed;
+}
+
+/* ============================================================================
+ * Buffers
+ * ============================================================================ */
+
+/**
+ * Index of the first newline at or after off
+ */
+static uint32_t nl_lower_bound(const pt_buffer_t *b, uint32_t off)
+{
+    uint32_t lo = 0, hi = b->num_newlines;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (b->newlines[mid] < off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint32_t count_newlines(const piece_table_t *pt, uint8_t buf,
+                               uint32_t start, uint32_t len)
+{
+    const pt_buffer_t *b = &pt->bufs[buf];
+
+    return nl_lower_bound(b, start + len) - nl_lower_bound(b, start);
+}
+
+static int buffer_reserve(pt_buffer_t *b, uint32_t len, uint32_t newlines)
+{
+    if (b->len + len > b->capacity) {
+        uint32_t cap = b->capacity ? b->capacity : PT_ADD_INITIAL;
+        char *data;
+
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        data = (char *)krealloc(b->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+        b->data = data;
+        b->capacity = cap;
+    }
+
+    if (b->num_newlines + newlines > b->newlines_capacity) {
+        uint32_t cap = b->newlines_capacity ? b->newlines_capacity : PT_NEWLINES_INITIAL;
+        uint32_t *nls;
+
+        while (cap < b->num_newlines + newlines) {
+            cap *= 2;
+        }
+        nls = (uint32_t *)krealloc(b->newlines, cap * sizeof(uint32_t));
+        if (nls == NULL) {
+            return -1;
+        }
+        b->newlines = nls;
+        b->newlines_capacity = cap;
+    }
+    return 0;
+}
+
+/**
+ * Append text to the add buffer
+ * @return Offset of the text in the buffer, or -1
+ */
+static int64_t buffer_append(pt_buffer_t *b, const char *text, uint32_t len)
+{
+    uint32_t start = b->len;
+    uint32_t newlines = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (text[i] == '\n') {
+            newlines++;
+        }
+    }
+    if (buffer_reserve(b, len, newlines) < 0) {
+        return -1;
+    }
+
+    memcpy(&b->data[start], text, len);
+    for (uint32_t i = 0; i < len; i++) {
+        if (text[i] == '\n') {
+            b->newlines[b->num_newlines++] = start + i;
+        }
+    }
+    b->len += len;
+    return start;
+}
+
+static void buffer_free(pt_buffer_t *b)
+{
+    if (b->data != NULL) {
+        kfree(b->data);
+    }
+    if (b->newlines != NULL) {
+        kfree(b->newlines);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+/* ============================================================================
+ * Tree
+ * ============================================================================ */
+
+static inline uint32_t tree_len(const pt_node_t *t)
+{
+    return t ? t->sum_len : 0;
+}
+
+static inline uint32_t tree_nl(const pt_node_t *t)
+{
+    return t ? t->sum_nl : 0;
+}
+
+static inline uint32_t tree_cnt(const pt_node_t *t)
+{
+    return t ? t->sum_cnt : 0;
+}
+
+static inline void node_update(pt_node_t *t)
+{
+    t->sum_len = tree_len(t->left) + t->len + tree_len(t->right);
+    t->sum_nl = tree_nl(t->left) + t->nl + tree_nl(t->right);
+    t->sum_cnt = tree_cnt(t->left) + 1 + tree_cnt(t->right);
+}
+
+static pt_node_t *node_alloc(void)
+{
+    pt_node_t *n = (pt_node_t *)kmalloc(sizeof(pt_node_t));
+
+    if (n != NULL) {
+        memset(n, 0, sizeof(*n));
+        n->prio = next_prio();
+    }
+    return n;
+}
+
+static void node_set(piece_table_t *pt, pt_node_t *n, uint8_t buf,
+                     uint32_t start, uint32_t len)
+{
+    n->buf = buf;
+    n->start = start;
+    n->len = len;
+    n->nl = count_newlines(pt, buf, start, len);
+    node_update(n);
+}
+
+static void tree_free(pt_node_t *t)
+{
+    while (t != NULL) {
+        pt_node_t *right = t->right;
+
+        tree_free(t->left);
+        kfree(t);
+        t = right;
+    }
+}
+
+static pt_node_t *tree_merge(pt_node_t *a, pt_node_t *b)
+{
+    if (a == NULL) {
+        return b;
+    }
+    if (b == NULL) {
+        return a;
+    }
+
+    if (a->prio > b->prio) {
+        a->right = tree_merge(a->right, b);
+        node_update(a);
+        return a;
+    }
+    b->left = tree_merge(a, b->left);
+    node_update(b);
+    return b;
+}
+
+/**
+ * Reserve the nodes that splits inside a piece consume
+ */
+static int spares_fill(piece_table_t *pt)
+{
+    for (int i = 0; i < 2; i++) {
+        if (pt->spare[i] == NULL) {
+            pt->spare[i] = node_alloc();
+            if (pt->spare[i] == NULL) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static pt_node_t *spare_take(piece_table_t *pt)
+{
+    pt_node_t *n = pt->spare[0] ? pt->spare[0] : pt->spare[1];
+
+    if (n == pt->spare[0]) {
+        pt->spare[0] = NULL;
+    } else {
+        pt->spare[1] = NULL;
+    }
+    n->left = n->right = NULL;
+    n->prio = next_prio();
+    return n;
+}
+
+/**
+ * Split t into the bytes before pos and those from pos on
+ */
+static void tree_split(piece_table_t *pt, pt_node_t *t, uint32_t pos,
+                       pt_node_t **l, pt_node_t **r)
+{
+    uint32_t left_len, off;
+    pt_node_t *tail;
+
+    if (t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+
+    left_len = tree_len(t->left);
+    if (pos <= left_len) {
+        tree_split(pt, t->left, pos, l, &t->left);
+        node_update(t);
+        *r = t;
+        return;
+    }
+    if (pos >= left_len + t->len) {
+        tree_split(pt, t->right, pos - left_len - t->len, &t->right, r);
+        node_update(t);
+        *l = t;
+        return;
+    }
+
+    /* Cut this piece: the head stays, the tail leads the right side */
+    off = pos - left_len;
+    tail = spare_take(pt);
+    node_set(pt, tail, t->buf, t->start + off, t->len - off);
+    *r = tree_merge(tail, t->right);
+    t->right = NULL;
+    node_set(pt, t, t->buf, t->start, off);
+    *l = t;
+}
+
+/**
+ * Extend the last piece of t by len bytes of the same buffer
+ */
+static void tree_grow_last(piece_table_t *pt, pt_node_t *t, uint32_t len)
+{
+    if (t->right != NULL) {
+        tree_grow_last(pt, t->right, len);
+        node_update(t);
+        return;
+    }
+    node_set(pt, t, t->buf, t->start, t->len + len);
+}
+
+static const pt_node_t *tree_last(const pt_node_t *t)
+{
+    while (t != NULL && t->right != NULL) {
+        t = t->right;
+    }
+    return t;
+}
+
+/* Runs visited by tree_walk */
+typedef int (*pt_run_fn)(void *ctx, uint8_t buf, uint32_t start, uint32_t len);
+
+/**
+ * Visit the runs of t that overlap [lo, hi), in order; base is t's offset
+ */
+static int tree_walk(const pt_node_t *t, uint32_t base, uint32_t lo, uint32_t hi,
+                     pt_run_fn fn, void *ctx)
+{
+    while (t != NULL && lo < hi && lo < base + t->sum_len && hi > base) {
+        uint32_t node_start = base + tree_len(t->left);
+        uint32_t node_end = node_start + t->len;
+        int rc;
+
+        if (lo < node_start) {
+            rc = tree_walk(t->left, base, lo, hi, fn, ctx);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        if (lo < node_end && hi > node_start && t->len > 0) {
+            uint32_t a = lo > node_start ? lo : node_start;
+            uint32_t b = hi < node_end ? hi : node_end;
+
+            rc = fn(ctx, t->buf, t->start + (a - node_start), b - a);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+        if (hi <= node_end) {
+            break;
+        }
+        base = node_end;
+        t = t->right;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Span Lists
+ * ============================================================================ */
+
+static int spans_append(pt_span_list_t *list, uint8_t buf, uint32_t start, uint32_t len)
+{
+    if (list->count > 0) {
+        pt_span_t *last = &list->spans[list->count - 1];
+
+        /* Adjacent runs of one buffer coalesce */
+        if (last->buf == buf && last->start + last->len == start) {
+            last->len += len;
+            list->len += len;
+            return 0;
+        }
+    }
+
+    if (list->count == list->capacity) {
+        uint32_t cap = list->capacity ? list->capacity * 2 : PT_SPANS_INITIAL;
+        pt_span_t *spans = (pt_span_t *)krealloc(list->spans, cap * sizeof(pt_span_t));
+
+        if (spans == NULL) {
+            return -1;
+        }
+        list->spans = spans;
+        list->capacity = cap;
+    }
+
+    list->spans[list->count].buf = buf;
+    list->spans[list->count].start = start;
+    list->spans[list->count].len = len;
+    list->count++;
+    list->len += len;
+    return 0;
+}
+
+static int collect_run(void *ctx, uint8_t buf, uint32_t start, uint32_t len)
+{
+    return spans_append((pt_span_list_t *)ctx, buf, start, len);
+}
+
+/**
+ * Empty a span list
+ */
+void pt_spans_clear(pt_span_list_t *list)
+{
+    list->count = 0;
+    list->len = 0;
+}
+
+/**
+ * Free a span list
+ */
+void pt_spans_free(pt_span_list_t *list)
+{
+    if (list->spans != NULL) {
+        kfree(list->spans);
+    }
+    memset(list, 0, sizeof(*list));
+}
+
+/* ============================================================================
+ * Piece Table API
+ * ============================================================================ */
+
+/**
+ * Initialize an empty table
+ */
+int pt_init(piece_table_t *pt)
+{
+    memset(pt, 0, sizeof(*pt));
+    return spares_fill(pt);
+}
+
+/**
+ * Replace the document with loaded text
+ */
+int pt_load(piece_table_t *pt, char *data, uint32_t len)
+{
+    pt_buffer_t *orig = &pt->bufs[PT_BUF_ORIG];
+    pt_node_t *n;
+    uint32_t newlines = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (data[i] == '\n') {
+            newlines++;
+        }
+    }
+
+    n = node_alloc();
+    if (n == NULL) {
+        kfree(data);
+        return -1;
+    }
+
+    buffer_free(orig);
+    if (newlines > 0) {
+        orig->newlines = (uint32_t *)kmalloc(newlines * sizeof(uint32_t));
+        if (orig->newlines == NULL) {
+            kfree(n);
+            kfree(data);
+            return -1;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            if (data[i] == '\n') {
+                orig->newlines[orig->num_newlines++] = i;
+            }
+        }
+    }
+    orig->data = data;
+    orig->len = len;
+    orig->capacity = len;
+    orig->newlines_capacity = newlines;
+
+    tree_free(pt->root);
+    pt->root = NULL;
+    if (len > 0) {
+        node_set(pt, n, PT_BUF_ORIG, 0, len);
+        pt->root = n;
+    } else {
+        kfree(n);
+    }
+    return 0;
+}
+
+/**
+ * Free everything
+ */
+void pt_destroy(piece_table_t *pt)
+{
+    tree_free(pt->root);
+    for (int i = 0; i < 2; i++) {
+        if (pt->spare[i] != NULL) {
+            kfree(pt->spare[i]);
+        }
+    }
+    for (int i = 0; i < PT_NUM_BUFS; i++) {
+        buffer_free(&pt->bufs[i]);
+    }
+    memset(pt, 0, sizeof(*pt));
+}
+
+uint32_t pt_length(const piece_table_t *pt)
+{
+    return tree_len(pt->root);
+}
+
+uint32_t pt_line_count(const piece_table_t *pt)
+{
+    return tree_nl(pt->root) + 1;
+}
+
+uint32_t pt_piece_count(const piece_table_t *pt)
+{
+    return tree_cnt(pt->root);
+}
+
+/**
+ * Line holding an offset: the newlines before it
+ */
+uint32_t pt_line_of(const piece_table_t *pt, uint32_t pos)
+{
+    const pt_node_t *t = pt->root;
+    uint32_t line = 0;
+
+    while (t != NULL) {
+        uint32_t left_len = tree_len(t->left);
+
+        if (pos <= left_len) {
+            t = t->left;
+            continue;
+        }
+        pos -= left_len;
+        line += tree_nl(t->left);
+
+        if (pos <= t->len) {
+            return line + count_newlines(pt, t->buf, t->start, pos);
+        }
+        pos -= t->len;
+        line += t->nl;
+        t = t->right;
+    }
+    return line;
+}
+
+/**
+ * Offset just past the line-th newline
+ */
+uint32_t pt_line_start(const piece_table_t *pt, uint32_t line)
+{
+    const pt_node_t *t = pt->root;
+    uint32_t k = line;
+    uint32_t base = 0;
+
+    if (line == 0) {
+        return 0;
+    }
+    if (line > tree_nl(t)) {
+        return tree_len(t);
+    }
+
+    while (t != NULL) {
+        uint32_t left_nl = tree_nl(t->left);
+
+        if (k <= left_nl) {
+            t = t->left;
+            continue;
+        }
+        k -= left_nl;
+        base += tree_len(t->left);
+
+        if (k <= t->nl) {
+            const pt_buffer_t *b = &pt->bufs[t->buf];
+            uint32_t nl = b->newlines[nl_lower_bound(b, t->start) + k - 1];
+
+            return base + (nl - t->start) + 1;
+        }
+        k -= t->nl;
+        base += t->len;
+        t = t->right;
+    }
+    return tree_len(pt->root);
+}
+
+uint32_t pt_line_length(const piece_table_t *pt, uint32_t line)
+{
+    uint32_t start = pt_line_start(pt, line);
+    uint32_t end;
+
+    if (line + 1 < pt_line_count(pt)) {
+        end = pt_line_start(pt, line + 1) - 1;
+    } else {
+        end = pt_length(pt);
+    }
+    return end - start;
+}
+
+/**
+ * Insert text
+ * Typing appends to the add buffer right after the previous insert, so the
+ * piece before the cursor usually just grows.
+ */
+int pt_insert(piece_table_t *pt, uint32_t pos, const char *text, uint32_t len)
+{
+    pt_buffer_t *add = &pt->bufs[PT_BUF_ADD];
+    pt_node_t *l, *r, *n = NULL;
+    const pt_node_t *last;
+    int64_t start;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (pos > pt_length(pt) || spares_fill(pt) < 0) {
+        return -1;
+    }
+
+    n = node_alloc();
+    if (n == NULL) {
+        return -1;
+    }
+    start = buffer_append(add, text, len);
+    if (start < 0) {
+        kfree(n);
+        return -1;
+    }
+
+    tree_split(pt, pt->root, pos, &l, &r);
+    last = tree_last(l);
+    if (last != NULL && last->buf == PT_BUF_ADD &&
+        last->start + last->len == (uint32_t)start) {
+        tree_grow_last(pt, l, len);
+        kfree(n);
+    } else {
+        node_set(pt, n, PT_BUF_ADD, (uint32_t)start, len);
+        l = tree_merge(l, n);
+    }
+    pt->root = tree_merge(l, r);
+    return 0;
+}
+
+/**
+ * Insert copied runs
+ */
+int pt_insert_spans(piece_table_t *pt, uint32_t pos, const pt_span_list_t *list)
+{
+    pt_node_t *l, *r, *chain = NULL, *n;
+
+    if (list->count == 0) {
+        return 0;
+    }
+    if (pos > pt_length(pt) || spares_fill(pt) < 0) {
+        return -1;
+    }
+
+    /* Allocate every node first so nothing can fail once the tree is split */
+    for (uint32_t i = 0; i < list->count; i++) {
+        n = node_alloc();
+        if (n == NULL) {
+            tree_free(chain);
+            return -1;
+        }
+        n->right = chain;
+        chain = n;
+    }
+
+    tree_split(pt, pt->root, pos, &l, &r);
+    for (uint32_t i = 0; i < list->count; i++) {
+        const pt_span_t *s = &list->spans[i];
+
+        n = chain;
+        chain = chain->right;
+        n->right = NULL;
+        node_set(pt, n, s->buf, s->start, s->len);
+        l = tree_merge(l, n);
+    }
+    pt->root = tree_merge(l, r);
+    return 0;
+}
+
+/**
+ * Delete a range
+ */
+int pt_delete(piece_table_t *pt, uint32_t pos, uint32_t len, pt_span_list_t *removed)
+{
+    pt_node_t *m;
+
+    if (pt_cut(pt, pos, len, &m) < 0) {
+        return -1;
+    }
+
+    if (removed != NULL && tree_walk(m, 0, 0, len, collect_run, removed) != 0) {
+        /* Put it back; the cut pieces simply stay cut */
+        pt_paste(pt, pos, m);
+        return -1;
+    }
+
+    tree_free(m);
+    return 0;
+}
+
+/**
+ * Detach a range as a tree of its own
+ */
+int pt_cut(piece_table_t *pt, uint32_t pos, uint32_t len, pt_node_t **out)
+{
+    pt_node_t *l, *m, *r;
+
+    *out = NULL;
+    if (len == 0) {
+        return 0;
+    }
+    if (pos + len > pt_length(pt) || pos + len < pos || spares_fill(pt) < 0) {
+        return -1;
+    }
+
+    tree_split(pt, pt->root, pos, &l, &r);
+    tree_split(pt, r, len, &m, &r);
+    pt->root = tree_merge(l, r);
+    *out = m;
+    return 0;
+}
+
+/**
+ * Reattach a detached tree at an offset
+ */
+int pt_paste(piece_table_t *pt, uint32_t pos, pt_node_t *pieces)
+{
+    pt_node_t *l, *r;
+
+    if (pieces == NULL) {
+        return 0;
+    }
+    if (pos > pt_length(pt) || spares_fill(pt) < 0) {
+        return -1;
+    }
+
+    tree_split(pt, pt->root, pos, &l, &r);
+    pt->root = tree_merge(tree_merge(l, pieces), r);
+    return 0;
+}
+
+/**
+ * Free a detached tree
+ */
+void pt_free_pieces(pt_node_t *pieces)
+{
+    tree_free(pieces);
+}
+
+/**
+ * Copy the runs covering a range
+ */
+int pt_copy_spans(const piece_table_t *pt, uint32_t pos, uint32_t len,
+                  pt_span_list_t *out)
+{
+    return tree_walk(pt->root, 0, pos, pos + len, collect_run, out);
+}
+
+typedef struct {
+    const piece_table_t *pt;
+    char *dst;
+    uint32_t copied;
+} pt_read_ctx_t;
+
+static int read_run(void *ctx, uint8_t buf, uint32_t start, uint32_t len)
+{
+    pt_read_ctx_t *rc = (pt_read_ctx_t *)ctx;
+
+    memcpy(rc->dst + rc->copied, &rc->pt->bufs[buf].data[start], len);
+    rc->copied += len;
+    return 0;
+}
+
+/**
+ * Copy a range out as text
+ */
+uint32_t pt_read(const piece_table_t *pt, uint32_t pos, char *dst, uint32_t len)
+{
+    pt_read_ctx_t rc = { pt, dst, 0 };
+
+    tree_walk(pt->root, 0, pos, pos + len, read_run, &rc);
+    return rc.copied;
+}
+
+typedef struct {
+    const piece_table_t *pt;
+    pt_text_fn fn;
+    void *ctx;
+} pt_each_ctx_t;
+
+static int each_run(void *ctx, uint8_t buf, uint32_t start, uint32_t len)
+{
+    pt_each_ctx_t *ec = (pt_each_ctx_t *)ctx;
+
+    return ec->fn(ec->ctx, &ec->pt->bufs[buf].data[start], len);
+}
+
+/**
+ * Visit the document in order
+ */
+int pt_for_each(const piece_table_t *pt, pt_text_fn fn, void *ctx)
+{
+    pt_each_ctx_t ec = { pt, fn, ctx };
+
+    return tree_walk(pt->root, 0, 0, pt_length(pt), each_run, &ec);
+}
+
+/* ============================================================================
+ * End of piece_table.c
+ * ============================================================================ */
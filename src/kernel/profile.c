@@ -0,0 +1,412 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/profile.c
+ * Description: Sampling profiler driven by the timer interrupt
+ * ============================================================================ */
+
+#include <aeos/profile.h>
+#include <aeos/ksyms.h>
+#include <aeos/semihosting.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/timer.h>
+#include <aeos/heap.h>
+#include <aeos/mm.h>
+#include <aeos/memblock.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * Every timer interrupt on a CPU records the interrupted PC and the return
+ * addresses found by walking the x29 frame records (the kernel is built
+ * with -fno-omit-frame-pointer). Each CPU appends to its own buffer from
+ * interrupt context, publishing the new count with a store-release, so a
+ * report can run while sampling continues. A full buffer drops samples
+ * rather than overwriting them.
+ *
+ * A start bumps the epoch; each CPU empties its own buffer the next time
+ * it samples and sees the new epoch. Until then the report skips it.
+ */
+
+/* Folded lines are written to the host in chunks of this size */
+#define PROF_DUMP_CHUNK     4096
+
+/* Report slots after the symbol table's own */
+#define PROF_SLOT_USER      0
+#define PROF_SLOT_UNKNOWN   1
+#define PROF_EXTRA_SLOTS    2
+
+typedef struct {
+    prof_sample_t *buf;
+    uint64_t held;
+    uint64_t user;
+    uint64_t dropped;
+    uint32_t epoch;
+} __attribute__((aligned(CACHE_LINE_SIZE))) prof_cpu_t;
+
+static struct {
+    prof_cpu_t cpus[MAX_CPUS];
+    spinlock_t lock;                    /* Serializes start/stop */
+    uint32_t running;
+    uint32_t epoch;
+    uint64_t start_ns;
+    uint64_t stop_ns;
+} prof = {
+    .lock = SPINLOCK_INIT,
+};
+
+/* Linker symbols bounding kernel code */
+extern char _kernel_start[];
+extern char __text_end[];
+
+/* ============================================================================
+ * Sampling
+ * ============================================================================ */
+
+static inline bool is_kernel_text(uint64_t addr)
+{
+    return addr >= (uint64_t)_kernel_start && addr < (uint64_t)__text_end;
+}
+
+/**
+ * Walk the frame records from the interrupted context
+ * Each record is {caller's x29, return address}. The walk stops at the
+ * first record outside RAM, one that doesn't move up the stack, or a return
+ * address outside kernel text.
+ */
+static uint8_t walk_stack(const cpu_context_t *context, uint64_t *pcs)
+{
+    const uint64_t *frame;
+    uint64_t fp = context->x[29];
+    uint64_t prev = 0, lr;
+    uint8_t depth = 0;
+
+    pcs[depth++] = context->pc;
+
+    while (depth < PROF_MAX_DEPTH) {
+        if ((fp & 7) != 0 || fp < memblock_start() || fp > memblock_end() - 16 ||
+            fp <= prev) {
+            break;
+        }
+
+        frame = (const uint64_t *)fp;
+        lr = frame[1];
+        if (!is_kernel_text(lr)) {
+            break;
+        }
+
+        /* The call instruction, so the caller gets the sample */
+        pcs[depth++] = lr - 4;
+        prev = fp;
+        fp = frame[0];
+    }
+    return depth;
+}
+
+/**
+ * Record the interrupted context
+ */
+void profile_sample(const cpu_context_t *context, bool user)
+{
+    prof_cpu_t *pc;
+    prof_sample_t *s;
+    uint32_t epoch;
+    uint64_t held;
+
+    if (!__atomic_load_n(&prof.running, __ATOMIC_ACQUIRE) || context == NULL) {
+        return;
+    }
+
+    pc = &prof.cpus[smp_processor_id()];
+
+    /* First sample since a start: empty this CPU's buffer */
+    epoch = __atomic_load_n(&prof.epoch, __ATOMIC_ACQUIRE);
+    if (pc->epoch != epoch) {
+        __atomic_store_n(&pc->held, 0, __ATOMIC_RELEASE);
+        pc->user = 0;
+        pc->dropped = 0;
+        __atomic_store_n(&pc->epoch, epoch, __ATOMIC_RELEASE);
+    }
+
+    held = pc->held;
+    if (held >= PROF_MAX_SAMPLES) {
+        pc->dropped++;
+        return;
+    }
+
+    s = &pc->buf[held];
+    if (user) {
+        s->pc[0] = context->pc;
+        s->depth = 1;
+        s->user = 1;
+        pc->user++;
+    } else {
+        s->depth = walk_stack(context, s->pc);
+        s->user = 0;
+    }
+    __atomic_store_n(&pc->held, held + 1, __ATOMIC_RELEASE);
+}
+
+/* ============================================================================
+ * Control
+ * ============================================================================ */
+
+/**
+ * Discard earlier samples and start sampling
+ */
+int profile_start(void)
+{
+    uint64_t flags;
+    uint32_t cpu;
+
+    flags = spin_lock_irqsave(&prof.lock);
+
+    /* Allocated once and never freed: interrupt handlers may hold them */
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (prof.cpus[cpu].buf == NULL) {
+            prof.cpus[cpu].buf = (prof_sample_t *)kmalloc(
+                PROF_MAX_SAMPLES * sizeof(prof_sample_t));
+            if (prof.cpus[cpu].buf == NULL) {
+                spin_unlock_irqrestore(&prof.lock, flags);
+                klog_error("profile: Failed to allocate sample buffers");
+                return -1;
+            }
+        }
+    }
+
+    __atomic_store_n(&prof.epoch, prof.epoch + 1, __ATOMIC_RELEASE);
+    prof.start_ns = timer_get_ns();
+    prof.stop_ns = 0;
+    __atomic_store_n(&prof.running, 1, __ATOMIC_RELEASE);
+
+    spin_unlock_irqrestore(&prof.lock, flags);
+    return 0;
+}
+
+/**
+ * Stop sampling
+ */
+void profile_stop(void)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&prof.lock);
+    if (prof.running) {
+        __atomic_store_n(&prof.running, 0, __ATOMIC_RELEASE);
+        prof.stop_ns = timer_get_ns();
+    }
+    spin_unlock_irqrestore(&prof.lock, flags);
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================ */
+
+/**
+ * Samples a CPU holds for the current epoch (0 if it hasn't sampled yet)
+ */
+static uint64_t cpu_held(const prof_cpu_t *pc)
+{
+    if (pc->buf == NULL || __atomic_load_n(&pc->epoch, __ATOMIC_ACQUIRE) !=
+                           __atomic_load_n(&prof.epoch, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return __atomic_load_n(&pc->held, __ATOMIC_ACQUIRE);
+}
+
+static const char *slot_name(uint32_t slot, uint32_t nsyms)
+{
+    if (slot == nsyms + PROF_SLOT_USER) {
+        return "[user]";
+    }
+    if (slot == nsyms + PROF_SLOT_UNKNOWN) {
+        return "[unknown]";
+    }
+    return ksym_name(slot);
+}
+
+/**
+ * Report the functions with the most samples
+ */
+int profile_report(uint32_t top, prof_report_fn fn, void *ctx)
+{
+    const prof_sample_t *s;
+    const prof_cpu_t *pc;
+    uint32_t *counts;
+    uint32_t nsyms, nslots, slot, best, index, reported;
+    uint64_t held, i;
+    uint32_t cpu;
+
+    if (fn == NULL) {
+        return -1;
+    }
+
+    nsyms = ksym_count();
+    nslots = nsyms + PROF_EXTRA_SLOTS;
+    counts = (uint32_t *)kmalloc(nslots * sizeof(uint32_t));
+    if (counts == NULL) {
+        return -1;
+    }
+    memset(counts, 0, nslots * sizeof(uint32_t));
+
+    /* Self samples: the function that was interrupted */
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pc = &prof.cpus[cpu];
+        held = cpu_held(pc);
+        for (i = 0; i < held; i++) {
+            s = &pc->buf[i];
+            if (s->user) {
+                slot = nsyms + PROF_SLOT_USER;
+            } else {
+                index = ksym_index(s->pc[0]);
+                slot = index == KSYM_NONE ? nsyms + PROF_SLOT_UNKNOWN : index;
+            }
+            counts[slot]++;
+        }
+    }
+
+    /* Few slots are wanted, so repeated selection beats sorting them all */
+    for (reported = 0; reported < top; reported++) {
+        best = 0;
+        for (slot = 1; slot < nslots; slot++) {
+            if (counts[slot] > counts[best]) {
+                best = slot;
+            }
+        }
+        if (counts[best] == 0) {
+            break;
+        }
+        fn(slot_name(best, nsyms), counts[best], ctx);
+        counts[best] = 0;
+    }
+
+    kfree(counts);
+    return (int)reported;
+}
+
+/* Output buffer for the folded dump */
+typedef struct {
+    int fd;
+    size_t len;
+    bool failed;
+    char buf[PROF_DUMP_CHUNK];
+} fold_out_t;
+
+static void fold_flush(fold_out_t *out)
+{
+    if (out->len != 0 && !out->failed &&
+        semihost_write(out->fd, out->buf, out->len) != 0) {
+        out->failed = true;
+    }
+    out->len = 0;
+}
+
+static void fold_put(fold_out_t *out, const char *str)
+{
+    size_t n = strlen(str);
+
+    if (out->len + n > sizeof(out->buf)) {
+        fold_flush(out);
+    }
+    if (n > sizeof(out->buf)) {
+        n = sizeof(out->buf);
+    }
+    memcpy(&out->buf[out->len], str, n);
+    out->len += n;
+}
+
+/**
+ * Write the samples as folded stacks to a host file
+ */
+int profile_dump_folded(const char *path)
+{
+    const prof_sample_t *s;
+    const prof_cpu_t *pc;
+    fold_out_t *out;
+    uint64_t held, i;
+    uint32_t cpu, index;
+    int written = 0;
+    int d;
+
+    if (path == NULL || !semihost_available()) {
+        return -1;
+    }
+
+    out = (fold_out_t *)kmalloc(sizeof(fold_out_t));
+    if (out == NULL) {
+        return -1;
+    }
+
+    out->fd = semihost_open(path, SEMIHOST_OPEN_W);
+    if (out->fd < 0) {
+        kfree(out);
+        return -1;
+    }
+    out->len = 0;
+    out->failed = false;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pc = &prof.cpus[cpu];
+        held = cpu_held(pc);
+        for (i = 0; i < held; i++) {
+            s = &pc->buf[i];
+            if (s->user) {
+                fold_put(out, "[user] 1\n");
+                written++;
+                continue;
+            }
+
+            /* Outermost caller first */
+            for (d = s->depth - 1; d >= 0; d--) {
+                index = ksym_index(s->pc[d]);
+                fold_put(out, index == KSYM_NONE ? "[unknown]" : ksym_name(index));
+                fold_put(out, d > 0 ? ";" : " 1\n");
+            }
+            written++;
+        }
+    }
+
+    fold_flush(out);
+    semihost_close(out->fd);
+    if (out->failed) {
+        written = -1;
+    }
+    kfree(out);
+    return written;
+}
+
+/**
+ * Get profiler statistics
+ */
+void profile_get_stats(prof_stats_t *stats)
+{
+    const prof_cpu_t *pc;
+    uint64_t held;
+    uint32_t cpu;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->running = __atomic_load_n(&prof.running, __ATOMIC_ACQUIRE) != 0;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pc = &prof.cpus[cpu];
+        held = cpu_held(pc);
+        if (held == 0) {
+            continue;
+        }
+        stats->samples += held;
+        stats->user += pc->user;
+        stats->dropped += pc->dropped;
+    }
+
+    if (prof.start_ns != 0) {
+        stats->elapsed_ns = (stats->running ? timer_get_ns() : prof.stop_ns) -
+                            prof.start_ns;
+    }
+}
+
+/* ============================================================================
+ * End of profile.c
+ * ============================================================================ */
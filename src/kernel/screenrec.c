@@ -0,0 +1,505 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/screenrec.c
+ * Description: Screen recording to a host file
+ * ============================================================================ */
+
+#include <aeos/screenrec.h>
+#include <aeos/framebuffer.h>
+#include <aeos/semihosting.h>
+#include <aeos/workqueue.h>
+#include <aeos/mutex.h>
+#include <aeos/timer.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * head and tail count bytes committed and written since the start, as in
+ * a pipe: the compositor encodes a frame past head and publishes it when
+ * the whole frame fits, the worker writes out up to head and moves tail.
+ * The previous frame is a full-screen copy of what the stream has
+ * described so far, updated only for frames that were committed, so a
+ * dropped frame's rects compare against the same pixels next time.
+ */
+
+/* Ring sizes: room for a frame of 4 bytes a pixel, within one huge buffer */
+#define SCREENREC_RING_MIN  (256 * 1024)
+#define SCREENREC_RING_MAX  ((size_t)PAGE_SIZE << PMM_MAX_ORDER)
+
+/* Frame header: u64 time, u32 rect count, u32 bytes */
+#define SCREENREC_FRAME_HDR 16
+
+static void screenrec_flush(void *arg);
+
+static struct {
+    mutex_t lock;                       /* Start, stop and frames */
+    volatile bool active;
+    int fd;
+
+    uint8_t *ring;
+    size_t size;                        /* Power of two */
+    uint64_t head;                      /* Committed by screenrec_frame() */
+    uint64_t tail;                      /* Written by the worker */
+    work_t work;
+
+    uint32_t *prev;                     /* The frame the stream is at */
+    size_t prev_size;
+    uint32_t width;
+    uint32_t height;
+    uint64_t start_ns;
+    bool keyframe;                      /* Next frame is the whole screen */
+    bool missed;                        /* Rects of dropped frames are owed */
+    rect_t missed_rect;
+
+    screenrec_stats_t stats;
+} rec = {
+    .lock = MUTEX_INIT,
+    .fd = -1,
+};
+
+/* Encoder position in the ring */
+typedef struct {
+    uint64_t pos;
+    uint64_t limit;                     /* tail + size */
+    bool full;
+} enc_t;
+
+/* ============================================================================
+ * Encoding
+ * ============================================================================ */
+
+static inline void put8(enc_t *e, uint8_t v)
+{
+    if (e->pos >= e->limit) {
+        e->full = true;
+        return;
+    }
+    rec.ring[e->pos & (rec.size - 1)] = v;
+    e->pos++;
+}
+
+static void put_le(enc_t *e, uint64_t v, uint32_t bytes)
+{
+    while (bytes-- > 0) {
+        put8(e, (uint8_t)v);
+        v >>= 8;
+    }
+}
+
+/* Overwrite bytes already encoded (a placeholder) */
+static void patch_le(uint64_t pos, uint64_t v, uint32_t bytes)
+{
+    while (bytes-- > 0) {
+        rec.ring[pos++ & (rec.size - 1)] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static inline void put_rgb(enc_t *e, uint32_t pixel)
+{
+    put8(e, (uint8_t)(pixel >> 16));
+    put8(e, (uint8_t)(pixel >> 8));
+    put8(e, (uint8_t)pixel);
+}
+
+static inline bool same_rgb(uint32_t a, uint32_t b)
+{
+    return ((a ^ b) & 0x00FFFFFF) == 0;
+}
+
+static void put_skip(enc_t *e, uint32_t n)
+{
+    uint32_t blocks;
+
+    while (n >= SCREENREC_OP_MAX) {
+        blocks = n / SCREENREC_OP_MAX;
+        if (blocks > SCREENREC_OP_MAX) {
+            blocks = SCREENREC_OP_MAX;
+        }
+        put8(e, (uint8_t)(SCREENREC_SKIP64 | (blocks - 1)));
+        n -= blocks * SCREENREC_OP_MAX;
+    }
+    if (n > 0) {
+        put8(e, (uint8_t)(SCREENREC_SKIP | (n - 1)));
+    }
+}
+
+static void put_repeat(enc_t *e, uint32_t pixel, uint32_t n)
+{
+    uint32_t m;
+
+    while (n > 0) {
+        m = n < SCREENREC_OP_MAX ? n : SCREENREC_OP_MAX;
+        put8(e, (uint8_t)(SCREENREC_REPEAT | (m - 1)));
+        put_rgb(e, pixel);
+        n -= m;
+    }
+}
+
+/**
+ * Encode one row of a rect against the previous frame
+ */
+static void encode_row(enc_t *e, const uint32_t *cur, const uint32_t *prev, uint32_t w)
+{
+    uint32_t i = 0, j, k;
+
+    while (i < w && !e->full) {
+        /* Unchanged */
+        if (same_rgb(cur[i], prev[i])) {
+            for (j = i + 1; j < w && same_rgb(cur[j], prev[j]); j++) {
+            }
+            put_skip(e, j - i);
+            i = j;
+            continue;
+        }
+
+        /* Changed, one colour: a fill, a gradient row, a window background */
+        for (j = i + 1; j < w && !same_rgb(cur[j], prev[j]) && same_rgb(cur[j], cur[i]); j++) {
+        }
+        if (j - i >= 2) {
+            put_repeat(e, cur[i], j - i);
+            i = j;
+            continue;
+        }
+
+        /* Changed and varied: literals, up to the next unchanged pixel or pair */
+        for (j = i + 1; j < w && j - i < SCREENREC_OP_MAX; j++) {
+            if (same_rgb(cur[j], prev[j]) ||
+                (j + 1 < w && same_rgb(cur[j], cur[j + 1]) && !same_rgb(cur[j + 1], prev[j + 1]))) {
+                break;
+            }
+        }
+        put8(e, (uint8_t)(SCREENREC_LITERAL | (j - i - 1)));
+        for (k = i; k < j; k++) {
+            put_rgb(e, cur[k]);
+        }
+        i = j;
+    }
+}
+
+/**
+ * Encode a rect (clipped to the screen)
+ */
+static void encode_rect(enc_t *e, const uint32_t *src, const rect_t *r)
+{
+    size_t offset;
+    int32_t y;
+
+    put_le(e, (uint32_t)r->x, 2);
+    put_le(e, (uint32_t)r->y, 2);
+    put_le(e, (uint32_t)r->width, 2);
+    put_le(e, (uint32_t)r->height, 2);
+
+    for (y = r->y; y < r->y + r->height && !e->full; y++) {
+        offset = (size_t)y * rec.width + (size_t)r->x;
+        encode_row(e, &src[offset], &rec.prev[offset], (uint32_t)r->width);
+    }
+}
+
+/**
+ * Bring the previous frame up to date over a committed rect
+ */
+static void update_prev(const uint32_t *src, const rect_t *r)
+{
+    size_t offset;
+    int32_t y;
+
+    for (y = r->y; y < r->y + r->height; y++) {
+        offset = (size_t)y * rec.width + (size_t)r->x;
+        memcpy(&rec.prev[offset], &src[offset], (size_t)r->width * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Record a presented frame
+ */
+void screenrec_frame(const rect_t *rects, uint32_t n)
+{
+    rect_t screen, r, owed, all;
+    const uint32_t *src;
+    uint64_t start, took, frame, pixels = 0;
+    uint32_t i, count = 0;
+    bool have_all = false;
+    enc_t e;
+
+    if (!rec.active || !mutex_trylock(&rec.lock)) {
+        return;
+    }
+    if (!rec.active) {
+        goto out;
+    }
+
+    start = timer_get_ns();
+
+    /* The mode changed under the recording */
+    if ((uint32_t)fb_width() != rec.width || (uint32_t)fb_height() != rec.height) {
+        rec.stats.dropped++;
+        goto out;
+    }
+
+    screen.x = 0;
+    screen.y = 0;
+    screen.width = (int32_t)rec.width;
+    screen.height = (int32_t)rec.height;
+    src = fb_front_buffer();
+
+    /* Owed rects go first: the whole screen, or what dropped frames left */
+    if (rec.keyframe) {
+        owed = screen;
+    } else if (rec.missed) {
+        owed = rec.missed_rect;
+    } else {
+        owed.width = 0;
+    }
+
+    e.pos = rec.head;
+    e.limit = __atomic_load_n(&rec.tail, __ATOMIC_ACQUIRE) + rec.size;
+    e.full = false;
+
+    frame = e.pos;
+    put_le(&e, start - rec.start_ns, 8);
+    put_le(&e, 0, 4);
+    put_le(&e, 0, 4);
+
+    /* Once the ring is full encoding stops, but every rect is still owed */
+    for (i = 0; i <= n; i++) {
+        if (i == 0) {
+            if (owed.width == 0) {
+                continue;
+            }
+            r = owed;
+        } else if (rec.keyframe || !rect_intersect(&rects[i - 1], &screen, &r)) {
+            continue;
+        }
+        encode_rect(&e, src, &r);
+        pixels += rect_area(&r);
+        if (have_all) {
+            rect_union(&all, &r, &all);
+        } else {
+            all = r;
+            have_all = true;
+        }
+        count++;
+    }
+
+    if (count == 0) {
+        goto out;
+    }
+
+    /* No room: owe the rects to a later frame */
+    if (e.full) {
+        rec.stats.dropped++;
+        if (!rec.keyframe) {
+            rec.missed_rect = all;
+            rec.missed = true;
+        }
+        goto out;
+    }
+
+    patch_le(frame + 8, count, 4);
+    patch_le(frame + 12, e.pos - frame - SCREENREC_FRAME_HDR, 4);
+
+    /* What the stream now says is on screen */
+    if (owed.width != 0) {
+        update_prev(src, &owed);
+    }
+    for (i = 0; i < n && !rec.keyframe; i++) {
+        if (rect_intersect(&rects[i], &screen, &r)) {
+            update_prev(src, &r);
+        }
+    }
+
+    rec.stats.pixels += pixels;
+    rec.stats.bytes += e.pos - frame;
+    rec.stats.frames++;
+    rec.keyframe = false;
+    rec.missed = false;
+    __atomic_store_n(&rec.head, e.pos, __ATOMIC_RELEASE);
+    queue_work(&rec.work);
+
+    took = timer_get_ns() - start;
+    rec.stats.encode_ns += took;
+    if (took > rec.stats.max_encode_ns) {
+        rec.stats.max_encode_ns = took;
+    }
+
+out:
+    mutex_unlock(&rec.lock);
+}
+
+/* ============================================================================
+ * Output
+ * ============================================================================ */
+
+/**
+ * Worker: write committed bytes to the host file
+ */
+static void screenrec_flush(void *arg)
+{
+    uint64_t head, tail;
+    size_t pos, n;
+
+    (void)arg;
+
+    head = __atomic_load_n(&rec.head, __ATOMIC_ACQUIRE);
+    tail = rec.tail;
+    while (tail != head) {
+        pos = (size_t)(tail & (rec.size - 1));
+        n = (size_t)(head - tail);
+        if (n > rec.size - pos) {
+            n = rec.size - pos;
+        }
+
+        /* After a failure the stream is cut; keep draining so frames go on */
+        if (!rec.stats.failed) {
+            if (semihost_write(rec.fd, rec.ring + pos, n) != 0) {
+                rec.stats.failed = true;
+            } else {
+                rec.stats.written += n;
+            }
+        }
+
+        tail += n;
+        __atomic_store_n(&rec.tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Free the buffers of a recording
+ */
+static void screenrec_free(void)
+{
+    mm_free_huge(rec.ring, rec.size);
+    mm_free_huge(rec.prev, rec.prev_size);
+    rec.ring = NULL;
+    rec.prev = NULL;
+}
+
+/**
+ * Start recording the screen to a host file
+ */
+int screenrec_start(const char *path)
+{
+    fb_info_t *fb = fb_get_info();
+    uint8_t header[16];
+    size_t size;
+
+    if (path == NULL || fb == NULL || !fb->initialized || !semihost_available()) {
+        return -1;
+    }
+
+    mutex_lock(&rec.lock);
+    if (rec.active) {
+        mutex_unlock(&rec.lock);
+        return -1;
+    }
+
+    rec.width = fb->width;
+    rec.height = fb->height;
+    rec.prev_size = (size_t)rec.width * rec.height * sizeof(uint32_t);
+
+    /* A whole-screen frame should fit; a larger one is dropped */
+    for (size = SCREENREC_RING_MIN; size < rec.prev_size && size < SCREENREC_RING_MAX; size <<= 1) {
+    }
+    rec.size = size;
+
+    rec.ring = (uint8_t *)mm_alloc_huge(rec.size);
+    rec.prev = (uint32_t *)mm_alloc_huge(rec.prev_size);
+    if (rec.ring == NULL || rec.prev == NULL) {
+        klog_error("screenrec: no memory for %u KB of buffers",
+                   (uint32_t)((rec.size + rec.prev_size) / 1024));
+        screenrec_free();
+        mutex_unlock(&rec.lock);
+        return -1;
+    }
+
+    rec.fd = semihost_open(path, SEMIHOST_OPEN_WB);
+    if (rec.fd < 0) {
+        screenrec_free();
+        mutex_unlock(&rec.lock);
+        return -1;
+    }
+
+    /* The decoder starts from black, and so does the first delta */
+    memset(rec.prev, 0, rec.prev_size);
+    memset(&rec.stats, 0, sizeof(rec.stats));
+
+    memcpy(header, SCREENREC_MAGIC, 8);
+    memcpy(&header[8], &rec.width, 4);
+    memcpy(&header[12], &rec.height, 4);
+    if (semihost_write(rec.fd, header, sizeof(header)) != 0) {
+        semihost_close(rec.fd);
+        rec.fd = -1;
+        screenrec_free();
+        mutex_unlock(&rec.lock);
+        return -1;
+    }
+    rec.stats.bytes = sizeof(header);
+    rec.stats.written = sizeof(header);
+    rec.stats.ring_size = (uint32_t)rec.size;
+
+    rec.head = 0;
+    rec.tail = 0;
+    rec.keyframe = true;
+    rec.missed = false;
+    rec.start_ns = timer_get_ns();
+    work_init(&rec.work, screenrec_flush, NULL);
+    rec.active = true;
+    rec.stats.active = true;
+
+    mutex_unlock(&rec.lock);
+    return 0;
+}
+
+/**
+ * Stop recording: write out what is buffered and close the file
+ */
+int screenrec_stop(void)
+{
+    mutex_lock(&rec.lock);
+    if (!rec.active) {
+        mutex_unlock(&rec.lock);
+        return -1;
+    }
+    rec.active = false;
+    rec.stats.active = false;
+    mutex_unlock(&rec.lock);
+
+    /* No frame queues it now; one last pass drains the ring */
+    queue_work(&rec.work);
+    work_flush(&rec.work);
+
+    semihost_close(rec.fd);
+    rec.fd = -1;
+    screenrec_free();
+    return rec.stats.failed ? -1 : 0;
+}
+
+/**
+ * Check whether a recording is running
+ */
+bool screenrec_active(void)
+{
+    return rec.active;
+}
+
+/**
+ * Get recording statistics
+ */
+void screenrec_get_stats(screenrec_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    mutex_lock(&rec.lock);
+    *stats = rec.stats;
+    mutex_unlock(&rec.lock);
+}
+
+/* ============================================================================
+ * End of screenrec.c
+ * ============================================================================ */
@@ -6,21 +6,45 @@
 
 #include <aeos/shell.h>
 #include <aeos/kprintf.h>
+#include <aeos/logbuf.h>
+#include <aeos/syscall.h>
 #include <aeos/uart.h>
 #include <aeos/string.h>
 #include <aeos/scheduler.h>
 #include <aeos/pmm.h>
 #include <aeos/heap.h>
+#include <aeos/memprof.h>
+#include <aeos/objpool.h>
+#include <aeos/arena.h>
+#include <aeos/mmu.h>
+#include <aeos/dma.h>
+#include <aeos/shrinker.h>
+#include <aeos/memblock.h>
 #include <aeos/framebuffer.h>
 #include <aeos/vfs.h>
 #include <aeos/ramfs.h>
 #include <aeos/fs_persist.h>
+#include <aeos/blkdev.h>
+#include <aeos/virtio_blk.h>
+#include <aeos/virtio_net.h>
+#include <aeos/net.h>
 #include <aeos/timer.h>
+#include <aeos/pmu.h>
+#include <aeos/profile.h>
+#include <aeos/trace.h>
+#include <aeos/screenrec.h>
+#include <aeos/bench.h>
+#include <aeos/boottime.h>
+#include <aeos/initrd.h>
+#include <aeos/semihosting.h>
 #include <aeos/editor.h>
 #include <aeos/gui.h>
-
-/* External symbols from vectors.asm */
-extern uint64_t exception_counters[16];
+#include <aeos/interrupts.h>
+#include <aeos/softirq.h>
+#include <aeos/workqueue.h>
+#include <aeos/ksyms.h>
+#include <aeos/pipe.h>
+#include <aeos/wait.h>
 
 /* ANSI escape color codes for terminal output */
 #define ANSI_RESET     "\033[0m"
@@ -54,14 +78,17 @@ static int history_start = 0;      /* Oldest entry index */
 #define SHELL_KEY_END         2005
 #define SHELL_KEY_DELETE      2006
 
-/* Current working directory */
-static char cwd[256] = "/";
+/* How long the rest of an escape sequence may take to arrive */
+#define SHELL_ESC_TIMEOUT_MS  20
 
 /* Forward declarations for built-in commands */
 static int cmd_help(int argc, char **argv);
 static int cmd_clear(int argc, char **argv);
 static int cmd_echo(int argc, char **argv);
 static int cmd_ps(int argc, char **argv);
+static int cmd_nice(int argc, char **argv);
+static int cmd_renice(int argc, char **argv);
+static int cmd_jobs(int argc, char **argv);
 static int cmd_meminfo(int argc, char **argv);
 static int cmd_ls(int argc, char **argv);
 static int cmd_cat(int argc, char **argv);
@@ -73,10 +100,18 @@ static int cmd_rm(int argc, char **argv);
 static int cmd_cp(int argc, char **argv);
 static int cmd_mv(int argc, char **argv);
 static int cmd_save(int argc, char **argv);
+static int cmd_sync(int argc, char **argv);
+static int cmd_lsblk(int argc, char **argv);
 static int cmd_uname(int argc, char **argv);
 static int cmd_uptime(int argc, char **argv);
 static int cmd_irqinfo(int argc, char **argv);
+static int cmd_dmesg(int argc, char **argv);
+static int cmd_strace(int argc, char **argv);
+static int cmd_sysstat(int argc, char **argv);
+static int cmd_prof(int argc, char **argv);
+static int cmd_trace(int argc, char **argv);
 static int cmd_edit(int argc, char **argv);
+static int cmd_run(int argc, char **argv);
 static int cmd_history(int argc, char **argv);
 static int cmd_time(int argc, char **argv);
 static int cmd_hexdump(int argc, char **argv);
@@ -84,6 +119,15 @@ static int cmd_write(int argc, char **argv);
 static int cmd_grep(int argc, char **argv);
 static int cmd_exit(int argc, char **argv);
 static int cmd_startx(int argc, char **argv);
+static int cmd_membench(int argc, char **argv);
+static int cmd_textbench(int argc, char **argv);
+static int cmd_bench(int argc, char **argv);
+static int cmd_gfxinfo(int argc, char **argv);
+static int cmd_screenshot(int argc, char **argv);
+static int cmd_record(int argc, char **argv);
+static int cmd_boottime(int argc, char **argv);
+static int cmd_mkinitrd(int argc, char **argv);
+static int cmd_net(int argc, char **argv);
 
 /* Built-in command table */
 typedef struct {
@@ -97,7 +141,10 @@ static const shell_cmd_t builtin_commands[] = {
     {"clear",   cmd_clear,   "Clear the screen"},
     {"echo",    cmd_echo,    "Print text to console"},
     {"ps",      cmd_ps,      "List running processes"},
-    {"meminfo", cmd_meminfo, "Display memory information"},
+    {"nice",    cmd_nice,    "Run a command at another nice value (-n adjust)"},
+    {"renice",  cmd_renice,  "Change the nice value of processes"},
+    {"jobs",    cmd_jobs,    "List pipelines and background jobs"},
+    {"meminfo", cmd_meminfo, "Display memory information (-v details, -sites allocators)"},
     {"ls",      cmd_ls,      "List files in directory"},
     {"cat",     cmd_cat,     "Display file contents"},
     {"touch",   cmd_touch,   "Create empty file"},
@@ -107,19 +154,36 @@ static const shell_cmd_t builtin_commands[] = {
     {"rm",      cmd_rm,      "Remove file or directory"},
     {"cp",      cmd_cp,      "Copy file"},
     {"mv",      cmd_mv,      "Move/rename file"},
-    {"save",    cmd_save,    "Save filesystem to persistent storage"},
+    {"save",    cmd_save,    "Save filesystem to persistent storage (-z compress, -d device)"},
+    {"sync",    cmd_sync,    "Write cached blocks back to their devices"},
+    {"lsblk",   cmd_lsblk,   "List block devices"},
     {"uname",   cmd_uname,   "Show system information"},
     {"uptime",  cmd_uptime,  "Show system uptime"},
-    {"irqinfo", cmd_irqinfo, "Show interrupt statistics"},
+    {"irqinfo", cmd_irqinfo, "Show interrupt statistics (-h latency histograms)"},
+    {"dmesg",   cmd_dmesg,   "Replay the kernel log (-s for statistics)"},
+    {"strace",  cmd_strace,  "Trace system calls (on, off, clear)"},
+    {"sysstat", cmd_sysstat, "Show system call counts and latency"},
+    {"prof",    cmd_prof,    "Sampling profiler (start, stop, report, dump)"},
+    {"trace",   cmd_trace,   "Kernel tracepoints (on, off, clear, dump)"},
+    {"run",     cmd_run,     "Run a program as a user process (EL0)"},
     {"edit",    cmd_edit,    "Edit file (vim-like editor)"},
     {"vi",      cmd_edit,    "Edit file (alias for edit)"},
     {"history", cmd_history, "Show command history"},
     {"time",    cmd_time,    "Time command execution"},
     {"hexdump", cmd_hexdump, "Hex dump of file contents"},
     {"write",   cmd_write,   "Write text to file"},
-    {"grep",    cmd_grep,    "Search for pattern in file"},
+    {"grep",    cmd_grep,    "Search for pattern in files (-c count, -r recurse)"},
     {"exit",    cmd_exit,    "Exit the shell"},
     {"startx",  cmd_startx,  "Start graphical desktop environment"},
+    {"membench", cmd_membench, "Benchmark memcpy/memset/memmove/memcmp"},
+    {"textbench", cmd_textbench, "Benchmark text rendering (glyphs/s)"},
+    {"bench",   cmd_bench,   "Run kernel microbenchmarks (-l to list)"},
+    {"gfxinfo", cmd_gfxinfo, "Show compositor statistics"},
+    {"screenshot", cmd_screenshot, "Save the screen as a PPM image on the host"},
+    {"record",  cmd_record,  "Record the screen to a host file (start, stop)"},
+    {"boottime", cmd_boottime, "Show the boot timeline"},
+    {"mkinitrd", cmd_mkinitrd, "Pack a directory into an initrd on the host"},
+    {"net",     cmd_net,     "Network status; send UDP text or the kernel log (send, log)"},
     {NULL,      NULL,        NULL}
 };
 
@@ -178,47 +242,24 @@ static const char *history_get(int rel_idx)
  * Read a key with escape sequence handling
  * Returns ASCII for regular keys, SHELL_KEY_* for special keys
  *
- * Uses blocking reads with simple timeout via busy-wait counter.
- * This approach works reliably on QEMU's UART.
+ * The bytes of a sequence arrive together; a lone ESC is one that nothing
+ * follows within SHELL_ESC_TIMEOUT_MS.
  */
 static int shell_read_key(void)
 {
     char c = uart_getc();
+    int seq1, seq2, seq3;
 
     if (c != 27) {
         return c;  /* Regular character */
     }
 
-    /* Escape sequence detected - check for more characters */
-    /* Use a simple delay-based approach instead of uart_data_available */
-    /* This works more reliably on QEMU */
-    volatile int i;
-    for (i = 0; i < 50000; i++) {
-        __asm__ volatile("nop");
-    }
-
-    /* Try to read next character (non-blocking check via flag register) */
-    uint32_t fr = *(volatile uint32_t *)(0x09000000 + 0x18);  /* UART_FR */
-    if (fr & (1 << 4)) {  /* RXFE - RX FIFO empty */
-        return 27;  /* Just ESC key, no sequence */
-    }
-
-    char seq1 = uart_getc();
+    seq1 = uart_getc_timeout(SHELL_ESC_TIMEOUT_MS);
     if (seq1 != '[') {
-        return 27;  /* Unknown sequence */
-    }
-
-    /* Wait and check for next char */
-    for (i = 0; i < 50000; i++) {
-        __asm__ volatile("nop");
-    }
-
-    fr = *(volatile uint32_t *)(0x09000000 + 0x18);
-    if (fr & (1 << 4)) {
-        return 27;
+        return 27;  /* Just ESC, or an unknown sequence */
     }
 
-    char seq2 = uart_getc();
+    seq2 = uart_getc_timeout(SHELL_ESC_TIMEOUT_MS);
 
     switch (seq2) {
         case 'A': return SHELL_KEY_UP;
@@ -227,45 +268,16 @@ static int shell_read_key(void)
         case 'D': return SHELL_KEY_LEFT;
         case 'H': return SHELL_KEY_HOME;
         case 'F': return SHELL_KEY_END;
-        case '3':
-            /* Delete key: ESC [ 3 ~ */
-            for (i = 0; i < 50000; i++) {
-                __asm__ volatile("nop");
-            }
-            fr = *(volatile uint32_t *)(0x09000000 + 0x18);
-            if (!(fr & (1 << 4))) {
-                char seq3 = uart_getc();
-                if (seq3 == '~') {
-                    return SHELL_KEY_DELETE;
-                }
-            }
-            return 27;
-        case '1':
-            /* Home: ESC [ 1 ~ */
-            for (i = 0; i < 50000; i++) {
-                __asm__ volatile("nop");
-            }
-            fr = *(volatile uint32_t *)(0x09000000 + 0x18);
-            if (!(fr & (1 << 4))) {
-                char seq3 = uart_getc();
-                if (seq3 == '~') {
-                    return SHELL_KEY_HOME;
-                }
-            }
-            return 27;
-        case '4':
-            /* End: ESC [ 4 ~ */
-            for (i = 0; i < 50000; i++) {
-                __asm__ volatile("nop");
-            }
-            fr = *(volatile uint32_t *)(0x09000000 + 0x18);
-            if (!(fr & (1 << 4))) {
-                char seq3 = uart_getc();
-                if (seq3 == '~') {
-                    return SHELL_KEY_END;
-                }
+        case '1':   /* Home: ESC [ 1 ~ */
+        case '3':   /* Delete: ESC [ 3 ~ */
+        case '4':   /* End: ESC [ 4 ~ */
+            seq3 = uart_getc_timeout(SHELL_ESC_TIMEOUT_MS);
+            if (seq3 != '~') {
+                return 27;
             }
-            return 27;
+            if (seq2 == '1') return SHELL_KEY_HOME;
+            if (seq2 == '3') return SHELL_KEY_DELETE;
+            return SHELL_KEY_END;
         default:
             return 27;
     }
@@ -380,7 +392,8 @@ static int shell_tab_complete(char *buf, int *len, int *cursor)
 
         kprintf("\n");
 
-        fd = vfs_open(cwd, O_RDONLY, 0);
+        boottime_wait();
+        fd = vfs_open(".", O_RDONLY, 0);
         if (fd >= 0) {
             while (vfs_readdir(fd, &entry) >= 0) {
                 if (word_len == 0 || strncmp(entry.name, partial, word_len) == 0) {
@@ -459,46 +472,6 @@ static void print_banner(void)
     kprintf("\n");
 }
 
-/**
- * Resolve a path relative to current working directory
- * Returns pointer to static buffer containing absolute path
- */
-static const char *resolve_path(const char *path)
-{
-    static char resolved[512];
-
-    /* If path is NULL or empty, use current directory */
-    if (path == NULL || path[0] == '\0') {
-        return cwd;
-    }
-
-    /* If path is already absolute, return as-is */
-    if (path[0] == '/') {
-        return path;
-    }
-
-    /* Combine cwd with relative path */
-    if (strcmp(cwd, "/") == 0) {
-        /* Root directory - don't add extra slash */
-        resolved[0] = '/';
-        resolved[1] = '\0';
-        strncat(resolved, path, sizeof(resolved) - 2);
-    } else {
-        /* Non-root directory - add slash separator */
-        strncpy(resolved, cwd, sizeof(resolved) - 1);
-        resolved[sizeof(resolved) - 1] = '\0';
-
-        size_t len = strlen(resolved);
-        if (len < sizeof(resolved) - 2) {
-            resolved[len] = '/';
-            resolved[len + 1] = '\0';
-            strncat(resolved, path, sizeof(resolved) - len - 2);
-        }
-    }
-
-    return resolved;
-}
-
 /**
  * Read a line with basic editing support
  * Simple version that just uses blocking UART reads
@@ -580,21 +553,39 @@ int shell_parse(char *line, int *argc, char **argv)
     return 0;
 }
 
+/**
+ * Per-command scratch memory, freed when the command returns
+ */
+static void *scratch_alloc(size_t size)
+{
+    return arena_alloc(process_scratch(), size);
+}
+
 /**
  * Execute a built-in command
  */
 int shell_execute(int argc, char **argv)
 {
-    int i;
+    arena_t *scratch;
+    arena_mark_t mark;
+    int i, ret;
 
     if (argc == 0) {
         return 0;
     }
 
+    /* A fast boot may still be mounting the root filesystem */
+    boottime_wait();
+
     /* Look for built-in command */
     for (i = 0; builtin_commands[i].name != NULL; i++) {
         if (strcmp(argv[0], builtin_commands[i].name) == 0) {
-            return builtin_commands[i].func(argc, argv);
+            /* A mark rather than a reset: 'time' runs commands inside one */
+            scratch = process_scratch();
+            mark = arena_mark(scratch);
+            ret = builtin_commands[i].func(argc, argv);
+            arena_release(scratch, mark);
+            return ret;
         }
     }
 
@@ -604,14 +595,345 @@ int shell_execute(int argc, char **argv)
     return -1;
 }
 
+/* ========================================================================== */
+/* Pipelines and Jobs                                                        */
+/* ========================================================================== */
+
+/*
+ * Each command of a pipeline runs in a process of its own, so producer
+ * and consumer run at once (on any CPU) and a full or empty pipe blocks
+ * whichever is ahead. A stage's stdin_fd and stdout_fd are its pipe ends,
+ * and what it prints with kprintf() goes down its pipe. Stages start in
+ * the shell's working directory at its nice value; what a stage changes
+ * of either (cd, renice) stays its own. A job belongs to the shell that
+ * started it, which frees its processes once they are gone.
+ */
+
+/* Stage kernel stacks, 2^order pages: commands keep sizeable frames */
+#define SHELL_STAGE_STACK_ORDER 2
+
+/* One command of a pipeline */
+typedef struct {
+    int argc;
+    char *argv[SHELL_MAX_ARGS];
+    process_t *proc;
+    uint64_t pid;                       /* Kept for jobs once proc is freed */
+    int status;                         /* Its shell_execute() result */
+    bool done;
+} shell_stage_t;
+
+/* A pipeline, in the foreground or the background */
+typedef struct {
+    bool used;
+    bool background;
+    uint32_t id;                        /* Job number shown by jobs */
+    process_t *owner;                   /* Shell that started it */
+    char text[SHELL_MAX_LINE];          /* The line as typed */
+    char line[SHELL_MAX_LINE];          /* Its copy, split into the argvs */
+    int nstages;
+    shell_stage_t stages[SHELL_MAX_STAGES];
+    uint32_t running;                   /* Stages still running */
+} shell_job_t;
+
+static struct {
+    spinlock_t lock;                    /* Protects the table */
+    wait_queue_t done;                  /* Woken as stages finish */
+    shell_job_t jobs[SHELL_MAX_JOBS];
+    uint32_t next_id;
+} shell_jobs = {
+    .lock = SPINLOCK_INIT,
+    .done = WAIT_QUEUE_INIT,
+};
+
+/**
+ * Standard input of the running command, -1 for the console
+ */
+static int shell_stdin(void)
+{
+    process_t *proc = process_current();
+
+    return (proc != NULL) ? proc->stdin_fd : -1;
+}
+
+/**
+ * Check whether the running command's output goes down a pipe
+ */
+static bool shell_piped(void)
+{
+    process_t *proc = process_current();
+
+    return proc != NULL && proc->stdout_fd >= 0;
+}
+
+/**
+ * Entry of a stage process: run its command, then tell the shell
+ */
+static void stage_main(void)
+{
+    process_t *self = process_current();
+    shell_job_t *job = NULL;
+    shell_stage_t *stage = NULL;
+    uint64_t flags;
+    int j, s, ret;
+
+    flags = spin_lock_irqsave(&shell_jobs.lock);
+    for (j = 0; j < SHELL_MAX_JOBS && stage == NULL; j++) {
+        for (s = 0; s < shell_jobs.jobs[j].nstages; s++) {
+            if (shell_jobs.jobs[j].used && shell_jobs.jobs[j].stages[s].proc == self) {
+                job = &shell_jobs.jobs[j];
+                stage = &job->stages[s];
+                break;
+            }
+        }
+    }
+    spin_unlock_irqrestore(&shell_jobs.lock, flags);
+
+    if (stage == NULL) {
+        return;
+    }
+
+    ret = shell_execute(stage->argc, stage->argv);
+
+    flags = spin_lock_irqsave(&shell_jobs.lock);
+    stage->status = ret;
+    stage->done = true;
+    job->running--;
+    spin_unlock_irqrestore(&shell_jobs.lock, flags);
+
+    /* Returning exits, which closes the pipe ends */
+    wake_up_all(&shell_jobs.done);
+}
+
+/**
+ * Take a free job slot
+ */
+static shell_job_t *job_alloc(void)
+{
+    shell_job_t *job = NULL;
+    uint64_t flags;
+    int j;
+
+    flags = spin_lock_irqsave(&shell_jobs.lock);
+    for (j = 0; j < SHELL_MAX_JOBS; j++) {
+        if (!shell_jobs.jobs[j].used) {
+            job = &shell_jobs.jobs[j];
+            memset(job, 0, sizeof(*job));
+            job->used = true;
+            job->id = ++shell_jobs.next_id;
+            job->owner = process_current();
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&shell_jobs.lock, flags);
+
+    return job;
+}
+
+static void job_free(shell_job_t *job)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&shell_jobs.lock);
+    job->used = false;
+    job->nstages = 0;
+    spin_unlock_irqrestore(&shell_jobs.lock, flags);
+}
+
+static bool job_finished(shell_job_t *job)
+{
+    return __atomic_load_n(&job->running, __ATOMIC_ACQUIRE) == 0;
+}
+
+/**
+ * Free a finished job's processes and its slot
+ */
+static void job_reap(shell_job_t *job)
+{
+    int s;
+
+    for (s = 0; s < job->nstages; s++) {
+        /* A stage that said it is done is on its way out */
+        while (process_reap(job->stages[s].proc) < 0) {
+            yield();
+        }
+    }
+    job_free(job);
+}
+
+/**
+ * Report and free the calling shell's background jobs that finished
+ */
+static void job_collect(void)
+{
+    process_t *self = process_current();
+    shell_job_t *job;
+    int j;
+
+    for (j = 0; j < SHELL_MAX_JOBS; j++) {
+        job = &shell_jobs.jobs[j];
+        if (job->used && job->owner == self && job->background && job_finished(job)) {
+            kprintf("[%u]  Done     %s\n", job->id, job->text);
+            job_reap(job);
+        }
+    }
+}
+
+/**
+ * Start a pipeline, and in the foreground wait until it is over
+ * @return Last command's status, 0 for a background job, -1 on error
+ */
+static int job_start(const char *line, bool background)
+{
+    int pipes[SHELL_MAX_STAGES - 1][2];
+    waiter_t w = WAITER_INIT;
+    shell_stage_t *stage;
+    shell_job_t *job;
+    process_t *proc, *self;
+    char *seg, *bar;
+    int npipes = 0, s, n, in, out, ret;
+
+    job = job_alloc();
+    if (job == NULL) {
+        kprintf("sh: too many jobs (at most %d)\n", SHELL_MAX_JOBS);
+        return -1;
+    }
+    job->background = background;
+    strncpy(job->text, line, SHELL_MAX_LINE - 1);
+    strncpy(job->line, line, SHELL_MAX_LINE - 1);
+
+    /* One stage per '|' separated command */
+    for (n = 0, seg = job->line; seg != NULL; n++, seg = bar) {
+        if (n == SHELL_MAX_STAGES) {
+            kprintf("sh: at most %d commands in a pipeline\n", SHELL_MAX_STAGES);
+            goto fail;
+        }
+        bar = strchr(seg, '|');
+        if (bar != NULL) {
+            *bar++ = '\0';
+        }
+        shell_parse(seg, &job->stages[n].argc, job->stages[n].argv);
+        if (job->stages[n].argc == 0) {
+            kprintf("sh: syntax error: empty command\n");
+            goto fail;
+        }
+    }
+
+    for (npipes = 0; npipes < n - 1; npipes++) {
+        if (pipe_open(pipes[npipes], 0) < 0) {
+            kprintf("sh: cannot create a pipe\n");
+            goto fail_pipes;
+        }
+    }
+
+    /*
+     * The stages take their own references to the pipe ends; the ends of
+     * the pipeline use the shell's own redirections, if it has any
+     */
+    self = process_current();
+    for (s = 0; s < n; s++) {
+        stage = &job->stages[s];
+        proc = process_alloc_stack(stage_main, stage->argv[0], SHELL_STAGE_STACK_ORDER);
+        if (proc == NULL) {
+            kprintf("sh: cannot start '%s'\n", stage->argv[0]);
+            goto fail_procs;
+        }
+        stage->proc = proc;
+        stage->pid = proc->pid;
+        in = (s > 0) ? pipes[s - 1][0] : self->stdin_fd;
+        out = (s < n - 1) ? pipes[s][1] : self->stdout_fd;
+        if (in >= 0) {
+            proc->stdin_fd = vfs_fd_install(proc->fd_table, in);
+            if (proc->stdin_fd < 0) {
+                goto fail_procs;
+            }
+        }
+        if (out >= 0) {
+            proc->stdout_fd = vfs_fd_install(proc->fd_table, out);
+            if (proc->stdout_fd < 0) {
+                goto fail_procs;
+            }
+        }
+    }
+
+    for (s = 0; s < npipes; s++) {
+        vfs_close(pipes[s][0]);
+        vfs_close(pipes[s][1]);
+    }
+
+    __atomic_store_n(&job->running, (uint32_t)n, __ATOMIC_RELEASE);
+    job->nstages = n;
+    for (s = 0; s < n; s++) {
+        scheduler_add_process(job->stages[s].proc);
+    }
+
+    if (background) {
+        kprintf("[%u] %u\n", job->id, (uint32_t)job->stages[n - 1].pid);
+        return 0;
+    }
+
+    for (;;) {
+        wait_prepare(&shell_jobs.done, &w);
+        if (job_finished(job)) {
+            break;
+        }
+        wait_sleep(&w, WAIT_FOREVER);
+    }
+    wait_finish(&shell_jobs.done, &w);
+
+    ret = job->stages[n - 1].status;
+    job_reap(job);
+    return ret;
+
+fail_procs:
+    for (s = 0; s < n; s++) {
+        process_discard(job->stages[s].proc);
+    }
+fail_pipes:
+    for (s = 0; s < npipes; s++) {
+        vfs_close(pipes[s][0]);
+        vfs_close(pipes[s][1]);
+    }
+fail:
+    job_free(job);
+    return -1;
+}
+
+/**
+ * Execute a command line
+ */
+int shell_execute_line(char *line)
+{
+    char *argv[SHELL_MAX_ARGS];
+    bool background = false;
+    size_t len;
+    int argc;
+
+    job_collect();
+
+    /* A trailing '&' leaves the line running in the background */
+    len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+        line[--len] = '\0';
+    }
+    if (len > 0 && line[len - 1] == '&') {
+        background = true;
+        line[--len] = '\0';
+    }
+
+    if (background || strchr(line, '|') != NULL) {
+        return job_start(line, background);
+    }
+
+    shell_parse(line, &argc, argv);
+    return (argc > 0) ? shell_execute(argc, argv) : 0;
+}
+
 /**
  * Main shell loop
  */
 void shell_run(void)
 {
     char line[SHELL_MAX_LINE];
-    char *argv[SHELL_MAX_ARGS];
-    int argc;
 
     print_banner();
 
@@ -622,13 +944,8 @@ void shell_run(void)
         /* Read command */
         shell_readline(line, SHELL_MAX_LINE);
 
-        /* Parse command */
-        shell_parse(line, &argc, argv);
-
-        /* Execute command */
-        if (argc > 0) {
-            shell_execute(argc, argv);
-        }
+        /* Execute command or pipeline */
+        shell_execute_line(line);
     }
 }
 
@@ -658,17 +975,27 @@ static int cmd_help(int argc, char **argv)
     kprintf("  " ANSI_GREEN "pwd" ANSI_RESET "       - Print working directory\n");
     kprintf("  " ANSI_GREEN "write" ANSI_RESET "     - Write text to file\n");
     kprintf("  " ANSI_GREEN "hexdump" ANSI_RESET "   - Hex dump of file contents\n");
-    kprintf("  " ANSI_GREEN "grep" ANSI_RESET "      - Search for pattern in file\n");
+    kprintf("  " ANSI_GREEN "grep" ANSI_RESET "      - Search for pattern in files (-c, -r)\n");
+
+    kprintf("  " ANSI_GREEN "run" ANSI_RESET "       - Run an ELF program in user mode\n");
 
     kprintf("\n" ANSI_YELLOW "Editor:" ANSI_RESET "\n");
     kprintf("  " ANSI_GREEN "edit" ANSI_RESET "/" ANSI_GREEN "vi" ANSI_RESET "  - Vim-like text editor\n");
 
     kprintf("\n" ANSI_YELLOW "System Information:" ANSI_RESET "\n");
     kprintf("  " ANSI_GREEN "ps" ANSI_RESET "        - List running processes\n");
+    kprintf("  " ANSI_GREEN "nice" ANSI_RESET "      - Run a command at another nice value\n");
+    kprintf("  " ANSI_GREEN "renice" ANSI_RESET "    - Change the nice value of processes\n");
     kprintf("  " ANSI_GREEN "meminfo" ANSI_RESET "   - Display memory information\n");
     kprintf("  " ANSI_GREEN "uptime" ANSI_RESET "    - Show system uptime\n");
     kprintf("  " ANSI_GREEN "irqinfo" ANSI_RESET "   - Show interrupt statistics\n");
+    kprintf("  " ANSI_GREEN "sysstat" ANSI_RESET "   - Show system call counts and latency\n");
+    kprintf("  " ANSI_GREEN "strace" ANSI_RESET "    - Trace system calls (on, off, clear)\n");
+    kprintf("  " ANSI_GREEN "prof" ANSI_RESET "      - Sampling profiler (start, stop, report, dump)\n");
+    kprintf("  " ANSI_GREEN "trace" ANSI_RESET "     - Kernel tracepoints (on, off, clear, dump)\n");
     kprintf("  " ANSI_GREEN "uname" ANSI_RESET "     - Show system information\n");
+    kprintf("  " ANSI_GREEN "membench" ANSI_RESET "  - Benchmark memory routines (MB/s)\n");
+    kprintf("  " ANSI_GREEN "textbench" ANSI_RESET " - Benchmark text rendering (glyphs/s)\n");
 
     kprintf("\n" ANSI_YELLOW "Shell Utilities:" ANSI_RESET "\n");
     kprintf("  " ANSI_GREEN "echo" ANSI_RESET "      - Print text to console\n");
@@ -678,7 +1005,7 @@ static int cmd_help(int argc, char **argv)
     kprintf("  " ANSI_GREEN "help" ANSI_RESET "      - Show this help message\n");
 
     kprintf("\n" ANSI_YELLOW "Persistence:" ANSI_RESET "\n");
-    kprintf("  " ANSI_GREEN "save" ANSI_RESET "      - Save filesystem to host\n");
+    kprintf("  " ANSI_GREEN "save" ANSI_RESET "      - Save filesystem to host (-z to compress)\n");
     kprintf("  " ANSI_GREEN "exit" ANSI_RESET "      - Exit the shell\n");
 
     kprintf("\n");
@@ -716,141 +1043,554 @@ static int cmd_echo(int argc, char **argv)
     return 0;
 }
 
+/**
+ * Format a number into buf, zero-padded to at least digits characters
+ * kprintf only pads strings, so columns of numbers go through this.
+ */
+static const char *u64_str(char *buf, uint64_t val, int digits)
+{
+    char *p = buf + 20;
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + val % 10);
+        val /= 10;
+        digits--;
+    } while (val != 0 || digits > 0);
+    return p;
+}
+
+/* Processes ps lists at most */
+#define PS_MAX_PROCS        64
+
+/**
+ * Name of a process state
+ */
+static const char *ps_state_name(process_state_t state)
+{
+    switch (state) {
+        case PROCESS_READY:   return "ready";
+        case PROCESS_RUNNING: return "run";
+        case PROCESS_BLOCKED: return "sleep";
+        case PROCESS_ZOMBIE:  return "zombie";
+    }
+    return "?";
+}
+
 /**
  * ps - List processes
  */
 static int cmd_ps(int argc, char **argv)
 {
     scheduler_stats_t stats;
+    process_info_t *info;
+    char col[5][21], ni[12];
+    uint32_t i, n;
     (void)argc;
     (void)argv;
 
     scheduler_get_stats(&stats);
 
+    info = kmalloc(sizeof(*info) * PS_MAX_PROCS);
+    if (info != NULL) {
+        n = process_list(info, PS_MAX_PROCS);
+        kprintf("\n  %5s %3s %-6s %3s %4s %5s %8s  %s\n",
+                "PID", "CPU", "STATE", "NI", "PRI", "SLICE", "TICKS", "NAME");
+        for (i = 0; i < n && i < PS_MAX_PROCS; i++) {
+            /* Idle processes sit below every level; '+' marks a boost */
+            snprintf(ni, sizeof(ni), "%d", info[i].nice);
+            kprintf("  %5s %3s %-6s %3s %3s%s %5s %8s  %s\n",
+                    u64_str(col[0], info[i].pid, 1),
+                    u64_str(col[1], info[i].cpu, 1),
+                    ps_state_name(info[i].state), ni,
+                    info[i].prio < SCHED_PRIO_LEVELS ?
+                        u64_str(col[2], info[i].prio, 1) : "-",
+                    info[i].boosted ? "+" : " ",
+                    u64_str(col[3], scheduler_quantum(info[i].nice), 1),
+                    u64_str(col[4], info[i].total_time, 1),
+                    info[i].name != NULL ? info[i].name : "?");
+        }
+        if (n > PS_MAX_PROCS) {
+            kprintf("  ... and %u more\n", n - PS_MAX_PROCS);
+        }
+        kfree(info);
+    }
+
     kprintf("\nProcess Information:\n");
     kprintf("  Total processes:   %u\n", stats.total_processes);
     kprintf("  Running processes: %u\n", stats.running_processes);
     kprintf("  Context switches:  %llu\n", stats.context_switches);
+    kprintf("  Work steals:       %llu (%llu processes)\n",
+            stats.steals, stats.stolen);
+    kprintf("  CPUs online:       %u\n", stats.online_cpus);
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (stats.cpus[i].online) {
+            kprintf("    CPU%u: %u processes, %llu switches (%llu preempted), "
+                    "%llu steals, %llu IPIs\n",
+                    i, stats.cpus[i].nr_running, stats.cpus[i].context_switches,
+                    stats.cpus[i].preemptions, stats.cpus[i].steals,
+                    stats.cpus[i].ipis);
+        }
+    }
     kprintf("\n");
 
     return 0;
 }
 
 /**
- * meminfo - Show memory information
+ * Parse a signed decimal number
  */
-static int cmd_meminfo(int argc, char **argv)
+static int parse_int(const char *str, int32_t *out)
 {
-    pmm_stats_t pmm_stats;
-    heap_stats_t heap_stats;
-    (void)argc;
-    (void)argv;
-
-    pmm_get_stats(&pmm_stats);
-    heap_get_stats(&heap_stats);
-
-    kprintf("\nMemory Information:\n\n");
-
-    kprintf("Physical Memory (PMM):\n");
-    kprintf("  Total pages:  %u (%u MB)\n",
-            pmm_stats.total_pages,
-            pmm_stats.total_pages * 4 / 1024);
-    kprintf("  Used pages:   %u (%u MB)\n",
-            pmm_stats.used_pages,
-            pmm_stats.used_pages * 4 / 1024);
-    kprintf("  Free pages:   %u (%u MB)\n",
-            pmm_stats.free_pages,
-            pmm_stats.free_pages * 4 / 1024);
-
-    kprintf("\nKernel Heap:\n");
-    kprintf("  Total size:   %u KB\n", heap_stats.total_size / 1024);
-    kprintf("  Used:         %u bytes\n", heap_stats.used_size);
-    kprintf("  Free:         %u KB\n", heap_stats.free_size / 1024);
-    kprintf("  Allocations:  %u\n", heap_stats.num_allocs);
-    kprintf("  Frees:        %u\n", heap_stats.num_frees);
+    const char *p = str;
+    bool neg = false;
+    int32_t val = 0;
 
-    kprintf("\n");
+    if (*p == '-' || *p == '+') {
+        neg = (*p == '-');
+        p++;
+    }
+    if (*p == '\0') {
+        return -1;
+    }
+    for (; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9' || val > 100000) {
+            return -1;
+        }
+        val = val * 10 + (*p - '0');
+    }
+    *out = neg ? -val : val;
     return 0;
 }
 
 /**
- * ls - List files in current directory
+ * nice - Run a command with the shell's nice value adjusted
+ * The shell runs commands itself, so the change lasts while the command
+ * does; processes it starts (run) inherit the value.
  */
-static int cmd_ls(int argc, char **argv)
+static int cmd_nice(int argc, char **argv)
 {
-    const char *path;
-    int fd;
-    vfs_dirent_t entry;
+    process_t *self = process_current();
+    int32_t adjust = 10, old, nice;
+    int first = 1;
     int ret;
 
-    /* Resolve path - default to cwd if no argument */
-    path = (argc > 1) ? resolve_path(argv[1]) : cwd;
-
-    /* Open directory */
-    fd = vfs_open(path, O_RDONLY, 0);
-    if (fd < 0) {
-        kprintf("ls: cannot access '%s': No such file or directory\n", path);
+    if (self == NULL) {
         return -1;
     }
+    old = self->nice;
 
-    kprintf("\nListing: %s\n", path);
-    kprintf("------------------------------------------------------\n");
-
-    /* Read directory entries */
-    while (1) {
-        ret = vfs_readdir(fd, &entry);
-        if (ret < 0) {
-            break;
+    if (argc >= 2 && strcmp(argv[1], "-n") == 0) {
+        if (argc < 3 || parse_int(argv[2], &adjust) != 0) {
+            kprintf("Usage: nice [-n adjust] [command [args...]]\n");
+            return -1;
         }
+        first = 3;
+    }
 
-        klog_debug("ls: got entry name='%s' type=%d size=%llu",
-                   entry.name, entry.type, entry.size);
+    if (first >= argc) {
+        kprintf("%d\n", old);
+        return 0;
+    }
 
-        /* Print entry with color */
-        if (entry.type == VFS_FILE_DIRECTORY) {
-            klog_debug("ls: printing directory entry");
-            kprintf("  " ANSI_BLUE "[DIR]" ANSI_RESET "  " ANSI_BLUE "%s/" ANSI_RESET "\n", entry.name);
-            klog_debug("ls: directory entry printed");
-        } else {
-            klog_debug("ls: printing file entry");
-            kprintf("  [FILE] %s (%u bytes)\n", entry.name, (uint32_t)entry.size);
-            klog_debug("ls: file entry printed");
-        }
+    nice = old + adjust;
+    if (nice < SCHED_NICE_MIN) {
+        nice = SCHED_NICE_MIN;
+    } else if (nice > SCHED_NICE_MAX) {
+        nice = SCHED_NICE_MAX;
     }
 
-    kprintf("------------------------------------------------------\n\n");
+    scheduler_set_nice(self, nice);
+    ret = shell_execute(argc - first, &argv[first]);
+    scheduler_set_nice(self, old);
 
-    vfs_close(fd);
-    return 0;
+    return ret;
 }
 
 /**
- * cat - Display file contents
+ * renice - Set the nice value of running processes
  */
-static int cmd_cat(int argc, char **argv)
+static int cmd_renice(int argc, char **argv)
 {
-    int fd;
-    char buffer[256];
-    ssize_t bytes_read;
-    const char *path;
+    process_t *proc;
+    int32_t nice, pid, old;
+    int i, ret = 0;
 
-    if (argc < 2) {
-        kprintf("Usage: cat <filename>\n");
+    if (argc < 3 || parse_int(argv[1], &nice) != 0) {
+        kprintf("Usage: renice <nice> <pid> [pid...]\n");
+        return -1;
+    }
+    if (nice < SCHED_NICE_MIN || nice > SCHED_NICE_MAX) {
+        kprintf("renice: nice values are %d to %d\n", SCHED_NICE_MIN, SCHED_NICE_MAX);
         return -1;
     }
 
-    /* Resolve path relative to cwd */
-    path = resolve_path(argv[1]);
+    for (i = 2; i < argc; i++) {
+        proc = NULL;
+        if (parse_int(argv[i], &pid) == 0 && pid > 0) {
+            proc = process_get_by_pid((uint64_t)pid);
+        }
+        if (proc == NULL) {
+            kprintf("renice: no process '%s'\n", argv[i]);
+            ret = -1;
+            continue;
+        }
+
+        old = proc->nice;
+        if (scheduler_set_nice(proc, nice) != 0) {
+            kprintf("renice: can't renice PID %d '%s'\n", pid, proc->name);
+            ret = -1;
+            continue;
+        }
+        kprintf("%d (%s): nice %d -> %d\n", pid, proc->name, old, nice);
+    }
+
+    return ret;
+}
+
+/**
+ * jobs - List pipelines and background jobs
+ */
+static int cmd_jobs(int argc, char **argv)
+{
+    shell_job_t *job;
+    int j, s, shown = 0;
+
+    (void)argc;
+    (void)argv;
+
+    /* A job's slot stays put until its own shell frees it */
+    for (j = 0; j < SHELL_MAX_JOBS; j++) {
+        job = &shell_jobs.jobs[j];
+        if (!job->used || job->nstages == 0) {
+            continue;
+        }
+
+        kprintf("[%u]  %-8s ", job->id, job_finished(job) ? "Done" : "Running");
+        for (s = 0; s < job->nstages; s++) {
+            kprintf("%u%s", (uint32_t)job->stages[s].pid,
+                    s < job->nstages - 1 ? "," : "");
+        }
+        kprintf("  %s%s\n", job->text, job->background ? " &" : "");
+        shown++;
+    }
+
+    if (shown == 0) {
+        kprintf("No jobs\n");
+    }
+    return 0;
+}
+
+/**
+ * Convert generic timer ticks to nanoseconds without overflowing
+ */
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+    uint64_t freq = timer_get_frequency();
+
+    if (freq == 0) {
+        return 0;
+    }
+    return (ticks / freq) * 1000000000ULL +
+           (ticks % freq) * 1000000000ULL / freq;
+}
+
+/**
+ * meminfo -sites - Live memory per allocation site
+ */
+static int meminfo_sites(int argc, char **argv)
+{
+    memprof_site_t sites[MEMPROF_REPORT_TOP];
+    memprof_stats_t stats;
+    char col[3][21];
+    uint32_t n, i;
+
+    if (argc >= 2 && strcmp(argv[1], "on") == 0) {
+        if (memprof_enable(true) != 0) {
+            kprintf("meminfo: out of memory\n");
+            return -1;
+        }
+        kprintf("Recording allocation sites (up to %u live allocations)\n",
+                MEMPROF_MAX_LIVE / 4 * 3);
+        return 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+        memprof_enable(false);
+        return 0;
+    }
+    if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+        memprof_reset();
+        return 0;
+    }
+    if (argc >= 2) {
+        kprintf("Usage: meminfo -sites [on|off|reset]\n");
+        return -1;
+    }
+
+    memprof_get_stats(&stats);
+    kprintf("\nAllocation sites (%s): %u sites, %llu live allocations, %llu untracked\n",
+            stats.enabled ? "recording" : "stopped", stats.sites,
+            stats.live, stats.untracked);
+    if (stats.sites == 0) {
+        kprintf("No sites (use 'meminfo -sites on')\n\n");
+        return 0;
+    }
+
+    n = memprof_top(sites, MEMPROF_REPORT_TOP);
+    kprintf("\n  %10s %7s %8s  %-5s %s\n", "live", "count", "allocs", "kind", "site");
+    for (i = 0; i < n; i++) {
+        kprintf("  %10s %7s %8s  %-5s %s\n",
+                u64_str(col[0], sites[i].live_bytes, 1),
+                u64_str(col[1], sites[i].live_count, 1),
+                u64_str(col[2], sites[i].allocs, 1),
+                sites[i].kind == MEMPROF_PAGES ? "pages" : "heap",
+                sites[i].site);
+    }
+    kprintf("\n");
+    return 0;
+}
+
+/**
+ * meminfo - Show memory information
+ */
+static int cmd_meminfo(int argc, char **argv)
+{
+    pmm_stats_t pmm_stats;
+    heap_stats_t heap_stats;
+    mmu_stats_t mmu_stats;
+    mm_huge_stats_t huge_stats;
+    dma_stats_t dma_stats;
+    reclaim_stats_t reclaim_stats;
+    shrinker_info_t shrinkers[8];
+    uint32_t nshrinkers;
+    memblock_region_t ram;
+    objpool_stats_t pools[OBJPOOL_MAX_POOLS];
+    uint32_t i, npools;
+
+    /* meminfo -v: full allocator dumps */
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        pmm_dump_state();
+        heap_dump_state();
+        return 0;
+    }
 
-    /* Open file */
+    /* meminfo -sites: who holds the memory */
+    if (argc > 1 && strcmp(argv[1], "-sites") == 0) {
+        return meminfo_sites(argc - 1, argv + 1);
+    }
+
+    pmm_get_stats(&pmm_stats);
+    heap_get_stats(&heap_stats);
+
+    kprintf("\nMemory Information:\n\n");
+
+    kprintf("Physical Memory (PMM):\n");
+    for (i = 0; memblock_get_memory(i, &ram); i++) {
+        kprintf("  RAM:          %p - %p (%u MB)\n", (void *)ram.base,
+                (void *)(ram.base + ram.size), (uint32_t)(ram.size >> 20));
+    }
+    kprintf("  Total pages:  %u (%u MB)\n",
+            pmm_stats.total_pages,
+            pmm_stats.total_pages * 4 / 1024);
+    kprintf("  Used pages:   %u (%u MB)\n",
+            pmm_stats.used_pages,
+            pmm_stats.used_pages * 4 / 1024);
+    kprintf("  Free pages:   %u (%u MB)\n",
+            pmm_stats.free_pages,
+            pmm_stats.free_pages * 4 / 1024);
+    kprintf("  Largest free: %u pages\n", pmm_stats.largest_free_pages);
+    mm_get_huge_stats(&huge_stats);
+    kprintf("  Huge buffers: %u (%u KB)\n",
+            (uint32_t)huge_stats.buffers, (uint32_t)(huge_stats.bytes / 1024));
+    if (pmm_stats.pcp_hits + pmm_stats.pcp_misses > 0) {
+        kprintf("  Per-CPU:      %u pages cached, %u%% hit rate\n",
+                pmm_stats.pcp_pages,
+                (uint32_t)(pmm_stats.pcp_hits * 100 /
+                           (pmm_stats.pcp_hits + pmm_stats.pcp_misses)));
+    }
+    kprintf("  Watermarks:   min %u, low %u, high %u pages\n",
+            (uint32_t)pmm_stats.wmark_min, (uint32_t)pmm_stats.wmark_low,
+            (uint32_t)pmm_stats.wmark_high);
+
+    reclaim_get_stats(&reclaim_stats);
+    kprintf("\nReclaim:\n");
+    kprintf("  Passes:       %llu direct, %llu background (%llu wakeups)\n",
+            reclaim_stats.direct, reclaim_stats.background, reclaim_stats.wakeups);
+    kprintf("  Freed:        %llu objects, %llu pages; %llu allocations failed\n",
+            reclaim_stats.freed, reclaim_stats.pages, reclaim_stats.failures);
+    nshrinkers = shrinker_list(shrinkers, 8);
+    for (i = 0; i < nshrinkers; i++) {
+        kprintf("  %-12s  %u reclaimable, %llu freed\n", shrinkers[i].name,
+                (uint32_t)shrinkers[i].count, shrinkers[i].freed);
+    }
+
+    mmu_get_stats(&mmu_stats);
+    kprintf("\nMMU:\n");
+    if (mmu_stats.enabled) {
+        kprintf("  Status:       enabled, 4KB pages, %u-bit VA, TTBR0=%p\n",
+                MMU_VA_BITS, (void *)mmu_stats.ttbr0);
+    } else {
+        kprintf("  Status:       disabled (caches off)\n");
+    }
+    kprintf("  Page tables:  %u pages (%u KB)\n",
+            mmu_stats.table_pages, mmu_stats.table_pages * 4);
+    kprintf("  Blocks:       %u x 1GB, %u x 2MB (%u pages mapped in all)\n",
+            (uint32_t)mmu_stats.blocks_1g, (uint32_t)mmu_stats.blocks_2m,
+            (uint32_t)mmu_stats.mapped_pages);
+    kprintf("  Map window:   %u of %u pages in use\n",
+            (uint32_t)mmu_stats.vmap_pages, (uint32_t)MMU_VMAP_PAGES);
+    kprintf("  User spaces:  %u (%u pages, %llu ASID rollovers)\n",
+            mmu_stats.spaces, (uint32_t)mmu_stats.user_pages,
+            mmu_stats.asid_generation);
+    kprintf("  Copy-on-write: %llu faults, %llu pages copied\n",
+            mmu_stats.cow_faults, mmu_stats.cow_copies);
+    dma_get_stats(&dma_stats);
+    kprintf("  DMA:          %s, %u-byte lines, %u coherent buffers (%u KB)\n",
+            dma_stats.coherent ? "coherent" : "non-coherent",
+            dma_stats.line_size, (uint32_t)dma_stats.coherent_allocs,
+            (uint32_t)(dma_stats.coherent_bytes / 1024));
+    if (!dma_stats.coherent) {
+        kprintf("  DMA syncs:    %llu (%llu lines)\n",
+                dma_stats.syncs, dma_stats.lines);
+    }
+    for (i = 0; i < mmu_stats.num_regions; i++) {
+        const mmu_region_t *region = mmu_get_region(i);
+        kprintf("  %p-%p  %s  %s\n",
+                (void *)region->va, (void *)(region->va + region->size),
+                (region->flags & MEM_DEVICE) ? "Device   " :
+                (region->flags & MEM_NOCACHE) ? "Normal NC" : "Normal WB",
+                region->name);
+    }
+
+    kprintf("\nKernel Heap:\n");
+    kprintf("  Total size:   %u KB\n", heap_stats.total_size / 1024);
+    kprintf("  Used:         %u bytes\n", heap_stats.used_size);
+    kprintf("  Free:         %u KB\n", heap_stats.free_size / 1024);
+    if (heap_stats.free_size > 0) {
+        /* Fragmentation: how much of the free space one request can use */
+        kprintf("  Largest free: %u KB (%u%% of free)\n",
+                heap_stats.largest_free / 1024,
+                (uint32_t)(heap_stats.largest_free * 100 / heap_stats.free_size));
+    }
+    kprintf("  Allocations:  %u\n", heap_stats.num_allocs);
+    kprintf("  Frees:        %u\n", heap_stats.num_frees);
+    kprintf("  Slab pages:   %u KB (%u bytes in objects)\n",
+            heap_stats.slab_size / 1024, heap_stats.slab_used);
+
+    kprintf("\nSize Classes (in use / capacity, slabs, allocs):\n");
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        const kmem_cache_stats_t *cls = &heap_stats.classes[i];
+        if (cls->num_allocs == 0) {
+            continue;
+        }
+        kprintf("  %s\t%u / %u\t%u\t%u\n",
+                cls->name, cls->active_objs, cls->total_objs,
+                cls->num_slabs, cls->num_allocs);
+    }
+
+    npools = objpool_get_stats(pools, OBJPOOL_MAX_POOLS);
+    if (npools > 0) {
+        kprintf("\nObject Pools (in use / ready, allocs, hit rate):\n");
+        for (i = 0; i < npools; i++) {
+            const objpool_stats_t *pool = &pools[i];
+            kprintf("  %s\t%u / %u\t%llu\t%u%%\n",
+                    pool->name, pool->objects - pool->ready, pool->ready,
+                    pool->allocs,
+                    pool->allocs ? (uint32_t)(pool->hits * 100 / pool->allocs) : 0);
+        }
+    }
+
+    kprintf("\n");
+    return 0;
+}
+
+/* Directory entries ls reads per call */
+#define LS_BATCH        32
+
+/**
+ * ls - List files in current directory
+ */
+static int cmd_ls(int argc, char **argv)
+{
+    const char *path;
+    int fd;
+    vfs_dirent_t *batch, *entry;
+    ssize_t n, i;
+
+    /* Default to the working directory (the VFS resolves relative paths) */
+    path = (argc > 1) ? argv[1] : ".";
+
+    batch = (vfs_dirent_t *)scratch_alloc(LS_BATCH * sizeof(vfs_dirent_t));
+    if (batch == NULL) {
+        kprintf("ls: out of memory\n");
+        return -1;
+    }
+
+    /* Open directory */
     fd = vfs_open(path, O_RDONLY, 0);
     if (fd < 0) {
-        kprintf("cat: %s: No such file or directory\n", argv[1]);
+        kprintf("ls: cannot access '%s': No such file or directory\n", path);
         return -1;
     }
 
-    /* Read and print file contents */
-    kprintf("\n");
+    kprintf("\nListing: %s\n", (argc > 1) ? path : vfs_getcwd());
+    kprintf("------------------------------------------------------\n");
+
+    /* Read directory entries a batch at a time */
+    while ((n = vfs_getdents(fd, batch, LS_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            entry = &batch[i];
+            klog_debug("ls: got entry name='%s' type=%d size=%llu",
+                       entry->name, entry->type, entry->size);
+
+            /* Print entry with color */
+            if (entry->type == VFS_FILE_DIRECTORY) {
+                kprintf("  " ANSI_BLUE "[DIR]" ANSI_RESET "  " ANSI_BLUE "%s/" ANSI_RESET "\n",
+                        entry->name);
+            } else {
+                kprintf("  [FILE] %s (%u bytes)\n", entry->name, (uint32_t)entry->size);
+            }
+        }
+    }
+
+    kprintf("------------------------------------------------------\n\n");
+
+    vfs_close(fd);
+    return 0;
+}
+
+/**
+ * cat - Display file contents (standard input in a pipeline)
+ */
+static int cmd_cat(int argc, char **argv)
+{
+    int fd;
+    char buffer[256];
+    ssize_t bytes_read;
+    const char *path;
+    bool piped = shell_piped();
+
+    if (argc < 2) {
+        fd = shell_stdin();
+        if (fd < 0) {
+            kprintf("Usage: cat <filename>\n");
+            return -1;
+        }
+    } else {
+        path = argv[1];
+
+        /* Open file */
+        fd = vfs_open(path, O_RDONLY, 0);
+        if (fd < 0) {
+            kprintf("cat: %s: No such file or directory\n", argv[1]);
+            return -1;
+        }
+    }
+
+    /* Read and print file contents; down a pipe, only the contents */
+    if (!piped) {
+        kprintf("\n");
+    }
     while (1) {
         bytes_read = vfs_read(fd, buffer, sizeof(buffer) - 1);
         if (bytes_read <= 0) {
@@ -860,9 +1600,13 @@ static int cmd_cat(int argc, char **argv)
         buffer[bytes_read] = '\0';
         kprintf("%s", buffer);
     }
-    kprintf("\n");
+    if (!piped) {
+        kprintf("\n");
+    }
 
-    vfs_close(fd);
+    if (argc >= 2) {
+        vfs_close(fd);
+    }
     return 0;
 }
 
@@ -879,8 +1623,7 @@ static int cmd_touch(int argc, char **argv)
         return -1;
     }
 
-    /* Resolve path relative to cwd */
-    path = resolve_path(argv[1]);
+    path = argv[1];
 
     /* Create file */
     fd = vfs_open(path, O_CREAT | O_WRONLY, 0644);
@@ -907,8 +1650,7 @@ static int cmd_mkdir(int argc, char **argv)
         return -1;
     }
 
-    /* Resolve path relative to cwd */
-    path = resolve_path(argv[1]);
+    path = argv[1];
 
     /* Create directory */
     ret = vfs_mkdir(path, 0755);
@@ -927,88 +1669,13 @@ static int cmd_mkdir(int argc, char **argv)
 static int cmd_cd(int argc, char **argv)
 {
     const char *path = (argc > 1) ? argv[1] : "/";
-    int fd;
-    char new_cwd[256];
-
-    /* Handle special case: ".." (parent directory) */
-    if (strcmp(path, "..") == 0) {
-        /* Find the last '/' in cwd and truncate there */
-        size_t len = strlen(cwd);
-        if (len > 1) {
-            /* Start from end and find last '/' */
-            char *last_slash = NULL;
-            for (size_t i = len - 1; i > 0; i--) {
-                if (cwd[i] == '/') {
-                    last_slash = &cwd[i];
-                    break;
-                }
-            }
-            if (last_slash != NULL) {
-                if (last_slash == cwd) {
-                    /* Parent is root */
-                    strcpy(cwd, "/");
-                } else {
-                    /* Truncate at last slash */
-                    *last_slash = '\0';
-                }
-            } else {
-                /* No slash found, go to root */
-                strcpy(cwd, "/");
-            }
-        }
-        /* Already at root, stay there */
-        return 0;
-    }
-
-    /* Handle special case: "." (current directory) */
-    if (strcmp(path, ".") == 0) {
-        /* Stay in current directory */
-        return 0;
-    }
-
-    /* Build absolute path */
-    if (path[0] == '/') {
-        /* Absolute path */
-        strncpy(new_cwd, path, sizeof(new_cwd) - 1);
-        new_cwd[sizeof(new_cwd) - 1] = '\0';
-    } else {
-        /* Relative path - append to current directory */
-        if (strcmp(cwd, "/") == 0) {
-            new_cwd[0] = '/';
-            strncpy(new_cwd + 1, path, sizeof(new_cwd) - 2);
-            new_cwd[sizeof(new_cwd) - 1] = '\0';
-        } else {
-            strncpy(new_cwd, cwd, sizeof(new_cwd) - 1);
-            new_cwd[sizeof(new_cwd) - 1] = '\0';
-            size_t cwd_len = strlen(new_cwd);
-            if (cwd_len < sizeof(new_cwd) - 1) {
-                new_cwd[cwd_len] = '/';
-                strncpy(new_cwd + cwd_len + 1, path, sizeof(new_cwd) - cwd_len - 2);
-                new_cwd[sizeof(new_cwd) - 1] = '\0';
-            }
-        }
-    }
 
-    /* Try to open the directory to verify it exists and is a directory */
-    fd = vfs_open(new_cwd, O_RDONLY, 0);
-    if (fd < 0) {
-        kprintf("cd: %s: No such file or directory\n", path);
+    /* The VFS resolves ".", ".." and relative paths against the cwd inode */
+    if (vfs_chdir(path) < 0) {
+        kprintf("cd: %s: No such directory\n", path);
         return -1;
     }
 
-    /* TODO: Check if it's actually a directory (currently trusting vfs_open) */
-    vfs_close(fd);
-
-    /* Update current working directory */
-    strncpy(cwd, new_cwd, sizeof(cwd) - 1);
-    cwd[sizeof(cwd) - 1] = '\0';
-
-    /* Normalize path (remove trailing slash unless it's root) */
-    size_t len = strlen(cwd);
-    if (len > 1 && cwd[len - 1] == '/') {
-        cwd[len - 1] = '\0';
-    }
-
     return 0;
 }
 
@@ -1020,7 +1687,7 @@ static int cmd_pwd(int argc, char **argv)
     (void)argc;
     (void)argv;
 
-    kprintf("%s\n", cwd);
+    kprintf("%s\n", vfs_getcwd());
     return 0;
 }
 
@@ -1069,8 +1736,8 @@ static int cmd_rm(int argc, char **argv)
         return -1;
     }
 
-    /* Get the file/directory to remove and resolve path */
-    const char *target = resolve_path(argv[arg_idx]);
+    /* Get the file/directory to remove */
+    const char *target = argv[arg_idx];
 
     /* Try to remove as file first */
     ret = vfs_unlink(target);
@@ -1101,8 +1768,8 @@ static int cmd_rm(int argc, char **argv)
 static int cmd_cp(int argc, char **argv)
 {
     int src_fd, dst_fd;
-    char buffer[512];
-    ssize_t bytes_read, bytes_written;
+    ssize_t copied;
+    int64_t size;
     const char *src_path, *dst_path;
 
     if (argc < 3) {
@@ -1110,9 +1777,8 @@ static int cmd_cp(int argc, char **argv)
         return -1;
     }
 
-    /* Resolve paths relative to cwd */
-    src_path = resolve_path(argv[1]);
-    dst_path = resolve_path(argv[2]);
+    src_path = argv[1];
+    dst_path = argv[2];
 
     /* Open source file */
     src_fd = vfs_open(src_path, O_RDONLY, 0);
@@ -1129,20 +1795,18 @@ static int cmd_cp(int argc, char **argv)
         return -1;
     }
 
-    /* Copy data */
-    while (1) {
-        bytes_read = vfs_read(src_fd, buffer, sizeof(buffer));
-        if (bytes_read <= 0) {
-            break;
-        }
-
-        bytes_written = vfs_write(dst_fd, buffer, bytes_read);
-        if (bytes_written < 0 || bytes_written != bytes_read) {
+    /* Copy data: page to page within a filesystem, 64KB chunks across */
+    size = vfs_seek(src_fd, 0, SEEK_END);
+    vfs_seek(src_fd, 0, SEEK_SET);
+    while (size > 0) {
+        copied = vfs_copy_file_range(src_fd, dst_fd, (size_t)size);
+        if (copied <= 0) {
             kprintf("cp: write error\n");
             vfs_close(src_fd);
             vfs_close(dst_fd);
             return -1;
         }
+        size -= copied;
     }
 
     kprintf("Copied: %s -> %s\n", argv[1], argv[2]);
@@ -1157,44 +1821,71 @@ static int cmd_cp(int argc, char **argv)
  */
 static int cmd_mv(int argc, char **argv)
 {
-    /* For now, implement as copy + delete */
+    char target[MAX_PATH_LEN];
+    vfs_inode_t *inode;
+    const char *base;
     int ret;
-    const char *src_path;
 
     if (argc < 3) {
         kprintf("Usage: mv <source> <destination>\n");
         return -1;
     }
 
-    /* Copy file */
-    char *cp_argv[] = {"cp", argv[1], argv[2]};
-    ret = cmd_cp(3, cp_argv);
-    if (ret < 0) {
-        return -1;
+    /* Moving into a directory keeps the name */
+    strncpy(target, argv[2], sizeof(target) - 1);
+    target[sizeof(target) - 1] = '\0';
+    if (vfs_path_lookup(argv[2], &inode) == 0 && inode->type == VFS_FILE_DIRECTORY) {
+        base = strrchr(argv[1], '/');
+        base = (base != NULL) ? base + 1 : argv[1];
+        snprintf(target, sizeof(target), "%s%s%s", argv[2],
+                 argv[2][strlen(argv[2]) - 1] == '/' ? "" : "/", base);
     }
 
-    /* Delete source - resolve path */
-    src_path = resolve_path(argv[1]);
-    ret = vfs_unlink(src_path);
-    if (ret < 0) {
-        kprintf("mv: cannot remove '%s' after copy\n", argv[1]);
+    /* Relink the entry; only across filesystems does the data move */
+    ret = vfs_rename(argv[1], target);
+    if (ret == VFS_RENAME_XDEV) {
+        char *cp_argv[] = {"cp", argv[1], target};
+        if (cmd_cp(3, cp_argv) < 0) {
+            return -1;
+        }
+        if (vfs_unlink(argv[1]) < 0) {
+            kprintf("mv: cannot remove '%s' after copy\n", argv[1]);
+            return -1;
+        }
+    } else if (ret < 0) {
+        kprintf(ANSI_RED "mv: cannot move '%s' to '%s'" ANSI_RESET "\n", argv[1], target);
         return -1;
     }
 
-    kprintf("Moved: %s -> %s\n", argv[1], argv[2]);
+    kprintf("Moved: %s -> %s\n", argv[1], target);
     return 0;
 }
 
 /**
  * save - Save filesystem to persistent storage
+ * Usage: save [-z]
  */
 static int cmd_save(int argc, char **argv)
 {
     vfs_filesystem_t *fs;
+    fs_persist_stats_t stats;
+    uint32_t flags = 0;
     int ret;
+    int i;
 
-    (void)argc;
-    (void)argv;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-z") == 0) {
+            flags |= FS_SAVE_COMPRESS;
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            if (fs_set_persist_device(argv[++i]) != 0) {
+                kprintf("save: no block device '%s'\n", argv[i]);
+                return -1;
+            }
+        } else {
+            kprintf("Usage: save [-z] [-d device]\n");
+            return -1;
+        }
+    }
 
     kprintf("\nSaving filesystem to disk...\n");
 
@@ -1206,15 +1897,86 @@ static int cmd_save(int argc, char **argv)
     }
 
     /* Save filesystem to disk */
-    ret = fs_save_to_disk(fs);
+    ret = fs_save_to_disk(fs, flags);
     if (ret < 0) {
         kprintf("[ERROR] Failed to save filesystem to disk\n");
         return -1;
     }
 
-    kprintf("Filesystem saved successfully!\n");
-    kprintf("Changes will persist across reboots (stored on disk.img)\n\n");
+    fs_get_persist_stats(&stats);
+    if (stats.raw_bytes == 0) {
+        kprintf("Nothing changed since the last save\n");
+    } else {
+        kprintf("%s save: %u inodes, %llu bytes written",
+                stats.full ? "Full" : "Incremental", stats.inodes, stats.written);
+        if (stats.compressed) {
+            /* Ratio in hundredths, e.g. 3.25:1 */
+            uint64_t ratio = (stats.raw_bytes * 100) / (stats.written ? stats.written : 1);
+            kprintf(" (%llu before compression, %llu.%llu%llu:1)",
+                    stats.raw_bytes, ratio / 100, (ratio / 10) % 10, ratio % 10);
+        }
+        kprintf("\n");
+    }
+    kprintf("Image size: %llu bytes\n", stats.image_size);
+
+    kprintf("Filesystem saved to the block cache\n");
+    kprintf("Writing back to '%s' in the background ('sync' to wait)\n\n", stats.device);
+
+    return 0;
+}
+
+/**
+ * sync - Write cached blocks back to their devices
+ */
+static int cmd_sync(int argc, char **argv)
+{
+    bcache_stats_t stats;
+    int ret;
+
+    (void)argc;
+    (void)argv;
+
+    ret = bcache_sync(NULL);
+    if (ret < 0) {
+        kprintf("[ERROR] Block device write failed; dirty blocks kept\n");
+        return -1;
+    }
+
+    bcache_get_stats(&stats);
+    kprintf("Synced %d blocks (cache: %u blocks, %llu hits, %llu misses, %llu writes)\n",
+            ret, stats.cached, stats.hits, stats.misses, stats.runs);
+    return 0;
+}
+
+/**
+ * lsblk - List block devices
+ */
+static int cmd_lsblk(int argc, char **argv)
+{
+    virtio_blk_stats_t vstats;
+    blkdev_t *dev;
+    uint32_t i;
+
+    (void)argc;
+    (void)argv;
+
+    for (i = 0; (dev = blkdev_get(i)) != NULL; i++) {
+        kprintf("  %s: %llu blocks (%llu MB)\n", dev->name, dev->num_blocks,
+                dev->num_blocks >> (20 - BLK_SHIFT));
+    }
+    if (i == 0) {
+        kprintf("No block devices\n");
+        return 0;
+    }
 
+    if (blkdev_find("vda") != NULL) {
+        virtio_blk_get_stats(&vstats);
+        kprintf("vda: %llu requests, %llu blocks, %u in flight (max %u), "
+                "%llu notifies, %llu interrupts, %llu errors%s\n",
+                vstats.requests, vstats.blocks, vstats.in_flight, vstats.max_in_flight,
+                vstats.notifies, vstats.interrupts, vstats.errors,
+                vstats.indirect ? ", indirect descriptors" : "");
+    }
     return 0;
 }
 
@@ -1243,6 +2005,8 @@ static int cmd_uptime(int argc, char **argv)
     uint64_t uptime_sec = timer_get_uptime_sec();
     uint64_t ticks = timer_get_ticks();
     uint32_t hours, minutes, seconds;
+    timer_stats_t tstats;
+    uint32_t i;
 
     (void)argc;
     (void)argv;
@@ -1255,59 +2019,445 @@ static int cmd_uptime(int argc, char **argv)
     kprintf("\nSystem Uptime:\n");
     kprintf("  Time:  %u:%02u:%02u (hh:mm:ss)\n", hours, minutes, seconds);
     kprintf("  Ticks: %llu (at %u Hz)\n", ticks, TIMER_FREQ_HZ);
+
+    timer_get_stats(&tstats);
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (smp_cpu_online(i)) {
+            kprintf("  CPU%u:  %u timers pending, %llu fired, %llu tickless idles\n",
+                    i, tstats.cpus[i].pending, tstats.cpus[i].events_fired,
+                    tstats.cpus[i].idle_entries);
+        }
+    }
     kprintf("\n");
 
     return 0;
 }
 
 /**
- * irqinfo - Show interrupt statistics
+ * One row of a deferred work stage: count, mean, p50 and p99 in ns
  */
-static int cmd_irqinfo(int argc, char **argv)
+static void irqinfo_stage(const char *name, const irq_stat_t *st)
 {
-    (void)argc;
-    (void)argv;
-
-    kprintf("\nInterrupt Statistics:\n\n");
-
-    kprintf("Exception Vector Counters:\n");
-    kprintf("  EL1 SP0: sync=%llu irq=%llu fiq=%llu serr=%llu\n",
-            exception_counters[0], exception_counters[1],
-            exception_counters[2], exception_counters[3]);
-    kprintf("  EL1 SPx: sync=%llu irq=%llu fiq=%llu serr=%llu\n",
-            exception_counters[4], exception_counters[5],
-            exception_counters[6], exception_counters[7]);
-    kprintf("  EL0 A64: sync=%llu irq=%llu fiq=%llu serr=%llu\n",
-            exception_counters[8], exception_counters[9],
-            exception_counters[10], exception_counters[11]);
-    kprintf("  EL0 A32: sync=%llu irq=%llu fiq=%llu serr=%llu\n",
-            exception_counters[12], exception_counters[13],
-            exception_counters[14], exception_counters[15]);
-
-    /* Calculate total IRQs */
-    uint64_t total_irqs = exception_counters[1] + exception_counters[5] +
-                          exception_counters[9] + exception_counters[13];
-    kprintf("\n  Total IRQs handled: %llu\n", total_irqs);
-    kprintf("\n");
+    char col[4][21];
 
-    return 0;
+    kprintf("  %-14s %10s %8s %8s %8s\n", name,
+            u64_str(col[0], st->count, 1),
+            u64_str(col[1], st->count ? ticks_to_ns(st->ticks / st->count) : 0, 1),
+            u64_str(col[2], ticks_to_ns(irq_stat_percentile(st, 50)), 1),
+            u64_str(col[3], ticks_to_ns(irq_stat_percentile(st, 99)), 1));
 }
 
 /**
- * edit/vi - Edit a file with vim-like editor
+ * Bottom half and workqueue latencies, the stages after the handler
  */
-static int cmd_edit(int argc, char **argv)
+static void irqinfo_deferred(void)
 {
-    const char *path;
+    softirq_stats_t sstats;
+    workqueue_stats_t wstats;
+    uint32_t i, pending = 0;
+
+    softirq_get_stats(&sstats);
+    workqueue_get_stats(&wstats);
+    for (i = 0; i < MAX_CPUS; i++) {
+        pending += sstats.pending[i];
+    }
+
+    kprintf("\nDeferred work (ns):\n\n");
+    kprintf("  %-14s %10s %8s %8s %8s\n", "stage", "count", "mean", "p50", "p99");
+    irqinfo_stage("tasklet wait", &sstats.wait);
+    irqinfo_stage("tasklet run", &sstats.run);
+    irqinfo_stage("work wait", &wstats.wait);
+    irqinfo_stage("work run", &wstats.run);
+
+    kprintf("\n  Tasklets: %llu passes, %llu exits left some queued, %u queued now\n",
+            sstats.passes, sstats.left_over, pending);
+    kprintf("  Workqueue: %llu items queued, %u pending\n", wstats.queued, wstats.pending);
+    for (i = 0; i < wstats.workers; i++) {
+        kprintf("    PID %u: %llu items%s\n", (uint32_t)wstats.worker[i].pid,
+                wstats.worker[i].items, wstats.worker[i].busy ? " (busy)" : "");
+    }
+}
 
-    if (argc < 2) {
-        kprintf("Usage: edit <filename>\n");
+/**
+ * irqinfo - Show interrupt statistics
+ */
+static int cmd_irqinfo(int argc, char **argv)
+{
+    static const char *const sources[4] = {
+        "EL1 SP0", "EL1 SPx", "EL0 A64", "EL0 A32"
+    };
+    exception_stats_t estats;
+    irq_stat_t st;
+    uart_stats_t ustats;
+    irq_handler_t handler;
+    uint64_t total_irqs = 0;
+    bool hist = argc > 1 && strcmp(argv[1], "-h") == 0;
+    char col[5][21];
+    uint32_t i, irq, b;
+
+    if (argc > 1 && !hist) {
+        kprintf("Usage: irqinfo [-h]\n");
+        return -1;
+    }
+
+    exception_get_stats(&estats);
+
+    kprintf("\nInterrupt Statistics:\n\n");
+
+    kprintf("Exception Vector Counters:\n");
+    for (i = 0; i < 4; i++) {
+        kprintf("  %s: sync=%llu irq=%llu fiq=%llu serr=%llu\n", sources[i],
+                estats.vectors[i][EXC_SYNC], estats.vectors[i][EXC_IRQ],
+                estats.vectors[i][EXC_FIQ], estats.vectors[i][EXC_SERR]);
+        total_irqs += estats.vectors[i][EXC_IRQ];
+    }
+    kprintf("\n  Total IRQs handled: %llu (%llu spurious)\n",
+            total_irqs, estats.spurious);
+
+    /* Per IRQ number; the timer's FIQs count under its PPI */
+    kprintf("\nPer IRQ (acknowledge to EOI in ns, percentiles are upper bounds):\n\n");
+    kprintf("  %4s %10s %8s %8s %8s  %s\n",
+            "irq", "count", "mean", "p50", "p99", "handler");
+    for (irq = 0; irq < IRQ_STATS_NR; irq++) {
+        if (irq_get_stat(irq, &st) != 0 || st.count == 0) {
+            continue;
+        }
+        handler = irq_get_handler(irq);
+        kprintf("  %4s %10s %8s %8s %8s  %s\n",
+                u64_str(col[0], irq, 1), u64_str(col[1], st.count, 1),
+                u64_str(col[2], ticks_to_ns(st.ticks / st.count), 1),
+                u64_str(col[3], ticks_to_ns(irq_stat_percentile(&st, 50)), 1),
+                u64_str(col[4], ticks_to_ns(irq_stat_percentile(&st, 99)), 1),
+                handler != NULL ?
+                    ksym_name(ksym_index((uint64_t)(uintptr_t)handler)) : "-");
+
+        if (!hist) {
+            continue;
+        }
+        for (b = 0; b < IRQ_LAT_BUCKETS; b++) {
+            if (st.hist[b] == 0) {
+                continue;
+            }
+            if (b == IRQ_LAT_BUCKETS - 1) {
+                kprintf("       >= %8s ns %10s\n",
+                        u64_str(col[0], ticks_to_ns(1ULL << b), 1),
+                        u64_str(col[1], st.hist[b], 1));
+            } else {
+                kprintf("       <  %8s ns %10s\n",
+                        u64_str(col[0], ticks_to_ns(2ULL << b), 1),
+                        u64_str(col[1], st.hist[b], 1));
+            }
+        }
+    }
+
+    irqinfo_deferred();
+
+    uart_get_stats(&ustats);
+    kprintf("\nUART (%s):\n", uart_rx_irq_enabled() ? "interrupt-driven" : "polled");
+    kprintf("  Interrupts:  %llu\n", ustats.interrupts);
+    kprintf("  TX:          %llu bytes in %llu writes (%u queued)\n",
+            ustats.tx_bytes, ustats.writes, ustats.tx_queued);
+    kprintf("  RX:          %llu bytes (%u queued, %llu dropped, %llu sleeps)\n",
+            ustats.rx_bytes, ustats.rx_queued, ustats.rx_dropped, ustats.rx_waits);
+    kprintf("\n");
+
+    return 0;
+}
+
+/**
+ * dmesg - Replay the kernel log ring
+ */
+static int cmd_dmesg(int argc, char **argv)
+{
+    logbuf_stats_t stats;
+
+    if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+        logbuf_get_stats(&stats);
+        kprintf("\nKernel Log:\n");
+        kprintf("  Records held:  %u (%u KB per CPU)\n",
+                stats.held, LOGBUF_CPU_SIZE / 1024);
+        kprintf("  Logged:        %llu records, %llu bytes\n",
+                stats.records, stats.bytes);
+        kprintf("  Overwritten:   %llu records\n", stats.overwritten);
+        kprintf("\n");
+        return 0;
+    }
+
+    /* Straight to the console, so the replay doesn't log itself */
+    logbuf_replay(console_write);
+    return 0;
+}
+
+static void print_trace_rec(const syscall_trace_rec_t *rec)
+{
+    const char *name = syscall_name(rec->num);
+    uint64_t at = ticks_to_ns(rec->start) / 1000;
+    char sec[21], usec[21];
+
+    kprintf("[%6s.%s] cpu%u pid %u  %-7s(0x%llx) = %lld  %llu ns\n",
+            u64_str(sec, at / 1000000, 1), u64_str(usec, at % 1000000, 6),
+            rec->cpu, rec->pid, name ? name : "?", rec->arg0,
+            (int64_t)rec->ret, ticks_to_ns(rec->ticks));
+}
+
+/**
+ * strace - Control or dump the system call trace
+ */
+static int cmd_strace(int argc, char **argv)
+{
+    syscall_stats_t stats;
+
+    if (argc > 1) {
+        if (strcmp(argv[1], "on") == 0) {
+            syscall_trace_set(true);
+        } else if (strcmp(argv[1], "off") == 0) {
+            syscall_trace_set(false);
+        } else if (strcmp(argv[1], "clear") == 0) {
+            syscall_trace_clear();
+        } else {
+            kprintf("Usage: strace [on|off|clear]\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    syscall_get_stats(&stats);
+    kprintf("\nSystem call trace (%s, %u per CPU):\n",
+            stats.tracing ? "on" : "off", SYSCALL_TRACE_RECORDS);
+    syscall_trace_replay(print_trace_rec);
+    kprintf("\n");
+    return 0;
+}
+
+/**
+ * sysstat - Show per-syscall counts and latency percentiles
+ */
+static int cmd_sysstat(int argc, char **argv)
+{
+    syscall_stats_t stats;
+    syscall_stat_t st;
+    const char *name;
+    char col[5][21];
+    uint32_t num;
+
+    (void)argc;
+    (void)argv;
+
+    kprintf("\nSystem Calls (latency in ns, percentiles are upper bounds):\n\n");
+    kprintf("  %-8s %10s %10s %10s %10s %10s\n",
+            "name", "calls", "mean", "p50", "p90", "p99");
+
+    for (num = 0; num < MAX_SYSCALLS; num++) {
+        name = syscall_name(num);
+        if (name == NULL || syscall_get_stat(num, &st) != 0) {
+            continue;
+        }
+        kprintf("  %-8s %10s %10s %10s %10s %10s\n", name,
+                u64_str(col[0], st.calls, 1),
+                u64_str(col[1], st.calls ? ticks_to_ns(st.ticks / st.calls) : 0, 1),
+                u64_str(col[2], ticks_to_ns(syscall_stat_percentile(&st, 50)), 1),
+                u64_str(col[3], ticks_to_ns(syscall_stat_percentile(&st, 90)), 1),
+                u64_str(col[4], ticks_to_ns(syscall_stat_percentile(&st, 99)), 1));
+    }
+
+    syscall_get_stats(&stats);
+    kprintf("\n  Total:    %llu calls, %llu invalid\n", stats.total, stats.invalid);
+    kprintf("  Tracing:  %s (%llu records written)\n",
+            stats.tracing ? "on" : "off", stats.traced);
+    kprintf("\n");
+    return 0;
+}
+
+/* Default number of functions in a profile report */
+#define PROF_REPORT_TOP     20
+
+static void print_prof_row(const char *name, uint64_t samples, void *ctx)
+{
+    uint64_t total = *(const uint64_t *)ctx;
+    uint64_t permille = samples * 1000 / total;
+    char col[3][21];
+
+    kprintf("  %8s %5s.%s%%  %s\n", u64_str(col[0], samples, 1),
+            u64_str(col[1], permille / 10, 1), u64_str(col[2], permille % 10, 1),
+            name);
+}
+
+/**
+ * prof - Sample where CPU time goes, from the timer interrupt
+ */
+static int cmd_prof(int argc, char **argv)
+{
+    prof_stats_t stats;
+    uint32_t top = PROF_REPORT_TOP;
+    const char *p;
+    char frac[21];
+    int n;
+
+    if (argc >= 2 && strcmp(argv[1], "start") == 0) {
+        if (profile_start() != 0) {
+            kprintf("prof: out of memory\n");
+            return -1;
+        }
+        kprintf("Profiling at %u Hz per CPU, %u samples per CPU\n",
+                TIMER_FREQ_HZ, PROF_MAX_SAMPLES);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "stop") == 0) {
+        profile_stop();
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "dump") == 0) {
+        if (argc < 3) {
+            kprintf("Usage: prof dump <host-file>\n");
+            return -1;
+        }
+        n = profile_dump_folded(argv[2]);
+        if (n < 0) {
+            kprintf("prof: cannot write %s on the host (semihosting)\n", argv[2]);
+            return -1;
+        }
+        kprintf("Wrote %d folded stacks to %s\n", n, argv[2]);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "report") != 0) {
+        kprintf("Usage: prof [start|stop|report [n]|dump <host-file>]\n");
+        return -1;
+    }
+
+    if (argc >= 3) {
+        top = 0;
+        for (p = argv[2]; *p >= '0' && *p <= '9'; p++) {
+            top = top * 10 + (uint32_t)(*p - '0');
+        }
+        if (*p != '\0' || top == 0) {
+            kprintf("prof: bad count '%s'\n", argv[2]);
+            return -1;
+        }
+    }
+
+    profile_get_stats(&stats);
+    kprintf("\nProfile (%s): %llu samples over %llu.%s s, %llu in EL0, %llu dropped\n",
+            stats.running ? "running" : "stopped", stats.samples,
+            stats.elapsed_ns / 1000000000ULL,
+            u64_str(frac, (stats.elapsed_ns / 1000000ULL) % 1000, 3),
+            stats.user, stats.dropped);
+    if (stats.samples == 0) {
+        kprintf("No samples (use 'prof start')\n\n");
+        return 0;
+    }
+
+    kprintf("\n  %8s %8s  %s\n", "samples", "self", "function");
+    if (profile_report(top, print_prof_row, &stats.samples) < 0) {
+        kprintf("prof: out of memory\n");
+        return -1;
+    }
+    kprintf("\n");
+    return 0;
+}
+
+/**
+ * trace - Control the kernel tracepoints or dump their records
+ */
+static int cmd_trace(int argc, char **argv)
+{
+    trace_stats_t stats;
+    uint32_t mask, bits;
+    int ev, i, n;
+
+    if (argc >= 2 && (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)) {
+        /* No event names: all of them */
+        bits = argc == 2 ? TRACE_ALL : 0;
+        for (i = 2; i < argc; i++) {
+            ev = trace_event_by_name(argv[i]);
+            if (ev < 0) {
+                kprintf("trace: no event '%s'\n", argv[i]);
+                return -1;
+            }
+            bits |= 1U << ev;
+        }
+
+        mask = trace_mask;
+        mask = strcmp(argv[1], "on") == 0 ? (mask | bits) : (mask & ~bits);
+        if (trace_set_mask(mask) != 0) {
+            kprintf("trace: out of memory\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "clear") == 0) {
+        trace_clear();
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "dump") == 0) {
+        if (argc < 3) {
+            kprintf("Usage: trace dump <host-file>\n");
+            return -1;
+        }
+        n = trace_dump(argv[2]);
+        if (n < 0) {
+            kprintf("trace: cannot write %s on the host (semihosting)\n", argv[2]);
+            return -1;
+        }
+        kprintf("Wrote %d records to %s\n", n, argv[2]);
+        return 0;
+    }
+
+    if (argc >= 2) {
+        kprintf("Usage: trace [on|off [event...]|clear|dump <host-file>]\n");
+        return -1;
+    }
+
+    trace_get_stats(&stats);
+    kprintf("\nTracepoints (%u records per CPU):\n\n", TRACE_RING_RECORDS);
+    for (i = 0; i < TRACE_NUM_EVENTS; i++) {
+        kprintf("  %-16s %s\n", trace_event_name((uint32_t)i),
+                (stats.mask & (1U << i)) ? ANSI_GREEN "on" ANSI_RESET : "off");
+    }
+    kprintf("\n  Written: %llu records, %llu held\n\n", stats.written, stats.held);
+    return 0;
+}
+
+/**
+ * run - Start an ELF executable as a user process
+ */
+static int cmd_run(int argc, char **argv)
+{
+    process_t *proc;
+
+    if (argc < 2) {
+        kprintf("Usage: run <program>\n");
+        return -1;
+    }
+
+    proc = process_create_user(argv[1]);
+    if (proc == NULL) {
+        kprintf("run: cannot start %s\n", argv[1]);
+        return -1;
+    }
+
+    kprintf("Started PID %u '%s'\n", (uint32_t)proc->pid, proc->name);
+    return 0;
+}
+
+/**
+ * edit/vi - Edit a file with vim-like editor
+ */
+static int cmd_edit(int argc, char **argv)
+{
+    const char *path;
+
+    if (argc < 2) {
+        kprintf("Usage: edit <filename>\n");
         kprintf("       vi <filename>\n");
         return -1;
     }
 
-    /* Resolve path relative to cwd */
-    path = resolve_path(argv[1]);
+    path = argv[1];
 
     /* Run the editor */
     editor_run(path);
@@ -1348,28 +2498,64 @@ static int cmd_history(int argc, char **argv)
  */
 static int cmd_time(int argc, char **argv)
 {
-    uint64_t start_ticks, end_ticks, elapsed_ticks;
-    uint64_t elapsed_ms;
+    pmu_counts_t before, after;
+    uint64_t start, elapsed, ns;
+    uint64_t count[PMU_NUM_COUNTS];
+    uint64_t ipc;
+    uint32_t valid, i;
+    char frac[21];
 
     if (argc < 2) {
         kprintf("Usage: time <command> [args...]\n");
         return -1;
     }
 
-    /* Get start time */
-    start_ticks = timer_get_ticks();
+    /* PMU counts are the shell's own, so they survive migration */
+    pmu_read_self(&before);
+    start = timer_get_counter();
 
     /* Execute the command (shift argv to skip "time") */
     shell_execute(argc - 1, &argv[1]);
 
-    /* Get end time */
-    end_ticks = timer_get_ticks();
+    elapsed = timer_get_counter() - start;
+    pmu_read_self(&after);
+
+    ns = ticks_to_ns(elapsed);
+    kprintf("\n" ANSI_CYAN "Time:" ANSI_RESET " %llu.%s ms (%llu ns, %llu counter ticks)\n",
+            ns / 1000000, u64_str(frac, (ns / 1000) % 1000, 3), ns, elapsed);
+
+    if (!pmu_available()) {
+        return 0;
+    }
+
+    valid = pmu_valid_counts();
+    for (i = 0; i < PMU_NUM_COUNTS; i++) {
+        count[i] = after.count[i] - before.count[i];
+    }
 
-    /* Calculate elapsed time */
-    elapsed_ticks = end_ticks - start_ticks;
-    elapsed_ms = (elapsed_ticks * 1000) / TIMER_FREQ_HZ;
+    kprintf(ANSI_CYAN "Cycles:" ANSI_RESET " %llu", count[PMU_CYCLES]);
+    if (valid & (1U << PMU_INSTRUCTIONS)) {
+        kprintf("  " ANSI_CYAN "Instructions:" ANSI_RESET " %llu", count[PMU_INSTRUCTIONS]);
+        if (count[PMU_CYCLES] != 0) {
+            ipc = count[PMU_INSTRUCTIONS] * 100 / count[PMU_CYCLES];
+            kprintf("  " ANSI_CYAN "IPC:" ANSI_RESET " %llu.%s",
+                    ipc / 100, u64_str(frac, ipc % 100, 2));
+        }
+    }
+    kprintf("\n");
 
-    kprintf("\n" ANSI_CYAN "Time:" ANSI_RESET " %llu ms (%llu ticks)\n", elapsed_ms, elapsed_ticks);
+    kprintf(ANSI_CYAN "L1D misses:" ANSI_RESET " ");
+    if (valid & (1U << PMU_CACHE_MISSES)) {
+        kprintf("%llu", count[PMU_CACHE_MISSES]);
+    } else {
+        kprintf("n/a");
+    }
+    kprintf("  " ANSI_CYAN "Branch misses:" ANSI_RESET " ");
+    if (valid & (1U << PMU_BRANCH_MISSES)) {
+        kprintf("%llu\n", count[PMU_BRANCH_MISSES]);
+    } else {
+        kprintf("n/a\n");
+    }
 
     return 0;
 }
@@ -1381,8 +2567,11 @@ static int cmd_hexdump(int argc, char **argv)
 {
     int fd;
     unsigned char buffer[16];
+    const unsigned char *row;
+    const unsigned char *map;
     ssize_t bytes_read;
     size_t offset = 0;
+    size_t map_len;
     const char *path;
     int i;
 
@@ -1391,7 +2580,7 @@ static int cmd_hexdump(int argc, char **argv)
         return -1;
     }
 
-    path = resolve_path(argv[1]);
+    path = argv[1];
 
     fd = vfs_open(path, O_RDONLY, 0);
     if (fd < 0) {
@@ -1403,10 +2592,27 @@ static int cmd_hexdump(int argc, char **argv)
     kprintf(ANSI_CYAN "Offset    00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F  ASCII" ANSI_RESET "\n");
     kprintf("--------  -----------------------------------------------  ----------------\n");
 
+    /* Dump straight from the file's pages when it can be mapped */
+    map_len = (size_t)vfs_seek(fd, 0, SEEK_END);
+    vfs_seek(fd, 0, SEEK_SET);
+    if (map_len > 512) {
+        map_len = 512;
+    }
+    map = (const unsigned char *)vfs_mmap(fd, 0, map_len, VFS_MAP_READ);
+
     while (1) {
-        bytes_read = vfs_read(fd, buffer, 16);
-        if (bytes_read <= 0) {
-            break;
+        if (map != NULL) {
+            if (offset >= map_len) {
+                break;
+            }
+            row = map + offset;
+            bytes_read = (map_len - offset < 16) ? (ssize_t)(map_len - offset) : 16;
+        } else {
+            bytes_read = vfs_read(fd, buffer, 16);
+            if (bytes_read <= 0) {
+                break;
+            }
+            row = buffer;
         }
 
         /* Print offset */
@@ -1418,7 +2624,7 @@ static int cmd_hexdump(int argc, char **argv)
                 kprintf(" ");  /* Extra space in middle */
             }
             if (i < bytes_read) {
-                kprintf("%02x ", buffer[i]);
+                kprintf("%02x ", row[i]);
             } else {
                 kprintf("   ");
             }
@@ -1427,8 +2633,8 @@ static int cmd_hexdump(int argc, char **argv)
         /* Print ASCII representation */
         kprintf(" ");
         for (i = 0; i < bytes_read; i++) {
-            if (buffer[i] >= 32 && buffer[i] < 127) {
-                kprintf("%c", buffer[i]);
+            if (row[i] >= 32 && row[i] < 127) {
+                kprintf("%c", row[i]);
             } else {
                 kprintf(".");
             }
@@ -1446,6 +2652,9 @@ static int cmd_hexdump(int argc, char **argv)
 
     kprintf("\nTotal: %u bytes\n\n", (unsigned int)offset);
 
+    if (map != NULL) {
+        vfs_munmap((void *)map, map_len);
+    }
     vfs_close(fd);
     return 0;
 }
@@ -1465,7 +2674,7 @@ static int cmd_write(int argc, char **argv)
         return -1;
     }
 
-    path = resolve_path(argv[1]);
+    path = argv[1];
 
     fd = vfs_open(path, O_CREAT | O_WRONLY, 0644);
     if (fd < 0) {
@@ -1488,136 +2697,418 @@ static int cmd_write(int argc, char **argv)
     return 0;
 }
 
+/* grep read size for files that cannot be mapped */
+#define GREP_CHUNK      4096
+
+/* Deepest directory level grep -r descends to */
+#define GREP_MAX_DEPTH  16
+
+/* grep search state, shared by every file of one command */
+typedef struct {
+    const char *pattern;
+    size_t pat_len;
+    uint8_t skip[256];          /* Horspool shift per text byte */
+    bool count_only;            /* -c: count matching lines */
+    bool show_names;            /* Several files: prefix lines with the name */
+    bool plain;                 /* Output goes down a pipe: lines only */
+    const char *name;           /* File being searched */
+    uint32_t matches;           /* Matching lines in this file */
+    uint32_t total;             /* Matching lines in all files */
+    uint32_t line_num;          /* Lines finished before the buffer start */
+    bool in_line;               /* Buffer starts in the middle of a line */
+    bool line_done;             /* That line already matched */
+    char *chunk;                /* GREP_CHUNK read buffer */
+} grep_t;
+
 /**
- * grep - Search for pattern in file
+ * Build the Boyer-Moore-Horspool shift table
  */
-static int cmd_grep(int argc, char **argv)
+static void grep_prepare(grep_t *g, const char *pattern)
 {
-    int fd;
-    char buffer[512];
-    char line[256];
-    ssize_t bytes_read;
-    const char *path;
-    const char *pattern;
-    int line_num = 0;
-    int matches = 0;
-    int line_pos = 0;
-    int i;
+    size_t i;
 
-    if (argc < 3) {
-        kprintf("Usage: grep <pattern> <filename>\n");
-        return -1;
+    g->pattern = pattern;
+    g->pat_len = strlen(pattern);
+
+    for (i = 0; i < 256; i++) {
+        g->skip[i] = (uint8_t)(g->pat_len < 255 ? g->pat_len : 255);
+    }
+    for (i = 0; i + 1 < g->pat_len; i++) {
+        size_t shift = g->pat_len - 1 - i;
+        g->skip[(uint8_t)pattern[i]] = (uint8_t)(shift < 255 ? shift : 255);
     }
+}
 
-    pattern = argv[1];
+/**
+ * Find the pattern in a buffer
+ * Single bytes go to memchr's 16-byte NEON compare, longer patterns to
+ * Horspool: check the window's last byte, shift by the table on a miss.
+ * @return Offset of the match, or -1
+ */
+static ssize_t grep_find(const grep_t *g, const char *text, size_t len)
+{
+    size_t last = g->pat_len - 1;
+    uint8_t tail = (uint8_t)g->pattern[last];
+    uint8_t c;
+    size_t i = 0;
 
-    /* Strip leading/trailing quotes from pattern */
-    {
-        int plen = strlen(pattern);
-        if (plen >= 2) {
-            char first = pattern[0];
-            char last = pattern[plen - 1];
-            if ((first == '"' && last == '"') || (first == '\'' && last == '\'')) {
-                /* Create unquoted pattern in static buffer */
-                static char unquoted[256];
-                int i;
-                for (i = 1; i < plen - 1 && i < 255; i++) {
-                    unquoted[i - 1] = pattern[i];
-                }
-                unquoted[i - 1] = '\0';
-                pattern = unquoted;
-            }
+    if (g->pat_len == 1) {
+        const char *p = memchr(text, tail, len);
+        return (p != NULL) ? p - text : -1;
+    }
+
+    while (i + g->pat_len <= len) {
+        c = (uint8_t)text[i + last];
+        if (c == tail && memcmp(text + i, g->pattern, last) == 0) {
+            return (ssize_t)i;
         }
+        i += g->skip[c];
     }
 
-    path = resolve_path(argv[2]);
+    return -1;
+}
 
-    fd = vfs_open(path, O_RDONLY, 0);
-    if (fd < 0) {
-        kprintf(ANSI_RED "grep: cannot open '%s': No such file" ANSI_RESET "\n", argv[2]);
-        return -1;
+/**
+ * Count newlines in a buffer
+ */
+static uint32_t grep_count_lines(const char *text, size_t len)
+{
+    const char *end = text + len;
+    uint32_t lines = 0;
+
+    while ((text = memchr(text, '\n', end - text)) != NULL) {
+        lines++;
+        text++;
     }
 
-    kprintf("\n");
+    return lines;
+}
 
-    /* Read file and search line by line */
-    while (1) {
-        bytes_read = vfs_read(fd, buffer, sizeof(buffer) - 1);
-        if (bytes_read <= 0) {
-            break;
-        }
-        buffer[bytes_read] = '\0';
+/**
+ * Print one matching line (the buffer holds [start, end), no newline)
+ */
+static void grep_print(const grep_t *g, const char *line, size_t len,
+                       bool cut_start, bool cut_end)
+{
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
 
-        /* Process buffer character by character */
-        for (i = 0; i < bytes_read; i++) {
-            if (buffer[i] == '\n' || buffer[i] == '\r') {
-                /* End of line - check for pattern */
-                line[line_pos] = '\0';
-                line_num++;
-
-                /* Simple substring search */
-                if (line_pos > 0) {
-                    char *found = NULL;
-                    int j;
-                    int pat_len = strlen(pattern);
-                    int line_len = line_pos;
-
-                    for (j = 0; j <= line_len - pat_len; j++) {
-                        if (strncmp(&line[j], pattern, pat_len) == 0) {
-                            found = &line[j];
-                            break;
-                        }
-                    }
+    if (g->plain) {
+        kprintf("%s%s%.*s\n", g->show_names ? g->name : "", g->show_names ? ":" : "",
+                (int)len, line);
+        return;
+    }
 
-                    if (found != NULL) {
-                        kprintf(ANSI_CYAN "%d:" ANSI_RESET " %s\n", line_num, line);
-                        matches++;
-                    }
-                }
+    if (g->show_names) {
+        kprintf(ANSI_MAGENTA "%s" ANSI_RESET ":", g->name);
+    }
+    kprintf(ANSI_CYAN "%u:" ANSI_RESET " %s%.*s%s\n", g->line_num + 1,
+            cut_start ? "..." : "", (int)len, line, cut_end ? "..." : "");
+}
 
-                line_pos = 0;
-                /* Skip \r\n combination */
-                if (buffer[i] == '\r' && i + 1 < bytes_read && buffer[i + 1] == '\n') {
-                    i++;
-                }
-            } else {
-                if (line_pos < (int)sizeof(line) - 1) {
-                    line[line_pos++] = buffer[i];
-                }
-            }
+/**
+ * Search a buffer of file data
+ * Matches are found directly in the buffer and newlines are only counted
+ * between matches (not at all with -c). Unless final, the unfinished
+ * last line is left for the caller to carry into the next read.
+ * @return Bytes consumed
+ */
+static size_t grep_scan(grep_t *g, const char *buf, size_t len, bool final)
+{
+    const char *nl;
+    size_t pos = 0;
+    size_t start, end, keep;
+    ssize_t hit;
+
+    /* Skip the rest of a long line that already matched */
+    if (g->line_done) {
+        nl = memchr(buf, '\n', len);
+        if (nl == NULL) {
+            return len;
         }
+        pos = (size_t)(nl - buf) + 1;
+        g->line_num++;
+        g->line_done = false;
+        g->in_line = false;
     }
 
-    /* Check last line if no trailing newline */
-    if (line_pos > 0) {
-        line[line_pos] = '\0';
-        line_num++;
-
-        char *found = NULL;
-        int j;
-        int pat_len = strlen(pattern);
+    while (pos < len && (hit = grep_find(g, buf + pos, len - pos)) >= 0) {
+        /* Widen the match to its line */
+        start = pos + (size_t)hit;
+        while (start > pos && buf[start - 1] != '\n') {
+            start--;
+        }
+        nl = memchr(buf + pos + hit + g->pat_len, '\n', len - (pos + hit + g->pat_len));
+        end = (nl != NULL) ? (size_t)(nl - buf) : len;
 
-        for (j = 0; j <= line_pos - pat_len; j++) {
-            if (strncmp(&line[j], pattern, pat_len) == 0) {
-                found = &line[j];
-                break;
-            }
+        if (!g->count_only) {
+            g->line_num += grep_count_lines(buf + pos, start - pos);
+            grep_print(g, buf + start, end - start,
+                       start == 0 && g->in_line, nl == NULL && !final);
         }
+        g->matches++;
 
-        if (found != NULL) {
-            kprintf(ANSI_CYAN "%d:" ANSI_RESET " %s\n", line_num, line);
-            matches++;
+        if (nl == NULL) {
+            /* The line goes on past this buffer, and it is done */
+            g->line_done = !final;
+            g->in_line = true;
+            return len;
         }
+
+        g->line_num++;
+        g->in_line = false;
+        pos = end + 1;
     }
 
-    if (matches == 0) {
-        kprintf("No matches found for '%s' in %s\n", pattern, argv[2]);
-    } else {
-        kprintf("\n" ANSI_GREEN "%d matches found" ANSI_RESET "\n", matches);
+    if (final) {
+        return len;
+    }
+
+    /* Keep the unfinished last line: a match may span the reads */
+    end = len;
+    while (end > pos && buf[end - 1] != '\n') {
+        end--;
+    }
+    if (!g->count_only) {
+        g->line_num += grep_count_lines(buf + pos, end - pos);
+    }
+    if (end > pos) {
+        g->in_line = false;
+    }
+
+    /* A line longer than the buffer: keep enough to finish a match */
+    if (end == 0 && len == GREP_CHUNK) {
+        keep = g->pat_len - 1;
+        g->in_line = true;
+        return len - keep;
+    }
+
+    return end;
+}
+
+/**
+ * Search an open file, mapped if possible and read in chunks otherwise
+ * A pipe cannot be seeked or mapped, and is read until end of file.
+ */
+static void grep_fd(grep_t *g, int fd, const char *name)
+{
+    const char *map = NULL;
+    ssize_t bytes_read;
+    size_t have, used;
+    int64_t size;
+
+    g->name = name;
+    g->matches = 0;
+    g->line_num = 0;
+    g->in_line = false;
+    g->line_done = false;
+
+    size = vfs_seek(fd, 0, SEEK_END);
+    vfs_seek(fd, 0, SEEK_SET);
+
+    /* The whole file is one buffer when it can be mapped */
+    if (size > 0) {
+        map = (const char *)vfs_mmap(fd, 0, (size_t)size, VFS_MAP_READ);
+    }
+    if (map != NULL) {
+        grep_scan(g, map, (size_t)size, true);
+        vfs_munmap((void *)map, (size_t)size);
+    } else {
+        have = 0;
+        while (1) {
+            bytes_read = vfs_read(fd, g->chunk + have, GREP_CHUNK - have);
+            if (bytes_read <= 0) {
+                grep_scan(g, g->chunk, have, true);
+                break;
+            }
+            have += (size_t)bytes_read;
+            if (have < GREP_CHUNK) {
+                continue;
+            }
+
+            used = grep_scan(g, g->chunk, have, false);
+            memmove(g->chunk, g->chunk + used, have - used);
+            have -= used;
+        }
+    }
+
+    if (g->count_only) {
+        if (g->show_names) {
+            kprintf(ANSI_MAGENTA "%s" ANSI_RESET ":", name);
+        }
+        kprintf("%u\n", g->matches);
+    }
+    g->total += g->matches;
+}
+
+/**
+ * Search one file
+ */
+static void grep_file(grep_t *g, const char *path)
+{
+    int fd;
+
+    fd = vfs_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        kprintf(ANSI_RED "grep: cannot open '%s': No such file" ANSI_RESET "\n", path);
+        return;
+    }
+
+    grep_fd(g, fd, path);
+    vfs_close(fd);
+}
+
+/**
+ * Search a file, or with -r everything below a directory
+ */
+static void grep_path(grep_t *g, const char *path, bool recursive, int depth)
+{
+    vfs_inode_t *inode;
+    vfs_dirent_t entry;
+    char child[MAX_PATH_LEN];
+    int fd;
+
+    if (vfs_path_lookup(path, &inode) < 0) {
+        kprintf(ANSI_RED "grep: cannot open '%s': No such file" ANSI_RESET "\n", path);
+        return;
+    }
+
+    if (inode->type != VFS_FILE_DIRECTORY) {
+        grep_file(g, path);
+        return;
+    }
+
+    if (!recursive) {
+        kprintf(ANSI_RED "grep: '%s' is a directory (use -r)" ANSI_RESET "\n", path);
+        return;
+    }
+    if (depth >= GREP_MAX_DEPTH) {
+        kprintf(ANSI_RED "grep: '%s': too deep, skipped" ANSI_RESET "\n", path);
+        return;
+    }
+
+    fd = vfs_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return;
+    }
+
+    while (vfs_readdir(fd, &entry) >= 0) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        if (strcmp(path, "/") == 0) {
+            snprintf(child, sizeof(child), "/%s", entry.name);
+        } else {
+            snprintf(child, sizeof(child), "%s/%s", path, entry.name);
+        }
+        grep_path(g, child, true, depth + 1);
     }
-    kprintf("\n");
 
     vfs_close(fd);
+}
+
+/**
+ * grep - Search for pattern in files
+ */
+static int cmd_grep(int argc, char **argv)
+{
+    grep_t g;
+    const char *pattern;
+    bool recursive = false;
+    int first;
+    int i;
+
+    memset(&g, 0, sizeof(g));
+
+    /* Leading options: -c, -r, or combined (-rc) */
+    for (first = 1; first < argc && argv[first][0] == '-' && argv[first][1] != '\0'; first++) {
+        const char *opt;
+        for (opt = argv[first] + 1; *opt != '\0'; opt++) {
+            if (*opt == 'c') {
+                g.count_only = true;
+            } else if (*opt == 'r') {
+                recursive = true;
+            } else {
+                kprintf(ANSI_RED "grep: unknown option '-%c'" ANSI_RESET "\n", *opt);
+                return -1;
+            }
+        }
+    }
+
+    /* Without files, a pipeline stage reads its standard input */
+    if (argc - first < 2 && (argc - first < 1 || shell_stdin() < 0)) {
+        kprintf("Usage: grep [-c] [-r] <pattern> <file|dir>...\n");
+        return -1;
+    }
+
+    pattern = argv[first];
+
+    /* Strip leading/trailing quotes from pattern */
+    {
+        int plen = strlen(pattern);
+        if (plen >= 2) {
+            char first_ch = pattern[0];
+            char last = pattern[plen - 1];
+            if ((first_ch == '"' && last == '"') || (first_ch == '\'' && last == '\'')) {
+                /* Unquoted copy in scratch memory */
+                char *unquoted = (char *)scratch_alloc((size_t)plen);
+                int i;
+                if (unquoted == NULL) {
+                    kprintf(ANSI_RED "grep: out of memory" ANSI_RESET "\n");
+                    return -1;
+                }
+                for (i = 1; i < plen - 1; i++) {
+                    unquoted[i - 1] = pattern[i];
+                }
+                unquoted[i - 1] = '\0';
+                pattern = unquoted;
+            }
+        }
+    }
+
+    if (pattern[0] == '\0') {
+        kprintf(ANSI_RED "grep: empty pattern" ANSI_RESET "\n");
+        return -1;
+    }
+
+    g.chunk = (char *)scratch_alloc(GREP_CHUNK);
+    if (g.chunk == NULL) {
+        kprintf(ANSI_RED "grep: out of memory" ANSI_RESET "\n");
+        return -1;
+    }
+
+    grep_prepare(&g, pattern);
+    g.show_names = recursive || argc - first > 2;
+    g.plain = shell_piped();
+
+    if (g.plain) {
+        /* Just the lines (or counts), for the next command */
+        if (argc - first < 2) {
+            grep_fd(&g, shell_stdin(), "(stdin)");
+        }
+        for (i = first + 1; i < argc; i++) {
+            grep_path(&g, argv[i], recursive, 0);
+        }
+        return 0;
+    }
+
+    kprintf("\n");
+    if (argc - first < 2) {
+        grep_fd(&g, shell_stdin(), "(stdin)");
+    }
+    for (i = first + 1; i < argc; i++) {
+        grep_path(&g, argv[i], recursive, 0);
+    }
+
+    if (!g.count_only) {
+        if (g.total == 0) {
+            kprintf("No matches found for '%s'\n", pattern);
+        } else {
+            kprintf("\n" ANSI_GREEN "%u matches found" ANSI_RESET "\n", g.total);
+        }
+    }
+    kprintf("\n");
     return 0;
 }
 
@@ -1630,6 +3121,11 @@ static int cmd_exit(int argc, char **argv)
     (void)argv;
 
     kprintf("\nExiting shell...\n");
+
+    /* Nothing flushes after this */
+    if (bcache_sync(NULL) < 0) {
+        kprintf("[ERROR] Some cached blocks could not be written back\n");
+    }
     kprintf("System halted.\n");
     kprintf("\nPress Ctrl+A then X to exit QEMU\n");
 
@@ -1669,6 +3165,535 @@ static int cmd_startx(int argc, char **argv)
     return 0;
 }
 
+/* membench: 2MB scratch area, source in the low half, destination above */
+#define MEMBENCH_ORDER      9
+#define MEMBENCH_HALF       (1024 * 1024)
+#define MEMBENCH_TOTAL      (8 * 1024 * 1024)   /* Bytes moved per measurement */
+
+/**
+ * Run one mem* routine over size-byte buffers and return MB/s
+ * which: 0 = memcpy, 1 = memset, 2 = memmove (overlapping), 3 = memcmp
+ */
+static uint64_t membench_run(int which, bool generic, uint8_t *buf, size_t size)
+{
+    uint8_t *src = buf;
+    uint8_t *dst = buf + MEMBENCH_HALF;
+    uint64_t iters = MEMBENCH_TOTAL / size;
+    uint64_t start, cycles, i;
+    volatile int sink = 0;
+
+    start = timer_get_counter();
+    for (i = 0; i < iters; i++) {
+        switch (which) {
+        case 0:
+            generic ? memcpy_generic(dst, src, size) : memcpy(dst, src, size);
+            break;
+        case 1:
+            generic ? memset_generic(dst, 0, size) : memset(dst, 0, size);
+            break;
+        case 2:
+            generic ? memmove_generic(src + 64, src, size) : memmove(src + 64, src, size);
+            break;
+        default:
+            sink += generic ? memcmp_generic(dst, src, size) : memcmp(dst, src, size);
+            break;
+        }
+    }
+    cycles = timer_get_counter() - start;
+    (void)sink;
+
+    if (cycles == 0) {
+        cycles = 1;
+    }
+
+    /* bytes * freq / (cycles * 1MB), ordered to stay within 64 bits */
+    return (iters * size / 1024) * timer_get_frequency() / (cycles * 1024);
+}
+
+/**
+ * membench - Measure mem* throughput against the byte-loop versions
+ */
+static int cmd_membench(int argc, char **argv)
+{
+    static const char *names[] = {"memcpy", "memset", "memmove", "memcmp"};
+    static const size_t sizes[] = {64, 4096, MEMBENCH_HALF - 64};
+    uint64_t base;
+    uint8_t *buf;
+    int r;
+    int s;
+
+    (void)argc;
+    (void)argv;
+
+    base = pmm_alloc_pages(MEMBENCH_ORDER);
+    if (base == 0) {
+        kprintf(ANSI_RED "membench: out of memory" ANSI_RESET "\n");
+        return -1;
+    }
+    buf = (uint8_t *)base;
+
+    /* Identical halves so memcmp runs to the end */
+    memset(buf, 0xA5, 2 * MEMBENCH_HALF);
+
+    kprintf("\n" ANSI_CYAN "Memory routine throughput (MB/s, optimized / byte loop):" ANSI_RESET "\n");
+    kprintf("  routine\t64B\t\t4KB\t\t1MB\n");
+
+    for (r = 0; r < 4; r++) {
+        kprintf("  %s", names[r]);
+        for (s = 0; s < 3; s++) {
+            uint64_t fast = membench_run(r, false, buf, sizes[s]);
+            uint64_t slow = membench_run(r, true, buf, sizes[s]);
+            kprintf("\t%llu / %llu", fast, slow);
+        }
+        kprintf("\n");
+        memset(buf, 0xA5, 2 * MEMBENCH_HALF);
+    }
+
+    kprintf("\n");
+    pmm_free_pages(base, MEMBENCH_ORDER);
+    return 0;
+}
+
+/* textbench: lines of 80 glyphs drawn into an off-screen buffer */
+#define TEXTBENCH_COLS      80
+#define TEXTBENCH_ROWS      8
+#define TEXTBENCH_GLYPHS    (TEXTBENCH_COLS * TEXTBENCH_ROWS * 64)
+
+/**
+ * Draw TEXTBENCH_GLYPHS glyphs and return glyphs per second
+ * mode: 0 = per-pixel decode, 1 = cached glyphs, 2 = cached runs
+ */
+static uint64_t textbench_run(int mode, const char *text)
+{
+    uint64_t start, cycles;
+    uint32_t pass, row, col;
+    int32_t y;
+
+    start = timer_get_counter();
+    for (pass = 0; pass < TEXTBENCH_GLYPHS / (TEXTBENCH_COLS * TEXTBENCH_ROWS); pass++) {
+        for (row = 0; row < TEXTBENCH_ROWS; row++) {
+            y = (int32_t)row * 8;
+            if (mode == 2) {
+                fb_puts_run(0, y, text, TEXTBENCH_COLS, COLOR_WHITE, COLOR_BLACK);
+                continue;
+            }
+            for (col = 0; col < TEXTBENCH_COLS; col++) {
+                if (mode == 0) {
+                    fb_putchar_uncached((int32_t)col * 8, y, text[col],
+                                        COLOR_WHITE, COLOR_BLACK);
+                } else {
+                    fb_putchar((int32_t)col * 8, y, text[col],
+                               COLOR_WHITE, COLOR_BLACK);
+                }
+            }
+        }
+    }
+    cycles = timer_get_counter() - start;
+
+    if (cycles == 0) {
+        cycles = 1;
+    }
+
+    return TEXTBENCH_GLYPHS * timer_get_frequency() / cycles;
+}
+
+/**
+ * textbench - Measure glyph rendering against the per-pixel font decode
+ */
+static int cmd_textbench(int argc, char **argv)
+{
+    static const char *names[] = {"per-pixel decode", "glyph cache", "glyph runs"};
+    char text[TEXTBENCH_COLS];
+    uint64_t hits, misses;
+    uint32_t *buf;
+    fb_info_t *fb = fb_get_info();
+    int i;
+
+    (void)argc;
+    (void)argv;
+
+    if (!fb || !fb->initialized) {
+        kprintf(ANSI_RED "textbench: framebuffer not initialized" ANSI_RESET "\n");
+        return -1;
+    }
+
+    buf = (uint32_t *)scratch_alloc(TEXTBENCH_COLS * 8 * TEXTBENCH_ROWS * 8 * 4);
+    if (buf == NULL) {
+        kprintf(ANSI_RED "textbench: out of memory" ANSI_RESET "\n");
+        return -1;
+    }
+
+    /* Every printable character, shuffled so neighbours differ */
+    for (i = 0; i < TEXTBENCH_COLS; i++) {
+        text[i] = (char)(32 + (i * 7) % 95);
+    }
+
+    /* Draw off-screen so the display is left alone */
+    fb_set_target(buf, 0, 0, TEXTBENCH_COLS * 8, TEXTBENCH_ROWS * 8);
+
+    kprintf("\n" ANSI_CYAN "Text rendering (%u glyphs per run):" ANSI_RESET "\n",
+            TEXTBENCH_GLYPHS);
+    for (i = 0; i < 3; i++) {
+        kprintf("  %s\t%llu glyphs/s\n", names[i], textbench_run(i, text));
+    }
+
+    fb_set_target(NULL, 0, 0, 0, 0);
+
+    fb_get_glyph_stats(&hits, &misses);
+    kprintf("  Glyph cache: %llu hits, %llu misses since boot\n\n", hits, misses);
+    return 0;
+}
+
+static void print_bench_line(const char *line, void *ctx)
+{
+    (void)ctx;
+    kprintf("%s\n", line);
+}
+
+/**
+ * bench - Run the microbenchmark suite, or one benchmark of it
+ */
+static int cmd_bench(int argc, char **argv)
+{
+    int failed;
+
+    if (argc >= 2 && strcmp(argv[1], "-l") == 0) {
+        kprintf("\n");
+        bench_list(print_bench_line, NULL);
+        kprintf("\n");
+        return 0;
+    }
+    if (argc > 2) {
+        kprintf("Usage: bench [-l | name]\n");
+        return -1;
+    }
+
+    kprintf("\n");
+    failed = bench_run(argc == 2 ? argv[1] : NULL, print_bench_line, NULL);
+    if (failed < 0) {
+        kprintf("bench: no benchmark '%s' ('bench -l' lists them)\n", argv[1]);
+        return -1;
+    }
+    kprintf("\n");
+    return failed == 0 ? 0 : -1;
+}
+
+/**
+ * gfxinfo - Show compositor statistics
+ */
+static int cmd_gfxinfo(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    gui_print_stats();
+    return 0;
+}
+
+/**
+ * screenshot - Save the screen as a binary PPM image on the host
+ */
+static int cmd_screenshot(int argc, char **argv)
+{
+    if (argc < 2) {
+        kprintf("Usage: screenshot <host-file>\n");
+        return -1;
+    }
+
+    if (fb_screenshot(argv[1]) != 0) {
+        kprintf("screenshot: cannot write %s on the host (semihosting)\n", argv[1]);
+        return -1;
+    }
+    kprintf("Wrote %dx%d to %s\n", fb_width(), fb_height(), argv[1]);
+    return 0;
+}
+
+/**
+ * record - Record the presented frames to a host file
+ */
+static int cmd_record(int argc, char **argv)
+{
+    screenrec_stats_t stats;
+
+    if (argc >= 2 && strcmp(argv[1], "start") == 0) {
+        if (argc < 3) {
+            kprintf("Usage: record start <host-file>\n");
+            return -1;
+        }
+        if (screenrec_active()) {
+            kprintf("record: already recording\n");
+            return -1;
+        }
+        if (screenrec_start(argv[2]) != 0) {
+            kprintf("record: cannot record to %s on the host (semihosting)\n", argv[2]);
+            return -1;
+        }
+        kprintf("Recording to %s\n", argv[2]);
+        return 0;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "stop") == 0) {
+        if (!screenrec_active()) {
+            kprintf("record: not recording\n");
+            return -1;
+        }
+        if (screenrec_stop() != 0) {
+            kprintf("record: a host write failed, the file is cut short\n");
+        }
+    } else if (argc >= 2) {
+        kprintf("Usage: record [start <host-file>|stop]\n");
+        return -1;
+    }
+
+    screenrec_get_stats(&stats);
+    kprintf("\nScreen recording (%s, %u KB ring):\n", stats.active ? "running" : "stopped",
+            stats.ring_size / 1024);
+    kprintf("  Frames:             %llu recorded, %llu dropped\n", stats.frames, stats.dropped);
+    kprintf("  Pixels:             %llu in %llu bytes", stats.pixels, stats.bytes);
+    if (stats.bytes > 0) {
+        kprintf(" (%llu%% of RGB)", stats.bytes * 100 / (stats.pixels * 3 + 1));
+    }
+    kprintf("\n  Written:            %llu bytes%s\n", stats.written,
+            stats.failed ? " (write failed)" : "");
+    if (stats.frames > 0) {
+        kprintf("  Encode time:        %llu us average, %llu us max\n",
+                stats.encode_ns / stats.frames / 1000, stats.max_encode_ns / 1000);
+    }
+    kprintf("\n");
+    return 0;
+}
+
+/**
+ * boottime - Show the boot timeline
+ */
+static int cmd_boottime(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    boottime_print();
+    return 0;
+}
+
+/**
+ * mkinitrd - Pack a directory into an initrd image on the host
+ */
+static int cmd_mkinitrd(int argc, char **argv)
+{
+    const char *host_path = argc >= 3 ? argv[2] : INITRD_FILE;
+    ssize_t size;
+
+    if (argc < 2) {
+        kprintf("Usage: mkinitrd <dir> [host-file]\n");
+        return -1;
+    }
+    if (!semihost_available()) {
+        kprintf("mkinitrd: semihosting not available\n");
+        return -1;
+    }
+
+    size = initrd_pack(argv[1], host_path);
+    if (size < 0) {
+        kprintf("mkinitrd: failed\n");
+        return -1;
+    }
+    kprintf("Wrote %llu byte initrd to %s ('make run-initrd' boots it)\n",
+            (uint64_t)size, host_path);
+    return 0;
+}
+
+/* Source port of the shell's datagrams */
+#define NET_SHELL_PORT      4000
+
+/* 'net log': records packed into datagrams, one filling while one is sent */
+static struct {
+    uint32_t dst;
+    uint16_t port;
+    char *buf[2];
+    uint64_t fence[2];
+    uint32_t cur;                   /* Buffer being filled */
+    uint32_t len;
+    uint32_t datagrams;
+    bool failed;
+} netlog;
+
+/**
+ * Send the datagram being filled and switch to the other buffer
+ */
+static void netlog_flush(void)
+{
+    uint64_t fence;
+
+    if (netlog.len == 0 || netlog.failed) {
+        return;
+    }
+
+    fence = udp_send(netlog.dst, netlog.port, NET_SHELL_PORT,
+                     netlog.buf[netlog.cur], netlog.len);
+    if (fence == 0) {
+        netlog.failed = true;
+        return;
+    }
+    netlog.fence[netlog.cur] = fence;
+    netlog.datagrams++;
+    netlog.cur ^= 1;
+    netlog.len = 0;
+
+    /* The device reads the payload in place: the next buffer must be free */
+    if (netlog.fence[netlog.cur] != 0 && net_wait(netlog.fence[netlog.cur]) != 0) {
+        netlog.failed = true;
+    }
+    netlog.fence[netlog.cur] = 0;
+}
+
+/**
+ * logbuf_replay() output: append a record to the datagram
+ */
+static void netlog_out(const char *text, size_t len)
+{
+    if (netlog.len + len > UDP_PAYLOAD_MAX) {
+        netlog_flush();
+    }
+    if (len > UDP_PAYLOAD_MAX) {
+        len = UDP_PAYLOAD_MAX;
+    }
+    memcpy(netlog.buf[netlog.cur] + netlog.len, text, len);
+    netlog.len += (uint32_t)len;
+}
+
+/**
+ * Parse a UDP port
+ */
+static int parse_port(const char *str, uint16_t *port)
+{
+    uint32_t val = 0;
+    const char *p;
+
+    for (p = str; *p >= '0' && *p <= '9' && val <= 65535; p++) {
+        val = val * 10 + (uint32_t)(*p - '0');
+    }
+    if (p == str || *p != '\0' || val == 0 || val > 65535) {
+        return -1;
+    }
+    *port = (uint16_t)val;
+    return 0;
+}
+
+/**
+ * net - Show network status, send a datagram or export the kernel log
+ */
+static int cmd_net(int argc, char **argv)
+{
+    virtio_net_stats_t vstats;
+    net_stats_t stats;
+    uint8_t mac[VIRTIO_NET_ALEN];
+    uint32_t dst, addr, gateway;
+    uint16_t port;
+    char a[16], g[16], m[18];
+    char *text;
+    size_t len, n;
+    uint64_t fence;
+    int i;
+
+    if (!net_up()) {
+        kprintf("net: no network device ('make run-net' adds one)\n");
+        return -1;
+    }
+
+    if (argc >= 2 && (strcmp(argv[1], "send") == 0 || strcmp(argv[1], "log") == 0)) {
+        if (argc < 4 || (argv[1][0] == 's' && argc < 5)) {
+            kprintf("Usage: net send <addr> <port> <text...> | net log <addr> <port>\n");
+            return -1;
+        }
+        if (net_parse_addr(argv[2], &dst) != 0 || parse_port(argv[3], &port) != 0) {
+            kprintf("net: bad address or port '%s %s'\n", argv[2], argv[3]);
+            return -1;
+        }
+
+        if (argv[1][0] == 's') {
+            /* The words, space-separated, as one line */
+            len = 0;
+            for (i = 4; i < argc; i++) {
+                len += strlen(argv[i]) + 1;
+            }
+            if (len > UDP_PAYLOAD_MAX) {
+                kprintf("net: text longer than %u bytes\n", (uint32_t)UDP_PAYLOAD_MAX);
+                return -1;
+            }
+            text = (char *)scratch_alloc(len);
+            if (text == NULL) {
+                kprintf("net: out of memory\n");
+                return -1;
+            }
+            len = 0;
+            for (i = 4; i < argc; i++) {
+                n = strlen(argv[i]);
+                memcpy(text + len, argv[i], n);
+                len += n;
+                text[len++] = i + 1 < argc ? ' ' : '\n';
+            }
+
+            fence = udp_send(dst, port, NET_SHELL_PORT, text, len);
+            if (fence == 0 || net_wait(fence) != 0) {
+                kprintf("net: send failed\n");
+                return -1;
+            }
+            return 0;
+        }
+
+        memset(&netlog, 0, sizeof(netlog));
+        netlog.dst = dst;
+        netlog.port = port;
+        netlog.buf[0] = (char *)scratch_alloc(UDP_PAYLOAD_MAX);
+        netlog.buf[1] = (char *)scratch_alloc(UDP_PAYLOAD_MAX);
+        if (netlog.buf[0] == NULL || netlog.buf[1] == NULL) {
+            kprintf("net: out of memory\n");
+            return -1;
+        }
+
+        logbuf_replay(netlog_out);
+        netlog_flush();
+
+        /* Both buffers go away with the command's scratch memory */
+        if (netlog.fence[netlog.cur ^ 1] != 0 && net_wait(netlog.fence[netlog.cur ^ 1]) != 0) {
+            netlog.failed = true;
+        }
+        if (netlog.failed) {
+            kprintf("net: log export failed after %u datagrams\n", netlog.datagrams);
+            return -1;
+        }
+        kprintf("Sent the kernel log in %u datagrams\n", netlog.datagrams);
+        return 0;
+    }
+
+    if (argc >= 2) {
+        kprintf("Usage: net [send <addr> <port> <text...>|log <addr> <port>]\n");
+        return -1;
+    }
+
+    virtio_net_get_mac(mac);
+    net_get_config(&addr, NULL, &gateway);
+    virtio_net_get_stats(&vstats);
+    net_get_stats(&stats);
+    net_format_mac(mac, m, sizeof(m));
+    net_format_addr(addr, a, sizeof(a));
+    net_format_addr(gateway, g, sizeof(g));
+
+    kprintf("\neth0: %s, MAC %s, gateway %s\n", a, m, g);
+    kprintf("  RX: %llu frames, %llu bytes, %u buffers posted, %u held\n",
+            vstats.rx_packets, vstats.rx_bytes, vstats.rx_posted, vstats.rx_held);
+    kprintf("  TX: %llu frames, %llu bytes, %u in flight, %llu waits for a slot\n",
+            vstats.tx_packets, vstats.tx_bytes, vstats.tx_in_flight, vstats.tx_waits);
+    kprintf("  %llu interrupts, %llu notifies (%llu skipped)%s%s\n",
+            vstats.interrupts, vstats.notifies, vstats.notifies_saved,
+            vstats.event_idx ? ", event idx" : "", vstats.indirect ? ", indirect" : "");
+    kprintf("  UDP: %llu datagrams, %llu bytes; ARP: %llu in, %llu out, %llu misses, "
+            "%llu failures; %llu frames ignored\n\n",
+            stats.udp_sent, stats.udp_bytes, stats.rx_arp, stats.tx_arp,
+            stats.arp_misses, stats.arp_failures, stats.rx_ignored);
+    return 0;
+}
+
 /* ============================================================================
  * End of shell.c
  * ============================================================================ */
@@ -0,0 +1,207 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/smp.c
+ * Description: Secondary core bring-up via PSCI CPU_ON
+ * ============================================================================ */
+
+#include <aeos/smp.h>
+#include <aeos/dtb.h>
+#include <aeos/pmm.h>
+#include <aeos/gic.h>
+#include <aeos/timer.h>
+#include <aeos/pmu.h>
+#include <aeos/scheduler.h>
+#include <aeos/kprintf.h>
+#include <aeos/types.h>
+
+/* Secondary entry point (boot.asm) */
+extern void secondary_entry(void);
+
+/* Exception level the kernel was entered at (written by boot.asm) */
+uint32_t smp_boot_el;
+
+/* Boot records read by secondary cores with their MMUs off */
+static smp_boot_record_t boot_records[MAX_CPUS];
+
+/* SMP state */
+static struct {
+    volatile bool online[MAX_CPUS];     /* Set by each core once running */
+    uint32_t num_online;
+    int method;                         /* DTB_PSCI_HVC or DTB_PSCI_SMC */
+} smp = { .online = { true }, .num_online = 1 };   /* Boot CPU */
+
+/**
+ * Issue a PSCI call through the firmware conduit
+ */
+static int64_t psci_call(uint64_t fn, uint64_t arg0, uint64_t arg1, uint64_t arg2)
+{
+    register uint64_t x0 __asm__("x0") = fn;
+    register uint64_t x1 __asm__("x1") = arg0;
+    register uint64_t x2 __asm__("x2") = arg1;
+    register uint64_t x3 __asm__("x3") = arg2;
+
+    if (smp.method == DTB_PSCI_SMC) {
+        __asm__ volatile("smc #0"
+                         : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                         :
+                         : "memory");
+    } else {
+        __asm__ volatile("hvc #0"
+                         : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3)
+                         :
+                         : "memory");
+    }
+
+    return (int64_t)x0;
+}
+
+/**
+ * Clean a buffer to the point of coherency
+ * Cores with their MMU off read memory uncached.
+ */
+static void clean_dcache_range(uint64_t start, size_t size)
+{
+    uint64_t addr = start & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+
+    for (; addr < start + size; addr += CACHE_LINE_SIZE) {
+        __asm__ volatile("dc cvac, %0" :: "r"(addr) : "memory");
+    }
+    __asm__ volatile("dsb sy" ::: "memory");
+}
+
+/**
+ * Fill in a boot record and start one secondary core
+ *
+ * @return 0 on success, -1 on error
+ */
+static int smp_boot_cpu(uint32_t cpu)
+{
+    smp_boot_record_t *rec = &boot_records[cpu];
+    uint64_t stack;
+    int64_t ret;
+
+    stack = pmm_alloc_pages(SMP_STACK_ORDER);
+    if (stack == 0) {
+        klog_error("SMP: no memory for CPU %u stack", cpu);
+        return -1;
+    }
+
+    /* Secondaries share the boot CPU's page tables and system setup */
+    rec->stack_top = stack + SMP_STACK_SIZE;
+    __asm__ volatile("mrs %0, mair_el1" : "=r"(rec->mair));
+    __asm__ volatile("mrs %0, tcr_el1" : "=r"(rec->tcr));
+    __asm__ volatile("mrs %0, ttbr0_el1" : "=r"(rec->ttbr0));
+    __asm__ volatile("mrs %0, sctlr_el1" : "=r"(rec->sctlr));
+    rec->cpu = cpu;
+    clean_dcache_range((uint64_t)rec, sizeof(*rec));
+
+    /* QEMU virt numbers cores 0..n-1 in MPIDR Aff0 */
+    ret = psci_call(PSCI_0_2_FN64_CPU_ON, cpu,
+                    (uint64_t)secondary_entry, (uint64_t)rec);
+    if (ret != PSCI_RET_SUCCESS) {
+        pmm_free_pages(stack, SMP_STACK_ORDER);
+        /* Not present: fewer cores than MAX_CPUS, nothing to report */
+        if (ret != PSCI_RET_INVALID_PARAMS) {
+            klog_warn("SMP: CPU_ON for CPU %u failed (%d)", cpu, (int32_t)ret);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Start the secondary cores
+ */
+uint32_t smp_init(void)
+{
+    uint32_t cpu;
+    uint64_t start;
+    uint64_t timeout;
+    int method;
+
+    klog_info("Starting secondary CPUs...");
+
+    smp.online[0] = true;
+    smp.num_online = 1;
+
+    /*
+     * The DTB names the conduit. Without one, QEMU's built-in PSCI answers
+     * SMC when the kernel was booted at EL2 and HVC when booted at EL1.
+     */
+    method = dtb_get_psci_method();
+    if (method < 0) {
+        method = (smp_boot_el >= 2) ? DTB_PSCI_SMC : DTB_PSCI_HVC;
+    }
+    smp.method = method;
+
+    if (smp_boot_el >= 3) {
+        /* No firmware to call: the cores stay parked in _start */
+        klog_warn("SMP: booted at EL3, no PSCI firmware - running on 1 CPU");
+        return smp.num_online;
+    }
+
+    kprintf("  PSCI conduit: %s\n", method == DTB_PSCI_SMC ? "smc" : "hvc");
+
+    for (cpu = 1; cpu < MAX_CPUS; cpu++) {
+        if (smp_boot_cpu(cpu) != 0) {
+            continue;
+        }
+
+        /* Wait up to 100ms for the core to come up */
+        timeout = timer_get_frequency() / 10;
+        start = timer_get_counter();
+        while (!smp.online[cpu] && timer_get_counter() - start < timeout) {
+            __asm__ volatile("yield");
+        }
+
+        if (smp.online[cpu]) {
+            smp.num_online++;
+        } else {
+            klog_warn("SMP: CPU %u did not come online", cpu);
+        }
+    }
+
+    klog_info("SMP: %u CPU(s) online", smp.num_online);
+    return smp.num_online;
+}
+
+/**
+ * C entry point of a secondary core
+ */
+void secondary_main(uint64_t cpu)
+{
+    /* Per-CPU interrupt controller, timer and PMU state */
+    gic_init_cpu();
+    timer_init_cpu();
+    pmu_init_cpu();
+
+    /* Own idle process and ready queue */
+    scheduler_init_cpu((uint32_t)cpu);
+
+    __asm__ volatile("dmb ish" ::: "memory");
+    smp.online[cpu] = true;
+
+    /* Run this CPU's ready queue (never returns, unmasks IRQs) */
+    scheduler_start();
+}
+
+/**
+ * Get the number of CPUs online
+ */
+uint32_t smp_num_online(void)
+{
+    return smp.num_online;
+}
+
+/**
+ * Check whether a CPU has come online
+ */
+bool smp_cpu_online(uint32_t cpu)
+{
+    return cpu < MAX_CPUS && smp.online[cpu];
+}
+
+/* ============================================================================
+ * End of smp.c
+ * ============================================================================ */
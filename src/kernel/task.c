@@ -0,0 +1,337 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/task.c
+ * Description: Cooperative tasks and futures for the GUI
+ * ============================================================================ */
+
+#include <aeos/task.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/spinlock.h>
+#include <aeos/timer.h>
+#include <aeos/vfs.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * The task list belongs to the main loop's process and has no lock. The
+ * futures list has one, because a helper walks it to find its future
+ * while the main loop adds and reaps others.
+ */
+
+static struct {
+    task_t *head;
+    task_t *tail;
+    uint32_t tasks;
+
+    spinlock_t lock;                    /* Protects the futures list */
+    future_t *futures;
+    uint32_t nr_futures;
+
+    void (*notify)(void);
+    uint64_t steps;
+    uint64_t passes;
+    uint64_t over_budget;
+    uint64_t max_step_ns;
+} rt = {
+    .lock = SPINLOCK_INIT,
+};
+
+/**
+ * Prepare a task
+ */
+void task_init(task_t *t, task_step_fn step, void *arg)
+{
+    memset(t, 0, sizeof(*t));
+    t->step = step;
+    t->arg = arg;
+}
+
+/**
+ * Put a task on the list
+ */
+bool task_spawn(task_t *t)
+{
+    if (t == NULL || t->step == NULL || t->queued) {
+        return false;
+    }
+
+    t->state = 0;
+    t->wait = NULL;
+    t->wake_ns = 0;
+    t->next = NULL;
+    t->queued = true;
+    if (rt.head == NULL) {
+        rt.head = t;
+    } else {
+        rt.tail->next = t;
+    }
+    rt.tail = t;
+    rt.tasks++;
+    return true;
+}
+
+/**
+ * Check whether a task is still on the list
+ */
+bool task_active(const task_t *t)
+{
+    return t != NULL && t->queued;
+}
+
+/**
+ * Set the function called when a future completes
+ */
+void task_set_notify(void (*notify)(void))
+{
+    rt.notify = notify;
+}
+
+/**
+ * Prepare a future
+ */
+void future_init(future_t *f)
+{
+    memset(f, 0, sizeof(*f));
+    f->out_fd = -1;
+    f->result = -1;
+}
+
+/**
+ * Entry of a helper process: run the future it was started for
+ */
+static void future_main(void)
+{
+    process_t *self = process_current();
+    void (*notify)(void);
+    future_t *f;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&rt.lock);
+    for (f = rt.futures; f != NULL && f->proc != self; f = f->next) {
+    }
+    spin_unlock_irqrestore(&rt.lock, flags);
+
+    if (f == NULL) {
+        return;
+    }
+
+    f->result = f->func(f->arg);
+
+    /* Reaped by the main loop once this process is gone */
+    __atomic_store_n(&f->done, true, __ATOMIC_RELEASE);
+    notify = rt.notify;
+    if (notify != NULL) {
+        notify();
+    }
+}
+
+/**
+ * Run func(arg) in a helper process
+ */
+int future_start(future_t *f, future_fn_t func, void *arg)
+{
+    process_t *proc;
+    uint64_t flags;
+
+    if (f == NULL || func == NULL || f->running) {
+        return -1;
+    }
+
+    f->func = func;
+    f->arg = arg;
+    f->result = -1;
+    f->done = false;
+
+    proc = process_alloc_stack(future_main, "async", TASK_FUTURE_STACK_ORDER);
+    if (proc == NULL) {
+        return -1;
+    }
+    if (f->out_fd >= 0) {
+        proc->stdout_fd = vfs_fd_install(proc->fd_table, f->out_fd);
+        if (proc->stdout_fd < 0) {
+            process_discard(proc);
+            return -1;
+        }
+    }
+
+    f->proc = proc;
+    f->running = true;
+    flags = spin_lock_irqsave(&rt.lock);
+    f->next = rt.futures;
+    rt.futures = f;
+    rt.nr_futures++;
+    spin_unlock_irqrestore(&rt.lock, flags);
+
+    scheduler_add_process(proc);
+    return 0;
+}
+
+/**
+ * Free the helpers of completed futures
+ * @return true if one has completed but is still on its way out
+ */
+static bool futures_reap(void)
+{
+    future_t *f, **link;
+    uint64_t flags;
+    bool left = false;
+
+    flags = spin_lock_irqsave(&rt.lock);
+    for (link = &rt.futures; (f = *link) != NULL; ) {
+        if (!__atomic_load_n(&f->done, __ATOMIC_ACQUIRE)) {
+            link = &f->next;
+            continue;
+        }
+        if (process_reap(f->proc) < 0) {
+            left = true;
+            link = &f->next;
+            continue;
+        }
+        *link = f->next;
+        f->next = NULL;
+        f->proc = NULL;
+        f->running = false;
+        rt.nr_futures--;
+    }
+    spin_unlock_irqrestore(&rt.lock, flags);
+
+    return left;
+}
+
+/**
+ * Check whether a future has completed and its helper is gone
+ */
+bool future_ready(future_t *f)
+{
+    if (f->running && f->done) {
+        futures_reap();
+    }
+    return !f->running;
+}
+
+/**
+ * Check whether a task's next step is due
+ */
+static bool task_due(task_t *t, uint64_t now)
+{
+    if (t->wait != NULL) {
+        return future_ready(t->wait);
+    }
+    return t->wake_ns == 0 || now >= t->wake_ns;
+}
+
+/**
+ * Take a finished task off the list
+ * @param prev The task before it, NULL if it is the head
+ */
+static void task_unlink(task_t *t, task_t *prev)
+{
+    if (prev == NULL) {
+        rt.head = t->next;
+    } else {
+        prev->next = t->next;
+    }
+    if (rt.tail == t) {
+        rt.tail = prev;
+    }
+    t->next = NULL;
+    t->queued = false;
+    rt.tasks--;
+}
+
+/**
+ * Run due steps until the budget is used up or nothing is due
+ */
+uint64_t task_run(uint64_t budget_ns)
+{
+    task_t *t, *prev, *next;
+    task_status_t status;
+    uint64_t start, now, took, due = TASK_NO_DEADLINE;
+    bool ran, any = false;
+
+    if (futures_reap()) {
+        due = 0;
+    }
+
+    start = now = timer_get_ns();
+    do {
+        ran = false;
+        for (prev = NULL, t = rt.head; t != NULL; t = next) {
+            next = t->next;
+            if (!task_due(t, now)) {
+                prev = t;
+                continue;
+            }
+            if (now - start >= budget_ns) {
+                rt.over_budget++;
+                goto out;
+            }
+
+            t->wait = NULL;
+            t->wake_ns = 0;
+            status = t->step(t);
+            t->steps++;
+            rt.steps++;
+            ran = any = true;
+
+            took = timer_get_ns() - now;
+            now += took;
+            if (took > rt.max_step_ns) {
+                rt.max_step_ns = took;
+            }
+
+            if (status == TASK_FINISHED) {
+                /* A step may have spawned tasks behind this one */
+                next = t->next;
+                task_unlink(t, prev);
+                if (t->on_finish != NULL) {
+                    t->on_finish(t);
+                }
+                continue;
+            }
+            prev = t;
+        }
+    } while (ran && now - start < budget_ns);
+
+out:
+    if (any) {
+        rt.passes++;
+    }
+
+    /* The next step is due now, at a wake time, or on a completion */
+    for (t = rt.head; t != NULL; t = t->next) {
+        if (t->wait != NULL) {
+            if (t->wait->done || !t->wait->running) {
+                due = 0;
+            }
+        } else if (t->wake_ns < due) {
+            due = t->wake_ns;
+        }
+    }
+
+    return (due < now) ? now : due;
+}
+
+/**
+ * Get task runtime statistics
+ */
+void task_get_stats(task_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->tasks = rt.tasks;
+    stats->futures = rt.nr_futures;
+    stats->steps = rt.steps;
+    stats->passes = rt.passes;
+    stats->over_budget = rt.over_budget;
+    stats->max_step_ns = rt.max_step_ns;
+}
+
+/* ============================================================================
+ * End of task.c
+ * ============================================================================ */
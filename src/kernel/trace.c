@@ -0,0 +1,366 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/trace.c
+ * Description: Static tracepoints and per-CPU binary trace rings
+ * ============================================================================ */
+
+#include <aeos/trace.h>
+#include <aeos/process.h>
+#include <aeos/semihosting.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/timer.h>
+#include <aeos/heap.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * Each CPU writes fixed-size records into its own ring with IRQs masked,
+ * so writers share no lock and no cache line. Positions only grow; the
+ * head is published with a store-release after the record is written.
+ * The oldest records are overwritten. A dump copies a record out and
+ * re-reads the head: if the writer has reached the record's slot again
+ * meanwhile, the copy is discarded.
+ */
+
+#define TRACE_RING_MASK     (TRACE_RING_RECORDS - 1)
+
+_Static_assert((TRACE_RING_RECORDS & TRACE_RING_MASK) == 0,
+               "TRACE_RING_RECORDS must be a power of two");
+_Static_assert(sizeof(trace_rec_t) == 32, "trace record must stay 32 bytes");
+
+/* Text written to the host in chunks of this size */
+#define TRACE_DUMP_CHUNK    4096
+
+typedef struct {
+    trace_rec_t *buf;
+    uint64_t head;                      /* Records written */
+    uint64_t start;                     /* Head at the last clear */
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_cpu_t;
+
+volatile uint32_t trace_mask;
+
+static struct {
+    trace_cpu_t cpus[MAX_CPUS];
+    spinlock_t lock;                    /* Serializes mask changes */
+} trace = {
+    .lock = SPINLOCK_INIT,
+};
+
+#define TRACE_EVENT_NAME(id, name, phase) name,
+static const char *const event_names[TRACE_NUM_EVENTS] = {
+    TRACE_EVENTS(TRACE_EVENT_NAME)
+};
+#undef TRACE_EVENT_NAME
+
+#define TRACE_EVENT_PHASE(id, name, phase) phase,
+static const char event_phases[TRACE_NUM_EVENTS] = {
+    TRACE_EVENTS(TRACE_EVENT_PHASE)
+};
+#undef TRACE_EVENT_PHASE
+
+/* ============================================================================
+ * Recording
+ * ============================================================================ */
+
+/**
+ * Write a record into the calling CPU's ring
+ */
+void trace_emit(uint32_t event, uint64_t a0, uint64_t a1)
+{
+    trace_cpu_t *tc;
+    trace_rec_t *rec;
+    process_t *cur;
+    uint64_t flags, head;
+    uint32_t cpu;
+
+    flags = irq_save();
+    cpu = smp_processor_id();
+    tc = &trace.cpus[cpu];
+
+    /* Enabled before this CPU saw the rings being allocated */
+    if (tc->buf == NULL) {
+        irq_restore(flags);
+        return;
+    }
+
+    head = tc->head;
+    rec = &tc->buf[head & TRACE_RING_MASK];
+    cur = process_current();
+
+    rec->ts = timer_get_counter();
+    rec->a0 = a0;
+    rec->a1 = a1;
+    rec->pid = cur != NULL ? (uint32_t)cur->pid : 0;
+    rec->event = (uint16_t)event;
+    rec->cpu = (uint8_t)cpu;
+    rec->reserved = 0;
+
+    __atomic_store_n(&tc->head, head + 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+/* ============================================================================
+ * Control
+ * ============================================================================ */
+
+/**
+ * Enable a set of events
+ */
+int trace_set_mask(uint32_t mask)
+{
+    uint64_t flags;
+    uint32_t cpu;
+
+    mask &= TRACE_ALL;
+    flags = spin_lock_irqsave(&trace.lock);
+
+    /* Allocated once and never freed: writers may hold them */
+    for (cpu = 0; mask != 0 && cpu < MAX_CPUS; cpu++) {
+        if (trace.cpus[cpu].buf == NULL) {
+            trace.cpus[cpu].buf = (trace_rec_t *)kmalloc(
+                TRACE_RING_RECORDS * sizeof(trace_rec_t));
+            if (trace.cpus[cpu].buf == NULL) {
+                spin_unlock_irqrestore(&trace.lock, flags);
+                klog_error("trace: Failed to allocate ring buffers");
+                return -1;
+            }
+        }
+    }
+
+    /* Rings before the mask that lets writers at them */
+    __asm__ volatile("dmb ish" ::: "memory");
+    trace_mask = mask;
+
+    spin_unlock_irqrestore(&trace.lock, flags);
+    return 0;
+}
+
+/**
+ * Forget the records held so far
+ */
+void trace_clear(void)
+{
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        __atomic_store_n(&trace.cpus[cpu].start,
+                         __atomic_load_n(&trace.cpus[cpu].head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Look up an event by name
+ */
+int trace_event_by_name(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < TRACE_NUM_EVENTS; i++) {
+        if (strcmp(event_names[i], name) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Name of an event
+ */
+const char *trace_event_name(uint32_t event)
+{
+    if (event >= TRACE_NUM_EVENTS) {
+        return "?";
+    }
+    return event_names[event];
+}
+
+/* ============================================================================
+ * Dump
+ * ============================================================================ */
+
+/* Output buffer for the dump */
+typedef struct {
+    int fd;
+    size_t len;
+    bool failed;
+    char buf[TRACE_DUMP_CHUNK];
+} dump_out_t;
+
+static void out_flush(dump_out_t *out)
+{
+    if (out->len != 0 && !out->failed &&
+        semihost_write(out->fd, out->buf, out->len) != 0) {
+        out->failed = true;
+    }
+    out->len = 0;
+}
+
+static void out_str(dump_out_t *out, const char *str)
+{
+    size_t n = strlen(str);
+
+    if (out->len + n > sizeof(out->buf)) {
+        out_flush(out);
+    }
+    memcpy(&out->buf[out->len], str, n);
+    out->len += n;
+}
+
+/* snprintf is 32-bit only, so 64-bit fields are formatted here */
+static void out_u64(dump_out_t *out, uint64_t val, bool hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint32_t base = hex ? 16 : 10;
+    char tmp[21];
+    char *p = &tmp[20];
+
+    *p = '\0';
+    do {
+        *--p = digits[val % base];
+        val /= base;
+    } while (val != 0);
+    out_str(out, p);
+}
+
+static uint64_t ticks_to_ns(uint64_t ticks, uint64_t freq)
+{
+    return (ticks / freq) * 1000000000ULL + ((ticks % freq) * 1000000000ULL) / freq;
+}
+
+/**
+ * Write one CPU's held records, oldest first
+ */
+static int dump_cpu(dump_out_t *out, trace_cpu_t *tc, uint64_t freq)
+{
+    trace_rec_t rec;
+    uint64_t pos, end, start, head;
+    int written = 0;
+
+    if (tc->buf == NULL) {
+        return 0;
+    }
+
+    /* Only what is there now: records written during the dump wait */
+    end = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+    start = __atomic_load_n(&tc->start, __ATOMIC_ACQUIRE);
+    pos = end > TRACE_RING_RECORDS ? end - TRACE_RING_RECORDS : 0;
+    if (pos < start) {
+        pos = start;
+    }
+
+    for (; pos < end; pos++) {
+        rec = tc->buf[pos & TRACE_RING_MASK];
+        __asm__ volatile("dmb ishld" ::: "memory");
+
+        /* Lapped: the writer has started on this slot again */
+        head = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+        if (head - pos >= TRACE_RING_RECORDS) {
+            continue;
+        }
+        if (rec.event >= TRACE_NUM_EVENTS) {
+            continue;
+        }
+
+        out_u64(out, ticks_to_ns(rec.ts, freq), false);
+        out_str(out, " ");
+        out_u64(out, rec.cpu, false);
+        out_str(out, " ");
+        out_u64(out, rec.pid, false);
+        out_str(out, " ");
+        out_str(out, event_names[rec.event]);
+        out_str(out, " ");
+        out_u64(out, rec.a0, true);
+        out_str(out, " ");
+        out_u64(out, rec.a1, true);
+        out_str(out, "\n");
+        written++;
+    }
+    return written;
+}
+
+/**
+ * Write the held records to a host file
+ */
+int trace_dump(const char *path)
+{
+    dump_out_t *out;
+    uint64_t freq = timer_get_frequency();
+    char phase[2] = { 0, 0 };
+    uint32_t i;
+    int written = 0;
+
+    if (path == NULL || freq == 0 || !semihost_available()) {
+        return -1;
+    }
+
+    out = (dump_out_t *)kmalloc(sizeof(dump_out_t));
+    if (out == NULL) {
+        return -1;
+    }
+
+    out->fd = semihost_open(path, SEMIHOST_OPEN_W);
+    if (out->fd < 0) {
+        kfree(out);
+        return -1;
+    }
+    out->len = 0;
+    out->failed = false;
+
+    /* Header: format version, then every event and its phase */
+    out_str(out, "# aeos-trace 1\n");
+    for (i = 0; i < TRACE_NUM_EVENTS; i++) {
+        phase[0] = event_phases[i];
+        out_str(out, "# event ");
+        out_str(out, event_names[i]);
+        out_str(out, " ");
+        out_str(out, phase);
+        out_str(out, "\n");
+    }
+    out_str(out, "# ns cpu pid event a0 a1\n");
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        written += dump_cpu(out, &trace.cpus[i], freq);
+    }
+
+    out_flush(out);
+    semihost_close(out->fd);
+    if (out->failed) {
+        written = -1;
+    }
+    kfree(out);
+    return written;
+}
+
+/**
+ * Get trace statistics
+ */
+void trace_get_stats(trace_stats_t *stats)
+{
+    trace_cpu_t *tc;
+    uint64_t head, start, held;
+    uint32_t cpu;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->mask = trace_mask;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        tc = &trace.cpus[cpu];
+        head = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+        start = __atomic_load_n(&tc->start, __ATOMIC_ACQUIRE);
+        held = head - start;
+        if (held > TRACE_RING_RECORDS) {
+            held = TRACE_RING_RECORDS;
+        }
+        stats->written += head;
+        stats->held += held;
+    }
+}
+
+/* ============================================================================
+ * End of trace.c
+ * ============================================================================ */
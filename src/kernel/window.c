@@ -5,14 +5,19 @@
  * ============================================================================ */
 
 #include <aeos/window.h>
+#include <aeos/wm.h>
 #include <aeos/framebuffer.h>
-#include <aeos/heap.h>
+#include <aeos/mm.h>
+#include <aeos/objpool.h>
 #include <aeos/string.h>
 #include <aeos/kprintf.h>
 
 /* Window ID counter */
 static uint32_t next_window_id = 1;
 
+/* Window structures (window_create() clears each one) */
+static objpool_t window_pool = OBJPOOL_INIT("window", window_t, NULL);
+
 /**
  * Update client area dimensions based on flags
  */
@@ -31,6 +36,46 @@ static void update_client_area(window_t *win)
     }
 }
 
+/**
+ * Mark a window-relative area of the backbuffer for re-rendering
+ */
+static void mark_dirty(window_t *win, int32_t x, int32_t y, int32_t w, int32_t h)
+{
+    rect_t r = { x, y, w, h };
+
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    if (win->flags & WINDOW_FLAG_DIRTY) {
+        rect_union(&win->dirty, &r, &win->dirty);
+    } else {
+        win->dirty = r;
+        win->flags |= WINDOW_FLAG_DIRTY;
+    }
+}
+
+/**
+ * Mark the whole window for re-rendering
+ */
+static void mark_all_dirty(window_t *win)
+{
+    mark_dirty(win, 0, 0, (int32_t)win->width, (int32_t)win->height);
+}
+
+/**
+ * Add the window's current screen area to the compositor's damage
+ */
+static void damage_window(window_t *win)
+{
+    rect_t r;
+
+    if (win->flags & WINDOW_FLAG_VISIBLE) {
+        window_outer_bounds(win, &r);
+        wm_add_damage(r.x, r.y, r.width, r.height);
+    }
+}
+
 /**
  * Create a new window
  */
@@ -39,7 +84,7 @@ window_t *window_create(const char *title, int32_t x, int32_t y,
 {
     window_t *win;
 
-    win = (window_t *)kmalloc(sizeof(window_t));
+    win = (window_t *)objpool_alloc(&window_pool);
     if (!win) {
         klog_error("Failed to allocate window");
         return NULL;
@@ -59,13 +104,14 @@ window_t *window_create(const char *title, int32_t x, int32_t y,
     win->width = width;
     win->height = height;
 
-    /* Default to decorated windows */
-    win->flags = flags | WINDOW_FLAG_DECORATED | WINDOW_FLAG_DIRTY;
+    /* Default to decorated windows, with nothing rendered yet */
+    win->flags = (flags | WINDOW_FLAG_DECORATED) & ~WINDOW_FLAG_DIRTY;
+    mark_all_dirty(win);
 
     /* Calculate client area */
     update_client_area(win);
 
-    /* No backbuffer by default (direct rendering) */
+    /* Backbuffer is allocated by the first window_render() */
     win->backbuffer = NULL;
     win->backbuffer_size = 0;
 
@@ -91,10 +137,10 @@ void window_destroy(window_t *win)
 
     /* Free backbuffer if allocated */
     if (win->backbuffer) {
-        kfree(win->backbuffer);
+        mm_free_huge(win->backbuffer, win->backbuffer_size);
     }
 
-    kfree(win);
+    objpool_free(&window_pool, win);
 }
 
 /**
@@ -103,7 +149,10 @@ void window_destroy(window_t *win)
 void window_show(window_t *win)
 {
     if (win) {
-        win->flags |= WINDOW_FLAG_VISIBLE | WINDOW_FLAG_DIRTY;
+        /* Changes made while hidden were not tracked */
+        win->flags |= WINDOW_FLAG_VISIBLE;
+        mark_all_dirty(win);
+        damage_window(win);
     }
 }
 
@@ -113,6 +162,8 @@ void window_show(window_t *win)
 void window_hide(window_t *win)
 {
     if (win) {
+        /* Uncover whatever was underneath */
+        damage_window(win);
         win->flags &= ~WINDOW_FLAG_VISIBLE;
     }
 }
@@ -125,7 +176,24 @@ void window_set_title(window_t *win, const char *title)
     if (win && title) {
         strncpy(win->title, title, WINDOW_TITLE_MAX - 1);
         win->title[WINDOW_TITLE_MAX - 1] = '\0';
-        win->flags |= WINDOW_FLAG_DIRTY;
+
+        /* Only the title bar changes */
+        window_invalidate_title(win);
+    }
+}
+
+/**
+ * Mark the title bar as needing redraw
+ */
+void window_invalidate_title(window_t *win)
+{
+    if (!win || !(win->flags & WINDOW_FLAG_DECORATED)) {
+        return;
+    }
+
+    mark_dirty(win, 0, 0, (int32_t)win->width, WINDOW_TITLE_HEIGHT);
+    if (win->flags & WINDOW_FLAG_VISIBLE) {
+        wm_add_damage(win->x, win->y, (int32_t)win->width, WINDOW_TITLE_HEIGHT);
     }
 }
 
@@ -135,10 +203,13 @@ void window_set_title(window_t *win, const char *title)
 void window_move(window_t *win, int32_t x, int32_t y)
 {
     if (win) {
+        /* Old position is uncovered, new position is painted; the
+         * contents are unchanged, so this is just a blit */
+        damage_window(win);
         win->x = x;
         win->y = y;
         update_client_area(win);
-        win->flags |= WINDOW_FLAG_DIRTY;
+        damage_window(win);
     }
 }
 
@@ -148,10 +219,12 @@ void window_move(window_t *win, int32_t x, int32_t y)
 void window_resize(window_t *win, uint32_t width, uint32_t height)
 {
     if (win) {
+        damage_window(win);
         win->width = width;
         win->height = height;
         update_client_area(win);
-        win->flags |= WINDOW_FLAG_DIRTY;
+        mark_all_dirty(win);
+        damage_window(win);
     }
 }
 
@@ -161,28 +234,94 @@ void window_resize(window_t *win, uint32_t width, uint32_t height)
 void window_invalidate(window_t *win)
 {
     if (win) {
-        win->flags |= WINDOW_FLAG_DIRTY;
+        mark_all_dirty(win);
+        damage_window(win);
     }
 }
 
+/**
+ * Mark part of the client area as needing redraw
+ */
+void window_invalidate_rect(window_t *win, int32_t x, int32_t y,
+                            uint32_t w, uint32_t h)
+{
+    rect_t area, client;
+
+    if (!win || !(win->flags & WINDOW_FLAG_VISIBLE)) {
+        return;
+    }
+
+    area.x = win->client_x + x;
+    area.y = win->client_y + y;
+    area.width = (int32_t)w;
+    area.height = (int32_t)h;
+    client.x = win->client_x;
+    client.y = win->client_y;
+    client.width = (int32_t)win->client_width;
+    client.height = (int32_t)win->client_height;
+
+    if (rect_intersect(&area, &client, &area)) {
+        mark_dirty(win, area.x - win->x, area.y - win->y, area.width, area.height);
+        wm_add_damage(area.x, area.y, area.width, area.height);
+    }
+}
+
+/**
+ * Scroll part of the client area up inside the backbuffer
+ */
+bool window_scroll(window_t *win, int32_t x, int32_t y,
+                   uint32_t w, uint32_t h, uint32_t dy)
+{
+    rect_t area, moved;
+    uint32_t *dst;
+    int32_t j;
+
+    if (!win || !win->backbuffer || !(win->flags & WINDOW_FLAG_VISIBLE) ||
+        x < 0 || y < 0 || x + w > win->client_width ||
+        y + h > win->client_height || dy >= h) {
+        return false;
+    }
+
+    /* Window-relative, like win->dirty */
+    area.x = win->client_x - win->x + x;
+    area.y = win->client_y - win->y + y;
+    area.width = (int32_t)w;
+    area.height = (int32_t)h;
+
+    /* Parts still waiting to be re-rendered move up with the pixels */
+    if ((win->flags & WINDOW_FLAG_DIRTY) &&
+        rect_intersect(&win->dirty, &area, &moved)) {
+        moved.y -= (int32_t)dy;
+        if (moved.y < area.y) {
+            moved.height -= area.y - moved.y;
+            moved.y = area.y;
+        }
+        mark_dirty(win, moved.x, moved.y, moved.width, moved.height);
+    }
+
+    dst = &win->backbuffer[area.y * (int32_t)win->width + area.x];
+    for (j = 0; j < area.height - (int32_t)dy; j++) {
+        memcpy(dst, dst + dy * win->width, w * 4);
+        dst += win->width;
+    }
+
+    wm_add_damage(win->x + area.x, win->y + area.y, area.width, area.height);
+    return true;
+}
+
 /**
  * Draw window decorations
- * Safe with partially off-screen windows (negative x/y coordinates)
+ * Safe with partially off-screen windows (negative x/y coordinates): every
+ * fb_* call clips to the drawing target, which may be the window's
+ * backbuffer rather than the screen.
  */
 void window_draw_decorations(window_t *win, bool focused)
 {
     uint32_t title_bg;
     uint32_t close_bg;
     int32_t close_x, close_y;
-    fb_info_t *fb = fb_get_info();
-
-    if (!win || !(win->flags & WINDOW_FLAG_DECORATED) || !fb || !fb->initialized) {
-        return;
-    }
 
-    /* Skip entirely off-screen windows */
-    if (win->x + (int32_t)win->width <= 0 || win->x >= (int32_t)fb->width ||
-        win->y + (int32_t)win->height <= 0 || win->y >= (int32_t)fb->height) {
+    if (!win || !(win->flags & WINDOW_FLAG_DECORATED)) {
         return;
     }
 
@@ -192,53 +331,83 @@ void window_draw_decorations(window_t *win, bool focused)
     /* Draw title bar — fb_fill_rect safely handles signed coordinates */
     fb_fill_rect(win->x, win->y, win->width, WINDOW_TITLE_HEIGHT, title_bg);
 
-    /* Draw title text if visible */
-    if (win->x + 8 >= 0 && win->y + 6 >= 0) {
-        fb_puts(win->x + 8, win->y + 6, win->title, WINDOW_TITLE_FG, title_bg);
-    }
+    /* Draw title text */
+    fb_puts(win->x + 8, win->y + 6, win->title, WINDOW_TITLE_FG, title_bg);
 
-    /* Draw close button if visible */
+    /* Draw close button */
     close_x = win->x + win->width - WINDOW_CLOSE_BTN_SIZE - 2;
     close_y = win->y + 2;
     close_bg = WINDOW_CLOSE_BTN_BG;
 
-    if (close_x >= 0 && close_y >= 0 &&
-        close_x < (int32_t)fb->width && close_y < (int32_t)fb->height) {
-        fb_fill_rect(close_x, close_y, WINDOW_CLOSE_BTN_SIZE, WINDOW_CLOSE_BTN_SIZE, close_bg);
+    fb_fill_rect(close_x, close_y, WINDOW_CLOSE_BTN_SIZE, WINDOW_CLOSE_BTN_SIZE, close_bg);
 
-        /* Draw X on close button */
-        int32_t cx = close_x + WINDOW_CLOSE_BTN_SIZE / 2;
-        int32_t cy = close_y + WINDOW_CLOSE_BTN_SIZE / 2;
-        fb_draw_line(cx - 4, cy - 4, cx + 4, cy + 4, WINDOW_TITLE_FG);
-        fb_draw_line(cx - 4, cy + 4, cx + 4, cy - 4, WINDOW_TITLE_FG);
-    }
+    /* Draw X on close button */
+    int32_t cx = close_x + WINDOW_CLOSE_BTN_SIZE / 2;
+    int32_t cy = close_y + WINDOW_CLOSE_BTN_SIZE / 2;
+    fb_draw_line(cx - 4, cy - 4, cx + 4, cy + 4, WINDOW_TITLE_FG);
+    fb_draw_line(cx - 4, cy + 4, cx + 4, cy - 4, WINDOW_TITLE_FG);
 
     /* Draw border — fb_draw_rect safely handles signed coordinates */
     fb_draw_rect(win->x, win->y, win->width, win->height, WINDOW_BORDER_COLOR);
 }
 
 /**
- * Draw window (decorations + content)
+ * Screen strips of a window's drop shadow
  */
-void window_draw(window_t *win)
+uint32_t window_shadow_rects(const window_t *win, rect_t out[2])
 {
-    bool focused;
-    fb_info_t *fb = fb_get_info();
+    int32_t s = WINDOW_SHADOW_SIZE;
+
+    if (!(win->flags & WINDOW_FLAG_DECORATED)) {
+        return 0;
+    }
+
+    /* The window's rect moved by s, less the window itself */
+    out[0].x = win->x + (int32_t)win->width;
+    out[0].y = win->y + s;
+    out[0].width = s;
+    out[0].height = (int32_t)win->height;
+    out[1].x = win->x + s;
+    out[1].y = win->y + (int32_t)win->height;
+    out[1].width = (int32_t)win->width - s;
+    out[1].height = s;
+    return 2;
+}
 
-    if (!win || !(win->flags & WINDOW_FLAG_VISIBLE)) {
-        return;
-    }
+/**
+ * Screen area a window changes: its bounds and its shadow
+ */
+void window_outer_bounds(const window_t *win, rect_t *r)
+{
+    int32_t s = (win->flags & WINDOW_FLAG_DECORATED) ? WINDOW_SHADOW_SIZE : 0;
 
-    /* Skip entirely off-screen windows */
-    if (fb && fb->initialized) {
-        if (win->x + (int32_t)win->width <= 0 || win->x >= (int32_t)fb->width ||
-            win->y + (int32_t)win->height <= 0 || win->y >= (int32_t)fb->height) {
-            win->flags &= ~WINDOW_FLAG_DIRTY;
-            return;
-        }
+    r->x = win->x;
+    r->y = win->y;
+    r->width = (int32_t)win->width + s;
+    r->height = (int32_t)win->height + s;
+}
+
+/**
+ * Blend a window's drop shadow over the target, within the clip
+ */
+void window_draw_shadow(const window_t *win)
+{
+    rect_t strips[2];
+    uint32_t n, i;
+
+    n = window_shadow_rects(win, strips);
+    for (i = 0; i < n; i++) {
+        fb_blend_rect(strips[i].x, strips[i].y, strips[i].width, strips[i].height,
+                      WINDOW_SHADOW_COLOR);
     }
+}
 
-    focused = (win->flags & WINDOW_FLAG_FOCUSED) != 0;
+/**
+ * Paint decorations and content into the current drawing target
+ */
+static void paint_window(window_t *win)
+{
+    bool focused = (win->flags & WINDOW_FLAG_FOCUSED) != 0;
 
     /* Draw decorations */
     window_draw_decorations(win, focused);
@@ -252,9 +421,94 @@ void window_draw(window_t *win)
     if (win->on_paint) {
         win->on_paint(win);
     }
+}
+
+/**
+ * Re-render the dirty part of the window into its backbuffer
+ */
+bool window_render(window_t *win)
+{
+    uint32_t size;
+    rect_t area;
+
+    if (!win || !(win->flags & WINDOW_FLAG_VISIBLE)) {
+        return false;
+    }
+
+    /* (Re)allocate to match the window size; a new buffer holds nothing */
+    size = win->width * win->height * 4;
+    if (win->backbuffer && win->backbuffer_size != size) {
+        mm_free_huge(win->backbuffer, win->backbuffer_size);
+        win->backbuffer = NULL;
+    }
+    if (!win->backbuffer) {
+        /* A huge buffer, so big windows stay off the heap */
+        win->backbuffer = (uint32_t *)mm_alloc_huge(size);
+        if (!win->backbuffer) {
+            /* Out of memory: window_draw() paints straight to the screen */
+            win->backbuffer_size = 0;
+            return false;
+        }
+        win->backbuffer_size = size;
+        mark_all_dirty(win);
+    }
+
+    if (!(win->flags & WINDOW_FLAG_DIRTY)) {
+        return false;
+    }
+
+    /* Paint in screen coordinates into the buffer, clipped to the dirty area */
+    area.x = win->x + win->dirty.x;
+    area.y = win->y + win->dirty.y;
+    area.width = win->dirty.width;
+    area.height = win->dirty.height;
+
+    fb_set_target(win->backbuffer, win->x, win->y, win->width, win->height);
+    fb_set_clip(&area);
+    paint_window(win);
+    fb_set_target(NULL, 0, 0, 0, 0);
 
-    /* Clear dirty flag */
     win->flags &= ~WINDOW_FLAG_DIRTY;
+    return true;
+}
+
+/**
+ * Draw window on screen
+ */
+void window_draw(window_t *win)
+{
+    if (!win || !(win->flags & WINDOW_FLAG_VISIBLE)) {
+        return;
+    }
+
+    /* Retained contents: a blit, clipped by the caller's clip rectangle */
+    if (win->backbuffer && !(win->flags & WINDOW_FLAG_DIRTY)) {
+        fb_blit(win->x, win->y, win->backbuffer, win->width, win->height,
+                win->width);
+        return;
+    }
+
+    /* No backbuffer: paint directly (the clip limits it to the damage) */
+    paint_window(win);
+}
+
+/**
+ * Free the backbuffer to give its memory back
+ */
+size_t window_drop_backbuffer(window_t *win)
+{
+    size_t pages;
+
+    if (!win || !win->backbuffer) {
+        return 0;
+    }
+
+    pages = PAGE_ALIGN_UP(win->backbuffer_size) >> PAGE_SHIFT;
+    mm_free_huge(win->backbuffer, win->backbuffer_size);
+    win->backbuffer = NULL;
+    win->backbuffer_size = 0;
+    mark_all_dirty(win);
+    return pages;
 }
 
 /**
@@ -417,6 +671,31 @@ void window_puts(window_t *win, int32_t x, int32_t y,
     fb_puts(abs_x, abs_y, text, fg, bg);
 }
 
+/**
+ * Draw a run of characters in client area
+ */
+void window_puts_run(window_t *win, int32_t x, int32_t y,
+                     const char *text, uint32_t len, uint32_t fg, uint32_t bg)
+{
+    uint32_t fit;
+
+    if (!win || !text) {
+        return;
+    }
+
+    /* Clip to client area, whole characters only */
+    if (x < 0 || y < 0 || x + 8 > (int32_t)win->client_width ||
+        y + 8 > (int32_t)win->client_height) {
+        return;
+    }
+    fit = (win->client_width - (uint32_t)x) / 8;
+    if (len > fit) {
+        len = fit;
+    }
+
+    fb_puts_run(win->client_x + x, win->client_y + y, text, len, fg, bg);
+}
+
 /**
  * Draw single character in client area
  */
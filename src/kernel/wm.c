@@ -8,12 +8,88 @@
 #include <aeos/window.h>
 #include <aeos/event.h>
 #include <aeos/framebuffer.h>
-#include <aeos/virtio_gpu.h>
 #include <aeos/virtio_input.h>
+#include <aeos/virtio_gpu.h>
+#include <aeos/uart.h>
 #include <aeos/desktop.h>
 #include <aeos/timer.h>
+#include <aeos/mm.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/task.h>
+#include <aeos/screenrec.h>
+#include <aeos/shrinker.h>
+#include <aeos/spinlock.h>
 #include <aeos/kprintf.h>
 #include <aeos/string.h>
+#include <aeos/trace.h>
+
+/*
+ * Damage tracking
+ *
+ * Anything that changes what is on screen adds the changed area to a short
+ * list of dirty rectangles, and a frame repaints only that area. A new rect
+ * is merged into an overlapping or nearby one when their bounding box
+ * wastes at most WM_DAMAGE_SLACK pixels (rect_list_add), which keeps the
+ * list short without turning two small, distant rects into one large one.
+ */
+#define WM_MAX_DAMAGE       16
+#define WM_DAMAGE_SLACK     1024    /* Pixels a merge may add */
+
+/*
+ * Occlusion
+ *
+ * Windows are opaque, so a damage rect is composited top to bottom: each
+ * window paints the parts of the rect it covers and they are cut out of
+ * the rect before the windows below see it. The desktop gets what is left.
+ * Every pixel is painted once, and windows that are covered never paint.
+ * A rect is cut into at most WM_MAX_PIECES pieces; past that, the rest of
+ * it is painted back to front as before.
+ */
+#define WM_MAX_PIECES       32
+
+/* Events taken from the queue at a time */
+#define WM_EVENT_BATCH      16
+
+/*
+ * Main loop
+ *
+ * wm_run() sleeps until something needs it: input (the event queue's
+ * notify hook, called from the input interrupts), damage added from
+ * outside the loop, a window's tick deadline such as the terminal cursor
+ * blink, or the next minute on the taskbar clock. Damage is presented at
+ * most once per refresh period, so a burst of input becomes one frame and
+ * an idle desktop makes no frames at all. UART fallback input wakes the
+ * loop from the UART's RX interrupt; only before that is enabled is it
+ * polled every WM_UART_POLL_MS.
+ */
+#define WM_REFRESH_HZ       60      /* Default frame rate cap */
+#define WM_MAX_REFRESH_HZ   240
+#define WM_UART_POLL_MS     10
+
+/*
+ * Frame timing
+ *
+ * wm_present() times the steps of each frame with timer_get_ns() and keeps
+ * the total of the last WM_FRAME_HISTORY frames in a ring, from which the
+ * moving FPS, percentiles and histogram are worked out when asked for.
+ * While the desktop's HUD is up, the taskbar is repainted every
+ * WM_HUD_REFRESH_MS so its figures stay current on an idle desktop.
+ */
+#define WM_HUD_REFRESH_MS   500
+#define WM_HUD_KEY          KEY_F12
+
+/*
+ * Memory pressure
+ *
+ * Backbuffers only save repainting, so the "wm-backbuffers" shrinker frees
+ * them, bottom window first, and marks the windows dirty: the next frame
+ * that shows one re-renders it into a new buffer, or paints it straight to
+ * the screen if there is no memory for one. The shrinker only tries the
+ * window manager lock, which wm_run() drops just for its idle wait, so it
+ * never frees a buffer that is being painted, and frees nothing when the
+ * allocation that ran out of memory was made by the loop itself.
+ */
 
 /* Window manager state */
 static struct {
@@ -38,13 +114,60 @@ static struct {
     /* Desktop paint callback */
     wm_desktop_paint_fn desktop_paint;
 
-    /* Cursor backup buffer */
+    /* Dirty rectangles for the next frame */
+    rect_t damage[WM_MAX_DAMAGE];
+    uint32_t damage_count;
+    rect_t frame_damage[WM_MAX_DAMAGE];   /* Painted by the last redraw */
+    uint64_t clock_minute;      /* Taskbar clock last painted */
+
+    /* Statistics */
+    uint64_t frames;
+    uint64_t frame_dirty_pixels;
+    uint32_t frame_damage_rects;
+    uint64_t total_dirty_pixels;
+    uint32_t frame_window_paints;
+    uint64_t total_window_paints;
+    uint32_t frame_windows_occluded;
+
+    /* Frame timing */
+    uint64_t frame_paint_ns;    /* Set by wm_redraw() */
+    uint64_t frame_composite_ns;
+    uint64_t frame_cursor_ns;
+    uint64_t frame_present_ns;
+    uint64_t frame_pixels;
+    uint64_t history_ns[WM_FRAME_HISTORY];      /* Frame times, a ring */
+    uint64_t history_end[WM_FRAME_HISTORY];     /* When each was presented */
+    uint64_t history_count;     /* Frames recorded since boot */
+    uint64_t hud_next_ms;       /* Uptime of the next HUD repaint */
+
+    /* Cursor sprite (built from cursor_bitmap) and backup buffer */
+    uint32_t cursor_image[CURSOR_WIDTH * CURSOR_HEIGHT];
     uint32_t cursor_backup[CURSOR_WIDTH * CURSOR_HEIGHT];
     int32_t cursor_backup_x;
     int32_t cursor_backup_y;
     bool cursor_backup_valid;
+
+    /* Hardware cursor plane: position last sent to the display */
+    bool hw_cursor;
+    int32_t hw_cursor_x;
+    int32_t hw_cursor_y;
+
+    /* Main loop */
+    process_t *proc;            /* Running wm_run(), woken by wm_wake() */
+    volatile bool wake_pending;
+    uint32_t refresh_hz;
+    uint64_t frame_ns;          /* Refresh period */
+    uint64_t next_frame;        /* Earliest timer_get_ns() for the next frame */
+    uint64_t wakeups;
 } wm;
 
+/* Outside wm, which wm_init() clears with a shrinker already registered */
+static spinlock_t wm_spinlock = SPINLOCK_INIT;
+static bool wm_shrinker_registered;
+
+/* Cursor drop shadow: translucent black (premultiplied) */
+#define CURSOR_SHADOW   0x50000000
+
 /* Mouse cursor bitmap (arrow) */
 static const uint8_t cursor_bitmap[CURSOR_HEIGHT][CURSOR_WIDTH] = {
     {1,0,0,0,0,0,0,0,0,0,0,0},
@@ -69,6 +192,134 @@ static const uint8_t cursor_bitmap[CURSOR_HEIGHT][CURSOR_WIDTH] = {
     {0,0,0,0,0,0,0,0,1,1,0,0}
 };
 
+/**
+ * Add a rectangle to the damage list, merging where it pays off
+ */
+static void add_damage_rect(rect_t r)
+{
+    rect_t screen = { 0, 0, fb_width(), fb_height() };
+
+    if (rect_intersect(&r, &screen, &r)) {
+        rect_list_add(wm.damage, &wm.damage_count, WM_MAX_DAMAGE, &r,
+                      WM_DAMAGE_SLACK);
+    }
+}
+
+/**
+ * Add a screen area to the next frame's damage
+ */
+void wm_add_damage(int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    rect_t r;
+
+    if (!wm.initialized || width <= 0 || height <= 0) {
+        return;
+    }
+
+    r.x = x;
+    r.y = y;
+    r.width = width;
+    r.height = height;
+    add_damage_rect(r);
+
+    /* The loop's own damage is presented before it sleeps */
+    if (process_current() != wm.proc) {
+        wm_wake();
+    }
+}
+
+/**
+ * Damage the whole screen
+ */
+void wm_damage_all(void)
+{
+    if (!wm.initialized) {
+        return;
+    }
+
+    wm.damage[0].x = 0;
+    wm.damage[0].y = 0;
+    wm.damage[0].width = fb_width();
+    wm.damage[0].height = fb_height();
+    wm.damage_count = 1;
+
+    if (process_current() != wm.proc) {
+        wm_wake();
+    }
+}
+
+/**
+ * Damage the taskbar's window buttons (the strip takes in the clock and HUD)
+ * The start button and the taskbar's background never change.
+ */
+static void damage_taskbar(void)
+{
+    wm_add_damage(TASKBAR_BUTTONS_X, fb_height() - TASKBAR_HEIGHT,
+                  fb_width() - TASKBAR_BUTTONS_X, TASKBAR_HEIGHT);
+}
+
+/**
+ * Damage the taskbar clock
+ */
+static void damage_clock(void)
+{
+    wm_add_damage(TASKBAR_CLOCK_X, fb_height() - TASKBAR_HEIGHT,
+                  TASKBAR_CLOCK_WIDTH, TASKBAR_HEIGHT);
+}
+
+/**
+ * Damage the performance HUD
+ */
+static void damage_hud(void)
+{
+    wm_add_damage(TASKBAR_HUD_X, fb_height() - TASKBAR_HEIGHT,
+                  TASKBAR_HUD_WIDTH, TASKBAR_HEIGHT);
+}
+
+/**
+ * Damage the area under the cursor at (x, y)
+ */
+static void damage_cursor(int32_t x, int32_t y)
+{
+    wm_add_damage(x, y, CURSOR_WIDTH, CURSOR_HEIGHT);
+}
+
+/**
+ * Send the mouse position to the hardware cursor plane
+ * Called once per input poll, so a burst of motion events costs one move.
+ * If the display stops taking moves, the cursor goes back to software.
+ */
+static void sync_hw_cursor(void)
+{
+    if (!wm.hw_cursor ||
+        (wm.mouse_x == wm.hw_cursor_x && wm.mouse_y == wm.hw_cursor_y)) {
+        return;
+    }
+
+    if (fb_cursor_move(wm.mouse_x, wm.mouse_y, wm.mouse_visible) != 0) {
+        klog_warn("WM: hardware cursor failed, drawing it in software");
+        wm.hw_cursor = false;
+        damage_cursor(wm.mouse_x, wm.mouse_y);
+        return;
+    }
+
+    wm.hw_cursor_x = wm.mouse_x;
+    wm.hw_cursor_y = wm.mouse_y;
+}
+
+/**
+ * Damage a window's screen area
+ */
+static void damage_window(window_t *win)
+{
+    rect_t r;
+
+    if (win->flags & WINDOW_FLAG_VISIBLE) {
+        window_outer_bounds(win, &r);
+        wm_add_damage(r.x, r.y, r.width, r.height);
+    }
+}
+
 /**
  * Save area under cursor
  */
@@ -102,32 +353,69 @@ static void save_cursor_background(int32_t x, int32_t y)
  */
 static void restore_cursor_background(void)
 {
-    int32_t i, j;
     fb_info_t *fb = fb_get_info();
 
     if (!fb || !fb->initialized || !wm.cursor_backup_valid) {
         return;
     }
 
-    for (j = 0; j < CURSOR_HEIGHT; j++) {
-        for (i = 0; i < CURSOR_WIDTH; i++) {
-            int32_t px = wm.cursor_backup_x + i;
-            int32_t py = wm.cursor_backup_y + j;
-            if (px >= 0 && px < (int32_t)fb->width &&
-                py >= 0 && py < (int32_t)fb->height) {
-                fb_putpixel(px, py, wm.cursor_backup[j * CURSOR_WIDTH + i]);
-            }
-        }
-    }
+    /* Off-screen parts of the backup were never saved; the clip skips them */
+    fb_blit(wm.cursor_backup_x, wm.cursor_backup_y, wm.cursor_backup,
+            CURSOR_WIDTH, CURSOR_HEIGHT, CURSOR_WIDTH);
 
     wm.cursor_backup_valid = false;
 }
 
+/**
+ * Shrinker: count the pages held by backbuffers
+ */
+static size_t wm_shrink_count(void)
+{
+    window_t *win;
+    size_t pages = 0;
+
+    if (!wm_trylock()) {
+        return 0;
+    }
+    for (win = wm.window_list; win != NULL; win = win->next) {
+        pages += PAGE_ALIGN_UP(win->backbuffer_size) >> PAGE_SHIFT;
+    }
+    wm_unlock();
+    return pages;
+}
+
+/**
+ * Shrinker: free backbuffers, bottom window first, until nr pages are freed
+ */
+static size_t wm_shrink_scan(size_t nr)
+{
+    window_t *win;
+    size_t freed = 0;
+
+    if (!wm_trylock()) {
+        return 0;
+    }
+    for (win = wm.window_list; win != NULL && freed < nr; win = win->next) {
+        freed += window_drop_backbuffer(win);
+    }
+    wm_unlock();
+    return freed;
+}
+
+/* Gives back the windows' backbuffers (Memory pressure, above) */
+static shrinker_t wm_shrinker = {
+    .name = "wm-backbuffers",
+    .count = wm_shrink_count,
+    .scan = wm_shrink_scan,
+};
+
 /**
  * Initialize window manager
  */
 void wm_init(void)
 {
+    int32_t i, j;
+
     klog_info("Initializing window manager...");
 
     memset(&wm, 0, sizeof(wm));
@@ -139,16 +427,50 @@ void wm_init(void)
     wm.initialized = true;
     wm.should_exit = false;
     wm.needs_redraw = true;
+    wm.damage_count = 0;
 
-    wm.mouse_x = FB_WIDTH / 2;
-    wm.mouse_y = FB_HEIGHT / 2;
+    wm.mouse_x = fb_width() / 2;
+    wm.mouse_y = fb_height() / 2;
     wm.mouse_visible = true;
 
     wm.drag_window = NULL;
     wm.desktop_paint = NULL;
     wm.cursor_backup_valid = false;
 
-    klog_info("Window manager initialized");
+    wm_set_refresh_rate(WM_REFRESH_HZ);
+
+    /* Cursor sprite, premultiplied for fb_blit_alpha() */
+    for (j = 0; j < CURSOR_HEIGHT; j++) {
+        for (i = 0; i < CURSOR_WIDTH; i++) {
+            switch (cursor_bitmap[j][i]) {
+                case 1:  /* Black outline */
+                    wm.cursor_image[j * CURSOR_WIDTH + i] = 0xFF000000;
+                    break;
+                case 2:  /* White fill */
+                    wm.cursor_image[j * CURSOR_WIDTH + i] = 0xFFFFFFFF;
+                    break;
+                default:  /* Transparent, or shadow below-right of the arrow */
+                    wm.cursor_image[j * CURSOR_WIDTH + i] =
+                        (i > 0 && j > 0 && cursor_bitmap[j - 1][i - 1] != 0) ?
+                        CURSOR_SHADOW : 0;
+                    break;
+            }
+        }
+    }
+
+    /* A cursor plane moves without repainting; else draw it in software */
+    wm.hw_cursor = fb_cursor_define(wm.cursor_image, CURSOR_WIDTH, CURSOR_HEIGHT, 0, 0) == 0 &&
+                   fb_cursor_move(wm.mouse_x, wm.mouse_y, wm.mouse_visible) == 0;
+    wm.hw_cursor_x = wm.mouse_x;
+    wm.hw_cursor_y = wm.mouse_y;
+
+    /* Each GUI run calls this again */
+    if (!wm_shrinker_registered) {
+        shrinker_register(&wm_shrinker);
+        wm_shrinker_registered = true;
+    }
+
+    klog_info("Window manager initialized (%s cursor)", wm.hw_cursor ? "hardware" : "software");
 }
 
 /**
@@ -181,7 +503,8 @@ void wm_register_window(window_t *win)
     /* Focus new window */
     wm_focus_window(win);
 
-    wm.needs_redraw = true;
+    damage_window(win);
+    damage_taskbar();
 
     klog_debug("Registered window %u: '%s' (total: %u)",
                win->id, win->title, wm.window_count);
@@ -221,10 +544,14 @@ void wm_unregister_window(window_t *win)
         wm.focused = wm.top_window;
         if (wm.focused) {
             wm.focused->flags |= WINDOW_FLAG_FOCUSED;
+            window_invalidate_title(wm.focused);
+            damage_window(wm.focused);
         }
     }
 
-    wm.needs_redraw = true;
+    /* Uncover whatever was underneath */
+    damage_window(win);
+    damage_taskbar();
 
     klog_debug("Unregistered window %u: '%s' (remaining: %u)",
                win->id, win->title, wm.window_count);
@@ -244,10 +571,10 @@ void wm_focus_window(window_t *win)
         return;
     }
 
-    /* Remove focus from old window */
+    /* Remove focus from old window (title bar colour changes) */
     if (wm.focused && wm.focused != win) {
         wm.focused->flags &= ~WINDOW_FLAG_FOCUSED;
-        wm.focused->flags |= WINDOW_FLAG_DIRTY;
+        window_invalidate_title(wm.focused);
     }
 
     /* Move window to top of list */
@@ -271,11 +598,15 @@ void wm_focus_window(window_t *win)
         wm.top_window = win;
     }
 
-    /* Set focus */
-    win->flags |= WINDOW_FLAG_FOCUSED | WINDOW_FLAG_DIRTY;
+    /* Set focus; raising it may uncover parts of it */
+    if (!(win->flags & WINDOW_FLAG_FOCUSED)) {
+        win->flags |= WINDOW_FLAG_FOCUSED;
+        window_invalidate_title(win);
+    }
     wm.focused = win;
 
-    wm.needs_redraw = true;
+    damage_window(win);
+    damage_taskbar();
 }
 
 /**
@@ -304,28 +635,262 @@ window_t *wm_window_at(int32_t x, int32_t y)
 }
 
 /**
- * Redraw all windows
+ * Screen area of a window
  */
-void wm_redraw(void)
+static void window_bounds(window_t *win, rect_t *r)
 {
-    window_t *win;
+    r->x = win->x;
+    r->y = win->y;
+    r->width = (int32_t)win->width;
+    r->height = (int32_t)win->height;
+}
+
+/**
+ * Cut a rectangle out of every piece of a region
+ * @return false if the result would not fit (region unchanged)
+ */
+static bool region_subtract(rect_t *region, uint32_t *count, const rect_t *r)
+{
+    rect_t out[WM_MAX_PIECES];
+    rect_t rest[4];
+    uint32_t n = 0, i, k, m;
+
+    for (i = 0; i < *count; i++) {
+        m = rect_subtract(&region[i], r, rest);
+        if (n + m > WM_MAX_PIECES) {
+            return false;
+        }
+        for (k = 0; k < m; k++) {
+            out[n++] = rest[k];
+        }
+    }
 
-    /* Draw desktop background */
+    memcpy(region, out, n * sizeof(rect_t));
+    *count = n;
+    return true;
+}
+
+/**
+ * Check whether any part of a window is on screen and not covered
+ */
+static bool window_exposed(window_t *win)
+{
+    rect_t region[WM_MAX_PIECES];
+    rect_t screen = { 0, 0, fb_width(), fb_height() };
+    rect_t bounds;
+    uint32_t count = 1;
+    window_t *above;
+
+    if (!(win->flags & WINDOW_FLAG_VISIBLE)) {
+        return false;
+    }
+
+    window_bounds(win, &bounds);
+    if (!rect_intersect(&bounds, &screen, &region[0])) {
+        return false;
+    }
+
+    for (above = win->next; above != NULL && count > 0; above = above->next) {
+        if (!(above->flags & WINDOW_FLAG_VISIBLE)) {
+            continue;
+        }
+        window_bounds(above, &bounds);
+        if (!region_subtract(region, &count, &bounds)) {
+            /* Too fragmented to tell */
+            return true;
+        }
+    }
+
+    return count > 0;
+}
+
+/**
+ * Paint the desktop over the clip rectangle
+ */
+static void paint_desktop(void)
+{
     if (wm.desktop_paint) {
         wm.desktop_paint();
     } else {
         /* Default background */
         fb_clear(0xFF202040);
     }
+}
+
+/**
+ * Painter's algorithm over one rect: desktop, then each window's shadow
+ * and the window itself, bottom to top
+ */
+static void paint_back_to_front(const rect_t *r)
+{
+    rect_t bounds, area;
+    window_t *win;
+
+    fb_set_clip(r);
+    paint_desktop();
 
-    /* Draw windows from bottom to top */
     for (win = wm.window_list; win != NULL; win = win->next) {
         if (win->flags & WINDOW_FLAG_VISIBLE) {
-            window_draw(win);
+            window_outer_bounds(win, &bounds);
+            if (rect_intersect(&bounds, r, &area)) {
+                window_draw_shadow(win);
+                window_draw(win);
+            }
+        }
+    }
+}
+
+/**
+ * Blend the window shadows that fall in a composited rect
+ * Bottom to top, each over the parts no window above it covers, so
+ * shadows stack like the windows do.
+ *
+ * @return false if a shadow was too fragmented to clip (rect unfinished)
+ */
+static bool composite_shadows(const rect_t *damage)
+{
+    rect_t region[WM_MAX_PIECES];
+    rect_t strips[2], bounds;
+    uint32_t n, s, count, i;
+    window_t *win, *above;
+
+    for (win = wm.window_list; win != NULL; win = win->next) {
+        if (!(win->flags & WINDOW_FLAG_VISIBLE)) {
+            continue;
+        }
+
+        n = window_shadow_rects(win, strips);
+        for (s = 0; s < n; s++) {
+            if (!rect_intersect(&strips[s], damage, &region[0])) {
+                continue;
+            }
+            count = 1;
+            for (above = win->next; above != NULL && count > 0; above = above->next) {
+                if (!(above->flags & WINDOW_FLAG_VISIBLE)) {
+                    continue;
+                }
+                window_bounds(above, &bounds);
+                if (!region_subtract(region, &count, &bounds)) {
+                    return false;
+                }
+            }
+            for (i = 0; i < count; i++) {
+                fb_set_clip(&region[i]);
+                window_draw_shadow(win);
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Composite one damage rect, front to back with occlusion
+ */
+static void composite_rect(const rect_t *damage)
+{
+    rect_t pieces[WM_MAX_PIECES];
+    rect_t bounds, area;
+    uint32_t count = 1, i;
+    window_t *win;
+
+    pieces[0] = *damage;
+
+    for (win = wm.top_window; win != NULL && count > 0; win = win->prev) {
+        if (!(win->flags & WINDOW_FLAG_VISIBLE)) {
+            continue;
+        }
+
+        /* The window paints only the exposed parts of the rect */
+        window_bounds(win, &bounds);
+        for (i = 0; i < count; i++) {
+            if (rect_intersect(&pieces[i], &bounds, &area)) {
+                fb_set_clip(&area);
+                window_draw(win);
+            }
+        }
+
+        /* ... and hides them from everything below */
+        if (!region_subtract(pieces, &count, &bounds)) {
+            paint_back_to_front(damage);
+            return;
+        }
+    }
+
+    /* Whatever no window covers shows the desktop */
+    for (i = 0; i < count; i++) {
+        fb_set_clip(&pieces[i]);
+        paint_desktop();
+    }
+
+    /* Shadows darken what is already there, so they come last */
+    if (!composite_shadows(damage)) {
+        paint_back_to_front(damage);
+    }
+}
+
+/**
+ * Repaint the damaged areas
+ * Exposed windows whose contents changed first re-render into their
+ * backbuffers; covered ones stay dirty until they are uncovered. Each dirty
+ * rect is then composited with occlusion (composite_rect).
+ */
+void wm_redraw(void)
+{
+    rect_t *damage = wm.frame_damage;
+    uint32_t count, i;
+    uint32_t paints = 0, occluded = 0;
+    uint64_t pixels = 0;
+    uint64_t start, paint_start, paint_ns = 0;
+    window_t *win;
+
+    start = timer_get_ns();
+
+    if (wm.needs_redraw) {
+        wm_damage_all();
+        wm.needs_redraw = false;
+    }
+
+    /* Bring backbuffers up to date; only windows whose contents changed paint */
+    for (win = wm.window_list; win != NULL; win = win->next) {
+        if (!(win->flags & WINDOW_FLAG_VISIBLE)) {
+            continue;
+        }
+        if (!window_exposed(win)) {
+            occluded++;
+            continue;
         }
+        paint_start = timer_get_ns();
+        if (window_render(win)) {
+            win->paint_ns = timer_get_ns() - paint_start;
+            win->paint_total_ns += win->paint_ns;
+            win->paints++;
+            paint_ns += win->paint_ns;
+            paints++;
+        }
+    }
+
+    /* Damage added while painting (e.g. by paint callbacks) is for the next frame */
+    count = wm.damage_count;
+    memcpy(damage, wm.damage, count * sizeof(rect_t));
+    wm.damage_count = 0;
+
+    for (i = 0; i < count; i++) {
+        pixels += rect_area(&damage[i]);
+        composite_rect(&damage[i]);
     }
 
-    wm.needs_redraw = false;
+    fb_set_clip(NULL);
+
+    wm.frames++;
+    wm.frame_damage_rects = count;
+    wm.frame_dirty_pixels = pixels;
+    wm.total_dirty_pixels += pixels;
+    wm.frame_window_paints = paints;
+    wm.frame_windows_occluded = occluded;
+    wm.total_window_paints += paints;
+    wm.frame_paint_ns = paint_ns;
+    wm.frame_composite_ns = timer_get_ns() - start - paint_ns;
 }
 
 /**
@@ -333,11 +898,9 @@ void wm_redraw(void)
  */
 void wm_draw_cursor(void)
 {
-    int32_t i, j;
-    uint32_t color;
     fb_info_t *fb = fb_get_info();
 
-    if (!fb || !fb->initialized || !wm.mouse_visible) {
+    if (!fb || !fb->initialized || !wm.mouse_visible || wm.hw_cursor) {
         return;
     }
 
@@ -345,51 +908,119 @@ void wm_draw_cursor(void)
     save_cursor_background(wm.mouse_x, wm.mouse_y);
 
     /* Draw cursor */
-    for (j = 0; j < CURSOR_HEIGHT; j++) {
-        for (i = 0; i < CURSOR_WIDTH; i++) {
-            int32_t px = wm.mouse_x + i;
-            int32_t py = wm.mouse_y + j;
+    fb_blit_alpha(wm.mouse_x, wm.mouse_y, wm.cursor_image,
+                  CURSOR_WIDTH, CURSOR_HEIGHT, CURSOR_WIDTH);
+}
 
-            if (px < 0 || px >= (int32_t)fb->width ||
-                py < 0 || py >= (int32_t)fb->height) {
-                continue;
-            }
+/**
+ * Run window ticks and update the taskbar clock
+ * @return Uptime (ms) by which the next tick is due
+ */
+static uint64_t wm_tick(void)
+{
+    window_t *win, *next;
+    uint64_t minute, due, now;
+
+    /* Taskbar clock shows hh:mm */
+    minute = timer_get_uptime_sec() / 60;
+    if (minute != wm.clock_minute) {
+        wm.clock_minute = minute;
+        damage_clock();
+    }
+    due = (minute + 1) * 60000ULL;
 
-            switch (cursor_bitmap[j][i]) {
-                case 1:  /* Black outline */
-                    color = 0xFF000000;
-                    break;
-                case 2:  /* White fill */
-                    color = 0xFFFFFFFF;
-                    break;
-                default:  /* Transparent */
-                    continue;
-            }
+    /* The HUD's figures change without anything else on screen doing so */
+    if (desktop_hud_visible()) {
+        now = timer_get_uptime_ms();
+        if (now >= wm.hud_next_ms) {
+            wm.hud_next_ms = now + WM_HUD_REFRESH_MS;
+            damage_hud();
+        }
+        if (wm.hud_next_ms < due) {
+            due = wm.hud_next_ms;
+        }
+    }
 
-            fb_putpixel(px, py, color);
+    /* Window timers, e.g. cursor blinking */
+    for (win = wm.window_list; win != NULL; win = next) {
+        next = win->next;
+        if ((win->flags & WINDOW_FLAG_VISIBLE) && win->on_tick) {
+            win->on_tick(win);
+            if (win->tick_deadline != 0 && win->tick_deadline < due) {
+                due = win->tick_deadline;
+            }
         }
     }
+
+    return due;
 }
 
 /**
- * Update display
+ * Check whether there is anything to present
  */
-void wm_update_display(void)
+static inline bool wm_frame_pending(void)
+{
+    return wm.damage_count > 0 || wm.needs_redraw;
+}
+
+/**
+ * Repaint the damaged areas and show the frame
+ */
+static void wm_present(void)
 {
+    /* Nothing changed on screen: skip the frame */
+    virtio_gpu_stats_t gpu;
+    uint64_t start, cursor_start, present_start, pixels, end;
+    uint32_t slot;
+
+    if (!wm_frame_pending()) {
+        return;
+    }
+    TRACEPOINT(WM_FRAME_BEGIN, 0, 0);
+    start = timer_get_ns();
+
     /* Restore cursor background before redraw */
     restore_cursor_background();
+    cursor_start = timer_get_ns();
 
-    /* Redraw if needed */
-    if (wm.needs_redraw) {
-        wm_redraw();
-        wm.needs_redraw = false;  /* Clear flag after redraw */
-    }
+    /* Repaint the damaged areas */
+    wm_redraw();
 
     /* Draw cursor */
+    present_start = timer_get_ns();
     wm_draw_cursor();
+    wm.frame_cursor_ns = (cursor_start - start) + (timer_get_ns() - present_start);
+
+    /* Show the frame; only the repainted areas go to the GPU (silently) */
+    virtio_gpu_get_stats(&gpu);
+    pixels = gpu.pixels_transferred;
+    present_start = timer_get_ns();
+    fb_swap_buffers(wm.frame_damage, wm.frame_damage_rects);
+    end = timer_get_ns();
+    virtio_gpu_get_stats(&gpu);
+
+    wm.frame_present_ns = end - present_start;
+    wm.frame_pixels = gpu.pixels_transferred - pixels;
+
+    slot = (uint32_t)(wm.history_count % WM_FRAME_HISTORY);
+    wm.history_ns[slot] = end - start;
+    wm.history_end[slot] = end;
+    wm.history_count++;
+    TRACEPOINT(WM_FRAME_END, wm.frame_damage_rects, wm.frame_dirty_pixels);
+
+    /* Encoded after the frame is timed; the host writes happen elsewhere */
+    if (screenrec_active()) {
+        screenrec_frame(wm.frame_damage, wm.frame_damage_rects);
+    }
+}
 
-    /* Send to GPU (silently) */
-    virtio_gpu_update_display();
+/**
+ * Update display
+ */
+void wm_update_display(void)
+{
+    wm_tick();
+    wm_present();
 }
 
 /**
@@ -461,16 +1092,18 @@ static void handle_mouse_button(mouse_event_t *mouse, bool pressed)
  */
 static void handle_mouse_move(mouse_event_t *mouse)
 {
+    /* Old and new cursor positions both change on screen (software cursor) */
+    if (!wm.hw_cursor && (mouse->x != wm.mouse_x || mouse->y != wm.mouse_y)) {
+        damage_cursor(wm.mouse_x, wm.mouse_y);
+        damage_cursor(mouse->x, mouse->y);
+    }
+
     /* Update cursor position */
     wm.mouse_x = mouse->x;
     wm.mouse_y = mouse->y;
 
-    /* Cursor is drawn via save/restore, so no full redraw needed for moves.
-       Only set needs_redraw when dragging (window position changes). */
-
-    /* Handle dragging */
+    /* Handle dragging (window_move damages the old and new position) */
     if (wm.drag_window) {
-        wm.needs_redraw = true;
         int32_t new_x = mouse->x - wm.drag_start_x;
         int32_t new_y = mouse->y - wm.drag_start_y;
 
@@ -478,12 +1111,12 @@ static void handle_mouse_move(mouse_event_t *mouse)
         if (new_x < -(int32_t)(wm.drag_window->width - 40)) {
             new_x = -(int32_t)(wm.drag_window->width - 40);
         }
-        if (new_x > (int32_t)FB_WIDTH - 40) {
-            new_x = FB_WIDTH - 40;
+        if (new_x > fb_width() - 40) {
+            new_x = fb_width() - 40;
         }
         if (new_y < 0) new_y = 0;
-        if (new_y > (int32_t)FB_HEIGHT - WINDOW_TITLE_HEIGHT) {
-            new_y = FB_HEIGHT - WINDOW_TITLE_HEIGHT;
+        if (new_y > fb_height() - WINDOW_TITLE_HEIGHT) {
+            new_y = fb_height() - WINDOW_TITLE_HEIGHT;
         }
 
         window_move(wm.drag_window, new_x, new_y);
@@ -499,6 +1132,14 @@ static void handle_key(key_event_t *key, bool pressed)
         return;  /* Only handle key down */
     }
 
+    /* The performance HUD's hotkey is the desktop's, whatever has focus */
+    if (key->keycode == WM_HUD_KEY) {
+        desktop_toggle_hud();
+        wm.hud_next_ms = 0;
+        damage_taskbar();
+        return;
+    }
+
     /* Debug: show key in title bar to verify keyboard events reach WM */
     if (wm.focused) {
         char debug_title[WINDOW_TITLE_MAX];
@@ -519,7 +1160,6 @@ static void handle_key(key_event_t *key, bool pressed)
             snprintf(debug_title, sizeof(debug_title), "%s [k%d]", base, key->keycode);
         }
         window_set_title(wm.focused, debug_title);
-        wm.needs_redraw = true;
     }
 
     /* Pass to focused window */
@@ -559,38 +1199,135 @@ void wm_handle_event(event_t *event)
     }
 }
 
+/**
+ * Follow a change of the display's resolution
+ * Everything is repainted at the new size. Windows that would be left off
+ * screen are pulled back, and so is the mouse.
+ */
+static void wm_follow_mode(void)
+{
+    window_t *win;
+    int32_t x, y;
+
+    if (virtio_gpu_resize() <= 0) {
+        return;
+    }
+
+    if (wm.mouse_x >= fb_width()) {
+        wm.mouse_x = fb_width() - 1;
+    }
+    if (wm.mouse_y >= fb_height()) {
+        wm.mouse_y = fb_height() - 1;
+    }
+    event_set_mouse_pos(wm.mouse_x, wm.mouse_y);
+    wm.cursor_backup_valid = false;
+
+    for (win = wm.window_list; win != NULL; win = win->next) {
+        x = win->x;
+        y = win->y;
+        if (x > fb_width() - 40) {
+            x = fb_width() - 40;
+        }
+        if (y > fb_height() - WINDOW_TITLE_HEIGHT) {
+            y = fb_height() - WINDOW_TITLE_HEIGHT;
+        }
+        if (x != win->x || y != win->y) {
+            window_move(win, x, y);
+        }
+    }
+
+    desktop_invalidate();
+    wm.needs_redraw = true;
+}
+
 /**
  * Main window manager loop
  */
 void wm_run(void)
 {
-    event_t event;
-    uint64_t last_update = 0;
-    uint64_t now;
+    event_t events[WM_EVENT_BATCH];
+    uint64_t now, now_ms, due, deadline, task_due;
+    uint32_t n, i;
 
-    klog_info("Starting window manager main loop");
+    klog_info("Starting window manager main loop (%u Hz)", wm.refresh_hz);
 
+    wm.proc = process_current();
+    event_set_notify(wm_wake);
+    uart_set_rx_notify(wm_wake);
+    virtio_gpu_set_mode_notify(wm_wake);
+    task_set_notify(wm_wake);
+
+    wm_lock();
     while (!wm.should_exit) {
-        /* Poll input devices */
+        /* Anything signalled from here on runs the loop again */
+        wm.wake_pending = false;
+        wm.wakeups++;
+
+        /* The host window was resized */
+        if (virtio_gpu_mode_pending()) {
+            wm_follow_mode();
+        }
+
+        /* Poll input devices (virtio-input only checks its rings in memory) */
         event_poll();
         virtio_input_poll();
 
         /* Process all pending events */
-        while (event_pop(&event)) {
-            wm_handle_event(&event);
+        while ((n = event_pop_many(events, WM_EVENT_BATCH)) > 0) {
+            for (i = 0; i < n; i++) {
+                wm_handle_event(&events[i]);
+            }
         }
 
-        /* Update display periodically (30 FPS) */
-        now = timer_get_uptime_ms();
-        if (now - last_update >= 33 || wm.needs_redraw) {
-            wm_update_display();
-            last_update = now;
+        /* The cursor plane follows the mouse between frames */
+        sync_hw_cursor();
+
+        due = wm_tick();
+        now_ms = timer_get_uptime_ms();
+        now = timer_get_ns();
+        deadline = now + (due > now_ms ? due - now_ms : 0) * 1000000ULL;
+
+        /* Background work gets a slice of each pass, before the frame */
+        task_due = task_run(TASK_BUDGET_NS);
+        if (task_due < deadline) {
+            deadline = task_due;
+        }
+        now = timer_get_ns();
+
+        /* At most one frame per refresh period; later damage waits for it */
+        if (wm_frame_pending()) {
+            if (now >= wm.next_frame) {
+                wm_present();
+                wm.next_frame = now + wm.frame_ns;
+            } else if (wm.next_frame < deadline) {
+                deadline = wm.next_frame;
+            }
+        }
+
+        if (!virtio_keyboard_available() && !uart_rx_irq_enabled() &&
+            now + WM_UART_POLL_MS * 1000000ULL < deadline) {
+            deadline = now + WM_UART_POLL_MS * 1000000ULL;
         }
 
-        /* Small delay to prevent busy looping */
-        timer_delay_ms(1);
+        /* The CPU idles until input, outside damage or the deadline */
+        wm_unlock();
+        timer_wait_until(deadline, &wm.wake_pending);
+        wm_lock();
+    }
+
+    event_set_notify(NULL);
+    uart_set_rx_notify(NULL);
+    virtio_gpu_set_mode_notify(NULL);
+    task_set_notify(NULL);
+    wm.proc = NULL;
+
+    /* The text console has no use for the cursor plane */
+    if (wm.hw_cursor) {
+        fb_cursor_move(wm.mouse_x, wm.mouse_y, false);
     }
 
+    wm_unlock();
+
     klog_info("Window manager exiting");
 }
 
@@ -600,6 +1337,62 @@ void wm_run(void)
 void wm_request_exit(void)
 {
     wm.should_exit = true;
+    wm_wake();
+}
+
+/**
+ * Wake the main loop
+ */
+void wm_wake(void)
+{
+    process_t *proc = wm.proc;
+
+    /* Visible before the wakeup that makes the loop look at it */
+    wm.wake_pending = true;
+    __asm__ volatile("dmb ish" ::: "memory");
+
+    if (proc != NULL) {
+        scheduler_wake(proc);
+    }
+}
+
+/**
+ * Take the window manager lock
+ */
+void wm_lock(void)
+{
+    spin_lock(&wm_spinlock);
+}
+
+/**
+ * Try to take the window manager lock
+ */
+bool wm_trylock(void)
+{
+    return spin_trylock(&wm_spinlock);
+}
+
+/**
+ * Release the window manager lock
+ */
+void wm_unlock(void)
+{
+    spin_unlock(&wm_spinlock);
+}
+
+/**
+ * Set the frame rate cap
+ */
+void wm_set_refresh_rate(uint32_t hz)
+{
+    if (hz == 0) {
+        hz = WM_REFRESH_HZ;
+    } else if (hz > WM_MAX_REFRESH_HZ) {
+        hz = WM_MAX_REFRESH_HZ;
+    }
+
+    wm.refresh_hz = hz;
+    wm.frame_ns = 1000000000ULL / hz;
 }
 
 /**
@@ -626,6 +1419,81 @@ window_t *wm_get_window_list(void)
     return wm.window_list;
 }
 
+/**
+ * Get compositor statistics
+ */
+void wm_get_stats(wm_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    stats->frames = wm.frames;
+    stats->frame_dirty_pixels = wm.frame_dirty_pixels;
+    stats->frame_damage_rects = wm.frame_damage_rects;
+    stats->total_dirty_pixels = wm.total_dirty_pixels;
+    stats->frame_window_paints = wm.frame_window_paints;
+    stats->total_window_paints = wm.total_window_paints;
+    stats->frame_windows_occluded = wm.frame_windows_occluded;
+    stats->pending_damage_rects = wm.damage_count;
+    stats->wakeups = wm.wakeups;
+    stats->refresh_hz = wm.refresh_hz;
+}
+
+/**
+ * Get frame timing over the last WM_FRAME_HISTORY frames
+ */
+void wm_get_frame_stats(wm_frame_stats_t *stats)
+{
+    uint64_t sorted[WM_FRAME_HISTORY];
+    uint64_t now, v;
+    uint32_t n, i, j, b;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    if (wm.history_count == 0) {
+        return;
+    }
+
+    now = timer_get_ns();
+    n = wm.history_count < WM_FRAME_HISTORY ? (uint32_t)wm.history_count
+                                            : WM_FRAME_HISTORY;
+
+    stats->history = n;
+    stats->frame_ns = wm.history_ns[(wm.history_count - 1) % WM_FRAME_HISTORY];
+    stats->paint_ns = wm.frame_paint_ns;
+    stats->composite_ns = wm.frame_composite_ns;
+    stats->cursor_ns = wm.frame_cursor_ns;
+    stats->present_ns = wm.frame_present_ns;
+    stats->pixels = wm.frame_pixels;
+
+    /* Few enough for an insertion sort; the histogram comes along */
+    for (i = 0; i < n; i++) {
+        v = wm.history_ns[i];
+        if (now - wm.history_end[i] < 1000000000ULL) {
+            stats->fps++;
+        }
+
+        b = 0;
+        while (b < WM_FRAME_BUCKETS - 1 && v >= (1000000ULL << b)) {
+            b++;
+        }
+        stats->histogram[b]++;
+
+        for (j = i; j > 0 && sorted[j - 1] > v; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = v;
+    }
+
+    stats->p50_ns = sorted[n / 2];
+    stats->p99_ns = sorted[(n * 99) / 100];
+    stats->max_ns = sorted[n - 1];
+}
+
 /**
  * Get window count
  */
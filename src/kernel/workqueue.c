@@ -0,0 +1,282 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/kernel/workqueue.c
+ * Description: Kernel workqueue run by worker processes
+ * ============================================================================ */
+
+#include <aeos/workqueue.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/spinlock.h>
+#include <aeos/timer.h>
+#include <aeos/trace.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * One FIFO feeds every worker. An idle worker blocks on a flag of its
+ * own; queue_work() hands the item's wakeup to one idle worker, so a
+ * burst of items wakes at most as many workers as are idle.
+ */
+
+/* A worker process */
+typedef struct {
+    process_t *proc;
+    volatile bool kick;                 /* Set by queue_work() to wake it */
+    bool idle;                          /* Blocked waiting for work */
+    bool busy;                          /* Running an item */
+    uint64_t items;
+} wq_worker_t;
+
+static const char *const worker_names[WORKQUEUE_WORKERS] = {
+    "kworker/0", "kworker/1"
+};
+
+static struct {
+    spinlock_t lock;                    /* Protects everything below */
+    work_t *head;
+    work_t *tail;
+    uint32_t pending;
+    uint32_t started;                   /* Workers running */
+    wq_worker_t workers[WORKQUEUE_WORKERS];
+    uint64_t queued;
+    irq_stat_t wait;
+    irq_stat_t run;
+} wq = {
+    .lock = SPINLOCK_INIT,
+};
+
+/**
+ * Append a work item to the queue (lock held)
+ */
+static void wq_enqueue(work_t *work)
+{
+    work->next = NULL;
+    if (wq.head == NULL) {
+        wq.head = work;
+    } else {
+        wq.tail->next = work;
+    }
+    wq.tail = work;
+    wq.pending++;
+}
+
+/**
+ * Pop the head of the queue (lock held)
+ */
+static work_t *wq_dequeue(void)
+{
+    work_t *work = wq.head;
+
+    if (work != NULL) {
+        wq.head = work->next;
+        if (wq.head == NULL) {
+            wq.tail = NULL;
+        }
+        work->next = NULL;
+        wq.pending--;
+    }
+    return work;
+}
+
+/**
+ * Pick an idle worker to wake (lock held)
+ * @return Its process, NULL if every worker is busy
+ */
+static process_t *wq_claim_idle(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < wq.started; i++) {
+        if (wq.workers[i].idle) {
+            wq.workers[i].idle = false;
+            wq.workers[i].kick = true;
+            return wq.workers[i].proc;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run one work item (lock not held)
+ */
+static void wq_run(work_t *work, uint64_t queued_at)
+{
+    work_fn_t func = work->func;
+    uint64_t start;
+
+    start = timer_get_counter();
+    irq_stat_add(&wq.wait, start - queued_at);
+
+    TRACEPOINT(WORK_START, (uintptr_t)work, (uintptr_t)func);
+    func(work->arg);
+    TRACEPOINT(WORK_DONE, (uintptr_t)work, (uintptr_t)func);
+
+    irq_stat_add(&wq.run, timer_get_counter() - start);
+}
+
+/**
+ * Worker process: run queued items, block while there are none
+ */
+static void worker_main(void)
+{
+    wq_worker_t *self;
+    work_t *work;
+    uint64_t flags, queued_at;
+
+    flags = spin_lock_irqsave(&wq.lock);
+    self = &wq.workers[wq.started++];
+    self->proc = process_current();
+    spin_unlock_irqrestore(&wq.lock, flags);
+
+    for (;;) {
+        flags = spin_lock_irqsave(&wq.lock);
+
+        work = wq_dequeue();
+        if (work == NULL) {
+            self->idle = true;
+            self->kick = false;
+            spin_unlock(&wq.lock);
+
+            /* IRQs stay masked until blocked, so a kick can't slip by */
+            scheduler_block_unless(&self->kick);
+            irq_restore(flags);
+            continue;
+        }
+
+        work->pending = false;
+        work->running = true;
+        queued_at = work->queued_at;
+        self->busy = true;
+        spin_unlock_irqrestore(&wq.lock, flags);
+
+        wq_run(work, queued_at);
+
+        flags = spin_lock_irqsave(&wq.lock);
+        self->busy = false;
+        self->items++;
+        work->running = false;
+        if (work->again) {
+            work->again = false;
+            wq_enqueue(work);
+        }
+        spin_unlock_irqrestore(&wq.lock, flags);
+    }
+}
+
+/**
+ * Start the worker processes
+ */
+int workqueue_init(void)
+{
+    uint32_t i, started = 0;
+
+    for (i = 0; i < WORKQUEUE_WORKERS; i++) {
+        if (process_create(worker_main, worker_names[i]) == NULL) {
+            klog_error("Workqueue: failed to start %s", worker_names[i]);
+            continue;
+        }
+        started++;
+    }
+
+    if (started == 0) {
+        return -1;
+    }
+    klog_info("Workqueue: %u workers", started);
+    return 0;
+}
+
+/**
+ * Prepare a work item
+ */
+void work_init(work_t *work, work_fn_t func, void *arg)
+{
+    memset(work, 0, sizeof(*work));
+    work->func = func;
+    work->arg = arg;
+}
+
+/**
+ * Queue a work item on the system workqueue
+ */
+bool queue_work(work_t *work)
+{
+    process_t *wake = NULL;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&wq.lock);
+
+    if (work->pending) {
+        spin_unlock_irqrestore(&wq.lock, flags);
+        return false;
+    }
+
+    work->pending = true;
+    work->queued_at = timer_get_counter();
+    wq.queued++;
+    if (work->running) {
+        /* Its worker queues it again when this run is over */
+        work->again = true;
+    } else {
+        wq_enqueue(work);
+        wake = wq_claim_idle();
+    }
+
+    spin_unlock_irqrestore(&wq.lock, flags);
+
+    if (wake != NULL) {
+        scheduler_wake(wake);
+    }
+    return true;
+}
+
+/**
+ * Check whether a work item is queued or running
+ */
+bool work_busy(const work_t *work)
+{
+    return work->pending || work->running;
+}
+
+/**
+ * Wait until a work item is neither queued nor running
+ */
+void work_flush(work_t *work)
+{
+    while (work_busy(work)) {
+        yield();
+    }
+}
+
+/**
+ * Get workqueue statistics
+ */
+void workqueue_get_stats(workqueue_stats_t *stats)
+{
+    uint64_t flags;
+    uint32_t i;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    flags = spin_lock_irqsave(&wq.lock);
+    stats->wait = wq.wait;
+    stats->run = wq.run;
+    stats->queued = wq.queued;
+    stats->pending = wq.pending;
+    stats->workers = wq.started;
+    for (i = 0; i < wq.started; i++) {
+        stats->worker[i].pid = wq.workers[i].proc->pid;
+        stats->worker[i].items = wq.workers[i].items;
+        stats->worker[i].busy = wq.workers[i].busy;
+    }
+    spin_unlock_irqrestore(&wq.lock, flags);
+}
+
+/* ============================================================================
+ * End of workqueue.c
+ * ============================================================================ */
@@ -0,0 +1,359 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/lib/format.c
+ * Description: printf-style formatting engine, shared by kprintf and snprintf
+ * ============================================================================ */
+
+#include <aeos/format.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/* Longest converted number: 20 decimal digits of a uint64_t */
+#define FMT_NUM_MAX     24
+
+/* Conversion flags */
+#define FMT_LEFT        0x1             /* '-': pad on the right */
+#define FMT_ZERO        0x2             /* '0': pad numbers with zeroes */
+#define FMT_UPPER       0x4             /* %X */
+
+/* "00" to "99": the digit pairs decimal conversion copies */
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+/**
+ * Make room for at least one byte
+ * @return false if the output is full and has no flush
+ */
+static inline bool fmt_room(fmt_out_t *out)
+{
+    if (out->len < out->size) {
+        return true;
+    }
+    if (out->flush != NULL) {
+        out->flush(out);
+    }
+    return out->len < out->size;
+}
+
+/**
+ * Append one byte
+ */
+static inline void fmt_putc(fmt_out_t *out, char c)
+{
+    if (fmt_room(out)) {
+        out->buf[out->len++] = c;
+    }
+    out->total++;
+}
+
+/**
+ * Append bytes to an output buffer unformatted
+ */
+void fmt_write(fmt_out_t *out, const char *s, size_t len)
+{
+    size_t n;
+
+    out->total += len;
+    while (len > 0 && fmt_room(out)) {
+        n = out->size - out->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out->buf + out->len, s, n);
+        out->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+/**
+ * Append a byte n times
+ */
+static void fmt_pad(fmt_out_t *out, char c, int n)
+{
+    for (; n > 0; n--) {
+        fmt_putc(out, c);
+    }
+}
+
+/**
+ * Convert to decimal, ending at end
+ * @return Digits written, backwards from end
+ */
+static int fmt_decimal(char *end, uint64_t value)
+{
+    char *p = end;
+    uint32_t pair;
+
+    while (value >= 100) {
+        pair = (uint32_t)(value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+    }
+    if (value >= 10) {
+        pair = (uint32_t)value * 2;
+        p -= 2;
+        p[0] = digit_pairs[pair];
+        p[1] = digit_pairs[pair + 1];
+    } else {
+        *--p = (char)('0' + value);
+    }
+    return (int)(end - p);
+}
+
+/**
+ * Convert to hexadecimal, ending at end, at least min_digits long
+ * @return Digits written, backwards from end
+ */
+static int fmt_hex(char *end, uint64_t value, bool upper, int min_digits)
+{
+    const char *digits = upper ? hex_upper : hex_lower;
+    char *p = end;
+
+    do {
+        *--p = digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0 || (end - p) < min_digits);
+    return (int)(end - p);
+}
+
+/**
+ * Append a converted field with its padding
+ * @param prefix Sign or "0x", which zero padding goes after
+ */
+static void fmt_field(fmt_out_t *out, const char *prefix, int prefix_len,
+                      const char *digits, int len, int width, uint32_t flags)
+{
+    int padding = width - prefix_len - len;
+
+    if (padding > 0 && !(flags & (FMT_LEFT | FMT_ZERO))) {
+        fmt_pad(out, ' ', padding);
+    }
+    fmt_write(out, prefix, (size_t)prefix_len);
+    if (padding > 0 && (flags & FMT_ZERO) && !(flags & FMT_LEFT)) {
+        fmt_pad(out, '0', padding);
+    }
+    fmt_write(out, digits, (size_t)len);
+    if (padding > 0 && (flags & FMT_LEFT)) {
+        fmt_pad(out, ' ', padding);
+    }
+}
+
+/**
+ * Format into an output buffer
+ */
+int fmt_vformat(fmt_out_t *out, const char *fmt, va_list args)
+{
+    char num[FMT_NUM_MAX];
+    char *end = num + sizeof(num);
+    size_t start = out->total;
+    const char *run, *str;
+    uint32_t flags;
+    int width, precision, len, size;
+    uint64_t uval;
+    int64_t sval;
+    char c;
+
+    while (*fmt != '\0') {
+        /* Literal text up to the next conversion in one copy */
+        run = fmt;
+        while (*fmt != '\0' && *fmt != '%') {
+            fmt++;
+        }
+        if (fmt != run) {
+            fmt_write(out, run, (size_t)(fmt - run));
+        }
+        if (*fmt == '\0') {
+            break;
+        }
+        fmt++;
+
+        flags = 0;
+        for (;; fmt++) {
+            if (*fmt == '-') {
+                flags |= FMT_LEFT;
+            } else if (*fmt == '0') {
+                flags |= FMT_ZERO;
+            } else {
+                break;
+            }
+        }
+
+        width = 0;
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FMT_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        /* Only %s uses a precision */
+        precision = -1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(args, int);
+                fmt++;
+                /* A negative precision is taken as if it were omitted */
+                if (precision < 0) {
+                    precision = -1;
+                }
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    precision = precision * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+
+        /*
+         * Argument size in bits. long, long long, size_t, intmax_t and
+         * ptrdiff_t are all 64-bit; h and hh narrow the promoted int.
+         */
+        size = 32;
+        while (*fmt == 'l' || *fmt == 'z' || *fmt == 'j' || *fmt == 't' || *fmt == 'h') {
+            if (*fmt == 'h') {
+                size = (size == 16) ? 8 : 16;
+            } else {
+                size = 64;
+            }
+            fmt++;
+        }
+
+        c = *fmt;
+        if (c == '\0') {
+            fmt_putc(out, '%');
+            break;
+        }
+        fmt++;
+
+        switch (c) {
+        case 'd':
+        case 'i':
+            if (size == 64) {
+                sval = va_arg(args, int64_t);
+            } else if (size == 16) {
+                sval = (int16_t)va_arg(args, int);
+            } else if (size == 8) {
+                sval = (int8_t)va_arg(args, int);
+            } else {
+                sval = va_arg(args, int);
+            }
+            uval = (sval < 0) ? (uint64_t)0 - (uint64_t)sval : (uint64_t)sval;
+            len = fmt_decimal(end, uval);
+            fmt_field(out, "-", (sval < 0) ? 1 : 0, end - len, len, width, flags);
+            break;
+
+        case 'u':
+        case 'x':
+        case 'X':
+            if (size == 64) {
+                uval = va_arg(args, uint64_t);
+            } else if (size == 16) {
+                uval = (uint16_t)va_arg(args, unsigned int);
+            } else if (size == 8) {
+                uval = (uint8_t)va_arg(args, unsigned int);
+            } else {
+                uval = va_arg(args, unsigned int);
+            }
+            if (c == 'u') {
+                len = fmt_decimal(end, uval);
+            } else {
+                len = fmt_hex(end, uval, c == 'X', 1);
+            }
+            fmt_field(out, "", 0, end - len, len, width, flags);
+            break;
+
+        case 'p':
+            uval = (uint64_t)(uintptr_t)va_arg(args, void *);
+            len = fmt_hex(end, uval, false, 16);
+            fmt_field(out, "0x", 2, end - len, len, width, flags & ~FMT_ZERO);
+            break;
+
+        case 's':
+            str = va_arg(args, const char *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            len = 0;
+            while ((precision < 0 || len < precision) && str[len] != '\0') {
+                len++;
+            }
+            fmt_field(out, "", 0, str, len, width, flags & ~FMT_ZERO);
+            break;
+
+        case 'c':
+            num[0] = (char)va_arg(args, int);
+            fmt_field(out, "", 0, num, 1, width, flags & ~FMT_ZERO);
+            break;
+
+        case '%':
+            fmt_putc(out, '%');
+            break;
+
+        default:
+            /* Unknown conversion: print it as it is */
+            fmt_putc(out, '%');
+            fmt_putc(out, c);
+            break;
+        }
+    }
+
+    return (int)(out->total - start);
+}
+
+/**
+ * Format into a buffer
+ */
+int vsnprintf(char *buf, size_t size, const char *fmt, va_list args)
+{
+    fmt_out_t out;
+
+    if (buf == NULL || size == 0 || fmt == NULL) {
+        return 0;
+    }
+
+    /* The last byte is kept for the terminator */
+    out.buf = buf;
+    out.size = size - 1;
+    out.len = 0;
+    out.total = 0;
+    out.flush = NULL;
+
+    fmt_vformat(&out, fmt, args);
+    buf[out.len] = '\0';
+    return (int)out.len;
+}
+
+/**
+ * Format into a buffer
+ */
+int snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = vsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+/* ============================================================================
+ * End of format.c
+ * ============================================================================ */
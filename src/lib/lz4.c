@@ -0,0 +1,260 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/lib/lz4.c
+ * Description: LZ4 block compression implementation
+ * ============================================================================ */
+
+#include <aeos/lz4.h>
+#include <aeos/string.h>
+#include <aeos/types.h>
+
+/*
+ * A block is a run of sequences. Each sequence is a token byte (literal
+ * count in the high nibble, match length - 4 in the low one), any extra
+ * length bytes, the literals, a 16-bit little-endian match offset and any
+ * extra match length bytes. The last sequence has literals only.
+ */
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5     /* A block ends in at least this many literals */
+#define LZ4_MF_LIMIT      12    /* No match starts closer than this to the end */
+#define LZ4_MAX_OFFSET    65535
+
+/**
+ * Load 4 bytes (unaligned)
+ */
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Hash the 4 bytes at a position
+ */
+static inline uint32_t lz4_hash(const uint8_t *p)
+{
+    return (lz4_read32(p) * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * Write the extra bytes of a length of 15 or more
+ */
+static uint8_t *lz4_put_length(uint8_t *op, size_t n)
+{
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+/**
+ * Write one sequence; a match length of 0 means literals only
+ * @return New output position, NULL if it does not fit
+ */
+static uint8_t *lz4_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                                 size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t *token;
+
+    /* Token, lengths, literals and offset */
+    if ((size_t)(oend - op) < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1) {
+        return NULL;
+    }
+
+    token = op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = lz4_put_length(op, lit_len - 15);
+    } else {
+        *token = (uint8_t)(lit_len << 4);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    match_len -= LZ4_MIN_MATCH;
+    if (match_len >= 15) {
+        *token |= 15;
+        op = lz4_put_length(op, match_len - 15);
+    } else {
+        *token |= (uint8_t)match_len;
+    }
+    return op;
+}
+
+/**
+ * Compress a block
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap, uint16_t *table)
+{
+    const uint8_t *in = (const uint8_t *)src;
+    const uint8_t *end = in + len;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *ref;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + cap;
+    size_t match_len;
+    uint32_t h;
+
+    if (src == NULL || dst == NULL || table == NULL || len > LZ4_BLOCK_MAX) {
+        return 0;
+    }
+
+    if (len >= LZ4_MF_LIMIT) {
+        const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+        const uint8_t *match_end = end - LZ4_LAST_LITERALS;
+
+        /* Stale entries point somewhere in this block; candidates are verified */
+        memset(table, 0, LZ4_HASH_SIZE * sizeof(uint16_t));
+        ip++;
+
+        while (ip <= mflimit) {
+            h = lz4_hash(ip);
+            ref = in + table[h];
+            table[h] = (uint16_t)(ip - in);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)) {
+                /* Step faster through data that does not compress */
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            /* Grow the match backwards over pending literals, then forwards */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_end && ip[match_len] == ref[match_len]) {
+                match_len++;
+            }
+
+            op = lz4_put_sequence(op, oend, anchor, (size_t)(ip - anchor),
+                                  (size_t)(ip - ref), match_len);
+            if (op == NULL) {
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+
+            /* Index a position inside the match for the next one to find */
+            if (ip <= mflimit) {
+                table[lz4_hash(ip - 2)] = (uint16_t)(ip - 2 - in);
+            }
+        }
+    }
+
+    op = lz4_put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+/**
+ * Read the extra bytes of a length
+ */
+static int lz4_get_length(const uint8_t **ipp, const uint8_t *iend, size_t *n)
+{
+    const uint8_t *ip = *ipp;
+    uint8_t b;
+
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+
+    *ipp = ip;
+    return 0;
+}
+
+/**
+ * Decompress a block
+ */
+ssize_t lz4_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *out = (uint8_t *)dst;
+    uint8_t *op = out;
+    uint8_t *oend = out + cap;
+    const uint8_t *ref;
+    size_t lit_len, match_len, offset;
+    uint8_t token;
+
+    if (src == NULL || dst == NULL || len == 0) {
+        return -1;
+    }
+
+    for (;;) {
+        if (ip >= iend) {
+            return -1;
+        }
+        token = *ip++;
+
+        lit_len = token >> 4;
+        if (lit_len == 15 && lz4_get_length(&ip, iend, &lit_len) != 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        /* The last sequence has no match */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+
+        match_len = token & 15;
+        if (match_len == 15 && lz4_get_length(&ip, iend, &match_len) != 0) {
+            return -1;
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        /* A match may overlap its own output: short offsets repeat a pattern */
+        ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            while (match_len-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return (ssize_t)(op - out);
+}
+
+/* ============================================================================
+ * End of lz4.c
+ * ============================================================================ */
@@ -6,11 +6,13 @@
 
 #include <aeos/string.h>
 #include <aeos/types.h>
+#include <aeos/mmu.h>
+#include <aeos/fpsimd.h>
 
 /**
- * Get length of string
+ * Get length of string (byte loop)
  */
-size_t strlen(const char *str)
+size_t strlen_generic(const char *str)
 {
     size_t len = 0;
 
@@ -26,9 +28,9 @@ size_t strlen(const char *str)
 }
 
 /**
- * Compare two strings
+ * Compare two strings (byte loop)
  */
-int strcmp(const char *s1, const char *s2)
+int strcmp_generic(const char *s1, const char *s2)
 {
     if (s1 == NULL || s2 == NULL) {
         return (s1 == s2) ? 0 : (s1 == NULL ? -1 : 1);
@@ -158,9 +160,9 @@ char *strncat(char *dest, const char *src, size_t n)
 }
 
 /**
- * Find first occurrence of character
+ * Find first occurrence of character (byte loop)
  */
-char *strchr(const char *str, int c)
+char *strchr_generic(const char *str, int c)
 {
     if (str == NULL) {
         return NULL;
@@ -208,9 +210,9 @@ char *strrchr(const char *str, int c)
 }
 
 /**
- * Find first occurrence of substring
+ * Find first occurrence of substring (naive byte loop)
  */
-char *strstr(const char *haystack, const char *needle)
+char *strstr_generic(const char *haystack, const char *needle)
 {
     size_t needle_len;
     size_t i;
@@ -224,7 +226,7 @@ char *strstr(const char *haystack, const char *needle)
         return (char *)haystack;
     }
 
-    needle_len = strlen(needle);
+    needle_len = strlen_generic(needle);
 
     while (*haystack != '\0') {
         /* Check if this position matches */
@@ -286,10 +288,140 @@ char *strtok_r(char *str, const char *delim, char **saveptr)
     return token;
 }
 
+/* ============================================================================
+ * Memory Operations
+ *
+ * The exported mem* routines move data in 64-bit words, 32 bytes per loop
+ * iteration (GCC turns the paired loads/stores into ldp/stp), with byte
+ * heads and tails to reach alignment. With NEON, copies of
+ * MEM_NEON_THRESHOLD bytes or more use 64-byte q-register loops. Large
+ * zeroing memsets use DC ZVA.
+ *
+ * Two rules protect the early boot path and exception context:
+ *  - Before mmu_init() all memory is Device memory. Unaligned word accesses
+ *    and DC ZVA would fault there, so word paths need matching alignment.
+ *  - The kernel is built with -mgeneral-regs-only and exception entry saves
+ *    only the general purpose registers. The NEON loops are inline asm
+ *    between kernel_neon_begin() and kernel_neon_end(), which save the
+ *    owner's FP/SIMD state and hold off preemption; kernel_neon_usable()
+ *    keeps them out of handlers and tasklets.
+ * ============================================================================ */
+
+/* Copies/sets at least this large use the NEON loops */
+#define MEM_NEON_THRESHOLD  256
+
+/* Zeroing memsets at least this large use DC ZVA */
+#define MEM_ZVA_THRESHOLD   1024
+
+/* Word-sized access helpers (may-alias so -O2 keeps them honest) */
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
+
 /**
- * Copy memory
+ * Check whether unaligned word accesses are safe (Normal memory)
  */
-void *memcpy(void *dest, const void *src, size_t n)
+static inline bool mem_unaligned_ok(void)
+{
+    return mmu_enabled();
+}
+
+/**
+ * Forward word copy, n must be a multiple of 8
+ */
+static void copy_words_fwd(unsigned char *d, const unsigned char *s, size_t n)
+{
+#ifdef __aarch64__
+    if (n >= MEM_NEON_THRESHOLD && kernel_neon_usable()) {
+        size_t blocks = n / 64;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "1: ldp q0, q1, [%1], #32\n"
+            "   ldp q2, q3, [%1], #32\n"
+            "   subs %2, %2, #1\n"
+            "   stp q0, q1, [%0], #32\n"
+            "   stp q2, q3, [%0], #32\n"
+            "   b.ne 1b\n"
+            : "+r"(d), "+r"(s), "+r"(blocks)
+            :
+            : "v0", "v1", "v2", "v3", "cc", "memory");
+        kernel_neon_end();
+        n &= 63;
+    }
+#endif
+
+    while (n >= 32) {
+        mem_word_t a = ((const mem_word_t *)s)[0];
+        mem_word_t b = ((const mem_word_t *)s)[1];
+        mem_word_t c = ((const mem_word_t *)s)[2];
+        mem_word_t e = ((const mem_word_t *)s)[3];
+        ((mem_word_t *)d)[0] = a;
+        ((mem_word_t *)d)[1] = b;
+        ((mem_word_t *)d)[2] = c;
+        ((mem_word_t *)d)[3] = e;
+        d += 32;
+        s += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        *(mem_word_t *)d = *(const mem_word_t *)s;
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+}
+
+/**
+ * Backward word copy from the end of both buffers, n must be a multiple of 8
+ */
+static void copy_words_bwd(unsigned char *d_end, const unsigned char *s_end, size_t n)
+{
+#ifdef __aarch64__
+    if (n >= MEM_NEON_THRESHOLD && kernel_neon_usable()) {
+        size_t blocks = n / 64;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "1: ldp q0, q1, [%1, #-32]!\n"
+            "   ldp q2, q3, [%1, #-32]!\n"
+            "   subs %2, %2, #1\n"
+            "   stp q0, q1, [%0, #-32]!\n"
+            "   stp q2, q3, [%0, #-32]!\n"
+            "   b.ne 1b\n"
+            : "+r"(d_end), "+r"(s_end), "+r"(blocks)
+            :
+            : "v0", "v1", "v2", "v3", "cc", "memory");
+        kernel_neon_end();
+        n &= 63;
+    }
+#endif
+
+    while (n >= 32) {
+        mem_word_t a = ((const mem_word_t *)s_end)[-1];
+        mem_word_t b = ((const mem_word_t *)s_end)[-2];
+        mem_word_t c = ((const mem_word_t *)s_end)[-3];
+        mem_word_t e = ((const mem_word_t *)s_end)[-4];
+        ((mem_word_t *)d_end)[-1] = a;
+        ((mem_word_t *)d_end)[-2] = b;
+        ((mem_word_t *)d_end)[-3] = c;
+        ((mem_word_t *)d_end)[-4] = e;
+        d_end -= 32;
+        s_end -= 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        d_end -= 8;
+        s_end -= 8;
+        *(mem_word_t *)d_end = *(const mem_word_t *)s_end;
+        n -= 8;
+    }
+}
+
+/**
+ * Copy memory (byte-at-a-time reference version)
+ */
+void *memcpy_generic(void *dest, const void *src, size_t n)
 {
     unsigned char *d = (unsigned char *)dest;
     const unsigned char *s = (const unsigned char *)src;
@@ -307,9 +439,9 @@ void *memcpy(void *dest, const void *src, size_t n)
 }
 
 /**
- * Set memory to value
+ * Set memory to value (byte-at-a-time reference version)
  */
-void *memset(void *dest, int c, size_t n)
+void *memset_generic(void *dest, int c, size_t n)
 {
     unsigned char *d = (unsigned char *)dest;
     size_t i;
@@ -326,9 +458,9 @@ void *memset(void *dest, int c, size_t n)
 }
 
 /**
- * Compare memory
+ * Compare memory (byte-at-a-time reference version)
  */
-int memcmp(const void *s1, const void *s2, size_t n)
+int memcmp_generic(const void *s1, const void *s2, size_t n)
 {
     const unsigned char *p1 = (const unsigned char *)s1;
     const unsigned char *p2 = (const unsigned char *)s2;
@@ -348,9 +480,9 @@ int memcmp(const void *s1, const void *s2, size_t n)
 }
 
 /**
- * Move memory (handles overlapping regions)
+ * Move memory (byte-at-a-time reference version)
  */
-void *memmove(void *dest, const void *src, size_t n)
+void *memmove_generic(void *dest, const void *src, size_t n)
 {
     unsigned char *d = (unsigned char *)dest;
     const unsigned char *s = (const unsigned char *)src;
@@ -375,175 +507,637 @@ void *memmove(void *dest, const void *src, size_t n)
     return dest;
 }
 
-/* Variable argument list support for snprintf */
-typedef __builtin_va_list va_list;
-#define va_start(ap, last) __builtin_va_start(ap, last)
-#define va_arg(ap, type)   __builtin_va_arg(ap, type)
-#define va_end(ap)         __builtin_va_end(ap)
+/**
+ * Copy memory
+ */
+void *memcpy(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
+
+    if (dest == NULL || src == NULL) {
+        return dest;
+    }
+
+    if (n >= 16 && (((uintptr_t)d ^ (uintptr_t)s) & 7) == 0) {
+        /* Same alignment: byte head up to a word boundary */
+        while ((uintptr_t)d & 7) {
+            *d++ = *s++;
+            n--;
+        }
+    } else if (n < 16 || !mem_unaligned_ok()) {
+        return memcpy_generic(dest, src, n);
+    }
+
+    copy_words_fwd(d, s, n & ~(size_t)7);
+    d += n & ~(size_t)7;
+    s += n & ~(size_t)7;
+    n &= 7;
+
+    while (n--) {
+        *d++ = *s++;
+    }
+
+    return dest;
+}
 
 /**
- * Format integer to buffer with optional width and padding
+ * Set memory to value
  */
-static int format_uint(char *buf, size_t size, size_t pos, uint32_t value, int base)
+void *memset(void *dest, int c, size_t n)
 {
-    char tmp[16];
-    int i = 0;
-    int count = 0;
-    const char *digits = "0123456789abcdef";
+    unsigned char *d = (unsigned char *)dest;
+    uint64_t pattern;
 
-    if (value == 0) {
-        if (pos < size - 1) {
-            buf[pos] = '0';
-            count = 1;
+    if (dest == NULL) {
+        return dest;
+    }
+
+    if (n < 16) {
+        return memset_generic(dest, c, n);
+    }
+
+    /* Byte head up to a word boundary */
+    while ((uintptr_t)d & 7) {
+        *d++ = (unsigned char)c;
+        n--;
+    }
+
+    pattern = (uint8_t)c;
+    pattern |= pattern << 8;
+    pattern |= pattern << 16;
+    pattern |= pattern << 32;
+
+    /* Zeroing whole cache-line-sized blocks: DC ZVA (Normal memory only) */
+    if (pattern == 0 && n >= MEM_ZVA_THRESHOLD && mem_unaligned_ok()) {
+        uint64_t dczid;
+        __asm__ volatile("mrs %0, dczid_el0" : "=r"(dczid));
+
+        if (!(dczid & (1 << 4))) {  /* DZP: DC ZVA permitted */
+            size_t block = 4UL << (dczid & 0xF);
+
+            while (((uintptr_t)d & (block - 1)) && n >= 8) {
+                *(mem_word_t *)d = 0;
+                d += 8;
+                n -= 8;
+            }
+            while (n >= block) {
+                __asm__ volatile("dc zva, %0" :: "r"(d) : "memory");
+                d += block;
+                n -= block;
+            }
         }
-        return count;
     }
 
-    while (value > 0 && i < 16) {
-        tmp[i++] = digits[value % base];
-        value /= base;
+#ifdef __aarch64__
+    if (n >= MEM_NEON_THRESHOLD && kernel_neon_usable()) {
+        size_t blocks = n / 64;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "   dup v0.2d, %2\n"
+            "1: stp q0, q0, [%0], #32\n"
+            "   subs %1, %1, #1\n"
+            "   stp q0, q0, [%0], #32\n"
+            "   b.ne 1b\n"
+            : "+r"(d), "+r"(blocks)
+            : "r"(pattern)
+            : "v0", "cc", "memory");
+        kernel_neon_end();
+        n &= 63;
+    }
+#endif
+
+    while (n >= 32) {
+        ((mem_word_t *)d)[0] = pattern;
+        ((mem_word_t *)d)[1] = pattern;
+        ((mem_word_t *)d)[2] = pattern;
+        ((mem_word_t *)d)[3] = pattern;
+        d += 32;
+        n -= 32;
+    }
+
+    while (n >= 8) {
+        *(mem_word_t *)d = pattern;
+        d += 8;
+        n -= 8;
     }
 
-    while (i > 0 && pos + count < size - 1) {
-        buf[pos + count] = tmp[--i];
-        count++;
+    while (n--) {
+        *d++ = (unsigned char)c;
     }
 
-    return count;
+    return dest;
 }
 
 /**
- * Format integer to buffer with width and zero-pad support
+ * Fill memory with a 32-bit value
  */
-static int format_uint_padded(char *buf, size_t size, size_t pos,
-                              uint32_t value, int base, int width, char pad)
+void *memset32(void *dest, uint32_t value, size_t count)
 {
-    char tmp[16];
-    int i = 0;
-    int count = 0;
-    int padding;
-    const char *digits = "0123456789abcdef";
+    uint32_t *w = (uint32_t *)dest;
+    unsigned char *d;
+    uint64_t pattern;
+    size_t n;
 
-    if (value == 0) {
-        tmp[i++] = '0';
-    } else {
-        while (value > 0 && i < 16) {
-            tmp[i++] = digits[value % base];
-            value /= base;
+    if (dest == NULL) {
+        return dest;
+    }
+
+    if (count < 8) {
+        while (count--) {
+            *w++ = value;
         }
+        return dest;
     }
 
-    /* Add padding if needed */
-    padding = width - i;
-    while (padding > 0 && pos + count < size - 1) {
-        buf[pos + count] = pad;
-        count++;
-        padding--;
+    /* One store reaches a word boundary */
+    if ((uintptr_t)w & 7) {
+        *w++ = value;
+        count--;
     }
 
-    /* Write digits */
-    while (i > 0 && pos + count < size - 1) {
-        buf[pos + count] = tmp[--i];
-        count++;
+    d = (unsigned char *)w;
+    n = count * 4;
+    pattern = value | ((uint64_t)value << 32);
+
+#ifdef __aarch64__
+    if (n >= MEM_NEON_THRESHOLD && kernel_neon_usable()) {
+        size_t blocks = n / 64;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "   dup v0.2d, %2\n"
+            "1: stp q0, q0, [%0], #32\n"
+            "   subs %1, %1, #1\n"
+            "   stp q0, q0, [%0], #32\n"
+            "   b.ne 1b\n"
+            : "+r"(d), "+r"(blocks)
+            : "r"(pattern)
+            : "v0", "cc", "memory");
+        kernel_neon_end();
+        n &= 63;
+    }
+#endif
+
+    while (n >= 32) {
+        ((mem_word_t *)d)[0] = pattern;
+        ((mem_word_t *)d)[1] = pattern;
+        ((mem_word_t *)d)[2] = pattern;
+        ((mem_word_t *)d)[3] = pattern;
+        d += 32;
+        n -= 32;
     }
 
-    return count;
+    while (n >= 8) {
+        *(mem_word_t *)d = pattern;
+        d += 8;
+        n -= 8;
+    }
+
+    if (n) {
+        *(uint32_t *)d = value;
+    }
+
+    return dest;
 }
 
 /**
- * Simplified snprintf
+ * Compare memory
  */
-int snprintf(char *buf, size_t size, const char *fmt, ...)
+int memcmp(const void *s1, const void *s2, size_t n)
 {
-    va_list args;
-    size_t pos = 0;
-    const char *str;
-    int32_t val;
-    uint32_t uval;
+    const unsigned char *p1 = (const unsigned char *)s1;
+    const unsigned char *p2 = (const unsigned char *)s2;
 
-    if (buf == NULL || size == 0 || fmt == NULL) {
+    if (s1 == NULL || s2 == NULL) {
         return 0;
     }
 
-    va_start(args, fmt);
+    if (n >= 16 && (((uintptr_t)p1 ^ (uintptr_t)p2) & 7) == 0) {
+        while ((uintptr_t)p1 & 7) {
+            if (*p1 != *p2) {
+                return *p1 - *p2;
+            }
+            p1++;
+            p2++;
+            n--;
+        }
+    } else if (n < 16 || !mem_unaligned_ok()) {
+        return memcmp_generic(s1, s2, n);
+    }
 
-    while (*fmt && pos < size - 1) {
-        if (*fmt == '%') {
-            fmt++;
-            int width = 0;
-            char pad_char = ' ';
+    /* Skip equal words; the first differing word is resolved bytewise */
+    while (n >= 8 && *(const mem_word_t *)p1 == *(const mem_word_t *)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
 
-            /* Check for zero-pad flag */
-            if (*fmt == '0') {
-                pad_char = '0';
-                fmt++;
-            }
+    return memcmp_generic(p1, p2, n);
+}
 
-            /* Parse width */
-            while (*fmt >= '0' && *fmt <= '9') {
-                width = width * 10 + (*fmt - '0');
-                fmt++;
-            }
+/**
+ * Move memory (handles overlapping regions)
+ */
+void *memmove(void *dest, const void *src, size_t n)
+{
+    unsigned char *d = (unsigned char *)dest;
+    const unsigned char *s = (const unsigned char *)src;
 
-            switch (*fmt) {
-                case 's':
-                    str = va_arg(args, const char *);
-                    if (str == NULL) str = "(null)";
-                    while (*str && pos < size - 1) {
-                        buf[pos++] = *str++;
-                    }
-                    break;
+    if (dest == NULL || src == NULL || n == 0) {
+        return dest;
+    }
 
-                case 'd':
-                    val = va_arg(args, int32_t);
-                    if (val < 0) {
-                        if (pos < size - 1) buf[pos++] = '-';
-                        val = -val;
-                    }
-                    if (width > 0) {
-                        pos += format_uint_padded(buf, size, pos, (uint32_t)val, 10, width, pad_char);
-                    } else {
-                        pos += format_uint(buf, size, pos, (uint32_t)val, 10);
-                    }
-                    break;
+    /* Forward copy is safe unless dest starts inside src */
+    if (d <= s || d >= s + n) {
+        return memcpy(dest, src, n);
+    }
 
-                case 'u':
-                    uval = va_arg(args, uint32_t);
-                    if (width > 0) {
-                        pos += format_uint_padded(buf, size, pos, uval, 10, width, pad_char);
-                    } else {
-                        pos += format_uint(buf, size, pos, uval, 10);
-                    }
-                    break;
+    if (n < 16 || ((((uintptr_t)d ^ (uintptr_t)s) & 7) != 0 && !mem_unaligned_ok())) {
+        return memmove_generic(dest, src, n);
+    }
 
-                case 'x':
-                    uval = va_arg(args, uint32_t);
-                    if (width > 0) {
-                        pos += format_uint_padded(buf, size, pos, uval, 16, width, pad_char);
-                    } else {
-                        pos += format_uint(buf, size, pos, uval, 16);
-                    }
-                    break;
+    /* Copy backward: byte tail first so the end is word aligned */
+    d += n;
+    s += n;
+    while (((uintptr_t)d & 7) && n) {
+        *--d = *--s;
+        n--;
+    }
 
-                case '%':
-                    if (pos < size - 1) buf[pos++] = '%';
-                    break;
+    copy_words_bwd(d, s, n & ~(size_t)7);
+    d -= n & ~(size_t)7;
+    s -= n & ~(size_t)7;
+    n &= 7;
+
+    while (n--) {
+        *--d = *--s;
+    }
+
+    return dest;
+}
+
+/**
+ * Find the first occurrence of a byte
+ * With NEON, 16 bytes are compared per step (cmeq) and the step that hit
+ * is resolved bytewise.
+ */
+void *memchr(const void *s, int c, size_t n)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    unsigned char ch = (unsigned char)c;
+
+    if (s == NULL) {
+        return NULL;
+    }
+
+#ifdef __aarch64__
+    if (n >= 32 && mem_unaligned_ok() && kernel_neon_usable()) {
+        uint32_t hit;
+
+        kernel_neon_begin();
+        __asm__ volatile(
+            "   dup v1.16b, %w[ch]\n"
+            "1: ld1 {v0.16b}, [%[p]]\n"
+            "   cmeq v0.16b, v0.16b, v1.16b\n"
+            "   umaxv b0, v0.16b\n"
+            "   fmov %w[hit], s0\n"
+            "   cbnz %w[hit], 2f\n"
+            "   add %[p], %[p], #16\n"
+            "   sub %[n], %[n], #16\n"
+            "   cmp %[n], #16\n"
+            "   b.hs 1b\n"
+            "2:\n"
+            : [p] "+r"(p), [n] "+r"(n), [hit] "=&r"(hit)
+            : [ch] "r"((uint32_t)ch)
+            : "v0", "v1", "cc", "memory");
+        kernel_neon_end();
+    }
+#endif
+
+    while (n--) {
+        if (*p == ch) {
+            return (void *)p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/* ============================================================================
+ * String Scanning
+ *
+ * strlen, strchr, strcmp and strstr look at 16 bytes per step with NEON,
+ * under the same rules as the mem* loops. The scan runs inside one
+ * kernel_neon_begin()/kernel_neon_end() pair. A string's length is unknown,
+ * so a 16-byte load may run past its terminator; it must never run into
+ * the next page, which might not be mapped. Loads are therefore either
+ * 16-byte aligned (strlen, strchr and the first string of strcmp) or
+ * checked against the page boundary (the second string of strcmp, which
+ * steps bytewise across it). strstr measures the haystack first and
+ * then stays inside it.
+ *
+ * A compare result (0x00/0xFF per byte) is narrowed to 4 bits per byte
+ * with shrn, so the first hit is ctz(mask) / 4.
+ * ============================================================================ */
+
+#ifdef __aarch64__
+/* Compares spanning fewer bytes than this use the byte loops */
+#define STR_NEON_MIN        16
+
+/**
+ * Check whether the string routines may use NEON
+ */
+static inline bool str_neon_ok(void)
+{
+    return mem_unaligned_ok() && kernel_neon_usable();
+}
+
+/**
+ * Bytes of the aligned block at p that are 0 or ch, 4 mask bits per byte
+ */
+static inline uint64_t str_scan16(const unsigned char *p, uint32_t ch)
+{
+    uint64_t mask;
+
+    __asm__ volatile(
+        "ld1 {v0.16b}, [%[p]]\n"
+        "dup v1.16b, %w[ch]\n"
+        "cmeq v1.16b, v0.16b, v1.16b\n"
+        "cmeq v0.16b, v0.16b, #0\n"
+        "orr v0.16b, v0.16b, v1.16b\n"
+        "shrn v0.8b, v0.8h, #4\n"
+        "fmov %[mask], d0\n"
+        : [mask] "=r"(mask)
+        : [p] "r"(p), [ch] "r"(ch), "m"(*(const unsigned char (*)[16])p)
+        : "v0", "v1");
+    return mask;
+}
+
+/**
+ * Bytes where a and b differ or a ends, 4 mask bits per byte
+ */
+static inline uint64_t str_diff16(const unsigned char *a, const unsigned char *b)
+{
+    uint64_t mask;
+
+    __asm__ volatile(
+        "ld1 {v0.16b}, [%[a]]\n"
+        "ld1 {v1.16b}, [%[b]]\n"
+        "cmeq v1.16b, v0.16b, v1.16b\n"
+        "cmeq v0.16b, v0.16b, #0\n"
+        "orn v0.16b, v0.16b, v1.16b\n"
+        "shrn v0.8b, v0.8h, #4\n"
+        "fmov %[mask], d0\n"
+        : [mask] "=r"(mask)
+        : [a] "r"(a), [b] "r"(b),
+          "m"(*(const unsigned char (*)[16])a), "m"(*(const unsigned char (*)[16])b)
+        : "v0", "v1");
+    return mask;
+}
+
+/**
+ * Positions i where p[i] == first and q[i] == last, 4 mask bits per byte
+ */
+static inline uint64_t str_pair16(const unsigned char *p, const unsigned char *q,
+                                  uint32_t first, uint32_t last)
+{
+    uint64_t mask;
+
+    __asm__ volatile(
+        "ld1 {v0.16b}, [%[p]]\n"
+        "ld1 {v1.16b}, [%[q]]\n"
+        "dup v2.16b, %w[first]\n"
+        "dup v3.16b, %w[last]\n"
+        "cmeq v0.16b, v0.16b, v2.16b\n"
+        "cmeq v1.16b, v1.16b, v3.16b\n"
+        "and v0.16b, v0.16b, v1.16b\n"
+        "shrn v0.8b, v0.8h, #4\n"
+        "fmov %[mask], d0\n"
+        : [mask] "=r"(mask)
+        : [p] "r"(p), [q] "r"(q), [first] "r"(first), [last] "r"(last),
+          "m"(*(const unsigned char (*)[16])p), "m"(*(const unsigned char (*)[16])q)
+        : "v0", "v1", "v2", "v3");
+    return mask;
+}
 
-                default:
-                    if (pos < size - 1) buf[pos++] = '%';
-                    if (pos < size - 1 && *fmt) buf[pos++] = *fmt;
+/**
+ * First byte of str that is 0 or ch, in aligned blocks
+ */
+static const char *str_find(const char *str, uint32_t ch)
+{
+    const unsigned char *p = (const unsigned char *)((uintptr_t)str & ~(uintptr_t)15);
+    uint64_t mask;
+
+    kernel_neon_begin();
+
+    /* Bytes of the first block before str are shifted out */
+    mask = str_scan16(p, ch) >> (((uintptr_t)str & 15) * 4);
+    if (mask != 0) {
+        kernel_neon_end();
+        return str + __builtin_ctzll(mask) / 4;
+    }
+
+    do {
+        p += 16;
+        mask = str_scan16(p, ch);
+    } while (mask == 0);
+
+    kernel_neon_end();
+    return (const char *)p + __builtin_ctzll(mask) / 4;
+}
+
+/**
+ * Compare from a 16-byte aligned a, 16 bytes per step
+ */
+static int str_compare(const unsigned char *a, const unsigned char *b)
+{
+    uint64_t mask;
+    size_t i = 0;
+
+    kernel_neon_begin();
+    for (;;) {
+        if (((uintptr_t)b & (PAGE_SIZE - 1)) > PAGE_SIZE - 16) {
+            for (i = 0; i < 16; i++) {
+                if (a[i] == '\0' || a[i] != b[i]) {
                     break;
+                }
+            }
+            if (i < 16) {
+                break;
             }
-            if (*fmt) fmt++;
         } else {
-            buf[pos++] = *fmt++;
+            mask = str_diff16(a, b);
+            if (mask != 0) {
+                i = __builtin_ctzll(mask) / 4;
+                break;
+            }
+        }
+        a += 16;
+        b += 16;
+    }
+    kernel_neon_end();
+
+    return a[i] - b[i];
+}
+
+/**
+ * Filter haystack positions from *pos by the needle's first and last bytes
+ * Stops where a step would load past the haystack, leaving *pos there.
+ * @return The first full match, or NULL
+ */
+static const unsigned char *str_match(const unsigned char *h, size_t hlen,
+                                      const unsigned char *n, size_t nlen,
+                                      size_t *pos)
+{
+    const unsigned char *found = NULL;
+    uint64_t mask;
+    size_t i;
+
+    kernel_neon_begin();
+    while (found == NULL && hlen - *pos >= nlen - 1 + STR_NEON_MIN) {
+        mask = str_pair16(h + *pos, h + *pos + nlen - 1, n[0], n[nlen - 1]);
+        while (mask != 0) {
+            i = __builtin_ctzll(mask) / 4;
+            if (memcmp(h + *pos + i + 1, n + 1, nlen - 2) == 0) {
+                found = h + *pos + i;
+                break;
+            }
+            mask &= ~(0xFULL << (i * 4));
+        }
+        if (found == NULL) {
+            *pos += 16;
+        }
+    }
+    kernel_neon_end();
+
+    return found;
+}
+#endif
+
+/**
+ * Get length of string
+ */
+size_t strlen(const char *str)
+{
+    if (str == NULL) {
+        return 0;
+    }
+
+#ifdef __aarch64__
+    if (str_neon_ok()) {
+        return (size_t)(str_find(str, 0) - str);
+    }
+#endif
+
+    return strlen_generic(str);
+}
+
+/**
+ * Find first occurrence of character
+ */
+char *strchr(const char *str, int c)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+
+#ifdef __aarch64__
+    if (str_neon_ok()) {
+        const char *hit = str_find(str, (unsigned char)c);
+
+        return (*hit == (char)c) ? (char *)hit : NULL;
+    }
+#endif
+
+    return strchr_generic(str, c);
+}
+
+/**
+ * Compare two strings
+ * With NEON, s1 is brought to 16-byte alignment bytewise; s2 is loaded
+ * unaligned, and bytewise for the block that would cross into its next page.
+ */
+int strcmp(const char *s1, const char *s2)
+{
+    const unsigned char *a = (const unsigned char *)s1;
+    const unsigned char *b = (const unsigned char *)s2;
+
+    if (s1 == NULL || s2 == NULL) {
+        return (s1 == s2) ? 0 : (s1 == NULL ? -1 : 1);
+    }
+
+#ifdef __aarch64__
+    if (str_neon_ok()) {
+        while (((uintptr_t)a & 15) != 0) {
+            if (*a == '\0' || *a != *b) {
+                return *a - *b;
+            }
+            a++;
+            b++;
         }
+
+        return str_compare(a, b);
+    }
+#endif
+
+    while (*a && (*a == *b)) {
+        a++;
+        b++;
+    }
+
+    return *a - *b;
+}
+
+/**
+ * Find first occurrence of substring
+ * With NEON, 16 positions are filtered per step by the needle's first and
+ * last characters; only positions passing both are compared in full.
+ */
+char *strstr(const char *haystack, const char *needle)
+{
+    if (haystack == NULL || needle == NULL) {
+        return NULL;
+    }
+
+    if (needle[0] == '\0') {
+        return (char *)haystack;
+    }
+    if (needle[1] == '\0') {
+        return strchr(haystack, needle[0]);
     }
 
-    buf[pos] = '\0';
-    va_end(args);
+#ifdef __aarch64__
+    if (str_neon_ok()) {
+        const unsigned char *h = (const unsigned char *)haystack;
+        const unsigned char *n = (const unsigned char *)needle;
+        const unsigned char *found;
+        size_t hlen, nlen, pos = 0;
+
+        nlen = strlen(needle);
+        hlen = strlen(haystack);
+        if (hlen < nlen) {
+            return NULL;
+        }
+
+        /* Both loads of a step stay inside the haystack */
+        found = str_match(h, hlen, n, nlen, &pos);
+        if (found != NULL) {
+            return (char *)found;
+        }
+
+        for (; pos + nlen <= hlen; pos++) {
+            if (h[pos] == n[0] && memcmp(h + pos + 1, n + 1, nlen - 1) == 0) {
+                return (char *)(h + pos);
+            }
+        }
+        return NULL;
+    }
+#endif
 
-    return (int)pos;
+    return strstr_generic(haystack, needle);
 }
 
 /* ============================================================================
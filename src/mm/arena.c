@@ -0,0 +1,229 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/arena.c
+ * Description: Arena allocator - bump allocation, freed all at once
+ * ============================================================================ */
+
+#include <aeos/arena.h>
+#include <aeos/pmm.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+#define ALIGN_UP(x, a)      (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+ * Blocks sit on a list, newest first, and allocation bumps through the
+ * newest. The first block also holds the arena itself, so an arena costs
+ * no heap memory; it stays until the arena is destroyed.
+ */
+
+/* Header at the start of every block */
+typedef struct arena_chunk {
+    struct arena_chunk *next;           /* Older block */
+    uint32_t order;
+} arena_chunk_t;
+
+struct arena {
+    arena_chunk_t *chunks;              /* Newest first; the last holds the arena */
+    uint8_t *ptr;                       /* Next free byte in the newest block */
+    uint8_t *end;                       /* End of the newest block */
+    uint32_t order;                     /* Order of new blocks */
+    size_t used;                        /* Bytes handed out since the last reset */
+};
+
+#define CHUNK_HEADER        ALIGN_UP(sizeof(arena_chunk_t), ARENA_ALIGN)
+#define ARENA_HEADER        ALIGN_UP(sizeof(arena_t), ARENA_ALIGN)
+
+static inline uint8_t *chunk_end(arena_chunk_t *chunk)
+{
+    return (uint8_t *)chunk + ((size_t)PAGE_SIZE << chunk->order);
+}
+
+/**
+ * Start a new block with room for size bytes
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+static int arena_grow(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk;
+    uint32_t order = arena->order;
+
+    while (((size_t)PAGE_SIZE << order) - CHUNK_HEADER < size) {
+        if (++order > PMM_MAX_ORDER) {
+            return -1;
+        }
+    }
+
+    chunk = (arena_chunk_t *)(uintptr_t)pmm_alloc_pages(order);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    chunk->order = order;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->ptr = (uint8_t *)chunk + CHUNK_HEADER;
+    arena->end = chunk_end(chunk);
+    return 0;
+}
+
+/**
+ * Free blocks newer than keep and resume bumping at ptr
+ */
+static void arena_unwind(arena_t *arena, arena_chunk_t *keep, uint8_t *ptr)
+{
+    arena_chunk_t *chunk;
+
+    while (arena->chunks != keep) {
+        chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        pmm_free_pages((uint64_t)(uintptr_t)chunk, chunk->order);
+    }
+
+    arena->ptr = ptr;
+    arena->end = chunk_end(keep);
+}
+
+/**
+ * Create an arena
+ */
+arena_t *arena_create(uint32_t order)
+{
+    arena_chunk_t *chunk;
+    arena_t *arena;
+
+    if (order > PMM_MAX_ORDER) {
+        klog_error("arena_create: bad order %u", order);
+        return NULL;
+    }
+
+    chunk = (arena_chunk_t *)(uintptr_t)pmm_alloc_pages(order);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->order = order;
+    chunk->next = NULL;
+
+    arena = (arena_t *)((uint8_t *)chunk + CHUNK_HEADER);
+    arena->chunks = chunk;
+    arena->ptr = (uint8_t *)arena + ARENA_HEADER;
+    arena->end = chunk_end(chunk);
+    arena->order = order;
+    arena->used = 0;
+    return arena;
+}
+
+/**
+ * Destroy an arena
+ */
+void arena_destroy(arena_t *arena)
+{
+    arena_chunk_t *chunk, *next;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    /* The arena lives in the last block, so read each link before freeing */
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        pmm_free_pages((uint64_t)(uintptr_t)chunk, chunk->order);
+    }
+}
+
+/**
+ * Allocate from an arena
+ */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    void *p;
+
+    if (arena == NULL || size == 0) {
+        return NULL;
+    }
+
+    size = ALIGN_UP(size, ARENA_ALIGN);
+    if ((size_t)(arena->end - arena->ptr) < size && arena_grow(arena, size) < 0) {
+        klog_error("arena_alloc: out of memory (%u bytes)", (uint32_t)size);
+        return NULL;
+    }
+
+    p = arena->ptr;
+    arena->ptr += size;
+    arena->used += size;
+    return p;
+}
+
+/**
+ * Allocate zeroed memory from an arena
+ */
+void *arena_calloc(arena_t *arena, size_t size)
+{
+    void *p = arena_alloc(arena, size);
+
+    if (p != NULL) {
+        memset(p, 0, size);
+    }
+    return p;
+}
+
+/**
+ * Free everything allocated from an arena
+ */
+void arena_reset(arena_t *arena)
+{
+    arena_chunk_t *first;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    first = arena->chunks;
+    while (first->next != NULL) {
+        first = first->next;
+    }
+
+    arena_unwind(arena, first, (uint8_t *)arena + ARENA_HEADER);
+    arena->used = 0;
+}
+
+/**
+ * Current position of an arena
+ */
+arena_mark_t arena_mark(arena_t *arena)
+{
+    arena_mark_t mark = { NULL, NULL, 0 };
+
+    if (arena != NULL) {
+        mark.chunk = arena->chunks;
+        mark.ptr = arena->ptr;
+        mark.used = arena->used;
+    }
+    return mark;
+}
+
+/**
+ * Free everything allocated since a mark
+ */
+void arena_release(arena_t *arena, arena_mark_t mark)
+{
+    if (arena == NULL || mark.chunk == NULL) {
+        return;
+    }
+
+    arena_unwind(arena, (arena_chunk_t *)mark.chunk, mark.ptr);
+    arena->used = mark.used;
+}
+
+/**
+ * Bytes allocated since creation or the last reset
+ */
+size_t arena_used(const arena_t *arena)
+{
+    return arena != NULL ? arena->used : 0;
+}
+
+/* ============================================================================
+ * End of arena.c
+ * ============================================================================ */
@@ -0,0 +1,300 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/dma.c
+ * Description: Memory shared with DMA devices
+ * ============================================================================ */
+
+#include <aeos/dma.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/mmu.h>
+#include <aeos/dtb.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/types.h>
+
+/*
+ * Maintenance works on whole lines, by virtual address, to the point of
+ * coherency. Cleaning a line that also holds other data is harmless, but
+ * invalidating one could throw away the CPU's writes next to the buffer,
+ * so dma_sync_for_cpu() cleans and invalidates the partial lines at
+ * either end and only invalidates the lines in between. A dsb after each
+ * sync orders it before the MMIO write or the read that follows.
+ */
+
+static struct {
+    bool coherent;
+    uint32_t line;                      /* D-cache line size in bytes */
+    spinlock_t lock;                    /* Protects the counters below */
+    size_t allocs;
+    size_t bytes;
+    uint64_t syncs;
+    uint64_t lines;
+} dma = {
+    .coherent = true,                   /* Caches are off until mmu_init() */
+    .line = CACHE_LINE_SIZE,
+    .lock = SPINLOCK_INIT,
+};
+
+/**
+ * Smallest PMM order holding size bytes, or -1 if none does
+ */
+static int dma_order(size_t size)
+{
+    int order = 0;
+
+    while (((size_t)PAGE_SIZE << order) < size) {
+        if (++order > PMM_MAX_ORDER) {
+            return -1;
+        }
+    }
+    return order;
+}
+
+/**
+ * Count a sync that did maintenance
+ */
+static void dma_account(uint64_t lines)
+{
+    __atomic_add_fetch(&dma.syncs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&dma.lines, lines, __ATOMIC_RELAXED);
+}
+
+/**
+ * Clean the lines of a range to RAM (no barrier)
+ * @return Lines cleaned
+ */
+static uint64_t clean_lines(uint64_t start, size_t size)
+{
+    uint64_t addr = start & ~(uint64_t)(dma.line - 1);
+    uint64_t end = start + size;
+    uint64_t n = 0;
+
+    for (; addr < end; addr += dma.line, n++) {
+        __asm__ volatile("dc cvac, %0" :: "r"(addr) : "memory");
+    }
+    return n;
+}
+
+/**
+ * Decide how DMA memory is handled
+ */
+void dma_init(bool noncoherent)
+{
+    uint64_t ctr;
+    int dt;
+
+    /* CTR_EL0.DminLine: log2 of the smallest line in words */
+    __asm__ volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    dma.line = 4U << ((ctr >> 16) & 0xF);
+
+    dt = dtb_virtio_dma_coherent();
+    if (!mmu_enabled()) {
+        /* Nothing is cached */
+        dma.coherent = true;
+    } else {
+        dma.coherent = (dt == 1) && !noncoherent;
+    }
+
+    klog_info("DMA: %s, %u-byte cache lines%s",
+              dma.coherent ? "coherent" : "non-coherent, cache maintenance on",
+              dma.line, (noncoherent && dt == 1) ? " (forced)" : "");
+}
+
+/**
+ * Check whether devices snoop the CPU caches
+ */
+bool dma_coherent(void)
+{
+    return dma.coherent;
+}
+
+/**
+ * Allocate zeroed memory that needs no cache maintenance
+ */
+void *dma_alloc_coherent(size_t size, uint64_t *dma_addr)
+{
+    uint64_t pages[1U << DMA_COHERENT_MAX_ORDER];
+    uint64_t pa, va, flags;
+    uint32_t count, i;
+    int order = dma_order(size);
+
+    if (size == 0 || order < 0 || dma_addr == NULL) {
+        return NULL;
+    }
+    if (!dma.coherent && order > DMA_COHERENT_MAX_ORDER) {
+        klog_error("DMA: coherent buffer of %u bytes is too large", (uint32_t)size);
+        return NULL;
+    }
+
+    pa = pmm_alloc_pages((uint32_t)order);
+    if (pa == 0) {
+        return NULL;
+    }
+    count = 1U << order;
+    memset((void *)pa, 0, (size_t)PAGE_SIZE << order);
+
+    if (dma.coherent) {
+        va = pa;
+    } else {
+        /*
+         * The cached alias stays in the identity map. Push the zeroes out
+         * and drop its lines, so none is ever written back over the
+         * device's data; nothing touches it through that alias again.
+         */
+        for (i = 0; i < ((PAGE_SIZE << order) / dma.line); i++) {
+            __asm__ volatile("dc civac, %0" :: "r"(pa + (uint64_t)i * dma.line)
+                             : "memory");
+        }
+        __asm__ volatile("dsb sy" ::: "memory");
+
+        for (i = 0; i < count; i++) {
+            pages[i] = pa + (uint64_t)i * PAGE_SIZE;
+        }
+        va = mmu_vmap(pages, count, MEM_KERNEL_RW | MEM_NOCACHE);
+        if (va == 0) {
+            pmm_free_pages(pa, (uint32_t)order);
+            return NULL;
+        }
+    }
+
+    flags = spin_lock_irqsave(&dma.lock);
+    dma.allocs++;
+    dma.bytes += (size_t)PAGE_SIZE << order;
+    spin_unlock_irqrestore(&dma.lock, flags);
+
+    *dma_addr = pa;
+    return (void *)va;
+}
+
+/**
+ * Free memory from dma_alloc_coherent()
+ */
+void dma_free_coherent(void *cpu_addr, uint64_t dma_addr, size_t size)
+{
+    uint64_t flags;
+    int order = dma_order(size);
+
+    if (cpu_addr == NULL || size == 0 || order < 0) {
+        return;
+    }
+
+    if ((uint64_t)cpu_addr != dma_addr) {
+        mmu_vunmap((uint64_t)cpu_addr, 1U << order);
+    }
+    pmm_free_pages(dma_addr, (uint32_t)order);
+
+    flags = spin_lock_irqsave(&dma.lock);
+    dma.allocs--;
+    dma.bytes -= (size_t)PAGE_SIZE << order;
+    spin_unlock_irqrestore(&dma.lock, flags);
+}
+
+/**
+ * Make a cached buffer's contents visible to devices
+ */
+void dma_sync_for_device(const void *addr, size_t size)
+{
+    uint64_t n;
+
+    if (dma.coherent || size == 0) {
+        return;
+    }
+
+    n = clean_lines((uint64_t)addr, size);
+    __asm__ volatile("dsb sy" ::: "memory");
+    dma_account(n);
+}
+
+/**
+ * Make what a device wrote to a cached buffer visible to the CPU
+ */
+void dma_sync_for_cpu(const void *addr, size_t size)
+{
+    uint64_t mask = dma.line - 1;
+    uint64_t start = (uint64_t)addr;
+    uint64_t end = start + size;
+    uint64_t lo, hi, a;
+    uint64_t n = 0;
+
+    if (dma.coherent || size == 0) {
+        return;
+    }
+
+    /* Lines [lo, hi); partial ones at the ends may hold the CPU's data */
+    lo = start & ~mask;
+    hi = (end + mask) & ~mask;
+    if ((start & mask) != 0) {
+        __asm__ volatile("dc civac, %0" :: "r"(lo) : "memory");
+        lo += dma.line;
+        n++;
+    }
+    if (lo < hi && (end & mask) != 0) {
+        hi -= dma.line;
+        __asm__ volatile("dc civac, %0" :: "r"(hi) : "memory");
+        n++;
+    }
+
+    for (a = lo; a < hi; a += dma.line) {
+        __asm__ volatile("dc ivac, %0" :: "r"(a) : "memory");
+        n++;
+    }
+
+    __asm__ volatile("dsb sy" ::: "memory");
+    dma_account(n);
+}
+
+/**
+ * Clean a rectangle of a cached 2D buffer for a device
+ */
+void dma_sync_2d_for_device(const void *base, size_t pitch, size_t width,
+                            uint32_t rows)
+{
+    uint64_t addr = (uint64_t)base;
+    uint64_t n = 0;
+    uint32_t row;
+
+    if (dma.coherent || width == 0 || rows == 0) {
+        return;
+    }
+
+    if (width >= pitch) {
+        /* Whole rows: one contiguous range */
+        n = clean_lines(addr, pitch * (rows - 1) + width);
+    } else {
+        for (row = 0; row < rows; row++, addr += pitch) {
+            n += clean_lines(addr, width);
+        }
+    }
+
+    __asm__ volatile("dsb sy" ::: "memory");
+    dma_account(n);
+}
+
+/**
+ * Get DMA statistics
+ */
+void dma_get_stats(dma_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&dma.lock);
+    stats->coherent = dma.coherent;
+    stats->line_size = dma.line;
+    stats->coherent_allocs = dma.allocs;
+    stats->coherent_bytes = dma.bytes;
+    spin_unlock_irqrestore(&dma.lock, flags);
+
+    stats->syncs = __atomic_load_n(&dma.syncs, __ATOMIC_RELAXED);
+    stats->lines = __atomic_load_n(&dma.lines, __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * End of dma.c
+ * ============================================================================ */
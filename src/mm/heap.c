@@ -1,26 +1,50 @@
 /* ============================================================================
  * AEOS - Abdalla's Educational Operating System
  * File: src/mm/heap.c
- * Description: Kernel heap allocator - Simple first-fit implementation
+ * Description: Kernel heap allocator - slab size classes in front of a
+ *              TLSF-style segregated-fit block allocator
  * ============================================================================ */
 
 #include <aeos/heap.h>
+#include <aeos/slab.h>
 #include <aeos/types.h>
+#include <aeos/string.h>
 #include <aeos/kprintf.h>
+#include <aeos/spinlock.h>
+#include <aeos/trace.h>
+#include <aeos/memprof.h>
 
 /**
  * Block header for heap allocations
- * Stored before each allocated or free block
+ * Stored before each allocated or free block. Every block also ends with a
+ * footer holding its size (boundary tag) so the previous neighbour of any
+ * block can be found in O(1).
  */
 typedef struct heap_block {
-    size_t size;                /* Size of block (including header) */
-    bool is_free;               /* True if block is free */
-    struct heap_block *next;    /* Next block in list */
-    struct heap_block *prev;    /* Previous block in list */
+    size_t size;                    /* Size of block (header + payload + footer) */
+    bool is_free;                   /* True if block is free */
+    struct heap_block *next_free;   /* Next block in free list (free blocks only) */
+    struct heap_block *prev_free;   /* Previous block in free list (free blocks only) */
 } heap_block_t;
 
 #define BLOCK_HEADER_SIZE   sizeof(heap_block_t)
-#define MIN_BLOCK_SIZE      (BLOCK_HEADER_SIZE + 16)
+#define BLOCK_FOOTER_SIZE   sizeof(size_t)
+#define BLOCK_OVERHEAD      (BLOCK_HEADER_SIZE + BLOCK_FOOTER_SIZE)
+#define MIN_BLOCK_SIZE      (BLOCK_OVERHEAD + 16)
+
+/*
+ * Segregated free lists (two-level, as in TLSF)
+ *
+ * The first level splits sizes by power of two, the second level splits each
+ * power-of-two range into FREE_SL_COUNT equal bins. Bitmaps record which bins
+ * are non-empty, so finding a fitting block is a couple of bit scans.
+ */
+#define FREE_SL_LOG2        3
+#define FREE_SL_COUNT       (1 << FREE_SL_LOG2)
+#define FREE_FL_SHIFT       (FREE_SL_LOG2 + 3)
+#define FREE_SMALL_BLOCK    (1UL << FREE_FL_SHIFT)      /* 64 bytes */
+#define FREE_FL_MAX_LOG2    32                          /* Blocks below 4GB */
+#define FREE_FL_COUNT       (FREE_FL_MAX_LOG2 - FREE_FL_SHIFT + 1)
 
 /**
  * Heap state
@@ -29,55 +53,74 @@ static struct {
     void *heap_start;           /* Start of heap region */
     void *heap_end;             /* End of heap region */
     size_t heap_size;           /* Total heap size */
-    heap_block_t *first_block;  /* First block in list */
+    uint32_t fl_bitmap;         /* Non-empty first-level ranges */
+    uint32_t sl_bitmap[FREE_FL_COUNT];                  /* Non-empty bins */
+    heap_block_t *free_lists[FREE_FL_COUNT][FREE_SL_COUNT];
     size_t num_allocs;          /* Total allocations */
     size_t num_frees;           /* Total frees */
+    spinlock_t lock;            /* Protects the block lists and counters */
     bool initialized;           /* Initialization flag */
 } heap;
 
 /* Forward declarations */
 static heap_block_t *find_free_block(size_t size);
 static void split_block(heap_block_t *block, size_t size);
-static void merge_free_blocks(void);
+static heap_block_t *coalesce(heap_block_t *block);
+static void insert_free_block(heap_block_t *block);
+static void remove_free_block(heap_block_t *block);
+static void set_block(heap_block_t *block, size_t size, bool is_free);
+static heap_block_t *next_block(heap_block_t *block);
+static heap_block_t *prev_block(heap_block_t *block);
 
 /**
  * Initialize the kernel heap
  */
 void heap_init(void *heap_start, size_t heap_size)
 {
-    heap_block_t *initial_block;
+    uint64_t start;
+    uint64_t end;
+    uint32_t i, j;
 
     klog_info("Initializing kernel heap...");
 
-    /* Save heap bounds */
-    heap.heap_start = heap_start;
-    heap.heap_size = heap_size;
-    heap.heap_end = (void *)((uint64_t)heap_start + heap_size);
+    /* Save heap bounds (8-byte aligned) */
+    start = ((uint64_t)heap_start + 7) & ~7ULL;
+    end = ((uint64_t)heap_start + heap_size) & ~7ULL;
+    heap.heap_start = (void *)start;
+    heap.heap_end = (void *)end;
+    heap.heap_size = end - start;
     heap.num_allocs = 0;
     heap.num_frees = 0;
+    spin_lock_init(&heap.lock);
+
+    heap.fl_bitmap = 0;
+    for (i = 0; i < FREE_FL_COUNT; i++) {
+        heap.sl_bitmap[i] = 0;
+        for (j = 0; j < FREE_SL_COUNT; j++) {
+            heap.free_lists[i][j] = NULL;
+        }
+    }
 
     /* Create initial free block spanning entire heap */
-    initial_block = (heap_block_t *)heap_start;
-    initial_block->size = heap_size;
-    initial_block->is_free = true;
-    initial_block->next = NULL;
-    initial_block->prev = NULL;
+    set_block((heap_block_t *)start, heap.heap_size, true);
+    insert_free_block((heap_block_t *)start);
 
-    heap.first_block = initial_block;
     heap.initialized = true;
 
-    kprintf("  Heap region: %p - %p\n", heap_start, heap.heap_end);
-    kprintf("  Heap size: %u KB\n", (uint32_t)(heap_size / 1024));
+    kprintf("  Heap region: %p - %p\n", heap.heap_start, heap.heap_end);
+    kprintf("  Heap size: %u KB\n", (uint32_t)(heap.heap_size / 1024));
     klog_info("Heap initialization complete");
 }
 
 /**
  * Allocate memory from kernel heap
  */
-void *kmalloc(size_t size)
+void *kmalloc_at(size_t size, const char *site)
 {
     heap_block_t *block;
     void *ptr;
+    uint64_t flags;
+    size_t requested = size;
 
     if (!heap.initialized) {
         klog_error("Heap not initialized");
@@ -88,46 +131,74 @@ void *kmalloc(size_t size)
         return NULL;
     }
 
-    /* Add header size and align to 8 bytes */
-    size = (size + BLOCK_HEADER_SIZE + 7) & ~7;
+    /* Small objects: O(1) from the size-class slabs */
+    if (size <= SLAB_MAX_SIZE) {
+        ptr = slab_alloc(size);
+        if (ptr != NULL) {
+            flags = spin_lock_irqsave(&heap.lock);
+            heap.num_allocs++;
+            spin_unlock_irqrestore(&heap.lock, flags);
+            TRACEPOINT(KMALLOC, ptr, requested);
+            MEMPROF_ALLOC(ptr, requested, site, MEMPROF_HEAP);
+            return ptr;
+        }
+        /* Out of slab pages: fall back to the block allocator */
+    }
+
+    if (size >= heap.heap_size) {
+        klog_warn("kmalloc: Out of heap memory (requested %u bytes)", (uint32_t)size);
+        return NULL;
+    }
+
+    /* Add header/footer size and align to 8 bytes */
+    size = (size + BLOCK_OVERHEAD + 7) & ~7;
 
     /* Ensure minimum block size */
     if (size < MIN_BLOCK_SIZE) {
         size = MIN_BLOCK_SIZE;
     }
 
-    /* Find free block using first-fit */
+    flags = spin_lock_irqsave(&heap.lock);
+
+    /* Find a free block from the segregated lists */
     block = find_free_block(size);
     if (block == NULL) {
+        spin_unlock_irqrestore(&heap.lock, flags);
         klog_warn("kmalloc: Out of heap memory (requested %u bytes)", (uint32_t)size);
         return NULL;
     }
 
+    /* Mark block as used */
+    remove_free_block(block);
+    set_block(block, block->size, false);
+
     /* Split block if it's much larger than needed */
     if (block->size >= size + MIN_BLOCK_SIZE) {
         split_block(block, size);
     }
 
-    /* Mark block as used */
-    block->is_free = false;
     heap.num_allocs++;
 
+    spin_unlock_irqrestore(&heap.lock, flags);
+
     /* Return pointer after header */
     ptr = (void *)((uint64_t)block + BLOCK_HEADER_SIZE);
+    TRACEPOINT(KMALLOC, ptr, requested);
+    MEMPROF_ALLOC(ptr, requested, site, MEMPROF_HEAP);
     return ptr;
 }
 
 /**
  * Allocate and zero-initialize memory
  */
-void *kcalloc(size_t nmemb, size_t size)
+void *kcalloc_at(size_t nmemb, size_t size, const char *site)
 {
     size_t total_size = nmemb * size;
     void *ptr;
     uint8_t *byte_ptr;
     size_t i;
 
-    ptr = kmalloc(total_size);
+    ptr = kmalloc_at(total_size, site);
     if (ptr == NULL) {
         return NULL;
     }
@@ -147,6 +218,7 @@ void *kcalloc(size_t nmemb, size_t size)
 void kfree(void *ptr)
 {
     heap_block_t *block;
+    uint64_t flags;
 
     if (ptr == NULL) {
         return;
@@ -157,6 +229,22 @@ void kfree(void *ptr)
         return;
     }
 
+    TRACEPOINT(KFREE, ptr, 0);
+    MEMPROF_FREE(ptr, MEMPROF_HEAP);
+
+    /* Anything outside the heap region must be a slab object */
+    if (ptr < heap.heap_start || ptr >= heap.heap_end) {
+        if (!slab_owns(ptr)) {
+            klog_error("kfree: Invalid pointer %p", ptr);
+            return;
+        }
+        slab_free(ptr);
+        flags = spin_lock_irqsave(&heap.lock);
+        heap.num_frees++;
+        spin_unlock_irqrestore(&heap.lock, flags);
+        return;
+    }
+
     /* Get block header */
     block = (heap_block_t *)((uint64_t)ptr - BLOCK_HEADER_SIZE);
 
@@ -166,34 +254,40 @@ void kfree(void *ptr)
         return;
     }
 
+    flags = spin_lock_irqsave(&heap.lock);
+
     /* Check if already free (double-free detection) */
     if (block->is_free) {
+        spin_unlock_irqrestore(&heap.lock, flags);
         klog_error("kfree: Double free detected at %p", ptr);
         return;
     }
 
-    /* Mark as free */
-    block->is_free = true;
     heap.num_frees++;
 
-    /* Merge adjacent free blocks */
-    merge_free_blocks();
+    /* Merge with free neighbours via boundary tags, then file it */
+    block = coalesce(block);
+    insert_free_block(block);
+
+    spin_unlock_irqrestore(&heap.lock, flags);
 }
 
 /**
  * Resize allocated memory block
  */
-void *krealloc(void *ptr, size_t new_size)
+void *krealloc_at(void *ptr, size_t new_size, const char *site)
 {
-    heap_block_t *block;
+    heap_block_t *block = NULL;
+    heap_block_t *next;
     void *new_ptr;
+    size_t old_size;
     size_t copy_size;
-    uint8_t *src, *dst;
-    size_t i;
+    size_t needed;
+    uint64_t flags;
 
     /* If ptr is NULL, behave like kmalloc */
     if (ptr == NULL) {
-        return kmalloc(new_size);
+        return kmalloc_at(new_size, site);
     }
 
     /* If new_size is 0, behave like kfree */
@@ -202,31 +296,59 @@ void *krealloc(void *ptr, size_t new_size)
         return NULL;
     }
 
-    /* Get current block */
-    block = (heap_block_t *)((uint64_t)ptr - BLOCK_HEADER_SIZE);
+    /* Usable size of the current allocation */
+    if (ptr < heap.heap_start || ptr >= heap.heap_end) {
+        old_size = slab_obj_size(ptr);
+        if (old_size == 0) {
+            klog_error("krealloc: Invalid pointer %p", ptr);
+            return NULL;
+        }
+    } else {
+        block = (heap_block_t *)((uint64_t)ptr - BLOCK_HEADER_SIZE);
+        old_size = block->size - BLOCK_OVERHEAD;
+    }
 
     /* If block is large enough, just return it */
-    if (block->size >= new_size + BLOCK_HEADER_SIZE) {
+    if (old_size >= new_size) {
         return ptr;
     }
 
+    /* Grow in place by absorbing a free block that follows */
+    if (block != NULL && new_size < heap.heap_size) {
+        needed = (new_size + BLOCK_OVERHEAD + 7) & ~7;
+
+        flags = spin_lock_irqsave(&heap.lock);
+        next = next_block(block);
+
+        if (next != NULL && next->is_free && block->size + next->size >= needed) {
+            remove_free_block(next);
+            set_block(block, block->size + next->size, false);
+
+            if (block->size >= needed + MIN_BLOCK_SIZE) {
+                split_block(block, needed);
+            }
+            spin_unlock_irqrestore(&heap.lock, flags);
+
+            /* The grown block is the realloc site's now */
+            MEMPROF_FREE(ptr, MEMPROF_HEAP);
+            MEMPROF_ALLOC(ptr, new_size, site, MEMPROF_HEAP);
+            return ptr;
+        }
+        spin_unlock_irqrestore(&heap.lock, flags);
+    }
+
     /* Allocate new block */
-    new_ptr = kmalloc(new_size);
+    new_ptr = kmalloc_at(new_size, site);
     if (new_ptr == NULL) {
         return NULL;
     }
 
     /* Copy data from old to new */
-    copy_size = block->size - BLOCK_HEADER_SIZE;
+    copy_size = old_size;
     if (new_size < copy_size) {
         copy_size = new_size;
     }
-
-    src = (uint8_t *)ptr;
-    dst = (uint8_t *)new_ptr;
-    for (i = 0; i < copy_size; i++) {
-        dst[i] = src[i];
-    }
+    memcpy(new_ptr, ptr, copy_size);
 
     /* Free old block */
     kfree(ptr);
@@ -242,30 +364,51 @@ void heap_get_stats(heap_stats_t *stats)
     heap_block_t *block;
     size_t used_size = 0;
     size_t free_size = 0;
+    size_t largest_free = 0;
     size_t num_blocks = 0;
+    size_t slab_size = 0;
+    size_t slab_used = 0;
+    uint32_t i;
+    uint64_t flags;
 
     if (stats == NULL || !heap.initialized) {
         return;
     }
 
-    /* Walk block list */
-    block = heap.first_block;
-    while (block != NULL) {
+    flags = spin_lock_irqsave(&heap.lock);
+
+    /* Walk blocks in address order */
+    for (block = (heap_block_t *)heap.heap_start; block != NULL;
+         block = next_block(block)) {
         num_blocks++;
         if (block->is_free) {
             free_size += block->size;
+            if (block->size > largest_free) {
+                largest_free = block->size;
+            }
         } else {
             used_size += block->size;
         }
-        block = block->next;
     }
 
     stats->total_size = heap.heap_size;
     stats->used_size = used_size;
     stats->free_size = free_size;
+    stats->largest_free = largest_free;
     stats->num_blocks = num_blocks;
     stats->num_allocs = heap.num_allocs;
     stats->num_frees = heap.num_frees;
+
+    spin_unlock_irqrestore(&heap.lock, flags);
+
+    /* Size-class slabs */
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_get_class_stats(i, &stats->classes[i]);
+        slab_size += stats->classes[i].num_slabs * SLAB_SIZE;
+        slab_used += stats->classes[i].active_objs * stats->classes[i].obj_size;
+    }
+    stats->slab_size = slab_size;
+    stats->slab_used = slab_used;
 }
 
 /**
@@ -276,6 +419,7 @@ void heap_dump_state(void)
     heap_stats_t stats;
     heap_block_t *block;
     uint32_t block_num = 0;
+    uint32_t fl, sl;
 
     kprintf("\n=== Heap State ===\n");
     kprintf("Heap: %p - %p\n", heap.heap_start, heap.heap_end);
@@ -288,25 +432,43 @@ void heap_dump_state(void)
     kprintf("Free: %u KB (%u%%)\n",
             (uint32_t)(stats.free_size / 1024),
             (uint32_t)(stats.free_size * 100 / stats.total_size));
+    kprintf("Largest free block: %u KB\n", (uint32_t)(stats.largest_free / 1024));
     kprintf("Blocks: %u\n", (uint32_t)stats.num_blocks);
     kprintf("Allocs: %u, Frees: %u\n",
             (uint32_t)stats.num_allocs,
             (uint32_t)stats.num_frees);
+    kprintf("Slabs: %u KB, %u bytes in use\n",
+            (uint32_t)(stats.slab_size / 1024),
+            (uint32_t)stats.slab_used);
 
     kprintf("\nBlock list:\n");
-    block = heap.first_block;
+    block = (heap_block_t *)heap.heap_start;
     while (block != NULL && block_num < 20) {
         kprintf("  [%2u] %p: %6u bytes %s\n",
                 block_num,
                 block,
                 (uint32_t)block->size,
                 block->is_free ? "(free)" : "(used)");
-        block = block->next;
+        block = next_block(block);
         block_num++;
     }
     if (block != NULL) {
         kprintf("  ... (more blocks)\n");
     }
+
+    kprintf("\nFree bins:\n");
+    for (fl = 0; fl < FREE_FL_COUNT; fl++) {
+        for (sl = 0; sl < FREE_SL_COUNT; sl++) {
+            uint32_t count = 0;
+            for (block = heap.free_lists[fl][sl]; block != NULL;
+                 block = block->next_free) {
+                count++;
+            }
+            if (count > 0) {
+                kprintf("  [%u,%u]: %u blocks\n", fl, sl, count);
+            }
+        }
+    }
     kprintf("=================\n\n");
 }
 
@@ -315,69 +477,196 @@ void heap_dump_state(void)
  * ============================================================================ */
 
 /**
- * Find first free block that fits (first-fit algorithm)
+ * Index of the most significant set bit (size must be non-zero)
+ */
+static inline uint32_t fls64(uint64_t size)
+{
+    return 63 - (uint32_t)__builtin_clzll(size);
+}
+
+/**
+ * Map a block size to its free-list bin
+ */
+static void mapping_insert(size_t size, uint32_t *fl, uint32_t *sl)
+{
+    uint32_t f;
+
+    if (size < FREE_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (uint32_t)(size / (FREE_SMALL_BLOCK / FREE_SL_COUNT));
+        return;
+    }
+
+    f = fls64(size);
+    *sl = (uint32_t)(size >> (f - FREE_SL_LOG2)) ^ FREE_SL_COUNT;
+    *fl = f - (FREE_FL_SHIFT - 1);
+}
+
+/**
+ * Find first free block that fits in the lowest bin guaranteed to fit
  */
 static heap_block_t *find_free_block(size_t size)
 {
-    heap_block_t *block = heap.first_block;
+    uint32_t fl, sl;
+    uint32_t sl_map, fl_map;
+
+    /* Round up to the next bin boundary so any block found is big enough */
+    if (size >= FREE_SMALL_BLOCK) {
+        size += (1UL << (fls64(size) - FREE_SL_LOG2)) - 1;
+    }
+    mapping_insert(size, &fl, &sl);
+
+    if (fl >= FREE_FL_COUNT) {
+        return NULL;
+    }
 
-    while (block != NULL) {
-        if (block->is_free && block->size >= size) {
-            return block;
+    sl_map = heap.sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        fl_map = (fl + 1 < 32) ? heap.fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return NULL;
         }
-        block = block->next;
+        fl = (uint32_t)__builtin_ctz(fl_map);
+        sl_map = heap.sl_bitmap[fl];
     }
+    sl = (uint32_t)__builtin_ctz(sl_map);
 
-    return NULL;
+    return heap.free_lists[fl][sl];
 }
 
 /**
- * Split block into two if large enough
+ * Split a used block into two, filing the remainder as a free block
+ * Callers only split blocks whose physical successor is in use, so the
+ * remainder never needs coalescing.
  */
 static void split_block(heap_block_t *block, size_t size)
 {
     heap_block_t *new_block;
-    size_t remaining_size;
-
-    remaining_size = block->size - size;
 
     /* Create new block in remaining space */
     new_block = (heap_block_t *)((uint64_t)block + size);
-    new_block->size = remaining_size;
-    new_block->is_free = true;
-    new_block->next = block->next;
-    new_block->prev = block;
+    set_block(new_block, block->size - size, true);
 
     /* Update current block */
-    block->size = size;
-    block->next = new_block;
+    set_block(block, size, false);
+
+    insert_free_block(new_block);
+}
+
+/**
+ * Merge a block with its free neighbours (O(1) via boundary tags)
+ * Neighbours are removed from their free lists; the result is marked free
+ * but not yet inserted.
+ */
+static heap_block_t *coalesce(heap_block_t *block)
+{
+    heap_block_t *next = next_block(block);
+    heap_block_t *prev = prev_block(block);
+    size_t size = block->size;
+
+    /* Stale headers inside the merged block still read as free */
+    block->is_free = true;
+
+    if (next != NULL && next->is_free) {
+        remove_free_block(next);
+        size += next->size;
+    }
 
-    /* Update next block's prev pointer */
-    if (new_block->next != NULL) {
-        new_block->next->prev = new_block;
+    if (prev != NULL && prev->is_free) {
+        remove_free_block(prev);
+        size += prev->size;
+        block = prev;
     }
+
+    set_block(block, size, true);
+    return block;
 }
 
 /**
- * Merge adjacent free blocks
+ * Push a free block onto its bin
  */
-static void merge_free_blocks(void)
+static void insert_free_block(heap_block_t *block)
 {
-    heap_block_t *block = heap.first_block;
+    uint32_t fl, sl;
 
-    while (block != NULL && block->next != NULL) {
-        if (block->is_free && block->next->is_free) {
-            /* Merge with next block */
-            block->size += block->next->size;
-            block->next = block->next->next;
+    mapping_insert(block->size, &fl, &sl);
 
-            if (block->next != NULL) {
-                block->next->prev = block;
-            }
-        } else {
-            block = block->next;
+    block->prev_free = NULL;
+    block->next_free = heap.free_lists[fl][sl];
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block;
+    }
+    heap.free_lists[fl][sl] = block;
+
+    heap.fl_bitmap |= 1U << fl;
+    heap.sl_bitmap[fl] |= 1U << sl;
+}
+
+/**
+ * Unlink a free block from its bin
+ */
+static void remove_free_block(heap_block_t *block)
+{
+    uint32_t fl, sl;
+
+    mapping_insert(block->size, &fl, &sl);
+
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap.free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+
+    if (heap.free_lists[fl][sl] == NULL) {
+        heap.sl_bitmap[fl] &= ~(1U << sl);
+        if (heap.sl_bitmap[fl] == 0) {
+            heap.fl_bitmap &= ~(1U << fl);
         }
     }
+
+    block->next_free = NULL;
+    block->prev_free = NULL;
+}
+
+/**
+ * Write a block's header fields and footer tag
+ */
+static void set_block(heap_block_t *block, size_t size, bool is_free)
+{
+    block->size = size;
+    block->is_free = is_free;
+    *(size_t *)((uint64_t)block + size - BLOCK_FOOTER_SIZE) = size;
+}
+
+/**
+ * Get the block physically after this one, or NULL at the heap end
+ */
+static heap_block_t *next_block(heap_block_t *block)
+{
+    uint64_t next = (uint64_t)block + block->size;
+
+    if (next >= (uint64_t)heap.heap_end) {
+        return NULL;
+    }
+    return (heap_block_t *)next;
+}
+
+/**
+ * Get the block physically before this one via its footer, or NULL
+ */
+static heap_block_t *prev_block(heap_block_t *block)
+{
+    size_t prev_size;
+
+    if ((void *)block <= heap.heap_start) {
+        return NULL;
+    }
+
+    prev_size = *(size_t *)((uint64_t)block - BLOCK_FOOTER_SIZE);
+    return (heap_block_t *)((uint64_t)block - prev_size);
 }
 
 /* ============================================================================
@@ -0,0 +1,287 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/memblock.c
+ * Description: Early physical memory map and boot-time allocator
+ * ============================================================================ */
+
+#include <aeos/memblock.h>
+#include <aeos/mm.h>
+#include <aeos/dtb.h>
+#include <aeos/kprintf.h>
+#include <aeos/types.h>
+
+/* External symbols from linker script */
+extern char _kernel_start;
+extern char __stack_top;
+
+/* A sorted list of disjoint, non-adjacent ranges */
+typedef struct {
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+    uint32_t count;
+} memblock_list_t;
+
+/* Runs single-threaded at boot, before interrupts: no lock */
+static struct {
+    memblock_list_t memory;
+    memblock_list_t reserved;
+    bool retired;
+} memblock;
+
+/**
+ * Insert [base, end) into a list, merging what it overlaps or touches
+ */
+static int list_insert(memblock_list_t *list, uint64_t base, uint64_t end)
+{
+    memblock_region_t *r = list->regions;
+    uint32_t i, j, first, last;
+
+    if (end <= base) {
+        return 0;
+    }
+
+    /* First range ending at or after base, then every one it reaches */
+    for (first = 0; first < list->count && r[first].base + r[first].size < base; first++) {
+    }
+    for (last = first; last < list->count && r[last].base <= end; last++) {
+        if (r[last].base < base) {
+            base = r[last].base;
+        }
+        if (r[last].base + r[last].size > end) {
+            end = r[last].base + r[last].size;
+        }
+    }
+
+    if (last == first) {
+        /* Touches nothing: open a slot */
+        if (list->count >= MEMBLOCK_MAX_REGIONS) {
+            return -1;
+        }
+        for (i = list->count; i > first; i--) {
+            r[i] = r[i - 1];
+        }
+        list->count++;
+    } else {
+        /* Collapse [first, last) into first */
+        for (i = first + 1, j = last; j < list->count; i++, j++) {
+            r[i] = r[j];
+        }
+        list->count -= last - first - 1;
+    }
+
+    r[first].base = base;
+    r[first].size = end - base;
+    return 0;
+}
+
+/**
+ * Add a range of RAM
+ */
+int memblock_add(uint64_t base, uint64_t size)
+{
+    uint64_t start = PAGE_ALIGN_UP(base);
+    uint64_t end = PAGE_ALIGN_DOWN(base + size);
+
+    if (memblock.retired) {
+        return -1;
+    }
+    if (end > PHYS_RAM_LIMIT) {
+        end = PHYS_RAM_LIMIT;
+    }
+    if (list_insert(&memblock.memory, start, end) != 0) {
+        klog_error("memblock: too many RAM ranges, dropping %p-%p",
+                   (void *)start, (void *)end);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reserve a range
+ */
+int memblock_reserve(uint64_t base, uint64_t size)
+{
+    uint64_t start = PAGE_ALIGN_DOWN(base);
+    uint64_t end = PAGE_ALIGN_UP(base + size);
+
+    if (memblock.retired) {
+        return -1;
+    }
+    if (list_insert(&memblock.reserved, start, end) != 0) {
+        klog_error("memblock: too many reserved ranges, %p-%p not kept",
+                   (void *)start, (void *)end);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the next free range at or above a position
+ */
+bool memblock_next_free(uint64_t *pos, uint64_t *start, uint64_t *end)
+{
+    const memblock_region_t *mem;
+    const memblock_region_t *rsv = memblock.reserved.regions;
+    uint64_t s, e, mem_end;
+    uint32_t i, j;
+
+    for (i = 0; i < memblock.memory.count; i++) {
+        mem = &memblock.memory.regions[i];
+        mem_end = mem->base + mem->size;
+        if (mem_end <= *pos) {
+            continue;
+        }
+
+        /* Step over reserved ranges covering the start */
+        s = mem->base > *pos ? mem->base : *pos;
+        for (j = 0; j < memblock.reserved.count; j++) {
+            if (rsv[j].base <= s && rsv[j].base + rsv[j].size > s) {
+                s = rsv[j].base + rsv[j].size;
+            }
+        }
+        if (s >= mem_end) {
+            continue;
+        }
+
+        /* Up to the next reserved range or the end of this RAM range */
+        e = mem_end;
+        for (j = 0; j < memblock.reserved.count; j++) {
+            if (rsv[j].base > s && rsv[j].base < e) {
+                e = rsv[j].base;
+                break;
+            }
+        }
+
+        *start = s;
+        *end = e;
+        *pos = e;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Allocate from the lowest free range that fits
+ */
+uint64_t memblock_alloc(uint64_t size, uint64_t align)
+{
+    uint64_t pos = 0, start, end, addr;
+
+    if (memblock.retired || size == 0 || align < PAGE_SIZE || (align & (align - 1)) != 0) {
+        return 0;
+    }
+    size = PAGE_ALIGN_UP(size);
+
+    while (memblock_next_free(&pos, &start, &end)) {
+        addr = (start + align - 1) & ~(align - 1);
+        if (addr >= start && addr + size <= end) {
+            return memblock_reserve(addr, size) == 0 ? addr : 0;
+        }
+    }
+
+    klog_error("memblock: no room for %u KB", (uint32_t)(size / 1024));
+    return 0;
+}
+
+/**
+ * Stop handing out memory
+ */
+void memblock_retire(void)
+{
+    memblock.retired = true;
+}
+
+/**
+ * Build the memory map from the device tree
+ */
+void memblock_init(void)
+{
+    dtb_region_t regions[MEMBLOCK_MAX_REGIONS];
+    uint32_t n, i;
+
+    n = dtb_get_memory(regions, MEMBLOCK_MAX_REGIONS);
+    for (i = 0; i < n; i++) {
+        memblock_add(regions[i].base, regions[i].size);
+    }
+    if (memblock.memory.count == 0) {
+        klog_warn("memblock: no memory in the device tree, assuming %u MB",
+                  (uint32_t)(PHYS_RAM_DEFAULT_SIZE >> 20));
+        memblock_add(PHYS_RAM_START, PHYS_RAM_DEFAULT_SIZE);
+    }
+
+    /* The image with its .bss and boot stack */
+    memblock_reserve((uint64_t)&_kernel_start,
+                     (uint64_t)&__stack_top - (uint64_t)&_kernel_start);
+
+    n = dtb_get_reserved(regions, MEMBLOCK_MAX_REGIONS);
+    for (i = 0; i < n; i++) {
+        memblock_reserve(regions[i].base, regions[i].size);
+    }
+
+    kprintf("  RAM: %u MB in %u range(s), %p - %p\n",
+            (uint32_t)(memblock_memory_size() >> 20), memblock.memory.count,
+            (void *)memblock_start(), (void *)memblock_end());
+}
+
+/**
+ * Lowest RAM address
+ */
+uint64_t memblock_start(void)
+{
+    return memblock.memory.count > 0 ? memblock.memory.regions[0].base : 0;
+}
+
+/**
+ * End of the highest RAM range
+ */
+uint64_t memblock_end(void)
+{
+    const memblock_region_t *last;
+
+    if (memblock.memory.count == 0) {
+        return 0;
+    }
+    last = &memblock.memory.regions[memblock.memory.count - 1];
+    return last->base + last->size;
+}
+
+/**
+ * Total bytes of RAM in all ranges
+ */
+uint64_t memblock_memory_size(void)
+{
+    uint64_t total = 0;
+    uint32_t i;
+
+    for (i = 0; i < memblock.memory.count; i++) {
+        total += memblock.memory.regions[i].size;
+    }
+    return total;
+}
+
+/**
+ * Get a RAM range
+ */
+bool memblock_get_memory(uint32_t index, memblock_region_t *region)
+{
+    if (region == NULL || index >= memblock.memory.count) {
+        return false;
+    }
+    *region = memblock.memory.regions[index];
+    return true;
+}
+
+/**
+ * Get a reserved range
+ */
+bool memblock_get_reserved(uint32_t index, memblock_region_t *region)
+{
+    if (region == NULL || index >= memblock.reserved.count) {
+        return false;
+    }
+    *region = memblock.reserved.regions[index];
+    return true;
+}
+
+/* ============================================================================
+ * End of memblock.c
+ * ============================================================================ */
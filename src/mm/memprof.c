@@ -0,0 +1,365 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/memprof.c
+ * Description: Allocation profiler - live bytes per allocation site
+ * ============================================================================ */
+
+#include <aeos/memprof.h>
+#include <aeos/pmm.h>
+#include <aeos/spinlock.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * The allocators pass every allocation's call site (a "file:line" string
+ * literal, so its address is the key). Two open-addressing tables sit
+ * under one lock: the sites, which are only ever added to, and the live
+ * allocations, keyed by address, which a free removes from with backward
+ * shift deletion so no tombstones build up. Neither table allocates, so
+ * recording can't recurse into the allocators.
+ */
+
+#define SITE_MASK           (MEMPROF_MAX_SITES - 1)
+#define LIVE_MASK           (MEMPROF_MAX_LIVE - 1)
+
+/* Live entries kept at most 3/4 of the table, so probes stay short */
+#define LIVE_LIMIT          (MEMPROF_MAX_LIVE / 4 * 3)
+
+_Static_assert((MEMPROF_MAX_SITES & SITE_MASK) == 0,
+               "MEMPROF_MAX_SITES must be a power of two");
+_Static_assert((MEMPROF_MAX_LIVE & LIVE_MASK) == 0,
+               "MEMPROF_MAX_LIVE must be a power of two");
+_Static_assert(MEMPROF_MAX_SITES <= 65536, "live entries hold a 16-bit site index");
+
+/* Page allocations are keyed with the low bit set: a slab object can share
+ * an address with the page it lives in */
+#define LIVE_KEY(ptr, kind)  ((uint64_t)(uintptr_t)(ptr) | ((kind) == MEMPROF_PAGES))
+
+/* One live allocation (16 bytes) */
+typedef struct {
+    uint64_t key;                       /* 0 if the slot is empty */
+    uint32_t size;
+    uint16_t site;                      /* Index into memprof.sites */
+    uint16_t reserved;
+} live_t;
+
+/* Pages holding the live table */
+#define LIVE_TABLE_SIZE     (MEMPROF_MAX_LIVE * sizeof(live_t))
+
+volatile uint32_t memprof_enabled;
+
+static struct {
+    memprof_site_t sites[MEMPROF_MAX_SITES];
+    live_t *live;                       /* From the PMM, never freed */
+    uint32_t nsites;
+    uint32_t nlive;
+    uint64_t untracked;
+    spinlock_t lock;
+} memprof = {
+    .lock = SPINLOCK_INIT,
+};
+
+/* ============================================================================
+ * Tables (called with memprof.lock held)
+ * ============================================================================ */
+
+static inline uint32_t hash_ptr(uint64_t key, uint32_t mask)
+{
+    return (uint32_t)(((key >> 3) * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+}
+
+/**
+ * Find or add a site
+ *
+ * @return Index, or -1 if the table is full
+ */
+static int site_lookup(const char *site, uint32_t kind)
+{
+    memprof_site_t *s;
+    uint32_t i = hash_ptr((uint64_t)(uintptr_t)site, SITE_MASK);
+
+    for (;;) {
+        s = &memprof.sites[i];
+        if (s->site == site) {
+            return (int)i;
+        }
+        if (s->site == NULL) {
+            break;
+        }
+        i = (i + 1) & SITE_MASK;
+    }
+
+    /* One slot stays empty so every probe ends */
+    if (memprof.nsites >= MEMPROF_MAX_SITES - 1) {
+        return -1;
+    }
+    s->site = site;
+    s->kind = kind;
+    memprof.nsites++;
+    return (int)i;
+}
+
+/**
+ * Slot holding key, or -1
+ */
+static int live_find(uint64_t key)
+{
+    uint32_t i = hash_ptr(key, LIVE_MASK);
+
+    while (memprof.live[i].key != 0) {
+        if (memprof.live[i].key == key) {
+            return (int)i;
+        }
+        i = (i + 1) & LIVE_MASK;
+    }
+    return -1;
+}
+
+/**
+ * Empty a slot, moving later entries of the probe run back into it
+ */
+static void live_remove(uint32_t i)
+{
+    uint32_t j = i;
+    uint32_t home;
+
+    for (;;) {
+        j = (j + 1) & LIVE_MASK;
+        if (memprof.live[j].key == 0) {
+            break;
+        }
+
+        /* An entry whose home lies cyclically in (i, j] must stay put */
+        home = hash_ptr(memprof.live[j].key, LIVE_MASK);
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) {
+            continue;
+        }
+
+        memprof.live[i] = memprof.live[j];
+        i = j;
+    }
+    memprof.live[i].key = 0;
+    memprof.nlive--;
+}
+
+static void clear_tables(void)
+{
+    memset(memprof.sites, 0, sizeof(memprof.sites));
+    memprof.nsites = 0;
+    if (memprof.live != NULL) {
+        memset(memprof.live, 0, LIVE_TABLE_SIZE);
+    }
+    memprof.nlive = 0;
+    memprof.untracked = 0;
+}
+
+/* ============================================================================
+ * Recording
+ * ============================================================================ */
+
+/**
+ * Record an allocation
+ */
+void memprof_alloc(const void *ptr, size_t size, const char *site, uint32_t kind)
+{
+    memprof_site_t *s;
+    uint64_t flags, key;
+    uint32_t i;
+    int index;
+
+    if (ptr == NULL || site == NULL) {
+        return;
+    }
+
+    key = LIVE_KEY(ptr, kind);
+    flags = spin_lock_irqsave(&memprof.lock);
+
+    if (!memprof_enabled || memprof.live == NULL) {
+        spin_unlock_irqrestore(&memprof.lock, flags);
+        return;
+    }
+
+    index = site_lookup(site, kind);
+    if (index < 0 || memprof.nlive >= LIVE_LIMIT) {
+        memprof.untracked++;
+        spin_unlock_irqrestore(&memprof.lock, flags);
+        return;
+    }
+
+    s = &memprof.sites[index];
+    s->allocs++;
+    s->bytes += size;
+
+    /* Reuse of an address whose free went unseen: drop the stale entry */
+    i = hash_ptr(key, LIVE_MASK);
+    while (memprof.live[i].key != 0 && memprof.live[i].key != key) {
+        i = (i + 1) & LIVE_MASK;
+    }
+    if (memprof.live[i].key == key) {
+        s = &memprof.sites[memprof.live[i].site];
+        s->live_count--;
+        s->live_bytes -= memprof.live[i].size;
+        memprof.nlive--;
+    }
+
+    memprof.live[i].key = key;
+    memprof.live[i].size = (uint32_t)size;
+    memprof.live[i].site = (uint16_t)index;
+    memprof.nlive++;
+
+    s = &memprof.sites[index];
+    s->live_count++;
+    s->live_bytes += (uint32_t)size;
+
+    spin_unlock_irqrestore(&memprof.lock, flags);
+}
+
+/**
+ * Record a free
+ */
+void memprof_free(const void *ptr, uint32_t kind)
+{
+    memprof_site_t *s;
+    uint64_t flags;
+    int i;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&memprof.lock);
+
+    if (memprof_enabled && memprof.live != NULL) {
+        i = live_find(LIVE_KEY(ptr, kind));
+        if (i >= 0) {
+            s = &memprof.sites[memprof.live[i].site];
+            s->live_count--;
+            s->live_bytes -= memprof.live[i].size;
+            live_remove((uint32_t)i);
+        }
+    }
+
+    spin_unlock_irqrestore(&memprof.lock, flags);
+}
+
+/* ============================================================================
+ * Control
+ * ============================================================================ */
+
+/**
+ * Start or stop recording
+ */
+int memprof_enable(bool on)
+{
+    live_t *live = NULL;
+    uint64_t flags;
+    uint32_t order = 0;
+
+    if (!on) {
+        memprof_enabled = 0;
+        return 0;
+    }
+
+    /* Allocated outside the lock: the page allocator may record itself */
+    if (memprof.live == NULL) {
+        while (((size_t)PAGE_SIZE << order) < LIVE_TABLE_SIZE) {
+            order++;
+        }
+        live = (live_t *)(uintptr_t)pmm_alloc_pages(order);
+        if (live == NULL) {
+            klog_error("memprof: Failed to allocate the live table");
+            return -1;
+        }
+    }
+
+    flags = spin_lock_irqsave(&memprof.lock);
+    if (memprof.live == NULL) {
+        memprof.live = live;
+        live = NULL;
+    }
+    clear_tables();
+    memprof_enabled = 1;
+    spin_unlock_irqrestore(&memprof.lock, flags);
+
+    /* Lost a race with another start */
+    if (live != NULL) {
+        pmm_free_pages((uint64_t)(uintptr_t)live, order);
+    }
+    return 0;
+}
+
+/**
+ * Forget every site and live allocation
+ */
+void memprof_reset(void)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&memprof.lock);
+    clear_tables();
+    spin_unlock_irqrestore(&memprof.lock, flags);
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================ */
+
+/**
+ * Copy out the sites holding the most live bytes
+ */
+uint32_t memprof_top(memprof_site_t *out, uint32_t max)
+{
+    const memprof_site_t *s;
+    uint32_t n = 0, i, j;
+    uint64_t flags;
+
+    if (out == NULL || max == 0) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&memprof.lock);
+
+    /* Insertion into the short output list, largest first */
+    for (i = 0; i < MEMPROF_MAX_SITES; i++) {
+        s = &memprof.sites[i];
+        if (s->site == NULL || s->live_bytes == 0) {
+            continue;
+        }
+        if (n == max && s->live_bytes <= out[n - 1].live_bytes) {
+            continue;
+        }
+
+        j = n < max ? n++ : n - 1;
+        while (j > 0 && out[j - 1].live_bytes < s->live_bytes) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = *s;
+    }
+
+    spin_unlock_irqrestore(&memprof.lock, flags);
+    return n;
+}
+
+/**
+ * Get profiler statistics
+ */
+void memprof_get_stats(memprof_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (!stats) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&memprof.lock);
+    stats->enabled = memprof_enabled != 0;
+    stats->sites = memprof.nsites;
+    stats->live = memprof.nlive;
+    stats->untracked = memprof.untracked;
+    spin_unlock_irqrestore(&memprof.lock, flags);
+}
+
+/* ============================================================================
+ * End of memprof.c
+ * ============================================================================ */
@@ -7,12 +7,26 @@
 #include <aeos/mm.h>
 #include <aeos/pmm.h>
 #include <aeos/heap.h>
+#include <aeos/slab.h>
+#include <aeos/mmu.h>
+#include <aeos/memblock.h>
 #include <aeos/kprintf.h>
+#include <aeos/spinlock.h>
 
-/* External symbols from linker script */
-extern char _kernel_end;
-extern char __heap_start;
-extern char __heap_end;
+/* The heap gets 1/MM_HEAP_DIV of RAM, within these bounds, 2MB aligned */
+#define MM_HEAP_DIV         16
+#define MM_HEAP_MIN         (16 * 1024 * 1024)
+#define MM_HEAP_MAX         (256 * 1024 * 1024)
+#define MM_HEAP_ALIGN       (2 * 1024 * 1024)
+
+/* Huge buffers in use */
+static struct {
+    size_t buffers;
+    size_t bytes;
+    spinlock_t lock;
+} huge = {
+    .lock = SPINLOCK_INIT,
+};
 
 /**
  * Initialize all memory management subsystems
@@ -20,22 +34,42 @@ extern char __heap_end;
 void mm_init(void)
 {
     uint64_t heap_start;
-    uint64_t heap_end;
     uint64_t heap_size;
 
     klog_info("Initializing Memory Management subsystem");
     kprintf("\n");
 
-    /* Get heap boundaries */
-    heap_start = (uint64_t)&__heap_start;
-    heap_end = (uint64_t)&__heap_end;
-    heap_size = heap_end - heap_start;
+    /* Size the heap from RAM and carve it out before the PMM takes the rest */
+    heap_size = memblock_memory_size() / MM_HEAP_DIV;
+    if (heap_size < MM_HEAP_MIN) {
+        heap_size = MM_HEAP_MIN;
+    } else if (heap_size > MM_HEAP_MAX) {
+        heap_size = MM_HEAP_MAX;
+    }
+    heap_start = memblock_alloc(heap_size, MM_HEAP_ALIGN);
+    if (heap_start == 0) {
+        /* Small machine: take what an unaligned 16MB gets */
+        heap_size = MM_HEAP_MIN;
+        heap_start = memblock_alloc(heap_size, PAGE_SIZE);
+    }
+
+    /* Initialize Physical Memory Manager over everything memblock left free */
+    pmm_init();
+
+    /* Build identity-mapped page tables and turn on the MMU and caches */
+    if (mmu_init() != 0) {
+        klog_warn("MMU setup failed, running with MMU and caches off");
+    }
 
-    /* Initialize Physical Memory Manager - start allocating AFTER the heap */
-    pmm_init(PHYS_RAM_START, PHYS_RAM_END, heap_end);
+    /* Size-class slabs for small kmalloc requests (pages from the PMM) */
+    slab_init();
 
     /* Initialize kernel heap */
-    heap_init((void *)heap_start, heap_size);
+    if (heap_start != 0) {
+        heap_init((void *)heap_start, heap_size);
+    } else {
+        klog_error("No memory for the kernel heap");
+    }
 
     kprintf("\n");
     klog_info("Memory Management initialization complete");
@@ -71,6 +105,85 @@ size_t mm_get_used_memory(void)
     return stats.used_pages * PAGE_SIZE;
 }
 
+/**
+ * Smallest PMM order holding size bytes, or -1 if none does
+ */
+static int huge_order(size_t size)
+{
+    int order = 0;
+
+    while (((size_t)PAGE_SIZE << order) < size) {
+        if (++order > PMM_MAX_ORDER) {
+            return -1;
+        }
+    }
+    return order;
+}
+
+/**
+ * Allocate a huge buffer
+ */
+void *mm_alloc_huge_at(size_t size, const char *site)
+{
+    uint64_t flags;
+    uint64_t addr;
+    int order = huge_order(size);
+
+    if (size == 0 || order < 0) {
+        klog_error("mm_alloc_huge: bad size %u", (uint32_t)size);
+        return NULL;
+    }
+
+    addr = pmm_alloc_pages_at((uint32_t)order, site);
+    if (addr == 0) {
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&huge.lock);
+    huge.buffers++;
+    huge.bytes += (size_t)PAGE_SIZE << order;
+    spin_unlock_irqrestore(&huge.lock, flags);
+
+    return (void *)(uintptr_t)addr;
+}
+
+/**
+ * Free a huge buffer
+ */
+void mm_free_huge(void *ptr, size_t size)
+{
+    uint64_t flags;
+    int order = huge_order(size);
+
+    if (ptr == NULL || size == 0 || order < 0) {
+        return;
+    }
+
+    pmm_free_pages((uint64_t)(uintptr_t)ptr, (uint32_t)order);
+
+    flags = spin_lock_irqsave(&huge.lock);
+    huge.buffers--;
+    huge.bytes -= (size_t)PAGE_SIZE << order;
+    spin_unlock_irqrestore(&huge.lock, flags);
+}
+
+/**
+ * Get huge buffer statistics
+ */
+void mm_get_huge_stats(mm_huge_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&huge.lock);
+    stats->buffers = huge.buffers;
+    stats->bytes = huge.bytes;
+    spin_unlock_irqrestore(&huge.lock, flags);
+}
+
 /* ============================================================================
  * End of mm.c
  * ============================================================================ */
@@ -0,0 +1,1259 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/mmu.c
+ * Description: MMU setup - identity-mapped kernel page tables
+ * ============================================================================ */
+
+#include <aeos/mmu.h>
+#include <aeos/mm.h>
+#include <aeos/pmm.h>
+#include <aeos/heap.h>
+#include <aeos/memblock.h>
+#include <aeos/uart.h>
+#include <aeos/gic.h>
+#include <aeos/virtio_gpu.h>
+#include <aeos/pflash.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <asm/registers.h>
+
+/* QEMU virt fw_cfg interface (used by ramfb) */
+#define FW_CFG_BASE     0x09020000
+#define FW_CFG_SIZE     0x1000
+
+/* GIC distributor, CPU interface and first redistributor frames */
+#define GIC_MAP_SIZE    0x00100000
+
+/* Level-1 slots private to each user address space */
+#define USER_L1_FIRST   MMU_L1_INDEX(MMU_USER_BASE)
+#define USER_L1_LAST    MMU_L1_INDEX(MMU_USER_TOP - 1)
+
+#define ASID_MASK       ((uint64_t)MMU_NUM_ASIDS - 1)
+
+/**
+ * User address space
+ */
+struct mmu_space {
+    uint64_t *root;                         /* Level 1 table (TTBR0_EL1) */
+    uint64_t asid;                          /* generation << MMU_ASID_BITS | ASID */
+    size_t pages;                           /* Leaf pages mapped (owned) */
+    size_t tables;                          /* Table pages, root included */
+};
+
+/**
+ * MMU state
+ */
+static struct {
+    uint64_t *root;                         /* Level 1 table (TTBR0_EL1) */
+    size_t table_pages;                     /* Pages allocated for tables */
+    size_t mapped_pages;                    /* Leaf pages mapped, blocks included */
+    size_t blocks_1g;                       /* Block descriptors per level */
+    size_t blocks_2m;
+    mmu_region_t regions[MMU_MAX_REGIONS];  /* Named regions for reporting */
+    uint32_t num_regions;
+    bool enabled;
+
+    /* Mapping window: one bit per page, set while allocated */
+    spinlock_t lock;                        /* Guards window tables and bitmap */
+    uint64_t vmap_bitmap[MMU_VMAP_PAGES / 64];
+    size_t vmap_used;
+    size_t vmap_hint;                       /* First page worth searching */
+    mmu_fault_fn vmap_fault;
+
+    /* User address spaces (counters under lock) */
+    mmu_fault_fn user_fault;
+    uint32_t num_spaces;
+    size_t user_pages;
+    uint64_t cow_faults;
+    uint64_t cow_copies;
+
+    /* ASIDs: one bit per ASID, set while taken in the current generation */
+    spinlock_t asid_lock;
+    uint64_t asid_generation;
+    uint64_t asid_map[MMU_NUM_ASIDS / 64];
+    uint32_t asid_next;                     /* First ASID worth searching */
+    mmu_space_t *active[MAX_CPUS];          /* Space in each CPU's TTBR0 */
+} mmu;
+
+/**
+ * Allocate and zero one translation table page
+ */
+static uint64_t *alloc_table(void)
+{
+    uint64_t page = pmm_alloc_page();
+
+    if (page == 0) {
+        return NULL;
+    }
+
+    memset((void *)page, 0, PAGE_SIZE);
+    mmu.table_pages++;
+
+    return (uint64_t *)page;
+}
+
+/**
+ * Replace a block descriptor with a table mapping the same range
+ * The entries keep the block's attributes: blocks of the next level, or
+ * pages when splitting a 2MB block. Changing a live block's size needs
+ * break-before-make, which the kernel can't do to memory it may be
+ * running from, so this only happens before the MMU is enabled.
+ *
+ * @param shift Level of the block (MMU_L1_SHIFT or MMU_L2_SHIFT)
+ */
+static uint64_t *split_block(uint64_t *table, uint32_t index, uint32_t shift)
+{
+    uint64_t desc = table[index];
+    uint64_t attrs = desc & ~PTE_ADDR_MASK;
+    uint64_t pa = desc & PTE_ADDR_MASK & ~((1ULL << shift) - 1);
+    uint32_t child = shift - (MMU_L1_SHIFT - MMU_L2_SHIFT);
+    uint64_t *next;
+    uint32_t i;
+
+    if (mmu.enabled) {
+        klog_error("MMU: refusing to split a live block at %p", (void *)pa);
+        return NULL;
+    }
+
+    next = alloc_table();
+    if (next == NULL) {
+        return NULL;
+    }
+
+    if (child == MMU_L3_SHIFT) {
+        attrs |= PTE_PAGE;
+    }
+    for (i = 0; i < MMU_ENTRIES; i++) {
+        next[i] = (pa + ((uint64_t)i << child)) | attrs;
+    }
+
+    if (shift == MMU_L1_SHIFT) {
+        mmu.blocks_1g--;
+        mmu.blocks_2m += MMU_ENTRIES;
+    } else {
+        mmu.blocks_2m--;
+    }
+
+    table[index] = ((uint64_t)next & PTE_ADDR_MASK) | PTE_TABLE | PTE_VALID;
+    return next;
+}
+
+/**
+ * Get next-level table for a descriptor, creating it if needed
+ *
+ * @param shift Level of the descriptor (MMU_L1_SHIFT or MMU_L2_SHIFT)
+ */
+static uint64_t *get_next_table(uint64_t *table, uint32_t index, uint32_t shift)
+{
+    uint64_t *next;
+
+    if (table[index] & PTE_VALID) {
+        if (!(table[index] & PTE_TABLE)) {
+            return split_block(table, index, shift);
+        }
+        return (uint64_t *)(table[index] & PTE_ADDR_MASK);
+    }
+
+    next = alloc_table();
+    if (next == NULL) {
+        return NULL;
+    }
+
+    table[index] = ((uint64_t)next & PTE_ADDR_MASK) | PTE_TABLE | PTE_VALID;
+    return next;
+}
+
+/**
+ * Convert MEM_* flags to leaf descriptor attribute bits
+ */
+static uint64_t flags_to_attrs(uint32_t flags)
+{
+    uint64_t attrs = PTE_AF | PTE_VALID | PTE_PAGE;
+
+    if (flags & MEM_DEVICE) {
+        /* Device memory: never executable, shareability is implied */
+        attrs |= PTE_ATTRINDX(MT_DEVICE_nGnRE) | PTE_PXN | PTE_UXN;
+    } else if (flags & MEM_NOCACHE) {
+        attrs |= PTE_ATTRINDX(MT_NORMAL_NC) | PTE_SH_INNER;
+    } else {
+        attrs |= PTE_ATTRINDX(MT_NORMAL) | PTE_SH_INNER;
+    }
+
+    if (!(flags & MEM_WRITE)) {
+        attrs |= PTE_AP_RO;
+    }
+
+    if (flags & MEM_USER) {
+        attrs |= PTE_AP_USER | PTE_NG;
+        /* EL1 must never execute user pages */
+        attrs |= PTE_PXN;
+        if (!(flags & MEM_EXEC)) {
+            attrs |= PTE_UXN;
+        }
+    } else {
+        /* EL0 must never execute kernel pages */
+        attrs |= PTE_UXN;
+        if (!(flags & MEM_EXEC)) {
+            attrs |= PTE_PXN;
+        }
+    }
+
+    return attrs;
+}
+
+/**
+ * Get the level-3 descriptor for an address, creating tables if asked
+ */
+static uint64_t *get_pte(uint64_t *root, uint64_t va, bool create)
+{
+    uint64_t *table = root;
+    uint32_t index;
+
+    index = MMU_L1_INDEX(va);
+    if (!(table[index] & PTE_VALID) && !create) {
+        return NULL;
+    }
+    table = get_next_table(table, index, MMU_L1_SHIFT);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    index = MMU_L2_INDEX(va);
+    if (!(table[index] & PTE_VALID) && !create) {
+        return NULL;
+    }
+    table = get_next_table(table, index, MMU_L2_SHIFT);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    return &table[MMU_L3_INDEX(va)];
+}
+
+/**
+ * Write one leaf descriptor (no TLB maintenance)
+ */
+static int map_page(uint64_t va, uint64_t pa, uint64_t attrs)
+{
+    uint64_t *pte = get_pte(mmu.root, va, true);
+
+    if (pte == NULL) {
+        return -1;
+    }
+
+    if (!(*pte & PTE_VALID)) {
+        mmu.mapped_pages++;
+    }
+    *pte = (pa & PTE_ADDR_MASK) | attrs;
+    return 0;
+}
+
+/**
+ * Write one kernel block descriptor (no TLB maintenance)
+ *
+ * @param shift MMU_L1_SHIFT for a 1GB block, MMU_L2_SHIFT for 2MB
+ * @return 0 on success, 1 if a table already covers the block (the caller
+ *         maps it with smaller entries), -1 if out of memory
+ */
+static int map_block(uint64_t va, uint64_t pa, uint64_t attrs, uint32_t shift)
+{
+    uint64_t *desc;
+    uint64_t *table;
+
+    if (shift == MMU_L1_SHIFT) {
+        desc = &mmu.root[MMU_L1_INDEX(va)];
+    } else {
+        table = get_next_table(mmu.root, MMU_L1_INDEX(va), MMU_L1_SHIFT);
+        if (table == NULL) {
+            return -1;
+        }
+        desc = &table[MMU_L2_INDEX(va)];
+    }
+
+    if (*desc & PTE_VALID) {
+        if (*desc & PTE_TABLE) {
+            return 1;
+        }
+    } else {
+        mmu.mapped_pages += 1UL << (shift - PAGE_SHIFT);
+        if (shift == MMU_L1_SHIFT) {
+            mmu.blocks_1g++;
+        } else {
+            mmu.blocks_2m++;
+        }
+    }
+
+    *desc = (pa & PTE_ADDR_MASK) | (attrs & ~PTE_PAGE);
+    return 0;
+}
+
+/**
+ * Whether [va, end) holds a whole block of a level, aligned on va and pa
+ */
+static inline bool block_fits(uint64_t va, uint64_t pa, uint64_t end, uint32_t shift)
+{
+    uint64_t size = 1ULL << shift;
+
+    return ((va | pa) & (size - 1)) == 0 && end - va >= size;
+}
+
+/**
+ * Make descriptor changes visible to every CPU's table walker
+ */
+static void tlb_flush_all(void)
+{
+    if (mmu.enabled) {
+        __asm__ volatile("dsb ishst\n"
+                         "tlbi vmalle1is\n"
+                         "dsb ish\n"
+                         "isb" ::: "memory");
+    }
+}
+
+/**
+ * Map a virtual address range to a physical range, with blocks where possible
+ */
+int mmu_map_range(uint64_t va, uint64_t pa, size_t size, uint32_t flags)
+{
+    uint64_t end;
+    uint64_t attrs;
+    uint64_t step;
+    int ret;
+
+    if (mmu.root == NULL) {
+        klog_error("MMU: page tables not initialized");
+        return -1;
+    }
+
+    if (!IS_PAGE_ALIGNED(va) || !IS_PAGE_ALIGNED(pa)) {
+        klog_error("MMU: unaligned mapping %p -> %p", (void *)va, (void *)pa);
+        return -1;
+    }
+
+    end = va + PAGE_ALIGN_UP(size);
+    if (end > (1ULL << MMU_VA_BITS) || end < va) {
+        klog_error("MMU: mapping %p + %u outside VA range", (void *)va, (uint32_t)size);
+        return -1;
+    }
+
+    /* The user range belongs to the per-process tables */
+    if (va < MMU_USER_TOP && end > MMU_USER_BASE) {
+        klog_error("MMU: kernel mapping %p overlaps the user range", (void *)va);
+        return -1;
+    }
+
+    attrs = flags_to_attrs(flags);
+
+    for (; va < end; va += step, pa += step) {
+        /* Largest block that fits, falling back where tables already are */
+        ret = 1;
+        step = PAGE_SIZE;
+        if (block_fits(va, pa, end, MMU_L1_SHIFT)) {
+            step = MMU_L1_BLOCK_SIZE;
+            ret = map_block(va, pa, attrs, MMU_L1_SHIFT);
+        }
+        if (ret > 0 && block_fits(va, pa, end, MMU_L2_SHIFT)) {
+            step = MMU_L2_BLOCK_SIZE;
+            ret = map_block(va, pa, attrs, MMU_L2_SHIFT);
+        }
+        if (ret > 0) {
+            ret = map_page(va, pa, attrs);
+        }
+        if (ret != 0) {
+            klog_error("MMU: out of memory for page tables");
+            return -1;
+        }
+    }
+
+    tlb_flush_all();
+    return 0;
+}
+
+/**
+ * Map and record a named region
+ */
+int mmu_map_region(const char *name, uint64_t pa, size_t size, uint32_t flags)
+{
+    mmu_region_t *region;
+
+    if (mmu_map_range(pa, pa, size, flags) != 0) {
+        return -1;
+    }
+
+    if (mmu.num_regions < MMU_MAX_REGIONS) {
+        region = &mmu.regions[mmu.num_regions++];
+        region->name = name;
+        region->va = pa;
+        region->pa = pa;
+        region->size = PAGE_ALIGN_UP(size);
+        region->flags = flags;
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * Mapping Window
+ * ============================================================================ */
+
+static inline bool vmap_test(size_t page)
+{
+    return (mmu.vmap_bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+static inline void vmap_set(size_t page, bool used)
+{
+    if (used) {
+        mmu.vmap_bitmap[page / 64] |= 1ULL << (page % 64);
+    } else {
+        mmu.vmap_bitmap[page / 64] &= ~(1ULL << (page % 64));
+    }
+}
+
+/**
+ * Find and reserve a run of free window pages (first fit)
+ * @return First page index, or MMU_VMAP_PAGES if the window is full
+ */
+static size_t vmap_reserve(size_t count)
+{
+    size_t start = mmu.vmap_hint;
+    size_t run = 0;
+    size_t page;
+
+    for (page = start; page < MMU_VMAP_PAGES; page++) {
+        /* Skip whole words that are fully in use */
+        if (run == 0 && page % 64 == 0 && mmu.vmap_bitmap[page / 64] == ~0ULL) {
+            page += 63;
+            continue;
+        }
+
+        if (vmap_test(page)) {
+            run = 0;
+            continue;
+        }
+
+        if (run == 0) {
+            start = page;
+        }
+        if (++run == count) {
+            for (page = start; page < start + count; page++) {
+                vmap_set(page, true);
+            }
+            if (start == mmu.vmap_hint) {
+                mmu.vmap_hint = start + count;
+            }
+            mmu.vmap_used += count;
+            return start;
+        }
+    }
+
+    return MMU_VMAP_PAGES;
+}
+
+/**
+ * Release window pages reserved by vmap_reserve()
+ */
+static void vmap_release(size_t start, size_t count)
+{
+    size_t page;
+
+    for (page = start; page < start + count; page++) {
+        vmap_set(page, false);
+    }
+    if (start < mmu.vmap_hint) {
+        mmu.vmap_hint = start;
+    }
+    mmu.vmap_used -= count;
+}
+
+/**
+ * Clear the leaf descriptors of a window range (no TLB maintenance)
+ */
+static void vmap_clear(uint64_t va, size_t count)
+{
+    uint64_t *pte;
+    size_t i;
+
+    for (i = 0; i < count; i++, va += PAGE_SIZE) {
+        pte = get_pte(mmu.root, va, false);
+        if (pte != NULL && (*pte & PTE_VALID)) {
+            *pte = 0;
+            mmu.mapped_pages--;
+        }
+    }
+}
+
+/**
+ * Map a list of physical pages contiguously in the mapping window
+ */
+uint64_t mmu_vmap(const uint64_t *pages, size_t count, uint32_t flags)
+{
+    uint64_t attrs;
+    uint64_t va;
+    uint64_t irq;
+    size_t start;
+    size_t i;
+
+    if (!mmu.enabled || pages == NULL || count == 0 || count >= MMU_VMAP_PAGES) {
+        return 0;
+    }
+
+    attrs = flags_to_attrs(flags);
+    irq = spin_lock_irqsave(&mmu.lock);
+
+    /* One extra page stays unmapped as a guard */
+    start = vmap_reserve(count + 1);
+    if (start == MMU_VMAP_PAGES) {
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        klog_warn("MMU: mapping window full (%u pages wanted)", (uint32_t)count);
+        return 0;
+    }
+    va = MMU_VMAP_BASE + ((uint64_t)start << PAGE_SHIFT);
+
+    for (i = 0; i < count; i++) {
+        if (!IS_PAGE_ALIGNED(pages[i]) || pages[i] == 0 ||
+            map_page(va + (i << PAGE_SHIFT), pages[i], attrs) != 0) {
+            vmap_clear(va, i);
+            tlb_flush_all();
+            vmap_release(start, count + 1);
+            spin_unlock_irqrestore(&mmu.lock, irq);
+            klog_error("MMU: cannot map window page %p", (void *)pages[i]);
+            return 0;
+        }
+    }
+
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    /* The range was unmapped before, so no stale entries exist: just publish */
+    __asm__ volatile("dsb ishst\n"
+                     "isb" ::: "memory");
+
+    return va;
+}
+
+/**
+ * Unmap a window mapping and release its addresses
+ */
+void mmu_vunmap(uint64_t va, size_t count)
+{
+    uint64_t irq;
+
+    if (va < MMU_VMAP_BASE || va >= MMU_VMAP_BASE + MMU_VMAP_SIZE ||
+        !IS_PAGE_ALIGNED(va) || count == 0) {
+        return;
+    }
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    vmap_clear(va, count);
+    /* The addresses can only be reused once no TLB still holds them */
+    tlb_flush_all();
+    vmap_release((va - MMU_VMAP_BASE) >> PAGE_SHIFT, count + 1);
+    spin_unlock_irqrestore(&mmu.lock, irq);
+}
+
+/**
+ * Point one mapped window page at a different physical page
+ */
+int mmu_vmap_replace(uint64_t va, uint64_t pa, uint32_t flags)
+{
+    uint64_t *pte;
+    uint64_t irq;
+
+    if (va < MMU_VMAP_BASE || va >= MMU_VMAP_BASE + MMU_VMAP_SIZE ||
+        !IS_PAGE_ALIGNED(va) || !IS_PAGE_ALIGNED(pa)) {
+        return -1;
+    }
+
+    irq = spin_lock_irqsave(&mmu.lock);
+
+    pte = get_pte(mmu.root, va, false);
+    if (pte == NULL || !(*pte & PTE_VALID)) {
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        return -1;
+    }
+
+    /* Break: remove the old translation everywhere... */
+    *pte = 0;
+    __asm__ volatile("dsb ishst\n"
+                     "tlbi vaae1is, %0\n"
+                     "dsb ish\n"
+                     "isb" :: "r"(va >> PAGE_SHIFT) : "memory");
+
+    /* ...then make the new one */
+    *pte = (pa & PTE_ADDR_MASK) | flags_to_attrs(flags);
+    __asm__ volatile("dsb ishst\n"
+                     "isb" ::: "memory");
+
+    spin_unlock_irqrestore(&mmu.lock, irq);
+    return 0;
+}
+
+/**
+ * Install the handler for faults inside the mapping window
+ */
+void mmu_set_vmap_fault_handler(mmu_fault_fn fn)
+{
+    mmu.vmap_fault = fn;
+}
+
+/* ============================================================================
+ * User Address Spaces
+ * ============================================================================ */
+
+/**
+ * Install the handler for translation faults inside the user range
+ */
+void mmu_set_user_fault_handler(mmu_fault_fn fn)
+{
+    mmu.user_fault = fn;
+}
+
+/**
+ * Create an empty user address space
+ */
+mmu_space_t *mmu_space_create(void)
+{
+    mmu_space_t *space;
+    uint64_t irq;
+
+    if (!mmu.enabled) {
+        return NULL;
+    }
+
+    space = (mmu_space_t *)kmalloc(sizeof(mmu_space_t));
+    if (space == NULL) {
+        return NULL;
+    }
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    space->root = alloc_table();
+    if (space->root == NULL) {
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        kfree(space);
+        return NULL;
+    }
+
+    /* Share the kernel half: its level-1 entries never change after boot */
+    memcpy(space->root, mmu.root, PAGE_SIZE);
+    mmu.num_spaces++;
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    space->asid = 0;                        /* Generation 0: none yet */
+    space->pages = 0;
+    space->tables = 1;
+
+    return space;
+}
+
+/**
+ * Drop every TLB entry tagged with a space's ASID, on all CPUs
+ * An ASID of an older generation was flushed by the rollover already.
+ */
+static void space_flush_asid(mmu_space_t *space)
+{
+    uint64_t irq;
+
+    irq = spin_lock_irqsave(&mmu.asid_lock);
+    if ((space->asid >> MMU_ASID_BITS) == mmu.asid_generation) {
+        __asm__ volatile("dsb ishst\n"
+                         "tlbi aside1is, %0\n"
+                         "dsb ish\n"
+                         "isb" :: "r"((space->asid & ASID_MASK) << TTBR_ASID_SHIFT)
+                         : "memory");
+    }
+    spin_unlock_irqrestore(&mmu.asid_lock, irq);
+}
+
+/**
+ * Drop one page of a space from the TLBs, on all CPUs
+ */
+static void space_flush_page(mmu_space_t *space, uint64_t va)
+{
+    uint64_t arg = ((space->asid & ASID_MASK) << TTBR_ASID_SHIFT) |
+                   (va >> PAGE_SHIFT);
+
+    __asm__ volatile("dsb ishst\n"
+                     "tlbi vae1is, %0\n"
+                     "dsb ish\n"
+                     "isb" :: "r"(arg) : "memory");
+}
+
+/**
+ * Copy a user address space, sharing its pages copy-on-write
+ */
+mmu_space_t *mmu_space_clone(mmu_space_t *src)
+{
+    mmu_space_t *dst;
+    uint64_t *l2, *l3, *pte;
+    uint64_t va, desc, pa, page;
+    size_t before;
+    uint64_t irq;
+    uint32_t i, j, k;
+    int ret = 0;
+
+    if (src == NULL) {
+        return NULL;
+    }
+
+    dst = mmu_space_create();
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    before = mmu.table_pages;
+
+    for (i = USER_L1_FIRST; i <= USER_L1_LAST && ret == 0; i++) {
+        if (!(src->root[i] & PTE_VALID)) {
+            continue;
+        }
+        l2 = (uint64_t *)(src->root[i] & PTE_ADDR_MASK);
+        for (j = 0; j < MMU_ENTRIES && ret == 0; j++) {
+            if (!(l2[j] & PTE_VALID)) {
+                continue;
+            }
+            l3 = (uint64_t *)(l2[j] & PTE_ADDR_MASK);
+            for (k = 0; k < MMU_ENTRIES; k++) {
+                desc = l3[k];
+                if (!(desc & PTE_VALID)) {
+                    continue;
+                }
+
+                va = ((uint64_t)i << MMU_L1_SHIFT) | ((uint64_t)j << MMU_L2_SHIFT) |
+                     ((uint64_t)k << MMU_L3_SHIFT);
+                pte = get_pte(dst->root, va, true);
+                if (pte == NULL) {
+                    ret = -1;
+                    break;
+                }
+
+                /* Writable pages go read-only on both sides */
+                if (!(desc & PTE_AP_RO)) {
+                    desc |= PTE_AP_RO | PTE_COW;
+                    l3[k] = desc;
+                }
+
+                pa = desc & PTE_ADDR_MASK;
+                if (pmm_page_share(pa) != 0) {
+                    /* Too many owners already: the copy gets its own page */
+                    page = pmm_alloc_page();
+                    if (page == 0) {
+                        ret = -1;
+                        break;
+                    }
+                    memcpy((void *)page, (const void *)pa, PAGE_SIZE);
+                    if (!(desc & PTE_UXN)) {
+                        mmu_sync_icache(page, PAGE_SIZE);
+                    }
+                    if (desc & PTE_COW) {
+                        desc &= ~(PTE_AP_RO | PTE_COW);
+                    }
+                    pa = page;
+                }
+
+                *pte = (desc & ~PTE_ADDR_MASK) | pa;
+                dst->pages++;
+                mmu.user_pages++;
+            }
+        }
+    }
+
+    dst->tables += mmu.table_pages - before;
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    /* The source may still cache its entries as writable */
+    space_flush_asid(src);
+
+    if (ret != 0) {
+        klog_error("MMU: out of memory cloning an address space");
+        mmu_space_destroy(dst);
+        return NULL;
+    }
+
+    return dst;
+}
+
+/**
+ * Resolve a write to a copy-on-write page of the space in TTBR0
+ *
+ * The last owner just gets write access back. Anyone else copies the page
+ * and swaps it in with break-before-make, then lets go of the shared one.
+ */
+static int cow_fault(uint64_t va)
+{
+    mmu_space_t *space = mmu.active[smp_processor_id()];
+    uint64_t *pte;
+    uint64_t attrs, old, page;
+    uint64_t irq;
+
+    if (space == NULL) {
+        return -1;
+    }
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    pte = get_pte(space->root, va, false);
+    if (pte == NULL || (*pte & (PTE_VALID | PTE_COW)) != (PTE_VALID | PTE_COW)) {
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        return -1;
+    }
+
+    old = *pte & PTE_ADDR_MASK;
+    attrs = *pte & ~(PTE_ADDR_MASK | PTE_AP_RO | PTE_COW);
+    mmu.cow_faults++;
+
+    if (!pmm_page_shared(old)) {
+        /* Only a permission change: no break-before-make needed */
+        *pte = old | attrs;
+        space_flush_page(space, va);
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        return 0;
+    }
+
+    page = pmm_alloc_page();
+    if (page == 0) {
+        spin_unlock_irqrestore(&mmu.lock, irq);
+        klog_error("MMU: no page to copy %p on write", (void *)va);
+        return -1;
+    }
+    memcpy((void *)page, (const void *)old, PAGE_SIZE);
+    if (!(attrs & PTE_UXN)) {
+        mmu_sync_icache(page, PAGE_SIZE);
+    }
+
+    *pte = 0;
+    space_flush_page(space, va);
+    *pte = page | attrs;
+    __asm__ volatile("dsb ishst\n"
+                     "isb" ::: "memory");
+    mmu.cow_copies++;
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    pmm_page_put(old);
+    return 0;
+}
+
+/**
+ * Free a user address space
+ */
+void mmu_space_destroy(mmu_space_t *space)
+{
+    uint64_t *l2, *l3;
+    uint64_t irq;
+    uint32_t i, j, k;
+
+    if (space == NULL) {
+        return;
+    }
+
+    /* Its ASID is retired until the next generation; drop its entries now */
+    space_flush_asid(space);
+
+    for (i = USER_L1_FIRST; i <= USER_L1_LAST; i++) {
+        if (!(space->root[i] & PTE_VALID)) {
+            continue;
+        }
+        l2 = (uint64_t *)(space->root[i] & PTE_ADDR_MASK);
+        for (j = 0; j < MMU_ENTRIES; j++) {
+            if (!(l2[j] & PTE_VALID)) {
+                continue;
+            }
+            l3 = (uint64_t *)(l2[j] & PTE_ADDR_MASK);
+            for (k = 0; k < MMU_ENTRIES; k++) {
+                if (l3[k] & PTE_VALID) {
+                    pmm_page_put(l3[k] & PTE_ADDR_MASK);
+                }
+            }
+            pmm_free_page((uint64_t)l3);
+        }
+        pmm_free_page((uint64_t)l2);
+    }
+    pmm_free_page((uint64_t)space->root);
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    mmu.table_pages -= space->tables;
+    mmu.user_pages -= space->pages;
+    mmu.num_spaces--;
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    kfree(space);
+}
+
+/**
+ * Map physical pages into a user address space
+ */
+int mmu_space_map(mmu_space_t *space, uint64_t va, uint64_t pa, size_t size,
+                  uint32_t flags)
+{
+    uint64_t *pte;
+    uint64_t attrs, end;
+    size_t before;
+    uint64_t irq;
+    int ret = 0;
+
+    if (space == NULL || !(flags & MEM_USER) ||
+        !IS_PAGE_ALIGNED(va) || !IS_PAGE_ALIGNED(pa) ||
+        !mmu_user_range_ok(va, PAGE_ALIGN_UP(size))) {
+        return -1;
+    }
+
+    attrs = flags_to_attrs(flags);
+    end = va + PAGE_ALIGN_UP(size);
+
+    irq = spin_lock_irqsave(&mmu.lock);
+    before = mmu.table_pages;
+
+    for (; va < end; va += PAGE_SIZE, pa += PAGE_SIZE) {
+        pte = get_pte(space->root, va, true);
+        if (pte == NULL || (*pte & PTE_VALID)) {
+            ret = -1;
+            break;
+        }
+        *pte = (pa & PTE_ADDR_MASK) | attrs;
+        space->pages++;
+        mmu.user_pages++;
+    }
+
+    space->tables += mmu.table_pages - before;
+    spin_unlock_irqrestore(&mmu.lock, irq);
+
+    /* Invalid before, so no TLB holds it: publish to the walker */
+    __asm__ volatile("dsb ishst\n"
+                     "isb" ::: "memory");
+
+    return ret;
+}
+
+/**
+ * Translate a user virtual address in a space
+ */
+uint64_t mmu_space_translate(mmu_space_t *space, uint64_t va)
+{
+    uint64_t *pte;
+
+    if (space == NULL || !mmu_user_range_ok(va, 1)) {
+        return 0;
+    }
+
+    pte = get_pte(space->root, va, false);
+    if (pte == NULL || !(*pte & PTE_VALID)) {
+        return 0;
+    }
+
+    return (*pte & PTE_ADDR_MASK) | (va & (PAGE_SIZE - 1));
+}
+
+/**
+ * Give a space an ASID of the current generation (asid_lock held)
+ *
+ * When none are left a new generation starts: every ASID is free again
+ * except those live in some CPU's TTBR0, which carry over, and one
+ * broadcast flush drops whatever the old generation left in the TLBs.
+ */
+static void asid_assign(mmu_space_t *space)
+{
+    mmu_space_t *live;
+    uint32_t asid, cpu;
+
+    for (;;) {
+        for (asid = mmu.asid_next; asid < MMU_NUM_ASIDS; asid++) {
+            if (!((mmu.asid_map[asid / 64] >> (asid % 64)) & 1)) {
+                mmu.asid_map[asid / 64] |= 1ULL << (asid % 64);
+                mmu.asid_next = asid + 1;
+                space->asid = (mmu.asid_generation << MMU_ASID_BITS) | asid;
+                return;
+            }
+        }
+
+        mmu.asid_generation++;
+        memset(mmu.asid_map, 0, sizeof(mmu.asid_map));
+        mmu.asid_map[0] = 1;                /* ASID 0 is the kernel's */
+        mmu.asid_next = 1;
+
+        for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+            live = mmu.active[cpu];
+            if (live != NULL) {
+                asid = (uint32_t)(live->asid & ASID_MASK);
+                mmu.asid_map[asid / 64] |= 1ULL << (asid % 64);
+                live->asid = (mmu.asid_generation << MMU_ASID_BITS) | asid;
+            }
+        }
+
+        __asm__ volatile("dsb ishst\n"
+                         "tlbi vmalle1is\n"
+                         "dsb ish\n"
+                         "isb" ::: "memory");
+    }
+}
+
+/**
+ * Load a space into TTBR0 on the calling CPU
+ */
+void mmu_switch_space(mmu_space_t *space)
+{
+    uint32_t cpu = smp_processor_id();
+    uint64_t ttbr;
+
+    if (space == NULL) {
+        /* Kernel mappings are global: ASID 0 never tags anything */
+        mmu.active[cpu] = NULL;
+        ttbr = (uint64_t)mmu.root;
+    } else {
+        /* Taken on every switch so a rollover never misses a live space */
+        spin_lock(&mmu.asid_lock);
+        if ((space->asid >> MMU_ASID_BITS) != mmu.asid_generation) {
+            asid_assign(space);
+        }
+        mmu.active[cpu] = space;
+        ttbr = (uint64_t)space->root | ((space->asid & ASID_MASK) << TTBR_ASID_SHIFT);
+        spin_unlock(&mmu.asid_lock);
+    }
+
+    __asm__ volatile("msr ttbr0_el1, %0\n"
+                     "isb" :: "r"(ttbr) : "memory");
+}
+
+/**
+ * Make instructions written through the kernel map visible to execution
+ */
+void mmu_sync_icache(uint64_t pa, size_t size)
+{
+    uint64_t addr = pa & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+
+    for (; addr < pa + size; addr += CACHE_LINE_SIZE) {
+        __asm__ volatile("dc cvau, %0" :: "r"(addr) : "memory");
+    }
+    __asm__ volatile("dsb ish\n"
+                     "ic ialluis\n"
+                     "dsb ish\n"
+                     "isb" ::: "memory");
+}
+
+/**
+ * Try to resolve a synchronous exception as a mapping window or user fault
+ */
+int mmu_handle_fault(uint64_t esr, uint64_t far)
+{
+    uint32_t ec = (esr >> 26) & 0x3F;
+    bool write;
+
+    /* User range: missing pages can be filled in, shared ones copied */
+    if (far >= MMU_USER_BASE && far < MMU_USER_TOP) {
+        if (ec != ESR_EC_DABT_LOW && ec != ESR_EC_IABT_LOW &&
+            ec != ESR_EC_DABT_CUR) {
+            return -1;
+        }
+        write = ec != ESR_EC_IABT_LOW && (esr & ESR_DABT_WNR) != 0;
+        if (write && DFSC_PERM_FAULT(ESR_DABT_DFSC(esr))) {
+            return cow_fault(PAGE_ALIGN_DOWN(far));
+        }
+        if (!DFSC_XLAT_FAULT(ESR_DABT_DFSC(esr)) || mmu.user_fault == NULL) {
+            return -1;
+        }
+        return mmu.user_fault(PAGE_ALIGN_DOWN(far), write);
+    }
+
+    if (ec != ESR_EC_DABT_CUR) {
+        return -1;
+    }
+
+    if (far < MMU_VMAP_BASE || far >= MMU_VMAP_BASE + MMU_VMAP_SIZE ||
+        mmu.vmap_fault == NULL) {
+        return -1;
+    }
+
+    /* Only permission faults are resolvable: translation faults are bugs */
+    if (!DFSC_PERM_FAULT(ESR_DABT_DFSC(esr))) {
+        return -1;
+    }
+
+    return mmu.vmap_fault(PAGE_ALIGN_DOWN(far), (esr & ESR_DABT_WNR) != 0);
+}
+
+/**
+ * Translate a virtual address by walking the kernel tables
+ */
+uint64_t mmu_translate(uint64_t va)
+{
+    uint64_t desc;
+    uint64_t *table;
+
+    if (mmu.root == NULL) {
+        return 0;
+    }
+
+    desc = mmu.root[MMU_L1_INDEX(va)];
+    if (!(desc & PTE_VALID)) {
+        return 0;
+    }
+    if (!(desc & PTE_TABLE)) {
+        return (desc & PTE_ADDR_MASK & ~(MMU_L1_BLOCK_SIZE - 1)) |
+               (va & (MMU_L1_BLOCK_SIZE - 1));
+    }
+
+    table = (uint64_t *)(desc & PTE_ADDR_MASK);
+    desc = table[MMU_L2_INDEX(va)];
+    if (!(desc & PTE_VALID)) {
+        return 0;
+    }
+    if (!(desc & PTE_TABLE)) {
+        return (desc & PTE_ADDR_MASK & ~(MMU_L2_BLOCK_SIZE - 1)) |
+               (va & (MMU_L2_BLOCK_SIZE - 1));
+    }
+
+    table = (uint64_t *)(desc & PTE_ADDR_MASK);
+    desc = table[MMU_L3_INDEX(va)];
+    if (!(desc & PTE_VALID)) {
+        return 0;
+    }
+
+    return (desc & PTE_ADDR_MASK) | (va & (PAGE_SIZE - 1));
+}
+
+/**
+ * Program MAIR/TCR/TTBR0 and turn on the MMU and caches
+ */
+static void mmu_enable(void)
+{
+    uint64_t mmfr0;
+    uint64_t tcr;
+    uint64_t sctlr;
+
+    /* Physical address size: use whatever the CPU implements */
+    __asm__ volatile("mrs %0, id_aa64mmfr0_el1" : "=r"(mmfr0));
+
+    tcr = TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER |
+          TCR_TG0_4K | TCR_EPD1 | ((mmfr0 & 0x7) << TCR_IPS_SHIFT);
+
+    __asm__ volatile("msr mair_el1, %0" :: "r"(MAIR_VALUE));
+    __asm__ volatile("msr tcr_el1, %0" :: "r"(tcr));
+    __asm__ volatile("msr ttbr0_el1, %0" :: "r"((uint64_t)mmu.root));
+
+    /* Tables were written with caches off: make sure they reached memory */
+    __asm__ volatile("dsb sy\n"
+                     "isb\n"
+                     "tlbi vmalle1\n"
+                     "ic iallu\n"
+                     "dsb nsh\n"
+                     "isb" ::: "memory");
+
+    __asm__ volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    sctlr |= SCTLR_M_BIT | SCTLR_C_BIT | SCTLR_I_BIT;
+    sctlr &= ~(uint64_t)SCTLR_A_BIT;
+    __asm__ volatile("msr sctlr_el1, %0\n"
+                     "isb" :: "r"(sctlr) : "memory");
+
+    mmu.enabled = true;
+}
+
+/**
+ * Build the kernel identity map and enable the MMU
+ */
+int mmu_init(void)
+{
+    memblock_region_t ram;
+    uint32_t i;
+
+    klog_info("Initializing MMU...");
+
+    memset(&mmu, 0, sizeof(mmu));
+
+    mmu.root = alloc_table();
+    if (mmu.root == NULL) {
+        klog_error("MMU: failed to allocate root table");
+        return -1;
+    }
+
+    /* RAM: Normal write-back cacheable, kernel read/write/execute */
+    for (i = 0; memblock_get_memory(i, &ram); i++) {
+        if (mmu_map_region("RAM", ram.base, ram.size,
+                           MEM_KERNEL_RW | MEM_EXEC) != 0) {
+            return -1;
+        }
+    }
+
+    /* MMIO: Device-nGnRE */
+    if (mmu_map_region("pflash", PFLASH_BASE, PFLASH_SIZE,
+                       MEM_KERNEL_RW | MEM_DEVICE) != 0 ||
+        mmu_map_region("GIC", GICD_BASE, GIC_MAP_SIZE,
+                       MEM_KERNEL_RW | MEM_DEVICE) != 0 ||
+        mmu_map_region("UART", UART0_BASE, PAGE_SIZE,
+                       MEM_KERNEL_RW | MEM_DEVICE) != 0 ||
+        mmu_map_region("fw_cfg", FW_CFG_BASE, FW_CFG_SIZE,
+                       MEM_KERNEL_RW | MEM_DEVICE) != 0 ||
+        mmu_map_region("virtio-mmio", VIRTIO_MMIO_BASE,
+                       VIRTIO_MMIO_COUNT * VIRTIO_MMIO_SIZE,
+                       MEM_KERNEL_RW | MEM_DEVICE) != 0) {
+        return -1;
+    }
+
+    /* User spaces copy the kernel's level-1 entries, so make the last now */
+    if (get_next_table(mmu.root, MMU_L1_INDEX(MMU_VMAP_BASE), MMU_L1_SHIFT) == NULL) {
+        klog_error("MMU: failed to allocate mapping window table");
+        return -1;
+    }
+    mmu.asid_generation = 1;
+    mmu.asid_map[0] = 1;
+    mmu.asid_next = 1;
+
+    kprintf("  Page tables: %u pages (%u KB), %u pages mapped\n",
+            (uint32_t)mmu.table_pages,
+            (uint32_t)(mmu.table_pages * PAGE_SIZE / 1024),
+            (uint32_t)mmu.mapped_pages);
+    kprintf("  Blocks: %u x 1GB, %u x 2MB\n",
+            (uint32_t)mmu.blocks_1g, (uint32_t)mmu.blocks_2m);
+
+    mmu_enable();
+
+    klog_info("MMU enabled (4KB granule, %u-bit VA, D/I-caches on)", MMU_VA_BITS);
+    return 0;
+}
+
+/**
+ * Check if the MMU has been enabled
+ */
+bool mmu_enabled(void)
+{
+    return mmu.enabled;
+}
+
+/**
+ * Get MMU statistics
+ */
+void mmu_get_stats(mmu_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    stats->enabled = mmu.enabled;
+    stats->ttbr0 = (uint64_t)mmu.root;
+    stats->table_pages = mmu.table_pages;
+    stats->mapped_pages = mmu.mapped_pages;
+    stats->blocks_1g = mmu.blocks_1g;
+    stats->blocks_2m = mmu.blocks_2m;
+    stats->num_regions = mmu.num_regions;
+    stats->vmap_pages = mmu.vmap_used;
+    stats->spaces = mmu.num_spaces;
+    stats->user_pages = mmu.user_pages;
+    stats->asid_generation = mmu.asid_generation - 1;
+    stats->cow_faults = mmu.cow_faults;
+    stats->cow_copies = mmu.cow_copies;
+}
+
+/**
+ * Get a recorded region by index
+ */
+const mmu_region_t *mmu_get_region(uint32_t index)
+{
+    if (index >= mmu.num_regions) {
+        return NULL;
+    }
+
+    return &mmu.regions[index];
+}
+
+/* ============================================================================
+ * End of mmu.c
+ * ============================================================================ */
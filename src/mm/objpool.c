@@ -0,0 +1,246 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/objpool.c
+ * Description: Typed object pools - ready objects in front of the slab caches
+ * ============================================================================ */
+
+#include <aeos/objpool.h>
+#include <aeos/pmm.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/*
+ * Only the stack of ready objects is touched under a pool's lock. Taking
+ * objects from backing memory, constructing and zeroing them all happen
+ * outside it, so a 4KB memset never runs with interrupts masked.
+ */
+
+/* Registered pools */
+static struct {
+    objpool_t *list;
+    spinlock_t lock;                    /* Protects the list and cache creation */
+} pools = {
+    .lock = SPINLOCK_INIT,
+};
+
+/**
+ * Create the backing cache and register the pool on first use
+ *
+ * @return 0 on success, -1 if the cache could not be created
+ */
+static int pool_setup(objpool_t *pool)
+{
+    uint64_t flags;
+    int ret = 0;
+
+    flags = spin_lock_irqsave(&pools.lock);
+
+    if (!(pool->flags & OBJPOOL_PAGES) && pool->cache == NULL) {
+        pool->cache = kmem_cache_create(pool->name, pool->size, 0);
+        if (pool->cache == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && !pool->registered) {
+        pool->next = pools.list;
+        pools.list = pool;
+        pool->registered = true;
+    }
+
+    spin_unlock_irqrestore(&pools.lock, flags);
+    return ret;
+}
+
+/**
+ * Take a new object from backing memory and construct it
+ */
+static void *object_create(objpool_t *pool)
+{
+    void *obj;
+
+    if (pool_setup(pool) < 0) {
+        return NULL;
+    }
+
+    if (pool->flags & OBJPOOL_PAGES) {
+        obj = (void *)(uintptr_t)pmm_alloc_pages(pool->order);
+    } else {
+        obj = kmem_cache_alloc(pool->cache);
+    }
+    if (obj == NULL) {
+        return NULL;
+    }
+
+    if (pool->flags & OBJPOOL_ZERO) {
+        memset(obj, 0, pool->size);
+    }
+    if (pool->ctor != NULL) {
+        pool->ctor(obj);
+    }
+    return obj;
+}
+
+/**
+ * Give an object back to backing memory
+ */
+static void object_release(objpool_t *pool, void *obj)
+{
+    if (pool->flags & OBJPOOL_PAGES) {
+        pmm_free_pages((uint64_t)(uintptr_t)obj, pool->order);
+    } else {
+        kmem_cache_free(pool->cache, obj);
+    }
+}
+
+/**
+ * Allocate an object
+ */
+void *objpool_alloc(objpool_t *pool)
+{
+    void *obj = NULL;
+    uint64_t flags;
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&pool->lock);
+    if (pool->nr_free > 0) {
+        obj = pool->free[--pool->nr_free];
+        pool->hits++;
+        pool->allocs++;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    if (obj != NULL) {
+        return obj;
+    }
+
+    obj = object_create(pool);
+    if (obj == NULL) {
+        klog_error("objpool: '%s' out of memory", pool->name);
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&pool->lock);
+    pool->objects++;
+    pool->allocs++;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    return obj;
+}
+
+/**
+ * Return an object to its pool
+ */
+void objpool_free(objpool_t *pool, void *obj)
+{
+    uint64_t flags;
+    bool kept = false;
+
+    if (pool == NULL || obj == NULL) {
+        return;
+    }
+
+    if (pool->flags & OBJPOOL_ZERO) {
+        memset(obj, 0, pool->size);
+    }
+
+    flags = spin_lock_irqsave(&pool->lock);
+    pool->frees++;
+    if (pool->nr_free < OBJPOOL_MAX_FREE) {
+        pool->free[pool->nr_free++] = obj;
+        kept = true;
+    } else {
+        pool->objects--;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    if (!kept) {
+        object_release(pool, obj);
+    }
+}
+
+/**
+ * Fill a pool's stack with ready objects
+ */
+int objpool_reserve(objpool_t *pool, uint32_t count)
+{
+    uint64_t flags;
+    uint32_t have;
+    void *obj;
+
+    if (pool == NULL) {
+        return -1;
+    }
+    if (count > OBJPOOL_MAX_FREE) {
+        count = OBJPOOL_MAX_FREE;
+    }
+
+    for (;;) {
+        flags = spin_lock_irqsave(&pool->lock);
+        have = pool->nr_free;
+        spin_unlock_irqrestore(&pool->lock, flags);
+        if (have >= count) {
+            return 0;
+        }
+
+        obj = object_create(pool);
+        if (obj == NULL) {
+            klog_error("objpool: '%s' could not reserve %u objects",
+                       pool->name, count);
+            return -1;
+        }
+
+        flags = spin_lock_irqsave(&pool->lock);
+        if (pool->nr_free < OBJPOOL_MAX_FREE) {
+            pool->free[pool->nr_free++] = obj;
+            pool->objects++;
+            obj = NULL;
+        }
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        /* Frees filled the stack meanwhile */
+        if (obj != NULL) {
+            object_release(pool, obj);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Copy out statistics for every registered pool
+ */
+uint32_t objpool_get_stats(objpool_stats_t *out, uint32_t max)
+{
+    objpool_t *pool;
+    uint64_t flags, pool_flags;
+    uint32_t n = 0;
+
+    if (out == NULL) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&pools.lock);
+
+    for (pool = pools.list; pool != NULL && n < max; pool = pool->next) {
+        pool_flags = spin_lock_irqsave(&pool->lock);
+        out[n].name = pool->name;
+        out[n].obj_size = pool->size;
+        out[n].objects = pool->objects;
+        out[n].ready = pool->nr_free;
+        out[n].allocs = pool->allocs;
+        out[n].hits = pool->hits;
+        out[n].frees = pool->frees;
+        spin_unlock_irqrestore(&pool->lock, pool_flags);
+        n++;
+    }
+
+    spin_unlock_irqrestore(&pools.lock, flags);
+    return n;
+}
+
+/* ============================================================================
+ * End of objpool.c
+ * ============================================================================ */
@@ -7,7 +7,12 @@
 #include <aeos/pmm.h>
 #include <aeos/mm.h>
 #include <aeos/types.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
 #include <aeos/kprintf.h>
+#include <aeos/memprof.h>
+#include <aeos/shrinker.h>
+#include <aeos/memblock.h>
 
 /**
  * Free list node for buddy allocator
@@ -15,111 +20,281 @@
  */
 typedef struct free_block {
     struct free_block *next;
+    struct free_block *prev;
 } free_block_t;
 
+/*
+ * Per-page state byte (one per managed page, stored in the page map)
+ *
+ * The first page of every block records the block's order. PAGE_FREE is set
+ * while the block sits on a free list, so "is my buddy free at this order"
+ * is a single byte compare. Pages inside a block are 0.
+ */
+#define PAGE_FREE           0x80
+#define PAGE_PCP            0x40        /* On a per-CPU hot list */
+#define PAGE_ORDER_MASK     0x1F
+
+/*
+ * Per-CPU hot lists of order-0 pages
+ *
+ * Single-page allocations and frees go to the calling CPU's list with only
+ * local IRQs masked. The shared buddy lists (and their lock) are touched
+ * once per batch, when a list runs dry or grows past four batches. The
+ * batch grows with RAM, one page per 16MB between PMM_PCP_BATCH_MIN and
+ * PMM_PCP_BATCH_MAX. Each CPU's list sits on its own cache line.
+ */
+#define PMM_PCP_BATCH_MIN   16
+#define PMM_PCP_BATCH_MAX   64
+
+typedef struct {
+    struct free_block *pages;   /* Hot order-0 pages (singly linked) */
+    uint32_t count;             /* Pages on the list */
+    size_t hits;                /* Allocations served from the list */
+    size_t misses;              /* Allocations that had to refill */
+    size_t drains;              /* Batches returned to the buddy lists */
+} __attribute__((aligned(CACHE_LINE_SIZE))) pmm_pcp_t;
+
 /**
  * Buddy allocator state
  */
 static struct {
     free_block_t *free_lists[PMM_MAX_ORDER + 1];  /* Free lists for each order */
+    size_t nr_free[PMM_MAX_ORDER + 1];             /* Blocks on each free list */
+    uint8_t *page_map;                             /* Per-page state bytes */
+    uint8_t *page_refs;                            /* Per-page extra owners */
     uint64_t mem_start;                            /* Start of managed memory */
     uint64_t mem_end;                              /* End of managed memory */
     size_t total_pages;                            /* Total number of pages */
     size_t free_pages;                             /* Number of free pages */
+    size_t reserved_pages;                         /* Page map + reserved regions */
+    size_t wmark_min;                              /* Watermarks (free pages) */
+    size_t wmark_low;
+    size_t wmark_high;
+    uint32_t pcp_batch;                            /* Pages moved per refill/drain */
+    uint32_t pcp_high;                             /* Drain a CPU list above this */
+    spinlock_t lock;                               /* Protects the buddy lists */
     bool initialized;                              /* Initialization flag */
 } pmm;
 
+/* Per-CPU page caches */
+static pmm_pcp_t pcp[MAX_CPUS];
+
 /* Forward declarations */
 static uint64_t get_buddy_addr(uint64_t addr, uint32_t order);
 static void add_to_free_list(uint64_t addr, uint32_t order);
-static uint64_t remove_from_free_list(uint32_t order);
-static bool is_in_free_list(uint64_t addr, uint32_t order);
+static void remove_from_free_list(uint64_t addr, uint32_t order);
+static bool is_free_block(uint64_t addr, uint32_t order);
+static bool isolate_block(uint64_t addr, uint32_t order);
+static uint64_t buddy_alloc(uint32_t order);
+static void buddy_free(uint64_t addr, uint32_t order);
+static void pcp_refill(pmm_pcp_t *cpu);
+static void pcp_drain(pmm_pcp_t *cpu, uint32_t count);
+
+/* Page map index of an address */
+#define PAGE_INDEX(addr)    (((addr) - pmm.mem_start) >> PAGE_SHIFT)
+
+/**
+ * Put a free range on the buddy lists, largest aligned blocks first
+ */
+static void add_free_range(uint64_t start, uint64_t end)
+{
+    uint64_t current = start;
+
+    while (current < end) {
+        uint64_t remaining = end - current;
+        int order;  /* Use signed int to avoid comparison issues */
+        uint64_t block_size;
+
+        /* Find largest block that fits and is properly aligned; a page
+         * always does, as memblock ranges are page aligned */
+        for (order = PMM_MAX_ORDER; order > 0; order--) {
+            block_size = PAGE_SIZE << order;
+            if (remaining >= block_size && (current & (block_size - 1)) == 0) {
+                break;
+            }
+        }
+
+        add_to_free_list(current, (uint32_t)order);
+        current += PAGE_SIZE << order;
+        pmm.free_pages += (1 << order);
+    }
+}
 
 /**
  * Initialize the Physical Memory Manager
  */
-void pmm_init(uint64_t mem_start, uint64_t mem_end, uint64_t kernel_end)
+void pmm_init(void)
 {
     uint32_t i;
-    uint64_t available_start;
-    uint64_t available_end;
-    uint64_t current;
+    uint64_t mem_start, mem_end;
+    uint64_t start, end, pos, map;
+    size_t span, map_size;
 
     klog_info("Initializing Physical Memory Manager...");
 
     /* Initialize free lists */
     for (i = 0; i <= PMM_MAX_ORDER; i++) {
         pmm.free_lists[i] = NULL;
+        pmm.nr_free[i] = 0;
+    }
+    spin_lock_init(&pmm.lock);
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        pcp[i].pages = NULL;
+        pcp[i].count = 0;
+        pcp[i].hits = 0;
+        pcp[i].misses = 0;
+        pcp[i].drains = 0;
     }
 
-    /* Align memory boundaries to page size */
-    mem_start = PAGE_ALIGN_UP(mem_start);
-    mem_end = PAGE_ALIGN_DOWN(mem_end);
-    kernel_end = PAGE_ALIGN_UP(kernel_end);
-
-    /* Save memory bounds */
+    /* The span from the lowest to the highest RAM page, holes included */
+    mem_start = memblock_start();
+    mem_end = memblock_end();
     pmm.mem_start = mem_start;
     pmm.mem_end = mem_end;
-    pmm.total_pages = (mem_end - mem_start) >> PAGE_SHIFT;
+    pmm.total_pages = memblock_memory_size() >> PAGE_SHIFT;
     pmm.free_pages = 0;
+    span = (mem_end - mem_start) >> PAGE_SHIFT;
 
-    /* Available memory starts after kernel */
-    available_start = kernel_end;
-    available_end = mem_end;
+    /* A state byte and a share count for every page of the span */
+    map_size = PAGE_ALIGN_UP(span);
+    map = memblock_alloc(2 * map_size, PAGE_SIZE);
+    if (map == 0) {
+        klog_error("PMM: no memory for the page map");
+        return;
+    }
+    pmm.page_map = (uint8_t *)map;
+    pmm.page_refs = (uint8_t *)(map + map_size);
+    for (pos = 0; pos < span; pos++) {
+        pmm.page_map[pos] = 0;
+        pmm.page_refs[pos] = 0;
+    }
 
     kprintf("  Memory range: %p - %p\n", (void *)mem_start, (void *)mem_end);
-    kprintf("  Kernel ends at: %p\n", (void *)kernel_end);
-    kprintf("  Available: %p - %p\n", (void *)available_start, (void *)available_end);
+    kprintf("  Page map: %u KB (+ %u KB share counts) at %p\n",
+            (uint32_t)(map_size / 1024), (uint32_t)(map_size / 1024), (void *)map);
     kprintf("  Total pages: %u (%u MB)\n", (uint32_t)pmm.total_pages, (uint32_t)(pmm.total_pages * PAGE_SIZE / (1024 * 1024)));
 
-    /*
-     * Add all available memory to free lists
-     * Start with largest possible blocks and work down
-     */
-    current = available_start;
-    while (current < available_end) {
-        uint64_t remaining = available_end - current;
-        int order;  /* Use signed int to avoid comparison issues */
-        uint64_t block_size;
-        bool found = false;
+    /* Everything memblock did not reserve; it hands out nothing more */
+    pos = 0;
+    while (memblock_next_free(&pos, &start, &end)) {
+        add_free_range(start, end);
+    }
+    memblock_retire();
 
-        /* Find largest block that fits */
-        for (order = PMM_MAX_ORDER; order >= 0; order--) {
-            block_size = PAGE_SIZE << order;
+    /* Kernel, heap, page map, device tree and initrd */
+    pmm.reserved_pages = pmm.total_pages - pmm.free_pages;
 
-            /* Check if block fits and is properly aligned */
-            if (remaining >= block_size &&
-                (current & (block_size - 1)) == 0) {
-                /* Add this block to free list */
-                add_to_free_list(current, (uint32_t)order);
-                current += block_size;
-                pmm.free_pages += (1 << order);
-                found = true;
-                break;
-            }
-        }
+    pmm.pcp_batch = (uint32_t)(pmm.total_pages >> 12);
+    if (pmm.pcp_batch < PMM_PCP_BATCH_MIN) {
+        pmm.pcp_batch = PMM_PCP_BATCH_MIN;
+    } else if (pmm.pcp_batch > PMM_PCP_BATCH_MAX) {
+        pmm.pcp_batch = PMM_PCP_BATCH_MAX;
+    }
+    pmm.pcp_high = 4 * pmm.pcp_batch;
 
-        /* If no block fit, move to next page */
-        if (!found) {
-            current += PAGE_SIZE;
-        }
+    pmm.wmark_min = pmm.free_pages / PMM_WMARK_DIV;
+    if (pmm.wmark_min < PMM_WMARK_MIN_PAGES) {
+        pmm.wmark_min = PMM_WMARK_MIN_PAGES;
     }
+    pmm.wmark_low = 2 * pmm.wmark_min;
+    pmm.wmark_high = 3 * pmm.wmark_min;
 
     pmm.initialized = true;
 
     kprintf("  Free pages: %u (%u MB)\n",
             (uint32_t)pmm.free_pages,
             (uint32_t)(pmm.free_pages * PAGE_SIZE / (1024 * 1024)));
+    kprintf("  Watermarks: min %u, low %u, high %u pages\n",
+            (uint32_t)pmm.wmark_min, (uint32_t)pmm.wmark_low,
+            (uint32_t)pmm.wmark_high);
+    kprintf("  Per-CPU lists: batches of %u pages\n", pmm.pcp_batch);
     klog_info("PMM initialization complete");
 }
 
+/**
+ * Free pages, counting the per-CPU lists (read without the lock)
+ */
+static size_t pmm_free_count(void)
+{
+    size_t free = pmm.free_pages;
+    uint32_t i;
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        free += pcp[i].count;
+    }
+    return free;
+}
+
+/**
+ * Take a block without reclaiming
+ * @param slow Set if the shared buddy lists were touched
+ * @return Physical address, or 0 if nothing fits
+ */
+static uint64_t pmm_try_alloc(uint32_t order, bool *slow)
+{
+    pmm_pcp_t *cpu;
+    uint64_t flags;
+    uint64_t addr;
+
+    if (order > 0) {
+        flags = spin_lock_irqsave(&pmm.lock);
+        addr = buddy_alloc(order);
+        spin_unlock_irqrestore(&pmm.lock, flags);
+        *slow = true;
+        return addr;
+    }
+
+    /* Single page: this CPU's hot list, refilled in batches */
+    flags = irq_save();
+    cpu = &pcp[smp_processor_id()];
+
+    if (cpu->pages == NULL) {
+        cpu->misses++;
+        pcp_refill(cpu);
+        *slow = true;
+        if (cpu->pages == NULL) {
+            irq_restore(flags);
+            return 0;
+        }
+    } else {
+        cpu->hits++;
+    }
+
+    addr = (uint64_t)cpu->pages;
+    cpu->pages = cpu->pages->next;
+    cpu->count--;
+    pmm.page_map[PAGE_INDEX(addr)] = 0;
+
+    irq_restore(flags);
+    return addr;
+}
+
+/**
+ * Give this CPU's hot pages back to the buddy lists so they can merge
+ */
+static void pcp_drain_local(void)
+{
+    pmm_pcp_t *cpu;
+    uint64_t flags;
+
+    flags = irq_save();
+    cpu = &pcp[smp_processor_id()];
+    if (cpu->count > 0) {
+        pcp_drain(cpu, cpu->count);
+    }
+    irq_restore(flags);
+}
+
 /**
  * Allocate 2^order contiguous physical pages
  */
-uint64_t pmm_alloc_pages(uint32_t order)
+uint64_t pmm_alloc_pages_at(uint32_t order, const char *site)
 {
-    uint32_t current_order;
     uint64_t addr;
+    size_t free;
+    bool slow = false;
+    int priority;
 
     if (!pmm.initialized) {
         klog_error("PMM not initialized");
@@ -131,29 +306,41 @@ uint64_t pmm_alloc_pages(uint32_t order)
         return 0;
     }
 
-    /* Find smallest available block that fits */
-    for (current_order = order; current_order <= PMM_MAX_ORDER; current_order++) {
-        if (pmm.free_lists[current_order] != NULL) {
-            /* Found a block, remove it from free list */
-            addr = remove_from_free_list(current_order);
+    addr = pmm_try_alloc(order, &slow);
 
-            /* Split block if it's larger than needed */
-            while (current_order > order) {
-                current_order--;
-                /* Add buddy (second half) to free list */
-                add_to_free_list(addr + (PAGE_SIZE << current_order), current_order);
-            }
+    /* Only buddy-list traffic can cross a watermark */
+    if (slow) {
+        free = pmm_free_count();
+        if (free < pmm.wmark_low) {
+            reclaim_wake();
+        }
+        if (addr != 0 && free < pmm.wmark_min) {
+            shrink_caches(SHRINK_PRIORITY_MAX, true);
+        }
+    }
 
-            /* Update statistics */
-            pmm.free_pages -= (1 << order);
+    if (addr == 0) {
+        /* Hot pages of this CPU may complete a larger block */
+        if (order > 0) {
+            pcp_drain_local();
+            addr = pmm_try_alloc(order, &slow);
+        }
 
-            return addr;
+        /* Escalate until something fits or nothing is left to shrink */
+        for (priority = SHRINK_PRIORITY_MAX; addr == 0 && priority >= 0; priority--) {
+            shrink_caches((uint32_t)priority, true);
+            addr = pmm_try_alloc(order, &slow);
+        }
+
+        if (addr == 0) {
+            reclaim_note_failure();
+            klog_warn("PMM: Out of memory (order %u)", order);
+            return 0;
         }
     }
 
-    /* No memory available */
-    klog_warn("PMM: Out of memory (order %u)", order);
-    return 0;
+    MEMPROF_ALLOC((void *)addr, PAGE_SIZE << order, site, MEMPROF_PAGES);
+    return addr;
 }
 
 /**
@@ -161,7 +348,9 @@ uint64_t pmm_alloc_pages(uint32_t order)
  */
 void pmm_free_pages(uint64_t addr, uint32_t order)
 {
-    uint64_t buddy_addr;
+    pmm_pcp_t *cpu;
+    free_block_t *block;
+    uint64_t flags;
 
     if (!pmm.initialized) {
         klog_error("PMM not initialized");
@@ -184,33 +373,104 @@ void pmm_free_pages(uint64_t addr, uint32_t order)
         return;
     }
 
-    /* Try to merge with buddy */
-    while (order < PMM_MAX_ORDER) {
-        buddy_addr = get_buddy_addr(addr, order);
+    /* Check if already free (double-free detection) */
+    if (pmm.page_map[PAGE_INDEX(addr)] & (PAGE_FREE | PAGE_PCP)) {
+        klog_error("PMM: Double free of %p (order %u)", (void *)addr, order);
+        return;
+    }
 
-        /* Check if buddy is free */
-        if (buddy_addr < pmm.mem_start || buddy_addr >= pmm.mem_end ||
-            !is_in_free_list(buddy_addr, order)) {
-            break;  /* Buddy not free, stop merging */
-        }
+    MEMPROF_FREE((void *)addr, MEMPROF_PAGES);
 
-        /* Remove buddy from free list */
-        remove_from_free_list(order);
+    if (order > 0) {
+        flags = spin_lock_irqsave(&pmm.lock);
+        buddy_free(addr, order);
+        spin_unlock_irqrestore(&pmm.lock, flags);
+        return;
+    }
 
-        /* Merge with buddy (use lower address) */
-        if (buddy_addr < addr) {
-            addr = buddy_addr;
+    /* Single page: push on this CPU's hot list, drain a batch when full */
+    flags = irq_save();
+    cpu = &pcp[smp_processor_id()];
+
+    block = (free_block_t *)addr;
+    block->next = cpu->pages;
+    cpu->pages = block;
+    cpu->count++;
+    pmm.page_map[PAGE_INDEX(addr)] = PAGE_PCP;
+
+    if (cpu->count >= pmm.pcp_high) {
+        pcp_drain(cpu, pmm.pcp_batch);
+    }
+
+    irq_restore(flags);
+}
+
+/**
+ * Check that an address is a page the PMM hands out
+ */
+static bool page_valid(uint64_t addr)
+{
+    return pmm.initialized && addr >= pmm.mem_start && addr < pmm.mem_end &&
+           IS_PAGE_ALIGNED(addr);
+}
+
+/**
+ * Add an owner to an allocated page
+ */
+int pmm_page_share(uint64_t addr)
+{
+    uint8_t *refs;
+    uint8_t old;
+
+    if (!page_valid(addr)) {
+        return -1;
+    }
+
+    refs = &pmm.page_refs[PAGE_INDEX(addr)];
+    old = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do {
+        if (old == PMM_PAGE_MAX_SHARE) {
+            return -1;
         }
+    } while (!__atomic_compare_exchange_n(refs, &old, (uint8_t)(old + 1), true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
 
-        /* Move up to next order */
-        order++;
+/**
+ * Drop an owner of a page, freeing it with the last one
+ */
+void pmm_page_put(uint64_t addr)
+{
+    uint8_t *refs;
+    uint8_t old;
+
+    if (!page_valid(addr)) {
+        klog_error("PMM: Invalid address %p", (void *)addr);
+        return;
     }
 
-    /* Add merged block to free list */
-    add_to_free_list(addr, order);
+    refs = &pmm.page_refs[PAGE_INDEX(addr)];
+    old = __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+    do {
+        if (old == 0) {
+            pmm_free_page(addr);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(refs, &old, (uint8_t)(old - 1), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
 
-    /* Update statistics */
-    pmm.free_pages += (1 << order);
+/**
+ * Check whether a page has more than one owner
+ */
+bool pmm_page_shared(uint64_t addr)
+{
+    if (!page_valid(addr)) {
+        return false;
+    }
+
+    return __atomic_load_n(&pmm.page_refs[PAGE_INDEX(addr)], __ATOMIC_ACQUIRE) != 0;
 }
 
 /**
@@ -218,6 +478,7 @@ void pmm_free_pages(uint64_t addr, uint32_t order)
  */
 void pmm_reserve_region(uint64_t start, uint64_t end)
 {
+    uint64_t flags;
     uint64_t current;
     int order;  /* Use signed int to avoid comparison issues */
 
@@ -226,20 +487,29 @@ void pmm_reserve_region(uint64_t start, uint64_t end)
 
     klog_debug("Reserving region: %p - %p", (void *)start, (void *)end);
 
-    /* Remove pages from free lists */
+    if (start < pmm.mem_start) {
+        start = pmm.mem_start;
+    }
+    if (end > pmm.mem_end) {
+        end = pmm.mem_end;
+    }
+
+    flags = spin_lock_irqsave(&pmm.lock);
+
+    /* Remove pages from free lists, splitting free blocks that straddle */
     for (current = start; current < end; ) {
         bool found = false;
 
-        /* Find largest block starting at current address */
+        /* Largest aligned block at current that fits the range */
         for (order = PMM_MAX_ORDER; order >= 0; order--) {
             uint64_t block_size = PAGE_SIZE << order;
 
             if (current + block_size <= end &&
                 (current & (block_size - 1)) == 0 &&
-                is_in_free_list(current, (uint32_t)order)) {
-                /* Remove this block */
-                remove_from_free_list((uint32_t)order);
+                isolate_block(current, (uint32_t)order)) {
                 pmm.free_pages -= (1 << order);
+                pmm.reserved_pages += (1 << order);
+                pmm.page_map[PAGE_INDEX(current)] = (uint8_t)order;
                 current += block_size;
                 found = true;
                 break;
@@ -250,6 +520,8 @@ void pmm_reserve_region(uint64_t start, uint64_t end)
             current += PAGE_SIZE;
         }
     }
+
+    spin_unlock_irqrestore(&pmm.lock, flags);
 }
 
 /**
@@ -257,14 +529,41 @@ void pmm_reserve_region(uint64_t start, uint64_t end)
  */
 void pmm_get_stats(pmm_stats_t *stats)
 {
+    uint32_t i;
+    int order;
+
     if (stats == NULL) {
         return;
     }
 
+    stats->pcp_pages = 0;
+    stats->pcp_hits = 0;
+    stats->pcp_misses = 0;
+    for (i = 0; i < MAX_CPUS; i++) {
+        stats->pcp_pages += pcp[i].count;
+        stats->pcp_hits += pcp[i].hits;
+        stats->pcp_misses += pcp[i].misses;
+    }
+
+    /* Pages parked on per-CPU lists are still free */
     stats->total_pages = pmm.total_pages;
-    stats->free_pages = pmm.free_pages;
-    stats->used_pages = pmm.total_pages - pmm.free_pages;
-    stats->reserved_pages = 0;  /* TODO: track reserved pages */
+    stats->free_pages = pmm.free_pages + stats->pcp_pages;
+    stats->used_pages = pmm.total_pages - stats->free_pages;
+    stats->reserved_pages = pmm.reserved_pages;
+    stats->wmark_min = pmm.wmark_min;
+    stats->wmark_low = pmm.wmark_low;
+    stats->wmark_high = pmm.wmark_high;
+
+    /* Fragmentation: the largest order with a free block */
+    stats->largest_free_pages = stats->pcp_pages > 0 ? 1 : 0;
+    for (order = PMM_MAX_ORDER; order >= 0; order--) {
+        if (pmm.nr_free[order] > 0) {
+            if ((1UL << order) > stats->largest_free_pages) {
+                stats->largest_free_pages = 1UL << order;
+            }
+            break;
+        }
+    }
 }
 
 /**
@@ -273,29 +572,65 @@ void pmm_get_stats(pmm_stats_t *stats)
 void pmm_dump_state(void)
 {
     uint32_t order;
-    uint32_t count;
-    free_block_t *block;
+    uint32_t j;
+    size_t usable;
+    size_t largest = 0;
 
     kprintf("\n=== PMM State ===\n");
     kprintf("Memory: %p - %p\n", (void *)pmm.mem_start, (void *)pmm.mem_end);
     kprintf("Total pages: %u\n", (uint32_t)pmm.total_pages);
     kprintf("Free pages: %u\n", (uint32_t)pmm.free_pages);
     kprintf("Used pages: %u\n", (uint32_t)(pmm.total_pages - pmm.free_pages));
+    kprintf("Reserved pages: %u\n", (uint32_t)pmm.reserved_pages);
 
-    kprintf("\nFree lists:\n");
+    /*
+     * Fragmentation histogram: free blocks per order, and for each order the
+     * share of free memory that cannot satisfy a request of that order
+     * (in blocks smaller than it). 0% means perfectly unfragmented.
+     */
+    kprintf("\nFree blocks by order:          unusable\n");
     for (order = 0; order <= PMM_MAX_ORDER; order++) {
-        count = 0;
-        block = pmm.free_lists[order];
-        while (block != NULL) {
-            count++;
-            block = block->next;
+        uint32_t bar;
+
+        usable = 0;
+        for (j = order; j <= PMM_MAX_ORDER; j++) {
+            usable += pmm.nr_free[j] << j;
+        }
+
+        kprintf("  Order %2u (%5u KB): %5u ",
+                order,
+                (uint32_t)((PAGE_SIZE << order) / 1024),
+                (uint32_t)pmm.nr_free[order]);
+
+        /* One '#' per block, capped to keep lines short */
+        bar = (uint32_t)(pmm.nr_free[order] > 16 ? 16 : pmm.nr_free[order]);
+        for (j = 0; j < 16; j++) {
+            kprintf("%c", j < bar ? '#' : ' ');
         }
-        if (count > 0) {
-            kprintf("  Order %2u (%5u KB): %u blocks\n",
-                    order,
-                    (uint32_t)((PAGE_SIZE << order) / 1024),
-                    count);
+
+        kprintf(" %3u%%\n", pmm.free_pages == 0 ? 0 :
+                (uint32_t)((pmm.free_pages - usable) * 100 / pmm.free_pages));
+
+        if (pmm.nr_free[order] > 0) {
+            largest = order;
+        }
+    }
+
+    if (pmm.free_pages > 0) {
+        kprintf("Largest free block: order %u (%u KB)\n",
+                (uint32_t)largest, (uint32_t)((PAGE_SIZE << largest) / 1024));
+    }
+
+    kprintf("\nPer-CPU page lists:\n");
+    for (j = 0; j < MAX_CPUS; j++) {
+        if (pcp[j].hits + pcp[j].misses == 0) {
+            continue;
         }
+        kprintf("  CPU%u: %u pages, %u hits, %u misses, %u drains (%u%% hit)\n",
+                j, pcp[j].count,
+                (uint32_t)pcp[j].hits, (uint32_t)pcp[j].misses,
+                (uint32_t)pcp[j].drains,
+                (uint32_t)(pcp[j].hits * 100 / (pcp[j].hits + pcp[j].misses)));
     }
     kprintf("================\n\n");
 }
@@ -319,39 +654,203 @@ static uint64_t get_buddy_addr(uint64_t addr, uint32_t order)
 static void add_to_free_list(uint64_t addr, uint32_t order)
 {
     free_block_t *block = (free_block_t *)addr;
+
+    block->prev = NULL;
     block->next = pmm.free_lists[order];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
     pmm.free_lists[order] = block;
+    pmm.nr_free[order]++;
+
+    pmm.page_map[PAGE_INDEX(addr)] = PAGE_FREE | (uint8_t)order;
 }
 
 /**
- * Remove first block from free list
+ * Unlink a specific block from its free list - O(1)
  */
-static uint64_t remove_from_free_list(uint32_t order)
+static void remove_from_free_list(uint64_t addr, uint32_t order)
 {
-    free_block_t *block = pmm.free_lists[order];
-    if (block == NULL) {
-        return 0;
+    free_block_t *block = (free_block_t *)addr;
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        pmm.free_lists[order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    pmm.nr_free[order]--;
+
+    pmm.page_map[PAGE_INDEX(addr)] = 0;
+}
+
+/**
+ * Check if a free block of exactly this order starts at addr
+ */
+static bool is_free_block(uint64_t addr, uint32_t order)
+{
+    if (addr < pmm.mem_start || addr >= pmm.mem_end) {
+        return false;
     }
 
-    pmm.free_lists[order] = block->next;
-    return (uint64_t)block;
+    return pmm.page_map[PAGE_INDEX(addr)] == (PAGE_FREE | order);
 }
 
 /**
- * Check if address is in free list
+ * Take the block at addr/order off the free lists, splitting a larger free
+ * block that contains it if needed
+ * @return true if the whole block was free and is now isolated
  */
-static bool is_in_free_list(uint64_t addr, uint32_t order)
+static bool isolate_block(uint64_t addr, uint32_t order)
 {
-    free_block_t *block = pmm.free_lists[order];
+    uint32_t o;
+    uint64_t head = 0;
+
+    /* Find the free block containing addr at this order or above */
+    for (o = order; o <= PMM_MAX_ORDER; o++) {
+        head = addr & ~((PAGE_SIZE << o) - 1);
+        if (is_free_block(head, o)) {
+            break;
+        }
+    }
+
+    if (o > PMM_MAX_ORDER) {
+        return false;
+    }
 
-    while (block != NULL) {
-        if ((uint64_t)block == addr) {
-            return true;
+    remove_from_free_list(head, o);
+
+    /* Split down, returning the halves that don't contain addr */
+    while (o > order) {
+        o--;
+        if (addr & (PAGE_SIZE << o)) {
+            add_to_free_list(head, o);
+            head += PAGE_SIZE << o;
+        } else {
+            add_to_free_list(head + (PAGE_SIZE << o), o);
         }
-        block = block->next;
     }
 
-    return false;
+    return true;
+}
+
+/**
+ * Take a 2^order block from the buddy lists (lock held)
+ */
+static uint64_t buddy_alloc(uint32_t order)
+{
+    uint32_t current_order;
+    uint64_t addr;
+
+    /* Find smallest available block that fits */
+    for (current_order = order; current_order <= PMM_MAX_ORDER; current_order++) {
+        if (pmm.free_lists[current_order] != NULL) {
+            /* Found a block, remove it from free list */
+            addr = (uint64_t)pmm.free_lists[current_order];
+            remove_from_free_list(addr, current_order);
+
+            /* Split block if it's larger than needed */
+            while (current_order > order) {
+                current_order--;
+                /* Add buddy (second half) to free list */
+                add_to_free_list(addr + (PAGE_SIZE << current_order), current_order);
+            }
+
+            /* Record the allocated order on the head page */
+            pmm.page_map[PAGE_INDEX(addr)] = (uint8_t)order;
+
+            /* Update statistics */
+            pmm.free_pages -= (1 << order);
+
+            return addr;
+        }
+    }
+
+    /* No memory available; the caller reclaims and reports */
+    return 0;
+}
+
+/**
+ * Return a 2^order block to the buddy lists, merging buddies (lock held)
+ */
+static void buddy_free(uint64_t addr, uint32_t order)
+{
+    uint64_t buddy_addr;
+
+    /* Update statistics */
+    pmm.free_pages += (1 << order);
+
+    /* Try to merge with buddy */
+    while (order < PMM_MAX_ORDER) {
+        buddy_addr = get_buddy_addr(addr, order);
+
+        /* Check if buddy is free - O(1) via the page map */
+        if (!is_free_block(buddy_addr, order)) {
+            break;  /* Buddy not free, stop merging */
+        }
+
+        /* Remove buddy from free list */
+        remove_from_free_list(buddy_addr, order);
+
+        /* Merge with buddy (use lower address) */
+        if (buddy_addr < addr) {
+            pmm.page_map[PAGE_INDEX(addr)] = 0;
+            addr = buddy_addr;
+        }
+
+        /* Move up to next order */
+        order++;
+    }
+
+    /* Add merged block to free list */
+    add_to_free_list(addr, order);
+}
+
+/**
+ * Move a batch of order-0 pages from the buddy lists to a CPU list
+ * Called with local IRQs masked.
+ */
+static void pcp_refill(pmm_pcp_t *cpu)
+{
+    free_block_t *block;
+    uint64_t addr;
+    uint32_t i;
+
+    spin_lock(&pmm.lock);
+    for (i = 0; i < pmm.pcp_batch; i++) {
+        addr = buddy_alloc(0);
+        if (addr == 0) {
+            break;
+        }
+        block = (free_block_t *)addr;
+        block->next = cpu->pages;
+        cpu->pages = block;
+        cpu->count++;
+        pmm.page_map[PAGE_INDEX(addr)] = PAGE_PCP;
+    }
+    spin_unlock(&pmm.lock);
+}
+
+/**
+ * Return up to count pages from a CPU list to the buddy lists
+ * Called with local IRQs masked.
+ */
+static void pcp_drain(pmm_pcp_t *cpu, uint32_t count)
+{
+    free_block_t *block;
+
+    spin_lock(&pmm.lock);
+    while (count-- > 0 && cpu->pages != NULL) {
+        block = cpu->pages;
+        cpu->pages = block->next;
+        cpu->count--;
+        pmm.page_map[PAGE_INDEX((uint64_t)block)] = 0;
+        buddy_free((uint64_t)block, 0);
+    }
+    cpu->drains++;
+    spin_unlock(&pmm.lock);
 }
 
 /* ============================================================================
@@ -0,0 +1,260 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/shrinker.c
+ * Description: Cache shrinkers and memory reclaim
+ * ============================================================================ */
+
+#include <aeos/shrinker.h>
+#include <aeos/pmm.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/softirq.h>
+#include <aeos/timer.h>
+#include <aeos/spinlock.h>
+#include <aeos/kprintf.h>
+#include <aeos/types.h>
+
+/*
+ * The lock covers the list and is held, with IRQs masked, for a whole
+ * pass. A pass only ever tries it: one that finds it taken, by another
+ * CPU or by an allocation inside a shrinker on this one, returns at once
+ * and leaves the work to the pass already running.
+ */
+
+static struct {
+    spinlock_t lock;
+    shrinker_t *list;
+    uint32_t count;
+    process_t *proc;                    /* kreclaimd */
+    volatile bool kicked;               /* Set by reclaim_wake() */
+    tasklet_t tasklet;                  /* Wakes proc */
+    reclaim_stats_t stats;              /* Under lock; wakeups, failures atomic */
+} reclaim = { .lock = SPINLOCK_INIT };
+
+/**
+ * Free pages as the watermarks count them
+ */
+static size_t free_pages(void)
+{
+    pmm_stats_t st;
+
+    pmm_get_stats(&st);
+    return st.free_pages;
+}
+
+/**
+ * Register a shrinker
+ */
+void shrinker_register(shrinker_t *s)
+{
+    uint64_t flags;
+
+    if (s == NULL || s->count == NULL || s->scan == NULL) {
+        klog_error("shrinker_register: incomplete shrinker");
+        return;
+    }
+
+    flags = spin_lock_irqsave(&reclaim.lock);
+    s->freed = 0;
+    s->next = reclaim.list;
+    reclaim.list = s;
+    reclaim.count++;
+    spin_unlock_irqrestore(&reclaim.lock, flags);
+}
+
+/**
+ * Unregister a shrinker
+ */
+void shrinker_unregister(shrinker_t *s)
+{
+    shrinker_t **link;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&reclaim.lock);
+    for (link = &reclaim.list; *link != NULL; link = &(*link)->next) {
+        if (*link == s) {
+            *link = s->next;
+            s->next = NULL;
+            reclaim.count--;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&reclaim.lock, flags);
+}
+
+/**
+ * Run one reclaim pass over every shrinker
+ */
+size_t shrink_caches(uint32_t priority, bool direct)
+{
+    shrinker_t *s;
+    uint64_t flags;
+    size_t before, after, count, nr, freed, total = 0;
+
+    if (priority > SHRINK_PRIORITY_MAX) {
+        priority = SHRINK_PRIORITY_MAX;
+    }
+
+    flags = irq_save();
+    if (!spin_trylock(&reclaim.lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    before = free_pages();
+    for (s = reclaim.list; s != NULL; s = s->next) {
+        count = s->count();
+        if (count == 0) {
+            continue;
+        }
+        nr = count >> priority;
+        if (nr == 0) {
+            nr = 1;
+        }
+        freed = s->scan(nr);
+        s->freed += freed;
+        total += freed;
+    }
+    after = free_pages();
+
+    if (direct) {
+        reclaim.stats.direct++;
+    } else {
+        reclaim.stats.background++;
+    }
+    reclaim.stats.freed += total;
+    if (after > before) {
+        reclaim.stats.pages += after - before;
+    }
+
+    spin_unlock_irqrestore(&reclaim.lock, flags);
+    return total;
+}
+
+/**
+ * Reclaim process: shrink caches back to the high watermark when woken
+ */
+static void kreclaimd(void)
+{
+    pmm_stats_t st;
+    size_t freed;
+    int priority;
+
+    for (;;) {
+        scheduler_block_unless(&reclaim.kicked);
+
+        /* Gentle passes first; harder ones only while still short */
+        freed = 0;
+        pmm_get_stats(&st);
+        for (priority = SHRINK_PRIORITY_MAX;
+             priority >= 0 && st.free_pages < st.wmark_high; priority--) {
+            freed += shrink_caches((uint32_t)priority, false);
+            pmm_get_stats(&st);
+        }
+
+        /* Nothing left to give: don't spin on every allocation's wakeup */
+        if (freed == 0) {
+            timer_sleep_ms(RECLAIM_BACKOFF_MS);
+        }
+        __atomic_store_n(&reclaim.kicked, false, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Tasklet: wake kreclaimd outside whatever the allocator was called under
+ */
+static void reclaim_tasklet(void *arg)
+{
+    (void)arg;
+    scheduler_wake(reclaim.proc);
+}
+
+/**
+ * Start the reclaim process
+ */
+void reclaim_init(void)
+{
+    pmm_stats_t st;
+
+    tasklet_init(&reclaim.tasklet, reclaim_tasklet, NULL);
+    reclaim.proc = process_create(kreclaimd, "kreclaimd");
+    if (reclaim.proc == NULL) {
+        klog_error("Reclaim: failed to start kreclaimd");
+        return;
+    }
+
+    pmm_get_stats(&st);
+    klog_info("Reclaim: %u shrinkers, watermarks %u/%u/%u pages",
+              reclaim.count, (uint32_t)st.wmark_min, (uint32_t)st.wmark_low,
+              (uint32_t)st.wmark_high);
+}
+
+/**
+ * Wake the reclaim process
+ */
+void reclaim_wake(void)
+{
+    if (reclaim.proc == NULL || __atomic_load_n(&reclaim.kicked, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    if (!__atomic_exchange_n(&reclaim.kicked, true, __ATOMIC_ACQ_REL)) {
+        __atomic_add_fetch(&reclaim.stats.wakeups, 1, __ATOMIC_RELAXED);
+        tasklet_schedule(&reclaim.tasklet);
+    }
+}
+
+/**
+ * Count an allocation that failed after reclaim
+ */
+void reclaim_note_failure(void)
+{
+    __atomic_add_fetch(&reclaim.stats.failures, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * List the registered shrinkers
+ */
+uint32_t shrinker_list(shrinker_info_t *info, uint32_t max)
+{
+    shrinker_t *s;
+    uint64_t flags;
+    uint32_t n = 0;
+
+    if (info == NULL) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&reclaim.lock);
+    for (s = reclaim.list; s != NULL && n < max; s = s->next, n++) {
+        info[n].name = s->name;
+        info[n].count = s->count();
+        info[n].freed = s->freed;
+    }
+    spin_unlock_irqrestore(&reclaim.lock, flags);
+    return n;
+}
+
+/**
+ * Get reclaim statistics
+ */
+void reclaim_get_stats(reclaim_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&reclaim.lock);
+    *stats = reclaim.stats;
+    stats->shrinkers = reclaim.count;
+    spin_unlock_irqrestore(&reclaim.lock, flags);
+
+    stats->wakeups = __atomic_load_n(&reclaim.stats.wakeups, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&reclaim.stats.failures, __ATOMIC_RELAXED);
+}
+
+/* ============================================================================
+ * End of shrinker.c
+ * ============================================================================ */
@@ -0,0 +1,592 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/mm/slab.c
+ * Description: Slab allocator - O(1) fixed-size object caches
+ * ============================================================================ */
+
+#include <aeos/slab.h>
+#include <aeos/pmm.h>
+#include <aeos/types.h>
+#include <aeos/kprintf.h>
+#include <aeos/spinlock.h>
+#include <aeos/shrinker.h>
+#include <aeos/memblock.h>
+
+#define SLAB_MAGIC          0x51AB51ABU
+
+/* Allocation bitmap size: enough for the smallest objects in one slab */
+#define SLAB_MAP_WORDS      ((SLAB_SIZE / SLAB_MIN_SIZE + 63) / 64)
+
+/**
+ * Slab header, stored at the start of each slab
+ */
+typedef struct slab {
+    uint32_t magic;             /* SLAB_MAGIC while the slab is live */
+    uint32_t in_use;            /* Allocated objects in this slab */
+    kmem_cache_t *cache;        /* Owning cache */
+    void *free_list;            /* Free objects (next pointer in object) */
+    struct slab *next;          /* Next slab in cache list */
+    struct slab *prev;          /* Previous slab in cache list */
+    uint64_t alloc_map[SLAB_MAP_WORDS];  /* Allocated objects (double-free check) */
+} slab_t;
+
+/**
+ * Object cache
+ */
+struct kmem_cache {
+    const char *name;
+    size_t obj_size;            /* Object stride in bytes */
+    size_t first_offset;        /* Offset of first object in a slab */
+    uint32_t objs_per_slab;
+    slab_t *partial;            /* Slabs with at least one free object */
+    slab_t *full;               /* Slabs with no free objects */
+    size_t num_slabs;
+    size_t empty_slabs;         /* Slabs on partial list with in_use == 0 */
+    size_t active_objs;
+    size_t num_allocs;
+    size_t num_frees;
+    spinlock_t lock;            /* Protects the slab lists and counters */
+    bool in_use;                /* Cache slot allocated */
+};
+
+/**
+ * Slab allocator state
+ */
+static struct {
+    kmem_cache_t caches[KMEM_MAX_CACHES];       /* Cache descriptors */
+    kmem_cache_t *classes[SLAB_NUM_CLASSES];    /* kmalloc size classes */
+    spinlock_t lock;                            /* Protects cache slots */
+    bool initialized;
+} slab;
+
+/* kmalloc size class names */
+static const char *class_names[SLAB_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k"
+};
+
+/* Forward declarations */
+static size_t slab_shrink_count(void);
+static size_t slab_shrink_scan(size_t nr);
+static slab_t *slab_create(kmem_cache_t *cache);
+static void list_add(slab_t **list, slab_t *s);
+static void list_remove(slab_t **list, slab_t *s);
+static int32_t obj_index(kmem_cache_t *cache, slab_t *s, void *obj);
+
+/* Gives back the empty slab each cache keeps */
+static shrinker_t slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrink_count,
+    .scan = slab_shrink_scan,
+};
+
+/**
+ * Initialize the slab allocator and the kmalloc size classes
+ */
+void slab_init(void)
+{
+    uint32_t i;
+
+    klog_info("Initializing slab allocator...");
+
+    for (i = 0; i < KMEM_MAX_CACHES; i++) {
+        slab.caches[i].in_use = false;
+    }
+    spin_lock_init(&slab.lock);
+
+    slab.initialized = true;
+
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab.classes[i] = kmem_cache_create(class_names[i],
+                                            SLAB_MIN_SIZE << i, 0);
+    }
+
+    shrinker_register(&slab_shrinker);
+
+    kprintf("  Size classes: %u - %u bytes, %u KB slabs\n",
+            (uint32_t)SLAB_MIN_SIZE, (uint32_t)SLAB_MAX_SIZE,
+            (uint32_t)(SLAB_SIZE / 1024));
+}
+
+/**
+ * Create a cache of fixed-size objects
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align)
+{
+    kmem_cache_t *cache = NULL;
+    uint32_t i;
+    uint64_t flags;
+
+    if (!slab.initialized) {
+        klog_error("Slab allocator not initialized");
+        return NULL;
+    }
+
+    if (align == 0) {
+        align = 8;
+    }
+
+    if (size == 0 || (align & (align - 1)) != 0 || align > PAGE_SIZE) {
+        klog_error("kmem_cache_create: bad size/align for '%s'", name);
+        return NULL;
+    }
+
+    /* Objects must hold the free-list pointer and keep their alignment */
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    size = (size + align - 1) & ~(align - 1);
+
+    if (size > SLAB_MAX_OBJ_SIZE) {
+        klog_error("kmem_cache_create: '%s' objects too large (%u bytes)",
+                   name, (uint32_t)size);
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&slab.lock);
+
+    for (i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!slab.caches[i].in_use) {
+            cache = &slab.caches[i];
+            cache->in_use = true;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&slab.lock, flags);
+
+    if (cache == NULL) {
+        klog_error("kmem_cache_create: no free cache slots");
+        return NULL;
+    }
+
+    cache->name = name;
+    cache->obj_size = size;
+    cache->first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+    cache->objs_per_slab = (uint32_t)((SLAB_SIZE - cache->first_offset) / size);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->num_slabs = 0;
+    cache->empty_slabs = 0;
+    cache->active_objs = 0;
+    cache->num_allocs = 0;
+    cache->num_frees = 0;
+    spin_lock_init(&cache->lock);
+
+    return cache;
+}
+
+/**
+ * Destroy a cache and return its slabs to the PMM
+ */
+int kmem_cache_destroy(kmem_cache_t *cache)
+{
+    slab_t *s;
+    uint64_t flags;
+
+    if (cache == NULL || !cache->in_use) {
+        return -1;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+
+    if (cache->active_objs != 0) {
+        spin_unlock_irqrestore(&cache->lock, flags);
+        klog_error("kmem_cache_destroy: '%s' still has %u objects",
+                   cache->name, (uint32_t)cache->active_objs);
+        return -1;
+    }
+
+    /* With no active objects every slab is empty and on the partial list */
+    while ((s = cache->partial) != NULL) {
+        list_remove(&cache->partial, s);
+        s->magic = 0;
+        pmm_free_pages((uint64_t)s, SLAB_ORDER);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    flags = spin_lock_irqsave(&slab.lock);
+    cache->in_use = false;
+    spin_unlock_irqrestore(&slab.lock, flags);
+    return 0;
+}
+
+/**
+ * Allocate one object from a cache (cache lock held)
+ */
+static void *cache_alloc(kmem_cache_t *cache)
+{
+    slab_t *s;
+    void *obj;
+    int32_t index;
+
+    s = cache->partial;
+    if (s == NULL) {
+        s = slab_create(cache);
+        if (s == NULL) {
+            return NULL;
+        }
+    }
+
+    if (s->in_use == 0) {
+        cache->empty_slabs--;
+    }
+
+    /* Pop the first free object */
+    obj = s->free_list;
+    s->free_list = *(void **)obj;
+    s->in_use++;
+    index = obj_index(cache, s, obj);
+    s->alloc_map[index / 64] |= 1ULL << (index % 64);
+
+    if (s->in_use == cache->objs_per_slab) {
+        list_remove(&cache->partial, s);
+        list_add(&cache->full, s);
+    }
+
+    cache->active_objs++;
+    cache->num_allocs++;
+
+    return obj;
+}
+
+/**
+ * Allocate one object from a cache
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    void *obj;
+    uint64_t flags;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+    obj = cache_alloc(cache);
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return obj;
+}
+
+/**
+ * Return an object to its cache (cache lock held)
+ */
+static void cache_free(kmem_cache_t *cache, void *obj)
+{
+    slab_t *s;
+    int32_t index;
+
+    s = (slab_t *)((uint64_t)obj & ~(uint64_t)(SLAB_SIZE - 1));
+
+    index = (s->magic == SLAB_MAGIC && s->cache == cache) ?
+            obj_index(cache, s, obj) : -1;
+    if (index < 0) {
+        klog_error("kmem_cache_free: Invalid object %p", obj);
+        return;
+    }
+
+    /* Check if already free (double-free detection) */
+    if (!(s->alloc_map[index / 64] & (1ULL << (index % 64)))) {
+        klog_error("kmem_cache_free: Double free detected at %p", obj);
+        return;
+    }
+    s->alloc_map[index / 64] &= ~(1ULL << (index % 64));
+
+    if (s->in_use == cache->objs_per_slab) {
+        list_remove(&cache->full, s);
+        list_add(&cache->partial, s);
+    }
+
+    /* Push onto the slab free list */
+    *(void **)obj = s->free_list;
+    s->free_list = obj;
+    s->in_use--;
+
+    cache->active_objs--;
+    cache->num_frees++;
+
+    /* Keep one empty slab around to avoid PMM ping-pong, release the rest */
+    if (s->in_use == 0) {
+        if (cache->empty_slabs > 0) {
+            list_remove(&cache->partial, s);
+            s->magic = 0;
+            pmm_free_pages((uint64_t)s, SLAB_ORDER);
+            cache->num_slabs--;
+        } else {
+            cache->empty_slabs++;
+        }
+    }
+}
+
+/**
+ * Return an object to its cache
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    uint64_t flags;
+
+    if (cache == NULL || obj == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&cache->lock);
+    cache_free(cache, obj);
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * Get statistics for a cache
+ */
+void kmem_cache_get_stats(kmem_cache_t *cache, kmem_cache_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    if (cache == NULL) {
+        stats->name = NULL;
+        stats->obj_size = 0;
+        stats->objs_per_slab = 0;
+        stats->num_slabs = 0;
+        stats->active_objs = 0;
+        stats->total_objs = 0;
+        stats->num_allocs = 0;
+        stats->num_frees = 0;
+        return;
+    }
+
+    stats->name = cache->name;
+    stats->obj_size = cache->obj_size;
+    stats->objs_per_slab = cache->objs_per_slab;
+    stats->num_slabs = cache->num_slabs;
+    stats->active_objs = cache->active_objs;
+    stats->total_objs = cache->num_slabs * cache->objs_per_slab;
+    stats->num_allocs = cache->num_allocs;
+    stats->num_frees = cache->num_frees;
+}
+
+/**
+ * Allocate from the smallest kmalloc size class that fits
+ */
+void *slab_alloc(size_t size)
+{
+    uint32_t index = 0;
+
+    if (!slab.initialized || size == 0 || size > SLAB_MAX_SIZE) {
+        return NULL;
+    }
+
+    while ((SLAB_MIN_SIZE << index) < size) {
+        index++;
+    }
+
+    return kmem_cache_alloc(slab.classes[index]);
+}
+
+/**
+ * Check whether a pointer belongs to a slab
+ */
+bool slab_owns(const void *ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+    slab_t *s;
+
+    if (!slab.initialized || addr < memblock_start() || addr >= memblock_end()) {
+        return false;
+    }
+
+    s = (slab_t *)(addr & ~(uint64_t)(SLAB_SIZE - 1));
+    return s->magic == SLAB_MAGIC && addr >= (uint64_t)s + s->cache->first_offset;
+}
+
+/**
+ * Free an object allocated from any cache
+ */
+void slab_free(void *ptr)
+{
+    slab_t *s;
+
+    if (!slab_owns(ptr)) {
+        klog_error("slab_free: Invalid pointer %p", ptr);
+        return;
+    }
+
+    s = (slab_t *)((uint64_t)ptr & ~(uint64_t)(SLAB_SIZE - 1));
+    kmem_cache_free(s->cache, ptr);
+}
+
+/**
+ * Get the object size of a slab-allocated pointer
+ */
+size_t slab_obj_size(const void *ptr)
+{
+    slab_t *s;
+
+    if (!slab_owns(ptr)) {
+        return 0;
+    }
+
+    s = (slab_t *)((uint64_t)ptr & ~(uint64_t)(SLAB_SIZE - 1));
+    return s->cache->obj_size;
+}
+
+/**
+ * Get statistics for a kmalloc size class
+ */
+void slab_get_class_stats(uint32_t index, kmem_cache_stats_t *stats)
+{
+    kmem_cache_get_stats(index < SLAB_NUM_CLASSES ? slab.classes[index] : NULL,
+                         stats);
+}
+
+/* ============================================================================
+ * Helper functions
+ * ============================================================================ */
+
+/**
+ * Shrinker: empty slabs held by all caches (read without the locks)
+ */
+static size_t slab_shrink_count(void)
+{
+    size_t n = 0;
+    uint32_t i;
+
+    for (i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (slab.caches[i].in_use) {
+            n += slab.caches[i].empty_slabs;
+        }
+    }
+    return n;
+}
+
+/**
+ * Shrinker: free up to nr empty slabs
+ * A cache whose lock is taken, as when its own slab_create() is what ran
+ * out of memory, is skipped.
+ */
+static size_t slab_shrink_scan(size_t nr)
+{
+    kmem_cache_t *cache;
+    slab_t *s, *next;
+    size_t freed = 0;
+    uint32_t i;
+
+    for (i = 0; i < KMEM_MAX_CACHES && freed < nr; i++) {
+        cache = &slab.caches[i];
+        if (!cache->in_use || cache->empty_slabs == 0 || !spin_trylock(&cache->lock)) {
+            continue;
+        }
+        for (s = cache->partial; s != NULL && freed < nr; s = next) {
+            next = s->next;
+            if (s->in_use == 0) {
+                list_remove(&cache->partial, s);
+                s->magic = 0;
+                pmm_free_pages((uint64_t)s, SLAB_ORDER);
+                cache->num_slabs--;
+                cache->empty_slabs--;
+                freed++;
+            }
+        }
+        spin_unlock(&cache->lock);
+    }
+    return freed;
+}
+
+/**
+ * Allocate a new slab from the PMM and thread its free list
+ */
+static slab_t *slab_create(kmem_cache_t *cache)
+{
+    uint64_t base;
+    slab_t *s;
+    uint8_t *obj;
+    uint32_t i;
+
+    base = pmm_alloc_pages(SLAB_ORDER);
+    if (base == 0) {
+        return NULL;
+    }
+
+    s = (slab_t *)base;
+    s->magic = SLAB_MAGIC;
+    s->in_use = 0;
+    s->cache = cache;
+    s->free_list = NULL;
+    for (i = 0; i < SLAB_MAP_WORDS; i++) {
+        s->alloc_map[i] = 0;
+    }
+
+    /* Build the free list back to front so objects come out in address order */
+    obj = (uint8_t *)base + cache->first_offset +
+          (size_t)(cache->objs_per_slab - 1) * cache->obj_size;
+    for (i = 0; i < cache->objs_per_slab; i++) {
+        *(void **)obj = s->free_list;
+        s->free_list = obj;
+        obj -= cache->obj_size;
+    }
+
+    list_add(&cache->partial, s);
+    cache->num_slabs++;
+    cache->empty_slabs++;
+
+    return s;
+}
+
+/**
+ * Get the index of an object within its slab, or -1 if obj is not an
+ * object boundary
+ */
+static int32_t obj_index(kmem_cache_t *cache, slab_t *s, void *obj)
+{
+    uint64_t offset = (uint64_t)obj - (uint64_t)s;
+
+    if (offset < cache->first_offset) {
+        return -1;
+    }
+
+    offset -= cache->first_offset;
+    if (offset % cache->obj_size != 0 ||
+        offset / cache->obj_size >= cache->objs_per_slab) {
+        return -1;
+    }
+
+    return (int32_t)(offset / cache->obj_size);
+}
+
+/**
+ * Push a slab onto the front of a list
+ */
+static void list_add(slab_t **list, slab_t *s)
+{
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = s;
+    }
+    *list = s;
+}
+
+/**
+ * Unlink a slab from a list
+ */
+static void list_remove(slab_t **list, slab_t *s)
+{
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        *list = s->next;
+    }
+
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+/* ============================================================================
+ * End of slab.c
+ * ============================================================================ */
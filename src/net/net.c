@@ -0,0 +1,478 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/net/net.c
+ * Description: Minimal IPv4 networking: ARP and sending UDP
+ * ============================================================================ */
+
+#include <aeos/net.h>
+#include <aeos/virtio_net.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+#include <aeos/spinlock.h>
+#include <aeos/timer.h>
+
+/* ARP */
+#define ARP_HTYPE_ETHER     1
+#define ARP_OP_REQUEST      1
+#define ARP_OP_REPLY        2
+
+/* Requests sent for an address before giving up, and the wait after each */
+#define NET_ARP_TRIES       3
+#define NET_ARP_WAIT_MS     100
+
+/* Link, network and transport headers of a datagram, copied per send */
+typedef struct {
+    eth_hdr_t eth;
+    ipv4_hdr_t ip;
+    udp_hdr_t udp;
+} __attribute__((packed)) udp_frame_hdr_t;
+
+_Static_assert(sizeof(udp_frame_hdr_t) <= VIRTIO_NET_TX_HEADROOM,
+               "datagram headers fit a send's headroom");
+
+/* One ARP cache entry */
+typedef struct {
+    uint32_t addr;                  /* 0 when unused */
+    uint8_t mac[VIRTIO_NET_ALEN];
+} arp_entry_t;
+
+static const uint8_t eth_broadcast[VIRTIO_NET_ALEN] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static struct {
+    spinlock_t lock;                /* ARP cache, IP ID and statistics */
+    bool up;
+    uint8_t mac[VIRTIO_NET_ALEN];
+    uint32_t addr;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint16_t ip_id;
+    arp_entry_t arp[NET_ARP_ENTRIES];
+    uint32_t arp_next;              /* Entry replaced next when the cache is full */
+    net_stats_t stats;
+} net = { .lock = SPINLOCK_INIT };
+
+/* ============================================================================
+ * ARP
+ * ============================================================================ */
+
+/**
+ * Look an address up in the ARP cache
+ * @return true if it is there
+ */
+static bool arp_lookup(uint32_t addr, uint8_t mac[VIRTIO_NET_ALEN])
+{
+    uint64_t flags;
+    uint32_t i;
+    bool found = false;
+
+    flags = spin_lock_irqsave(&net.lock);
+    for (i = 0; i < NET_ARP_ENTRIES; i++) {
+        if (net.arp[i].addr == addr) {
+            memcpy(mac, net.arp[i].mac, VIRTIO_NET_ALEN);
+            found = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&net.lock, flags);
+
+    return found;
+}
+
+/**
+ * Record where an address is
+ * Caller holds net.lock.
+ */
+static void arp_learn_locked(uint32_t addr, const uint8_t mac[VIRTIO_NET_ALEN])
+{
+    uint32_t i;
+
+    for (i = 0; i < NET_ARP_ENTRIES; i++) {
+        if (net.arp[i].addr == addr) {
+            break;
+        }
+    }
+    if (i == NET_ARP_ENTRIES) {
+        i = net.arp_next;
+        net.arp_next = (net.arp_next + 1) % NET_ARP_ENTRIES;
+    }
+
+    net.arp[i].addr = addr;
+    memcpy(net.arp[i].mac, mac, VIRTIO_NET_ALEN);
+}
+
+/**
+ * Send an ARP request or reply
+ * The whole frame is the send's copied header, so nothing is waited on.
+ */
+static void arp_send(uint16_t oper, const uint8_t eth_dst[VIRTIO_NET_ALEN],
+                     const uint8_t tha[VIRTIO_NET_ALEN], uint32_t tpa)
+{
+    uint8_t frame[ETH_FRAME_MIN];
+    eth_hdr_t *eth = (eth_hdr_t *)frame;
+    arp_pkt_t *arp = (arp_pkt_t *)(frame + sizeof(eth_hdr_t));
+    uint64_t flags;
+
+    _Static_assert(sizeof(eth_hdr_t) + sizeof(arp_pkt_t) <= ETH_FRAME_MIN,
+                   "an ARP frame is padded to the minimum");
+
+    memset(frame, 0, sizeof(frame));
+    memcpy(eth->dst, eth_dst, VIRTIO_NET_ALEN);
+    memcpy(eth->src, net.mac, VIRTIO_NET_ALEN);
+    eth->type = net_htons(ETH_TYPE_ARP);
+
+    arp->htype = net_htons(ARP_HTYPE_ETHER);
+    arp->ptype = net_htons(ETH_TYPE_IPV4);
+    arp->hlen = VIRTIO_NET_ALEN;
+    arp->plen = sizeof(uint32_t);
+    arp->oper = net_htons(oper);
+    memcpy(arp->sha, net.mac, VIRTIO_NET_ALEN);
+    arp->spa = net_htonl(net.addr);
+    memcpy(arp->tha, tha, VIRTIO_NET_ALEN);
+    arp->tpa = net_htonl(tpa);
+
+    if (virtio_net_send(frame, sizeof(frame), NULL, 0) != 0) {
+        flags = spin_lock_irqsave(&net.lock);
+        net.stats.tx_arp++;
+        spin_unlock_irqrestore(&net.lock, flags);
+    }
+}
+
+/**
+ * Find the MAC address of a next hop, asking for it if it isn't cached
+ * @return 0 on success, -1 if it never answered
+ */
+static int arp_resolve(uint32_t addr, uint8_t mac[VIRTIO_NET_ALEN])
+{
+    static const uint8_t unknown[VIRTIO_NET_ALEN];
+    uint64_t wait = (uint64_t)timer_get_frequency() * NET_ARP_WAIT_MS / 1000;
+    uint64_t flags, start;
+    uint32_t try;
+    char ip[16];
+
+    if (arp_lookup(addr, mac)) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&net.lock);
+    net.stats.arp_misses++;
+    spin_unlock_irqrestore(&net.lock, flags);
+
+    for (try = 0; try < NET_ARP_TRIES; try++) {
+        arp_send(ARP_OP_REQUEST, eth_broadcast, unknown, addr);
+
+        /* The reply is normally taken by the interrupt on CPU 0 */
+        start = timer_get_counter();
+        while (timer_get_counter() - start < wait) {
+            virtio_net_poll();
+            if (arp_lookup(addr, mac)) {
+                return 0;
+            }
+            __asm__ volatile("yield");
+        }
+    }
+
+    flags = spin_lock_irqsave(&net.lock);
+    net.stats.arp_failures++;
+    spin_unlock_irqrestore(&net.lock, flags);
+
+    net_format_addr(addr, ip, sizeof(ip));
+    klog_warn("net: no ARP reply from %s", ip);
+    return -1;
+}
+
+/**
+ * Receive handler: answer and learn from ARP, drop everything else
+ * Runs from the driver's interrupt; the frame is read in place.
+ */
+static bool net_rx(void *frame, uint32_t len)
+{
+    eth_hdr_t *eth = (eth_hdr_t *)frame;
+    arp_pkt_t *arp = (arp_pkt_t *)((uint8_t *)frame + sizeof(eth_hdr_t));
+    uint8_t sha[VIRTIO_NET_ALEN];
+    uint32_t spa;
+    uint16_t oper;
+    bool reply = false;
+
+    spin_lock(&net.lock);
+    net.stats.rx_frames++;
+
+    if (len < sizeof(eth_hdr_t) + sizeof(arp_pkt_t) ||
+        net_ntohs(eth->type) != ETH_TYPE_ARP ||
+        net_ntohs(arp->htype) != ARP_HTYPE_ETHER ||
+        net_ntohs(arp->ptype) != ETH_TYPE_IPV4 ||
+        arp->hlen != VIRTIO_NET_ALEN || arp->plen != sizeof(uint32_t) ||
+        net_ntohl(arp->tpa) != net.addr) {
+        net.stats.rx_ignored++;
+        spin_unlock(&net.lock);
+        return false;
+    }
+
+    net.stats.rx_arp++;
+    spa = net_ntohl(arp->spa);
+    oper = net_ntohs(arp->oper);
+    memcpy(sha, arp->sha, VIRTIO_NET_ALEN);
+
+    /* Whoever asks or answers for us gets remembered */
+    if (spa != 0 && (oper == ARP_OP_REQUEST || oper == ARP_OP_REPLY)) {
+        arp_learn_locked(spa, sha);
+    }
+    reply = oper == ARP_OP_REQUEST;
+    spin_unlock(&net.lock);
+
+    if (reply) {
+        arp_send(ARP_OP_REPLY, sha, sha, spa);
+    }
+    return false;
+}
+
+/* ============================================================================
+ * IPv4 and UDP
+ * ============================================================================ */
+
+/**
+ * Internet checksum of a header, in network byte order
+ */
+static uint16_t ip_checksum(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += ((uint32_t)p[i] << 8) | p[i + 1];
+    }
+    if (len & 1) {
+        sum += (uint32_t)p[len - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return net_htons((uint16_t)~sum);
+}
+
+/**
+ * Send a UDP datagram from several buffers
+ */
+uint64_t udp_sendv(uint32_t dst, uint16_t dst_port, uint16_t src_port,
+                   const virtq_buf_t *bufs, uint16_t count)
+{
+    udp_frame_hdr_t hdr;
+    uint8_t mac[VIRTIO_NET_ALEN];
+    uint32_t next_hop;
+    uint64_t flags, fence;
+    size_t len = 0;
+    uint16_t i, id;
+
+    if (!net.up || count > UDP_SEND_BUFS) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        len += bufs[i].len;
+    }
+    if (len > UDP_PAYLOAD_MAX) {
+        return 0;
+    }
+
+    /* Off the subnet, the frame goes to the gateway */
+    if (dst == 0xFFFFFFFF) {
+        memcpy(mac, eth_broadcast, VIRTIO_NET_ALEN);
+    } else {
+        next_hop = ((dst ^ net.addr) & net.netmask) == 0 ? dst : net.gateway;
+        if (arp_resolve(next_hop, mac) != 0) {
+            return 0;
+        }
+    }
+
+    flags = spin_lock_irqsave(&net.lock);
+    id = net.ip_id++;
+    spin_unlock_irqrestore(&net.lock, flags);
+
+    memcpy(hdr.eth.dst, mac, VIRTIO_NET_ALEN);
+    memcpy(hdr.eth.src, net.mac, VIRTIO_NET_ALEN);
+    hdr.eth.type = net_htons(ETH_TYPE_IPV4);
+
+    hdr.ip.ver_ihl = 0x45;          /* IPv4, 20-byte header */
+    hdr.ip.tos = 0;
+    hdr.ip.total_len = net_htons((uint16_t)(sizeof(ipv4_hdr_t) + sizeof(udp_hdr_t) + len));
+    hdr.ip.id = net_htons(id);
+    hdr.ip.frag = 0;
+    hdr.ip.ttl = IP_TTL_DEFAULT;
+    hdr.ip.proto = IP_PROTO_UDP;
+    hdr.ip.csum = 0;
+    hdr.ip.src = net_htonl(net.addr);
+    hdr.ip.dst = net_htonl(dst);
+    hdr.ip.csum = ip_checksum(&hdr.ip, sizeof(ipv4_hdr_t));
+
+    /* No UDP checksum (optional over IPv4): the payload is never read here */
+    hdr.udp.src_port = net_htons(src_port);
+    hdr.udp.dst_port = net_htons(dst_port);
+    hdr.udp.len = net_htons((uint16_t)(sizeof(udp_hdr_t) + len));
+    hdr.udp.csum = 0;
+
+    fence = virtio_net_send(&hdr, sizeof(hdr), bufs, count);
+    if (fence != 0) {
+        flags = spin_lock_irqsave(&net.lock);
+        net.stats.udp_sent++;
+        net.stats.udp_bytes += len;
+        spin_unlock_irqrestore(&net.lock, flags);
+    }
+    return fence;
+}
+
+/**
+ * Send a UDP datagram from one buffer
+ */
+uint64_t udp_send(uint32_t dst, uint16_t dst_port, uint16_t src_port,
+                  const void *data, size_t len)
+{
+    virtq_buf_t buf;
+
+    if (len > UDP_PAYLOAD_MAX) {
+        return 0;
+    }
+
+    buf.addr = (uint64_t)data;
+    buf.len = (uint32_t)len;
+    buf.write = false;
+    return udp_sendv(dst, dst_port, src_port, &buf, len > 0 ? 1 : 0);
+}
+
+/**
+ * Wait until every send up to a fence is done with its buffers
+ */
+int net_wait(uint64_t fence)
+{
+    return virtio_net_tx_wait(fence);
+}
+
+/* ============================================================================
+ * Network API
+ * ============================================================================ */
+
+/**
+ * Bring networking up on the VirtIO network device
+ */
+int net_init(void)
+{
+    char addr[16];
+
+    if (!virtio_net_present()) {
+        return -1;
+    }
+
+    virtio_net_get_mac(net.mac);
+    net.addr = NET_DEFAULT_ADDR;
+    net.netmask = NET_DEFAULT_NETMASK;
+    net.gateway = NET_DEFAULT_GATEWAY;
+    net.up = true;
+    virtio_net_set_rx_handler(net_rx);
+
+    net_format_addr(net.addr, addr, sizeof(addr));
+    klog_info("Network up: %s/24", addr);
+    return 0;
+}
+
+/**
+ * Check whether networking is up
+ */
+bool net_up(void)
+{
+    return net.up;
+}
+
+/**
+ * Get the interface configuration
+ */
+void net_get_config(uint32_t *addr, uint32_t *netmask, uint32_t *gateway)
+{
+    if (addr) {
+        *addr = net.addr;
+    }
+    if (netmask) {
+        *netmask = net.netmask;
+    }
+    if (gateway) {
+        *gateway = net.gateway;
+    }
+}
+
+/**
+ * Parse a dotted-quad address
+ */
+int net_parse_addr(const char *str, uint32_t *addr)
+{
+    uint32_t result = 0, part;
+    int i, digits;
+
+    if (str == NULL || addr == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        part = 0;
+        digits = 0;
+        while (*str >= '0' && *str <= '9' && digits < 3) {
+            part = part * 10 + (uint32_t)(*str - '0');
+            str++;
+            digits++;
+        }
+        if (digits == 0 || part > 255) {
+            return -1;
+        }
+        result = (result << 8) | part;
+
+        if (i < 3) {
+            if (*str != '.') {
+                return -1;
+            }
+            str++;
+        }
+    }
+    if (*str != '\0') {
+        return -1;
+    }
+
+    *addr = result;
+    return 0;
+}
+
+/**
+ * Format an address as a dotted quad
+ */
+void net_format_addr(uint32_t addr, char *buf, size_t size)
+{
+    snprintf(buf, size, "%u.%u.%u.%u", (addr >> 24) & 0xFF, (addr >> 16) & 0xFF,
+             (addr >> 8) & 0xFF, addr & 0xFF);
+}
+
+/**
+ * Format a MAC address
+ */
+void net_format_mac(const uint8_t mac[VIRTIO_NET_ALEN], char *buf, size_t size)
+{
+    snprintf(buf, size, "%02x:%02x:%02x:%02x:%02x:%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+/**
+ * Get network statistics
+ */
+void net_get_stats(net_stats_t *stats)
+{
+    uint64_t flags;
+
+    if (stats == NULL) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&net.lock);
+    *stats = net.stats;
+    spin_unlock_irqrestore(&net.lock, flags);
+}
+
+/* ============================================================================
+ * End of net.c
+ * ============================================================================ */
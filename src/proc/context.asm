@@ -9,7 +9,7 @@ include(`src/boot/macros.m4')
 /* ============================================================================
  * Context Switch Function
  *
- * void context_switch(process_t *from, process_t *to);
+ * process_t *context_switch(process_t *from, process_t *to);
  *
  * Saves the current process context and restores the next process context.
  *
@@ -17,6 +17,10 @@ include(`src/boot/macros.m4')
  *   x0 = from (pointer to current process PCB)
  *   x1 = to   (pointer to next process PCB)
  *
+ * Returns (in the context switched to): x0 is left untouched, so the
+ * resumed process gets back the PCB it was switched in from. The
+ * scheduler uses it to mark that process as off the CPU.
+ *
  * Process PCB layout (from include/aeos/process.h):
  *   Offset  Field
  *   0x00    pid (uint64_t)
@@ -43,7 +47,8 @@ include(`src/boot/macros.m4')
 
 context_switch:
     /* Save current process context (from = x0) */
-    /* We only save callee-saved registers per ARM64 ABI */
+    /* We only save callee-saved registers per ARM64 ABI; kernel code
+     * keeps nothing in the FP/SIMD registers (-mgeneral-regs-only) */
     stp x19, x20, [x0, #0x18]   /* Save x19, x20 */
     stp x21, x22, [x0, #0x28]   /* Save x21, x22 */
     stp x23, x24, [x0, #0x38]   /* Save x23, x24 */
@@ -72,6 +77,141 @@ context_switch:
     /* or to the process entry point if this is the first time it's being run */
     ret
 
+/* ============================================================================
+ * Process Trampoline
+ *
+ * First code run by a new process: process_alloc() points the saved LR
+ * here and stores the entry point in x19. Finish the switch for the
+ * process we came from, then, since the scheduler switches with IRQs
+ * masked, unmask them before calling the entry, and exit the process
+ * cleanly if the entry function returns.
+ * ============================================================================ */
+
+    .global process_trampoline
+    .balign 4
+process_trampoline:
+    bl scheduler_finish_switch  /* x0 = previous process (or NULL) */
+    msr daifclr, #2             /* Unmask IRQs */
+    blr x19                     /* Call entry point */
+    bl process_exit             /* Entry returned: never comes back */
+
+/* ============================================================================
+ * User Mode Entry
+ *
+ * void user_enter(uint64_t entry, uint64_t user_sp, uint64_t kernel_sp);
+ *
+ * First entry of a user process into EL0. The process's kernel stack is
+ * reset to kernel_sp, so exceptions from EL0 start on an empty stack;
+ * SP_EL0 takes user_sp. SPSR = 0 selects EL0t with every interrupt
+ * unmasked. No kernel register contents leak to the program; the FP/SIMD
+ * registers get the process's (zeroed) state.
+ * ============================================================================ */
+
+    .global user_enter
+    .balign 4
+user_enter:
+    msr daifset, #3             /* No IRQ between here and the eret */
+    mov sp, x2
+    mov x19, x0
+    mov x20, x1
+    bl fpsimd_user_return
+    msr sp_el0, x20
+    msr elr_el1, x19
+    msr spsr_el1, xzr
+
+    mov x0, xzr
+    mov x1, xzr
+    mov x2, xzr
+    mov x3, xzr
+    mov x4, xzr
+    mov x5, xzr
+    mov x6, xzr
+    mov x7, xzr
+    mov x8, xzr
+    mov x9, xzr
+    mov x10, xzr
+    mov x11, xzr
+    mov x12, xzr
+    mov x13, xzr
+    mov x14, xzr
+    mov x15, xzr
+    mov x16, xzr
+    mov x17, xzr
+    mov x18, xzr
+    mov x19, xzr
+    mov x20, xzr
+    mov x21, xzr
+    mov x22, xzr
+    mov x23, xzr
+    mov x24, xzr
+    mov x25, xzr
+    mov x26, xzr
+    mov x27, xzr
+    mov x28, xzr
+    mov x29, xzr
+    mov x30, xzr
+    eret
+
+/* ============================================================================
+ * FP/SIMD State
+ *
+ * void fpsimd_save_regs(fpsimd_state_t *state);
+ * void fpsimd_load_regs(const fpsimd_state_t *state);
+ *
+ * q0-q31 at offsets 0-511, then FPSR and FPCR. Paired q-register
+ * accesses need no alignment on Normal memory.
+ * ============================================================================ */
+
+    .global fpsimd_save_regs
+    .balign 4
+fpsimd_save_regs:
+    stp q0, q1, [x0, #(32 * 0)]
+    stp q2, q3, [x0, #(32 * 1)]
+    stp q4, q5, [x0, #(32 * 2)]
+    stp q6, q7, [x0, #(32 * 3)]
+    stp q8, q9, [x0, #(32 * 4)]
+    stp q10, q11, [x0, #(32 * 5)]
+    stp q12, q13, [x0, #(32 * 6)]
+    stp q14, q15, [x0, #(32 * 7)]
+    stp q16, q17, [x0, #(32 * 8)]
+    stp q18, q19, [x0, #(32 * 9)]
+    stp q20, q21, [x0, #(32 * 10)]
+    stp q22, q23, [x0, #(32 * 11)]
+    stp q24, q25, [x0, #(32 * 12)]
+    stp q26, q27, [x0, #(32 * 13)]
+    stp q28, q29, [x0, #(32 * 14)]
+    stp q30, q31, [x0, #(32 * 15)]
+    mrs x1, fpsr
+    mrs x2, fpcr
+    str w1, [x0, #512]
+    str w2, [x0, #516]
+    ret
+
+    .global fpsimd_load_regs
+    .balign 4
+fpsimd_load_regs:
+    ldp q0, q1, [x0, #(32 * 0)]
+    ldp q2, q3, [x0, #(32 * 1)]
+    ldp q4, q5, [x0, #(32 * 2)]
+    ldp q6, q7, [x0, #(32 * 3)]
+    ldp q8, q9, [x0, #(32 * 4)]
+    ldp q10, q11, [x0, #(32 * 5)]
+    ldp q12, q13, [x0, #(32 * 6)]
+    ldp q14, q15, [x0, #(32 * 7)]
+    ldp q16, q17, [x0, #(32 * 8)]
+    ldp q18, q19, [x0, #(32 * 9)]
+    ldp q20, q21, [x0, #(32 * 10)]
+    ldp q22, q23, [x0, #(32 * 11)]
+    ldp q24, q25, [x0, #(32 * 12)]
+    ldp q26, q27, [x0, #(32 * 13)]
+    ldp q28, q29, [x0, #(32 * 14)]
+    ldp q30, q31, [x0, #(32 * 15)]
+    ldr w1, [x0, #512]
+    ldr w2, [x0, #516]
+    msr fpsr, x1
+    msr fpcr, x2
+    ret
+
 /* ============================================================================
  * End of context.asm
  * ============================================================================ */
@@ -0,0 +1,155 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/proc/elf.c
+ * Description: ELF64 executable loader
+ * ============================================================================ */
+
+#include <aeos/elf.h>
+#include <aeos/mmu.h>
+#include <aeos/pmm.h>
+#include <aeos/vfs.h>
+#include <aeos/kprintf.h>
+#include <aeos/string.h>
+
+/**
+ * Read exactly len bytes at an offset
+ */
+static int read_at(int fd, uint64_t offset, void *buf, size_t len)
+{
+    if (vfs_seek(fd, (int64_t)offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return vfs_read(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * Check the file header describes something we can run
+ */
+static bool header_ok(const elf64_ehdr_t *eh)
+{
+    return eh->magic == ELF_MAGIC && eh->class == ELF_CLASS_64 &&
+           eh->data == ELF_DATA_LSB && eh->type == ELF_TYPE_EXEC &&
+           eh->machine == ELF_MACHINE_AARCH64 &&
+           eh->phentsize == sizeof(elf64_phdr_t) &&
+           eh->phnum > 0 && eh->phnum <= ELF_MAX_PHDRS;
+}
+
+/**
+ * Map one PT_LOAD segment, a page at a time
+ */
+static int load_segment(mmu_space_t *space, int fd, const elf64_phdr_t *ph,
+                        uint64_t limit)
+{
+    uint64_t va, end, page, lo, hi;
+    uint32_t flags = MEM_USER;
+
+    if (ph->filesz > ph->memsz || ph->vaddr < MMU_USER_BASE ||
+        ph->memsz > limit - ph->vaddr || ph->vaddr >= limit) {
+        return -1;
+    }
+
+    if (ph->flags & ELF_PF_R) {
+        flags |= MEM_READ;
+    }
+    if (ph->flags & ELF_PF_W) {
+        flags |= MEM_WRITE;
+    }
+    if (ph->flags & ELF_PF_X) {
+        flags |= MEM_EXEC;
+    }
+
+    end = PAGE_ALIGN_UP(ph->vaddr + ph->memsz);
+    for (va = PAGE_ALIGN_DOWN(ph->vaddr); va < end; va += PAGE_SIZE) {
+        if (mmu_space_translate(space, va) != 0) {
+            return -1;                      /* Shared with another segment */
+        }
+
+        page = pmm_alloc_page();
+        if (page == 0) {
+            return -1;
+        }
+        memset((void *)page, 0, PAGE_SIZE);
+
+        /* The part of this page backed by the file */
+        lo = (va > ph->vaddr) ? va : ph->vaddr;
+        hi = ph->vaddr + ph->filesz;
+        if (hi > va + PAGE_SIZE) {
+            hi = va + PAGE_SIZE;
+        }
+        if (lo < hi && read_at(fd, ph->offset + (lo - ph->vaddr),
+                               (void *)(page + (lo - va)), hi - lo) != 0) {
+            pmm_free_page(page);
+            return -1;
+        }
+
+        if (flags & MEM_EXEC) {
+            mmu_sync_icache(page, PAGE_SIZE);
+        }
+
+        if (mmu_space_map(space, va, page, PAGE_SIZE, flags) != 0) {
+            pmm_free_page(page);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Load a static AArch64 executable into a user address space
+ */
+int elf_load(mmu_space_t *space, const char *path, uint64_t limit, uint64_t *entry)
+{
+    elf64_phdr_t ph[ELF_MAX_PHDRS];
+    elf64_ehdr_t eh;
+    bool loaded = false;
+    int fd, i;
+
+    if (space == NULL || path == NULL || entry == NULL) {
+        return -1;
+    }
+
+    fd = vfs_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        klog_warn("elf: cannot open %s", path);
+        return -1;
+    }
+
+    if (read_at(fd, 0, &eh, sizeof(eh)) != 0 || !header_ok(&eh)) {
+        klog_warn("elf: %s is not an AArch64 executable", path);
+        vfs_close(fd);
+        return -1;
+    }
+
+    if (read_at(fd, eh.phoff, ph, eh.phnum * sizeof(elf64_phdr_t)) != 0) {
+        klog_warn("elf: %s: cannot read program headers", path);
+        vfs_close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < eh.phnum; i++) {
+        if (ph[i].type != ELF_PT_LOAD || ph[i].memsz == 0) {
+            continue;
+        }
+        if (load_segment(space, fd, &ph[i], limit) != 0) {
+            klog_warn("elf: %s: cannot load segment at %p", path, (void *)ph[i].vaddr);
+            vfs_close(fd);
+            return -1;
+        }
+        loaded = true;
+    }
+
+    vfs_close(fd);
+
+    if (!loaded || mmu_space_translate(space, eh.entry) == 0) {
+        klog_warn("elf: %s: entry point %p is not mapped", path, (void *)eh.entry);
+        return -1;
+    }
+
+    *entry = eh.entry;
+    return 0;
+}
+
+/* ============================================================================
+ * End of elf.c
+ * ============================================================================ */
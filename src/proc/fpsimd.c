@@ -0,0 +1,122 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/proc/fpsimd.c
+ * Description: Lazy switching of user FP/SIMD state
+ * ============================================================================ */
+
+#include <aeos/fpsimd.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/smp.h>
+#include <aeos/softirq.h>
+#include <aeos/spinlock.h>
+#include <aeos/types.h>
+#include <asm/registers.h>
+
+/*
+ * The kernel leaves the FP/SIMD registers alone, so a user process's
+ * values stay in them through its exceptions and system calls. They are
+ * saved when the process is switched out and loaded again on the way back
+ * to EL0, unless this CPU's registers still hold them: the CPU's owner is
+ * the process and the process was last loaded on this CPU. Running only
+ * kernel processes in between costs no save or load.
+ *
+ * Kernel NEON code runs between kernel_neon_begin() and kernel_neon_end()
+ * with preemption disabled, so no switch sees its registers. It takes the
+ * registers from whoever owns them, saving them first if still live.
+ */
+
+static struct {
+    struct process *owner[MAX_CPUS];    /* Whose state the registers hold */
+} fpsimd;
+
+/**
+ * Check whether this CPU's registers hold a process's state
+ */
+static inline bool fpsimd_live(process_t *proc, uint32_t cpu)
+{
+    return fpsimd.owner[cpu] == proc && proc->fpsimd_cpu == cpu;
+}
+
+/**
+ * Save a process's registers as it is switched out
+ */
+void fpsimd_switch(process_t *from)
+{
+    if (from != NULL && fpsimd_live(from, smp_processor_id())) {
+        fpsimd_save_regs(&from->fpsimd);
+    }
+}
+
+/**
+ * Bring the current process's registers back before it returns to EL0
+ */
+void fpsimd_user_return(void)
+{
+    process_t *cur = process_current();
+    uint32_t cpu = smp_processor_id();
+
+    if (cur == NULL || fpsimd_live(cur, cpu)) {
+        return;
+    }
+
+    fpsimd_load_regs(&cur->fpsimd);
+    fpsimd.owner[cpu] = cur;
+    cur->fpsimd_cpu = cpu;
+}
+
+/**
+ * Write the current process's live registers back to its PCB
+ */
+void fpsimd_flush_current(void)
+{
+    process_t *cur = process_current();
+    uint64_t flags;
+
+    flags = irq_save();
+    if (cur != NULL && fpsimd_live(cur, smp_processor_id())) {
+        fpsimd_save_regs(&cur->fpsimd);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Check whether kernel code may use NEON here
+ */
+bool kernel_neon_usable(void)
+{
+    process_t *cur = process_current();
+    uint64_t daif;
+
+    __asm__ volatile("mrs %0, daif" : "=r"(daif));
+    return cur != NULL && cur->preempt_count == 0 &&
+           (daif & DAIF_IRQ_BIT) == 0 && !in_softirq();
+}
+
+/**
+ * Take the FP/SIMD registers for kernel NEON code
+ */
+void kernel_neon_begin(void)
+{
+    process_t *cur = process_current();
+    uint32_t cpu;
+
+    preempt_disable();
+    cpu = smp_processor_id();
+    if (cur != NULL && fpsimd_live(cur, cpu)) {
+        fpsimd_save_regs(&cur->fpsimd);
+    }
+    fpsimd.owner[cpu] = NULL;
+}
+
+/**
+ * Give the FP/SIMD registers back
+ */
+void kernel_neon_end(void)
+{
+    preempt_enable();
+}
+
+/* ============================================================================
+ * End of fpsimd.c
+ * ============================================================================ */
@@ -0,0 +1,138 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/proc/mutex.c
+ * Description: Sleeping mutexes
+ * ============================================================================ */
+
+#include <aeos/mutex.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/softirq.h>
+#include <aeos/spinlock.h>
+#include <aeos/types.h>
+
+/**
+ * Initialize a mutex (unlocked)
+ */
+void mutex_init(mutex_t *m)
+{
+    spin_lock_init(&m->lock);
+    m->locked = false;
+    m->owner = NULL;
+    m->head = NULL;
+    m->tail = NULL;
+    m->contended = 0;
+}
+
+/**
+ * Acquire a mutex, blocking while another process holds it
+ */
+void mutex_lock(mutex_t *m)
+{
+    process_t *self = process_current();
+    waiter_t w;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&m->lock);
+    if (!m->locked) {
+        m->locked = true;
+        m->owner = self;
+        spin_unlock_irqrestore(&m->lock, flags);
+        return;
+    }
+    m->contended++;
+
+    /* Nothing to block (early boot): wait for it to come free */
+    if (self == NULL || in_softirq()) {
+        while (m->locked) {
+            spin_unlock_irqrestore(&m->lock, flags);
+            __asm__ volatile("yield");
+            flags = spin_lock_irqsave(&m->lock);
+        }
+        m->locked = true;
+        m->owner = self;
+        spin_unlock_irqrestore(&m->lock, flags);
+        return;
+    }
+
+    w.proc = self;
+    w.next = NULL;
+    w.woken = false;
+    w.queued = true;
+    if (m->head == NULL) {
+        m->head = &w;
+    } else {
+        m->tail->next = &w;
+    }
+    m->tail = &w;
+
+    /*
+     * IRQs stay masked until blocked; mutex_unlock() makes us the owner.
+     * Any other scheduler_wake() (a stale timer wakeup) is not a handover,
+     * so block again until the flag says so.
+     */
+    spin_unlock(&m->lock);
+    while (!w.woken) {
+        scheduler_block_unless(&w.woken);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Acquire a mutex only if it is free
+ */
+bool mutex_trylock(mutex_t *m)
+{
+    uint64_t flags;
+    bool taken = false;
+
+    flags = spin_lock_irqsave(&m->lock);
+    if (!m->locked) {
+        m->locked = true;
+        m->owner = process_current();
+        taken = true;
+    }
+    spin_unlock_irqrestore(&m->lock, flags);
+    return taken;
+}
+
+/**
+ * Release a mutex, handing it to the oldest waiter
+ */
+void mutex_unlock(mutex_t *m)
+{
+    waiter_t *w;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&m->lock);
+    w = m->head;
+    if (w == NULL) {
+        m->locked = false;
+        m->owner = NULL;
+        spin_unlock_irqrestore(&m->lock, flags);
+        return;
+    }
+
+    /* Still locked: ownership passes straight to the waiter */
+    m->head = w->next;
+    if (m->head == NULL) {
+        m->tail = NULL;
+    }
+    m->owner = w->proc;
+    w->queued = false;
+    w->woken = true;
+    scheduler_wake(w->proc);
+    spin_unlock_irqrestore(&m->lock, flags);
+}
+
+/**
+ * Check whether a mutex is held (by anyone)
+ */
+bool mutex_is_locked(const mutex_t *m)
+{
+    return m->locked;
+}
+
+/* ============================================================================
+ * End of mutex.c
+ * ============================================================================ */
@@ -6,118 +6,465 @@
 
 #include <aeos/process.h>
 #include <aeos/scheduler.h>
-#include <aeos/heap.h>
+#include <aeos/fpsimd.h>
+#include <aeos/objpool.h>
+#include <aeos/arena.h>
 #include <aeos/kprintf.h>
+#include <aeos/string.h>
 #include <aeos/uart.h>
 #include <aeos/types.h>
 #include <aeos/vfs.h>
+#include <aeos/smp.h>
+#include <aeos/spinlock.h>
+#include <aeos/mmu.h>
+#include <aeos/pmm.h>
+#include <aeos/elf.h>
+#include <aeos/interrupts.h>
 
 /* Process ID counter */
 static uint64_t next_pid = 1;
+static spinlock_t pid_lock = SPINLOCK_INIT;
 
-/* Current running process */
-static process_t *current_process = NULL;
+/* PCBs, and kernel stacks as single pre-zeroed pages */
+static objpool_t process_pool = OBJPOOL_INIT("process", process_t, NULL);
+static objpool_t stack_pool = OBJPOOL_PAGES_INIT("process-stack", 0);
+
+_Static_assert(PROCESS_STACK_SIZE == PAGE_SIZE, "kernel stacks come from a page pool");
+
+/* PCBs and stacks made ready at boot */
+#define PROCESS_POOL_RESERVE    8
+
+/* Live processes, oldest first; zombies are taken off */
+static struct {
+    spinlock_t lock;
+    process_t *head;
+    process_t *tail;
+} proc_list = { .lock = SPINLOCK_INIT };
+
+/* Current running process, per CPU */
+static process_t *current_process[MAX_CPUS];
+
+/* First code run by every new process (context.asm) */
+extern void process_trampoline(void);
+
+/* Drop to EL0 at entry with the given stacks (context.asm) */
+extern void user_enter(uint64_t entry, uint64_t user_sp, uint64_t kernel_sp)
+    __attribute__((noreturn));
+
+/* Return to EL0 from an exception frame (vectors.asm) */
+extern void user_resume(cpu_context_t *frame) __attribute__((noreturn));
 
 /**
- * Create a new process
+ * Allocate a kernel stack of 2^order pages
+ * One page comes from the stack pool, larger ones straight from the PMM.
  */
-process_t *process_create(process_entry_t entry_point, const char *name)
+static void *stack_alloc(uint32_t order)
 {
-    process_t *proc;
-    uint64_t *stack_top;
+    if (order == 0) {
+        return objpool_alloc(&stack_pool);
+    }
+    return (void *)pmm_alloc_pages(order);
+}
 
-    kprintf("process_create: entry for '%s'\n", name ? name : "NULL");
+static void stack_free(void *base, size_t size)
+{
+    if (size == PROCESS_STACK_SIZE) {
+        objpool_free(&stack_pool, base);
+    } else {
+        pmm_free_pages((uint64_t)base, (uint32_t)__builtin_ctzll(size / PAGE_SIZE));
+    }
+}
+
+/**
+ * Allocate and initialize a process without making it runnable
+ */
+process_t *process_alloc(process_entry_t entry_point, const char *name)
+{
+    return process_alloc_stack(entry_point, name, 0);
+}
+
+/**
+ * Allocate a process with a kernel stack of 2^order pages
+ */
+process_t *process_alloc_stack(process_entry_t entry_point, const char *name,
+                               uint32_t order)
+{
+    process_t *proc, *parent;
+    uint64_t flags;
 
     if (entry_point == NULL) {
         klog_error("process_create: NULL entry point");
         return NULL;
     }
+    if (order > PROCESS_STACK_MAX_ORDER) {
+        klog_error("process_create: stack order %u too large", order);
+        return NULL;
+    }
 
     /* Allocate PCB */
-    kprintf("  Allocating PCB...\n");
-    proc = (process_t *)kmalloc(sizeof(process_t));
-    kprintf("  PCB allocated at %p\n", proc);
+    proc = (process_t *)objpool_alloc(&process_pool);
     if (proc == NULL) {
         klog_error("process_create: Failed to allocate PCB");
         return NULL;
     }
 
     /* Allocate stack */
-    kprintf("  Allocating stack...\n");
-    proc->stack_base = kmalloc(PROCESS_STACK_SIZE);
-    kprintf("  Stack allocated at %p\n", proc->stack_base);
+    proc->stack_base = stack_alloc(order);
     if (proc->stack_base == NULL) {
         klog_error("process_create: Failed to allocate stack");
-        kfree(proc);
+        objpool_free(&process_pool, proc);
         return NULL;
     }
 
     /* Create file descriptor table */
-    kprintf("  Creating file descriptor table...\n");
     proc->fd_table = vfs_fd_table_create();
     if (proc->fd_table == NULL) {
         klog_error("process_create: Failed to create fd table");
-        kfree(proc->stack_base);
-        kfree(proc);
+        stack_free(proc->stack_base, PROCESS_STACK_SIZE << order);
+        objpool_free(&process_pool, proc);
         return NULL;
     }
 
     /* Initialize PCB */
-    kprintf("  Initializing PCB fields: ");
-    kprintf("p"); proc->pid = next_pid++;
-    kprintf("s"); proc->state = PROCESS_READY;
-    kprintf("n"); proc->name = name;
-    kprintf("z"); proc->stack_size = PROCESS_STACK_SIZE;
-    kprintf("t"); proc->time_slice = 0;
-    kprintf("T"); proc->total_time = 0;
-    kprintf("N"); proc->next = NULL;
-    kprintf(" done\n");
+    flags = spin_lock_irqsave(&pid_lock);
+    proc->pid = next_pid++;
+    spin_unlock_irqrestore(&pid_lock, flags);
+
+    proc->state = PROCESS_READY;
+    proc->name = name;
+    proc->stack_size = PROCESS_STACK_SIZE << order;
+    proc->scratch = NULL;
+    proc->time_slice = 0;
+    proc->total_time = 0;
+    proc->next = NULL;
+    proc->cpu = 0;
+    proc->on_cpu = false;
+    proc->boosted = false;
+    memset(&proc->pmu, 0, sizeof(proc->pmu));
+    proc->mm = NULL;
+    proc->user_entry = 0;
+    proc->user_stack_top = 0;
+    proc->user_stack_limit = 0;
+    proc->user_name[0] = '\0';
+    proc->preempt_count = 0;
+    proc->fpsimd_cpu = FPSIMD_NO_CPU;
+    memset(&proc->fpsimd, 0, sizeof(proc->fpsimd));
+    proc->stdin_fd = -1;
+    proc->stdout_fd = -1;
+
+    /* Start in the creator's working directory, at its nice value */
+    parent = process_current();
+    if (parent != NULL) {
+        proc->cwd = parent->cwd;
+        strcpy(proc->cwd_path, parent->cwd_path);
+        proc->nice = parent->nice;
+    } else {
+        proc->cwd = NULL;
+        strcpy(proc->cwd_path, "/");
+        proc->nice = 0;
+    }
+    proc->prio = 0;
 
     /* Set up initial context */
     /* Stack grows downward, so SP points to top of stack */
-    kprintf("  Setting up context: ");
-    stack_top = (uint64_t *)((uint64_t)proc->stack_base + PROCESS_STACK_SIZE);
-
     /* Align stack to 16 bytes (ARM64 requirement) */
-    kprintf("S"); proc->sp = ((uint64_t)stack_top) & ~0xFULL;
+    proc->sp = ((uint64_t)proc->stack_base + proc->stack_size) & ~0xFULL;
 
-    /* Set up return address to entry point */
-    kprintf("L"); proc->x30 = (uint64_t)entry_point;
+    /* First switch returns into the trampoline, which calls x19 */
+    proc->x30 = (uint64_t)process_trampoline;
+    proc->x19 = (uint64_t)entry_point;
 
     /* Initialize frame pointer */
-    kprintf("F"); proc->x29 = proc->sp;
+    proc->x29 = proc->sp;
 
     /* Clear other callee-saved registers */
-    kprintf("R");
-    kprintf("a"); proc->x19 = 0;
-    kprintf("b"); proc->x20 = 0;
-    kprintf("c"); proc->x21 = 0;
-    kprintf("d"); proc->x22 = 0;
-    kprintf("e"); proc->x23 = 0;
-    kprintf("f"); proc->x24 = 0;
-    kprintf("g"); proc->x25 = 0;
-    kprintf("h"); proc->x26 = 0;
-    kprintf("i"); proc->x27 = 0;
-    kprintf("j"); proc->x28 = 0;
-    kprintf(" done\n");
-
-    /* Add to scheduler */
-    kprintf("  Adding to scheduler...\n");
+    proc->x20 = 0;
+    proc->x21 = 0;
+    proc->x22 = 0;
+    proc->x23 = 0;
+    proc->x24 = 0;
+    proc->x25 = 0;
+    proc->x26 = 0;
+    proc->x27 = 0;
+    proc->x28 = 0;
+
+    proc->all_next = NULL;
+    flags = spin_lock_irqsave(&proc_list.lock);
+    if (proc_list.head == NULL) {
+        proc_list.head = proc;
+    } else {
+        proc_list.tail->all_next = proc;
+    }
+    proc_list.tail = proc;
+    spin_unlock_irqrestore(&proc_list.lock, flags);
+
+    return proc;
+}
+
+/**
+ * Take a process off the list of live processes
+ */
+static void proc_list_remove(process_t *proc)
+{
+    process_t *cur, *prev = NULL;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&proc_list.lock);
+    for (cur = proc_list.head; cur != NULL; prev = cur, cur = cur->all_next) {
+        if (cur != proc) {
+            continue;
+        }
+        if (prev == NULL) {
+            proc_list.head = proc->all_next;
+        } else {
+            prev->all_next = proc->all_next;
+        }
+        if (proc_list.tail == proc) {
+            proc_list.tail = prev;
+        }
+        proc->all_next = NULL;
+        break;
+    }
+    spin_unlock_irqrestore(&proc_list.lock, flags);
+}
+
+/**
+ * Create a new process
+ */
+process_t *process_create(process_entry_t entry_point, const char *name)
+{
+    process_t *proc;
+
+    proc = process_alloc(entry_point, name);
+    if (proc == NULL) {
+        return NULL;
+    }
+
+    /* Add to scheduler (picks the least loaded CPU) */
     scheduler_add_process(proc);
-    kprintf("  Added to scheduler\n");
 
-    klog_debug("Created process PID=%u '%s' at %p, stack=%p",
-               (uint32_t)proc->pid, name, proc, proc->stack_base);
+    klog_debug("Created process PID=%u '%s' at %p, stack=%p, CPU %u",
+               (uint32_t)proc->pid, name, proc, proc->stack_base, proc->cpu);
 
     return proc;
 }
 
+/**
+ * Scratch arena of the current process
+ */
+arena_t *process_scratch(void)
+{
+    process_t *proc = process_current();
+
+    if (proc == NULL) {
+        return NULL;
+    }
+
+    if (proc->scratch == NULL) {
+        proc->scratch = arena_create(PROCESS_SCRATCH_ORDER);
+    }
+    return proc->scratch;
+}
+
+/**
+ * Return a process's kernel stack to the stack pool
+ */
+void process_release_stack(process_t *proc)
+{
+    if (proc == NULL || proc->stack_base == NULL) {
+        return;
+    }
+
+    stack_free(proc->stack_base, proc->stack_size);
+    proc->stack_base = NULL;
+    proc->stack_size = 0;
+}
+
+/**
+ * Kernel entry of a user process: leave for EL0 on an empty kernel stack
+ */
+static void user_start(void)
+{
+    process_t *proc = process_current();
+
+    user_enter(proc->user_entry, proc->user_stack_top,
+               ((uint64_t)proc->stack_base + proc->stack_size) & ~0xFULL);
+}
+
+/**
+ * Create a user process from an ELF executable
+ */
+process_t *process_create_user(const char *path)
+{
+    process_t *proc;
+    mmu_space_t *space;
+    const char *base;
+    uint64_t entry;
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    space = mmu_space_create();
+    if (space == NULL) {
+        klog_error("process_create_user: Failed to create address space");
+        return NULL;
+    }
+
+    /* Everything below the stack's guard page is the program's */
+    if (elf_load(space, path, MMU_USER_TOP - PROCESS_USER_STACK_SIZE - PAGE_SIZE,
+                 &entry) != 0) {
+        mmu_space_destroy(space);
+        return NULL;
+    }
+
+    proc = process_alloc(user_start, NULL);
+    if (proc == NULL) {
+        mmu_space_destroy(space);
+        return NULL;
+    }
+
+    base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    strncpy(proc->user_name, base, PROCESS_NAME_LEN - 1);
+    proc->user_name[PROCESS_NAME_LEN - 1] = '\0';
+    proc->name = proc->user_name;
+
+    proc->mm = space;
+    proc->user_entry = entry;
+    proc->user_stack_top = MMU_USER_TOP;
+    proc->user_stack_limit = MMU_USER_TOP - PROCESS_USER_STACK_SIZE;
+
+    scheduler_add_process(proc);
+
+    klog_debug("Created user process PID=%u '%s', entry=%p, CPU %u",
+               (uint32_t)proc->pid, proc->name, (void *)entry, proc->cpu);
+
+    return proc;
+}
+
+/**
+ * Exception frame a user process's last entry from EL0 saved
+ * EL0 exceptions start on an empty kernel stack, so it is the topmost.
+ */
+static cpu_context_t *user_frame(process_t *proc)
+{
+    uint64_t top = ((uint64_t)proc->stack_base + proc->stack_size) & ~0xFULL;
+
+    return (cpu_context_t *)(top - sizeof(cpu_context_t));
+}
+
+/**
+ * Kernel entry of a cloned process: resume at EL0 from the copied frame
+ */
+static void clone_start(void)
+{
+    user_resume(user_frame(process_current()));
+}
+
+/**
+ * Clone the current user process
+ */
+process_t *process_clone(void)
+{
+    process_t *parent = process_current();
+    process_t *proc;
+    mmu_space_t *space;
+    cpu_context_t *frame;
+
+    if (parent == NULL || parent->mm == NULL) {
+        return NULL;
+    }
+
+    space = mmu_space_clone(parent->mm);
+    if (space == NULL) {
+        return NULL;
+    }
+
+    proc = process_alloc(clone_start, NULL);
+    if (proc == NULL) {
+        mmu_space_destroy(space);
+        return NULL;
+    }
+
+    /* Share the parent's files instead of a table of its own */
+    vfs_fd_table_destroy(proc->fd_table);
+    proc->fd_table = vfs_fd_table_get(parent->fd_table);
+    proc->stdin_fd = parent->stdin_fd;
+    proc->stdout_fd = parent->stdout_fd;
+
+    memcpy(proc->user_name, parent->user_name, PROCESS_NAME_LEN);
+    proc->name = (parent->name == parent->user_name) ? proc->user_name : parent->name;
+    proc->mm = space;
+    proc->user_entry = parent->user_entry;
+    proc->user_stack_top = parent->user_stack_top;
+    proc->user_stack_limit = parent->user_stack_limit;
+
+    /* FP/SIMD registers as the parent has them now */
+    fpsimd_flush_current();
+    memcpy(&proc->fpsimd, &parent->fpsimd, sizeof(proc->fpsimd));
+
+    /* The parent's frame for this system call, returning 0 to the child;
+     * the trampoline and clone_start() run on the stack below it */
+    frame = user_frame(proc);
+    memcpy(frame, user_frame(parent), sizeof(*frame));
+    frame->x[0] = 0;
+    proc->sp = (uint64_t)frame;
+    proc->x29 = proc->sp;
+
+    scheduler_add_process(proc);
+
+    klog_debug("Cloned PID=%u '%s' as PID=%u, CPU %u", (uint32_t)parent->pid,
+               parent->name, (uint32_t)proc->pid, proc->cpu);
+
+    return proc;
+}
+
+/**
+ * Resolve a translation fault in the current process's user range
+ */
+int process_user_fault(uint64_t va, bool write)
+{
+    process_t *proc = process_current();
+    uint64_t page;
+
+    (void)write;
+
+    if (proc == NULL || proc->mm == NULL) {
+        return -1;
+    }
+
+    /* Demand-zero stack */
+    if (va >= proc->user_stack_limit && va < proc->user_stack_top) {
+        page = pmm_alloc_page();
+        if (page == 0) {
+            klog_error("PID %u '%s': out of memory growing the stack",
+                       (uint32_t)proc->pid, proc->name);
+            return -1;
+        }
+        memset((void *)page, 0, PAGE_SIZE);
+        if (mmu_space_map(proc->mm, va, page, PAGE_SIZE, MEM_USER_RW) != 0) {
+            pmm_free_page(page);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (va >= proc->user_stack_limit - PAGE_SIZE && va < proc->user_stack_limit) {
+        klog_error("PID %u '%s': stack overflow", (uint32_t)proc->pid, proc->name);
+    }
+
+    return -1;
+}
+
 /**
  * Exit current process
  */
 void process_exit(void)
 {
     process_t *proc = process_current();
+    mmu_space_t *space;
+    uint64_t flags;
 
     if (proc == NULL) {
         klog_fatal("process_exit: No current process - halting");
@@ -126,7 +473,7 @@ void process_exit(void)
         }
     }
 
-    klog_info("Process PID=%u '%s' exiting", (uint32_t)proc->pid, proc->name);
+    klog_debug("Process PID=%u '%s' exiting", (uint32_t)proc->pid, proc->name);
 
     /* Destroy file descriptor table (closes all open files) */
     if (proc->fd_table != NULL) {
@@ -134,7 +481,25 @@ void process_exit(void)
         proc->fd_table = NULL;
     }
 
+    /* Scratch arena back to the PMM */
+    if (proc->scratch != NULL) {
+        arena_destroy(proc->scratch);
+        proc->scratch = NULL;
+    }
+
+    /* Back on the kernel tables before the address space goes */
+    if (proc->mm != NULL) {
+        space = proc->mm;
+        flags = irq_save();
+        proc->mm = NULL;
+        mmu_switch_space(NULL);
+        irq_restore(flags);
+
+        mmu_space_destroy(space);
+    }
+
     /* Mark as zombie */
+    proc_list_remove(proc);
     proc->state = PROCESS_ZOMBIE;
 
     /* Remove from scheduler */
@@ -150,12 +515,47 @@ void process_exit(void)
     }
 }
 
+/**
+ * Free a process that was allocated but never made runnable
+ */
+void process_discard(process_t *proc)
+{
+    if (proc == NULL) {
+        return;
+    }
+
+    proc_list_remove(proc);
+    vfs_fd_table_destroy(proc->fd_table);
+    proc->fd_table = NULL;
+    process_release_stack(proc);
+    objpool_free(&process_pool, proc);
+}
+
+/**
+ * Free an exited process's PCB and kernel stack
+ */
+int process_reap(process_t *proc)
+{
+    if (proc == NULL || proc->state != PROCESS_ZOMBIE) {
+        return -1;
+    }
+
+    /* Still switching away on its stack */
+    if (__atomic_load_n(&proc->on_cpu, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    process_release_stack(proc);
+    objpool_free(&process_pool, proc);
+    return 0;
+}
+
 /**
  * Get current running process
  */
 process_t *process_current(void)
 {
-    return current_process;
+    return current_process[smp_processor_id()];
 }
 
 /**
@@ -163,7 +563,7 @@ process_t *process_current(void)
  */
 void process_set_current(process_t *proc)
 {
-    current_process = proc;
+    current_process[smp_processor_id()] = proc;
 }
 
 /**
@@ -171,10 +571,48 @@ void process_set_current(process_t *proc)
  */
 process_t *process_get_by_pid(uint64_t pid)
 {
-    /* TODO: Implement process table lookup */
-    /* For now, just return NULL */
-    (void)pid;
-    return NULL;
+    process_t *proc;
+    uint64_t flags;
+
+    /* Only zombies are reaped, after they left the list, and only by their
+     * creator: a live process found here stays valid after the unlock */
+    flags = spin_lock_irqsave(&proc_list.lock);
+    for (proc = proc_list.head; proc != NULL; proc = proc->all_next) {
+        if (proc->pid == pid) {
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&proc_list.lock, flags);
+
+    return proc;
+}
+
+/**
+ * List the live processes, oldest first
+ */
+uint32_t process_list(process_info_t *info, uint32_t max)
+{
+    process_t *proc;
+    uint64_t flags;
+    uint32_t n = 0;
+
+    flags = spin_lock_irqsave(&proc_list.lock);
+    for (proc = proc_list.head; proc != NULL; proc = proc->all_next) {
+        if (n < max) {
+            info[n].pid = proc->pid;
+            info[n].name = proc->name;
+            info[n].state = proc->state;
+            info[n].cpu = proc->cpu;
+            info[n].nice = proc->nice;
+            info[n].prio = proc->prio;
+            info[n].boosted = proc->boosted;
+            info[n].total_time = proc->total_time;
+        }
+        n++;
+    }
+    spin_unlock_irqrestore(&proc_list.lock, flags);
+
+    return n;
 }
 
 /**
@@ -182,10 +620,21 @@ process_t *process_get_by_pid(uint64_t pid)
  */
 void process_init(void)
 {
+    uint32_t i;
+
     klog_info("Initializing process subsystem...");
 
     /* Initialize current process to NULL */
-    current_process = NULL;
+    for (i = 0; i < MAX_CPUS; i++) {
+        current_process[i] = NULL;
+    }
+
+    /* Page faults in the user range */
+    mmu_set_user_fault_handler(process_user_fault);
+
+    /* Spawns pop a ready PCB and stack */
+    objpool_reserve(&process_pool, PROCESS_POOL_RESERVE);
+    objpool_reserve(&stack_pool, PROCESS_POOL_RESERVE);
 
     /* Scheduler will create idle process */
 
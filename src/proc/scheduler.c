@@ -1,145 +1,551 @@
 /* ============================================================================
  * AEOS - Abdalla's Educational Operating System
  * File: src/proc/scheduler.c
- * Description: Cooperative round-robin scheduler
+ * Description: Per-CPU multi-level priority scheduler
  * ============================================================================ */
 
 #include <aeos/scheduler.h>
 #include <aeos/process.h>
 #include <aeos/kprintf.h>
-#include <aeos/uart.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/gic.h>
+#include <aeos/interrupts.h>
+#include <aeos/timer.h>
+#include <aeos/pmu.h>
+#include <aeos/fpsimd.h>
+#include <aeos/trace.h>
+#include <aeos/softirq.h>
+#include <aeos/percpu.h>
+#include <aeos/mmu.h>
+#include <aeos/string.h>
 #include <aeos/types.h>
+#include <asm/registers.h>
 
-/* External context switch function (from context.asm) */
-extern void context_switch(process_t *from, process_t *to);
+/* External context switch function (from context.asm), returns prev */
+extern process_t *context_switch(process_t *from, process_t *to);
 
-/* Scheduler state */
-static struct {
+/* Bit of a run queue level in the bitmap: clz of the bitmap is the best level */
+#define PRIO_BIT(level)     (0x80000000U >> (level))
+
+/* Quanta in timer ticks, for nice 19 and nice -20 (nice 0: 10 ticks = 100ms) */
+#define SCHED_SLICE_MIN     2
+#define SCHED_SLICE_MAX     20
+
+/*
+ * Per-CPU run queue
+ *
+ * One FIFO per priority level, and a bitmap of the levels that have
+ * processes, so picking the next process is a clz and a pop whatever the
+ * number of processes. The owner pops from its queues. Other CPUs take
+ * the lock to enqueue work on it (process_create picks the least loaded
+ * CPU), and an idle CPU steals half of the busiest CPU's processes, the
+ * lowest priority ones first. A CPU always
+ * switches with its queue lock dropped but local IRQs still masked, so
+ * the timer tick cannot re-enter the switch.
+ *
+ * A process that was just requeued by yield() is still on its CPU until
+ * context_switch() has saved its registers. on_cpu covers that window:
+ * it is set when a process is picked and cleared by the next process
+ * (scheduler_finish_switch), and thieves skip processes that have it set.
+ */
+typedef struct {
+    spinlock_t lock;            /* Protects the fields below */
     process_t *current;         /* Currently running process */
     process_t *idle;            /* Idle process (runs when queue empty) */
-    process_t *ready_head;      /* Head of ready queue */
-    process_t *ready_tail;      /* Tail of ready queue */
+    struct {
+        process_t *head;
+        process_t *tail;
+    } queue[SCHED_PRIO_LEVELS]; /* Ready processes by level */
+    uint32_t bitmap;            /* PRIO_BIT() of each non-empty level */
+    uint32_t nr_ready;          /* Processes on the ready queues */
+    uint32_t nr_running;        /* Non-idle processes owned by this CPU */
+    volatile bool need_resched; /* Switch at the next IRQ exit */
+    bool online;                /* CPU has its idle process */
+} __attribute__((aligned(CACHE_LINE_SIZE))) runqueue_t;
+
+/* Scheduler state */
+static struct {
+    runqueue_t rq[MAX_CPUS];
+
+    /* Counters, off the run queue lines that other CPUs lock */
+    percpu_counter_t context_switches;
+    percpu_counter_t steals;    /* Successful steals, by the thief */
+    percpu_counter_t stolen;    /* Processes taken by those steals */
+    percpu_counter_t ipis;      /* Reschedule IPIs received */
+    percpu_counter_t preemptions; /* Switches made on IRQ exit */
+
+    spinlock_t lock;            /* Protects total_processes */
     uint64_t total_processes;
-    uint64_t running_processes;
-    uint64_t context_switches;
     bool initialized;
 } scheduler;
 
+/**
+ * Get the calling CPU's run queue
+ */
+static inline runqueue_t *this_rq(void)
+{
+    return &scheduler.rq[smp_processor_id()];
+}
+
+/**
+ * Time quantum for a nice value
+ */
+uint32_t scheduler_quantum(int32_t nice)
+{
+    return SCHED_SLICE_MIN + (uint32_t)(SCHED_NICE_MAX - nice) *
+           (SCHED_SLICE_MAX - SCHED_SLICE_MIN) / (SCHED_NICE_MAX - SCHED_NICE_MIN);
+}
+
+/**
+ * Run queue level a process runs at now: its nice value's, raised while
+ * it is boosted
+ */
+static uint32_t proc_level(const process_t *proc)
+{
+    uint32_t level = (uint32_t)(proc->nice - SCHED_NICE_MIN) * SCHED_PRIO_LEVELS /
+                     (SCHED_NICE_MAX - SCHED_NICE_MIN + 1);
+
+    if (proc->boosted) {
+        level = level > SCHED_WAKE_BOOST ? level - SCHED_WAKE_BOOST : 0;
+    }
+    return level;
+}
+
+/**
+ * Best level with a ready process (lock held)
+ * @return The level, SCHED_PRIO_LEVELS if nothing is ready
+ */
+static inline uint32_t rq_best_level(const runqueue_t *rq)
+{
+    return rq->bitmap ? (uint32_t)__builtin_clz(rq->bitmap) : SCHED_PRIO_LEVELS;
+}
+
+/**
+ * Append a process to the ready queue of its level (lock held)
+ */
+static void rq_enqueue(runqueue_t *rq, process_t *proc)
+{
+    uint32_t level = proc_level(proc);
+
+    proc->next = NULL;
+    proc->state = PROCESS_READY;
+    proc->prio = level;
+
+    if (rq->queue[level].head == NULL) {
+        rq->queue[level].head = proc;
+        rq->bitmap |= PRIO_BIT(level);
+    } else {
+        rq->queue[level].tail->next = proc;
+    }
+    rq->queue[level].tail = proc;
+    rq->nr_ready++;
+}
+
+/**
+ * Unlink a process from its level's ready queue (lock held)
+ * @param prev The process before it there, NULL if it is the head
+ */
+static void rq_unlink(runqueue_t *rq, process_t *proc, process_t *prev)
+{
+    uint32_t level = proc->prio;
+
+    if (prev == NULL) {
+        rq->queue[level].head = proc->next;
+    } else {
+        prev->next = proc->next;
+    }
+    if (rq->queue[level].tail == proc) {
+        rq->queue[level].tail = prev;
+    }
+    if (rq->queue[level].head == NULL) {
+        rq->bitmap &= ~PRIO_BIT(level);
+    }
+    proc->next = NULL;
+    rq->nr_ready--;
+}
+
+/**
+ * Pop the head of the best non-empty level (lock held)
+ */
+static process_t *rq_dequeue(runqueue_t *rq)
+{
+    process_t *proc;
+
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+
+    proc = rq->queue[rq_best_level(rq)].head;
+    rq_unlink(rq, proc, NULL);
+    return proc;
+}
+
+/**
+ * Unlink a process from a ready queue (lock held)
+ * @return true if it was queued
+ */
+static bool rq_remove(runqueue_t *rq, process_t *proc)
+{
+    process_t *current, *prev;
+
+    if (proc->prio >= SCHED_PRIO_LEVELS) {
+        return false;
+    }
+
+    prev = NULL;
+    for (current = rq->queue[proc->prio].head; current != NULL;
+         current = current->next) {
+        if (current == proc) {
+            rq_unlink(rq, proc, prev);
+            return true;
+        }
+        prev = current;
+    }
+
+    return false;
+}
+
+/**
+ * Pick the next process and requeue the current one (lock held)
+ *
+ * A preemption keeps the current process running while everything ready
+ * is at a lower priority; a voluntary yield() hands the CPU to whoever is
+ * ready, since the caller may be waiting on one of them.
+ */
+static process_t *pick_next(runqueue_t *rq, bool preempt)
+{
+    process_t *cur = rq->current;
+    process_t *next;
+    bool runnable;
+
+    runnable = cur != NULL && cur != rq->idle && cur->state == PROCESS_RUNNING;
+    if (preempt && runnable && proc_level(cur) < rq_best_level(rq)) {
+        return cur;
+    }
+
+    next = rq_dequeue(rq);
+    if (next == NULL) {
+        /* Nothing else ready: keep running, or go idle if we blocked/exited */
+        if (cur != NULL && cur->state == PROCESS_RUNNING) {
+            return cur;
+        }
+        return rq->idle;
+    }
+
+    /* Round-robin within a level: the current process goes to the back */
+    if (runnable) {
+        rq_enqueue(rq, cur);
+    }
+
+    return next;
+}
+
+/**
+ * Steal half of the busiest other CPU's ready processes
+ *
+ * Takes the lowest priority ones, which the owner would run last, and
+ * never nests the two queue locks: the victim is only trylocked, so two
+ * idle CPUs cannot deadlock and a thief never spins against a busy owner.
+ *
+ * @return Number of processes moved to this CPU
+ */
+static uint32_t steal_work(uint32_t self)
+{
+    runqueue_t *rq = &scheduler.rq[self];
+    runqueue_t *victim = NULL;
+    process_t *stolen_head = NULL, *stolen_tail = NULL;
+    process_t *proc, *prev, *next;
+    uint32_t max_ready = 0;
+    uint32_t want, count = 0;
+    uint32_t i, level;
+    uint64_t flags;
+
+    /* Busiest queue; unlocked reads only choose the victim */
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (i != self && scheduler.rq[i].online &&
+            scheduler.rq[i].nr_ready > max_ready) {
+            max_ready = scheduler.rq[i].nr_ready;
+            victim = &scheduler.rq[i];
+        }
+    }
+
+    if (victim == NULL) {
+        return 0;
+    }
+
+    flags = irq_save();
+    if (!spin_trylock(&victim->lock)) {
+        irq_restore(flags);
+        return 0;
+    }
+
+    /* Leave the best half (rounded down) for the owner */
+    want = victim->nr_ready - victim->nr_ready / 2;
+    for (level = SCHED_PRIO_LEVELS; level-- > 0 && count < want;) {
+        prev = NULL;
+        for (proc = victim->queue[level].head; proc != NULL && count < want;
+             proc = next) {
+            next = proc->next;
+
+            if (proc->on_cpu) {
+                prev = proc;
+                continue;
+            }
+
+            rq_unlink(victim, proc, prev);
+            victim->nr_running--;
+
+            /* Keep queue order on the thief */
+            if (stolen_head == NULL) {
+                stolen_head = proc;
+            } else {
+                stolen_tail->next = proc;
+            }
+            stolen_tail = proc;
+            count++;
+        }
+    }
+
+    spin_unlock(&victim->lock);
+
+    if (count > 0) {
+        spin_lock(&rq->lock);
+        for (proc = stolen_head; proc != NULL; proc = next) {
+            next = proc->next;
+            proc->cpu = self;
+            rq_enqueue(rq, proc);
+            rq->nr_running++;
+        }
+        percpu_counter_inc(&scheduler.steals);
+        percpu_counter_add(&scheduler.stolen, count);
+        spin_unlock(&rq->lock);
+    }
+
+    irq_restore(flags);
+    return count;
+}
+
+/**
+ * Check whether a ready process should preempt the running one (lock not
+ * needed: a stale read only delays the switch to the next tick)
+ */
+static bool rq_should_preempt(const runqueue_t *rq)
+{
+    process_t *cur = rq->current;
+
+    if (rq->bitmap == 0 || cur == NULL) {
+        return false;
+    }
+    return cur == rq->idle || rq_best_level(rq) < proc_level(cur);
+}
+
+/**
+ * Reschedule IPI - work was queued on this CPU
+ * Switch away from idle, or to a higher priority process, on the way out
+ * of the interrupt.
+ */
+static void resched_ipi_handler(void)
+{
+    runqueue_t *rq = this_rq();
+
+    percpu_counter_inc(&scheduler.ipis);
+    if (rq_should_preempt(rq)) {
+        rq->need_resched = true;
+    }
+}
+
+/**
+ * Wake one idle CPU other than self so it can steal queued work
+ * Idle CPUs are tickless and no longer poll for work on their own.
+ */
+static void kick_idle_cpu(uint32_t self)
+{
+    uint32_t i;
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        if (i != self && scheduler.rq[i].online &&
+            scheduler.rq[i].current == scheduler.rq[i].idle) {
+            gic_send_sgi(SGI_RESCHEDULE, i);
+            return;
+        }
+    }
+}
+
 /**
  * Idle process - runs when no other process is ready
  */
 static void idle_process(void)
 {
-    klog_info("Idle process started");
+    runqueue_t *rq = this_rq();
+    uint64_t flags;
 
     while (1) {
-        /* Just wait for interrupts (low power) */
-        __asm__ volatile("wfi");
-
-        /* Since we don't have timer interrupts yet,
-         * we'll just yield periodically
+        /*
+         * Check for work with IRQs masked so a reschedule IPI between the
+         * check and wfi is not lost: wfi still wakes on a pending IRQ.
+         * The periodic tick is stopped meanwhile; the timer only fires
+         * for this CPU's next queued event.
          */
+        flags = irq_save();
+
+        /* Tasklets queued outside an interrupt, or left over by one */
+        softirq_run();
+        if (rq->bitmap == 0 && !softirq_pending() &&
+            steal_work(smp_processor_id()) == 0) {
+            timer_idle_enter();
+            __asm__ volatile("wfi");
+            timer_idle_exit();
+        }
+        irq_restore(flags);
+
         yield();
     }
 }
 
 /**
- * Initialize the scheduler
+ * Initialize the scheduler on the boot CPU
  */
 void scheduler_init(void)
 {
+    runqueue_t *rq;
+    process_t *kernel;
+    uint32_t i;
+
     klog_info("Initializing scheduler...");
-    kprintf("Step 1\n");
 
     /* Clear scheduler state */
-    scheduler.current = NULL;
-    scheduler.idle = NULL;
-    scheduler.ready_head = NULL;
-    scheduler.ready_tail = NULL;
+    for (i = 0; i < MAX_CPUS; i++) {
+        rq = &scheduler.rq[i];
+        spin_lock_init(&rq->lock);
+        rq->current = NULL;
+        rq->idle = NULL;
+        memset(rq->queue, 0, sizeof(rq->queue));
+        rq->bitmap = 0;
+        rq->nr_ready = 0;
+        rq->nr_running = 0;
+        rq->need_resched = false;
+        rq->online = false;
+    }
+    spin_lock_init(&scheduler.lock);
     scheduler.total_processes = 0;
-    scheduler.running_processes = 0;
-    scheduler.context_switches = 0;
     scheduler.initialized = false;  /* Set to false until fully initialized */
 
-    kprintf("Step 2\n");
-    /* Create idle process - this will add it to the ready queue */
-    process_t *idle = process_create(idle_process, "idle");
-    kprintf("Step 3\n");
+    /* SGIs are banked per CPU; each CPU enables it in scheduler_init_cpu() */
+    irq_register_handler(SGI_RESCHEDULE, resched_ipi_handler);
+
+    scheduler_init_cpu(0);
+
+    /*
+     * The boot context (kernel_main, then the shell or GUI) becomes a
+     * regular process on CPU 0, so it round-robins with anything else
+     * placed there instead of only running when CPU 0 is idle.
+     */
+    kernel = process_alloc(idle_process, "kernel");
+    if (kernel == NULL) {
+        klog_fatal("Failed to create kernel process");
+        while (1) {
+            __asm__ volatile("wfi");
+        }
+    }
+
+    /* It keeps running on the boot stack */
+    process_release_stack(kernel);
+
+    rq = &scheduler.rq[0];
+    kernel->cpu = 0;
+    kernel->state = PROCESS_RUNNING;
+    kernel->on_cpu = true;
+    kernel->time_slice = scheduler_quantum(kernel->nice);
+    kernel->prio = proc_level(kernel);
+    rq->current = kernel;
+    rq->nr_running = 1;
+    process_set_current(kernel);
+    scheduler.total_processes = 1;
+
+    /* Now we're initialized */
+    scheduler.initialized = true;
+
+    klog_info("Scheduler initialized (kernel PID=%u, idle PID=%u)",
+              (uint32_t)kernel->pid, (uint32_t)rq->idle->pid);
+}
+
+/**
+ * Create the calling CPU's idle process and bring its run queue online
+ */
+void scheduler_init_cpu(uint32_t cpu)
+{
+    runqueue_t *rq = &scheduler.rq[cpu];
+    process_t *idle;
+
+    /* Idle never sits on a ready queue, so don't use process_create() */
+    idle = process_alloc(idle_process, "idle");
     if (idle == NULL) {
-        klog_fatal("Failed to create idle process");
+        klog_fatal("Failed to create idle process for CPU %u", cpu);
         while (1) {
             __asm__ volatile("wfi");
         }
     }
 
-    kprintf("Step 4\n");
-    /* Remove idle from ready queue since it's a special process
-     * It will only run when no other processes are ready
-     */
-    scheduler_remove_process(idle);
+    idle->cpu = cpu;
+    idle->prio = SCHED_PRIO_LEVELS;     /* Below every level, never queued */
 
-    kprintf("Step 5\n");
-    /* Store idle process reference */
-    scheduler.idle = idle;
+    /* Let other CPUs wake us out of wfi */
+    gic_enable_irq(SGI_RESCHEDULE);
 
-    /* Set idle as initial current process */
-    scheduler.current = idle;
-    idle->state = PROCESS_RUNNING;
+    /* Not running yet: scheduler_start() or the first switch picks it */
+    rq->idle = idle;
+    rq->current = idle;
     process_set_current(idle);
 
-    kprintf("Step 6\n");
-    /* Now we're initialized */
-    scheduler.initialized = true;
+    __asm__ volatile("dmb ish" ::: "memory");
+    rq->online = true;
 
-    klog_info("Scheduler initialized (idle process PID=%u)", (uint32_t)idle->pid);
+    klog_debug("CPU %u run queue online (idle PID=%u)", cpu, (uint32_t)idle->pid);
 }
 
 /**
- * Add a process to the ready queue
+ * Add a process to the least loaded CPU's ready queue
  */
 void scheduler_add_process(process_t *proc)
 {
-    kprintf("    scheduler_add_process: entry\n");
+    runqueue_t *rq;
+    uint32_t best = 0;
+    uint32_t i;
+    uint64_t flags;
+    bool idle;
 
     if (proc == NULL) {
-        kprintf("    NULL process, returning\n");
         return;
     }
 
-    kprintf("    Adding PID=%u '%s'\n", (uint32_t)proc->pid, proc->name);
+    /* Loads are sampled without locks; a stale read only affects balance */
+    for (i = 1; i < MAX_CPUS; i++) {
+        if (scheduler.rq[i].online &&
+            scheduler.rq[i].nr_running < scheduler.rq[best].nr_running) {
+            best = i;
+        }
+    }
 
-    /* Add to tail of ready queue (circular list) */
-    kprintf("    Setting next: ");
-    proc->next = NULL;
-    kprintf("N ");
-
-    if (scheduler.ready_head == NULL) {
-        /* First process in queue */
-        kprintf("(first)");
-        scheduler.ready_head = proc;
-        kprintf("H");
-        scheduler.ready_tail = proc;
-        kprintf("T");
-    } else {
-        /* Add to tail */
-        kprintf("(tail)");
-        scheduler.ready_tail->next = proc;
-        kprintf("L");
-        scheduler.ready_tail = proc;
-        kprintf("T");
+    rq = &scheduler.rq[best];
+    flags = spin_lock_irqsave(&rq->lock);
+    proc->cpu = best;
+    rq_enqueue(rq, proc);
+    rq->nr_running++;
+    idle = (rq->current == rq->idle);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    /* An idle CPU sleeps in wfi until its next tick: wake it now */
+    if (idle && best != smp_processor_id()) {
+        gic_send_sgi(SGI_RESCHEDULE, best);
     }
-    kprintf("\n");
 
-    kprintf("    Setting state & counters: ");
-    proc->state = PROCESS_READY;
-    kprintf("S");
+    flags = spin_lock_irqsave(&scheduler.lock);
     scheduler.total_processes++;
-    kprintf("t");
-    scheduler.running_processes++;
-    kprintf("r\n");
+    spin_unlock_irqrestore(&scheduler.lock, flags);
 
-    klog_debug("Added process PID=%u '%s' to ready queue",
-               (uint32_t)proc->pid, proc->name);
+    klog_debug("Added process PID=%u '%s' to CPU %u ready queue",
+               (uint32_t)proc->pid, proc->name, best);
 }
 
 /**
@@ -147,219 +553,449 @@ void scheduler_add_process(process_t *proc)
  */
 void scheduler_remove_process(process_t *proc)
 {
-    process_t *current, *prev;
+    runqueue_t *rq;
+    uint64_t flags;
 
-    if (proc == NULL || scheduler.ready_head == NULL) {
+    if (proc == NULL || proc->cpu >= MAX_CPUS) {
         return;
     }
 
-    /* Find and remove from ready queue */
-    prev = NULL;
-    for (current = scheduler.ready_head; current != NULL; current = current->next) {
-        if (current == proc) {
-            /* Found it */
-            if (prev == NULL) {
-                /* Removing head */
-                scheduler.ready_head = current->next;
-                if (scheduler.ready_head == NULL) {
-                    scheduler.ready_tail = NULL;
-                }
-            } else {
-                /* Removing middle or tail */
-                prev->next = current->next;
-                if (current == scheduler.ready_tail) {
-                    scheduler.ready_tail = prev;
-                }
-            }
-
-            current->next = NULL;
-            scheduler.running_processes--;
+    rq = &scheduler.rq[proc->cpu];
+    flags = spin_lock_irqsave(&rq->lock);
 
-            klog_debug("Removed process PID=%u '%s' from scheduler",
-                       (uint32_t)proc->pid, proc->name);
-            return;
+    /* Either waiting on the queue or the caller itself (process_exit) */
+    if (rq_remove(rq, proc) || proc == rq->current) {
+        if (proc != rq->idle && rq->nr_running > 0) {
+            rq->nr_running--;
         }
-        prev = current;
+
+        klog_debug("Removed process PID=%u '%s' from scheduler",
+                   (uint32_t)proc->pid, proc->name);
     }
+
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 /**
- * Select the next process to run (round-robin)
+ * Change a process's nice value
  */
-process_t *schedule(void)
+int scheduler_set_nice(process_t *proc, int32_t nice)
 {
-    process_t *next;
+    runqueue_t *rq;
+    uint32_t quantum;
+    uint64_t flags;
 
-    if (scheduler.ready_head == NULL) {
-        /* No ready processes, return idle process */
-        klog_debug("schedule: ready queue empty, returning idle process");
-        return scheduler.idle;
+    if (proc == NULL || proc->cpu >= MAX_CPUS ||
+        nice < SCHED_NICE_MIN || nice > SCHED_NICE_MAX) {
+        return -1;
     }
 
-    /* Simple round-robin: take first process from ready queue */
-    next = scheduler.ready_head;
-
-    /* If current process is still ready, add it to back of queue */
-    if (scheduler.current != NULL &&
-        scheduler.current->state == PROCESS_RUNNING) {
-
-        scheduler.current->state = PROCESS_READY;
+    rq = &scheduler.rq[proc->cpu];
+    if (proc == rq->idle) {
+        return -1;
+    }
 
-        /* Remove from wherever it is and add to tail */
-        scheduler_remove_process(scheduler.current);
-        scheduler_add_process(scheduler.current);
+    flags = spin_lock_irqsave(&rq->lock);
+    if (proc->state == PROCESS_READY && rq_remove(rq, proc)) {
+        /* Waiting: move it to the queue of its new level */
+        proc->nice = nice;
+        rq_enqueue(rq, proc);
+    } else {
+        /* Running or blocked; one being stolen keeps the level it is queued
+         * at until it next waits */
+        proc->nice = nice;
+        if (proc->state != PROCESS_READY) {
+            proc->prio = proc_level(proc);
+        }
     }
 
-    /* Remove next process from ready queue */
-    scheduler.ready_head = next->next;
-    if (scheduler.ready_head == NULL) {
-        scheduler.ready_tail = NULL;
+    /* A shorter quantum applies now, a longer one from the next */
+    quantum = scheduler_quantum(nice);
+    if (proc->time_slice > quantum) {
+        proc->time_slice = quantum;
     }
-    next->next = NULL;
+    if (rq_should_preempt(rq) && proc->cpu == smp_processor_id()) {
+        rq->need_resched = true;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    return 0;
+}
+
+/**
+ * Select the next process to run on this CPU (round-robin)
+ */
+process_t *schedule(void)
+{
+    runqueue_t *rq = this_rq();
+    process_t *next;
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&rq->lock);
+    next = pick_next(rq, false);
+    spin_unlock_irqrestore(&rq->lock, flags);
 
     return next;
 }
 
 /**
- * Yield CPU to next process (cooperative multitasking)
+ * Switch to the next process
+ * @param preempt Called on IRQ exit rather than by the process itself
  */
-void yield(void)
+static void switch_next(bool preempt)
 {
+    runqueue_t *rq;
     process_t *from, *to;
+    uint64_t flags;
 
     if (!scheduler.initialized) {
         klog_error("yield: Scheduler not initialized");
         return;
     }
 
-    /* Get next process */
-    to = schedule();
-
-    if (to == NULL) {
-        klog_error("yield: No process to schedule!");
+    /* IRQs stay masked until we are switched back to */
+    flags = irq_save();
+    rq = this_rq();
+    if (!rq->online) {
+        irq_restore(flags);
         return;
     }
 
-    from = scheduler.current;
+    spin_lock(&rq->lock);
+
+    from = rq->current;
+    to = pick_next(rq, preempt);
 
     /* If switching to same process, nothing to do */
-    if (from == to) {
+    if (to == NULL || from == to) {
+        spin_unlock_irqrestore(&rq->lock, flags);
         return;
     }
 
+    to->on_cpu = true;
+
     /* Update states */
-    if (from != NULL) {
-        if (from->state == PROCESS_RUNNING) {
-            from->state = PROCESS_READY;
-        }
+    if (from->state == PROCESS_RUNNING) {
+        from->state = PROCESS_READY;
     }
 
     to->state = PROCESS_RUNNING;
-    scheduler.current = to;
+    if (to->time_slice == 0) {
+        to->time_slice = scheduler_quantum(to->nice);
+    }
+    rq->current = to;
     process_set_current(to);
 
     /* Update statistics */
-    scheduler.context_switches++;
+    percpu_counter_inc(&scheduler.context_switches);
+
+    spin_unlock(&rq->lock);
+
+    /* Kernel mappings are in every space: only user processes change TTBR0 */
+    if (to->mm != from->mm) {
+        mmu_switch_space(to->mm);
+    }
 
-    klog_debug("Context switch: %s (PID %u) -> %s (PID %u)",
-               from ? from->name : "NULL", from ? (uint32_t)from->pid : 0,
-               to->name, (uint32_t)to->pid);
+    /* Charge the PMU counts so far to the process being switched out,
+     * and keep its FP/SIMD registers if they are still live */
+    pmu_switch(&from->pmu);
+    fpsimd_switch(from);
+    TRACEPOINT(SCHED_SWITCH, from->pid, to->pid);
 
     /* Perform actual context switch */
-    if (from != NULL) {
-        context_switch(from, to);
-    } else {
-        /* First time scheduling, just jump to new process */
-        /* This is tricky - we need to manually set up the context */
-        __asm__ volatile(
-            "mov sp, %0\n"
-            "mov x30, %1\n"
-            "ret\n"
-            :
-            : "r"(to->sp), "r"(to->x30)
-            : "memory"
-        );
+    from = context_switch(from, to);
+
+    /* Back on this stack: release whoever ran before us */
+    scheduler_finish_switch(from);
+
+    irq_restore(flags);
+}
+
+/**
+ * Yield CPU to next process (cooperative multitasking)
+ */
+void yield(void)
+{
+    switch_next(false);
+}
+
+/**
+ * Block the current process until scheduler_wake()
+ */
+void scheduler_block(void)
+{
+    scheduler_block_unless(NULL);
+}
+
+/**
+ * Block the current process unless *cond is already set
+ */
+void scheduler_block_unless(const volatile bool *cond)
+{
+    runqueue_t *rq;
+    process_t *cur;
+    uint64_t flags;
+
+    if (!scheduler.initialized) {
+        return;
+    }
+
+    flags = irq_save();
+    rq = this_rq();
+    spin_lock(&rq->lock);
+    cur = rq->current;
+    if (cur == NULL || cur == rq->idle || (cond != NULL && *cond)) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+
+    /* Off the queue and out of the load count until woken */
+    cur->state = PROCESS_BLOCKED;
+    if (rq->nr_running > 0) {
+        rq->nr_running--;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    /* pick_next() doesn't requeue a blocked process */
+    yield();
+}
+
+/**
+ * Make a blocked process runnable again
+ */
+void scheduler_wake(process_t *proc)
+{
+    runqueue_t *rq;
+    uint32_t cpu, self;
+    uint64_t flags;
+    bool idle, busy, preempt;
+
+    if (proc == NULL || proc->cpu >= MAX_CPUS) {
+        return;
+    }
+
+    cpu = proc->cpu;
+    rq = &scheduler.rq[cpu];
+    flags = spin_lock_irqsave(&rq->lock);
+
+    if (proc->state != PROCESS_BLOCKED) {
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+
+    rq->nr_running++;
+    if (proc == rq->current) {
+        /* Hasn't switched away yet: its yield() becomes a no-op */
+        proc->state = PROCESS_RUNNING;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+
+    /* It gave the CPU up before its quantum ran out: run it ahead of the
+     * processes that didn't, until it has used up a quantum */
+    proc->boosted = true;
+    rq_enqueue(rq, proc);
+    idle = (rq->current == rq->idle);
+    preempt = rq_should_preempt(rq);
+    busy = !idle && rq->nr_ready > 1;
+    if (preempt && cpu == smp_processor_id()) {
+        rq->need_resched = true;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    self = smp_processor_id();
+    if (preempt && cpu != self) {
+        gic_send_sgi(SGI_RESCHEDULE, cpu);
+    } else if (busy) {
+        /* Queue is backing up: let an idle CPU steal from it */
+        kick_idle_cpu(cpu);
+    }
+}
+
+/**
+ * Complete a context switch in the process switched to
+ * Called by yield() and process_trampoline with the previous process.
+ */
+void scheduler_finish_switch(process_t *prev)
+{
+    if (prev != NULL) {
+        /* Its registers are saved: it may now run elsewhere */
+        __asm__ volatile("dmb ish" ::: "memory");
+        prev->on_cpu = false;
     }
 }
 
 /**
  * Timer tick handler for preemptive scheduling
- * Called from timer IRQ to manage time slices
+ * Called from timer IRQ to manage time slices. Only requests the switch:
+ * scheduler_irq_exit() performs it once the handler has sent the EOI.
  */
 void scheduler_tick(void)
 {
+    runqueue_t *rq;
+    process_t *cur;
+
     /* Don't do anything if scheduler not ready */
-    if (!scheduler.initialized || scheduler.current == NULL) {
+    if (!scheduler.initialized) {
+        return;
+    }
+
+    rq = this_rq();
+    cur = rq->current;
+    if (!rq->online || cur == NULL) {
         return;
     }
 
     /* Decrement time slice of current process */
-    if (scheduler.current->time_slice > 0) {
-        scheduler.current->time_slice--;
+    if (cur->time_slice > 0) {
+        cur->time_slice--;
     }
 
-    /* Track total CPU time */
-    scheduler.current->total_time++;
+    /* Track total CPU time (an idle CPU steals in its loop, not here) */
+    cur->total_time++;
 
-    /* If time slice expired and there are other ready processes, preempt */
-    if (scheduler.current->time_slice == 0 && scheduler.ready_head != NULL) {
-        /* Reset time slice for next run */
-        scheduler.current->time_slice = 10;  /* 10 ticks = 100ms quantum */
+    /* Quantum used up: back to its own level, behind its equals there */
+    if (cur->time_slice == 0 && cur != rq->idle) {
+        cur->time_slice = scheduler_quantum(cur->nice);
+        cur->boosted = false;
+        if (rq->bitmap != 0 && rq_best_level(rq) <= proc_level(cur)) {
+            rq->need_resched = true;
+        }
+    }
 
-        /* Trigger context switch */
-        yield();
+    /* Idle, or a higher priority process is waiting */
+    if (rq_should_preempt(rq)) {
+        rq->need_resched = true;
     }
 }
 
 /**
- * Start the scheduler (first context switch)
+ * Switch processes on the way out of an IRQ, if one was requested
  */
-void scheduler_start(void)
+void scheduler_irq_exit(void)
 {
-    process_t *first;
+    runqueue_t *rq;
 
     if (!scheduler.initialized) {
-        klog_fatal("scheduler_start: Not initialized");
-        while (1) {
-            __asm__ volatile("wfi");
-        }
+        return;
     }
 
-    if (scheduler.ready_head == NULL) {
-        klog_fatal("scheduler_start: No processes to run!");
+    /* Interrupted a tasklet: the exit below it switches once it is done.
+     * With preemption disabled, preempt_enable() switches instead. */
+    rq = this_rq();
+    if (!rq->need_resched || in_softirq() ||
+        (rq->current != NULL && rq->current->preempt_count > 0)) {
+        return;
+    }
+
+    rq->need_resched = false;
+    percpu_counter_inc(&scheduler.preemptions);
+
+    /* IRQs are masked here; the eret after we're switched back unmasks */
+    switch_next(true);
+}
+
+/**
+ * Keep the current process on this CPU until preempt_enable()
+ */
+void preempt_disable(void)
+{
+    process_t *cur = process_current();
+
+    if (cur != NULL) {
+        cur->preempt_count++;
+        __asm__ volatile("" ::: "memory");
+    }
+}
+
+/**
+ * Undo preempt_disable(), switching now if a reschedule was put off
+ */
+void preempt_enable(void)
+{
+    process_t *cur = process_current();
+    runqueue_t *rq;
+    uint64_t flags;
+
+    if (cur == NULL || cur->preempt_count == 0) {
+        return;
+    }
+    __asm__ volatile("" ::: "memory");
+    if (--cur->preempt_count > 0 || !scheduler.initialized) {
+        return;
+    }
+
+    /* Only from plain process context: a handler's own exit switches */
+    flags = irq_save();
+    rq = this_rq();
+    if (rq->need_resched && !(flags & DAIF_IRQ_BIT) && !in_softirq()) {
+        rq->need_resched = false;
+        percpu_counter_inc(&scheduler.preemptions);
+        switch_next(true);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Start scheduling on the calling CPU (first context switch)
+ */
+void scheduler_start(void)
+{
+    runqueue_t *rq;
+    process_t *first;
+
+    rq = this_rq();
+    if (!scheduler.initialized || !rq->online) {
+        klog_fatal("scheduler_start: Not initialized");
         while (1) {
             __asm__ volatile("wfi");
         }
     }
 
-    klog_info("Starting scheduler...");
+    /* The trampoline of the first process unmasks IRQs again */
+    irq_save();
+    spin_lock(&rq->lock);
 
-    /* Get first process from ready queue */
-    first = scheduler.ready_head;
-    scheduler.ready_head = first->next;
-    if (scheduler.ready_head == NULL) {
-        scheduler.ready_tail = NULL;
+    /* First ready process, or this CPU's idle process */
+    first = rq_dequeue(rq);
+    if (first == NULL) {
+        first = rq->idle;
     }
-    first->next = NULL;
 
     /* Set it as current and mark running */
+    rq->idle->state = PROCESS_READY;
     first->state = PROCESS_RUNNING;
-    scheduler.current = first;
+    first->on_cpu = true;
+    if (first->time_slice == 0) {
+        first->time_slice = scheduler_quantum(first->nice);
+    }
+    rq->current = first;
     process_set_current(first);
-    scheduler.context_switches++;
+    percpu_counter_inc(&scheduler.context_switches);
+
+    spin_unlock(&rq->lock);
+
+    if (first->mm != NULL) {
+        mmu_switch_space(first->mm);
+    }
+
+    /* Nothing before this point belongs to any process */
+    pmu_switch(NULL);
 
-    klog_info("Starting first process: %s (PID %u)", first->name, (uint32_t)first->pid);
+    klog_debug("CPU %u starting %s (PID %u)", first->cpu, first->name,
+               (uint32_t)first->pid);
 
     /* Jump to first process (never returns) */
-    /* Use simple BR - SVC will set ELR_EL1 automatically when it traps */
     __asm__ volatile(
         "msr spsel, #1\n"       /* Select SP_EL1 for exception handling */
         "mov sp, %0\n"          /* Set stack pointer to process stack */
         "mov x29, %1\n"         /* Set frame pointer */
-        "br %2\n"               /* Branch to entry point */
+        "mov x19, %2\n"         /* Entry point for the trampoline */
+        "mov x0, xzr\n"         /* No previous process */
+        "br %3\n"               /* Branch to process_trampoline */
         :
-        : "r"(first->sp), "r"(first->x29), "r"(first->x30)
-        : "memory"
+        : "r"(first->sp), "r"(first->x29), "r"(first->x19), "r"(first->x30)
+        : "x0", "x19", "x29", "memory"
     );
 
     /* Should never return */
@@ -374,21 +1010,37 @@ void scheduler_start(void)
  */
 void scheduler_get_stats(scheduler_stats_t *stats)
 {
-    kprintf("  scheduler_get_stats: entry\n");
+    uint32_t i;
 
     if (stats == NULL) {
-        kprintf("  scheduler_get_stats: NULL stats, returning\n");
         return;
     }
 
-    kprintf("  scheduler_get_stats: copying stats: ");
-    kprintf("t");
     stats->total_processes = scheduler.total_processes;
-    kprintf("r");
-    stats->running_processes = scheduler.running_processes;
-    kprintf("c");
-    stats->context_switches = scheduler.context_switches;
-    kprintf(" done\n");
+    stats->running_processes = 0;
+    stats->context_switches = percpu_counter_read(&scheduler.context_switches);
+    stats->steals = percpu_counter_read(&scheduler.steals);
+    stats->stolen = percpu_counter_read(&scheduler.stolen);
+    stats->online_cpus = 0;
+
+    for (i = 0; i < MAX_CPUS; i++) {
+        runqueue_t *rq = &scheduler.rq[i];
+
+        stats->cpus[i].online = rq->online;
+        stats->cpus[i].nr_running = rq->online ? rq->nr_running : 0;
+        stats->cpus[i].context_switches =
+            percpu_counter_read_cpu(&scheduler.context_switches, i);
+        stats->cpus[i].steals = percpu_counter_read_cpu(&scheduler.steals, i);
+        stats->cpus[i].stolen = percpu_counter_read_cpu(&scheduler.stolen, i);
+        stats->cpus[i].ipis = percpu_counter_read_cpu(&scheduler.ipis, i);
+        stats->cpus[i].preemptions =
+            percpu_counter_read_cpu(&scheduler.preemptions, i);
+
+        if (rq->online) {
+            stats->online_cpus++;
+            stats->running_processes += rq->nr_running;
+        }
+    }
 }
 
 /* ============================================================================
@@ -0,0 +1,23 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/proc/user_images.asm
+ * Description: User programs built into the kernel image
+ *
+ * The Makefile links each program in src/user before this file is
+ * assembled; main.c copies them into the ramfs at boot.
+ * ============================================================================ */
+
+include(`src/boot/macros.m4')
+
+    .section .rodata
+    .balign 8
+
+    .global user_hello_start
+    .global user_hello_end
+user_hello_start:
+    .incbin "build/user/hello.elf"
+user_hello_end:
+
+/* ============================================================================
+ * End of user_images.asm
+ * ============================================================================ */
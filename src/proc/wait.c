@@ -0,0 +1,181 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/proc/wait.c
+ * Description: Wait queues for processes blocked on a condition
+ * ============================================================================ */
+
+#include <aeos/wait.h>
+#include <aeos/process.h>
+#include <aeos/scheduler.h>
+#include <aeos/softirq.h>
+#include <aeos/spinlock.h>
+#include <aeos/timer.h>
+#include <aeos/types.h>
+
+/*
+ * Sleeping is scheduler_block_unless() on the waiter's woken flag, through
+ * timer_wait_until() when there is a deadline. The waker sets the flag
+ * and calls scheduler_wake() with the queue lock held, so the waiter
+ * cannot return from wait_finish() (and drop its stack frame) in between.
+ * A process can be woken for other reasons, so the flag and deadline are
+ * checked again after every wakeup.
+ */
+
+/**
+ * Initialize a wait queue (empty)
+ */
+void wait_queue_init(wait_queue_t *wq)
+{
+    spin_lock_init(&wq->lock);
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+/**
+ * Unlink a waiter (lock held)
+ */
+static void wait_unlink(wait_queue_t *wq, waiter_t *w)
+{
+    waiter_t *prev = NULL, *cur;
+
+    for (cur = wq->head; cur != NULL; prev = cur, cur = cur->next) {
+        if (cur != w) {
+            continue;
+        }
+        if (prev == NULL) {
+            wq->head = w->next;
+        } else {
+            prev->next = w->next;
+        }
+        if (wq->tail == w) {
+            wq->tail = prev;
+        }
+        break;
+    }
+    w->next = NULL;
+    w->queued = false;
+}
+
+/**
+ * Join a wait queue before checking the condition
+ */
+void wait_prepare(wait_queue_t *wq, waiter_t *w)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&wq->lock);
+    if (!w->queued) {
+        w->proc = process_current();
+        w->next = NULL;
+        w->queued = true;
+        if (wq->head == NULL) {
+            wq->head = w;
+        } else {
+            wq->tail->next = w;
+        }
+        wq->tail = w;
+    }
+    w->woken = false;
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * Sleep until woken or a deadline
+ */
+bool wait_sleep(waiter_t *w, uint64_t deadline_ns)
+{
+    uint64_t flags;
+
+    /* Nothing to block: wait on the flag instead */
+    if (w->proc == NULL || in_softirq()) {
+        while (!w->woken && timer_get_ns() < deadline_ns) {
+            __asm__ volatile("yield");
+        }
+        return w->woken;
+    }
+
+    if (deadline_ns == WAIT_FOREVER) {
+        flags = irq_save();
+        while (!w->woken) {
+            scheduler_block_unless(&w->woken);
+        }
+        irq_restore(flags);
+    } else {
+        while (!w->woken && timer_get_ns() < deadline_ns) {
+            timer_wait_until(deadline_ns, &w->woken);
+        }
+    }
+    return w->woken;
+}
+
+/**
+ * Leave a wait queue once the wait is over
+ */
+void wait_finish(wait_queue_t *wq, waiter_t *w)
+{
+    uint64_t flags;
+
+    flags = spin_lock_irqsave(&wq->lock);
+    if (w->queued) {
+        wait_unlink(wq, w);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * Take the oldest waiter off a queue and wake it (lock held)
+ */
+static bool wake_first_locked(wait_queue_t *wq)
+{
+    waiter_t *w = wq->head;
+
+    if (w == NULL) {
+        return false;
+    }
+
+    wq->head = w->next;
+    if (wq->head == NULL) {
+        wq->tail = NULL;
+    }
+    w->next = NULL;
+    w->queued = false;
+    w->woken = true;
+    if (w->proc != NULL) {
+        scheduler_wake(w->proc);
+    }
+    return true;
+}
+
+/**
+ * Wake every process on a queue
+ */
+uint32_t wake_up_all(wait_queue_t *wq)
+{
+    uint64_t flags;
+    uint32_t n = 0;
+
+    flags = spin_lock_irqsave(&wq->lock);
+    while (wake_first_locked(wq)) {
+        n++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return n;
+}
+
+/**
+ * Wake the longest-waiting process on a queue
+ */
+bool wake_up_one(wait_queue_t *wq)
+{
+    uint64_t flags;
+    bool woke;
+
+    flags = spin_lock_irqsave(&wq->lock);
+    woke = wake_first_locked(wq);
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woke;
+}
+
+/* ============================================================================
+ * End of wait.c
+ * ============================================================================ */
@@ -8,13 +8,49 @@
 #include <aeos/process.h>
 #include <aeos/scheduler.h>
 #include <aeos/kprintf.h>
-#include <aeos/uart.h>
+#include <aeos/timer.h>
+#include <aeos/mmu.h>
+#include <aeos/spinlock.h>
+#include <aeos/smp.h>
+#include <aeos/string.h>
+#include <aeos/trace.h>
+#include <aeos/percpu.h>
 #include <aeos/types.h>
 
+/*
+ * The dispatch path formats nothing. Each call bumps its own counter, adds
+ * its latency in counter ticks and drops it into a log2 histogram, all in
+ * the calling CPU's copy of the counters, so CPUs never take a lock or
+ * share a counter line; readers sum the copies. Tracing is off by default;
+ * when on, each CPU appends fixed-size records to its own ring with IRQs
+ * masked, and readers detect overwritten records the way logbuf does.
+ */
+
+#define TRACE_MASK          (SYSCALL_TRACE_RECORDS - 1)
+
+_Static_assert((SYSCALL_TRACE_RECORDS & TRACE_MASK) == 0,
+               "SYSCALL_TRACE_RECORDS must be a power of two");
+_Static_assert(sizeof(syscall_trace_rec_t) == 32,
+               "trace record must stay 32 bytes");
+
+/* One CPU's trace ring */
+typedef struct {
+    syscall_trace_rec_t recs[SYSCALL_TRACE_RECORDS];
+    uint64_t head;                      /* Records written since boot */
+    uint64_t tail;                      /* First record still wanted */
+} __attribute__((aligned(CACHE_LINE_SIZE))) trace_cpu_t;
+
+/* One CPU's counters */
+typedef struct {
+    syscall_stat_t calls[MAX_SYSCALLS];
+    uint64_t invalid;
+} PERCPU_ALIGNED syscall_cpu_t;
+
 /* System call statistics */
 static struct {
-    uint64_t total_syscalls;
-    uint64_t syscall_counts[MAX_SYSCALLS];
+    syscall_cpu_t cpus[MAX_CPUS];
+    trace_cpu_t trace[MAX_CPUS];
+    bool tracing;
 } syscall_stats;
 
 /* Forward declarations of syscall implementations
@@ -30,6 +66,8 @@ static uint64_t sys_getpid_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
                                  uint64_t arg3, uint64_t arg4, uint64_t arg5);
 static uint64_t sys_yield_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
                                 uint64_t arg3, uint64_t arg4, uint64_t arg5);
+static uint64_t sys_fork_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                               uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
 /* System call table - maps syscall numbers to function pointers */
 typedef uint64_t (*syscall_fn_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
@@ -40,9 +78,76 @@ static const syscall_fn_t syscall_table[MAX_SYSCALLS] = {
     [SYS_READ]   = sys_read_impl,
     [SYS_GETPID] = sys_getpid_impl,
     [SYS_YIELD]  = sys_yield_impl,
+    [SYS_FORK]   = sys_fork_impl,
     /* Other syscalls are NULL (not implemented yet) */
 };
 
+static const char *const syscall_names[MAX_SYSCALLS] = {
+    [SYS_EXIT]   = "exit",
+    [SYS_WRITE]  = "write",
+    [SYS_READ]   = "read",
+    [SYS_GETPID] = "getpid",
+    [SYS_YIELD]  = "yield",
+    [SYS_FORK]   = "fork",
+};
+
+/* ============================================================================
+ * Accounting and Tracing
+ * ============================================================================ */
+
+/**
+ * Histogram bucket for a latency: floor(log2(ticks)), 0 for 0 or 1
+ */
+static inline uint32_t latency_bucket(uint64_t ticks)
+{
+    uint32_t b;
+
+    if (ticks < 2) {
+        return 0;
+    }
+    b = 63 - (uint32_t)__builtin_clzll(ticks);
+    return b < SYSCALL_LAT_BUCKETS ? b : SYSCALL_LAT_BUCKETS - 1;
+}
+
+static void account(uint32_t num, uint64_t ticks)
+{
+    syscall_stat_t *st = &syscall_stats.cpus[smp_processor_id()].calls[num];
+
+    percpu_add(&st->calls, 1);
+    percpu_add(&st->ticks, ticks);
+    percpu_add(&st->hist[latency_bucket(ticks)], 1);
+}
+
+/**
+ * Append a record to this CPU's trace ring
+ */
+static void trace_record(uint32_t num, uint64_t start, uint64_t ticks,
+                         uint64_t arg0, uint64_t ret)
+{
+    process_t *proc = process_current();
+    syscall_trace_rec_t *rec;
+    trace_cpu_t *tc;
+    uint64_t flags, head;
+    uint32_t cpu;
+
+    flags = irq_save();
+    cpu = smp_processor_id();
+    tc = &syscall_stats.trace[cpu];
+    head = tc->head;
+
+    rec = &tc->recs[head & TRACE_MASK];
+    rec->start = start;
+    rec->arg0 = arg0;
+    rec->ret = ret;
+    rec->ticks = ticks > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (uint32_t)ticks;
+    rec->pid = proc ? (uint16_t)proc->pid : 0;
+    rec->num = (uint8_t)num;
+    rec->cpu = (uint8_t)cpu;
+    __atomic_store_n(&tc->head, head + 1, __ATOMIC_RELEASE);
+
+    irq_restore(flags);
+}
+
 /**
  * Initialize syscall subsystem
  */
@@ -51,10 +156,7 @@ void syscall_init(void)
     klog_info("Initializing system call subsystem...");
 
     /* Clear statistics */
-    syscall_stats.total_syscalls = 0;
-    for (int i = 0; i < MAX_SYSCALLS; i++) {
-        syscall_stats.syscall_counts[i] = 0;
-    }
+    memset(&syscall_stats, 0, sizeof(syscall_stats));
 
     klog_info("System call subsystem initialized");
     klog_info("  Implemented syscalls: exit, write, read, getpid, yield");
@@ -71,32 +173,228 @@ uint64_t syscall_handler(uint64_t syscall_num,
                          uint64_t arg0, uint64_t arg1, uint64_t arg2,
                          uint64_t arg3, uint64_t arg4, uint64_t arg5)
 {
-    kprintf("[syscall_handler] num=%u, args=(%lx,%lx,%lx,%lx,%lx,%lx)\n",
-            (uint32_t)syscall_num, arg0, arg1, arg2, arg3, arg4, arg5);
+    uint64_t start, ticks, ret;
+    uint32_t num;
 
-    /* Validate syscall number */
-    if (syscall_num >= MAX_SYSCALLS) {
-        klog_error("syscall_handler: Invalid syscall number %u", (uint32_t)syscall_num);
-        return (uint64_t)-1;  /* Return -1 for error */
+    /* Validate: bad numbers are counted, not logged */
+    if (syscall_num >= MAX_SYSCALLS || syscall_table[syscall_num] == NULL) {
+        percpu_add(&syscall_stats.cpus[smp_processor_id()].invalid, 1);
+        return (uint64_t)-1;
     }
+    num = (uint32_t)syscall_num;
 
-    /* Check if syscall is implemented */
-    if (syscall_table[syscall_num] == NULL) {
-        klog_error("syscall_handler: Unimplemented syscall %u", (uint32_t)syscall_num);
-        return (uint64_t)-1;
+    start = timer_get_counter();
+
+    TRACEPOINT(SYSCALL_ENTRY, num, arg0);
+
+    /* exit never comes back; account for it on the way in */
+    if (num == SYS_EXIT) {
+        account(num, 0);
+        if (syscall_stats.tracing) {
+            trace_record(num, start, 0, arg0, 0);
+        }
+        return syscall_table[num](arg0, arg1, arg2, arg3, arg4, arg5);
     }
 
-    /* Update statistics */
-    syscall_stats.total_syscalls++;
-    syscall_stats.syscall_counts[syscall_num]++;
+    ret = syscall_table[num](arg0, arg1, arg2, arg3, arg4, arg5);
 
-    /* Log syscall (debug only) */
-    klog_debug("syscall: %u from PID %u",
-               (uint32_t)syscall_num,
-               (uint32_t)process_current()->pid);
+    ticks = timer_get_counter() - start;
+    account(num, ticks);
+    if (syscall_stats.tracing) {
+        trace_record(num, start, ticks, arg0, ret);
+    }
+    TRACEPOINT(SYSCALL_EXIT, num, ret);
 
-    /* Dispatch to syscall implementation */
-    return syscall_table[syscall_num](arg0, arg1, arg2, arg3, arg4, arg5);
+    return ret;
+}
+
+/* ============================================================================
+ * Statistics and Trace API
+ * ============================================================================ */
+
+/**
+ * Name of a system call
+ */
+const char *syscall_name(uint32_t num)
+{
+    if (num >= MAX_SYSCALLS) {
+        return NULL;
+    }
+    return syscall_names[num];
+}
+
+/**
+ * Get dispatcher statistics
+ */
+void syscall_get_stats(syscall_stats_t *stats)
+{
+    trace_cpu_t *tc;
+    uint32_t i;
+
+    if (!stats) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < MAX_SYSCALLS; i++) {
+        stats->total += percpu_sum(&syscall_stats.cpus[0].calls[i].calls,
+                                   sizeof(syscall_cpu_t));
+    }
+    for (i = 0; i < MAX_CPUS; i++) {
+        tc = &syscall_stats.trace[i];
+        stats->traced += __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+    }
+    stats->invalid = percpu_sum(&syscall_stats.cpus[0].invalid,
+                                sizeof(syscall_cpu_t));
+    stats->tracing = syscall_stats.tracing;
+}
+
+/**
+ * Get one system call's count and latency histogram
+ */
+int syscall_get_stat(uint32_t num, syscall_stat_t *stat)
+{
+    const syscall_stat_t *first;
+    uint32_t b;
+
+    if (num >= MAX_SYSCALLS || !stat) {
+        return -1;
+    }
+
+    /* Fields are summed one at a time, so a racing call may show in only some */
+    first = &syscall_stats.cpus[0].calls[num];
+    stat->calls = percpu_sum(&first->calls, sizeof(syscall_cpu_t));
+    stat->ticks = percpu_sum(&first->ticks, sizeof(syscall_cpu_t));
+    for (b = 0; b < SYSCALL_LAT_BUCKETS; b++) {
+        stat->hist[b] = percpu_sum(&first->hist[b], sizeof(syscall_cpu_t));
+    }
+    return 0;
+}
+
+/**
+ * Latency at a percentile, from the histogram
+ */
+uint64_t syscall_stat_percentile(const syscall_stat_t *stat, uint32_t pct)
+{
+    uint64_t total = 0, want, seen = 0;
+    uint32_t b;
+
+    if (!stat || pct == 0) {
+        return 0;
+    }
+    if (pct > 100) {
+        pct = 100;
+    }
+
+    for (b = 0; b < SYSCALL_LAT_BUCKETS; b++) {
+        total += stat->hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    /* Rank of the wanted call, rounded up */
+    want = (total * pct + 99) / 100;
+    for (b = 0; b < SYSCALL_LAT_BUCKETS; b++) {
+        seen += stat->hist[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+    if (b >= SYSCALL_LAT_BUCKETS - 1) {
+        return ~0ULL;
+    }
+    return (2ULL << b) - 1;
+}
+
+/**
+ * Turn syscall tracing on or off
+ */
+void syscall_trace_set(bool on)
+{
+    syscall_stats.tracing = on;
+    __asm__ volatile("dmb ish" ::: "memory");
+}
+
+/**
+ * Forget the records traced so far
+ */
+void syscall_trace_clear(void)
+{
+    trace_cpu_t *tc;
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        tc = &syscall_stats.trace[cpu];
+        __atomic_store_n(&tc->tail, __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE),
+                         __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Replay held trace records in start order
+ */
+void syscall_trace_replay(syscall_trace_fn fn)
+{
+    syscall_trace_rec_t rec[MAX_CPUS];
+    uint64_t pos[MAX_CPUS], end[MAX_CPUS];
+    bool have[MAX_CPUS];
+    trace_cpu_t *tc;
+    uint64_t first;
+    uint32_t cpu, best;
+    bool found;
+
+    if (fn == NULL) {
+        return;
+    }
+
+    /* Only what is there now, and no older than the ring still holds */
+    for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+        tc = &syscall_stats.trace[cpu];
+        end[cpu] = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+        pos[cpu] = __atomic_load_n(&tc->tail, __ATOMIC_ACQUIRE);
+        if (end[cpu] - pos[cpu] > SYSCALL_TRACE_RECORDS) {
+            pos[cpu] = end[cpu] - SYSCALL_TRACE_RECORDS;
+        }
+        have[cpu] = false;
+    }
+
+    for (;;) {
+        found = false;
+        best = 0;
+
+        for (cpu = 0; cpu < MAX_CPUS; cpu++) {
+            tc = &syscall_stats.trace[cpu];
+
+            /* Copy the next record out, then check the writer hasn't lapped it */
+            while (!have[cpu] && pos[cpu] < end[cpu]) {
+                memcpy(&rec[cpu], &tc->recs[pos[cpu] & TRACE_MASK],
+                       sizeof(syscall_trace_rec_t));
+                __asm__ volatile("dmb ishld" ::: "memory");
+                first = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+                if (first > SYSCALL_TRACE_RECORDS &&
+                    first - SYSCALL_TRACE_RECORDS > pos[cpu]) {
+                    pos[cpu] = first - SYSCALL_TRACE_RECORDS;
+                    continue;
+                }
+                have[cpu] = true;
+            }
+
+            if (have[cpu] &&
+                (!found || (int64_t)(rec[cpu].start - rec[best].start) < 0)) {
+                best = cpu;
+                found = true;
+            }
+        }
+
+        if (!found) {
+            break;
+        }
+
+        have[best] = false;
+        pos[best]++;
+        fn(&rec[best]);
+    }
 }
 
 /* ============================================================================
@@ -144,36 +442,29 @@ static uint64_t sys_write_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
     const void *buf = (const void *)arg1;
     size_t count = (size_t)arg2;
     const char *str = (const char *)buf;
-    size_t i;
+    process_t *proc = process_current();
 
     (void)arg3; (void)arg4; (void)arg5;
 
-    /* DEBUG: Show syscall parameters */
-    kprintf("[sys_write] fd=%d, buf=%p, count=%u\n", fd, buf, (uint32_t)count);
-
     /* Validate arguments */
     if (buf == NULL) {
-        klog_error("sys_write: NULL buffer");
+        return (uint64_t)-1;
+    }
+
+    /* User programs may only pass their own memory */
+    if (proc != NULL && proc->mm != NULL &&
+        !mmu_user_range_ok((uint64_t)buf, count)) {
         return (uint64_t)-1;
     }
 
     /* For now, all file descriptors write to UART */
     /* In the future, we'll have a proper VFS layer */
     if (fd != STDOUT_FILENO && fd != STDERR_FILENO) {
-        klog_error("sys_write: Invalid fd %d", fd);
         return (uint64_t)-1;
     }
 
-    /* DEBUG: Show we passed validation */
-    kprintf("[sys_write] Validation passed, writing %u bytes\n", (uint32_t)count);
-
-    /* Write each character */
-    for (i = 0; i < count; i++) {
-        uart_putc(str[i]);
-    }
-
-    /* DEBUG: Confirm write complete */
-    kprintf("[sys_write] Write complete\n");
+    /* One console write for the whole buffer */
+    console_write(str, count);
 
     return count;  /* Return number of bytes written */
 }
@@ -212,8 +503,6 @@ static uint64_t sys_getpid_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
     (void)arg0; (void)arg1; (void)arg2;
     (void)arg3; (void)arg4; (void)arg5;
 
-    kprintf("[sys_getpid] proc=%p, proc->pid=%u\n", proc, (uint32_t)proc->pid);
-
     return proc->pid;
 }
 
@@ -234,6 +523,31 @@ static uint64_t sys_yield_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
     return 0;
 }
 
+/**
+ * sys_fork - Clone the calling user process
+ *
+ * The child shares the parent's pages copy-on-write and its fd table, and
+ * returns from this call with its own result.
+ *
+ * @param arg0-5 Unused
+ * @return Child's PID in the parent, 0 in the child, -1 on error
+ */
+static uint64_t sys_fork_impl(uint64_t arg0, uint64_t arg1, uint64_t arg2,
+                               uint64_t arg3, uint64_t arg4, uint64_t arg5)
+{
+    process_t *child;
+
+    (void)arg0; (void)arg1; (void)arg2;
+    (void)arg3; (void)arg4; (void)arg5;
+
+    child = process_clone();
+    if (child == NULL) {
+        return (uint64_t)-1;
+    }
+
+    return child->pid;
+}
+
 /* ============================================================================
  * Kernel-side syscall wrappers (for use within kernel code)
  * These just call the implementation directly without going through SVC
@@ -0,0 +1,87 @@
+/* ============================================================================
+ * AEOS - Abdalla's Educational Operating System
+ * File: src/user/hello.asm
+ * Description: Sample user program, installed as /bin/hello
+ *
+ * Runs at EL0 and talks to the kernel only through SVC. It touches 32KB
+ * of stack, well past the first page, so the demand-zero stack has to
+ * grow under it, and yields between writes.
+ * ============================================================================ */
+
+include(`src/boot/macros.m4')
+
+/* System call numbers (include/aeos/syscall.h) */
+.set SYS_EXIT,      0
+.set SYS_WRITE,     1
+.set SYS_YIELD,     4
+
+.set STACK_TOUCH,   (32 * 1024)
+
+    .section .text
+    .global _start
+    .balign 4
+_start:
+    /* Greeting */
+    mov x0, #1
+    adr x1, hello_msg
+    mov x2, #(hello_end - hello_msg)
+    mov x8, #SYS_WRITE
+    svc #0
+
+    /* Write one word into every page of STACK_TOUCH bytes of stack */
+    mov x19, sp
+    sub sp, sp, #STACK_TOUCH
+    mov x20, sp
+1:  str x20, [x20]
+    add x20, x20, #4096
+    cmp x20, x19
+    b.lo 1b
+
+    /* Every page reads back what was stored in it */
+    mov x20, sp
+2:  ldr x21, [x20]
+    cmp x21, x20
+    b.ne fail
+    add x20, x20, #4096
+    cmp x20, x19
+    b.lo 2b
+    mov sp, x19
+
+    mov x8, #SYS_YIELD
+    svc #0
+
+    mov x0, #1
+    adr x1, stack_msg
+    mov x2, #(stack_end - stack_msg)
+    mov x8, #SYS_WRITE
+    svc #0
+
+    mov x0, #0
+    mov x8, #SYS_EXIT
+    svc #0
+
+fail:
+    mov x0, #1
+    adr x1, fail_msg
+    mov x2, #(fail_end - fail_msg)
+    mov x8, #SYS_WRITE
+    svc #0
+
+    mov x0, #1
+    mov x8, #SYS_EXIT
+    svc #0
+
+    .section .rodata
+hello_msg:
+    .ascii "Hello from EL0!\n"
+hello_end:
+stack_msg:
+    .ascii "hello: 32KB of demand-zero stack OK\n"
+stack_end:
+fail_msg:
+    .ascii "hello: stack page lost its contents\n"
+fail_end:
+
+/* ============================================================================
+ * End of hello.asm
+ * ============================================================================ */